@@ -0,0 +1,88 @@
+#include "adaptive_sampling.h"
+#include <numeric>
+
+namespace ks
+{
+
+AdaptiveSamplingOptions load_adaptive_sampling_options(const ConfigArgs &args)
+{
+    AdaptiveSamplingOptions options;
+    options.min_spp = args.load_integer("min_spp", options.min_spp);
+    options.max_spp = args.load_integer("max_spp", options.max_spp);
+    options.spp_per_pass = args.load_integer("spp_per_pass", options.spp_per_pass);
+    options.error_threshold = args.load_float("error_threshold", options.error_threshold);
+    ASSERT(options.min_spp >= 2 && options.max_spp >= options.min_spp && options.spp_per_pass > 0,
+           "Invalid adaptive sampling options.");
+    return options;
+}
+
+AdaptiveScheduler::AdaptiveScheduler(int width, int height, const AdaptiveSamplingOptions &options,
+                                     const TileSchedulerOptions &tile_options)
+    : options(options), tiling(width, height, tile_options)
+{
+    tiles.resize(tiling.num_tiles());
+    std::iota(tiles.begin(), tiles.end(), 0);
+}
+
+int AdaptiveScheduler::next_pass_spp() const
+{
+    if (samples_taken < options.min_spp)
+        return options.min_spp - samples_taken;
+    return std::min(options.spp_per_pass, options.max_spp - samples_taken);
+}
+
+bool AdaptiveScheduler::update(const RenderTarget &rt)
+{
+    ASSERT(rt.has_statistics());
+    samples_taken += next_pass_spp();
+    if (samples_taken >= options.max_spp) {
+        tiles.clear();
+        return false;
+    }
+    return filter_tiles(rt);
+}
+
+bool AdaptiveScheduler::resume(const RenderTarget &rt, int samples_taken)
+{
+    ASSERT(rt.has_statistics());
+    this->samples_taken = samples_taken;
+    tiles.resize(tiling.num_tiles());
+    std::iota(tiles.begin(), tiles.end(), 0);
+    if (samples_taken >= options.max_spp) {
+        tiles.clear();
+        return false;
+    }
+    // Converged tiles never receive more samples, so filtering all tiles again reproduces the schedule.
+    if (samples_taken < options.min_spp)
+        return true;
+    return filter_tiles(rt);
+}
+
+bool AdaptiveScheduler::filter_tiles(const RenderTarget &rt)
+{
+    std::vector<uint8_t> keep(tiles.size());
+    parallel_for((int)tiles.size(), [&](int i) {
+        float max_error = 0.0f;
+        tiling.visit(tiles[i], [&](int x, int y) {
+            max_error = std::max(max_error, rt.stats[rt.index(x, y)].error());
+        });
+        keep[i] = max_error > options.error_threshold;
+    });
+    int m = 0;
+    for (int i = 0; i < (int)tiles.size(); ++i) {
+        if (keep[i])
+            tiles[m++] = tiles[i];
+    }
+    tiles.resize(m);
+    return !tiles.empty();
+}
+
+void AdaptiveScheduler::active_pixels(const RenderTarget &rt, std::vector<uint32_t> &pixels) const
+{
+    pixels.clear();
+    for (int tile : tiling.dispatch_order(tiles)) {
+        tiling.visit(tile, [&](int x, int y) { pixels.push_back(rt.index(x, y)); });
+    }
+}
+
+} // namespace ks
\ No newline at end of file
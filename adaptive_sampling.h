@@ -0,0 +1,74 @@
+#pragma once
+#include "config.h"
+#include "render_target.h"
+#include "tile_scheduler.h"
+#include <span>
+#include <vector>
+
+namespace ks
+{
+
+struct AdaptiveSamplingOptions
+{
+    int min_spp = 16;
+    int max_spp = 1024;
+    // Samples added to every unconverged pixel per pass (after the first min_spp).
+    int spp_per_pass = 16;
+    // A tile is converged once the error (see PixelStatistics::error) of all its pixels is below this.
+    float error_threshold = 0.01f;
+};
+
+AdaptiveSamplingOptions load_adaptive_sampling_options(const ConfigArgs &args);
+
+// Decides which tiles (see TileScheduler) still need samples after each pass.
+// All pixels of active tiles receive the same number of samples per pass.
+struct AdaptiveScheduler
+{
+    AdaptiveScheduler(int width, int height, const AdaptiveSamplingOptions &options,
+                      const TileSchedulerOptions &tile_options = {});
+
+    // Number of samples per pixel for the next pass.
+    int next_pass_spp() const;
+    // Call after a pass of next_pass_spp() samples. Returns false once every tile is converged or at max_spp.
+    // rt must have statistics enabled.
+    bool update(const RenderTarget &rt);
+    // Restore the schedule after samples_taken samples (e.g. from a checkpoint). Returns false if already done.
+    bool resume(const RenderTarget &rt, int samples_taken);
+
+    std::span<const int> active_tiles() const { return tiles; }
+    // Storage indices (see RenderTarget::index) of the pixels of active tiles, tile by tile in dispatch order.
+    void active_pixels(const RenderTarget &rt, std::vector<uint32_t> &pixels) const;
+
+    bool filter_tiles(const RenderTarget &rt);
+
+    AdaptiveSamplingOptions options;
+    TileScheduler tiling;
+    // Row-major indices of the active tiles of tiling.
+    std::vector<int> tiles;
+    int samples_taken = 0;
+};
+
+// sample_func(x, y, sample_index) -> color3 is called for every new sample of every pixel in active tiles.
+// The resolved mean ends up in rt.pixels.
+template <typename Func>
+void render_adaptive(RenderTarget &rt, const AdaptiveSamplingOptions &options, const Func &sample_func)
+{
+    rt.enable_statistics();
+    AdaptiveScheduler scheduler(rt.width, rt.height, options);
+    do {
+        int sample_begin = scheduler.samples_taken;
+        int sample_end = sample_begin + scheduler.next_pass_spp();
+        // Unconverged tiles tend to stay the expensive ones, so the timings of the last pass order the next one.
+        scheduler.tiling.run(scheduler.active_tiles(), [&](const Tile &tile) {
+            scheduler.tiling.visit(tile.index, [&](int x, int y) {
+                uint32_t pixel = rt.index(x, y);
+                for (int s = sample_begin; s < sample_end; ++s) {
+                    rt.add_sample(pixel, sample_func(x, y, s));
+                }
+            });
+        });
+    } while (scheduler.update(rt));
+    rt.resolve_statistics();
+}
+
+} // namespace ks
\ No newline at end of file
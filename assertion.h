@@ -103,6 +103,27 @@
     ASSERT_FATAL(false, "Unreachable code: %s: %s", __FILE__, __LINE__); \
   } while(false); \
 
+  // Modification: assertion tiers, selected at compile time with KS_ASSERT_LEVEL:
+  //   0: none
+  //   1: ASSERT_HOT (internal invariants of per-sample and per-ray code), the default
+  //   2: + ASSERT_PARANOID (checks in the innermost loops, e.g. every texel fetch)
+  // Plain ASSERT is not tiered and stays on for setup, config and asset loading. Disabled tiers still type-check their condition but never evaluate it.
+  #if !defined(KS_ASSERT_LEVEL)
+    #define KS_ASSERT_LEVEL 1
+  #endif
+  #define KS_ASSERT_DISABLED_(expression, ...) PPK_ASSERT_UNUSED(expression)
+  #define KS_ASSERT_DISABLED(...) PPK_ASSERT_APPLY_VA_ARGS(KS_ASSERT_DISABLED_, __VA_ARGS__, 0)
+  #if KS_ASSERT_LEVEL >= 1
+    #define ASSERT_HOT(...) ASSERT(__VA_ARGS__)
+  #else
+    #define ASSERT_HOT(...) KS_ASSERT_DISABLED(__VA_ARGS__)
+  #endif
+  #if KS_ASSERT_LEVEL >= 2
+    #define ASSERT_PARANOID(...) ASSERT(__VA_ARGS__)
+  #else
+    #define ASSERT_PARANOID(...) KS_ASSERT_DISABLED(__VA_ARGS__)
+  #endif
+
 
   #define PPK_ASSERT(...)                    PPK_ASSERT_(ppk::assert::implementation::AssertLevel::PPK_ASSERT_DEFAULT_LEVEL, __VA_ARGS__)
   #define PPK_ASSERT_WARNING(...)            PPK_ASSERT_(ppk::assert::implementation::AssertLevel::Warning, __VA_ARGS__)
@@ -0,0 +1,174 @@
+#include "asset_store.h"
+#include "hash.h"
+#include "stats.h"
+#include <algorithm>
+#include <cstring>
+
+namespace ks
+{
+
+static StatCounter stat_dedup_meshes("assets/dedup_meshes");
+static StatCounter stat_dedup_textures("assets/dedup_textures");
+static StatCounter stat_dedup_bytes("assets/dedup_bytes");
+
+template <typename T>
+static void hash_span(uint64_t &h, std::span<const T> s)
+{
+    uint64_t size = s.size();
+    h = hash_buffer(&size, sizeof(size), h);
+    h = hash_buffer(s.data(), s.size_bytes(), h);
+}
+
+template <typename T>
+static bool equal_span(std::span<const T> a, std::span<const T> b)
+{
+    return a.size() == b.size() && (a.empty() || !memcmp(a.data(), b.data(), a.size_bytes()));
+}
+
+static size_t mesh_bytes(const MeshData &mesh)
+{
+    size_t bytes = mesh.vertex_buffer().size_bytes() + mesh.texcoord_buffer().size_bytes() +
+                   mesh.vertex_normal_buffer().size_bytes() + mesh.index_buffer().size_bytes() +
+                   mesh.triangle_order_buffer().size_bytes() + mesh.packed.size() * sizeof(MeshData::PackedAttributes);
+    for (const std::vector<float> &step : mesh.motion_vertices)
+        bytes += step.size() * sizeof(float);
+    return bytes;
+}
+
+uint64_t content_hash(const MeshData &mesh)
+{
+    uint64_t h = hash(mesh.twosided, mesh.use_smooth_normal, mesh.packed_texcoord, mesh.packed_vertex_normal,
+                      mesh.packed_uv_min.x(), mesh.packed_uv_min.y(), mesh.packed_uv_extent.x(),
+                      mesh.packed_uv_extent.y());
+    hash_span(h, mesh.vertex_buffer());
+    hash_span(h, mesh.texcoord_buffer());
+    hash_span(h, mesh.vertex_normal_buffer());
+    hash_span(h, mesh.index_buffer());
+    hash_span(h, mesh.triangle_order_buffer());
+    hash_span(h, std::span<const MeshData::PackedAttributes>(mesh.packed));
+    for (const std::vector<float> &step : mesh.motion_vertices)
+        hash_span(h, std::span<const float>(step));
+    return h;
+}
+
+bool content_equal(const MeshData &a, const MeshData &b)
+{
+    if (a.twosided != b.twosided || a.use_smooth_normal != b.use_smooth_normal ||
+        a.packed_texcoord != b.packed_texcoord || a.packed_vertex_normal != b.packed_vertex_normal ||
+        a.packed_uv_min != b.packed_uv_min || a.packed_uv_extent != b.packed_uv_extent ||
+        a.motion_vertices.size() != b.motion_vertices.size())
+        return false;
+    if (!equal_span(a.vertex_buffer(), b.vertex_buffer()) || !equal_span(a.texcoord_buffer(), b.texcoord_buffer()) ||
+        !equal_span(a.vertex_normal_buffer(), b.vertex_normal_buffer()) ||
+        !equal_span(a.index_buffer(), b.index_buffer()) ||
+        !equal_span(a.triangle_order_buffer(), b.triangle_order_buffer()) ||
+        !equal_span(std::span<const MeshData::PackedAttributes>(a.packed),
+                    std::span<const MeshData::PackedAttributes>(b.packed)))
+        return false;
+    for (size_t i = 0; i < a.motion_vertices.size(); ++i) {
+        if (!equal_span(std::span<const float>(a.motion_vertices[i]), std::span<const float>(b.motion_vertices[i])))
+            return false;
+    }
+    return true;
+}
+
+// Mips are blocked, so gather a row of texels (without the block padding) before hashing/comparing it.
+static void gather_mip_row(const TextureMip &mip, int v, std::vector<std::byte> &row)
+{
+    int block = mip.block_size();
+    row.resize((size_t)mip.ures * mip.stride);
+    for (int u = 0; u < mip.ures; u += block) {
+        int n = std::min(block, mip.ures - u);
+        std::copy_n(mip.fetch_multi(u, v), (size_t)n * mip.stride, row.data() + (size_t)u * mip.stride);
+    }
+}
+
+static size_t texture_bytes(const Texture &texture)
+{
+    size_t bytes = 0;
+    for (const TextureMip &mip : texture.mips)
+        bytes += (size_t)mip.ures * mip.vres * mip.stride;
+    return bytes;
+}
+
+uint64_t content_hash(const Texture &texture)
+{
+    uint64_t h = hash(texture.width, texture.height, texture.num_channels, texture.data_type, texture.levels());
+    std::vector<std::byte> row;
+    for (const TextureMip &mip : texture.mips) {
+        for (int v = 0; v < mip.vres; ++v) {
+            gather_mip_row(mip, v, row);
+            h = hash_buffer(row.data(), row.size(), h);
+        }
+    }
+    return h;
+}
+
+bool content_equal(const Texture &a, const Texture &b)
+{
+    if (a.width != b.width || a.height != b.height || a.num_channels != b.num_channels ||
+        a.data_type != b.data_type || a.mips.size() != b.mips.size() || a.tiled || b.tiled)
+        return false;
+    std::vector<std::byte> row_a, row_b;
+    for (size_t l = 0; l < a.mips.size(); ++l) {
+        const TextureMip &mip_a = a.mips[l];
+        const TextureMip &mip_b = b.mips[l];
+        if (mip_a.ures != mip_b.ures || mip_a.vres != mip_b.vres || mip_a.stride != mip_b.stride)
+            return false;
+        for (int v = 0; v < mip_a.vres; ++v) {
+            gather_mip_row(mip_a, v, row_a);
+            gather_mip_row(mip_b, v, row_b);
+            if (row_a != row_b)
+                return false;
+        }
+    }
+    return true;
+}
+
+template <typename T>
+static std::shared_ptr<T> intern_in(std::mutex &mutex, AssetStore::Table<T> &table, std::shared_ptr<T> obj,
+                                    const StatCounter &stat_dedup, size_t bytes)
+{
+    // Hash outside the lock: it's the expensive part.
+    uint64_t key = content_hash(*obj);
+    std::scoped_lock lock(mutex);
+    std::vector<std::weak_ptr<T>> &bucket = table[key];
+    std::erase_if(bucket, [](const std::weak_ptr<T> &entry) { return entry.expired(); });
+    for (const std::weak_ptr<T> &entry : bucket) {
+        std::shared_ptr<T> stored = entry.lock();
+        if (stored && (stored == obj || content_equal(*stored, *obj))) {
+            if (stored != obj) {
+                stat_dedup.add();
+                stat_dedup_bytes.add(bytes);
+            }
+            return stored;
+        }
+    }
+    bucket.push_back(obj);
+    return obj;
+}
+
+std::shared_ptr<MeshData> AssetStore::intern(std::shared_ptr<MeshData> mesh)
+{
+    if (!mesh)
+        return mesh;
+    size_t bytes = mesh_bytes(*mesh);
+    return intern_in(mutex, meshes, std::move(mesh), stat_dedup_meshes, bytes);
+}
+
+std::shared_ptr<Texture> AssetStore::intern(std::shared_ptr<Texture> texture)
+{
+    // Tiled textures are paged in from their file and don't take memory for themselves.
+    if (!texture || texture->tiled)
+        return texture;
+    size_t bytes = texture_bytes(*texture);
+    return intern_in(mutex, textures, std::move(texture), stat_dedup_textures, bytes);
+}
+
+AssetStore &asset_store()
+{
+    static AssetStore store;
+    return store;
+}
+
+} // namespace ks
\ No newline at end of file
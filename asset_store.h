@@ -0,0 +1,39 @@
+#pragma once
+#include "geometry.h"
+#include "texture.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace ks
+{
+
+// Process-wide content-addressed store of imported meshes and textures. Assets that import identical data (e.g. kits
+// that reuse the same props and textures) get one shared copy back from intern(). The store only holds weak
+// references, so the data is freed with its last user.
+// NOTE: interned data is shared, so don't modify it afterwards (transform, compress etc. before interning).
+struct AssetStore
+{
+    // Thread-safe. Returns the stored copy of identical content, or stores and returns the argument.
+    std::shared_ptr<MeshData> intern(std::shared_ptr<MeshData> mesh);
+    std::shared_ptr<Texture> intern(std::shared_ptr<Texture> texture);
+
+    template <typename T>
+    using Table = std::unordered_map<uint64_t, std::vector<std::weak_ptr<T>>>;
+
+    std::mutex mutex;
+    Table<MeshData> meshes;
+    Table<Texture> textures;
+};
+
+AssetStore &asset_store();
+
+// Hash (with hash_buffer) and compare everything that's observable by rendering.
+uint64_t content_hash(const MeshData &mesh);
+uint64_t content_hash(const Texture &texture);
+bool content_equal(const MeshData &a, const MeshData &b);
+bool content_equal(const Texture &a, const Texture &b);
+
+} // namespace ks
\ No newline at end of file
@@ -2,49 +2,69 @@
 
 // Modified from pbrt.
 
+#include "assertion.h"
 #include "memory_util.h"
 #include "parallel.h"
 #include <algorithm>
+#include <array>
 #include <memory>
 #include <utility>
 
 namespace ks
 {
 
-template <typename T>
+// LogBlockSize and Stride can be fixed at compile time (dynamic_blocked_extent otherwise) so that indexing compiles
+// to shifts, masks and constant multiplies. It's the innermost operation of texture and sky map lookups.
+constexpr int dynamic_blocked_extent = -1;
+
+template <typename T, int LogBlockSize = dynamic_blocked_extent, int Stride = dynamic_blocked_extent>
 struct BlockedArray
 {
     ~BlockedArray()
     {
         int n_alloc = round_up(ures) * round_up(vres) * stride;
         std::destroy_n(data, n_alloc);
-        free_aligned(data);
+        if (allocator)
+            allocator->free(data);
+        else
+            free_aligned(data);
     }
 
     BlockedArray() = default;
 
-    BlockedArray(int ures, int vres, int stride, int log_block_size = 2)
-        : ures(ures), vres(vres), stride(stride), log_block_size(log_block_size)
+    // With an allocator (e.g. a PoolAllocator for short-lived texture tiles), the storage comes from it instead of
+    // alloc_aligned. Such storage is only 16-byte aligned and isn't interleaved over NUMA nodes.
+    BlockedArray(int ures, int vres, int stride, int log_block_size = 2, Allocator *allocator = nullptr)
+        : ures(ures), vres(vres), stride(static_or(Stride, stride)),
+          log_block_size(static_or(LogBlockSize, log_block_size)), allocator(allocator)
     {
-        ublocks = round_up(ures) >> log_block_size;
-        int n_alloc = round_up(ures) * round_up(vres) * stride;
+        ublocks = round_up(ures) >> log_block();
+        int n_alloc = round_up(ures) * round_up(vres) * this->stride;
         constexpr size_t cache_line = 64;
-        data = alloc_aligned<T>(n_alloc, cache_line);
+        if (allocator) {
+            data = reinterpret_cast<T *>(allocator->allocate(n_alloc * sizeof(T)));
+        } else {
+            data = alloc_aligned<T>(n_alloc, cache_line);
+            numa_interleave(data, n_alloc * sizeof(T));
+        }
         std::uninitialized_default_construct_n(data, n_alloc);
     }
 
     BlockedArray(int ures, int vres, int stride, const T *d, int log_block_size = 2, bool parallel_construct = false)
-        : ures(ures), vres(vres), stride(stride), log_block_size(log_block_size)
+        : ures(ures), vres(vres), stride(static_or(Stride, stride)),
+          log_block_size(static_or(LogBlockSize, log_block_size))
     {
-        ublocks = round_up(ures) >> log_block_size;
-        int n_alloc = round_up(ures) * round_up(vres) * stride;
+        ublocks = round_up(ures) >> log_block();
+        int n_alloc = round_up(ures) * round_up(vres) * this->stride;
         constexpr size_t cache_line = 64;
         data = alloc_aligned<T>(n_alloc, cache_line);
+        // Textures are read by every node.
+        numa_interleave(data, n_alloc * sizeof(T));
 
         auto loop_row = [&](int v) {
             for (int u = 0; u < ures; ++u)
                 for (int c = 0; c < stride; ++c)
-                    std::construct_at(&(*this)(u, v, c), d[(v * ures + u) * stride + c]);
+                    std::construct_at(&(*this)(u, v, c), d[(v * this->ures + u) * this->stride + c]);
         };
 
         if (!parallel_construct) {
@@ -57,12 +77,13 @@ struct BlockedArray
     }
 
     BlockedArray(const BlockedArray &other)
-        : ures(other.ures), vres(other.vres), stride(other.stride), ublocks(other.ublocks),
-          log_block_size(log_block_size)
+        : ures(other.ures), vres(other.vres), ublocks(other.ublocks), log_block_size(other.log_block_size),
+          stride(other.stride)
     {
-        int n_alloc = round_up(ures) * round_up(vres);
+        int n_alloc = round_up(ures) * round_up(vres) * stride;
         constexpr size_t cache_line = 64;
         data = alloc_aligned<T>(n_alloc, cache_line);
+        numa_interleave(data, n_alloc * sizeof(T));
         std::uninitialized_copy(other.data, other.data + n_alloc, data);
     }
 
@@ -75,6 +96,7 @@ struct BlockedArray
         swap(first.ublocks, second.ublocks);
         swap(first.log_block_size, second.log_block_size);
         swap(first.stride, second.stride);
+        swap(first.allocator, second.allocator);
     }
 
     BlockedArray(BlockedArray &&other) noexcept : BlockedArray() { swap(*this, other); }
@@ -85,25 +107,72 @@ struct BlockedArray
         return *this;
     }
 
-    int block_size() const { return 1 << log_block_size; }
+    static constexpr int static_or(int static_value, int value) { return static_value >= 0 ? static_value : value; }
+    int log_block() const
+    {
+        if constexpr (LogBlockSize >= 0)
+            return LogBlockSize;
+        else
+            return log_block_size;
+    }
+    int elem_stride() const
+    {
+        if constexpr (Stride >= 0)
+            return Stride;
+        else
+            return stride;
+    }
+
+    int block_size() const { return 1 << log_block(); }
     int round_up(int x) const { return (x + block_size() - 1) & ~(block_size() - 1); }
-    int block(int a) const { return a >> log_block_size; }
+    int block(int a) const { return a >> log_block(); }
     int offset(int a) const { return (a & (block_size() - 1)); }
 
+    // The stride can also be given at the call site (S must match stride).
+    template <int S = Stride>
+    int index(int u, int v) const
+    {
+        ASSERT_PARANOID(u >= 0 && u < ures && v >= 0 && v < vres, "BlockedArray index (%d, %d) out of range.", u, v);
+        int lb = log_block();
+        int i = (ublocks * block(v) + block(u)) << (2 * lb);
+        i += (offset(v) << lb) + offset(u);
+        return i * static_or(S, stride);
+    }
+
     const T &operator()(int u, int v, int c = 0) const
     {
-        int bu = block(u), bv = block(v);
-        int ou = offset(u), ov = offset(v);
-        int offset = block_size() * block_size() * (ublocks * bv + bu);
-        offset += block_size() * ov + ou;
-        return data[offset * stride + c];
+        ASSERT_PARANOID(c >= 0 && c < stride);
+        return data[index(u, v) + c];
     }
 
     T &operator()(int u, int v, int c = 0) { return const_cast<T &>(std::as_const(*this)(u, v, c)); }
 
-    const T *fetch_multi(int u, int v) const { return &(*this)(u, v, 0); }
+    template <int S = Stride>
+    const T *fetch_multi(int u, int v) const
+    {
+        return data + index<S>(u, v);
+    }
 
-    T *fetch_multi(int u, int v) { return const_cast<T *>(std::as_const(*this).fetch_multi(u, v)); }
+    template <int S = Stride>
+    T *fetch_multi(int u, int v)
+    {
+        return const_cast<T *>(std::as_const(*this).template fetch_multi<S>(u, v));
+    }
+
+    // The 2x2 footprint (u0, v0), (u1, v0), (u0, v1), (u1, v1) of a bilinear lookup. When the texels are adjacent and
+    // in the same block (the common case), only one address is computed.
+    template <int S = Stride>
+    std::array<const T *, 4> fetch_quad(int u0, int v0, int u1, int v1) const
+    {
+        int bm = block_size() - 1;
+        if (u1 == u0 + 1 && v1 == v0 + 1 && (u0 & bm) != bm && (v0 & bm) != bm) {
+            int s = static_or(S, stride);
+            const T *p = data + index<S>(u0, v0);
+            int row = s << log_block();
+            return {p, p + s, p + row, p + row + s};
+        }
+        return {fetch_multi<S>(u0, v0), fetch_multi<S>(u1, v0), fetch_multi<S>(u0, v1), fetch_multi<S>(u1, v1)};
+    }
 
     void copy_to_linear_array(T *a) const
     {
@@ -119,6 +188,8 @@ struct BlockedArray
     int ublocks = 0;
     int log_block_size = 2;
     int stride = 0;
+    // Null: alloc_aligned. Copies always use alloc_aligned.
+    Allocator *allocator = nullptr;
 };
 
 } // namespace ks
\ No newline at end of file
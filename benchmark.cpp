@@ -0,0 +1,496 @@
+#include "benchmark.h"
+#include "barray.h"
+#include "camera.h"
+#include "distrib.h"
+#include "embree_util.h"
+#include "image_util.h"
+#include "mesh_asset.h"
+#include "principled_bsdf.h"
+#include "render_target.h"
+#include "rng.h"
+#include "scene.h"
+#include "sobol.h"
+#include "stats.h"
+#include "texture.h"
+#include "wavefront.h"
+#include <fstream>
+#include <optional>
+
+namespace ks
+{
+
+// Inputs are generated once per benchmark so that the measured loops only contain the kernel.
+constexpr int bench_batch = 1024;
+
+static void print_result(const BenchmarkResult &r)
+{
+    printf("  %-36s %10.2f ns/item %14.0f items/s (%llu iterations)\n", r.name.c_str(), r.ns_per_item(),
+           r.items_per_second(), (unsigned long long)r.iterations);
+}
+
+static void benchmark_distrib(double min_time, std::vector<BenchmarkResult> &results)
+{
+    RNG rng(1);
+    std::vector<float> weights(1 << 16);
+    for (float &w : weights)
+        w = rng.next() * rng.next();
+    DistribTable table(weights.data(), (uint32_t)weights.size());
+    std::vector<float> weights_2d(512 * 256);
+    for (float &w : weights_2d)
+        w = rng.next() * rng.next();
+    DistribTable2D table_2d(weights_2d.data(), 512, 256);
+    AliasTable alias(weights.data(), (uint32_t)weights.size());
+    AliasTable2D alias_2d(weights_2d.data(), 512, 256);
+    std::vector<vec2> u(bench_batch);
+    for (vec2 &x : u)
+        x = rng.next2d();
+
+    results.push_back(run_benchmark("DistribTable::sample", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            float prob;
+            uint32_t index = table.sample(u[i].x(), prob);
+            do_not_optimize(index);
+            do_not_optimize(prob);
+        }
+    }));
+    results.push_back(run_benchmark("DistribTable::sample_linear", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            float pdf;
+            uint32_t index;
+            float x = table.sample_linear(u[i].x(), pdf, index);
+            do_not_optimize(x);
+            do_not_optimize(pdf);
+        }
+    }));
+    results.push_back(run_benchmark("DistribTable2D::sample_linear", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            float pdf;
+            vec2 x = table_2d.sample_linear(u[i], pdf);
+            do_not_optimize(x);
+            do_not_optimize(pdf);
+        }
+    }));
+    results.push_back(run_benchmark("AliasTable::sample", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            float prob;
+            uint32_t index = alias.sample(u[i].x(), prob);
+            do_not_optimize(index);
+            do_not_optimize(prob);
+        }
+    }));
+    results.push_back(run_benchmark("AliasTable2D::sample_linear", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            float pdf;
+            vec2 x = alias_2d.sample_linear(u[i], pdf);
+            do_not_optimize(x);
+            do_not_optimize(pdf);
+        }
+    }));
+}
+
+static void benchmark_sobol(double min_time, std::vector<BenchmarkResult> &results)
+{
+    RNG rng(2);
+    std::vector<int> idx(bench_batch), dim(bench_batch);
+    std::vector<uint32_t> seed(bench_batch);
+    for (int i = 0; i < bench_batch; ++i) {
+        idx[i] = (int)(rng.nextu32() & 0xffff);
+        dim[i] = (int)(rng.nextu32() % 64);
+        seed[i] = rng.nextu32();
+    }
+    std::vector<float> out(bench_batch);
+
+    results.push_back(run_benchmark("sobol_owen", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            float x = sobol_owen(idx[i], dim[i], seed[i], 1);
+            do_not_optimize(x);
+        }
+    }));
+    results.push_back(run_benchmark("sobol_owen_n", min_time, bench_batch, [&]() {
+        sobol_owen_n(idx, dim, seed, 1, out);
+        do_not_optimize(out[0]);
+    }));
+}
+
+static void benchmark_blocked_array(double min_time, std::vector<BenchmarkResult> &results)
+{
+    constexpr int res = 2048;
+    RNG rng(3);
+    std::vector<float> data(res * res * 3);
+    for (float &x : data)
+        x = rng.next();
+    BlockedArray<float> dynamic_array(res, res, 3, data.data());
+    BlockedArray<float, 2, 3> static_array(res, res, 3, data.data());
+    std::vector<std::array<int, 2>> coords(bench_batch);
+    for (auto &c : coords)
+        c = {(int)(rng.nextu32() % res), (int)(rng.nextu32() % res)};
+
+    results.push_back(run_benchmark("BlockedArray (dynamic extents)", min_time, bench_batch, [&]() {
+        for (const auto &c : coords) {
+            float x = dynamic_array(c[0], c[1], 1);
+            do_not_optimize(x);
+        }
+    }));
+    results.push_back(run_benchmark("BlockedArray (static extents)", min_time, bench_batch, [&]() {
+        for (const auto &c : coords) {
+            float x = static_array(c[0], c[1], 1);
+            do_not_optimize(x);
+        }
+    }));
+}
+
+static std::unique_ptr<Texture> synthetic_texture(int res)
+{
+    RNG rng(4);
+    std::vector<std::byte> bytes(res * res * 4);
+    for (std::byte &b : bytes)
+        b = (std::byte)(rng.nextu32() & 0xff);
+    return std::make_unique<Texture>(bytes.data(), res, res, 4, TextureDataType::u8, true);
+}
+
+static void benchmark_texture(double min_time, std::vector<BenchmarkResult> &results)
+{
+    std::unique_ptr<Texture> texture = synthetic_texture(1024);
+    RNG rng(5);
+    std::vector<vec2> uv(bench_batch);
+    for (vec2 &x : uv)
+        x = rng.next2d();
+    // About two texels per pixel, so that lookups blend two mip levels.
+    mat2 duvdxy = mat2::Identity() * (2.0f / 1024.0f);
+
+    LinearSampler linear;
+    CubicSampler cubic;
+    results.push_back(run_benchmark("LinearSampler", min_time, bench_batch, [&]() {
+        for (const vec2 &x : uv) {
+            color4 c = linear(*texture, x, duvdxy);
+            do_not_optimize(c);
+        }
+    }));
+    results.push_back(run_benchmark("CubicSampler", min_time, bench_batch, [&]() {
+        for (const vec2 &x : uv) {
+            color4 c = cubic(*texture, x, duvdxy);
+            do_not_optimize(c);
+        }
+    }));
+}
+
+static void benchmark_principled_bsdf(double min_time, std::vector<BenchmarkResult> &results)
+{
+    MicrofacetAdapterDerived<GGX> ggx;
+    RNG rng(6);
+    std::vector<PrincipledBSDF::Closure> closures(bench_batch);
+    std::vector<vec3> wo(bench_batch), wi(bench_batch);
+    std::vector<vec2> u(bench_batch);
+    for (int i = 0; i < bench_batch; ++i) {
+        PrincipledBSDF::Closure &c = closures[i];
+        c.basecolor = rng.next3d();
+        c.ax = c.ay = std::max(rng.next(), 0.01f);
+        c.metallic = rng.next();
+        c.ior = 1.0f + rng.next();
+        c.specular_trans = rng.next();
+        c.microfacet = &ggx;
+        wo[i] = sample_cosine_hemisphere(rng.next2d());
+        wi[i] = sample_uniform_sphere(rng.next2d());
+        u[i] = rng.next2d();
+    }
+
+    results.push_back(run_benchmark("PrincipledBSDF::eval", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            color3 f = PrincipledBSDF::internal::eval(wo[i], wi[i], closures[i]);
+            do_not_optimize(f);
+        }
+    }));
+    results.push_back(run_benchmark("PrincipledBSDF::sample", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            vec3 w;
+            float pdf;
+            color3 beta = PrincipledBSDF::internal::sample(wo[i], w, closures[i], u[i], pdf);
+            do_not_optimize(beta);
+            do_not_optimize(pdf);
+        }
+    }));
+}
+
+static void benchmark_spawn_ray(double min_time, std::vector<BenchmarkResult> &results)
+{
+    RNG rng(7);
+    std::vector<vec3> p(bench_batch), dir(bench_batch), ng(bench_batch);
+    std::vector<vec2> film_pos(bench_batch);
+    for (int i = 0; i < bench_batch; ++i) {
+        p[i] = 100.0f * rng.next3d();
+        dir[i] = sample_uniform_sphere(rng.next2d());
+        ng[i] = sample_uniform_sphere(rng.next2d());
+        film_pos[i] = rng.next2d();
+    }
+    Camera camera(vec3(0.0f, 0.0f, 5.0f), vec3::Zero(), vec3(0.0f, 1.0f, 0.0f), to_radian(45.0f), 1.0f);
+    CameraRaySetup setup = camera.ray_setup(vec2i(1024, 1024), 1);
+
+    results.push_back(run_benchmark("spawn_ray (surface)", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            Ray ray = spawn_ray<OffsetType::NextBounce>(p[i], dir[i], ng[i], 0.0f, inf);
+            do_not_optimize(ray);
+        }
+    }));
+    results.push_back(run_benchmark("CameraRaySetup::spawn_ray", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            Ray ray = setup.spawn_ray(film_pos[i]);
+            do_not_optimize(ray);
+        }
+    }));
+}
+
+// A res x res height field of random bumps over [0, 1]^2.
+static std::unique_ptr<MeshAsset> synthetic_mesh(int res)
+{
+    RNG rng(8);
+    auto mesh = std::make_unique<MeshData>();
+    int n_verts = (res + 1) * (res + 1);
+    mesh->vertices.reserve(3 * n_verts + 1);
+    mesh->texcoords.reserve(2 * n_verts + 2);
+    mesh->vertex_normals.reserve(3 * n_verts + 1);
+    for (int y = 0; y <= res; ++y) {
+        for (int x = 0; x <= res; ++x) {
+            vec2 uv((float)x / (float)res, (float)y / (float)res);
+            mesh->vertices.insert(mesh->vertices.end(), {uv.x(), uv.y(), 0.01f * rng.next()});
+            mesh->texcoords.insert(mesh->texcoords.end(), {uv.x(), uv.y()});
+            mesh->vertex_normals.insert(mesh->vertex_normals.end(), {0.0f, 0.0f, 1.0f});
+        }
+    }
+    mesh->vertices.push_back(0.0f);
+    mesh->texcoords.insert(mesh->texcoords.end(), {0.0f, 0.0f});
+    mesh->vertex_normals.push_back(0.0f);
+    for (int y = 0; y < res; ++y) {
+        for (int x = 0; x < res; ++x) {
+            uint32_t v00 = y * (res + 1) + x;
+            uint32_t v10 = v00 + 1;
+            uint32_t v01 = v00 + res + 1;
+            uint32_t v11 = v01 + 1;
+            mesh->indices.insert(mesh->indices.end(), {v00, v10, v11, v00, v11, v01});
+        }
+    }
+    auto asset = std::make_unique<MeshAsset>();
+    asset->meshes.push_back(std::move(mesh));
+    asset->mesh_names.push_back("height_field");
+    return asset;
+}
+
+static void benchmark_embree(double min_time, std::vector<BenchmarkResult> &results)
+{
+    std::unique_ptr<MeshAsset> asset = synthetic_mesh(512);
+    EmbreeDevice device;
+    Scene scene = create_scene_from_mesh_asset(*asset, device);
+
+    RNG rng(9);
+    std::vector<Ray> rays(bench_batch);
+    for (Ray &ray : rays) {
+        vec3 origin(rng.next(), rng.next(), 1.0f);
+        vec3 target(rng.next(), rng.next(), 0.0f);
+        ray = Ray(origin, (target - origin).normalized(), 0.0f, inf);
+    }
+    std::vector<SceneHit> hits(bench_batch);
+    std::vector<uint8_t> found(bench_batch);
+
+    results.push_back(run_benchmark("Scene::intersect1 (HitRecord)", min_time, bench_batch, [&]() {
+        for (const Ray &ray : rays) {
+            HitRecord record;
+            bool hit = scene.intersect1(ray, record);
+            do_not_optimize(hit);
+            do_not_optimize(record);
+        }
+    }));
+    results.push_back(run_benchmark("Scene::intersect1 (SceneHit)", min_time, bench_batch, [&]() {
+        for (int i = 0; i < bench_batch; ++i) {
+            bool hit = scene.intersect1(rays[i], hits[i]);
+            do_not_optimize(hit);
+        }
+    }));
+    results.push_back(run_benchmark("Scene::intersect_stream", min_time, bench_batch, [&]() {
+        scene.intersect_stream(rays, hits, found);
+        do_not_optimize(found[0]);
+    }));
+    results.push_back(run_benchmark("Scene::occlude_stream", min_time, bench_batch, [&]() {
+        scene.occlude_stream(rays, found);
+        do_not_optimize(found[0]);
+    }));
+}
+
+// Round trips through the binary formats. Items are bytes on disk.
+static void benchmark_serialization(double min_time, const fs::path &task_dir, std::vector<BenchmarkResult> &results)
+{
+    fs::path texture_path = task_dir / "benchmark_texture.bin";
+    std::unique_ptr<Texture> texture = synthetic_texture(1024);
+    write_texture_to_serialized(*texture, texture_path);
+    double texture_bytes = (double)fs::file_size(texture_path);
+    results.push_back(run_benchmark("write_texture_to_serialized", min_time, texture_bytes,
+                                    [&]() { write_texture_to_serialized(*texture, texture_path); }));
+    results.push_back(run_benchmark("create_texture_from_serialized", min_time, texture_bytes, [&]() {
+        std::unique_ptr<Texture> loaded = create_texture_from_serialized(texture_path);
+        do_not_optimize(loaded);
+    }));
+    fs::remove(texture_path);
+
+    fs::path mesh_path = task_dir / "benchmark_mesh.bin";
+    std::unique_ptr<MeshAsset> asset = synthetic_mesh(512);
+    asset->write_to_binary(mesh_path);
+    double mesh_bytes = (double)fs::file_size(mesh_path);
+    results.push_back(run_benchmark("MeshAsset::write_to_binary", min_time, mesh_bytes,
+                                    [&]() { asset->write_to_binary(mesh_path); }));
+    // NOTE: binary meshes are memory-mapped, so this measures the mapping and validation, not reading every page.
+    results.push_back(run_benchmark("MeshAsset::load_from_binary", min_time, mesh_bytes, [&]() {
+        MeshAsset loaded;
+        loaded.load_from_binary(mesh_path);
+        do_not_optimize(loaded.meshes[0]->vertex_buffer()[0]);
+    }));
+    fs::remove(mesh_path);
+}
+
+struct SceneStep
+{
+    int spp;
+    double seconds;
+    uint64_t rays;
+    double rmse;
+};
+
+struct SceneResult
+{
+    std::string name;
+    std::vector<SceneStep> steps;
+    std::optional<double> target_rmse;
+    // Of the first step at or below target_rmse.
+    std::optional<double> time_to_target;
+};
+
+static double rmse(const RenderTarget &rt, const float *reference)
+{
+    std::vector<color3> pixels = rt.linear_pixels();
+    double sum = 0.0;
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        for (int c = 0; c < 3; ++c) {
+            double d = (double)pixels[i][c] - (double)reference[3 * i + c];
+            sum += d * d;
+        }
+    }
+    return std::sqrt(sum / (3.0 * (double)pixels.size()));
+}
+
+static uint64_t rays_traced()
+{
+    StatsRegistry &registry = stats_registry();
+    return registry.counter_value("scene/intersect1") + registry.counter_value("scene/occlude1") +
+           registry.counter_value("scene/intersect_stream_rays") + registry.counter_value("scene/occlude_stream_rays");
+}
+
+static SceneResult benchmark_scene(const ConfigArgs &args, const fs::path &task_dir)
+{
+    SceneResult result;
+    result.name = args.load_string("name");
+    std::unique_ptr<WavefrontTask> task = load_wavefront_task(args, task_dir);
+    ASSERT(!task->options.adaptive && !task->options.progressive && !task->options.distributed,
+           "Benchmark scenes must have a fixed sample count.");
+
+    int ref_width, ref_height;
+    std::unique_ptr<float[]> reference = load_from_exr(args.load_path("reference"), 3, ref_width, ref_height);
+    ASSERT(ref_width == task->width && ref_height == task->height, "Reference of [%s] has a different resolution.",
+           result.name.c_str());
+    if (args.contains("target_rmse")) {
+        result.target_rmse = args.load_float("target_rmse");
+    }
+
+    printf("Scene [%s]:\n", result.name.c_str());
+    ConfigArgs spp_steps = args["spp_steps"];
+    for (int i = 0; i < (int)spp_steps.array_size(); ++i) {
+        SceneStep step;
+        step.spp = spp_steps.load_integer(i);
+        task->options.spp = step.spp;
+        RenderTarget rt(task->width, task->height, color3::Zero(), task->tile_size);
+        uint64_t rays_before = rays_traced();
+        auto start = std::chrono::steady_clock::now();
+        task->render(rt);
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        step.seconds = duration.count();
+        step.rays = rays_traced() - rays_before;
+        step.rmse = rmse(rt, reference.get());
+        printf("  %6d spp %10.3f sec %14.0f rays/s  RMSE %.6f\n", step.spp, step.seconds,
+               (double)step.rays / step.seconds, step.rmse);
+        if (result.target_rmse && !result.time_to_target && step.rmse <= *result.target_rmse) {
+            result.time_to_target = step.seconds;
+        }
+        result.steps.push_back(step);
+    }
+    return result;
+}
+
+static void write_benchmark_json(const fs::path &path, const std::vector<BenchmarkResult> &kernels,
+                                 const std::vector<SceneResult> &scenes)
+{
+    std::ofstream out(path);
+    out << "{\n  \"kernels\": [";
+    for (size_t i = 0; i < kernels.size(); ++i) {
+        const BenchmarkResult &r = kernels[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+            << ", \"seconds\": " << r.seconds << ", \"items_per_iteration\": " << r.items_per_iteration
+            << ", \"ns_per_item\": " << r.ns_per_item() << ", \"items_per_second\": " << r.items_per_second() << "}";
+    }
+    out << "\n  ],\n  \"scenes\": [";
+    for (size_t i = 0; i < scenes.size(); ++i) {
+        const SceneResult &s = scenes[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << s.name << "\"";
+        if (s.target_rmse) {
+            out << ", \"target_rmse\": " << *s.target_rmse << ", \"time_to_target_rmse\": ";
+            if (s.time_to_target) {
+                out << *s.time_to_target;
+            } else {
+                out << "null";
+            }
+        }
+        out << ", \"steps\": [";
+        for (size_t j = 0; j < s.steps.size(); ++j) {
+            const SceneStep &step = s.steps[j];
+            out << (j ? ", " : "") << "{\"spp\": " << step.spp << ", \"seconds\": " << step.seconds
+                << ", \"rays\": " << step.rays << ", \"rays_per_second\": " << (double)step.rays / step.seconds
+                << ", \"rmse\": " << step.rmse << "}";
+        }
+        out << "]}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void run_benchmark_task(const ConfigArgs &args, const fs::path &task_dir, int task_id)
+{
+    double min_time = args.load_float("min_time", 0.2f);
+
+    std::vector<BenchmarkResult> kernels;
+    if (args.load_bool("kernels", true)) {
+        printf("Kernels:\n");
+        auto run = [&](auto benchmark) {
+            size_t first = kernels.size();
+            benchmark();
+            for (size_t i = first; i < kernels.size(); ++i)
+                print_result(kernels[i]);
+        };
+        run([&]() { benchmark_distrib(min_time, kernels); });
+        run([&]() { benchmark_sobol(min_time, kernels); });
+        run([&]() { benchmark_blocked_array(min_time, kernels); });
+        run([&]() { benchmark_texture(min_time, kernels); });
+        run([&]() { benchmark_principled_bsdf(min_time, kernels); });
+        run([&]() { benchmark_spawn_ray(min_time, kernels); });
+        run([&]() { benchmark_embree(min_time, kernels); });
+        run([&]() { benchmark_serialization(min_time, task_dir, kernels); });
+    }
+
+    std::vector<SceneResult> scenes;
+    if (args.contains("scenes")) {
+#if !KS_ENABLE_STATS
+        printf("Stats are compiled out (KS_ENABLE_STATS=0): ray counts will be zero.\n");
+#endif
+        int n_scenes = (int)args["scenes"].array_size();
+        for (int i = 0; i < n_scenes; ++i) {
+            scenes.push_back(benchmark_scene(args["scenes"][i], task_dir));
+        }
+    }
+
+    write_benchmark_json(task_dir / "benchmark.json", kernels, scenes);
+}
+
+} // namespace ks
\ No newline at end of file
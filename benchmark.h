@@ -0,0 +1,74 @@
+#pragma once
+#include "config.h"
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+namespace fs = std::filesystem;
+
+namespace ks
+{
+
+// Keeps the computation of value alive without otherwise constraining the optimizer.
+template <typename T>
+inline void do_not_optimize(const T &value)
+{
+#if defined(_MSC_VER)
+    static const volatile void *sink;
+    sink = &value;
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : "m"(value) : "memory");
+#endif
+}
+
+struct BenchmarkResult
+{
+    double ns_per_item() const { return seconds * 1e9 / ((double)iterations * items_per_iteration); }
+    double items_per_second() const { return (double)iterations * items_per_iteration / seconds; }
+
+    std::string name;
+    uint64_t iterations = 0;
+    double seconds = 0.0;
+    // E.g. the number of lookups in one call of the benchmarked function.
+    double items_per_iteration = 1.0;
+};
+
+// Calls func in batches of doubling size until one batch takes at least min_seconds, and reports that batch.
+template <typename Func>
+BenchmarkResult run_benchmark(std::string name, double min_seconds, double items_per_iteration, const Func &func)
+{
+    BenchmarkResult result;
+    result.name = std::move(name);
+    result.items_per_iteration = items_per_iteration;
+    // Warm up caches (and lazily built tables).
+    func();
+    for (uint64_t iterations = 1;; iterations *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            func();
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        result.iterations = iterations;
+        result.seconds = duration.count();
+        if (result.seconds >= min_seconds) {
+            return result;
+        }
+    }
+}
+
+// Micro-benchmarks of the hot kernels (sampling tables, sobol, texture filtering, BSDFs, ray spawning, embree
+// queries, asset serialization) on synthetic data, and end-to-end wavefront renders of reference scenes that report
+// rays per second and the RMSE reached over time against a reference image. Results go to task_dir/benchmark.json.
+//
+// min_time = 0.2       # seconds per kernel measurement
+// kernels = true
+// [[scenes]]           # same arguments as render_wavefront_task, plus:
+// name = "..."
+// reference = "..."    # converged EXR of the same resolution
+// spp_steps = [...]    # one render per entry
+// target_rmse = ...    # optional: reports the time of the first step at or below it
+void run_benchmark_task(const ConfigArgs &args, const fs::path &task_dir, int task_id);
+
+} // namespace ks
\ No newline at end of file
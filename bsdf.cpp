@@ -1,4 +1,5 @@
 #include "bsdf.h"
+#include "memory_util.h"
 #include "principled_bsdf.h"
 #include "rng.h"
 
@@ -10,6 +11,65 @@ std::pair<color3, float> BSDF::eval_and_pdf(const vec3 &wo, const vec3 &wi, cons
     return {eval(wo, wi, it), pdf(wo, wi, it)};
 }
 
+namespace
+{
+
+struct ForwardingClosure : public BSDFClosure
+{
+    ForwardingClosure(const BSDF &bsdf, const Intersection &it) : bsdf(&bsdf), it(&it) {}
+
+    bool delta() const { return bsdf->delta(); }
+    color3 eval(const vec3 &wo, const vec3 &wi) const { return bsdf->eval(wo, wi, *it); }
+    color3 sample(const vec3 &wo, vec3 &wi, const vec2 &u, float &pdf) const
+    {
+        return bsdf->sample(wo, wi, *it, u, pdf);
+    }
+    float pdf(const vec3 &wo, const vec3 &wi) const { return bsdf->pdf(wo, wi, *it); }
+    std::pair<color3, float> eval_and_pdf(const vec3 &wo, const vec3 &wi) const
+    {
+        return bsdf->eval_and_pdf(wo, wi, *it);
+    }
+
+    const BSDF *bsdf;
+    const Intersection *it;
+};
+
+struct LambertianClosure : public BSDFClosure
+{
+    bool delta() const { return false; }
+    color3 eval(const vec3 &wo, const vec3 &wi) const
+    {
+        if (wo.z() <= 0.0f || wi.z() <= 0.0f)
+            return color3::Zero();
+        return inv_pi * albedo * wi.z();
+    }
+    color3 sample(const vec3 &wo, vec3 &wi, const vec2 &u, float &pdf) const
+    {
+        if (wo.z() <= 0.0f) {
+            pdf = 0.0f;
+            return color3::Zero();
+        }
+        wi = sample_cosine_hemisphere(u);
+        pdf = wi.z() * inv_pi;
+        return albedo;
+    }
+    float pdf(const vec3 &wo, const vec3 &wi) const
+    {
+        if (wo.z() <= 0.0f || wi.z() <= 0.0f)
+            return 0.0f;
+        return wi.z() * inv_pi;
+    }
+
+    color3 albedo;
+};
+
+} // namespace
+
+const BSDFClosure *BSDF::closure(const Intersection &it, Allocator &arena) const
+{
+    return arena.allocate_typed<ForwardingClosure>(*this, it);
+}
+
 color3 Lambertian::eval(const vec3 &wo, const vec3 &wi, const Intersection &it) const
 {
     if (wo.z() <= 0.0f || wi.z() <= 0.0f)
@@ -39,6 +99,13 @@ float Lambertian::pdf(const vec3 &wo, const vec3 &wi, const Intersection &it) co
     return wi.z() * inv_pi;
 }
 
+const BSDFClosure *Lambertian::closure(const Intersection &it, Allocator &arena) const
+{
+    LambertianClosure *closure = arena.allocate_typed<LambertianClosure>();
+    closure->albedo = clamp((*albedo)(it), color3::Zero(), color3::Ones());
+    return closure;
+}
+
 std::unique_ptr<Lambertian> create_lambertian(const ConfigArgs &args)
 {
     std::unique_ptr<ShaderField3> albedo =
@@ -6,6 +6,32 @@
 namespace ks
 {
 
+class Allocator;
+struct BSDFEvalBatch;
+
+// Per-hit BSDF with all shader fields already evaluated, so that repeated queries at the same intersection (e.g. NEE
+// followed by BSDF sampling) don't re-fetch textures.
+// NOTE: closures are allocated from a scratch arena and never destroyed. Keep them trivially destructible.
+struct BSDFClosure
+{
+    virtual bool delta() const = 0;
+    // NOTE: return cosine-weighted bsdf: f*cos(theta_i)
+    virtual color3 eval(const vec3 &wo, const vec3 &wi) const = 0;
+    // NOTE: return cosine-weighted throughput weight: (f*cos(theta_i) / pdf)
+    virtual color3 sample(const vec3 &wo, vec3 &wi, const vec2 &u, float &pdf) const = 0;
+    virtual float pdf(const vec3 &wo, const vec3 &wi) const = 0;
+    virtual std::pair<color3, float> eval_and_pdf(const vec3 &wo, const vec3 &wi) const
+    {
+        return {eval(wo, wi), pdf(wo, wi)};
+    }
+    // Queues eval_and_pdf(wo, wi) into batch instead of evaluating it. Returns false if the closure has no batched
+    // evaluation.
+    virtual bool queue_eval(const vec3 &wo, const vec3 &wi, BSDFEvalBatch &batch) const { return false; }
+
+  protected:
+    ~BSDFClosure() = default;
+};
+
 struct BSDF : public Configurable
 {
     virtual ~BSDF() = default;
@@ -17,6 +43,10 @@ struct BSDF : public Configurable
     virtual float pdf(const vec3 &wo, const vec3 &wi, const Intersection &it) const = 0;
     // NOTE: MIS usually requires these together. This provides room of optimization for implementations.
     virtual std::pair<color3, float> eval_and_pdf(const vec3 &wo, const vec3 &wi, const Intersection &it) const;
+
+    // Evaluate the closure at it once. The result is allocated from arena and stays valid until the arena is reset.
+    // The default just forwards to the methods above (it must then outlive the closure).
+    virtual const BSDFClosure *closure(const Intersection &it, Allocator &arena) const;
 };
 
 struct Lambertian : public BSDF
@@ -31,6 +61,7 @@ struct Lambertian : public BSDF
     // NOTE: return cosine-weighted throughput weight: (f*cos(theta_i) / pdf)
     color3 sample(const vec3 &wo, vec3 &wi, const Intersection &it, const vec2 &u, float &pdf) const;
     float pdf(const vec3 &wo, const vec3 &wi, const Intersection &it) const;
+    const BSDFClosure *closure(const Intersection &it, Allocator &arena) const;
 
     std::unique_ptr<ShaderField<color3>> albedo;
 };
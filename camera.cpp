@@ -1,5 +1,9 @@
 #include "camera.h"
+#include "assertion.h"
 #include "config.h"
+#include "distrib.h"
+#include "image_util.h"
+#include "rng.h"
 
 namespace ks
 {
@@ -120,46 +124,145 @@ Camera::Camera(const vec3 &position, const vec3 &target, const vec3 &up, float l
     camera_to_world = Transform(camera_to_world_m);
 }
 
-Ray Camera::spawn_ray(const vec2 &film_pos, const vec2i &film_res, int spp) const
+vec2 ThinLens::sample_aperture(const vec2 &u) const
 {
-    Ray ray;
-    vec3 ndc_pos(film_pos.x() * 2.0f - 1.0f, film_pos.y() * 2.0f - 1.0f, 1.0f);
+    if (aperture_map) {
+        float pdf;
+        vec2 p = aperture_map->sample_linear(u, pdf);
+        // Image rows go top to bottom.
+        return vec2(2.0f * p.x() - 1.0f, 1.0f - 2.0f * p.y());
+    }
+    if (blades < 3) {
+        return sample_disk(u);
+    }
+    // Pick a blade triangle (center, v0, v1) and sample it uniformly.
+    float x = u.x() * (float)blades;
+    int k = std::min((int)x, blades - 1);
+    float u0 = x - (float)k;
+    float wedge = two_pi / (float)blades;
+    float phi0 = blade_rotation + wedge * (float)k;
+    vec2 v0(std::cos(phi0), std::sin(phi0));
+    vec2 v1(std::cos(phi0 + wedge), std::sin(phi0 + wedge));
+    float s = std::sqrt(u0);
+    return s * ((1.0f - u.y()) * v0 + u.y() * v1);
+}
 
+CameraRaySetup Camera::ray_setup(const vec2i &film_res, int spp) const
+{
+    CameraRaySetup setup;
     vec3 mid = proj_to_camera.point_hdiv(vec3(0.0f, 0.0f, 1.0f));
     vec3 right = proj_to_camera.point_hdiv(vec3(2.0f / film_res.x(), 0.0f, 1.0f));
     vec3 up = proj_to_camera.point_hdiv(vec3(0.0f, 2.0f / film_res.y(), 1.0f));
-    vec3 camera_dx = right - mid;
-    camera_dx = camera_to_world.direction(camera_dx);
-    vec3 camera_dy = up - mid;
-    camera_dy = camera_to_world.direction(camera_dy);
+    setup.pixel_dx = camera_to_world.direction(right - mid);
+    setup.pixel_dy = camera_to_world.direction(up - mid);
+    setup.diff_scale = 1.0f / std::sqrt((float)spp);
+
+    // NOTE: w is constant over the near plane (ndc z = 1) for both projections we build, so this is exact.
+    vec3 p00 = proj_to_world.point_hdiv(vec3(-1.0f, -1.0f, 1.0f));
+    vec3 p10 = proj_to_world.point_hdiv(vec3(1.0f, -1.0f, 1.0f));
+    vec3 p01 = proj_to_world.point_hdiv(vec3(-1.0f, 1.0f, 1.0f));
+    setup.film_origin = p00;
+    setup.film_du = p10 - p00;
+    setup.film_dv = p01 - p00;
+
+    setup.position = position();
+    setup.ortho_dir = direction();
+    setup.orthographic = orthographic;
+
+    setup.lens = lens;
+    setup.lens_right = camera_to_world.direction(vec3::UnitX()).normalized();
+    setup.lens_up = camera_to_world.direction(vec3::UnitY()).normalized();
+    setup.forward = setup.ortho_dir;
+    return setup;
+}
 
+Ray CameraRaySetup::spawn_ray(const vec2 &film_pos, const vec2 &u_lens) const
+{
+    Ray ray;
+    vec3 world_pos = film_origin + film_pos.x() * film_du + film_pos.y() * film_dv;
     if (!orthographic) {
-        vec3 camera_position = position();
-        vec3 world_pos = proj_to_world.point_hdiv(ndc_pos);
-        vec3 ray_dir = (world_pos - camera_position).normalized();
-        ray = Ray(camera_position, ray_dir, 0.0f, inf);
+        vec3 ray_dir = (world_pos - position).normalized();
+        ray = Ray(position, ray_dir, 0.0f, inf);
 
         ray.rx_origin = ray.ry_origin = ray.origin;
-        ray.rx_dir = (world_pos + camera_dx - camera_position).normalized();
-        ray.ry_dir = (world_pos + camera_dy - camera_position).normalized();
+        vec3 rx_dir = (world_pos + pixel_dx - position).normalized();
+        vec3 ry_dir = (world_pos + pixel_dy - position).normalized();
+        ray.rx_dir = ray.dir + (rx_dir - ray.dir) * diff_scale;
+        ray.ry_dir = ray.dir + (ry_dir - ray.dir) * diff_scale;
     } else {
-        vec3 ortho_dir = direction();
-        vec3 origin = proj_to_world.point_hdiv(ndc_pos);
         // TODO: ray diff in this case?
-        ray = Ray(origin, ortho_dir, 0.0f, inf);
+        ray = Ray(world_pos, ortho_dir, 0.0f, inf);
 
-        ray.rx_origin = ray.origin + camera_dx;
-        ray.ry_origin = ray.origin + camera_dy;
+        ray.rx_origin = ray.origin + pixel_dx * diff_scale;
+        ray.ry_origin = ray.origin + pixel_dy * diff_scale;
         ray.rx_dir = ray.ry_dir = ray.dir;
     }
 
-    if (ray.has_ray_diffs()) {
-        float scale = 1.0f / std::sqrt((float)spp);
-        ray.rx_origin = ray.origin + (ray.rx_origin - ray.origin) * scale;
-        ray.ry_origin = ray.origin + (ray.ry_origin - ray.origin) * scale;
-        ray.rx_dir = ray.dir + (ray.rx_dir - ray.dir) * scale;
-        ray.ry_dir = ray.dir + (ray.ry_dir - ray.dir) * scale;
+    if (lens.enabled()) {
+        // Move the origin onto the lens and aim at where the pinhole ray meets the focus plane. The differential rays
+        // get the same lens offset and their own focus points.
+        vec2 a = lens.aperture_radius * lens.sample_aperture(u_lens);
+        vec3 offset = a.x() * lens_right + a.y() * lens_up;
+        auto focus_point = [&](const vec3 &o, const vec3 &d) { return o + d * (lens.focus_distance / d.dot(forward)); };
+        vec3 focus = focus_point(ray.origin, ray.dir);
+        vec3 focus_x = focus_point(ray.rx_origin, ray.rx_dir);
+        vec3 focus_y = focus_point(ray.ry_origin, ray.ry_dir);
+        ray.origin += offset;
+        ray.rx_origin += offset;
+        ray.ry_origin += offset;
+        ray.dir = (focus - ray.origin).normalized();
+        ray.rx_dir = (focus_x - ray.rx_origin).normalized();
+        ray.ry_dir = (focus_y - ray.ry_origin).normalized();
+    }
+    return ray;
+}
+
+void CameraRaySetup::spawn_rays(std::span<const vec2> film_pos, std::span<const vec2> u_lens,
+                                std::span<Ray> rays) const
+{
+    ASSERT(film_pos.size() == rays.size() && (u_lens.empty() || u_lens.size() == rays.size()));
+    ASSERT(!lens.enabled() || !u_lens.empty(), "Lens samples are required with an enabled lens.");
+    for (size_t i = 0; i < film_pos.size(); ++i) {
+        rays[i] = spawn_ray(film_pos[i], u_lens.empty() ? vec2::Zero() : u_lens[i]);
+    }
+}
+
+Ray Camera::spawn_ray(const vec2 &film_pos, const vec2i &film_res, int spp) const
+{
+    return ray_setup(film_res, spp).spawn_ray(film_pos);
+}
+
+Ray Camera::spawn_ray(const vec2 &film_pos, const vec2 &u_lens, const vec2i &film_res, int spp) const
+{
+    return ray_setup(film_res, spp).spawn_ray(film_pos, u_lens);
+}
+
+Ray CameraMotion::spawn_ray(const vec2 &film_pos, const vec2i &film_res, int spp, float time) const
+{
+    return spawn_ray(film_pos, vec2::Zero(), film_res, spp, time);
+}
+
+Ray CameraMotion::spawn_ray(const vec2 &film_pos, const vec2 &u_lens, const vec2i &film_res, int spp, float time) const
+{
+    ASSERT(!steps.empty());
+    if (steps.size() == 1) {
+        Ray ray = steps[0].spawn_ray(film_pos, u_lens, film_res, spp);
+        ray.time = time;
+        return ray;
     }
+    float t = std::clamp(time, 0.0f, 1.0f) * (float)(steps.size() - 1);
+    uint32_t k = std::min((uint32_t)t, (uint32_t)steps.size() - 2);
+    float w = t - (float)k;
+    Ray r0 = steps[k].spawn_ray(film_pos, u_lens, film_res, spp);
+    Ray r1 = steps[k + 1].spawn_ray(film_pos, u_lens, film_res, spp);
+    Ray ray = r0;
+    ray.origin = (1.0f - w) * r0.origin + w * r1.origin;
+    ray.dir = ((1.0f - w) * r0.dir + w * r1.dir).normalized();
+    ray.rx_origin = (1.0f - w) * r0.rx_origin + w * r1.rx_origin;
+    ray.ry_origin = (1.0f - w) * r0.ry_origin + w * r1.ry_origin;
+    ray.rx_dir = ((1.0f - w) * r0.rx_dir + w * r1.rx_dir).normalized();
+    ray.ry_dir = ((1.0f - w) * r0.ry_dir + w * r1.ry_dir).normalized();
+    ray.time = time;
     return ray;
 }
 
@@ -175,11 +278,12 @@ std::unique_ptr<Camera> create_camera(const ConfigArgs &args)
         to_world = Transform(look_at(camera_pos, camera_target, camera_up));
     }
 
+    std::unique_ptr<Camera> camera;
     std::string type = args.load_string("type");
     if (type == "perspective") {
         float vfov = to_radian(args.load_float("vfov"));
         float aspect = args.load_float("aspect");
-        return std::make_unique<Camera>(to_world, vfov, aspect);
+        camera = std::make_unique<Camera>(to_world, vfov, aspect);
     } else if (type == "orthographic") {
         float left = args.load_float("left");
         float right = args.load_float("right");
@@ -187,9 +291,47 @@ std::unique_ptr<Camera> create_camera(const ConfigArgs &args)
         float top = args.load_float("top");
         float near = args.load_float("near");
         float far = args.load_float("far");
-        return std::make_unique<Camera>(to_world, left, right, bottom, top, near, far);
+        camera = std::make_unique<Camera>(to_world, left, right, bottom, top, near, far);
+    }
+    if (camera && args.contains("lens")) {
+        camera->lens = create_thin_lens(args["lens"]);
+    }
+    return camera;
+}
+
+ThinLens create_thin_lens(const ConfigArgs &args)
+{
+    ThinLens lens;
+    lens.aperture_radius = args.load_float("aperture_radius");
+    lens.focus_distance = args.load_float("focus_distance");
+    lens.blades = args.load_integer("blades", 0);
+    lens.blade_rotation = to_radian(args.load_float("blade_rotation", 0.0f));
+    if (args.contains("aperture_map")) {
+        int width, height;
+        std::unique_ptr<float[]> lum =
+            load_from_ldr_to_float(args.load_path("aperture_map"), 1, width, height, ColorSpace::Linear);
+        lens.aperture_map = std::make_shared<DistribTable2D>(lum.get(), width, height);
+    }
+    ASSERT(lens.aperture_radius >= 0.0f && lens.focus_distance > 0.0f, "Invalid thin lens.");
+    return lens;
+}
+
+std::unique_ptr<CameraMotion> create_camera_motion(const ConfigArgs &args, float shutter_open, float shutter_close,
+                                                   int time_steps)
+{
+    ASSERT(time_steps >= 1);
+    auto motion = std::make_unique<CameraMotion>();
+    motion->steps.reserve(time_steps);
+    for (int i = 0; i < time_steps; ++i) {
+        float t = time_steps == 1 ? 0.0f : (float)i / (float)(time_steps - 1);
+        args.update_time(std::lerp(shutter_open, shutter_close, t));
+        motion->steps.push_back(*create_camera(args));
+        if (i > 0) {
+            // Aperture maps are not animated; share the first one.
+            motion->steps.back().lens.aperture_map = motion->steps[0].lens.aperture_map;
+        }
     }
-    return nullptr;
+    return motion;
 }
 
 } // namespace ks
\ No newline at end of file
@@ -2,10 +2,62 @@
 #include "maths.h"
 #include "ray.h"
 #include <memory>
+#include <span>
+#include <vector>
 
 namespace ks
 {
 
+struct DistribTable2D;
+
+// Thin lens for depth of field. A zero aperture radius is a pinhole (and costs nothing).
+struct ThinLens
+{
+    bool enabled() const { return aperture_radius > 0.0f; }
+    // Point on the unit aperture from a uniform 2D sample.
+    vec2 sample_aperture(const vec2 &u) const;
+
+    // In world units.
+    float aperture_radius = 0.0f;
+    // Distance of the plane in focus along the view direction.
+    float focus_distance = 1.0f;
+    // Polygonal bokeh with this many blades, circular if < 3.
+    int blades = 0;
+    float blade_rotation = 0.0f;
+    // Optional aperture image mapped to [-1, 1]^2 and sampled proportionally to its luminance. Overrides blades.
+    std::shared_ptr<const DistribTable2D> aperture_map;
+};
+
+// Constants of Camera::spawn_ray for a fixed film resolution and spp, hoisted out of the per-ray work.
+// Film positions map affinely to points on the near plane, so spawning a ray is a few FMAs and a normalize.
+struct CameraRaySetup
+{
+    // u_lens is only used with an enabled lens.
+    Ray spawn_ray(const vec2 &film_pos, const vec2 &u_lens = vec2::Zero()) const;
+    // A tile's (or wave's) worth of primary rays, e.g. to feed Scene::intersect_stream directly.
+    // u_lens may be empty without a lens.
+    void spawn_rays(std::span<const vec2> film_pos, std::span<const vec2> u_lens, std::span<Ray> rays) const;
+
+    // Near plane point at film_pos (0, 0) and its change per unit of film_pos.
+    vec3 film_origin;
+    vec3 film_du;
+    vec3 film_dv;
+    // Perspective eye position or orthographic direction.
+    vec3 position;
+    vec3 ortho_dir;
+    // One pixel step on the near plane. The differentials are scaled by diff_scale (1 / sqrt(spp)).
+    vec3 pixel_dx;
+    vec3 pixel_dy;
+    float diff_scale;
+    bool orthographic;
+
+    ThinLens lens;
+    // Camera frame in world space, for placing points on the lens and finding the focus plane.
+    vec3 lens_right;
+    vec3 lens_up;
+    vec3 forward;
+};
+
 struct Camera
 {
     Camera() = default;
@@ -16,6 +68,9 @@ struct Camera
            float near, float far);
 
     Ray spawn_ray(const vec2 &film_pos, const vec2i &film_res, int spp) const;
+    Ray spawn_ray(const vec2 &film_pos, const vec2 &u_lens, const vec2i &film_res, int spp) const;
+    // Compute once per frame when spawning many rays.
+    CameraRaySetup ray_setup(const vec2i &film_res, int spp) const;
 
     vec3 position() const { return vec3(camera_to_world.m(0, 3), camera_to_world.m(1, 3), camera_to_world.m(2, 3)); }
 
@@ -29,6 +84,7 @@ struct Camera
     Transform proj_to_camera;
     Transform camera_to_world;
     bool orthographic = false;
+    ThinLens lens;
 };
 
 ks::mat4 look_at(const ks::vec3 &position, const ks::vec3 &target, ks::vec3 up);
@@ -36,7 +92,22 @@ ks::mat4 look_at_view(const ks::vec3 &position, const ks::vec3 &target, ks::vec3
 ks::mat4 rev_inf_projection(float vfov, float aspect, float near_clip = 0.01f);
 ks::mat4 rev_orthographic(float left, float right, float bottom, float top, float near, float far);
 
+// Cameras uniformly spaced over the shutter interval. Rays are interpolated between the two nearest ones.
+struct CameraMotion
+{
+    // time is the normalized shutter time in [0, 1] and is stored in the ray.
+    Ray spawn_ray(const vec2 &film_pos, const vec2i &film_res, int spp, float time) const;
+    Ray spawn_ray(const vec2 &film_pos, const vec2 &u_lens, const vec2i &film_res, int spp, float time) const;
+    bool has_lens() const { return !steps.empty() && steps[0].lens.enabled(); }
+
+    std::vector<Camera> steps;
+};
+
 struct ConfigArgs;
 std::unique_ptr<Camera> create_camera(const ConfigArgs &args);
+ThinLens create_thin_lens(const ConfigArgs &args);
+// Evaluates the (keyframed) camera args at time_steps times over [shutter_open, shutter_close].
+std::unique_ptr<CameraMotion> create_camera_motion(const ConfigArgs &args, float shutter_open, float shutter_close,
+                                                   int time_steps);
 
 } // namespace ks
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "compression.h"
+#include "assertion.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <lz4.h>
+#include <memory>
+#include <vector>
+
+namespace ks
+{
+
+void write_lz4_compressed(BinaryWriter &writer, const std::byte *src, size_t size)
+{
+    int num_blocks = (int)std::ceil((double)size / double(LZ4_MAX_INPUT_SIZE));
+    writer.write<int>(num_blocks);
+
+    size_t offset = 0;
+    size_t total_compressed_capacity = 0;
+    for (int block = 0; block < num_blocks; ++block) {
+        size_t block_size = std::min(size_t(LZ4_MAX_INPUT_SIZE), size - offset);
+        total_compressed_capacity += LZ4_compressBound((int)block_size);
+        offset += block_size;
+    }
+    std::unique_ptr<std::byte[]> compressed_buf = std::make_unique<std::byte[]>(total_compressed_capacity);
+    offset = 0;
+    size_t compressed_offset = 0;
+    for (int block = 0; block < num_blocks; ++block) {
+        size_t block_size = std::min(size_t(LZ4_MAX_INPUT_SIZE), size - offset);
+        int compressed_block_capacity = LZ4_compressBound((int)block_size);
+        int compressed_block_size =
+            LZ4_compress_default((const char *)(src + offset), (char *)(compressed_buf.get() + compressed_offset),
+                                 (int)block_size, compressed_block_capacity);
+        ASSERT(compressed_block_size > 0, "lz4 compression failed.");
+        writer.write<int>(compressed_block_size);
+        compressed_offset += compressed_block_size;
+        offset += block_size;
+    }
+    size_t total_compressed_size = compressed_offset;
+    writer.write_array<std::byte>(compressed_buf.get(), total_compressed_size);
+}
+
+void read_lz4_compressed(BinaryReader &reader, std::byte *dest, size_t size)
+{
+    int num_blocks = reader.read<int>();
+    std::vector<int> compressed_block_sizes(num_blocks);
+    size_t total_compressed_size = 0;
+    for (int block = 0; block < num_blocks; ++block) {
+        compressed_block_sizes[block] = reader.read<int>();
+        total_compressed_size += compressed_block_sizes[block];
+    }
+    std::unique_ptr<std::byte[]> compressed_buf = std::make_unique<std::byte[]>(total_compressed_size);
+    reader.read_array<std::byte>(compressed_buf.get(), total_compressed_size);
+    size_t offset = 0;
+    size_t compressed_offset = 0;
+    for (int block = 0; block < num_blocks; ++block) {
+        size_t block_size = std::min(size_t(LZ4_MAX_INPUT_SIZE), size - offset);
+        int ret = LZ4_decompress_safe((const char *)(compressed_buf.get() + compressed_offset),
+                                      (char *)(dest + offset), compressed_block_sizes[block], (int)block_size);
+        ASSERT(ret > 0, "lz4 decompression failed.");
+        offset += block_size;
+        compressed_offset += compressed_block_sizes[block];
+    }
+}
+
+// Number of blocks (de)compressed in parallel before the batch is written out or a new one is read.
+static int lz4_stream_batch_size() { return 2 * num_system_cores(); }
+
+void write_lz4_stream(BinaryWriter &writer, size_t size, const StreamGather &gather, size_t block_size)
+{
+    ASSERT(block_size > 0 && block_size <= LZ4_MAX_INPUT_SIZE, "Invalid lz4 block size.");
+    writer.write<uint64_t>(block_size);
+    size_t num_blocks = (size + block_size - 1) / block_size;
+    int batch_size = lz4_stream_batch_size();
+    int capacity = LZ4_compressBound((int)block_size);
+    // Buffers are reused across batches.
+    std::vector<std::unique_ptr<std::byte[]>> raw(batch_size);
+    std::vector<std::unique_ptr<std::byte[]>> compressed(batch_size);
+    std::vector<int> compressed_sizes(batch_size);
+    for (size_t batch_start = 0; batch_start < num_blocks; batch_start += batch_size) {
+        int n = (int)std::min(size_t(batch_size), num_blocks - batch_start);
+        parallel_for(n, [&](int i) {
+            if (!raw[i]) {
+                raw[i] = std::make_unique<std::byte[]>(block_size);
+                compressed[i] = std::make_unique<std::byte[]>(capacity);
+            }
+            size_t offset = (batch_start + i) * block_size;
+            size_t bytes = std::min(block_size, size - offset);
+            gather(offset, bytes, raw[i].get());
+            compressed_sizes[i] = LZ4_compress_default((const char *)raw[i].get(), (char *)compressed[i].get(),
+                                                       (int)bytes, capacity);
+            ASSERT(compressed_sizes[i] > 0, "lz4 compression failed.");
+        });
+        for (int i = 0; i < n; ++i) {
+            writer.write<int>(compressed_sizes[i]);
+            writer.write_array<std::byte>(compressed[i].get(), compressed_sizes[i]);
+        }
+    }
+}
+
+void read_lz4_stream(BinaryReader &reader, size_t size, const StreamScatter &scatter)
+{
+    size_t block_size = reader.read<uint64_t>();
+    ASSERT(block_size > 0 && block_size <= LZ4_MAX_INPUT_SIZE, "Invalid lz4 block size.");
+    size_t num_blocks = (size + block_size - 1) / block_size;
+    int batch_size = lz4_stream_batch_size();
+    int capacity = LZ4_compressBound((int)block_size);
+    std::vector<std::unique_ptr<std::byte[]>> raw(batch_size);
+    std::vector<std::unique_ptr<std::byte[]>> compressed(batch_size);
+    std::vector<int> compressed_sizes(batch_size);
+    for (size_t batch_start = 0; batch_start < num_blocks; batch_start += batch_size) {
+        int n = (int)std::min(size_t(batch_size), num_blocks - batch_start);
+        for (int i = 0; i < n; ++i) {
+            compressed_sizes[i] = reader.read<int>();
+            ASSERT(compressed_sizes[i] > 0 && compressed_sizes[i] <= capacity, "Corrupted lz4 stream.");
+            if (!compressed[i]) {
+                raw[i] = std::make_unique<std::byte[]>(block_size);
+                compressed[i] = std::make_unique<std::byte[]>(capacity);
+            }
+            reader.read_array<std::byte>(compressed[i].get(), compressed_sizes[i]);
+        }
+        parallel_for(n, [&](int i) {
+            size_t offset = (batch_start + i) * block_size;
+            size_t bytes = std::min(block_size, size - offset);
+            int ret = LZ4_decompress_safe((const char *)compressed[i].get(), (char *)raw[i].get(),
+                                          compressed_sizes[i], (int)bytes);
+            ASSERT(ret == (int)bytes, "lz4 decompression failed.");
+            scatter(offset, bytes, raw[i].get());
+        });
+    }
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+#include "file_util.h"
+#include <cstddef>
+#include <functional>
+
+namespace ks
+{
+
+// lz4 compression of a raw buffer. LZ4_MAX_INPUT_SIZE is ~2GB, so large buffers are split into blocks.
+// Layout: num_blocks, compressed size of each block, compressed blocks.
+// NOTE: the uncompressed size is not written and must be stored by the caller.
+void write_lz4_compressed(BinaryWriter &writer, const std::byte *src, size_t size);
+void read_lz4_compressed(BinaryReader &reader, std::byte *dest, size_t size);
+
+// Streamed lz4 compression: the data is split into small independent blocks that are (de)compressed in parallel a
+// batch at a time, so only one batch of blocks needs to be in memory.
+// Layout: block size, then the compressed size and compressed bytes of each block.
+// gather/scatter copy the uncompressed bytes [offset, offset + size) from/to the caller's storage. They are called
+// concurrently for disjoint ranges.
+constexpr size_t lz4_stream_block_size = size_t(1) << 22;
+using StreamGather = std::function<void(size_t offset, size_t size, std::byte *dest)>;
+using StreamScatter = std::function<void(size_t offset, size_t size, const std::byte *src)>;
+void write_lz4_stream(BinaryWriter &writer, size_t size, const StreamGather &gather,
+                      size_t block_size = lz4_stream_block_size);
+void read_lz4_stream(BinaryReader &reader, size_t size, const StreamScatter &scatter);
+
+} // namespace ks
\ No newline at end of file
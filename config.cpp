@@ -1,14 +1,26 @@
 #include "config.h"
 #include "file_util.h"
+#include "hash.h"
+#include "image_util.h"
 #include "keyframe.h"
+#include "parallel.h"
+#include "stats.h"
 #include "test_util.h"
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <tbb/task_arena.h>
+#include <thread>
 #include <toml.hpp>
 #include <unsupported/Eigen/EulerAngles>
 
 namespace ks
 {
 
+struct ConfigTaskNode;
+
 struct ConfigServiceInternal
 {
     void parse_file(const fs::path &file_path);
@@ -19,8 +31,21 @@ struct ConfigServiceInternal
     vec3 load_vec3_field(const toml::node_view<const toml::node> &args, bool force_normalize, float time = 0.0f);
     vec4 load_vec4_field(const toml::node_view<const toml::node> &args, bool force_normalize, float time = 0.0f);
     Transform load_transform_field(const toml::node_view<const toml::node> &args, float time = 0.0f);
+    // Batched versions of the above (see KeyframeField::eval_n).
+    void load_vec3_field_n(const toml::node_view<const toml::node> &args, bool force_normalize,
+                           std::span<const float> times, std::span<vec3> out);
+    void load_vec4_field_n(const toml::node_view<const toml::node> &args, bool force_normalize,
+                           std::span<const float> times, std::span<vec4> out);
+    void load_transform_field_n(const toml::node_view<const toml::node> &args, std::span<const float> times,
+                                std::span<Transform> out);
+    // Cached keyframed fields.
+    const KeyframeVec3 &vec3_field(const toml::node_view<const toml::node> &args, bool force_normalize);
+    const KeyframeVec4 &vec4_field(const toml::node_view<const toml::node> &args, bool force_normalize);
 
     fs::path output_directory() const;
+    // Relative paths are relative to asset_root_dir (if set).
+    fs::path resolve_path(const fs::path &p) const;
+    void run_task(const ConfigTaskNode &node, bool task_stats) const;
     void run_all_tasks() const;
 
     toml::parse_result cfg;
@@ -34,6 +59,10 @@ struct ConfigServiceInternal
     std::unordered_map<const toml::node *, KeyframeVec4> vec4_fields;
 
     std::unordered_map<std::string, ConfigTask> task_factory;
+
+    // Tasks may run concurrently (see run_all_tasks).
+    mutable std::mutex print_mutex;
+    std::mutex field_mutex;
 };
 
 void ConfigServiceInternal::parse_file(const fs::path &file_path)
@@ -59,20 +88,27 @@ float ConfigServiceInternal::load_float_field(const toml::node_view<const toml::
     if (args.is_number()) {
         return *args.value<float>();
     } else {
-        auto it = float_fields.find(args.node());
-        if (it == float_fields.end()) {
-            const toml::array &times = *args["times"].as_array();
-            const toml::array &values = *args["values"].as_array();
-            KeyframeFloat field;
-            field.times.resize(times.size());
-            field.values.resize(values.size());
-            for (int i = 0; i < times.size(); ++i) {
-                field.times[i] = *times[i].value<float>();
-                field.values[i] = *values[i].value<float>();
+        // Parsed and baked once per node. Elements of the map are stable, so they're evaluated outside the lock.
+        const KeyframeFloat *cached;
+        {
+            std::scoped_lock lock(field_mutex);
+            auto it = float_fields.find(args.node());
+            if (it == float_fields.end()) {
+                const toml::array &times = *args["times"].as_array();
+                const toml::array &values = *args["values"].as_array();
+                KeyframeFloat field;
+                field.times.resize(times.size());
+                field.values.resize(values.size());
+                for (int i = 0; i < times.size(); ++i) {
+                    field.times[i] = *times[i].value<float>();
+                    field.values[i] = *values[i].value<float>();
+                }
+                field.bake_segments();
+                it = float_fields.insert({args.node(), std::move(field)}).first;
             }
-            it = float_fields.insert({args.node(), std::move(field)}).first;
+            cached = &it->second;
         }
-        return it->second.eval(time);
+        return cached->eval(time);
     }
 }
 
@@ -88,29 +124,70 @@ vec2 ConfigServiceInternal::load_vec2_field(const toml::node_view<const toml::no
             v.normalize();
         return v;
     } else {
-        auto it = vec2_fields.find(args.node());
-        if (it == vec2_fields.end()) {
-            const toml::array &times = *args["times"].as_array();
-            const toml::array &values = *args["values"].as_array();
-            KeyframeVec2 field;
-            field.times.resize(times.size());
-            field.values.resize(values.size());
-            for (int i = 0; i < times.size(); ++i) {
-                field.times[i] = *times[i].value<float>();
-                const toml::array &value = *values[i].as_array();
-                for (int j = 0; j < 3; ++j)
-                    field.values[i][j] = *value[j].value<float>();
-                if (force_normalize)
-                    field.values[i].normalize();
+        // Parsed and baked once per node. Elements of the map are stable, so they're evaluated outside the lock.
+        const KeyframeVec2 *cached;
+        {
+            std::scoped_lock lock(field_mutex);
+            auto it = vec2_fields.find(args.node());
+            if (it == vec2_fields.end()) {
+                const toml::array &times = *args["times"].as_array();
+                const toml::array &values = *args["values"].as_array();
+                KeyframeVec2 field;
+                field.times.resize(times.size());
+                field.values.resize(values.size());
+                for (int i = 0; i < times.size(); ++i) {
+                    field.times[i] = *times[i].value<float>();
+                    const toml::array &value = *values[i].as_array();
+                    for (int j = 0; j < 2; ++j)
+                        field.values[i][j] = *value[j].value<float>();
+                    if (force_normalize)
+                        field.values[i].normalize();
+                }
+                field.bake_segments();
+                it = vec2_fields.insert({args.node(), std::move(field)}).first;
             }
-            it = vec2_fields.insert({args.node(), std::move(field)}).first;
+            cached = &it->second;
+        }
+        return cached->eval(time);
+    }
+}
+
+const KeyframeVec3 &ConfigServiceInternal::vec3_field(const toml::node_view<const toml::node> &args,
+                                                      bool force_normalize)
+{
+    // Parsed and baked once per node. Elements of the map are stable, so they're evaluated outside the lock.
+    std::scoped_lock lock(field_mutex);
+    auto it = vec3_fields.find(args.node());
+    if (it == vec3_fields.end()) {
+        const toml::array &times = *args["times"].as_array();
+        const toml::array &values = *args["values"].as_array();
+        KeyframeVec3 field;
+        field.times.resize(times.size());
+        field.values.resize(values.size());
+        for (int i = 0; i < times.size(); ++i) {
+            field.times[i] = *times[i].value<float>();
+            const toml::array &value = *values[i].as_array();
+            for (int j = 0; j < 3; ++j)
+                field.values[i][j] = *value[j].value<float>();
+            if (force_normalize)
+                field.values[i].normalize();
         }
-        return it->second.eval(time);
+        field.bake_segments();
+        it = vec3_fields.insert({args.node(), std::move(field)}).first;
     }
+    return it->second;
 }
 
 vec3 ConfigServiceInternal::load_vec3_field(const toml::node_view<const toml::node> &args, bool force_normalize,
                                             float time)
+{
+    vec3 v;
+    load_vec3_field_n(args, force_normalize, {&time, 1}, {&v, 1});
+    return v;
+}
+
+void ConfigServiceInternal::load_vec3_field_n(const toml::node_view<const toml::node> &args, bool force_normalize,
+                                              std::span<const float> times, std::span<vec3> out)
 {
     if (args.is_array()) {
         const toml::array &components = *args.as_array();
@@ -119,31 +196,48 @@ vec3 ConfigServiceInternal::load_vec3_field(const toml::node_view<const toml::no
             v[i] = *components[i].value<float>();
         if (force_normalize)
             v.normalize();
-        return v;
+        std::fill(out.begin(), out.end(), v);
     } else {
-        auto it = vec3_fields.find(args.node());
-        if (it == vec3_fields.end()) {
-            const toml::array &times = *args["times"].as_array();
-            const toml::array &values = *args["values"].as_array();
-            KeyframeVec3 field;
-            field.times.resize(times.size());
-            field.values.resize(values.size());
-            for (int i = 0; i < times.size(); ++i) {
-                field.times[i] = *times[i].value<float>();
-                const toml::array &value = *values[i].as_array();
-                for (int j = 0; j < 3; ++j)
-                    field.values[i][j] = *value[j].value<float>();
-                if (force_normalize)
-                    field.values[i].normalize();
-            }
-            it = vec3_fields.insert({args.node(), std::move(field)}).first;
+        vec3_field(args, force_normalize).eval_n(times, out);
+    }
+}
+
+const KeyframeVec4 &ConfigServiceInternal::vec4_field(const toml::node_view<const toml::node> &args,
+                                                      bool force_normalize)
+{
+    // Parsed and baked once per node. Elements of the map are stable, so they're evaluated outside the lock.
+    std::scoped_lock lock(field_mutex);
+    auto it = vec4_fields.find(args.node());
+    if (it == vec4_fields.end()) {
+        const toml::array &times = *args["times"].as_array();
+        const toml::array &values = *args["values"].as_array();
+        KeyframeVec4 field;
+        field.times.resize(times.size());
+        field.values.resize(values.size());
+        for (int i = 0; i < times.size(); ++i) {
+            field.times[i] = *times[i].value<float>();
+            const toml::array &value = *values[i].as_array();
+            for (int j = 0; j < 4; ++j)
+                field.values[i][j] = *value[j].value<float>();
+            if (force_normalize)
+                field.values[i].normalize();
         }
-        return it->second.eval(time);
+        field.bake_segments();
+        it = vec4_fields.insert({args.node(), std::move(field)}).first;
     }
+    return it->second;
 }
 
 vec4 ConfigServiceInternal::load_vec4_field(const toml::node_view<const toml::node> &args, bool force_normalize,
-                                            float time /*= 0.0f*/)
+                                            float time)
+{
+    vec4 v;
+    load_vec4_field_n(args, force_normalize, {&time, 1}, {&v, 1});
+    return v;
+}
+
+void ConfigServiceInternal::load_vec4_field_n(const toml::node_view<const toml::node> &args, bool force_normalize,
+                                              std::span<const float> times, std::span<vec4> out)
 {
     if (args.is_array()) {
         const toml::array &components = *args.as_array();
@@ -152,69 +246,55 @@ vec4 ConfigServiceInternal::load_vec4_field(const toml::node_view<const toml::no
             v[i] = *components[i].value<float>();
         if (force_normalize)
             v.normalize();
-        return v;
+        std::fill(out.begin(), out.end(), v);
     } else {
-        auto it = vec4_fields.find(args.node());
-        if (it == vec4_fields.end()) {
-            const toml::array &times = *args["times"].as_array();
-            const toml::array &values = *args["values"].as_array();
-            KeyframeVec4 field;
-            field.times.resize(times.size());
-            field.values.resize(values.size());
-            for (int i = 0; i < times.size(); ++i) {
-                field.times[i] = *times[i].value<float>();
-                const toml::array &value = *values[i].as_array();
-                for (int j = 0; j < 4; ++j)
-                    field.values[i][j] = *value[j].value<float>();
-                if (force_normalize)
-                    field.values[i].normalize();
-            }
-            it = vec4_fields.insert({args.node(), std::move(field)}).first;
-        }
-        return it->second.eval(time);
+        vec4_field(args, force_normalize).eval_n(times, out);
     }
 }
 
 Transform ConfigServiceInternal::load_transform_field(const toml::node_view<const toml::node> &args, float time)
 {
-    // TODO: keyframe this
+    Transform transform;
+    load_transform_field_n(args, {&time, 1}, {&transform, 1});
+    return transform;
+}
 
+void ConfigServiceInternal::load_transform_field_n(const toml::node_view<const toml::node> &args,
+                                                   std::span<const float> times, std::span<Transform> out)
+{
+    ASSERT(times.size() == out.size());
+    // Each component may be keyframed.
     const toml::table &table = *args.as_table();
-
-    Transform transform;
-    vec3 scale = vec3::Ones();
-    if (table.contains("scale")) {
-        const auto &s = *table["scale"].as_array();
-        for (int i = 0; i < 3; ++i)
-            scale[i] = *s[i].value<float>();
-    }
-    quat rotation = quat::Identity();
+    size_t n = times.size();
+    std::vector<vec3> scale(n, vec3::Ones());
+    if (table.contains("scale"))
+        load_vec3_field_n(args["scale"], false, times, scale);
+    std::vector<quat> rotation(n, quat::Identity());
     if (table.contains("rotation")) {
         const auto &r = *table["rotation"].as_table();
         if (r.contains("euler")) {
-            const auto &euler = *r["euler"].as_array();
-            float angle0 = to_radian(*euler[0].value<float>());
-            float angle1 = to_radian(*euler[1].value<float>());
-            float angle2 = to_radian(*euler[2].value<float>());
-            rotation = (quat)Eigen::EulerAnglesXYZf(angle0, angle1, angle2);
+            std::vector<vec3> euler(n);
+            load_vec3_field_n(args["rotation"]["euler"], false, times, euler);
+            for (size_t i = 0; i < n; ++i)
+                rotation[i] = (quat)Eigen::EulerAnglesXYZf(to_radian(euler[i][0]), to_radian(euler[i][1]),
+                                                           to_radian(euler[i][2]));
         } else if (r.contains("quat")) {
-            const auto &quaternion = *r["quat"].as_array();
-            float w = *quaternion[0].value<float>();
-            float x = *quaternion[1].value<float>();
-            float y = *quaternion[2].value<float>();
-            float z = *quaternion[3].value<float>();
-            rotation = quat(w, x, y, z).normalized();
+            // (w, x, y, z). Keyframes are blended with nlerp.
+            std::vector<vec4> quaternion(n);
+            load_vec4_field_n(args["rotation"]["quat"], false, times, quaternion);
+            for (size_t i = 0; i < n; ++i) {
+                const vec4 &q = quaternion[i];
+                rotation[i] = quat(q[0], q[1], q[2], q[3]).normalized();
+            }
         } else {
             ASSERT(false, "Must specify rotation as (XYZ) euler angles or quaternion.");
         }
     }
-    vec3 translation = vec3::Zero();
-    if (table.contains("translation")) {
-        const auto &t = *table["translation"].as_array();
-        for (int i = 0; i < 3; ++i)
-            translation[i] = *t[i].value<float>();
-    }
-    return Transform(scale_rotate_translate(scale, rotation, translation));
+    std::vector<vec3> translation(n, vec3::Zero());
+    if (table.contains("translation"))
+        load_vec3_field_n(args["translation"], false, times, translation);
+    for (size_t i = 0; i < n; ++i)
+        out[i] = Transform(scale_rotate_translate(scale[i], rotation[i], translation[i]));
 }
 
 fs::path ConfigServiceInternal::output_directory() const
@@ -226,6 +306,75 @@ fs::path ConfigServiceInternal::output_directory() const
     }
 }
 
+fs::path ConfigServiceInternal::resolve_path(const fs::path &p) const
+{
+    if (p.is_absolute() || asset_root_dir.empty()) {
+        return p;
+    } else {
+        return asset_root_dir / p;
+    }
+}
+
+struct ConfigTaskNode
+{
+    int task_id;
+    fs::path task_dir;
+    toml::table table;
+    // Only used when tasks run in parallel.
+    std::vector<int> dependents;
+    int num_pending = 0;
+    // Size of the tbb arena the task runs in. 0 means the default arena.
+    int num_threads = 0;
+    // Has an override base or depends_on list, whose outputs it may read.
+    bool has_dependencies = false;
+};
+
+// With task_stats, the stats are reset before the task and written to task_dir/stats.json after it. Only valid when
+// no other task runs concurrently: the per-thread values are read and cleared without synchronization.
+void ConfigServiceInternal::run_task(const ConfigTaskNode &node, bool task_stats) const
+{
+    std::ostringstream config_str;
+    config_str << node.table << "\n";
+    {
+        std::scoped_lock lock(print_mutex);
+        printf("Next task: \n");
+        std::cout << config_str.str() << std::endl;
+    }
+    // Don't touch config.toml when re-running the same task so that file timestamps stay meaningful.
+    fs::path config_path = node.task_dir / "config.toml";
+    if (!fs::exists(config_path) || read_file_as_string(config_path) != config_str.str()) {
+        std::ofstream write_config(config_path);
+        write_config << config_str.str();
+    }
+
+    std::string type = *node.table["type"].value<std::string>();
+    const ConfigTask &task = task_factory.at(type);
+
+    if (node.has_dependencies) {
+        // Outputs of earlier tasks may still be queued on the background writer.
+        background_writer().flush();
+    }
+    toml::node_view<const toml::node> view(node.table);
+    ConfigArgs args(std::make_unique<ConfigArgsInternal>(const_cast<ConfigServiceInternal *>(this), view));
+#if KS_ENABLE_STATS
+    if (task_stats)
+        stats_registry().reset();
+#endif
+    if (node.num_threads > 0) {
+        tbb::task_arena arena(node.num_threads);
+        arena.execute([&]() { task(args, node.task_dir, node.task_id); });
+    } else {
+        task(args, node.task_dir, node.task_id);
+    }
+#if KS_ENABLE_STATS
+    if (task_stats)
+        stats_registry().write_json(node.task_dir / "stats.json");
+#endif
+
+    std::scoped_lock lock(print_mutex);
+    printf("Saving output to [%s]\n\n", node.task_dir.string().c_str());
+}
+
 void ConfigServiceInternal::run_all_tasks() const
 {
     fs::path output_dir = output_directory();
@@ -241,7 +390,9 @@ void ConfigServiceInternal::run_all_tasks() const
         return;
     }
     const toml::array &task_array = *cfg["task"].as_array();
-    for (int task_id = 0; task_id < (int)task_array.size(); ++task_id) {
+    int num_tasks = (int)task_array.size();
+    std::vector<ConfigTaskNode> nodes(num_tasks);
+    for (int task_id = 0; task_id < num_tasks; ++task_id) {
         fs::path task_dir;
         toml::table task_table = *task_array[task_id].as_table();
         if (task_table.contains("task_dir")) {
@@ -258,6 +409,7 @@ void ConfigServiceInternal::run_all_tasks() const
             }
         }
 
+        ConfigTaskNode &node = nodes[task_id];
         if (task_table.contains("override")) {
             int base_task_id = *task_table["override"].value<int>();
             ASSERT(base_task_id < task_id);
@@ -269,22 +421,202 @@ void ConfigServiceInternal::run_all_tasks() const
                     override_table.insert_or_assign(key, val);
             });
             task_table = std::move(override_table);
+            // Overriding tasks usually reuse the outputs of their base task.
+            nodes[base_task_id].dependents.push_back(task_id);
+            ++node.num_pending;
+            node.has_dependencies = true;
+        }
+        if (task_table.contains("depends_on")) {
+            const toml::array &deps = *task_table["depends_on"].as_array();
+            for (int i = 0; i < (int)deps.size(); ++i) {
+                int dep = *deps[i].value<int>();
+                // Also guarantees that the graph is acyclic.
+                ASSERT(dep < task_id, "Task %d can only depend on earlier tasks.", task_id);
+                nodes[dep].dependents.push_back(task_id);
+                ++node.num_pending;
+                node.has_dependencies = true;
+            }
         }
+        node.task_id = task_id;
+        node.task_dir = std::move(task_dir);
+        node.num_threads = task_table["num_threads"].value_or(0);
+        node.table = std::move(task_table);
+    }
 
-        printf("Next task: \n");
-        std::cout << task_table << "\n" << std::endl;
-        std::ofstream write_config(task_dir / "config.toml");
-        write_config << task_table << std::endl;
+    // Tasks run one after another in declaration order unless the config opts in.
+    // With parallel_tasks, a task starts as soon as the tasks it depends on (its override base and depends_on list)
+    // are done, so e.g. I/O-bound conversions can overlap with renders.
+    // NOTE: tasks that run concurrently share the tbb worker pool. num_threads bounds the share of a task.
+    if (!cfg["parallel_tasks"].value_or(false)) {
+#if KS_ENABLE_STATS
+        // Asset loading (and preload_assets) happens before the first task resets the stats.
+        stats_registry().write_json(output_dir / "load_stats.json");
+#endif
+        for (const ConfigTaskNode &node : nodes) {
+            run_task(node, true);
+        }
+        background_writer().flush();
+        return;
+    }
+    int max_parallel_tasks = cfg["max_parallel_tasks"].value_or(num_system_cores());
+    ASSERT(max_parallel_tasks > 0);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<int> ready;
+    for (int task_id = num_tasks - 1; task_id >= 0; --task_id) {
+        if (nodes[task_id].num_pending == 0)
+            ready.push_back(task_id);
+    }
+    int num_running = 0;
+    int num_finished = 0;
+    std::vector<std::thread> threads;
+    std::unique_lock lock(mutex);
+    while (num_finished < num_tasks) {
+        while (!ready.empty() && num_running < max_parallel_tasks) {
+            // Lowest task id first.
+            int task_id = ready.back();
+            ready.pop_back();
+            ++num_running;
+            threads.emplace_back([&, task_id]() {
+                run_task(nodes[task_id], false);
+                std::scoped_lock finished_lock(mutex);
+                --num_running;
+                ++num_finished;
+                for (int dependent : nodes[task_id].dependents) {
+                    if (--nodes[dependent].num_pending == 0) {
+                        ready.push_back(dependent);
+                        std::sort(ready.begin(), ready.end(), std::greater<int>());
+                    }
+                }
+                cv.notify_one();
+            });
+        }
+        cv.wait(lock);
+    }
+    lock.unlock();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+#if KS_ENABLE_STATS
+    // Concurrent tasks count each other's work, so only one dump for the whole run (including asset loading).
+    stats_registry().write_json(output_dir / "stats.json");
+#endif
+    asset_table.write_file_hashes();
+    background_writer().flush();
+}
+
+static StatCounter stat_snapshot_hits("config/snapshot_hits");
+static StatCounter stat_snapshot_misses("config/snapshot_misses");
+
+// Bump to invalidate all existing snapshots.
+constexpr uint64_t snapshot_format_version = 1;
+
+uint64_t hash_file(const fs::path &path, uint64_t seed)
+{
+    MappedFile file(path);
+    return hash_buffer(file.data(), file.size(), seed);
+}
 
-        std::string type = *task_table["type"].value<std::string>();
-        const ConfigTask &task = task_factory.at(type);
+void write_snapshot_file(const fs::path &path, const std::function<bool(const fs::path &temp_path)> &write)
+{
+    fs::path temp_path = path;
+    temp_path += string_format(".%08x.tmp", std::random_device()());
+    std::error_code ec;
+    if (write(temp_path))
+        fs::rename(temp_path, path, ec);
+    if (fs::exists(temp_path, ec))
+        fs::remove(temp_path, ec);
+}
 
-        toml::node_view<const toml::node> view(task_table);
-        ConfigArgs args(std::make_unique<ConfigArgsInternal>(const_cast<ConfigServiceInternal *>(this), view));
-        task(args, task_dir, task_id);
+// Bump to invalidate the cached file hashes.
+constexpr uint64_t file_hashes_version = 1;
 
-        printf("Saving output to [%s]\n\n", task_dir.string().c_str());
+uint64_t ConfigurableTable::hash_input_file(const fs::path &path) const
+{
+    std::error_code ec;
+    fs::path abs_path = fs::absolute(path, ec);
+    uint64_t size = fs::file_size(abs_path, ec);
+    int64_t mtime = (int64_t)fs::last_write_time(abs_path, ec).time_since_epoch().count();
+    if (ec)
+        return hash_file(path);
+    std::string key = abs_path.string();
+    {
+        std::lock_guard<std::mutex> lock(file_hashes_mutex);
+        auto it = file_hashes.find(key);
+        if (it != file_hashes.end() && it->second.size == size && it->second.mtime == mtime)
+            return it->second.hash;
     }
+    // Hashed outside the lock: two threads may hash the same file, but never block each other on large files.
+    uint64_t hash = hash_file(abs_path);
+    std::lock_guard<std::mutex> lock(file_hashes_mutex);
+    file_hashes[std::move(key)] = {size, mtime, hash};
+    file_hashes_dirty = true;
+    return hash;
+}
+
+void ConfigurableTable::read_file_hashes()
+{
+    fs::path path = snapshot_dir / "file_hashes.bin";
+    if (snapshot_dir.empty() || !fs::exists(path))
+        return;
+    BinaryReader reader(path);
+    if (reader.read<uint64_t>() != file_hashes_version)
+        return;
+    size_t count = reader.read<size_t>();
+    for (size_t i = 0; i < count; ++i) {
+        std::vector<char> name = reader.read_vector<char>();
+        FileHash entry = reader.read<FileHash>();
+        file_hashes.insert({std::string(name.begin(), name.end()), entry});
+    }
+}
+
+void ConfigurableTable::write_file_hashes() const
+{
+    std::lock_guard<std::mutex> lock(file_hashes_mutex);
+    if (snapshot_dir.empty() || !file_hashes_dirty)
+        return;
+    write_snapshot_file(snapshot_dir / "file_hashes.bin", [&](const fs::path &temp_path) {
+        BinaryWriter writer(temp_path);
+        writer.write(file_hashes_version);
+        writer.write(file_hashes.size());
+        for (const auto &[name, entry] : file_hashes) {
+            writer.write_vector(std::vector<char>(name.begin(), name.end()));
+            writer.write(entry);
+        }
+        return true;
+    });
+    file_hashes_dirty = false;
+}
+
+// Hashes the asset table and the contents of every file it references, so that a snapshot goes stale with any of
+// its inputs. File contents are only hashed again when their size or modification time changes (see
+// ConfigurableTable::hash_input_file).
+// NOTE: assets referenced by name are not followed, so only snapshot types that don't depend on other assets.
+static uint64_t asset_snapshot_key(const ConfigServiceInternal &service, std::string_view asset_path,
+                                   const toml::table &table)
+{
+    std::ostringstream text;
+    text << table;
+    std::string str = text.str();
+    uint64_t key = hash_buffer(asset_path.data(), asset_path.size(), snapshot_format_version);
+    key = hash_buffer(str.data(), str.size(), key);
+    auto visit = [&](auto &&self, const toml::node &node) -> void {
+        if (const toml::table *t = node.as_table()) {
+            for (auto &&[k, v] : *t)
+                self(self, v);
+        } else if (const toml::array *a = node.as_array()) {
+            for (const toml::node &v : *a)
+                self(self, v);
+        } else if (const toml::value<std::string> *v = node.as_string()) {
+            fs::path p = service.resolve_path(v->get());
+            std::error_code ec;
+            if (fs::is_regular_file(p, ec))
+                key = hash(key, service.asset_table.hash_input_file(p));
+        }
+    };
+    visit(visit, table);
+    return key;
 }
 
 void ConfigurableTable::load(ConfigServiceInternal &service)
@@ -293,16 +625,69 @@ void ConfigurableTable::load(ConfigServiceInternal &service)
         if (service.cfg.contains(field)) {
             const toml::table &table = *service.cfg[field].as_table();
             table.for_each([&](const toml::key &key, const toml::table &val) {
-                toml::node_view<const toml::node> view(val);
-                ConfigArgs args(std::make_unique<ConfigArgsInternal>(&service, view));
-                auto asset = parser(args);
+                auto lazy = std::make_unique<LazyAsset>();
                 std::string path = field + "." + std::string(key.str());
-                assets.insert({std::move(path), std::move(asset)});
+                // NOTE: val lives in service.cfg, which outlives the table.
+                lazy->create = [this, &service, &val, path, field = field,
+                                parser = parser]() -> std::unique_ptr<Configurable> {
+                    toml::node_view<const toml::node> view(val);
+                    ConfigArgs args(std::make_unique<ConfigArgsInternal>(&service, view));
+                    auto snapshot = snapshots.find(field);
+                    if (snapshot_dir.empty() || snapshot == snapshots.end())
+                        return parser(args);
+
+                    fs::path snapshot_file = snapshot_path(path, asset_snapshot_key(service, path, val));
+                    if (fs::exists(snapshot_file)) {
+                        stat_snapshot_hits.add();
+                        return snapshot->second.read(snapshot_file);
+                    }
+                    stat_snapshot_misses.add();
+                    std::unique_ptr<Configurable> asset = parser(args);
+                    if (asset) {
+                        write_snapshot_file(snapshot_file, [&](const fs::path &temp_file) {
+                            return snapshot->second.write(*asset, temp_file);
+                        });
+                    }
+                    return asset;
+                };
+                assets.insert({std::move(path), std::move(lazy)});
             });
         }
     }
 }
 
+fs::path ConfigurableTable::snapshot_path(std::string_view name, uint64_t key) const
+{
+    if (snapshot_dir.empty())
+        return {};
+    return snapshot_dir / string_format("%.*s_%016llx.bin", (int)name.size(), name.data(), (unsigned long long)key);
+}
+
+const Configurable *ConfigurableTable::get(std::string_view path) const
+{
+    auto it = assets.find(path);
+    if (it == assets.end())
+        return nullptr;
+    LazyAsset &lazy = *it->second;
+    std::call_once(lazy.once, [&]() {
+        // Isolate so that this thread does not pick up another asset's construction (which may get this asset)
+        // while waiting inside a nested parallel loop of the parser.
+        tbb::this_task_arena::isolate([&]() { lazy.asset = lazy.create(); });
+        lazy.create = nullptr;
+    });
+    return lazy.asset.get();
+}
+
+void ConfigurableTable::preload() const
+{
+    std::vector<std::string_view> paths;
+    paths.reserve(assets.size());
+    for (const auto &[path, lazy] : assets) {
+        paths.push_back(path);
+    }
+    parallel_for((int)paths.size(), [&](int i) { get(paths[i]); });
+}
+
 ConfigService::~ConfigService() = default;
 ConfigService::ConfigService() : service(std::make_unique<ConfigServiceInternal>()) {}
 
@@ -322,7 +707,24 @@ void ConfigService::register_task(std::string_view name, const ConfigTask &task)
     service->task_factory.insert({std::string(name), task});
 }
 
-void ConfigService::load_assets() { service->asset_table.load(*service); }
+void ConfigService::register_snapshot(std::string_view prefix, const ConfigurableSnapshot &snapshot)
+{
+    service->asset_table.register_snapshot(prefix, snapshot);
+}
+
+void ConfigService::load_assets()
+{
+    if (service->cfg.contains("snapshot_dir")) {
+        fs::path dir = service->resolve_path(*service->cfg["snapshot_dir"].value<std::string>());
+        fs::create_directories(dir);
+        service->asset_table.snapshot_dir = std::move(dir);
+        service->asset_table.read_file_hashes();
+    }
+    service->asset_table.load(*service);
+    if (service->cfg["preload_assets"].value_or(false)) {
+        service->asset_table.preload();
+    }
+}
 
 const ConfigurableTable &ConfigService::asset_table() const { return service->asset_table; }
 
@@ -345,9 +747,10 @@ struct ConfigArgsInternal
     vec4 load_vec4(std::string_view name, bool force_normalize = false,
                    const std::optional<vec4> &default_value = {}) const;
     Transform load_transform(std::string_view name, const std::optional<Transform> &default_value = {}) const;
+    std::vector<Transform> load_transform_n(std::string_view name, std::span<const float> times) const;
     bool load_bool(std::string_view name, const std::optional<bool> &default_value = {}) const;
     std::string load_string(std::string_view name, const std::optional<std::string> &default_value = {}) const;
-    fs::path load_path(std::string_view name) const;
+    fs::path load_path(std::string_view name, const std::optional<fs::path> &default_value = {}) const;
 
     int load_integer(int index) const;
     float load_float(int index) const;
@@ -487,6 +890,16 @@ Transform ConfigArgsInternal::load_transform(std::string_view name, const std::o
     }
 }
 
+std::vector<Transform> ConfigArgsInternal::load_transform_n(std::string_view name, std::span<const float> times) const
+{
+    ASSERT(args.is_table(), "This ConfigArgs is not a table.");
+    ASSERT(args.as_table()->contains(name), "No transform value named [%.*s].", static_cast<int>(name.length()),
+           name.data());
+    std::vector<Transform> transforms(times.size());
+    service->load_transform_field_n(args[name], times, transforms);
+    return transforms;
+}
+
 Transform ConfigArgsInternal::load_transform(int index) const
 {
     ASSERT(args.is_array() || args.is_array_of_tables(), "This ConfigArgs is not an array.");
@@ -535,33 +948,21 @@ std::string ConfigArgsInternal::load_string(int index) const
     return *args[index].value<std::string>();
 }
 
-fs::path ConfigArgsInternal::load_path(std::string_view name) const
+fs::path ConfigArgsInternal::load_path(std::string_view name, const std::optional<fs::path> &default_value) const
 {
     ASSERT(args.is_table(), "This ConfigArgs is not a table.");
+    if (!args.as_table()->contains(name) && default_value)
+        return service->resolve_path(*default_value);
     ASSERT(args.as_table()->contains(name), "No path value named [%.*s].", static_cast<int>(name.length()),
            name.data());
-    fs::path p(*args[name].value<std::string>());
-    if (p.is_absolute()) {
-        return p;
-    } else if (!service->asset_root_dir.empty()) {
-        return service->asset_root_dir / p;
-    } else {
-        return p;
-    }
+    return service->resolve_path(*args[name].value<std::string>());
 }
 
 fs::path ConfigArgsInternal::load_path(int index) const
 {
     ASSERT(args.is_array() || args.is_array_of_tables(), "This ConfigArgs is not an array.");
     ASSERT(index < args.as_array()->size(), "Index out of bound.");
-    fs::path p(*args[index].value<std::string>());
-    if (p.is_absolute()) {
-        return p;
-    } else if (!service->asset_root_dir.empty()) {
-        return service->asset_root_dir / p;
-    } else {
-        return p;
-    }
+    return service->resolve_path(*args[index].value<std::string>());
 }
 
 ConfigArgs::~ConfigArgs() = default;
@@ -642,6 +1043,11 @@ Transform ConfigArgs::load_transform(std::string_view name, const std::optional<
     return args->load_transform(name, default_value);
 }
 
+std::vector<Transform> ConfigArgs::load_transform_n(std::string_view name, std::span<const float> times) const
+{
+    return args->load_transform_n(name, times);
+}
+
 Transform ConfigArgs::load_transform(int index) const { return args->load_transform(index); }
 
 bool ConfigArgs::load_bool(std::string_view name, const std::optional<bool> &default_value) const
@@ -658,7 +1064,10 @@ std::string ConfigArgs::load_string(std::string_view name, const std::optional<s
 
 std::string ConfigArgs::load_string(int index) const { return args->load_string(index); }
 
-fs::path ConfigArgs::load_path(std::string_view name) const { return args->load_path(name); }
+fs::path ConfigArgs::load_path(std::string_view name, const std::optional<fs::path> &default_value) const
+{
+    return args->load_path(name, default_value);
+}
 
 fs::path ConfigArgs::load_path(int index) const { return args->load_path(index); }
 
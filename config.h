@@ -4,10 +4,13 @@
 #include <filesystem>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <vector>
 namespace fs = std::filesystem;
 
 namespace ks
@@ -49,9 +52,11 @@ struct ConfigArgs
     vec4 load_vec4(std::string_view name, bool force_normalize = false,
                    const std::optional<vec4> &default_value = {}) const;
     Transform load_transform(std::string_view name, const std::optional<Transform> &default_value = {}) const;
+    // Evaluated at all the given times at once (e.g. the frames of a sequence) instead of one update_time per time.
+    std::vector<Transform> load_transform_n(std::string_view name, std::span<const float> times) const;
     bool load_bool(std::string_view name, const std::optional<bool> &default_value = {}) const;
     std::string load_string(std::string_view name, const std::optional<std::string> &default_value = {}) const;
-    fs::path load_path(std::string_view name) const;
+    fs::path load_path(std::string_view name, const std::optional<fs::path> &default_value = {}) const;
 
     int load_integer(int index) const;
     float load_float(int index) const;
@@ -78,6 +83,14 @@ struct Configurable
 };
 using ConfigurableParser = std::function<std::unique_ptr<Configurable>(const ConfigArgs &args)>;
 
+// Binary snapshot of parsed assets of one type, so that later launches with unchanged inputs skip the parser.
+// write returns false if the given asset can't be snapshotted (it's parsed again next time).
+struct ConfigurableSnapshot
+{
+    std::function<bool(const Configurable &asset, const fs::path &path)> write;
+    std::function<std::unique_ptr<Configurable>(const fs::path &path)> read;
+};
+
 struct ConfigurableTable
 {
     void register_parser(std::string_view prefix, const ConfigurableParser &parser)
@@ -91,15 +104,18 @@ struct ConfigurableTable
         parsers.insert({std::string(prefix), [&](const ConfigArgs &args) { return parser(args); }});
     }
 
-    void load(ConfigServiceInternal &service);
-
-    const Configurable *get(std::string_view path) const
+    void register_snapshot(std::string_view prefix, const ConfigurableSnapshot &snapshot)
     {
-        auto it = assets.find(path);
-        if (it == assets.end())
-            return nullptr;
-        return it->second.get();
+        snapshots.insert({std::string(prefix), snapshot});
     }
+
+    // Only records the assets. Each one is constructed on its first get() (or by preload()).
+    void load(ConfigServiceInternal &service);
+    // Construct all assets that are not constructed yet in parallel.
+    void preload() const;
+
+    // Thread-safe. Assets may get other assets while being constructed.
+    const Configurable *get(std::string_view path) const;
     template <typename T>
     const T *get(std::string_view path) const
     {
@@ -125,10 +141,45 @@ struct ConfigurableTable
         return std::unique_ptr<T>(t_obj);
     }
 
-    StringHashTable<std::unique_ptr<Configurable>> assets;
+    // Path of the snapshot of some derived data (e.g. "sky_light"), or empty if snapshots are disabled.
+    // key should hash everything the data depends on, including the contents of the input files (see hash_file).
+    fs::path snapshot_path(std::string_view name, uint64_t key) const;
+    // Content hash of an input file for snapshot keys (see hash_file). Thread-safe. A file is only read again when its
+    // size or modification time changes, and the hashes are kept across launches in snapshot_dir.
+    uint64_t hash_input_file(const fs::path &path) const;
+    void read_file_hashes();
+    void write_file_hashes() const;
+
+    struct LazyAsset
+    {
+        std::once_flag once;
+        std::function<std::unique_ptr<Configurable>()> create;
+        std::unique_ptr<Configurable> asset;
+    };
+    StringHashTable<std::unique_ptr<LazyAsset>> assets;
     std::vector<std::pair<std::string, ConfigurableParser>> parsers;
+    StringHashTable<ConfigurableSnapshot> snapshots;
+    // Set by the config (snapshot_dir = "..."). Snapshots are disabled if empty.
+    fs::path snapshot_dir;
+
+    struct FileHash
+    {
+        uint64_t size;
+        int64_t mtime;
+        uint64_t hash;
+    };
+    // Keyed by absolute path.
+    mutable StringHashTable<FileHash> file_hashes;
+    mutable bool file_hashes_dirty = false;
+    mutable std::mutex file_hashes_mutex;
 };
 
+// Content hash of a file, for snapshot keys.
+uint64_t hash_file(const fs::path &path, uint64_t seed = 0);
+// Calls write on a temporary file that is then renamed to path (if write returns true), so that concurrent
+// launches never read partial snapshots.
+void write_snapshot_file(const fs::path &path, const std::function<bool(const fs::path &temp_path)> &write);
+
 // (args, task_dir, task_id);
 using ConfigTask = std::function<void(const ConfigArgs &args, const fs::path &, int)>;
 
@@ -143,7 +194,11 @@ struct ConfigService
 
     void register_asset(std::string_view prefix, const ConfigurableParser &parser);
     void register_task(std::string_view name, const ConfigTask &task);
+    // Assets of the given prefix are snapshotted if the config sets snapshot_dir = "...". The key of a snapshot
+    // hashes the asset table and the contents of every file it references.
+    void register_snapshot(std::string_view prefix, const ConfigurableSnapshot &snapshot);
 
+    // Assets are constructed lazily on first access unless the config sets preload_assets = true.
     void load_assets();
     const ConfigurableTable &asset_table() const;
 
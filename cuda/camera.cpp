@@ -34,6 +34,21 @@ void Camera::load_from_config(const ks::ConfigArgs &args)
     *this = Camera(ksc::vec3(camera_pos.x(), camera_pos.y(), camera_pos.z()),
                    ksc::vec3(camera_target.x(), camera_target.y(), camera_target.z()),
                    ksc::vec3(camera_up.x(), camera_up.y(), camera_up.z()), camera_vfov, camera_aspect);
+    if (args.contains("lens")) {
+        load_lens_from_config(args["lens"]);
+    }
+}
+
+void Camera::load_lens_from_config(const ks::ConfigArgs &args)
+{
+    aperture_radius = args.load_float("aperture_radius");
+    focus_distance = args.load_float("focus_distance");
+    blades = args.load_integer("blades", 0);
+    blade_rotation = ksc::to_radian(args.load_float("blade_rotation", 0.0f));
+    if (args.contains("aperture_map")) {
+        fprintf(stderr, "Aperture maps are not supported by the GPU camera, using the blade shape instead.\n");
+    }
+    ASSERT(aperture_radius >= 0.0f && focus_distance > 0.0f, "Invalid thin lens.");
 }
 
 void copy_accessor_to_linear(const std::vector<tinygltf::Buffer> &buffers,
@@ -226,6 +241,15 @@ void CameraAnimation::load_from_config(const ks::ConfigArgs &args)
             q = r * q;
         }
     }
+
+    if (args.contains("lens")) {
+        Camera lens;
+        lens.load_lens_from_config(args["lens"]);
+        aperture_radius = lens.aperture_radius;
+        focus_distance = lens.focus_distance;
+        blades = lens.blades;
+        blade_rotation = lens.blade_rotation;
+    }
 }
 
-} // namespace ksc
+} // namespace ksc
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "camera.cuh"
+#include "rng.cuh"
 #include <algorithm>
 
 namespace ksc
@@ -112,7 +113,29 @@ Camera::Camera(const vec3 &position, const vec3 &target, const vec3 &up, float l
     camera_to_world = Transform(camera_to_world_m);
 }
 
+vec2 Camera::sample_aperture(const vec2 &u) const
+{
+    if (blades < 3) {
+        return sample_disk(u);
+    }
+    // Pick a blade triangle (center, v0, v1) and sample it uniformly.
+    float x = u.x * (float)blades;
+    int k = min((int)x, blades - 1);
+    float u0 = x - (float)k;
+    float wedge = pi * 2.0f / (float)blades;
+    float phi0 = blade_rotation + wedge * (float)k;
+    vec2 v0(cos(phi0), sin(phi0));
+    vec2 v1(cos(phi0 + wedge), sin(phi0 + wedge));
+    float s = sqrt(u0);
+    return s * ((1.0f - u.y) * v0 + u.y * v1);
+}
+
 Ray Camera::spawn_ray(const vec2 &film_pos, const vec2i &film_res, int spp) const
+{
+    return spawn_ray(film_pos, vec2::zero(), film_res, spp);
+}
+
+Ray Camera::spawn_ray(const vec2 &film_pos, const vec2 &u_lens, const vec2i &film_res, int spp) const
 {
     Ray ray;
     vec3 ndc_pos(film_pos.x * 2.0f - 1.0f, film_pos.y * 2.0f - 1.0f, 1.0f);
@@ -152,6 +175,23 @@ Ray Camera::spawn_ray(const vec2 &film_pos, const vec2i &film_res, int spp) cons
         ray.rx_dir = ray.dir + (ray.rx_dir - ray.dir) * scale;
         ray.ry_dir = ray.dir + (ray.ry_dir - ray.dir) * scale;
     }
+
+    if (has_lens()) {
+        // Same as ks::CameraRaySetup::spawn_ray: move onto the lens and aim at the focus plane.
+        vec2 a = aperture_radius * sample_aperture(u_lens);
+        vec3 offset = camera_to_world.direction(vec3(a.x, a.y, 0.0f));
+        vec3 forward = direction();
+        auto focus_point = [&](const vec3 &o, const vec3 &d) { return o + d * (focus_distance / dot(d, forward)); };
+        vec3 focus = focus_point(ray.origin, ray.dir);
+        vec3 focus_x = focus_point(ray.rx_origin, ray.rx_dir);
+        vec3 focus_y = focus_point(ray.ry_origin, ray.ry_dir);
+        ray.origin += offset;
+        ray.rx_origin += offset;
+        ray.ry_origin += offset;
+        ray.dir = normalize(focus - ray.origin);
+        ray.rx_dir = normalize(focus_x - ray.rx_origin);
+        ray.ry_dir = normalize(focus_y - ray.ry_origin);
+    }
     return ray;
 }
 
@@ -195,11 +235,13 @@ Camera CameraAnimation::eval(float time) const
     quat rotation = slerp(delta, rotation_values[left], rotation_values[right]);
     mat4 m = make_affine(rotation.to_matrix(), translation);
     Transform to_world(m, affine_inverse(m));
-    if (perspective) {
-        return Camera(to_world, vfov, aspect);
-    } else {
-        return Camera(to_world, left, right, bottom, top, near, far);
-    }
+    Camera camera = perspective ? Camera(to_world, vfov, aspect)
+                                : Camera(to_world, this->left, this->right, bottom, top, near, far);
+    camera.aperture_radius = aperture_radius;
+    camera.focus_distance = focus_distance;
+    camera.blades = blades;
+    camera.blade_rotation = blade_rotation;
+    return camera;
 }
 
 } // namespace ksc
\ No newline at end of file
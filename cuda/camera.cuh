@@ -23,6 +23,15 @@ struct Camera
 
     CUDA_HOST_DEVICE
     Ray spawn_ray(const ksc::vec2 &film_pos, const ksc::vec2i &film_res, int scale_spp) const;
+    // u_lens is only used with a lens (see ks::ThinLens).
+    CUDA_HOST_DEVICE
+    Ray spawn_ray(const ksc::vec2 &film_pos, const ksc::vec2 &u_lens, const ksc::vec2i &film_res,
+                  int scale_spp) const;
+
+    CUDA_HOST_DEVICE
+    bool has_lens() const { return aperture_radius > 0.0f; }
+    CUDA_HOST_DEVICE
+    ksc::vec2 sample_aperture(const ksc::vec2 &u) const;
 
     CUDA_HOST_DEVICE
     ksc::vec3 position() const
@@ -41,8 +50,15 @@ struct Camera
     ksc::Transform camera_to_world;
     bool orthographic = false;
 
+    // Thin lens. No aperture maps on the GPU, only circular or polygonal bokeh.
+    float aperture_radius = 0.0f;
+    float focus_distance = 1.0f;
+    int blades = 0;
+    float blade_rotation = 0.0f;
+
 #ifdef CPP_CODE_ONLY
     void load_from_config(const ks::ConfigArgs &args);
+    void load_lens_from_config(const ks::ConfigArgs &args);
 #endif
 };
 
@@ -63,6 +79,11 @@ struct CameraAnimation
     bool perspective;
     float vfov, aspect;
     float left, right, bottom, top, near, far;
+    // Not animated.
+    float aperture_radius = 0.0f;
+    float focus_distance = 1.0f;
+    int blades = 0;
+    float blade_rotation = 0.0f;
 
     std::vector<float> translation_keys;
     std::vector<ksc::vec3> translation_values;
@@ -1,22 +1,194 @@
 #include "memory.cuh"
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
 
 namespace ksc
 {
 
+namespace
+{
+
+enum class AllocKind
+{
+    Managed,
+    Device,
+    // cudaMalloc where the device doesn't support memory pools.
+    DeviceUnpooled,
+};
+
+struct Allocation
+{
+    AllocKind kind;
+    size_t size;
+};
+
+struct AllocRegistry
+{
+    void add(void *ptr, AllocKind kind, size_t size)
+    {
+        std::scoped_lock lock(mutex);
+        allocations.emplace(ptr, Allocation{kind, size});
+        if (kind == AllocKind::Managed) {
+            ++stats.managed_allocs;
+            stats.managed_bytes += size;
+            stats.peak_managed_bytes = std::max(stats.peak_managed_bytes, stats.managed_bytes);
+        } else {
+            ++stats.device_allocs;
+            stats.device_bytes += size;
+            stats.peak_device_bytes = std::max(stats.peak_device_bytes, stats.device_bytes);
+        }
+    }
+
+    Allocation remove(void *ptr)
+    {
+        std::scoped_lock lock(mutex);
+        auto it = allocations.find(ptr);
+        CUDA_ASSERT_FMT(it != allocations.end(), "Freeing memory not allocated by ksc (%p).", ptr);
+        Allocation allocation = it->second;
+        allocations.erase(it);
+        if (allocation.kind == AllocKind::Managed) {
+            stats.managed_bytes -= allocation.size;
+        } else {
+            stats.device_bytes -= allocation.size;
+        }
+        return allocation;
+    }
+
+    std::mutex mutex;
+    std::unordered_map<void *, Allocation> allocations;
+    CudaAllocStats stats;
+};
+
+AllocRegistry &alloc_registry()
+{
+    static AllocRegistry registry;
+    return registry;
+}
+
+struct DeviceInfo
+{
+    // Null if memory pools aren't supported.
+    cudaMemPool_t pool = nullptr;
+    bool concurrent_managed_access = false;
+};
+
+constexpr int max_devices = 16;
+
+const DeviceInfo &device_info(int device)
+{
+    static DeviceInfo infos[max_devices];
+    static std::once_flag flags[max_devices];
+    CUDA_ASSERT_FMT(device >= 0 && device < max_devices, "Unsupported device id %d.", device);
+    std::call_once(flags[device], [device] {
+        DeviceInfo &info = infos[device];
+        int pools_supported = 0;
+        cuda_check(cudaDeviceGetAttribute(&pools_supported, cudaDevAttrMemoryPoolsSupported, device));
+        if (pools_supported) {
+            cuda_check(cudaDeviceGetDefaultMemPool(&info.pool, device));
+            // By default the pool trims itself to nothing at each sync. Keep freed memory for the next allocations.
+            uint64_t threshold = UINT64_MAX;
+            cuda_check(cudaMemPoolSetAttribute(info.pool, cudaMemPoolAttrReleaseThreshold, &threshold));
+        }
+        int concurrent = 0;
+        cuda_check(cudaDeviceGetAttribute(&concurrent, cudaDevAttrConcurrentManagedAccess, device));
+        info.concurrent_managed_access = concurrent != 0;
+    });
+    return infos[device];
+}
+
+int current_device()
+{
+    int device = 0;
+    cuda_check(cudaGetDevice(&device));
+    return device;
+}
+
+} // namespace
+
 void *cuda_alloc_managed(size_t size)
 {
     void *ptr = nullptr;
     cuda_check(cudaMallocManaged(&ptr, size));
+    alloc_registry().add(ptr, AllocKind::Managed, size);
     return ptr;
 }
 
-void *cuda_alloc_device(size_t size)
+void *cuda_alloc_device(size_t size) { return cuda_alloc_device_async(size, 0); }
+
+void *cuda_alloc_device_async(size_t size, cudaStream_t stream)
 {
     void *ptr = nullptr;
-    cuda_check(cudaMalloc(&ptr, size));
+    cudaMemPool_t pool = device_info(current_device()).pool;
+    if (pool) {
+        cuda_check(cudaMallocFromPoolAsync(&ptr, size, pool, stream));
+        alloc_registry().add(ptr, AllocKind::Device, size);
+    } else {
+        cuda_check(cudaMalloc(&ptr, size));
+        alloc_registry().add(ptr, AllocKind::DeviceUnpooled, size);
+    }
     return ptr;
 }
 
-void cuda_free(void *ptr) { cuda_check(cudaFree(ptr)); }
+void cuda_free(void *ptr) { cuda_free_async(ptr, 0); }
+
+void cuda_free_async(void *ptr, cudaStream_t stream)
+{
+    if (!ptr) {
+        return;
+    }
+    Allocation allocation = alloc_registry().remove(ptr);
+    if (allocation.kind == AllocKind::Device) {
+        cuda_check(cudaFreeAsync(ptr, stream));
+    } else {
+        cuda_check(cudaFree(ptr));
+    }
+}
+
+void cuda_prefetch_managed(const void *ptr, size_t size, cudaStream_t stream, bool read_mostly, int device)
+{
+    if (!ptr || size == 0) {
+        return;
+    }
+    if (device < 0) {
+        device = current_device();
+    }
+    if (!device_info(device).concurrent_managed_access) {
+        return;
+    }
+    if (read_mostly) {
+        cuda_check(cudaMemAdvise(ptr, size, cudaMemAdviseSetReadMostly, device));
+    }
+    cuda_check(cudaMemPrefetchAsync(ptr, size, device, stream));
+    std::scoped_lock lock(alloc_registry().mutex);
+    alloc_registry().stats.prefetched_bytes += size;
+}
+
+CudaAllocStats cuda_alloc_stats()
+{
+    CudaAllocStats stats;
+    {
+        std::scoped_lock lock(alloc_registry().mutex);
+        stats = alloc_registry().stats;
+    }
+    if (cudaMemPool_t pool = device_info(current_device()).pool) {
+        uint64_t reserved = 0;
+        cuda_check(cudaMemPoolGetAttribute(pool, cudaMemPoolAttrReservedMemCurrent, &reserved));
+        stats.pool_reserved_bytes = (size_t)reserved;
+    }
+    return stats;
+}
+
+void print_cuda_alloc_stats()
+{
+    CudaAllocStats stats = cuda_alloc_stats();
+    printf("[CUDA memory]: managed %llu allocs, %zu bytes live (peak %zu), %zu bytes prefetched\n",
+           (unsigned long long)stats.managed_allocs, stats.managed_bytes, stats.peak_managed_bytes,
+           stats.prefetched_bytes);
+    printf("[CUDA memory]: device %llu allocs, %zu bytes live (peak %zu), %zu bytes reserved by the pool\n",
+           (unsigned long long)stats.device_allocs, stats.device_bytes, stats.peak_device_bytes,
+           stats.pool_reserved_bytes);
+}
 
 } // namespace ksc
\ No newline at end of file
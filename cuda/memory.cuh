@@ -13,10 +13,39 @@ namespace ksc
 
 void *cuda_alloc_managed(size_t size);
 
+// Device memory comes from the memory pool of the current device (cudaMallocFromPoolAsync) where supported, so
+// allocations after warm-up reuse freed memory instead of calling into the driver. Freed memory stays in the pool.
+// cuda_alloc_device is ordered on the legacy default stream (which other blocking streams sync with).
 void *cuda_alloc_device(size_t size);
+// Usable by work on stream (and after it) only.
+void *cuda_alloc_device_async(size_t size, cudaStream_t stream);
 
 // Same for device or managed memory
 void cuda_free(void *ptr);
+// Device memory is returned to the pool once the work queued on stream so far is done. Same as cuda_free otherwise.
+void cuda_free_async(void *ptr, cudaStream_t stream);
+
+// Migrates managed memory to device (the current one if negative) ahead of the kernels that use it instead of faulting
+// it in page by page on first touch. With read_mostly, the pages are also duplicated instead of migrated back when read
+// on the host. No-op where managed memory can't be prefetched (no concurrent managed access).
+void cuda_prefetch_managed(const void *ptr, size_t size, cudaStream_t stream = 0, bool read_mostly = true,
+                           int device = -1);
+
+struct CudaAllocStats
+{
+    uint64_t managed_allocs = 0;
+    uint64_t device_allocs = 0;
+    // Live.
+    size_t managed_bytes = 0;
+    size_t device_bytes = 0;
+    size_t peak_managed_bytes = 0;
+    size_t peak_device_bytes = 0;
+    size_t prefetched_bytes = 0;
+    // Memory held by the pool of the current device for reuse (including live allocations).
+    size_t pool_reserved_bytes = 0;
+};
+CudaAllocStats cuda_alloc_stats();
+void print_cuda_alloc_stats();
 
 // Cuda also supports alloca in device code since 11.3.
 // Variable length array on stack. Be very careful about this!!
@@ -603,6 +632,14 @@ struct CudaManagedArray
     CUDA_HOST_DEVICE
     operator span<const T>() const { return MakeConstSpan(ptr.get(), size); }
 
+    // See cuda_prefetch_managed. Call once the array is filled on the host.
+    void prefetch(cudaStream_t stream = 0, bool read_mostly = true) const
+    {
+        if (size > 0) {
+            cuda_prefetch_managed(ptr.get(), sizeof(T) * size, stream, read_mostly);
+        }
+    }
+
     unique_ptr<T[], CudaManagedObjectArrayDeleter<T[]>> ptr;
     size_t size = 0;
 };
@@ -635,8 +672,11 @@ struct CudaDeviceObjectArrayDeleter
         if (!obj) {
             return;
         }
-        cuda_free(obj);
+        cuda_free_async(obj, stream);
     }
+
+    // The stream the array was allocated on: freed after the work queued on it.
+    cudaStream_t stream = 0;
 };
 
 template <typename T>
@@ -667,12 +707,26 @@ unique_ptr<T[], CudaDeviceObjectArrayDeleter<T[]>> make_unique_for_overwrite_cud
     return p;
 }
 
+// Allocated and freed in the order of stream (see cuda_alloc_device_async).
+template <typename T>
+    requires(!std::is_array_v<T>)
+unique_ptr<T[], CudaDeviceObjectArrayDeleter<T[]>> make_unique_for_overwrite_cuda_device(size_t n,
+                                                                                          cudaStream_t stream)
+{
+    T *arr = reinterpret_cast<T *>(cuda_alloc_device_async(sizeof(T) * n, stream));
+    return unique_ptr<T[], CudaDeviceObjectArrayDeleter<T[]>>(arr, CudaDeviceObjectArrayDeleter<T[]>{stream});
+}
+
 template <typename T>
     requires(!std::is_array_v<T>)
 struct CudaDeviceArray
 {
     CudaDeviceArray() = default;
     explicit CudaDeviceArray(size_t size) : ptr(make_unique_for_overwrite_cuda_device<T>(size)), size(size) {}
+    // Scratch memory of the work on stream: allocated from and returned to the pool in stream order.
+    CudaDeviceArray(size_t size, cudaStream_t stream)
+        : ptr(make_unique_for_overwrite_cuda_device<T>(size, stream)), size(size)
+    {}
 
     explicit CudaDeviceArray(span<const T> data)
         : ptr(make_unique_for_overwrite_cuda_device<T>(data.size())), size(data.size())
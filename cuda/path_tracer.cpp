@@ -0,0 +1,273 @@
+#include "path_tracer.cuh"
+#include "../file_util.h"
+#include "../distrib.h"
+#include "../geometry.h"
+#include "../hash.h"
+#include "../light.h"
+#include "../material.h"
+#include "../principled_bsdf.h"
+#include "../render_target.h"
+#include "../scene.h"
+#include "../shader_field.h"
+#include "../texture.h"
+#include <unordered_map>
+
+namespace ksc
+{
+
+void GPUPathTracerOptions::load_from_config(const ks::ConfigArgs &args)
+{
+    spp = (uint32_t)args.load_integer("spp", 16);
+    max_depth = (uint32_t)args.load_integer("max_depth", 8);
+    rr_start_depth = (uint32_t)args.load_integer("rr_start_depth", 3);
+    wave_size = (uint32_t)args.load_integer("wave_size", 1 << 20);
+}
+
+static vec3 to_ksc(const ks::vec3 &v) { return vec3(v.x(), v.y(), v.z()); }
+static vec2 to_ksc(const ks::vec2 &v) { return vec2(v.x(), v.y()); }
+
+// Mip 0, read as normalized float RGBA with hardware bilinear filtering. Block-compressed textures are uploaded as is
+// (see Texture2D), other types are expanded to float.
+static Texture2D upload_texture(const ks::Texture &texture)
+{
+    cudaTextureDesc tex_desc{};
+    tex_desc.addressMode[0] = cudaAddressModeWrap;
+    tex_desc.addressMode[1] = cudaAddressModeWrap;
+    tex_desc.filterMode = cudaFilterModeLinear;
+    tex_desc.normalizedCoords = 1;
+
+    if (ks::is_block_compressed(texture.data_type)) {
+        cudaChannelFormatDesc format_desc;
+        switch (texture.data_type) {
+        case ks::TextureDataType::bc1:
+            format_desc = cudaCreateChannelDesc<cudaChannelFormatKindUnsignedBlockCompressed1>();
+            break;
+        case ks::TextureDataType::bc4:
+            format_desc = cudaCreateChannelDesc<cudaChannelFormatKindUnsignedBlockCompressed4>();
+            break;
+        case ks::TextureDataType::bc5:
+        default:
+            format_desc = cudaCreateChannelDesc<cudaChannelFormatKindUnsignedBlockCompressed5>();
+            break;
+        }
+        tex_desc.readMode = cudaReadModeNormalizedFloat;
+        const ks::TextureMip &mip = texture.mips[0];
+        std::vector<std::byte> blocks((size_t)mip.ures * mip.vres * mip.stride);
+        mip.copy_to_linear_array(blocks.data());
+        return Texture2D(texture.width, texture.height, format_desc, tex_desc, {blocks.data(), blocks.size()});
+    }
+
+    ASSERT(texture.num_channels <= 4, "GPUScene textures have at most 4 channels.");
+    std::vector<float4> texels((size_t)texture.width * texture.height);
+    for (int y = 0; y < texture.height; ++y)
+        for (int x = 0; x < texture.width; ++x) {
+            float c[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+            texture.fetch_as_float(x, y, 0, {c, (size_t)texture.num_channels});
+            texels[(size_t)y * texture.width + x] = {c[0], c[1], c[2], c[3]};
+        }
+    tex_desc.readMode = cudaReadModeElementType;
+    return Texture2D(texture.width, texture.height, cudaCreateChannelDesc<float4>(), tex_desc,
+                     {reinterpret_cast<const std::byte *>(texels.data()), sizeof(float4) * texels.size()});
+}
+
+// CDFs of the sky distribution in the layout of GPUSkyLight.
+static void flatten_sky_distrib(const ks::SkyLight &sky, std::vector<float> &margin_cdf, std::vector<float> &cond_cdf,
+                                uint32_t &nx, uint32_t &ny)
+{
+    auto append = [](const ks::DistribTable &table, std::vector<float> &cdf) {
+        cdf.insert(cdf.end(), table.cdf.begin(), table.cdf.end());
+    };
+    if (sky.use_alias_table) {
+        // Same pmf, sampled by CDF inversion instead.
+        auto to_cdf_table = [](const ks::AliasTable &alias) {
+            std::vector<float> pmf(alias.size());
+            for (uint32_t i = 0; i < alias.size(); ++i)
+                pmf[i] = alias.bins[i].p;
+            return ks::DistribTable(pmf.data(), alias.size());
+        };
+        append(to_cdf_table(sky.alias_distrib.margin), margin_cdf);
+        for (const ks::AliasTable &row : sky.alias_distrib.cond)
+            append(to_cdf_table(row), cond_cdf);
+        nx = sky.alias_distrib.cond[0].size();
+        ny = (uint32_t)sky.alias_distrib.cond.size();
+    } else {
+        append(sky.distrib.margin, margin_cdf);
+        for (const ks::DistribTable &row : sky.distrib.cond)
+            append(row, cond_cdf);
+        nx = (uint32_t)sky.distrib.cond[0].cdf.size() - 1;
+        ny = (uint32_t)sky.distrib.cond.size();
+    }
+}
+
+static GPUMaterial convert_material(const ks::Material *material, std::vector<Texture2D> &textures)
+{
+    GPUMaterial m;
+    const ks::PrincipledBRDF *brdf = material ? dynamic_cast<const ks::PrincipledBRDF *>(material->bsdf) : nullptr;
+    if (!brdf) {
+        printf("[GPUScene]: Only PrincipledBRDF is supported, using the default material instead.\n");
+        return m;
+    }
+    ks::vec2 center(0.5f, 0.5f);
+    ks::mat2 duvdxy = ks::mat2::Zero();
+    if (auto tex = dynamic_cast<const ks::TextureField<3> *>(brdf->basecolor.get())) {
+        textures.push_back(upload_texture(*tex->texture));
+        m.basecolor_texture = textures.back();
+        for (int i = 0; i < 3; ++i)
+            m.swizzle[i] = tex->swizzle[i];
+        m.flip_v = tex->flip_v;
+        m.uv_scale = to_ksc(tex->uv_scale);
+        m.uv_offset = to_ksc(tex->uv_offset);
+    } else {
+        ks::color3 c = (*brdf->basecolor)(center, duvdxy);
+        m.basecolor = color3(c[0], c[1], c[2]);
+    }
+    m.roughness = (*brdf->roughness)(center, duvdxy)[0];
+    m.metallic = (*brdf->metallic)(center, duvdxy)[0];
+    m.specular = (*brdf->specular)(center, duvdxy)[0];
+    return m;
+}
+
+void GPUScene::load_from_scene(const ks::Scene &scene, std::span<const ks::Light *const> lights,
+                               const SBVHBuildOption &bvh_option, const fs::path &bvh_cache_dir)
+{
+    std::vector<vec3> world_vertices;
+    std::vector<vec3> world_normals;
+    std::vector<vec2> world_texcoords;
+    std::vector<uint32_t> world_indices;
+    std::vector<uint32_t> tri_material_ids;
+    std::vector<GPUMaterial> gpu_materials;
+    std::unordered_map<const ks::Material *, uint32_t> material_index;
+    bool any_normals = false;
+    bool any_texcoords = false;
+
+    // Instance groups are flattened.
+    scene.for_each_subscene_instance([&](const ks::SubSceneInstance &instance, const ks::Transform &to_world) {
+        const ks::SubScene &subscene = *scene.subscenes[instance.prototype];
+        for (uint32_t geom_id = 0; geom_id < (uint32_t)subscene.geometries.size(); ++geom_id) {
+            const ks::MeshGeometry *mesh = dynamic_cast<const ks::MeshGeometry *>(subscene.geometries[geom_id].get());
+            if (!mesh) {
+                printf("[GPUScene]: Only meshes are supported, skipping geometry %u of subscene %u.\n", geom_id,
+                       instance.prototype);
+                continue;
+            }
+            const ks::MeshData &data = *mesh->data;
+            uint32_t base = (uint32_t)world_vertices.size();
+            for (int v = 0; v < data.vertex_count(); ++v) {
+                world_vertices.push_back(to_ksc(to_world.point(data.get_pos(v))));
+                world_normals.push_back(data.has_vertex_normal()
+                                            ? to_ksc(to_world.normal(data.get_vertex_normal(v)))
+                                            : vec3(0.0f));
+                world_texcoords.push_back(data.has_texcoord() ? to_ksc(data.get_texcoord(v)) : vec2(0.0f));
+            }
+            any_normals |= data.has_vertex_normal();
+            any_texcoords |= data.has_texcoord();
+            for (uint32_t index : data.index_buffer()) {
+                world_indices.push_back(base + index);
+            }
+
+            const ks::Material *material = subscene.materials[geom_id];
+            auto it = material_index.find(material);
+            if (it == material_index.end()) {
+                it = material_index.emplace(material, (uint32_t)gpu_materials.size()).first;
+                gpu_materials.push_back(convert_material(material, textures));
+            }
+            tri_material_ids.insert(tri_material_ids.end(), data.tri_count(), it->second);
+        }
+    });
+    ASSERT(!world_indices.empty(), "GPUScene needs at least one triangle.");
+
+    // One cache file per flattened scene. The file is still validated against the mesh and options when loaded.
+    uint64_t scene_hash = ks::hash_buffer(world_vertices.data(), sizeof(vec3) * world_vertices.size());
+    scene_hash = ks::hash_buffer(world_indices.data(), sizeof(uint32_t) * world_indices.size(), scene_hash);
+    fs::path cache_dir = bvh_cache_dir.empty() ? fs::temp_directory_path() / "ksc_sbvh_cache" : bvh_cache_dir;
+    fs::create_directories(cache_dir);
+    fs::path cache_path = cache_dir / ks::string_format("sbvh_%016llx.bin", (unsigned long long)scene_hash);
+    bvh = make_unique_cuda_managed<SBVH>(bvh_option, span<const vec3>(world_vertices.data(), world_vertices.size()),
+                                         span<const uint32_t>(world_indices.data(), world_indices.size()), cache_path);
+    if (any_normals)
+        vertex_normals = CudaManagedArray<vec3>(span<const vec3>(world_normals.data(), world_normals.size()));
+    if (any_texcoords)
+        texcoords = CudaManagedArray<vec2>(span<const vec2>(world_texcoords.data(), world_texcoords.size()));
+    material_ids = CudaManagedArray<uint32_t>(span<const uint32_t>(tri_material_ids.data(), tri_material_ids.size()));
+    materials = CudaManagedArray<GPUMaterial>(span<const GPUMaterial>(gpu_materials.data(), gpu_materials.size()));
+
+    std::vector<GPUDirectionalLight> dir_lights;
+    for (const ks::Light *light : lights) {
+        if (auto dir_light = dynamic_cast<const ks::DirectionalLight *>(light)) {
+            ks::color3 L = dir_light->L;
+            dir_lights.push_back({color3(L[0], L[1], L[2]), to_ksc(dir_light->dir)});
+        } else if (auto sky_light = dynamic_cast<const ks::SkyLight *>(light)) {
+            load_sky(*sky_light);
+        } else {
+            printf("[GPUScene]: Unsupported light type, skipped.\n");
+        }
+    }
+    directional_lights =
+        CudaManagedArray<GPUDirectionalLight>(span<const GPUDirectionalLight>(dir_lights.data(), dir_lights.size()));
+
+    // Everything above is only read by kernels from now on: migrate it before the first launch rather than faulting
+    // it in from every thread of the first wave.
+    cuda_prefetch_managed(bvh.get(), sizeof(SBVH));
+    bvh->prefetch();
+    vertex_normals.prefetch();
+    texcoords.prefetch();
+    material_ids.prefetch();
+    materials.prefetch();
+    directional_lights.prefetch();
+    sky_margin_cdf.prefetch();
+    sky_cond_cdf.prefetch();
+    print_cuda_alloc_stats();
+}
+
+void GPUScene::load_sky(const ks::SkyLight &sky_light)
+{
+    ASSERT(!sky.map, "GPUScene supports at most one sky light.");
+    if (!sky_light.portals.empty() || sky_light.visibility) {
+        printf("[GPUScene]: Sky portals and visibility sampling are not supported, sampling the map only.\n");
+    }
+
+    const ks::SkyLight::SkyMap &map = sky_light.map;
+    std::vector<float4> texels((size_t)map.ures * map.vres);
+    for (int v = 0; v < map.vres; ++v)
+        for (int u = 0; u < map.ures; ++u) {
+            const ks::color3 &L = map(u, v);
+            texels[(size_t)v * map.ures + u] = {L[0], L[1], L[2], 1.0f};
+        }
+    // Same wrapping as ks::SkyLight::lookup.
+    cudaTextureDesc tex_desc{};
+    tex_desc.addressMode[0] = cudaAddressModeWrap;
+    tex_desc.addressMode[1] = cudaAddressModeClamp;
+    tex_desc.filterMode = cudaFilterModeLinear;
+    tex_desc.readMode = cudaReadModeElementType;
+    tex_desc.normalizedCoords = 1;
+    sky_map = Texture2D(map.ures, map.vres, cudaCreateChannelDesc<float4>(), tex_desc,
+                        {reinterpret_cast<const std::byte *>(texels.data()), sizeof(float4) * texels.size()});
+
+    std::vector<float> margin_cdf;
+    std::vector<float> cond_cdf;
+    flatten_sky_distrib(sky_light, margin_cdf, cond_cdf, sky.nx, sky.ny);
+    sky_margin_cdf = CudaManagedArray<float>(span<const float>(margin_cdf.data(), margin_cdf.size()));
+    sky_cond_cdf = CudaManagedArray<float>(span<const float>(cond_cdf.data(), cond_cdf.size()));
+
+    sky.map = sky_map;
+    for (int i = 0; i < 3; ++i) {
+        sky.world_to_map[i] = to_ksc(ks::vec3(sky_light.baked.world_to_map.row(i).transpose()));
+        sky.map_to_world[i] = to_ksc(ks::vec3(sky_light.baked.map_to_world.row(i).transpose()));
+    }
+    sky.margin_cdf = sky_margin_cdf.ptr.get();
+    sky.cond_cdf = sky_cond_cdf.ptr.get();
+}
+
+void GPUPathTracer::render(const GPUScene &scene, const Camera &camera, ks::RenderTarget &rt)
+{
+    std::vector<color3> film((size_t)rt.width * rt.height);
+    render(scene, camera, vec2i(rt.width, rt.height), span<color3>(film.data(), film.size()));
+    for (int y = 0; y < rt.height; ++y) {
+        for (int x = 0; x < rt.width; ++x) {
+            const color3 &c = film[(size_t)y * rt.width + x];
+            rt(x, y) = ks::color3(c.x, c.y, c.z);
+        }
+    }
+}
+
+} // namespace ksc
\ No newline at end of file
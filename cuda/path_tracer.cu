@@ -0,0 +1,387 @@
+#include "device_util.cuh"
+#include "path_tracer.cuh"
+#include "principled.cuh"
+#include "sobol.cuh"
+#include <algorithm>
+
+namespace ksc
+{
+
+RayQueue::RayQueue(uint32_t capacity)
+    : capacity(capacity), origin(capacity), dir(capacity), beta(capacity), pdf(capacity), pixel(capacity),
+      rng(capacity), size(1)
+{}
+
+RayQueueView RayQueue::view()
+{
+    return {origin.ptr.get(), dir.ptr.get(), beta.ptr.get(), pdf.ptr.get(),
+            pixel.ptr.get(), rng.ptr.get(), size.ptr.get()};
+}
+
+ShadowQueue::ShadowQueue(uint32_t capacity) : origin(capacity), dir(capacity), L(capacity), pixel(capacity), size(1)
+{}
+
+ShadowQueueView ShadowQueue::view()
+{
+    return {origin.ptr.get(), dir.ptr.get(), L.ptr.get(), pixel.ptr.get(), size.ptr.get()};
+}
+
+// What the kernels need from GPUScene.
+struct GPUSceneView
+{
+    const SBVH *bvh;
+    const vec3 *vertex_normals;
+    const vec2 *texcoords;
+    const uint32_t *material_ids;
+    const GPUMaterial *materials;
+    const GPUDirectionalLight *directional_lights;
+    uint32_t directional_light_count;
+    GPUSkyLight sky;
+};
+
+static GPUSceneView make_scene_view(const GPUScene &scene)
+{
+    GPUSceneView view;
+    view.bvh = scene.bvh.get();
+    view.vertex_normals = scene.vertex_normals.size > 0 ? scene.vertex_normals.ptr.get() : nullptr;
+    view.texcoords = scene.texcoords.size > 0 ? scene.texcoords.ptr.get() : nullptr;
+    view.material_ids = scene.material_ids.ptr.get();
+    view.materials = scene.materials.ptr.get();
+    view.directional_lights = scene.directional_lights.ptr.get();
+    view.directional_light_count = (uint32_t)scene.directional_lights.size;
+    view.sky = scene.sky;
+    return view;
+}
+
+CUDA_DEVICE inline void add_to_film(color3 *film, uint32_t pixel, const color3 &L)
+{
+    atomicAdd(&film[pixel].x, L.x);
+    atomicAdd(&film[pixel].y, L.y);
+    atomicAdd(&film[pixel].z, L.z);
+}
+
+CUDA_DEVICE inline vec3 mul_rows(const vec3 rows[3], const vec3 &v)
+{
+    return vec3(dot(rows[0], v), dot(rows[1], v), dot(rows[2], v));
+}
+
+// Same as ks::DistribTable::sample_linear on n + 1 CDF entries.
+CUDA_DEVICE inline float sample_cdf(const float *cdf, uint32_t n, float u, float &pdf, uint32_t &index)
+{
+    u = fminf(u, float_before_one);
+    // Last entry <= u.
+    uint32_t lo = 0;
+    uint32_t hi = n;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (cdf[mid] <= u)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    index = lo;
+    float width = cdf[lo + 1] - cdf[lo];
+    pdf = width * (float)n;
+    float du = width > 0.0f ? (u - cdf[lo]) / width : 0.0f;
+    return ((float)lo + du) / (float)n;
+}
+
+CUDA_DEVICE inline color3 sky_lookup(const GPUSkyLight &sky, const vec2 &uv)
+{
+    float4 c = tex2D<float4>(sky.map, uv.x, uv.y);
+    return color3(c.x, c.y, c.z);
+}
+
+CUDA_DEVICE inline vec2 sky_uv(const GPUSkyLight &sky, const vec3 &wi, float &sin_theta)
+{
+    vec2 sph = to_spherical(mul_rows(sky.world_to_map, wi));
+    sin_theta = sinf(sph.y);
+    return vec2(sph.x * 0.5f / pi, sph.y / pi);
+}
+
+CUDA_DEVICE inline color3 sky_eval(const GPUSkyLight &sky, const vec3 &wi)
+{
+    float sin_theta;
+    return sky_lookup(sky, sky_uv(sky, wi, sin_theta));
+}
+
+// Same as ks::SkyLight::map_pdf.
+CUDA_DEVICE inline float sky_pdf(const GPUSkyLight &sky, const vec3 &wi)
+{
+    float sin_theta;
+    vec2 uv = sky_uv(sky, wi, sin_theta);
+    if (sin_theta == 0.0f)
+        return 0.0f;
+    uint32_t x = min((uint32_t)(uv.x * (float)sky.nx), sky.nx - 1);
+    uint32_t y = min((uint32_t)(uv.y * (float)sky.ny), sky.ny - 1);
+    const float *row = sky.cond_cdf + y * (sky.nx + 1);
+    float pdf = (sky.margin_cdf[y + 1] - sky.margin_cdf[y]) * (float)sky.ny * (row[x + 1] - row[x]) * (float)sky.nx;
+    return pdf / (2.0f * pi * pi * sin_theta);
+}
+
+// Returns the radiance (not divided by pdf) like ks::SkyLight::sample does with the map distribution.
+CUDA_DEVICE inline color3 sky_sample(const GPUSkyLight &sky, const vec2 &u, vec3 &wi, float &pdf)
+{
+    float pdf_v, pdf_u;
+    uint32_t y, x;
+    float v = sample_cdf(sky.margin_cdf, sky.ny, u.y, pdf_v, y);
+    float uu = sample_cdf(sky.cond_cdf + y * (sky.nx + 1), sky.nx, u.x, pdf_u, x);
+    pdf = pdf_v * pdf_u;
+    float theta = v * pi;
+    float sin_theta = sinf(theta);
+    if (pdf == 0.0f || sin_theta == 0.0f) {
+        pdf = 0.0f;
+        return color3(0.0f);
+    }
+    pdf /= (2.0f * pi * pi * sin_theta);
+    wi = mul_rows(sky.map_to_world, to_cartesian(vec2(uu * 2.0f * pi, theta)));
+    return sky_lookup(sky, vec2(uu, v));
+}
+
+CUDA_DEVICE inline float power_heuristic(float pdf_a, float pdf_b)
+{
+    float a2 = pdf_a * pdf_a;
+    float b2 = pdf_b * pdf_b;
+    return a2 + b2 > 0.0f ? a2 / (a2 + b2) : 0.0f;
+}
+
+__global__ void generate_camera_rays(Camera camera, vec2i film_res, uint32_t pixel_begin, uint32_t count,
+                                     uint32_t sample, RayQueueView queue)
+{
+    uint32_t i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= count)
+        return;
+    uint32_t pixel = pixel_begin + i;
+    vec2i p(pixel % film_res.x, pixel / film_res.x);
+    uint32_t seed = (uint32_t)MixBits(pixel);
+    // Lens samples take the next two sobol dimensions (the pinhole sequence is unchanged without a lens).
+    int nd = camera.has_lens() ? 4 : 2;
+    vec2 jitter(sobol_owen(sample, 0, seed, nd), sobol_owen(sample, 1, seed, nd));
+    vec2 film_pos(((float)p.x + jitter.x) / (float)film_res.x, ((float)p.y + jitter.y) / (float)film_res.y);
+    vec2 u_lens = vec2::zero();
+    if (camera.has_lens()) {
+        u_lens = vec2(sobol_owen(sample, 2, seed, nd), sobol_owen(sample, 3, seed, nd));
+    }
+    Ray ray = camera.spawn_ray(film_pos, u_lens, film_res, 1);
+
+    queue.origin[i] = ray.origin;
+    queue.dir[i] = ray.dir;
+    queue.beta[i] = color3(1.0f);
+    queue.pdf[i] = 0.0f;
+    queue.pixel[i] = pixel;
+    // One stream per pixel, offset per sample.
+    RNG rng(pixel);
+    rng.Advance((int64_t)sample * 65536);
+    queue.rng[i] = rng;
+}
+
+__global__ void intersect_rays(const SBVH *bvh, RayQueueView queue, SBVHIsectRecord *hits)
+{
+    uint32_t i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= *queue.size)
+        return;
+    Ray ray(queue.origin[i], queue.dir[i], 0.0f, inf);
+    hits[i] = bvh->intersect(ray, {SBVHCulling::None});
+}
+
+__global__ void shade(GPUSceneView scene, RayQueueView queue, const SBVHIsectRecord *hits, RayQueueView next,
+                      ShadowQueueView shadow, color3 *film, uint32_t depth, uint32_t rr_start_depth, bool last)
+{
+    uint32_t i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= *queue.size)
+        return;
+    uint32_t pixel = queue.pixel[i];
+    color3 beta = queue.beta[i];
+    vec3 wo = -queue.dir[i];
+    const SBVHIsectRecord &hit = hits[i];
+    // NEE picks one light uniformly: the directional lights and the sky.
+    uint32_t n_lights = scene.directional_light_count + (scene.sky.map ? 1u : 0u);
+    if (!hit.valid()) {
+        if (scene.sky.map) {
+            color3 L = sky_eval(scene.sky, -wo);
+            // Camera rays (pdf 0) can't be generated by NEE.
+            float bsdf_pdf = queue.pdf[i];
+            if (bsdf_pdf > 0.0f)
+                L = L * power_heuristic(bsdf_pdf, sky_pdf(scene.sky, -wo) / (float)n_lights);
+            add_to_film(film, pixel, beta * L);
+        }
+        return;
+    }
+    RNG rng = queue.rng[i];
+
+    const SBVH &bvh = *scene.bvh;
+    array<vec3, 3> v = bvh.tri_verts(hit.tri_idx);
+    const uint32_t *idx = &bvh.indices[3 * hit.tri_idx];
+    vec3 p = hit.coord[0] * v[0] + hit.coord[1] * v[1] + hit.coord[2] * v[2];
+    vec3 ng = normalize(cross(v[1] - v[0], v[2] - v[0]));
+    vec3 ns = ng;
+    if (scene.vertex_normals) {
+        vec3 n = hit.coord[0] * scene.vertex_normals[idx[0]] + hit.coord[1] * scene.vertex_normals[idx[1]] +
+                 hit.coord[2] * scene.vertex_normals[idx[2]];
+        // Meshes without vertex normals have zeros.
+        if (length_squared(n) > 0.0f)
+            ns = normalize(n);
+    }
+    // Two-sided: both normals face the outgoing direction.
+    if (dot(ng, wo) < 0.0f)
+        ng = -ng;
+    if (dot(ns, ng) < 0.0f)
+        ns = -ns;
+    vec2 uv(0.0f);
+    if (scene.texcoords) {
+        uv = hit.coord[0] * scene.texcoords[idx[0]] + hit.coord[1] * scene.texcoords[idx[1]] +
+             hit.coord[2] * scene.texcoords[idx[2]];
+    }
+
+    const GPUMaterial &material = scene.materials[scene.material_ids[hit.tri_idx]];
+    color3 basecolor = material.basecolor;
+    if (material.basecolor_texture) {
+        vec2 tex_uv = uv;
+        if (material.flip_v)
+            tex_uv.y = 1.0f - tex_uv.y;
+        tex_uv = tex_uv * material.uv_scale + material.uv_offset;
+        float4 c = tex2D<float4>(material.basecolor_texture, tex_uv.x, tex_uv.y);
+        float channels[4] = {c.x, c.y, c.z, c.w};
+        for (int k = 0; k < 3; ++k)
+            basecolor[k] = material.swizzle[k] >= 0 ? channels[material.swizzle[k]] : 0.0f;
+    }
+    PrincipledBRDFClosure closure =
+        make_principled_brdf_closure(basecolor, material.roughness, material.metallic, material.specular);
+
+    vec3 t, b;
+    orthonormal_basis(ns, t, b);
+    auto to_local = [&](const vec3 &w) { return vec3(dot(w, t), dot(w, b), dot(w, ns)); };
+    vec3 wo_local = to_local(wo);
+    // Push off the surface to avoid self-intersection.
+    float eps = 1e-4f * fmaxf(1.0f, fmaxf(fabsf(p.x), fmaxf(fabsf(p.y), fabsf(p.z))));
+    vec3 origin = p + eps * ng;
+
+    // NEE with one uniformly picked light.
+    if (n_lights > 0) {
+        uint32_t l = min((uint32_t)(rng.Uniform<float>() * (float)n_lights), n_lights - 1);
+        vec3 wi(0.0f);
+        // Radiance over the probability of picking it (and MIS weighted for the sky).
+        color3 Le(0.0f);
+        if (l < scene.directional_light_count) {
+            const GPUDirectionalLight &light = scene.directional_lights[l];
+            wi = light.dir;
+            Le = light.L * (float)n_lights;
+        } else {
+            float light_pdf;
+            color3 L = sky_sample(scene.sky, rng.Uniform<vec2>(), wi, light_pdf);
+            if (light_pdf > 0.0f) {
+                light_pdf /= (float)n_lights;
+                float bsdf_pdf = principled_brdf_pdf(wo_local, to_local(wi), closure);
+                Le = L * (power_heuristic(light_pdf, bsdf_pdf) / light_pdf);
+            }
+        }
+        if (dot(wi, ng) > 0.0f) {
+            color3 f = principled_brdf_eval(wo_local, to_local(wi), closure);
+            color3 L = beta * f * Le;
+            if (luminance(L) > 0.0f) {
+                uint32_t s = atomicAdd(shadow.size, 1u);
+                shadow.origin[s] = origin;
+                shadow.dir[s] = wi;
+                shadow.L[s] = L;
+                shadow.pixel[s] = pixel;
+            }
+        }
+    }
+    if (last)
+        return;
+
+    vec3 wi_local;
+    float pdf;
+    color3 weight = principled_brdf_sample(wo_local, closure, rng.Uniform<vec2>(), wi_local, pdf);
+    if (pdf == 0.0f)
+        return;
+    vec3 wi = wi_local.x * t + wi_local.y * b + wi_local.z * ns;
+    // Shading normals can send the ray under the surface.
+    if (dot(wi, ng) <= 0.0f)
+        return;
+    beta = beta * weight;
+    if (depth + 1 >= rr_start_depth) {
+        float p_continue = fminf(1.0f, luminance(beta));
+        if (rng.Uniform<float>() >= p_continue)
+            return;
+        beta = beta / p_continue;
+    }
+
+    uint32_t j = atomicAdd(next.size, 1u);
+    next.origin[j] = origin;
+    next.dir[j] = wi;
+    next.beta[j] = beta;
+    next.pdf[j] = pdf;
+    next.pixel[j] = pixel;
+    next.rng[j] = rng;
+}
+
+__global__ void trace_shadow_rays(const SBVH *bvh, ShadowQueueView shadow, color3 *film)
+{
+    uint32_t i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= *shadow.size)
+        return;
+    Ray ray(shadow.origin[i], shadow.dir[i], 0.0f, inf);
+    if (!bvh->intersectBool(ray, {SBVHCulling::None})) {
+        add_to_film(film, shadow.pixel[i], shadow.L[i]);
+    }
+}
+
+GPUPathTracer::GPUPathTracer(const GPUPathTracerOptions &options)
+    : options(options), queues{RayQueue(options.wave_size), RayQueue(options.wave_size)}, hits(options.wave_size),
+      shadow_queue(options.wave_size)
+{}
+
+void GPUPathTracer::render(const GPUScene &scene, const Camera &camera, vec2i film_res, span<color3> film,
+                           cudaStream_t stream)
+{
+    uint32_t pixel_count = (uint32_t)(film_res.x * film_res.y);
+    CUDA_ASSERT(film.size() == pixel_count);
+    CudaDeviceArray<color3> accum(pixel_count, stream);
+    cuda_check(cudaMemsetAsync(accum.ptr.get(), 0, sizeof(color3) * pixel_count, stream));
+
+    GPUSceneView scene_view = make_scene_view(scene);
+    for (uint32_t sample = 0; sample < options.spp; ++sample) {
+        for (uint32_t pixel_begin = 0; pixel_begin < pixel_count; pixel_begin += options.wave_size) {
+            uint32_t active = std::min(options.wave_size, pixel_count - pixel_begin);
+            RayQueue *curr = &queues[0];
+            RayQueue *next = &queues[1];
+            cuda_check(cudaMemcpyAsync(curr->size.ptr.get(), &active, sizeof(uint32_t), cudaMemcpyHostToDevice,
+                                       stream));
+            run_kernel_1d(generate_camera_rays, 0, stream, active, camera, film_res, pixel_begin, active, sample,
+                          curr->view());
+
+            for (uint32_t depth = 0; depth < options.max_depth; ++depth) {
+                run_kernel_1d(intersect_rays, 0, stream, active, scene_view.bvh, curr->view(), hits.ptr.get());
+                cuda_check(cudaMemsetAsync(next->size.ptr.get(), 0, sizeof(uint32_t), stream));
+                cuda_check(cudaMemsetAsync(shadow_queue.size.ptr.get(), 0, sizeof(uint32_t), stream));
+                bool last = depth + 1 == options.max_depth;
+                run_kernel_1d(shade, 0, stream, active, scene_view, curr->view(), hits.ptr.get(), next->view(),
+                              shadow_queue.view(), accum.ptr.get(), depth, options.rr_start_depth, last);
+                // At most one shadow ray per path.
+                run_kernel_1d(trace_shadow_rays, 0, stream, active, scene_view.bvh, shadow_queue.view(),
+                              accum.ptr.get());
+
+                // The only host sync per bounce: the size of the next wave.
+                cuda_check(cudaMemcpyAsync(&active, next->size.ptr.get(), sizeof(uint32_t), cudaMemcpyDeviceToHost,
+                                           stream));
+                cuda_check(cudaStreamSynchronize(stream));
+                if (active == 0)
+                    break;
+                std::swap(curr, next);
+            }
+        }
+    }
+
+    cuda_check(cudaMemcpyAsync(film.data(), accum.ptr.get(), sizeof(color3) * pixel_count, cudaMemcpyDeviceToHost,
+                               stream));
+    cuda_check(cudaStreamSynchronize(stream));
+    float inv_spp = 1.0f / (float)options.spp;
+    for (uint32_t i = 0; i < pixel_count; ++i) {
+        film[i] = film[i] * inv_spp;
+    }
+    // Peaks include the per-render accumulation buffer, which is still live here.
+    print_cuda_alloc_stats();
+}
+
+} // namespace ksc
\ No newline at end of file
@@ -0,0 +1,184 @@
+#pragma once
+#include "camera.cuh"
+#include "memory.cuh"
+#include "rng.cuh"
+#include "sbvh.cuh"
+#include "texture.cuh"
+#include <vector>
+#ifdef CPP_CODE_ONLY
+#include "../config.h"
+#include <span>
+namespace ks
+{
+struct Scene;
+struct Light;
+struct SkyLight;
+struct RenderTarget;
+} // namespace ks
+#endif
+
+namespace ksc
+{
+
+// Parameters of ks::PrincipledBRDF. Non-constant roughness/metallic/specular fields are not supported (evaluated at
+// the texture center).
+struct GPUMaterial
+{
+    color3 basecolor = color3(0.8f);
+    // 0 if the basecolor is constant. Sampled as normalized float RGBA (block-compressed textures are uploaded as is).
+    cudaTextureObject_t basecolor_texture = 0;
+    // Texture channels of the basecolor (-1 for zero), same as ks::TextureField::swizzle.
+    int swizzle[3] = {0, 1, 2};
+    // Same texcoord mapping as ks::TextureField.
+    bool flip_v = true;
+    vec2 uv_scale = vec2(1.0f);
+    vec2 uv_offset = vec2(0.0f);
+    float roughness = 0.5f;
+    float metallic = 0.0f;
+    float specular = 0.5f;
+};
+
+struct GPUDirectionalLight
+{
+    color3 L;
+    // Towards the light.
+    vec3 dir;
+};
+
+// Device version of ks::SkyLight: the (z-up, equirectangular) map and its piecewise-constant sampling distribution.
+// Portals and visibility-weighted sampling are not supported. The map distribution is used alone, which is still
+// unbiased.
+struct GPUSkyLight
+{
+    // 0 if the scene has no sky light. Sampled as float RGBA with bilinear filtering, like ks::SkyLight::lookup.
+    cudaTextureObject_t map = 0;
+    // Rows of ks::SkyLight::baked.world_to_map and map_to_world.
+    vec3 world_to_map[3];
+    vec3 map_to_world[3];
+    // Same layout as ks::DistribTable2D: the marginal CDF over rows (ny + 1 entries) followed by the conditional CDF
+    // of each row (nx + 1 entries each).
+    uint32_t nx = 0;
+    uint32_t ny = 0;
+    const float *margin_cdf = nullptr;
+    const float *cond_cdf = nullptr;
+};
+
+// All instances of a ks::Scene flattened into one world-space triangle mesh.
+struct GPUScene
+{
+    // In managed memory so that kernels can use it directly.
+    cuda_managed_unique_ptr<SBVH> bvh;
+    // Per vertex. Empty if not available.
+    CudaManagedArray<vec3> vertex_normals;
+    CudaManagedArray<vec2> texcoords;
+    // Per triangle.
+    CudaManagedArray<uint32_t> material_ids;
+    CudaManagedArray<GPUMaterial> materials;
+    std::vector<Texture2D> textures;
+
+    CudaManagedArray<GPUDirectionalLight> directional_lights;
+    // At most one. sky points into sky_map and the CDF arrays.
+    Texture2D sky_map;
+    CudaManagedArray<float> sky_margin_cdf;
+    CudaManagedArray<float> sky_cond_cdf;
+    GPUSkyLight sky;
+
+#ifdef CPP_CODE_ONLY
+    // The SBVH is cached in bvh_cache_dir (a temporary directory if empty) under a hash of the flattened scene.
+    void load_from_scene(const ks::Scene &scene, std::span<const ks::Light *const> lights,
+                         const SBVHBuildOption &bvh_option, const fs::path &bvh_cache_dir = {});
+    void load_sky(const ks::SkyLight &sky_light);
+#endif
+};
+
+struct GPUPathTracerOptions
+{
+    uint32_t spp = 16;
+    uint32_t max_depth = 8;
+    uint32_t rr_start_depth = 3;
+    // Max number of paths in flight (queue capacity).
+    uint32_t wave_size = 1 << 20;
+
+#ifdef CPP_CODE_ONLY
+    void load_from_config(const ks::ConfigArgs &args);
+#endif
+};
+
+// Kernel-side view of a RayQueue (SoA).
+struct RayQueueView
+{
+    vec3 *origin;
+    vec3 *dir;
+    color3 *beta;
+    // Solid angle pdf of sampling dir from the BSDF (for MIS with the sky), 0 for camera rays.
+    float *pdf;
+    uint32_t *pixel;
+    RNG *rng;
+    uint32_t *size;
+};
+
+struct RayQueue
+{
+    RayQueue() = default;
+    explicit RayQueue(uint32_t capacity);
+    RayQueueView view();
+
+    uint32_t capacity = 0;
+    CudaDeviceArray<vec3> origin;
+    CudaDeviceArray<vec3> dir;
+    CudaDeviceArray<color3> beta;
+    CudaDeviceArray<float> pdf;
+    CudaDeviceArray<uint32_t> pixel;
+    CudaDeviceArray<RNG> rng;
+    CudaDeviceArray<uint32_t> size;
+};
+
+// Closest hits of a RayQueue, with the same indexing.
+struct HitQueueView
+{
+    SBVHIsectRecord *record;
+};
+
+// Unoccluded shadow rays add their contribution to the pixel.
+struct ShadowQueueView
+{
+    vec3 *origin;
+    vec3 *dir;
+    color3 *L;
+    uint32_t *pixel;
+    uint32_t *size;
+};
+
+struct ShadowQueue
+{
+    ShadowQueue() = default;
+    explicit ShadowQueue(uint32_t capacity);
+    ShadowQueueView view();
+
+    CudaDeviceArray<vec3> origin;
+    CudaDeviceArray<vec3> dir;
+    CudaDeviceArray<color3> L;
+    CudaDeviceArray<uint32_t> pixel;
+    CudaDeviceArray<uint32_t> size;
+};
+
+// Wavefront path tracer with ray-generation, intersect, shade and shadow kernels over SoA queues in device memory.
+// Samples are taken in waves of at most wave_size paths, one kernel launch per stage and bounce.
+struct GPUPathTracer
+{
+    explicit GPUPathTracer(const GPUPathTracerOptions &options);
+
+    // Writes the mean radiance per pixel to film (row-major, same layout as ks::RenderTarget::pixels).
+    void render(const GPUScene &scene, const Camera &camera, vec2i film_res, span<color3> film,
+                cudaStream_t stream = 0);
+#ifdef CPP_CODE_ONLY
+    void render(const GPUScene &scene, const Camera &camera, ks::RenderTarget &rt);
+#endif
+
+    GPUPathTracerOptions options;
+    RayQueue queues[2];
+    CudaDeviceArray<SBVHIsectRecord> hits;
+    ShadowQueue shadow_queue;
+};
+
+} // namespace ksc
\ No newline at end of file
@@ -0,0 +1,160 @@
+#pragma once
+#include "math.cuh"
+#include "rng.cuh"
+#include "vecmath.cuh"
+
+namespace ksc
+{
+
+// Device version of ks::PrincipledBRDF with the (isotropic) GGX microfacet distribution. Directions are in the local
+// shading frame (z = normal). Same closure parameterization and lobe selection as the CPU version so that renders
+// match.
+struct PrincipledBRDFClosure
+{
+    color3 basecolor;
+    // Already squared roughness.
+    float alpha;
+    float metallic;
+    // Already scaled by 0.08.
+    float specular;
+};
+
+constexpr float ggx_min_alpha = 1e-3f;
+
+CUDA_HOST_DEVICE inline float fresnel_schlick(float cos_theta)
+{
+    float m = saturate(1.0f - cos_theta);
+    float m2 = m * m;
+    return m2 * m2 * m;
+}
+
+CUDA_HOST_DEVICE inline float ggx_D(float alpha, const vec3 &wm)
+{
+    if (wm.z <= 0.0f) {
+        return 0.0f;
+    }
+    float a2 = alpha * alpha;
+    float t = 1.0f + (a2 - 1.0f) * wm.z * wm.z;
+    return a2 / (pi * t * t);
+}
+
+CUDA_HOST_DEVICE inline float ggx_lambda(float alpha, const vec3 &w)
+{
+    if (w.z >= 1.0f || w.z <= -1.0f) {
+        return 0.0f;
+    }
+    float NdotV2 = w.z * w.z;
+    float t = (1.0f - NdotV2) * alpha * alpha / NdotV2;
+    return 0.5f * (-1.0f + sqrt(1.0f + t));
+}
+
+CUDA_HOST_DEVICE inline float ggx_G1(float alpha, const vec3 &w) { return 1.0f / (1.0f + ggx_lambda(alpha, w)); }
+
+// Only for the same hemisphere (reflection).
+CUDA_HOST_DEVICE inline float ggx_G2(float alpha, const vec3 &wo, const vec3 &wi)
+{
+    return 1.0f / (1.0f + ggx_lambda(alpha, wo) + ggx_lambda(alpha, wi));
+}
+
+// Visible normal sampling (Heitz 18).
+CUDA_HOST_DEVICE inline vec3 ggx_sample(float alpha, const vec3 &wo, const vec2 &u)
+{
+    vec3 Vh = normalize(vec3(alpha * wo.x, alpha * wo.y, wo.z));
+    float lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+    vec3 T1 = lensq > 0.0f ? vec3(-Vh.y, Vh.x, 0.0f) * (1.0f / sqrt(lensq)) : vec3(1.0f, 0.0f, 0.0f);
+    vec3 T2 = cross(Vh, T1);
+    float r = sqrt(u.x);
+    float phi = 2.0f * pi * u.y;
+    float t1 = r * cos(phi);
+    float t2 = r * sin(phi);
+    float s = 0.5f * (1.0f + Vh.z);
+    t2 = (1.0f - s) * sqrt(1.0f - t1 * t1) + s * t2;
+    vec3 Nh = t1 * T1 + t2 * T2 + sqrt(fmaxf(0.0f, 1.0f - t1 * t1 - t2 * t2)) * Vh;
+    return normalize(vec3(alpha * Nh.x, alpha * Nh.y, fmaxf(0.0f, Nh.z)));
+}
+
+CUDA_HOST_DEVICE inline vec3 reflect(const vec3 &w, const vec3 &n) { return -w + 2.0f * dot(w, n) * n; }
+
+CUDA_HOST_DEVICE inline PrincipledBRDFClosure make_principled_brdf_closure(const color3 &basecolor, float roughness,
+                                                                           float metallic, float specular)
+{
+    PrincipledBRDFClosure c;
+    c.basecolor = max(min(basecolor, color3(1.0f)), color3(0.0f));
+    c.alpha = fmaxf(sqr(saturate(roughness)), ggx_min_alpha);
+    c.metallic = saturate(metallic);
+    c.specular = saturate(specular) * 0.08f;
+    return c;
+}
+
+// NOTE: return cosine-weighted bsdf: f*cos(theta_i)
+CUDA_HOST_DEVICE inline color3 principled_brdf_eval(const vec3 &wo, const vec3 &wi, const PrincipledBRDFClosure &c)
+{
+    if (wo.z <= 0.0f || wi.z <= 0.0f) {
+        return color3(0.0f);
+    }
+    color3 f = (1.0f - c.metallic) * c.basecolor * (wi.z / pi);
+
+    vec3 wh = normalize(wo + wi);
+    float D = ggx_D(c.alpha, wh);
+    float G = ggx_G2(c.alpha, wo, wi);
+    color3 R0 = lerp(c.metallic, color3(c.specular), c.basecolor);
+    color3 Fr = lerp(fresnel_schlick(dot(wo, wh)), R0, color3(1.0f));
+    f += D * G * Fr / (4.0f * wo.z);
+    return f;
+}
+
+// Probability of picking the diffuse lobe; 1 - that for the specular lobe. Negative if nothing can be sampled.
+CUDA_HOST_DEVICE inline float principled_brdf_diffuse_weight(const vec3 &wo, const PrincipledBRDFClosure &c)
+{
+    if (wo.z <= 0.0f) {
+        return -1.0f;
+    }
+    float lum_basecolor = luminance(c.basecolor);
+    float lum_R0 = c.specular + (lum_basecolor - c.specular) * c.metallic;
+    float weight_diffuse = (1.0f - c.metallic) * lum_basecolor / pi;
+    float weight_specular = lum_R0 + (1.0f - lum_R0) * fresnel_schlick(wo.z);
+    float sum = weight_diffuse + weight_specular;
+    if (sum == 0.0f) {
+        return -1.0f;
+    }
+    return weight_diffuse / sum;
+}
+
+CUDA_HOST_DEVICE inline float principled_brdf_pdf(const vec3 &wo, const vec3 &wi, const PrincipledBRDFClosure &c)
+{
+    float w_diffuse = principled_brdf_diffuse_weight(wo, c);
+    if (w_diffuse < 0.0f || wi.z <= 0.0f) {
+        return 0.0f;
+    }
+    vec3 wh = normalize(wo + wi);
+    float pdf_diffuse = wi.z / pi;
+    float pdf_specular = ggx_D(c.alpha, wh) * ggx_G1(c.alpha, wo) / (4.0f * wo.z);
+    return w_diffuse * pdf_diffuse + (1.0f - w_diffuse) * pdf_specular;
+}
+
+// NOTE: return cosine-weighted throughput weight: (f*cos(theta_i) / pdf)
+CUDA_HOST_DEVICE inline color3 principled_brdf_sample(const vec3 &wo, const PrincipledBRDFClosure &c, const vec2 &u,
+                                                      vec3 &wi, float &pdf)
+{
+    pdf = 0.0f;
+    float w_diffuse = principled_brdf_diffuse_weight(wo, c);
+    if (w_diffuse < 0.0f) {
+        return color3(0.0f);
+    }
+    if (u.x < w_diffuse) {
+        wi = sample_cosine_hemisphere(vec2(fminf(u.x / w_diffuse, float_before_one), u.y));
+    } else {
+        vec2 u_remap(fminf((u.x - w_diffuse) / (1.0f - w_diffuse), float_before_one), u.y);
+        wi = reflect(wo, ggx_sample(c.alpha, wo, u_remap));
+    }
+    if (wi.z <= 0.0f) {
+        return color3(0.0f);
+    }
+    pdf = principled_brdf_pdf(wo, wi, c);
+    if (pdf == 0.0f) {
+        return color3(0.0f);
+    }
+    return principled_brdf_eval(wo, wi, c) / pdf;
+}
+
+} // namespace ksc
\ No newline at end of file
@@ -1,4 +1,7 @@
+#include "../file_util.h"
+#include "../hash.h"
 #include "../memory_util.h"
+#include "../parallel.h"
 #include "ray_tri.cuh"
 #include "sbvh.cuh"
 #include <algorithm>
@@ -59,8 +62,18 @@ static_assert(sizeof(SBVHPrimRef) == 32, "Unexpected SBVHPrimitiveInfo size.");
 
 struct BuildContext
 {
+    // For a subtree built in parallel. Its nodes and ordered prims are appended to the parent with appendSubtree.
+    BuildContext subContext() const
+    {
+        BuildContext sub;
+        sub.option = option;
+        sub.unorderedPrims = unorderedPrims;
+        sub.rootSurfaceArea = rootSurfaceArea;
+        return sub;
+    }
+
     SBVHBuildOption option;
-    std::vector<Primitive> unorderedPrims;
+    const Primitive *unorderedPrims = nullptr;
     std::vector<SBVHBuildNode> buildNodePool;
     std::vector<SBVHPrimRef> refScratchBuffer;
     std::vector<Primitive> orderedPrims;
@@ -68,6 +81,45 @@ struct BuildContext
     float rootSurfaceArea = 0.0f;
 };
 
+// Binning and bound computation of nodes with more references than this are split into parallel chunks.
+constexpr uint32_t parallelChunkSize = 1 << 14;
+
+static uint32_t chunkCount(uint32_t refCount) { return (refCount + parallelChunkSize - 1) / parallelChunkSize; }
+
+// Calls func(begin, end, chunk) for each chunk of [0, refCount), in parallel if there is more than one.
+template <typename Func>
+static void forEachChunk(uint32_t refCount, const Func &func)
+{
+    uint32_t n = chunkCount(refCount);
+    if (n <= 1) {
+        func(0u, refCount, 0u);
+        return;
+    }
+    ks::parallel_for(n, [&](uint32_t c) {
+        func(c * parallelChunkSize, std::min((c + 1) * parallelChunkSize, refCount), c);
+    });
+}
+
+static uint32_t appendSubtree(BuildContext &ctx, const BuildContext &sub)
+{
+    // Same layout as building the subtree serially: depth-first, left subtree first.
+    uint32_t nodeBase = ctx.totalNodeCount;
+    uint32_t primBase = (uint32_t)ctx.orderedPrims.size();
+    ctx.totalNodeCount += sub.totalNodeCount;
+    ctx.buildNodePool.resize(ctx.totalNodeCount);
+    for (uint32_t i = 0; i < sub.totalNodeCount; ++i) {
+        SBVHBuildNode node = sub.buildNodePool[i];
+        node.primOffset += primBase;
+        if (!node.isLeaf()) {
+            node.children[0] += nodeBase;
+            node.children[1] += nodeBase;
+        }
+        ctx.buildNodePool[nodeBase + i] = node;
+    }
+    ctx.orderedPrims.insert(ctx.orderedPrims.end(), sub.orderedPrims.begin(), sub.orderedPrims.end());
+    return nodeBase;
+}
+
 static uint32_t recursiveBuild(BuildContext &ctx, std::vector<SBVHPrimRef> &refs);
 static uint32_t flatten(uint32_t buildIndex, uint32_t &flatIndex, SBVHNode *nodes, const BuildContext &ctx);
 
@@ -88,12 +140,25 @@ static SplitEstimate estimateObjectSplit(const std::vector<SBVHPrimRef> &refs, c
         AABB3 bounds;
     };
     uint32_t bucketCount = ctx.option.bucketCount;
+    uint32_t refCount = (uint32_t)refs.size();
+    // Bin each chunk separately, then merge. Counts and bounds don't depend on the order, so the result is the same
+    // as binning serially.
+    std::vector<ObjectSplitBucketInfo> chunkBuckets(chunkCount(refCount) * bucketCount);
+    forEachChunk(refCount, [&](uint32_t begin, uint32_t end, uint32_t chunk) {
+        ObjectSplitBucketInfo *local = &chunkBuckets[chunk * bucketCount];
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t b = (uint32_t)std::floor(bucketCount * centroidBounds.offset(refs[i].partialBound.center(), dim));
+            b = std::min(b, bucketCount - 1);
+            ++local[b].count;
+            local[b].bounds.expand(refs[i].partialBound);
+        }
+    });
     VLA(buckets, ObjectSplitBucketInfo, bucketCount);
-    for (uint32_t i = 0; i < (uint32_t)refs.size(); ++i) {
-        uint32_t b = (uint32_t)std::floor(bucketCount * centroidBounds.offset(refs[i].partialBound.center(), dim));
-        b = std::min(b, bucketCount - 1);
-        ++buckets[b].count;
-        buckets[b].bounds.expand(refs[i].partialBound);
+    for (uint32_t c = 0; c < (uint32_t)chunkBuckets.size(); c += bucketCount) {
+        for (uint32_t b = 0; b < bucketCount; ++b) {
+            buckets[b].count += chunkBuckets[c + b].count;
+            buckets[b].bounds.expand(chunkBuckets[c + b].bounds);
+        }
     }
     // Compute costs for splitting after each bucket.
     // Can optimize the double loop.
@@ -150,24 +215,36 @@ static SplitEstimate estimateSpatialSplit(const std::vector<SBVHPrimRef> &refs,
     for (uint32_t b = 0; b <= bucketCount; ++b) {
         clipPlanes[b] = std::lerp(bounds.min[dim], bounds.max[dim], (float)(b) / (float)bucketCount);
     }
-    for (uint32_t i = 0; i < (uint32_t)refs.size(); ++i) {
-        uint32_t enter = bucketCount - 1;
-        uint32_t exit = 0;
+    uint32_t refCount = (uint32_t)refs.size();
+    std::vector<SpatialSplitBucketInfo> chunkBuckets(chunkCount(refCount) * bucketCount);
+    forEachChunk(refCount, [&](uint32_t begin, uint32_t end, uint32_t chunk) {
+        SpatialSplitBucketInfo *local = &chunkBuckets[chunk * bucketCount];
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t enter = bucketCount - 1;
+            uint32_t exit = 0;
+            for (uint32_t b = 0; b < bucketCount; ++b) {
+                if (refs[i].partialBound.min[dim] > clipPlanes[b + 1])
+                    continue;
+                if (refs[i].partialBound.max[dim] < clipPlanes[b])
+                    break;
+                exit = std::max(exit, b);
+                enter = std::min(enter, b);
+                AABB3 chopped = refs[i].partialBound;
+                chopped.min[dim] = std::max(chopped.min[dim], clipPlanes[b]);
+                chopped.max[dim] = std::min(chopped.max[dim], clipPlanes[b + 1]);
+                local[b].bounds.expand(chopped);
+            }
+            CUDA_ASSERT(enter <= exit);
+            ++local[enter].enterCount;
+            ++local[exit].exitCount;
+        }
+    });
+    for (uint32_t c = 0; c < (uint32_t)chunkBuckets.size(); c += bucketCount) {
         for (uint32_t b = 0; b < bucketCount; ++b) {
-            if (refs[i].partialBound.min[dim] > clipPlanes[b + 1])
-                continue;
-            if (refs[i].partialBound.max[dim] < clipPlanes[b])
-                break;
-            exit = std::max(exit, b);
-            enter = std::min(enter, b);
-            AABB3 chopped = refs[i].partialBound;
-            chopped.min[dim] = std::max(chopped.min[dim], clipPlanes[b]);
-            chopped.max[dim] = std::min(chopped.max[dim], clipPlanes[b + 1]);
-            buckets[b].bounds.expand(chopped);
+            buckets[b].enterCount += chunkBuckets[c + b].enterCount;
+            buckets[b].exitCount += chunkBuckets[c + b].exitCount;
+            buckets[b].bounds.expand(chunkBuckets[c + b].bounds);
         }
-        CUDA_ASSERT(enter <= exit);
-        ++buckets[enter].enterCount;
-        ++buckets[exit].exitCount;
     }
     // Compute costs for splitting after each bucket.
     // Can optimize the double loop.
@@ -305,9 +382,19 @@ static uint32_t recursiveBuild(BuildContext &ctx, std::vector<SBVHPrimRef> &refs
 
     uint32_t refCount = (uint32_t)refs.size();
     // Compute bounds of all primitives in BVH node.
+    std::vector<AABB3> chunkBounds(chunkCount(refCount));
+    std::vector<AABB3> chunkCentroidBounds(chunkCount(refCount));
+    forEachChunk(refCount, [&](uint32_t begin, uint32_t end, uint32_t chunk) {
+        for (uint32_t i = begin; i < end; ++i) {
+            chunkBounds[chunk].expand(refs[i].partialBound);
+            chunkCentroidBounds[chunk].expand(refs[i].partialBound.center());
+        }
+    });
     AABB3 bounds;
-    for (uint32_t i = 0; i < refCount; ++i) {
-        bounds.expand(refs[i].partialBound);
+    AABB3 centroidBounds;
+    for (uint32_t c = 0; c < (uint32_t)chunkBounds.size(); ++c) {
+        bounds.expand(chunkBounds[c]);
+        centroidBounds.expand(chunkCentroidBounds[c]);
     }
     if (ctx.rootSurfaceArea == 0.0f) {
         ctx.rootSurfaceArea = bounds.surface_area();
@@ -326,11 +413,7 @@ static uint32_t recursiveBuild(BuildContext &ctx, std::vector<SBVHPrimRef> &refs
     if (refCount == 1) {
         return asLeaf();
     } else {
-        // Compute bound of primitive centroids, choose split dimension.
-        AABB3 centroidBounds;
-        for (uint32_t i = 0; i < refCount; ++i) {
-            centroidBounds.expand(refs[i].partialBound.center());
-        }
+        // Choose split dimension.
         uint32_t dim = centroidBounds.largest_axis();
         // Super degeneracy...no bound at all.
         if (centroidBounds.max[dim] == centroidBounds.min[dim]) {
@@ -361,8 +444,19 @@ static uint32_t recursiveBuild(BuildContext &ctx, std::vector<SBVHPrimRef> &refs
             std::vector<SBVHPrimRef> rightChildRefs(refs.begin() + split.mid, refs.end());
             leftChildRefs.resize(split.mid);
             uint32_t orderedPrimStart = (uint32_t)ctx.orderedPrims.size();
-            uint32_t leftChildIndex = recursiveBuild(ctx, leftChildRefs);
-            uint32_t rightChildIndex = recursiveBuild(ctx, rightChildRefs);
+            uint32_t leftChildIndex, rightChildIndex;
+            if (refCount >= ctx.option.parallelBuildThreshold) {
+                // Build both subtrees concurrently in their own contexts, then append them in serial order.
+                BuildContext leftCtx = ctx.subContext();
+                BuildContext rightCtx = ctx.subContext();
+                ks::parallel_invoke([&]() { recursiveBuild(leftCtx, leftChildRefs); },
+                                    [&]() { recursiveBuild(rightCtx, rightChildRefs); });
+                leftChildIndex = appendSubtree(ctx, leftCtx);
+                rightChildIndex = appendSubtree(ctx, rightCtx);
+            } else {
+                leftChildIndex = recursiveBuild(ctx, leftChildRefs);
+                rightChildIndex = recursiveBuild(ctx, rightChildRefs);
+            }
             uint32_t orderedPrimEnd = (uint32_t)ctx.orderedPrims.size();
             ctx.buildNodePool[nodeIndex].initInterior(dim, orderedPrimStart, orderedPrimEnd - orderedPrimStart,
                                                       leftChildIndex, split.leftBound, rightChildIndex,
@@ -413,19 +507,15 @@ void SBVH::build(const SBVHBuildOption &option)
     ctx.option.travWeight = clamp(ctx.option.travWeight, 0.0f, 10.0f);
     ctx.option.alpha = saturate(ctx.option.alpha);
 
-    ctx.unorderedPrims.reserve(initPrimCount);
-    for (uint32_t shapeIndex = 0; shapeIndex < initPrimCount; ++shapeIndex) {
-        ctx.unorderedPrims.push_back({shapeIndex});
-    }
-
-    std::vector<SBVHPrimRef> refs(ctx.unorderedPrims.size());
-    for (uint32_t i = 0; i < (uint32_t)ctx.unorderedPrims.size(); ++i) {
-        uint32_t shapeIndex = ctx.unorderedPrims[i].shapeIndex;
-        AABB3 bound = tri_bound(shapeIndex);
-        refs[i] = SBVHPrimRef(i, bound);
-    }
+    std::vector<Primitive> unorderedPrims(initPrimCount);
+    std::vector<SBVHPrimRef> refs(initPrimCount);
+    ks::parallel_for(initPrimCount, [&](uint32_t shapeIndex) {
+        unorderedPrims[shapeIndex] = {shapeIndex};
+        refs[shapeIndex] = SBVHPrimRef(shapeIndex, tri_bound(shapeIndex));
+    }, parallelChunkSize);
+    ctx.unorderedPrims = unorderedPrims.data();
 
-    ctx.orderedPrims.reserve(ctx.unorderedPrims.size());
+    ctx.orderedPrims.reserve(initPrimCount);
     ctx.totalNodeCount = 0;
     ctx.buildNodePool.reserve(std::min((uint32_t)1024, 2 * initPrimCount - 1));
 
@@ -437,6 +527,239 @@ void SBVH::build(const SBVHBuildOption &option)
 
     primitives = CudaManagedArray<Primitive>(ctx.orderedPrims.size());
     std::memcpy(primitives.ptr.get(), ctx.orderedPrims.data(), sizeof(Primitive) * primitives.size);
+
+    buildWideNodes();
+}
+
+// Cache layout: SBVHCacheHeader, nodes, primitives.
+constexpr const char *sbvhCacheMagic = "i_am_a_sbvh_cache";
+constexpr uint32_t sbvhCacheVersion = 1;
+
+struct SBVHCacheHeader
+{
+    std::array<char, std::string_view(sbvhCacheMagic).size()> magic;
+    uint32_t version;
+    // Of the build options and the mesh, see cacheKey.
+    uint64_t key;
+    uint64_t nodeCount;
+    uint64_t primCount;
+};
+
+static uint64_t cacheKey(const SBVHBuildOption &option, const SBVH &bvh)
+{
+    uint64_t key = ks::hash(option.maxPrimsInNode, option.bucketCount, option.travWeight, option.alpha);
+    key = ks::hash_buffer(bvh.vertices.ptr.get(), sizeof(vec3) * bvh.vertices.size, key);
+    key = ks::hash_buffer(bvh.indices.ptr.get(), sizeof(uint32_t) * bvh.indices.size, key);
+    return key;
+}
+
+SBVH::SBVH(const SBVHBuildOption &option, span<const vec3> vertices, span<const uint32_t> indices,
+           const fs::path &cachePath)
+    : vertices(vertices), indices(indices)
+{
+    if (!loadCache(option, cachePath)) {
+        build(option);
+        saveCache(option, cachePath);
+    }
+}
+
+bool SBVH::loadCache(const SBVHBuildOption &option, const fs::path &path)
+{
+    if (!fs::exists(path))
+        return false;
+    ks::MappedFile file(path);
+    SBVHCacheHeader header;
+    if (file.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::string_view(header.magic.data(), header.magic.size()) != sbvhCacheMagic ||
+        header.version != sbvhCacheVersion || header.key != cacheKey(option, *this) ||
+        file.size() != sizeof(header) + header.nodeCount * sizeof(SBVHNode) + header.primCount * sizeof(Primitive)) {
+        return false;
+    }
+    // NOTE: managed memory can't alias the mapping, so this is one copy (still much faster than a build).
+    const std::byte *src = file.data() + sizeof(header);
+    nodes = CudaManagedArray<SBVHNode>(header.nodeCount);
+    std::memcpy(nodes.ptr.get(), src, sizeof(SBVHNode) * header.nodeCount);
+    src += sizeof(SBVHNode) * header.nodeCount;
+    primitives = CudaManagedArray<Primitive>(header.primCount);
+    std::memcpy(primitives.ptr.get(), src, sizeof(Primitive) * header.primCount);
+    // Cheap enough to not be cached.
+    buildWideNodes();
+    return true;
+}
+
+void SBVH::saveCache(const SBVHBuildOption &option, const fs::path &path) const
+{
+    SBVHCacheHeader header;
+    std::copy_n(sbvhCacheMagic, header.magic.size(), header.magic.begin());
+    header.version = sbvhCacheVersion;
+    header.key = cacheKey(option, *this);
+    header.nodeCount = nodes.size;
+    header.primCount = primitives.size;
+    ks::BinaryWriter writer(path);
+    writer.write(header);
+    writer.write(nodes.ptr.get(), sizeof(SBVHNode) * nodes.size);
+    writer.write(primitives.ptr.get(), sizeof(Primitive) * primitives.size);
+}
+
+struct WideChildRef
+{
+    uint32_t nodeIndex;
+    uint32_t primCount;
+};
+
+// Child i of a binary interior node (primCount is the prim count of the node itself).
+static WideChildRef binaryChild(const SBVH &bvh, const WideChildRef &ref, uint32_t i)
+{
+    const SBVHNode &node = bvh.nodes[ref.nodeIndex];
+    const SBVHNode &right = bvh.nodes[node.rightChildOffset];
+    uint32_t leftPrimCount = right.primOffset - node.primOffset;
+    if (i == 0) {
+        return {ref.nodeIndex + 1, leftPrimCount};
+    }
+    return {node.rightChildOffset, ref.primCount - leftPrimCount};
+}
+
+static void quantizeChild(SBVHWideNode &wide, uint32_t slot, const AABB3 &b)
+{
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        float scale = ldexpf(1.0f, wide.exponent[axis]);
+        int qmin = clamp((int)std::floor((b.min[axis] - wide.origin[axis]) / scale), 0, 255);
+        int qmax = clamp((int)std::ceil((b.max[axis] - wide.origin[axis]) / scale), 0, 255);
+        // Make sure the decoded bound is conservative after rounding.
+        while (qmin > 0 && wide.dequantize(axis, (uint8_t)qmin) > b.min[axis])
+            --qmin;
+        while (qmax < 255 && wide.dequantize(axis, (uint8_t)qmax) < b.max[axis])
+            ++qmax;
+        wide.qmin[axis][slot] = (uint8_t)qmin;
+        wide.qmax[axis][slot] = (uint8_t)qmax;
+    }
+}
+
+static uint32_t collapse(const SBVH &bvh, const WideChildRef &ref, std::vector<SBVHWideNode> &wideNodes)
+{
+    uint32_t wideIndex = (uint32_t)wideNodes.size();
+    wideNodes.emplace_back();
+
+    // Open the interior child with the largest surface area until the node is full.
+    WideChildRef children[SBVHWideNode::width];
+    uint32_t childCount = 0;
+    if (bvh.nodes[ref.nodeIndex].is_leaf()) {
+        children[childCount++] = ref;
+    } else {
+        children[childCount++] = binaryChild(bvh, ref, 0);
+        children[childCount++] = binaryChild(bvh, ref, 1);
+    }
+    while (childCount < SBVHWideNode::width) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (uint32_t i = 0; i < childCount; ++i) {
+            const SBVHNode &node = bvh.nodes[children[i].nodeIndex];
+            if (!node.is_leaf() && node.bound.surface_area() > bestArea) {
+                best = (int)i;
+                bestArea = node.bound.surface_area();
+            }
+        }
+        if (best < 0)
+            break;
+        WideChildRef opened = children[best];
+        children[best] = binaryChild(bvh, opened, 0);
+        children[childCount++] = binaryChild(bvh, opened, 1);
+    }
+
+    SBVHWideNode wide{};
+    const AABB3 &bound = bvh.nodes[ref.nodeIndex].bound;
+    wide.origin = bound.min;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        // Smallest power of two that covers the extent in 255 steps.
+        int exponent;
+        std::frexp(bound.extents()[axis] / 255.0f, &exponent);
+        wide.exponent[axis] = (int8_t)clamp(exponent, -126, 127);
+    }
+    wide.childCount = (uint8_t)childCount;
+    for (uint32_t i = 0; i < childCount; ++i) {
+        const SBVHNode &node = bvh.nodes[children[i].nodeIndex];
+        quantizeChild(wide, i, node.bound);
+        if (node.is_leaf()) {
+            CUDA_ASSERT(children[i].primCount > 0 && children[i].primCount <= UINT16_MAX);
+            wide.child[i] = node.primOffset;
+            wide.primCount[i] = (uint16_t)children[i].primCount;
+        }
+    }
+    for (uint32_t i = 0; i < childCount; ++i) {
+        if (!bvh.nodes[children[i].nodeIndex].is_leaf()) {
+            wide.child[i] = collapse(bvh, children[i], wideNodes);
+        }
+    }
+    wideNodes[wideIndex] = wide;
+    return wideIndex;
+}
+
+// Number of nodes on the longest root-to-leaf path.
+static uint32_t binaryDepth(const SBVH &bvh)
+{
+    uint32_t maxDepth = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> stack{{0, 1}};
+    while (!stack.empty()) {
+        auto [nodeIndex, depth] = stack.back();
+        stack.pop_back();
+        maxDepth = std::max(maxDepth, depth);
+        const SBVHNode &node = bvh.nodes[nodeIndex];
+        if (!node.is_leaf()) {
+            stack.push_back({nodeIndex + 1, depth + 1});
+            stack.push_back({node.rightChildOffset, depth + 1});
+        }
+    }
+    return maxDepth;
+}
+
+// Number of wide nodes on the longest root-to-leaf path.
+static uint32_t wideDepth(const std::vector<SBVHWideNode> &wideNodes)
+{
+    uint32_t maxDepth = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> stack{{0, 1}};
+    while (!stack.empty()) {
+        auto [nodeIndex, depth] = stack.back();
+        stack.pop_back();
+        maxDepth = std::max(maxDepth, depth);
+        const SBVHWideNode &node = wideNodes[nodeIndex];
+        for (uint32_t i = 0; i < node.childCount; ++i) {
+            if (!node.is_leaf(i))
+                stack.push_back({node.child[i], depth + 1});
+        }
+    }
+    return maxDepth;
+}
+
+void SBVH::buildWideNodes()
+{
+    std::vector<SBVHWideNode> collapsed;
+    collapsed.reserve(nodes.size / 2 + 1);
+    collapse(*this, {0, (uint32_t)primitives.size}, collapsed);
+    wideNodes = CudaManagedArray<SBVHWideNode>(span<const SBVHWideNode>(collapsed.data(), collapsed.size()));
+
+    // The binary traversal keeps at most one entry per level, the wide traversal up to width - 1 per level plus the
+    // children of the deepest node. CUDA_ASSERT compiles out of device code, so overflows must be ruled out here.
+    uint32_t binaryStackSize = binaryDepth(*this);
+    CUDA_ASSERT_FMT(binaryStackSize <= traversalStackSize,
+                    "SBVH is too deep (%u levels) for the traversal stack (%u entries). Try a larger maxPrimsInNode.",
+                    binaryStackSize, traversalStackSize);
+    uint32_t wideStackSize = (SBVHWideNode::width - 1) * (wideDepth(collapsed) - 1) + SBVHWideNode::width;
+    useWideNodes = wideStackSize <= traversalStackSize;
+    if (!useWideNodes) {
+        printf("[SBVH]: Collapsed tree needs %u stack entries (max %u), using the binary traversal.\n", wideStackSize,
+               traversalStackSize);
+    }
+}
+
+void SBVH::prefetch(cudaStream_t stream) const
+{
+    vertices.prefetch(stream);
+    indices.prefetch(stream);
+    primitives.prefetch(stream);
+    nodes.prefetch(stream);
+    wideNodes.prefetch(stream);
 }
 
 void SBVH::printStats() const
@@ -446,6 +769,7 @@ void SBVH::printStats() const
     printf("SBVH stats:\n");
     printf("bound: [%.4f, %.4f, %.4f] -> [%.4f, %.4f, %.4f]\n", b.min.x, b.min.y, b.min.x, b.max.x, b.max.y, b.max.x);
     printf("node count: %lu\n", nodes.size);
+    printf("wide node count: %lu\n", wideNodes.size);
     printf("----------------------------------------\n");
 }
 
@@ -457,7 +781,7 @@ struct TraversalStackEntry
 
 struct TraversalStack
 {
-    static constexpr uint8_t maxStackDepth = 64;
+    static constexpr uint32_t maxStackDepth = SBVH::traversalStackSize;
     TraversalStackEntry entries[maxStackDepth];
     uint8_t stackSize = 0;
 
@@ -509,7 +833,7 @@ struct IsectQuery
     const SBVHIsectOption &option;
 };
 
-SBVHIsectRecord SBVH::intersect(const Ray &ray, const SBVHIsectOption &option) const
+SBVHIsectRecord SBVH::intersectBinary(const Ray &ray, const SBVHIsectOption &option) const
 {
     SBVHIsectRecord record;
 
@@ -559,7 +883,7 @@ SBVHIsectRecord SBVH::intersect(const Ray &ray, const SBVHIsectOption &option) c
     return record;
 }
 
-bool SBVH::intersectBool(const Ray &ray, const SBVHIsectOption &option) const
+bool SBVH::intersectBoolBinary(const Ray &ray, const SBVHIsectOption &option) const
 {
     IsectQuery query(ray, option);
     TraversalStack stack;
@@ -602,4 +926,175 @@ bool SBVH::intersectBool(const Ray &ray, const SBVHIsectOption &option) const
     return false;
 }
 
+
+struct WideTraversalEntry
+{
+    uint32_t nodeIndex;
+    // Entry distance into the node, to skip it once a closer hit is found.
+    float tnear;
+};
+
+struct WideTraversalStack
+{
+    static constexpr uint32_t maxStackDepth = SBVH::traversalStackSize;
+    WideTraversalEntry entries[maxStackDepth];
+    uint8_t stackSize = 0;
+
+    CUDA_HOST_DEVICE
+    void push(uint32_t nodeIndex, float tnear)
+    {
+        CUDA_ASSERT(stackSize < maxStackDepth);
+        entries[stackSize++] = {nodeIndex, tnear};
+    }
+
+    CUDA_HOST_DEVICE
+    WideTraversalEntry pop()
+    {
+        CUDA_ASSERT(stackSize > 0);
+        return entries[--stackSize];
+    }
+
+    CUDA_HOST_DEVICE
+    bool empty() const { return stackSize == 0; }
+};
+
+// Slab test against all children of a wide node. Returns the number of hit children, whose slots are written to
+// order[] sorted front to back.
+CUDA_HOST_DEVICE
+inline uint32_t intersectChildren(const IsectQuery &query, const SBVHWideNode &node, uint32_t order[SBVHWideNode::width],
+                                  float tnear[SBVHWideNode::width])
+{
+    const Ray &ray = query.ray;
+    const RayBoundHelper &rb = query.rb;
+    float scale[3];
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        scale[axis] = ldexpf(1.0f, node.exponent[axis]);
+    }
+    uint32_t hitCount = 0;
+    for (uint32_t i = 0; i < node.childCount; ++i) {
+        float t0 = ray.tmin;
+        float t1 = ray.tmax;
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            // Same as SBVHWideNode::dequantize.
+            uint8_t qEnter = rb.dir_is_neg[axis] ? node.qmax[axis][i] : node.qmin[axis][i];
+            uint8_t qExit = rb.dir_is_neg[axis] ? node.qmin[axis][i] : node.qmax[axis][i];
+            // Need to avoid 0 multiplied by inf here...
+            float tEnter = (node.origin[axis] + (float)qEnter * scale[axis]) - ray.origin[axis];
+            if (tEnter != 0.0f)
+                tEnter *= rb.inv_dir[axis];
+            float tExit = (node.origin[axis] + (float)qExit * scale[axis]) - ray.origin[axis];
+            if (tExit != 0.0f)
+                tExit *= rb.inv_dir[axis];
+            t0 = tEnter > t0 ? tEnter : t0;
+            t1 = tExit < t1 ? tExit : t1;
+        }
+        if (t0 > t1)
+            continue;
+        // Insertion sort, at most 4 entries.
+        uint32_t j = hitCount++;
+        while (j > 0 && tnear[j - 1] > t0) {
+            tnear[j] = tnear[j - 1];
+            order[j] = order[j - 1];
+            --j;
+        }
+        tnear[j] = t0;
+        order[j] = i;
+    }
+    return hitCount;
+}
+
+SBVHIsectRecord SBVH::intersect(const Ray &ray, const SBVHIsectOption &option) const
+{
+    if (!useWideNodes)
+        return intersectBinary(ray, option);
+    SBVHIsectRecord record;
+
+    IsectQuery query(ray, option);
+    if (!query.intersect(bound()))
+        return record;
+    WideTraversalStack stack;
+    uint32_t nodeIndex = 0;
+    while (true) {
+        const SBVHWideNode &node = wideNodes[nodeIndex];
+        uint32_t order[SBVHWideNode::width];
+        float tnear[SBVHWideNode::width];
+        uint32_t hitCount = intersectChildren(query, node, order, tnear);
+
+        // Leaves first (front to back) to shrink tmax before deciding which subtrees to visit.
+        for (uint32_t k = 0; k < hitCount; ++k) {
+            uint32_t i = order[k];
+            if (!node.is_leaf(i) || tnear[k] > query.ray.tmax)
+                continue;
+            for (uint32_t p = 0; p < node.primCount[i]; ++p) {
+                const Primitive &prim = primitives[node.child[i] + p];
+                RayTriIsect isect;
+                if (query.intersect(tri_verts(prim.shapeIndex), &isect) && isect.tHit < query.ray.tmax) {
+                    query.ray.tmax = isect.tHit;
+                    record.coord = isect.coord;
+                    record.thit = isect.tHit;
+                    record.tri_idx = prim.shapeIndex;
+                }
+            }
+        }
+        // Push back to front so the nearest subtree is popped first.
+        for (uint32_t k = hitCount; k-- > 0;) {
+            uint32_t i = order[k];
+            if (!node.is_leaf(i) && tnear[k] <= query.ray.tmax)
+                stack.push(node.child[i], tnear[k]);
+        }
+
+        bool found = false;
+        while (!stack.empty()) {
+            WideTraversalEntry entry = stack.pop();
+            if (entry.tnear <= query.ray.tmax) {
+                nodeIndex = entry.nodeIndex;
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            break;
+    }
+
+    return record;
+}
+
+bool SBVH::intersectBool(const Ray &ray, const SBVHIsectOption &option) const
+{
+    if (!useWideNodes)
+        return intersectBoolBinary(ray, option);
+    IsectQuery query(ray, option);
+    if (!query.intersect(bound()))
+        return false;
+    WideTraversalStack stack;
+    uint32_t nodeIndex = 0;
+    while (true) {
+        const SBVHWideNode &node = wideNodes[nodeIndex];
+        uint32_t order[SBVHWideNode::width];
+        float tnear[SBVHWideNode::width];
+        uint32_t hitCount = intersectChildren(query, node, order, tnear);
+        for (uint32_t k = 0; k < hitCount; ++k) {
+            uint32_t i = order[k];
+            if (!node.is_leaf(i))
+                continue;
+            for (uint32_t p = 0; p < node.primCount[i]; ++p) {
+                const Primitive &prim = primitives[node.child[i] + p];
+                if (query.intersect(tri_verts(prim.shapeIndex))) {
+                    return true;
+                }
+            }
+        }
+        for (uint32_t k = hitCount; k-- > 0;) {
+            uint32_t i = order[k];
+            if (!node.is_leaf(i))
+                stack.push(node.child[i], tnear[k]);
+        }
+        if (stack.empty())
+            break;
+        nodeIndex = stack.pop().nodeIndex;
+    }
+
+    return false;
+}
+
 } // namespace ksc
\ No newline at end of file
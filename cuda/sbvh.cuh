@@ -2,6 +2,8 @@
 #include "aabb.cuh"
 #include "memory.cuh"
 #include "vecmath.cuh"
+#include <filesystem>
+namespace fs = std::filesystem;
 
 namespace ksc
 {
@@ -13,6 +15,9 @@ struct SBVHBuildOption
     float travWeight = 1.0f;
     // Control spatial splitting.
     float alpha = 1e-5f;
+    // Nodes with at least this many references build their two subtrees in parallel.
+    // Doesn't change the result.
+    uint32_t parallelBuildThreshold = 1 << 12;
 };
 
 struct alignas(32) SBVHNode
@@ -27,6 +32,29 @@ struct alignas(32) SBVHNode
 };
 static_assert(sizeof(SBVHNode) == 32, "Unexpected SBVHNode size.");
 
+// Collapsed from the binary nodes. Child bounds are quantized to 8 bits per axis on a power-of-two grid anchored at
+// the node bound, so one 64-byte node replaces up to three binary nodes.
+struct alignas(64) SBVHWideNode
+{
+    static constexpr uint32_t width = 4;
+
+    vec3 origin;
+    int8_t exponent[3];
+    uint8_t childCount;
+    uint8_t qmin[3][width];
+    uint8_t qmax[3][width];
+    // Wide node index for interior children, first primitive for leaves.
+    uint32_t child[width];
+    // 0 for interior children.
+    uint16_t primCount[width];
+
+    CUDA_HOST_DEVICE
+    bool is_leaf(uint32_t i) const { return primCount[i] > 0; }
+    CUDA_HOST_DEVICE
+    float dequantize(uint32_t axis, uint8_t q) const { return origin[axis] + (float)q * ldexpf(1.0f, exponent[axis]); }
+};
+static_assert(sizeof(SBVHWideNode) == 64, "Unexpected SBVHWideNode size.");
+
 enum class SBVHCulling : uint8_t
 {
     CullBackface,
@@ -58,12 +86,28 @@ struct SBVH
 {
     SBVH() = default;
     SBVH(const SBVHBuildOption &option, span<const vec3> vertices, span<const uint32_t> indices);
+    // Loads the BVH from cachePath (e.g. next to the binary mesh asset) if it was built from the same mesh and options,
+    // otherwise builds it and writes the cache.
+    SBVH(const SBVHBuildOption &option, span<const vec3> vertices, span<const uint32_t> indices,
+         const fs::path &cachePath);
     void build(const SBVHBuildOption &option);
+    bool loadCache(const SBVHBuildOption &option, const fs::path &path);
+    void saveCache(const SBVHBuildOption &option, const fs::path &path) const;
+    // Called by build() and loadCache().
+    void buildWideNodes();
+    // Moves the managed arrays to the device ahead of traversal (see cuda_prefetch_managed). Read-mostly afterwards.
+    void prefetch(cudaStream_t stream = 0) const;
     void printStats() const;
+    // Traverse the wide nodes.
     CUDA_HOST_DEVICE
     SBVHIsectRecord intersect(const Ray &ray, const SBVHIsectOption &option) const;
     CUDA_HOST_DEVICE
     bool intersectBool(const Ray &ray, const SBVHIsectOption &option) const;
+    // Traverse the binary nodes (reference).
+    CUDA_HOST_DEVICE
+    SBVHIsectRecord intersectBinary(const Ray &ray, const SBVHIsectOption &option) const;
+    CUDA_HOST_DEVICE
+    bool intersectBoolBinary(const Ray &ray, const SBVHIsectOption &option) const;
     CUDA_HOST_DEVICE
     AABB3 bound() const { return nodes[0].bound; }
 
@@ -91,6 +135,13 @@ struct SBVH
     CudaManagedArray<uint32_t> indices;
     CudaManagedArray<Primitive> primitives;
     CudaManagedArray<SBVHNode> nodes;
+    CudaManagedArray<SBVHWideNode> wideNodes;
+
+    // Entries of the fixed-size traversal stacks. buildWideNodes checks the depth of both trees against it.
+    static constexpr uint32_t traversalStackSize = 64;
+    // Set by buildWideNodes. The wide traversal can push up to width - 1 entries per level, so it is only used if the
+    // collapsed tree is shallow enough. intersect() and intersectBool() fall back to the binary traversal otherwise.
+    bool useWideNodes = true;
 };
 
 } // namespace ksc
\ No newline at end of file
@@ -5,17 +5,50 @@
 namespace ksc
 {
 
+size_t block_compressed_bytes(cudaChannelFormatKind kind)
+{
+    switch (kind) {
+    case cudaChannelFormatKindUnsignedBlockCompressed1:
+    case cudaChannelFormatKindUnsignedBlockCompressed1SRGB:
+    case cudaChannelFormatKindUnsignedBlockCompressed4:
+    case cudaChannelFormatKindSignedBlockCompressed4:
+        return 8;
+    case cudaChannelFormatKindUnsignedBlockCompressed2:
+    case cudaChannelFormatKindUnsignedBlockCompressed2SRGB:
+    case cudaChannelFormatKindUnsignedBlockCompressed3:
+    case cudaChannelFormatKindUnsignedBlockCompressed3SRGB:
+    case cudaChannelFormatKindUnsignedBlockCompressed5:
+    case cudaChannelFormatKindSignedBlockCompressed5:
+    case cudaChannelFormatKindUnsignedBlockCompressed6H:
+    case cudaChannelFormatKindSignedBlockCompressed6H:
+    case cudaChannelFormatKindUnsignedBlockCompressed7:
+    case cudaChannelFormatKindUnsignedBlockCompressed7SRGB:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
 Texture2D::Texture2D(size_t width, size_t height, const cudaChannelFormatDesc &format_desc,
                      const cudaTextureDesc &tex_desc, span<const std::byte> data)
     : width(width), height(height), format_desc(format_desc), tex_desc(tex_desc)
 {
     cuda_check(cudaMallocArray(&arr, &format_desc, width, height));
 
-    size_t texel_bytes = (format_desc.x + format_desc.y + format_desc.z + format_desc.w) / 8;
-    size_t spitch = width * texel_bytes;
-    // width - Width of matrix transfer(columns in bytes)
-    cuda_check(
-        cudaMemcpy2DToArray(arr, 0, 0, data.data(), spitch, width * texel_bytes, height, cudaMemcpyHostToDevice));
+    size_t block_bytes = block_compressed_bytes(format_desc.f);
+    if (block_bytes > 0) {
+        // Rows of 4x4 blocks (e.g. ks::Texture mips of block-compressed types). Partial blocks at the right and bottom
+        // edges are stored whole.
+        size_t spitch = ((width + 3) / 4) * block_bytes;
+        cuda_check(
+            cudaMemcpy2DToArray(arr, 0, 0, data.data(), spitch, spitch, (height + 3) / 4, cudaMemcpyHostToDevice));
+    } else {
+        size_t texel_bytes = (format_desc.x + format_desc.y + format_desc.z + format_desc.w) / 8;
+        size_t spitch = width * texel_bytes;
+        // width - Width of matrix transfer(columns in bytes)
+        cuda_check(
+            cudaMemcpy2DToArray(arr, 0, 0, data.data(), spitch, width * texel_bytes, height, cudaMemcpyHostToDevice));
+    }
 
     cudaResourceDesc resDesc{};
     resDesc.resType = cudaResourceTypeArray;
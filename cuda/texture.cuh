@@ -10,6 +10,11 @@
 namespace ksc
 {
 
+// Bytes per 4x4 block of block-compressed formats (cudaChannelFormatKind*BlockCompressed*), 0 otherwise.
+size_t block_compressed_bytes(cudaChannelFormatKind kind);
+
+// NOTE: block-compressed data (e.g. from ks::Texture with TextureDataType::bc*) is uploaded as is. Use
+// cudaCreateChannelDesc<cudaChannelFormatKindUnsignedBlockCompressed1>() etc. and read with normalized float.
 struct Texture2D
 {
     Texture2D() = default;
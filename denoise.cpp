@@ -0,0 +1,259 @@
+#include "denoise.h"
+#include "assertion.h"
+#include "parallel.h"
+#if KS_ENABLE_OIDN
+#include <OpenImageDenoise/oidn.hpp>
+#endif
+
+namespace ks
+{
+
+DenoiseOptions load_denoise_options(const ConfigArgs &args)
+{
+    DenoiseOptions options;
+    if (args.contains("type")) {
+        std::string type = args.load_string("type");
+        if (type == "oidn") {
+            options.type = DenoiserType::OIDN;
+        } else if (type == "atrous") {
+            options.type = DenoiserType::ATrous;
+        } else {
+            ASSERT(false, "Invalid denoiser type [%s].", type.c_str());
+        }
+    }
+    ASSERT(KS_ENABLE_OIDN || options.type != DenoiserType::OIDN, "Built without OIDN (see KS_ENABLE_OIDN).");
+    options.cuda = args.load_bool("cuda", options.cuda);
+    options.prefilter_aux = args.load_bool("prefilter_aux", options.prefilter_aux);
+    options.iterations = args.load_integer("iterations", options.iterations);
+    options.sigma_color = args.load_float("sigma_color", options.sigma_color);
+    options.sigma_normal = args.load_float("sigma_normal", options.sigma_normal);
+    options.sigma_albedo = args.load_float("sigma_albedo", options.sigma_albedo);
+    options.preview = args.load_bool("preview", options.preview);
+    ASSERT(options.iterations >= 0);
+    return options;
+}
+
+// Per-pixel means of a 3-channel AOV, or empty if not enabled.
+static std::vector<color3> resolve_aov3(const RenderTarget &rt, AOV aov)
+{
+    if (!rt.has_aov(aov)) {
+        return {};
+    }
+    std::vector<ExrChannel> channels = rt.resolve_aov(aov);
+    std::vector<color3> out(rt.pixels.size());
+    for (size_t i = 0; i < out.size(); ++i)
+        out[i] = color3(channels[0].data[i], channels[1].data[i], channels[2].data[i]);
+    return out;
+}
+
+struct DenoiserInternal
+{
+#if KS_ENABLE_OIDN
+    oidn::DeviceRef device;
+#endif
+};
+
+#if KS_ENABLE_OIDN
+static bool oidn_check(oidn::DeviceRef &device)
+{
+    const char *message;
+    if (device.getError(message) != oidn::Error::None) {
+        fprintf(stderr, "OIDN error: %s\n", message);
+        return false;
+    }
+    return true;
+}
+
+// Denoises an auxiliary image in place with the RT filter in its prefiltering mode (only the aux image bound).
+static void oidn_prefilter(oidn::DeviceRef &device, int width, int height, const char *name, std::vector<color3> &aux)
+{
+    size_t bytes = aux.size() * sizeof(color3);
+    oidn::BufferRef buf = device.newBuffer(bytes);
+    buf.write(0, bytes, aux.data());
+    oidn::FilterRef filter = device.newFilter("RT");
+    filter.setImage(name, buf, oidn::Format::Float3, width, height);
+    filter.setImage("output", buf, oidn::Format::Float3, width, height);
+    filter.commit();
+    filter.execute();
+    if (oidn_check(device))
+        buf.read(0, bytes, aux.data());
+}
+
+static void oidn_filter(oidn::DeviceRef &device, int width, int height, std::vector<color3> &color,
+                        const std::vector<color3> &albedo, const std::vector<color3> &normal, bool clean_aux)
+{
+    size_t bytes = color.size() * sizeof(color3);
+    oidn::BufferRef color_buf = device.newBuffer(bytes);
+    color_buf.write(0, bytes, color.data());
+    oidn::FilterRef filter = device.newFilter("RT");
+    filter.setImage("color", color_buf, oidn::Format::Float3, width, height);
+    filter.setImage("output", color_buf, oidn::Format::Float3, width, height);
+    oidn::BufferRef albedo_buf, normal_buf;
+    if (!albedo.empty()) {
+        albedo_buf = device.newBuffer(bytes);
+        albedo_buf.write(0, bytes, albedo.data());
+        filter.setImage("albedo", albedo_buf, oidn::Format::Float3, width, height);
+        // The normal is only used together with the albedo.
+        if (!normal.empty()) {
+            normal_buf = device.newBuffer(bytes);
+            normal_buf.write(0, bytes, normal.data());
+            filter.setImage("normal", normal_buf, oidn::Format::Float3, width, height);
+        }
+    }
+    filter.set("hdr", true);
+    filter.set("cleanAux", clean_aux);
+    filter.commit();
+    filter.execute();
+    if (oidn_check(device))
+        color_buf.read(0, bytes, color.data());
+}
+
+static std::vector<color3> denoise_oidn(oidn::DeviceRef &device, const RenderTarget &rt, std::vector<color3> color,
+                                        std::vector<color3> albedo, std::vector<color3> normal,
+                                        const DenoiseOptions &options)
+{
+    bool clean_aux = false;
+    if (options.prefilter_aux && !albedo.empty()) {
+        oidn_prefilter(device, rt.width, rt.height, "albedo", albedo);
+        if (!normal.empty())
+            oidn_prefilter(device, rt.width, rt.height, "normal", normal);
+        clean_aux = true;
+    }
+    oidn_filter(device, rt.width, rt.height, color, albedo, normal, clean_aux);
+    return color;
+}
+#endif
+
+static std::vector<color3> denoise_atrous(const RenderTarget &rt, std::vector<color3> color,
+                                          const std::vector<color3> &albedo, const std::vector<color3> &normal,
+                                          const DenoiseOptions &options)
+{
+    int width = rt.width;
+    int height = rt.height;
+    size_t n = color.size();
+    // Filter the irradiance (color / albedo) so that textures stay sharp.
+    std::vector<color3> modulation(n, color3::Ones());
+    if (!albedo.empty()) {
+        for (size_t i = 0; i < n; ++i) {
+            modulation[i] = (albedo[i] > 0.01f).select(albedo[i], 1.0f);
+            color[i] = color[i] / modulation[i];
+        }
+    }
+    // Variance of the mean luminance, filtered along with the color.
+    std::vector<float> variance;
+    if (rt.has_statistics()) {
+        variance.resize(n);
+        std::vector<PixelStatistics> stats = rt.linearize<PixelStatistics>(rt.stats);
+        for (size_t i = 0; i < n; ++i) {
+            const PixelStatistics &s = stats[i];
+            float scale = luminance(modulation[i]);
+            variance[i] = s.count > 1 ? s.variance() / ((float)s.count * sqr(scale)) : inf;
+        }
+    }
+
+    constexpr float kernel[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+    std::vector<color3> next_color(n);
+    std::vector<float> next_variance(variance.size());
+    for (int iteration = 0; iteration < options.iterations; ++iteration) {
+        int step = 1 << iteration;
+        // Without statistics, the color range shrinks with the footprint (as in Dammertz et al.).
+        float sigma_color = options.sigma_color * std::exp2(-(float)iteration);
+        parallel_for(height, [&](int y) {
+            for (int x = 0; x < width; ++x) {
+                int p = y * width + x;
+                float lum_p = luminance(color[p]);
+                float color_scale = variance.empty() ? 0.0f : options.sigma_color * std::sqrt(variance[p]) + 1e-6f;
+                color3 sum = color3::Zero();
+                float sum_w = 0.0f;
+                float sum_var = 0.0f;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    int qy = y + dy * step;
+                    if (qy < 0 || qy >= height)
+                        continue;
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        int qx = x + dx * step;
+                        if (qx < 0 || qx >= width)
+                            continue;
+                        int q = qy * width + qx;
+                        float w = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                        if (!variance.empty()) {
+                            // Pixels without a variance estimate yet are not edge-stopped.
+                            if (std::isfinite(color_scale))
+                                w *= std::exp(-std::abs(lum_p - luminance(color[q])) / color_scale);
+                        } else {
+                            w *= std::exp(-(color[p] - color[q]).matrix().squaredNorm() / sqr(sigma_color));
+                        }
+                        if (!normal.empty()) {
+                            bool hit_p = !normal[p].isZero();
+                            bool hit_q = !normal[q].isZero();
+                            if (hit_p != hit_q)
+                                continue;
+                            if (hit_p) {
+                                float cos_n = normal[p].matrix().normalized().dot(normal[q].matrix().normalized());
+                                w *= std::pow(std::max(cos_n, 0.0f), options.sigma_normal);
+                            }
+                        }
+                        if (!albedo.empty()) {
+                            w *= std::exp(-(albedo[p] - albedo[q]).matrix().squaredNorm() / sqr(options.sigma_albedo));
+                        }
+                        sum += w * color[q];
+                        sum_w += w;
+                        if (!variance.empty())
+                            sum_var += sqr(w) * variance[q];
+                    }
+                }
+                // The center pixel always has a positive weight.
+                next_color[p] = sum / sum_w;
+                if (!variance.empty())
+                    next_variance[p] = sum_var / sqr(sum_w);
+            }
+        });
+        std::swap(color, next_color);
+        std::swap(variance, next_variance);
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        color[i] *= modulation[i];
+    return color;
+}
+
+Denoiser::Denoiser(const DenoiseOptions &options) : options(options), internal(std::make_unique<DenoiserInternal>())
+{
+#if KS_ENABLE_OIDN
+    if (options.type == DenoiserType::OIDN) {
+        internal->device = oidn::newDevice(options.cuda ? oidn::DeviceType::CUDA : oidn::DeviceType::CPU);
+        internal->device.commit();
+    }
+#endif
+}
+
+Denoiser::~Denoiser() = default;
+
+std::vector<color3> Denoiser::denoise(const RenderTarget &rt) const
+{
+    std::vector<color3> color = rt.linear_pixels();
+    if (rt.has_statistics()) {
+        rt.for_each_run([&](uint32_t linear, uint32_t i, int n) {
+            for (int j = 0; j < n; ++j)
+                color[linear + j] = rt.stats[i + j].mean;
+        });
+    }
+    std::vector<color3> albedo = resolve_aov3(rt, AOV::Albedo);
+    std::vector<color3> normal = resolve_aov3(rt, AOV::Normal);
+
+    if (options.type == DenoiserType::OIDN) {
+#if KS_ENABLE_OIDN
+        return denoise_oidn(internal->device, rt, std::move(color), std::move(albedo), std::move(normal), options);
+#else
+        ASSERT(false, "Built without OIDN (see KS_ENABLE_OIDN).");
+#endif
+    }
+    return denoise_atrous(rt, std::move(color), albedo, normal, options);
+}
+
+std::vector<color3> denoise(const RenderTarget &rt, const DenoiseOptions &options)
+{
+    return Denoiser(options).denoise(rt);
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+#include "config.h"
+#include "maths.h"
+#include "render_target.h"
+#include <memory>
+#include <vector>
+
+// Build with -DKS_ENABLE_OIDN=1 (and link OpenImageDenoise) for the neural denoiser.
+#ifndef KS_ENABLE_OIDN
+#define KS_ENABLE_OIDN 0
+#endif
+
+namespace ks
+{
+
+enum class DenoiserType
+{
+    // Intel Open Image Denoise, on the CPU or (with cuda) on the GPU.
+    OIDN,
+    // Edge-avoiding a-trous wavelet filter (Dammertz et al. 10) guided by the albedo and normal AOVs and, if the
+    // render has per-pixel statistics, the variance (as in SVGF). Much weaker, but has no dependencies.
+    ATrous,
+};
+
+struct DenoiseOptions
+{
+    DenoiserType type = KS_ENABLE_OIDN ? DenoiserType::OIDN : DenoiserType::ATrous;
+
+    // OIDN
+    bool cuda = false;
+    // Denoise the albedo and normal AOVs first, which OIDN assumes noise-free otherwise.
+    bool prefilter_aux = true;
+
+    // ATrous
+    int iterations = 5;
+    // Color edge stopping: relative to the standard error with statistics, absolute otherwise.
+    float sigma_color = 4.0f;
+    // Exponent of the normal similarity.
+    float sigma_normal = 128.0f;
+    float sigma_albedo = 0.1f;
+
+    // Also denoise the progressive passes for previews.
+    bool preview = false;
+};
+
+DenoiseOptions load_denoise_options(const ConfigArgs &args);
+
+struct DenoiserInternal;
+
+// Keeps the OIDN device alive between calls, so that e.g. the progressive previews don't create one per pass.
+struct Denoiser
+{
+    explicit Denoiser(const DenoiseOptions &options);
+    ~Denoiser();
+
+    // Beauty of rt (the per-pixel means with statistics), denoised with the albedo and normal AOVs of rt if enabled.
+    std::vector<color3> denoise(const RenderTarget &rt) const;
+
+    DenoiseOptions options;
+    std::unique_ptr<DenoiserInternal> internal;
+};
+
+// Same as Denoiser(options).denoise(rt).
+std::vector<color3> denoise(const RenderTarget &rt, const DenoiseOptions &options);
+
+} // namespace ks
\ No newline at end of file
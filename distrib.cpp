@@ -31,7 +31,7 @@ DistribTable::DistribTable(const float *f, uint32_t n) : cdf(n + 1)
 uint32_t DistribTable::sample(float u, float &prob) const
 {
     u = std::clamp(u, 0.0f, std::nextafter(1.0f, 0.0f));
-    ASSERT(u >= 0.0f && u < 1.0f);
+    ASSERT_HOT(u >= 0.0f && u < 1.0f);
     auto it = std::upper_bound(cdf.begin(), cdf.end(), u);
     uint32_t index = (uint32_t)std::distance(cdf.begin(), std::prev(it));
     prob = cdf[index + 1] - cdf[index];
@@ -41,7 +41,7 @@ uint32_t DistribTable::sample(float u, float &prob) const
 float DistribTable::sample_linear(float u, float &pdf, uint32_t &index) const
 {
     u = std::clamp(u, 0.0f, std::nextafter(1.0f, 0.0f));
-    ASSERT(u >= 0.0f && u < 1.0f);
+    ASSERT_HOT(u >= 0.0f && u < 1.0f);
     auto it = std::upper_bound(cdf.begin(), cdf.end(), u);
     index = (uint32_t)std::distance(cdf.begin(), std::prev(it));
     float n = (float)(cdf.size() - 1);
@@ -54,13 +54,13 @@ float DistribTable::sample_linear(float u, float &pdf, uint32_t &index) const
 float DistribTable::pdf(uint32_t index) const
 {
     uint32_t n = (uint32_t)(cdf.size() - 1);
-    ASSERT(index < n);
+    ASSERT_HOT(index < n);
     return (cdf[index + 1] - cdf[index]) * (float)n;
 }
 
 float DistribTable::pdf(float x) const
 {
-    ASSERT(x >= 0.0 && x <= 1.0f);
+    ASSERT_HOT(x >= 0.0 && x <= 1.0f);
     int n = (int)(cdf.size() - 1);
     uint32_t idx = (uint32_t)std::clamp((int)std::floor(x * n), 0, n - 1);
     return pdf(idx);
@@ -102,4 +102,123 @@ float DistribTable2D::pdf(const vec2 &p) const
     return pdf(x, y);
 }
 
+AliasTable::AliasTable(const float *f, uint32_t n) : bins(n)
+{
+    double sum = 0.0;
+    for (uint32_t i = 0; i < n; ++i) {
+        sum += f[i];
+    }
+    acc = (float)(sum / (double)n);
+    for (uint32_t i = 0; i < n; ++i) {
+        // Fall back to uniform like DistribTable.
+        bins[i].p = sum == 0.0 ? 1.0f / (float)n : (float)(f[i] / sum);
+        bins[i].alias = i;
+    }
+
+    // Vose's method.
+    std::vector<uint32_t> small, large;
+    std::vector<double> scaled(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        scaled[i] = (double)bins[i].p * (double)n;
+        if (scaled[i] < 1.0)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back();
+        small.pop_back();
+        uint32_t l = large.back();
+        bins[s].q = (float)scaled[s];
+        bins[s].alias = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Remaining ones are 1 up to numerical error.
+    for (uint32_t i : large)
+        bins[i].q = 1.0f;
+    for (uint32_t i : small)
+        bins[i].q = 1.0f;
+}
+
+uint32_t AliasTable::sample(float u, float &prob) const
+{
+    uint32_t index;
+    sample_linear(u, prob, index);
+    prob = bins[index].p;
+    return index;
+}
+
+float AliasTable::sample_linear(float u, float &pdf, uint32_t &index) const
+{
+    u = std::clamp(u, 0.0f, std::nextafter(1.0f, 0.0f));
+    ASSERT_HOT(u >= 0.0f && u < 1.0f);
+    uint32_t n = (uint32_t)bins.size();
+    float un = u * (float)n;
+    uint32_t i = std::min((uint32_t)un, n - 1);
+    float up = std::min(un - (float)i, before_one);
+    const Bin &bin = bins[i];
+    float du;
+    if (up < bin.q) {
+        index = i;
+        du = up / bin.q;
+    } else {
+        index = bin.alias;
+        du = (up - bin.q) / (1.0f - bin.q);
+    }
+    du = std::min(du, before_one);
+    pdf = bins[index].p * (float)n;
+    return (index + du) / (float)n;
+}
+
+float AliasTable::pdf(uint32_t index) const
+{
+    uint32_t n = (uint32_t)bins.size();
+    ASSERT_HOT(index < n);
+    return bins[index].p * (float)n;
+}
+
+float AliasTable::pdf(float x) const
+{
+    ASSERT_HOT(x >= 0.0 && x <= 1.0f);
+    int n = (int)bins.size();
+    uint32_t idx = (uint32_t)std::clamp((int)std::floor(x * n), 0, n - 1);
+    return pdf(idx);
+}
+
+AliasTable2D::AliasTable2D(const float *f, uint32_t nx, uint32_t ny)
+{
+    cond = std::vector<AliasTable>(ny);
+    for (uint32_t y = 0; y < ny; ++y) {
+        cond[y] = AliasTable(f + (y * nx), nx);
+    }
+    std::vector<float> marginPmf(ny);
+    for (uint32_t y = 0; y < ny; ++y) {
+        marginPmf[y] = cond[y].acc;
+    }
+    margin = AliasTable(marginPmf.data(), ny);
+}
+
+vec2 AliasTable2D::sample_linear(const vec2 &u, float &pdf) const
+{
+    float pdfMargin, pdfCond;
+    uint32_t uIndex, vIndex;
+    float vSample = margin.sample_linear(u[1], pdfMargin, vIndex);
+    float uSample = cond[vIndex].sample_linear(u[0], pdfCond, uIndex);
+    pdf = pdfMargin * pdfCond;
+    return vec2(uSample, vSample);
+}
+
+float AliasTable2D::pdf(uint32_t x, uint32_t y) const { return margin.pdf(y) * cond[y].pdf(x); }
+
+float AliasTable2D::pdf(const vec2 &p) const
+{
+    int x = std::clamp(int(p[0] * cond[0].size()), 0, (int)cond[0].size() - 1);
+    int y = std::clamp(int(p[1] * cond.size()), 0, (int)cond.size() - 1);
+    return pdf(x, y);
+}
+
 } // namespace ks
\ No newline at end of file
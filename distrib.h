@@ -1,6 +1,7 @@
 #pragma once
 
 #include "maths.h"
+#include <vector>
 
 namespace ks
 {
@@ -32,4 +33,42 @@ struct DistribTable2D
     DistribTable margin;
 };
 
+// Walker/Vose alias method: O(1) sampling with the same interface and pdf() semantics as DistribTable.
+// NOTE: unlike the CDF inversion, the mapping from u is not monotonic, which hurts stratified/QMC samples.
+struct AliasTable
+{
+    AliasTable() = default;
+
+    AliasTable(const float *f, uint32_t n);
+    uint32_t sample(float u, float &prob) const;
+    float sample_linear(float u, float &pdf, uint32_t &index) const;
+    float pdf(uint32_t index) const;
+    float pdf(float x) const;
+    uint32_t size() const { return (uint32_t)bins.size(); }
+
+    struct Bin
+    {
+        // Probability of keeping this bin (vs. jumping to alias).
+        float q;
+        uint32_t alias;
+        // Normalized probability of this bin.
+        float p;
+    };
+    std::vector<Bin> bins;
+    float acc = 0.0f;
+};
+
+struct AliasTable2D
+{
+    AliasTable2D() = default;
+    AliasTable2D(const float *f, uint32_t nx, uint32_t ny);
+
+    vec2 sample_linear(const vec2 &u, float &pdf) const;
+    float pdf(uint32_t x, uint32_t y) const;
+    float pdf(const vec2 &p) const;
+
+    std::vector<AliasTable> cond;
+    AliasTable margin;
+};
+
 } // namespace ks
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "distributed.h"
+#include <numeric>
+
+namespace ks
+{
+
+std::pair<int, int> DistributedOptions::sample_range(int spp) const
+{
+    if (split != DistributedSplit::Samples)
+        return {0, spp};
+    // Contiguous ranges so that the union over all workers is exactly [0, spp).
+    int begin = (int)((int64_t)spp * worker_id / num_workers);
+    int end = (int)((int64_t)spp * (worker_id + 1) / num_workers);
+    return {begin, end};
+}
+
+void DistributedOptions::filter_pixels(const RenderTarget &rt, const TileScheduler &tiling,
+                                       std::vector<uint32_t> &pixels) const
+{
+    if (split != DistributedSplit::Tiles || num_workers == 1)
+        return;
+    std::erase_if(pixels, [&](uint32_t pixel) {
+        vec2i xy = rt.coords(pixel);
+        return !owns_tile(tiling.tile_index(xy.x(), xy.y()));
+    });
+}
+
+void DistributedOptions::filter_tiles(std::vector<int> &tiles) const
+{
+    std::erase_if(tiles, [&](int tile) { return !owns_tile(tile); });
+}
+
+DistributedOptions load_distributed_options(const ConfigArgs &args, const fs::path &task_dir)
+{
+    DistributedOptions options;
+    std::string split = args.load_string("split", "tiles");
+    if (split == "tiles") {
+        options.split = DistributedSplit::Tiles;
+    } else if (split == "samples") {
+        options.split = DistributedSplit::Samples;
+    } else {
+        ASSERT(false, "Invalid distributed split [%s].", split.c_str());
+    }
+    options.num_workers = args.load_integer("num_workers");
+    options.worker_id = args.load_integer("worker_id");
+    options.partial_path = task_dir / args.load_string("partial", "partial.bin");
+    ASSERT(options.num_workers > 0 && options.worker_id >= 0 && options.worker_id < options.num_workers,
+           "Invalid distributed options.");
+    return options;
+}
+
+RenderTarget merge_partial_renders(std::span<const fs::path> paths, int width, int height)
+{
+    RenderTarget rt(width, height, color3::Zero());
+    rt.enable_statistics();
+    RenderTarget partial(width, height, color3::Zero());
+    for (const fs::path &path : paths) {
+        int samples_taken = partial.load_checkpoint(path);
+        ASSERT(samples_taken >= 0, "Failed to load partial render [%s].", path.string().c_str());
+        ASSERT(partial.has_statistics(), "Partial render [%s] has no sample counts.", path.string().c_str());
+        rt.merge(partial);
+    }
+    rt.resolve_statistics();
+    return rt;
+}
+
+void merge_render_task(const ConfigArgs &args, const fs::path &task_dir, int task_id)
+{
+    int width = args.load_integer("width");
+    int height = args.load_integer("height");
+    std::vector<fs::path> paths;
+    int n_partials = args["partials"].array_size();
+    for (int i = 0; i < n_partials; ++i) {
+        paths.push_back(args["partials"].load_path(i));
+    }
+    RenderTarget rt = merge_partial_renders(paths, width, height);
+    printf("Merged %d partial renders.\n", n_partials);
+    rt.save_to_exr(task_dir / "render.exr");
+}
+
+} // namespace ks
\ No newline at end of file
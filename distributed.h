@@ -0,0 +1,48 @@
+#pragma once
+#include "config.h"
+#include "render_target.h"
+#include "tile_scheduler.h"
+#include <filesystem>
+#include <span>
+#include <vector>
+namespace fs = std::filesystem;
+
+namespace ks
+{
+
+// Splits one render task across independent worker processes (e.g. farm nodes). Each worker renders its share into a
+// partial RenderTarget with per-pixel statistics, and merge_render_task combines the partials.
+enum class DistributedSplit
+{
+    // Workers own interleaved tiles (see TileScheduler) and render all samples of them.
+    Tiles,
+    // Workers render disjoint sample index ranges of every pixel.
+    Samples,
+};
+
+struct DistributedOptions
+{
+    bool owns_tile(int tile) const { return split != DistributedSplit::Tiles || tile % num_workers == worker_id; }
+    // [begin, end) of the sample indices rendered by this worker, out of spp in total.
+    std::pair<int, int> sample_range(int spp) const;
+    // Drops the pixels of tiles (of tiling) owned by other workers. The order of the remaining pixels is kept.
+    // Pixels are storage indices of rt.
+    void filter_pixels(const RenderTarget &rt, const TileScheduler &tiling, std::vector<uint32_t> &pixels) const;
+    void filter_tiles(std::vector<int> &tiles) const;
+
+    DistributedSplit split = DistributedSplit::Tiles;
+    int num_workers = 1;
+    int worker_id = 0;
+    // Relative to the task directory.
+    fs::path partial_path = "partial.bin";
+};
+
+DistributedOptions load_distributed_options(const ConfigArgs &args, const fs::path &task_dir);
+
+// Weighted (by per-pixel sample count) merge of partial renders written by RenderTarget::save_checkpoint.
+// The merged target has statistics and its pixels are resolved.
+RenderTarget merge_partial_renders(std::span<const fs::path> paths, int width, int height);
+
+void merge_render_task(const ConfigArgs &args, const fs::path &task_dir, int task_id);
+
+} // namespace ks
\ No newline at end of file
@@ -43,10 +43,17 @@ void handle_embree_error(void *user_ptr, RTCError code, const char *str)
     exit(1);
 }
 
+static bool monitor_embree_memory(void *user_ptr, ssize_t bytes, bool post)
+{
+    static_cast<EmbreeDevice *>(user_ptr)->memory_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    return true;
+}
+
 EmbreeDevice::EmbreeDevice(const std::string &device_config) : device(rtcNewDevice(device_config.c_str()))
 {
     handle_embree_error(nullptr, rtcGetDeviceError(device), nullptr);
     rtcSetDeviceErrorFunction(device, handle_embree_error, nullptr);
+    rtcSetDeviceMemoryMonitorFunction(device, monitor_embree_memory, this);
     // TODO: Want this for cylinders, but my custom build embree crashes with when creating a lot of bezier curves
     // For now use a intersection/occlusion filter.
 
@@ -59,4 +66,126 @@ EmbreeDevice::EmbreeDevice(const std::string &device_config) : device(rtcNewDevi
 
 EmbreeDevice::~EmbreeDevice() { rtcReleaseDevice(device); }
 
+EmbreeBuildOptions load_embree_build_options(const ConfigArgs &args)
+{
+    EmbreeBuildOptions options;
+    std::string preset = args.load_string("preset", "interactive");
+    if (preset == "fast") {
+        options.quality = RTC_BUILD_QUALITY_LOW;
+    } else if (preset == "interactive") {
+        options.quality = RTC_BUILD_QUALITY_MEDIUM;
+    } else if (preset == "final") {
+        options.quality = RTC_BUILD_QUALITY_HIGH;
+    } else {
+        ASSERT(false, "Invalid bvh preset [%s].", preset.c_str());
+    }
+    int flags = RTC_SCENE_FLAG_NONE;
+    if (args.load_bool("compact", false))
+        flags |= RTC_SCENE_FLAG_COMPACT;
+    if (args.load_bool("robust", false))
+        flags |= RTC_SCENE_FLAG_ROBUST;
+    options.flags = (RTCSceneFlags)flags;
+    options.dynamic = args.load_bool("dynamic", false);
+    options.parallel_subscenes = args.load_bool("parallel_subscenes", true);
+    options.report = args.load_bool("report", false);
+    return options;
+}
+
+void RayStream::resize(uint32_t n)
+{
+    for (auto *a : {&org_x, &org_y, &org_z, &tnear, &dir_x, &dir_y, &dir_z, &time, &tfar})
+        a->resize(n);
+    for (auto *a : {&mask, &id, &flags})
+        a->resize(n);
+}
+
+void RayStream::set_ray(uint32_t i, const vec3 &origin, const vec3 &dir, float tn, float tf, float t)
+{
+    org_x[i] = origin.x();
+    org_y[i] = origin.y();
+    org_z[i] = origin.z();
+    tnear[i] = tn;
+    dir_x[i] = dir.x();
+    dir_y[i] = dir.y();
+    dir_z[i] = dir.z();
+    time[i] = t;
+    tfar[i] = tf;
+    mask[i] = ~0;
+    id[i] = i;
+    flags[i] = 0;
+}
+
+RTCRayNp RayStream::soa()
+{
+    RTCRayNp r;
+    r.org_x = org_x.data();
+    r.org_y = org_y.data();
+    r.org_z = org_z.data();
+    r.tnear = tnear.data();
+    r.dir_x = dir_x.data();
+    r.dir_y = dir_y.data();
+    r.dir_z = dir_z.data();
+    r.time = time.data();
+    r.tfar = tfar.data();
+    r.mask = mask.data();
+    r.id = id.data();
+    r.flags = flags.data();
+    return r;
+}
+
+void RayHitStream::resize(uint32_t n)
+{
+    RayStream::resize(n);
+    for (auto *a : {&Ng_x, &Ng_y, &Ng_z, &u, &v})
+        a->resize(n);
+    prim_id.resize(n);
+    // Hits must be initialized to invalid before tracing.
+    geom_id.assign(n, RTC_INVALID_GEOMETRY_ID);
+    for (auto &inst : inst_id)
+        inst.assign(n, RTC_INVALID_GEOMETRY_ID);
+}
+
+RTCRayHit RayHitStream::rayhit(uint32_t i) const
+{
+    RTCRayHit rh;
+    rh.ray.org_x = org_x[i];
+    rh.ray.org_y = org_y[i];
+    rh.ray.org_z = org_z[i];
+    rh.ray.tnear = tnear[i];
+    rh.ray.dir_x = dir_x[i];
+    rh.ray.dir_y = dir_y[i];
+    rh.ray.dir_z = dir_z[i];
+    rh.ray.time = time[i];
+    rh.ray.tfar = tfar[i];
+    rh.ray.mask = mask[i];
+    rh.ray.id = id[i];
+    rh.ray.flags = flags[i];
+    rh.hit.Ng_x = Ng_x[i];
+    rh.hit.Ng_y = Ng_y[i];
+    rh.hit.Ng_z = Ng_z[i];
+    rh.hit.u = u[i];
+    rh.hit.v = v[i];
+    rh.hit.primID = prim_id[i];
+    rh.hit.geomID = geom_id[i];
+    for (int l = 0; l < RTC_MAX_INSTANCE_LEVEL_COUNT; ++l)
+        rh.hit.instID[l] = inst_id[l][i];
+    return rh;
+}
+
+RTCRayHitNp RayHitStream::soa()
+{
+    RTCRayHitNp rh;
+    rh.ray = RayStream::soa();
+    rh.hit.Ng_x = Ng_x.data();
+    rh.hit.Ng_y = Ng_y.data();
+    rh.hit.Ng_z = Ng_z.data();
+    rh.hit.u = u.data();
+    rh.hit.v = v.data();
+    rh.hit.primID = prim_id.data();
+    rh.hit.geomID = geom_id.data();
+    for (int l = 0; l < RTC_MAX_INSTANCE_LEVEL_COUNT; ++l)
+        rh.hit.instID[l] = inst_id[l].data();
+    return rh;
+}
+
 } // namespace ks
\ No newline at end of file
@@ -2,8 +2,12 @@
 
 #include "aabb.h"
 #include "assertion.h"
+#include "config.h"
 #include "ray.h"
+#include <array>
+#include <atomic>
 #include <embree3/rtcore.h>
+#include <vector>
 
 namespace ks
 {
@@ -14,10 +18,32 @@ struct EmbreeDevice
     ~EmbreeDevice();
 
     operator RTCDevice() const { return device; }
+    // Bytes currently allocated by embree (BVHs and non-shared buffers), see rtcSetDeviceMemoryMonitorFunction.
+    int64_t memory_usage() const { return memory_bytes.load(std::memory_order_relaxed); }
 
     RTCDevice device;
+    std::atomic<int64_t> memory_bytes = 0;
 };
 
+// BVH build settings for SubScene/Scene::create_rtc_scene.
+struct EmbreeBuildOptions
+{
+    RTCBuildQuality quality = RTC_BUILD_QUALITY_MEDIUM;
+    // Added to RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION.
+    RTCSceneFlags flags = RTC_SCENE_FLAG_NONE;
+    // For scenes updated every frame (see Scene::commit_updates): faster, less optimized builds.
+    bool dynamic = false;
+    // Commit independent subscenes concurrently.
+    bool parallel_subscenes = true;
+    // Print build time and BVH memory per subscene.
+    bool report = false;
+};
+
+// Presets: "fast" (low quality, quick previews), "interactive" (medium, the embree default) and "final" (high quality
+// with spatial splits, for long renders). Flags: compact (less memory, slower traversal), robust (no precision
+// shortcuts) and dynamic (animated scenes).
+EmbreeBuildOptions load_embree_build_options(const ConfigArgs &args);
+
 struct IntersectContext
 {
     IntersectContext() { rtcInitIntersectContext(&context); }
@@ -26,7 +52,7 @@ struct IntersectContext
     void *ext = nullptr; // allow extended intersection data to callbacks
 };
 
-inline RTCRay spawn_ray(const vec3 &origin, const vec3 &dir, float tnear, float tfar)
+inline RTCRay spawn_ray(const vec3 &origin, const vec3 &dir, float tnear, float tfar, float time = 0.0f)
 {
     RTCRay ray;
     ray.org_x = origin.x();
@@ -37,7 +63,7 @@ inline RTCRay spawn_ray(const vec3 &origin, const vec3 &dir, float tnear, float
     ray.dir_z = dir.z();
     ray.tnear = tnear;
     ray.tfar = tfar;
-    ray.time = uint_as_float(~0);
+    ray.time = time;
     ray.mask = ~0;
     ray.id = ~0;
     ray.flags = 0;
@@ -55,10 +81,10 @@ inline RTCRay spawn_rtcray(vec3 origin, const vec3 &dir, const vec3 &ng, float t
     return spawn_ray(origin, dir, tnear, tfar);
 }
 
-inline RTCRayHit spawn_rtcrayhit(const vec3 &origin, const vec3 &dir, float tnear, float tfar)
+inline RTCRayHit spawn_rtcrayhit(const vec3 &origin, const vec3 &dir, float tnear, float tfar, float time = 0.0f)
 {
     RTCRayHit rayhit;
-    rayhit.ray = spawn_ray(origin, dir, tnear, tfar);
+    rayhit.ray = spawn_ray(origin, dir, tnear, tfar, time);
     rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
     rayhit.hit.primID = RTC_INVALID_GEOMETRY_ID;
     return rayhit;
@@ -74,19 +100,21 @@ inline RTCRayHit spawn_rtcrayhit(vec3 origin, const vec3 &dir, const vec3 &ng, f
     return rayhit;
 }
 
-inline RTCRay to_rtcray(const Ray &ray) { return spawn_ray(ray.origin, ray.dir, ray.tmin, ray.tmax); }
+inline RTCRay to_rtcray(const Ray &ray) { return spawn_ray(ray.origin, ray.dir, ray.tmin, ray.tmax, ray.time); }
 
 inline Ray from_rtcray(const RTCRay &ray)
 {
     vec3 o(ray.org_x, ray.org_y, ray.org_z);
     vec3 d(ray.dir_x, ray.dir_y, ray.dir_z);
-    return Ray(o, d, ray.tnear, ray.tfar);
+    Ray r(o, d, ray.tnear, ray.tfar);
+    r.time = ray.time;
+    return r;
 }
 
 inline RTCRayHit to_rtcrayhit(const Ray &ray)
 {
     RTCRayHit rayhit;
-    rayhit.ray = spawn_ray(ray.origin, ray.dir, ray.tmin, ray.tmax);
+    rayhit.ray = spawn_ray(ray.origin, ray.dir, ray.tmin, ray.tmax, ray.time);
     rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
     rayhit.hit.primID = RTC_INVALID_GEOMETRY_ID;
     return rayhit;
@@ -126,6 +154,55 @@ inline bool occlude1(RTCScene scene, const IntersectContext &ctx, RTCRay &ray)
     return ray.tfar == -inf;
 }
 
+// SoA ray buffers for stream queries (rtcIntersectNp/rtcOccludedNp).
+struct RayStream
+{
+    void resize(uint32_t n);
+    uint32_t size() const { return (uint32_t)org_x.size(); }
+    void set_ray(uint32_t i, const vec3 &origin, const vec3 &dir, float tnear, float tfar, float t = 0.0f);
+    RTCRayNp soa();
+
+    std::vector<float> org_x, org_y, org_z, tnear;
+    std::vector<float> dir_x, dir_y, dir_z, time;
+    std::vector<float> tfar;
+    std::vector<uint32_t> mask, id, flags;
+};
+
+struct RayHitStream : public RayStream
+{
+    void resize(uint32_t n);
+    bool hit(uint32_t i) const { return geom_id[i] != RTC_INVALID_GEOMETRY_ID; }
+    // Gather a single entry back to AoS layout (e.g. for Geometry::compute_intersection).
+    RTCRayHit rayhit(uint32_t i) const;
+    RTCRayHitNp soa();
+
+    std::vector<float> Ng_x, Ng_y, Ng_z, u, v;
+    std::vector<uint32_t> prim_id, geom_id;
+    std::array<std::vector<uint32_t>, RTC_MAX_INSTANCE_LEVEL_COUNT> inst_id;
+};
+
+// Coherent flag should only be set for ray streams with similar origins/directions (e.g. primary rays).
+inline void intersect_stream(RTCScene scene, const IntersectContext &ctx, RayHitStream &stream, bool coherent = false)
+{
+    if (stream.size() == 0)
+        return;
+    // Copy to keep ext visible to filter callbacks.
+    IntersectContext stream_ctx = ctx;
+    stream_ctx.context.flags = coherent ? RTC_INTERSECT_CONTEXT_FLAG_COHERENT : RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+    RTCRayHitNp soa = stream.soa();
+    rtcIntersectNp(scene, (RTCIntersectContext *)&stream_ctx, &soa, stream.size());
+}
+
+inline void occlude_stream(RTCScene scene, const IntersectContext &ctx, RayStream &stream, bool coherent = false)
+{
+    if (stream.size() == 0)
+        return;
+    IntersectContext stream_ctx = ctx;
+    stream_ctx.context.flags = coherent ? RTC_INTERSECT_CONTEXT_FLAG_COHERENT : RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+    RTCRayNp soa = stream.soa();
+    rtcOccludedNp(scene, (RTCIntersectContext *)&stream_ctx, &soa, stream.size());
+}
+
 inline AABB3 scene_bound(RTCScene scene)
 {
     ASSERT(scene);
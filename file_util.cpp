@@ -0,0 +1,71 @@
+#include "file_util.h"
+#if _WIN32 || _WIN64
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ks
+{
+
+#if _WIN32 || _WIN64
+
+MappedFile::MappedFile(const fs::path &path)
+{
+    file_handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    ASSERT(file_handle != INVALID_HANDLE_VALUE, "Failed to open [%s].", path.string().c_str());
+    LARGE_INTEGER file_size;
+    ASSERT(GetFileSizeEx(file_handle, &file_size));
+    bytes = (size_t)file_size.QuadPart;
+    if (bytes == 0)
+        return;
+    mapping_handle = CreateFileMappingW(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    ASSERT(mapping_handle, "Failed to map [%s].", path.string().c_str());
+    ptr = reinterpret_cast<const std::byte *>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+    ASSERT(ptr, "Failed to map [%s].", path.string().c_str());
+}
+
+MappedFile::~MappedFile()
+{
+    if (ptr)
+        UnmapViewOfFile(ptr);
+    if (mapping_handle)
+        CloseHandle(mapping_handle);
+    if (file_handle && file_handle != INVALID_HANDLE_VALUE)
+        CloseHandle(file_handle);
+}
+
+#else
+
+MappedFile::MappedFile(const fs::path &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    ASSERT(fd >= 0, "Failed to open [%s].", path.string().c_str());
+    struct stat st;
+    ASSERT(fstat(fd, &st) == 0);
+    bytes = (size_t)st.st_size;
+    if (bytes > 0) {
+        void *addr = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        ASSERT(addr != MAP_FAILED, "Failed to map [%s].", path.string().c_str());
+        ptr = reinterpret_cast<const std::byte *>(addr);
+    }
+    // The mapping stays valid after closing the descriptor.
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (ptr)
+        munmap(const_cast<std::byte *>(ptr), bytes);
+}
+
+#endif
+
+} // namespace ks
\ No newline at end of file
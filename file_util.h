@@ -178,6 +178,26 @@ struct BinaryWriter
     std::ofstream stream;
 };
 
+// Read-only memory mapping of a whole file. Pages are backed by the page cache and shared between all processes
+// mapping the same file.
+struct MappedFile
+{
+    explicit MappedFile(const fs::path &path);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const std::byte *data() const { return ptr; }
+    size_t size() const { return bytes; }
+
+    const std::byte *ptr = nullptr;
+    size_t bytes = 0;
+#if _WIN32 || _WIN64
+    void *file_handle = nullptr;
+    void *mapping_handle = nullptr;
+#endif
+};
+
 // Poor man's std::format...
 template <typename... Args>
 std::string string_format(const std::string &format, Args... args)
@@ -1,5 +1,6 @@
 #include "geometry.h"
 #include "embree_util.h"
+#include "parallel.h"
 
 namespace ks
 {
@@ -12,8 +13,22 @@ Geometry::~Geometry()
     }
 }
 
+void MeshData::make_owned()
+{
+    if (!is_mapped())
+        return;
+    vertices.assign(mapped.vertices.begin(), mapped.vertices.end());
+    texcoords.assign(mapped.texcoords.begin(), mapped.texcoords.end());
+    vertex_normals.assign(mapped.vertex_normals.begin(), mapped.vertex_normals.end());
+    indices.assign(mapped.indices.begin(), mapped.indices.end());
+    triangle_order.assign(mapped.triangle_order.begin(), mapped.triangle_order.end());
+    mapped = MappedBuffers();
+    mapping.reset();
+}
+
 void MeshData::transform(const Transform &t)
 {
+    make_owned();
     for (int i = 0; i < (int)vertices.size() - 1; i += 3) {
         vec3 v(vertices[i + 0], vertices[i + 1], vertices[i + 2]);
         v = t.point(v);
@@ -21,7 +36,7 @@ void MeshData::transform(const Transform &t)
         vertices[i + 1] = v.y();
         vertices[i + 2] = v.z();
 
-        if (has_vertex_normal()) {
+        if (!vertex_normals.empty()) {
             vec3 vn(vertex_normals[i + 0], vertex_normals[i + 1], vertex_normals[i + 2]);
             vn = t.normal(vn);
             vertex_normals[i + 0] = vn.x();
@@ -29,35 +44,161 @@ void MeshData::transform(const Transform &t)
             vertex_normals[i + 2] = vn.z();
         }
     }
+    if (packed_vertex_normal) {
+        for (PackedAttributes &p : packed) {
+            p.normal = encode_octahedral(t.normal(decode_octahedral(p.normal)));
+        }
+    }
+    for (std::vector<float> &step : motion_vertices) {
+        for (int i = 0; i < (int)step.size() - 1; i += 3) {
+            vec3 v = t.point(vec3(step[i + 0], step[i + 1], step[i + 2]));
+            step[i + 0] = v.x();
+            step[i + 1] = v.y();
+            step[i + 2] = v.z();
+        }
+    }
+}
+
+void MeshData::compress_attributes()
+{
+    if (is_packed() || (!has_texcoord() && !has_vertex_normal()))
+        return;
+    make_owned();
+    uint32_t n = (uint32_t)vertex_count();
+    packed.resize(n);
+    if (!texcoords.empty()) {
+        AABB2 uv_bound;
+        for (uint32_t i = 0; i < n; ++i) {
+            uv_bound.expand(vec2(texcoords[2 * i], texcoords[2 * i + 1]));
+        }
+        packed_uv_min = uv_bound.min;
+        packed_uv_extent = uv_bound.extents();
+        vec2 scale = vec2::NullaryExpr([&](int a) {
+            return packed_uv_extent[a] > 0.0f ? 65535.0f / packed_uv_extent[a] : 0.0f;
+        });
+        for (uint32_t i = 0; i < n; ++i) {
+            vec2 q = (vec2(texcoords[2 * i], texcoords[2 * i + 1]) - packed_uv_min).cwiseProduct(scale);
+            packed[i].uv = {(uint16_t)std::clamp(std::round(q.x()), 0.0f, 65535.0f),
+                            (uint16_t)std::clamp(std::round(q.y()), 0.0f, 65535.0f)};
+        }
+        packed_texcoord = true;
+    }
+    if (!vertex_normals.empty()) {
+        for (uint32_t i = 0; i < n; ++i) {
+            vec3 vn(vertex_normals[3 * i], vertex_normals[3 * i + 1], vertex_normals[3 * i + 2]);
+            // Keep bad normals bad so that shading still falls back to the face normal.
+            packed[i].normal = vn.allFinite() && !vn.isZero() ? encode_octahedral(vn.normalized())
+                                                              : std::array<int16_t, 2>{0, 0};
+        }
+        packed_vertex_normal = true;
+    }
+    texcoords = std::vector<float>();
+    vertex_normals = std::vector<float>();
+}
+
+void MeshData::reorder_for_locality()
+{
+    ASSERT(!is_packed(), "Reorder before compressing attributes.");
+    make_owned();
+    uint32_t n_tris = (uint32_t)tri_count();
+    uint32_t n_verts = (uint32_t)vertex_count();
+    if (n_tris == 0)
+        return;
+
+    std::vector<vec3> centroids(n_tris);
+    parallel_for(n_tris, [&](uint32_t t) {
+        centroids[t] = (get_pos(indices[3 * t]) + get_pos(indices[3 * t + 1]) + get_pos(indices[3 * t + 2])) / 3.0f;
+    }, 1u << 12);
+    AABB3 bound;
+    for (const vec3 &c : centroids) {
+        bound.expand(c);
+    }
+    vec3 scale = vec3::NullaryExpr([&](int a) {
+        float extent = bound.max[a] - bound.min[a];
+        return extent > 0.0f ? 1023.0f / extent : 0.0f;
+    });
+    // (morton code, triangle): ties keep the file order.
+    std::vector<std::pair<uint32_t, uint32_t>> keys(n_tris);
+    parallel_for(n_tris, [&](uint32_t t) {
+        vec3 q = (centroids[t] - bound.min).cwiseProduct(scale);
+        keys[t] = {encode_morton_3((uint32_t)q.x(), (uint32_t)q.y(), (uint32_t)q.z()), t};
+    }, 1u << 12);
+    parallel_sort(keys.begin(), keys.end());
+
+    // Compose with a previous reordering so that triangle_order always refers to the source file.
+    std::vector<uint32_t> order(n_tris);
+    for (uint32_t t = 0; t < n_tris; ++t) {
+        order[t] = triangle_order.empty() ? keys[t].second : triangle_order[keys[t].second];
+    }
+    triangle_order = std::move(order);
+
+    std::vector<uint32_t> new_indices(3 * n_tris);
+    std::vector<uint32_t> vertex_remap(n_verts, ~0u);
+    // new vertex -> old vertex
+    std::vector<uint32_t> vertex_order;
+    vertex_order.reserve(n_verts);
+    for (uint32_t t = 0; t < n_tris; ++t) {
+        for (int v = 0; v < 3; ++v) {
+            uint32_t old_vertex = indices[3 * keys[t].second + v];
+            if (vertex_remap[old_vertex] == ~0u) {
+                vertex_remap[old_vertex] = (uint32_t)vertex_order.size();
+                vertex_order.push_back(old_vertex);
+            }
+            new_indices[3 * t + v] = vertex_remap[old_vertex];
+        }
+    }
+    indices = std::move(new_indices);
+
+    // Unreferenced vertices are dropped. Keep the embree padding (see above).
+    auto permute = [&](std::vector<float> &buffer, int dim, int padding) {
+        if (buffer.empty())
+            return;
+        std::vector<float> reordered(dim * vertex_order.size() + padding, 0.0f);
+        for (uint32_t i = 0; i < (uint32_t)vertex_order.size(); ++i) {
+            std::copy_n(&buffer[dim * vertex_order[i]], dim, &reordered[dim * i]);
+        }
+        buffer = std::move(reordered);
+    };
+    permute(vertices, 3, 1);
+    permute(texcoords, 2, 2);
+    permute(vertex_normals, 3, 1);
+    for (std::vector<float> &step : motion_vertices) {
+        permute(step, 3, 1);
+    }
 }
 
 void MeshGeometry::create_rtc_geom(const EmbreeDevice &device)
 {
     rtcgeom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
 
-    ASSERT((data->vertices.size() - 1) % 3 == 0);
-    ASSERT(data->indices.size() % 3 == 0);
-    rtcSetSharedGeometryBuffer(rtcgeom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, data->vertices.data(), 0,
-                               sizeof(float[3]), (data->vertices.size() - 1) / 3);
-    rtcSetSharedGeometryBuffer(rtcgeom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, data->indices.data(), 0,
-                               sizeof(uint32_t[3]), data->indices.size() / 3);
-
-    uint32_t attrib_count = (int)(data->has_texcoord()) + (int)(data->has_vertex_normal() && data->use_smooth_normal);
+    // NOTE: embree never writes to shared buffers, so mapped (read-only) buffers can be passed directly.
+    std::span<const uint32_t> indices = data->index_buffer();
+    ASSERT((data->vertex_buffer().size() - 1) % 3 == 0);
+    ASSERT(indices.size() % 3 == 0);
+    set_vertex_buffers();
+    rtcSetSharedGeometryBuffer(rtcgeom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, indices.data(), 0,
+                               sizeof(uint32_t[3]), indices.size() / 3);
+
+    // Packed attributes are decoded by us instead of rtcInterpolate.
+    bool float_texcoord = data->has_texcoord() && !data->packed_texcoord;
+    bool float_vertex_normal = data->has_vertex_normal() && !data->packed_vertex_normal && data->use_smooth_normal;
+    uint32_t attrib_count = (int)float_texcoord + (int)float_vertex_normal;
     rtcSetGeometryVertexAttributeCount(rtcgeom, attrib_count);
 
     uint32_t next_slot = 0;
-    if (data->has_texcoord()) {
-        ASSERT((data->texcoords.size() - 2) % 2 == 0);
+    if (float_texcoord) {
+        std::span<const float> texcoords = data->texcoord_buffer();
+        ASSERT((texcoords.size() - 2) % 2 == 0);
         texcoord_slot = next_slot;
         rtcSetSharedGeometryBuffer(rtcgeom, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, next_slot++, RTC_FORMAT_FLOAT2,
-                                   data->texcoords.data(), 0, sizeof(float[2]), (data->texcoords.size() - 2) / 2);
+                                   texcoords.data(), 0, sizeof(float[2]), (texcoords.size() - 2) / 2);
     }
-    if (data->has_vertex_normal() && data->use_smooth_normal) {
-        ASSERT((data->vertex_normals.size() - 1) % 3 == 0);
+    if (float_vertex_normal) {
+        std::span<const float> vertex_normals = data->vertex_normal_buffer();
+        ASSERT((vertex_normals.size() - 1) % 3 == 0);
         vertex_normal_slot = next_slot;
         rtcSetSharedGeometryBuffer(rtcgeom, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, next_slot++, RTC_FORMAT_FLOAT3,
-                                   data->vertex_normals.data(), 0, sizeof(float[3]),
-                                   (data->vertex_normals.size() - 1) / 3);
+                                   vertex_normals.data(), 0, sizeof(float[3]), (vertex_normals.size() - 1) / 3);
     }
 
     rtcSetGeometryUserData(rtcgeom, (void *)this);
@@ -65,6 +206,21 @@ void MeshGeometry::create_rtc_geom(const EmbreeDevice &device)
     rtcCommitGeometry(rtcgeom);
 }
 
+void MeshGeometry::set_vertex_buffers()
+{
+    std::span<const float> vertices = data->vertex_buffer();
+    uint32_t vertex_count = (uint32_t)(vertices.size() - 1) / 3;
+    rtcSetGeometryTimeStepCount(rtcgeom, data->time_step_count());
+    rtcSetSharedGeometryBuffer(rtcgeom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, vertices.data(), 0,
+                               sizeof(float[3]), vertex_count);
+    for (uint32_t t = 1; t < data->time_step_count(); ++t) {
+        const std::vector<float> &step = data->motion_vertices[t - 1];
+        ASSERT(step.size() == vertices.size(), "Motion steps must have the same vertex count.");
+        rtcSetSharedGeometryBuffer(rtcgeom, RTC_BUFFER_TYPE_VERTEX, t, RTC_FORMAT_FLOAT3, step.data(), 0,
+                                   sizeof(float[3]), vertex_count);
+    }
+}
+
 Intersection MeshGeometry::compute_intersection(const RTCRayHit &rayhit, const Ray &ray,
                                                 const Transform &transform) const
 {
@@ -85,24 +241,38 @@ Intersection MeshGeometry::compute_intersection(const RTCRayHit &rayhit, const R
     // is much better than based on ray equation.
     vec4 P;
     vec4 dPdu, dPdv;
-    rtcInterpolate1(rtcgeom, rayhit.hit.primID, rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX, 0, P.data(),
-                    dPdu.data(), dPdv.data(), 3);
+    uint32_t time_steps = data->time_step_count();
+    if (time_steps == 1) {
+        rtcInterpolate1(rtcgeom, rayhit.hit.primID, rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX, 0, P.data(),
+                        dPdu.data(), dPdv.data(), 3);
+    } else {
+        // Embree intersects the triangle lerped between the two nearest time steps, so do the same here.
+        float t = std::clamp(ray.time, 0.0f, 1.0f) * (float)(time_steps - 1);
+        uint32_t k = std::min((uint32_t)t, time_steps - 2);
+        float w = t - (float)k;
+        vec4 P1, dPdu1, dPdv1;
+        rtcInterpolate1(rtcgeom, rayhit.hit.primID, rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX, k, P.data(),
+                        dPdu.data(), dPdv.data(), 3);
+        rtcInterpolate1(rtcgeom, rayhit.hit.primID, rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX, k + 1,
+                        P1.data(), dPdu1.data(), dPdv1.data(), 3);
+        P = (1.0f - w) * P + w * P1;
+        dPdu = (1.0f - w) * dPdu + w * dPdu1;
+        dPdv = (1.0f - w) * dPdv + w * dPdv1;
+    }
     it.p = P.head(3);
     it.dpdu = dPdu.head(3);
     it.dpdv = dPdv.head(3);
 
     // TODO: refactor hard-coded buffer slot.
     if (data->has_texcoord()) {
-        vec4 tc;
-        rtcInterpolate0(rtcgeom, rayhit.hit.primID, rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE,
-                        texcoord_slot, tc.data(), 2);
-        it.uv = tc.head(2);
+        it.uv = interpolate_texcoord(rayhit.hit.primID, vec2(rayhit.hit.u, rayhit.hit.v));
 
         // Need to manually re-calculate dpdu/dpdv due to based on supplied texture coordinates.
+        // NOTE: uses the first time step for motion blurred meshes.
         vec3 p[3];
         vec2 uv[3];
         for (int v = 0; v < 3; ++v) {
-            int idx = data->indices[3 * rayhit.hit.primID + v];
+            int idx = data->index_buffer()[3 * rayhit.hit.primID + v];
             p[v] = data->get_pos(idx);
             uv[v] = data->get_texcoord(idx);
         }
@@ -132,13 +302,10 @@ Intersection MeshGeometry::compute_intersection(const RTCRayHit &rayhit, const R
     }
 
     it.frame = Frame(t, b, ng);
-    if (!data->use_smooth_normal || data->vertex_normals.empty()) {
+    if (!data->use_smooth_normal || !data->has_vertex_normal()) {
         it.sh_frame = it.frame;
     } else {
-        vec4 vn4;
-        rtcInterpolate0(rtcgeom, rayhit.hit.primID, rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE,
-                        vertex_normal_slot, vn4.data(), 3);
-        vec3 vn = vn4.head(3).normalized();
+        vec3 vn = interpolate_raw_vertex_normal(rayhit.hit.primID, vec2(rayhit.hit.u, rayhit.hit.v)).normalized();
         if (!vn.allFinite()) {
             // Revert to face normal if vertex normal is bad.
             it.sh_frame = it.frame;
@@ -155,8 +322,9 @@ Intersection MeshGeometry::compute_intersection(const RTCRayHit &rayhit, const R
         }
     }
 
-    it.compute_uv_partials(ray);
     it = transform_it(transform, it);
+    // NOTE: ray differentials are in world space.
+    it.compute_uv_partials(ray);
     return it;
 }
 
@@ -169,6 +337,11 @@ vec3 MeshGeometry::interpolate_position(uint32_t prim_id, const vec2 &bary) cons
 
 vec2 MeshGeometry::interpolate_texcoord(uint32_t prim_id, const vec2 &bary) const
 {
+    if (data->packed_texcoord) {
+        const uint32_t *idx = &data->index_buffer()[3 * prim_id];
+        return (1.0f - bary.x() - bary.y()) * data->get_texcoord(idx[0]) + bary.x() * data->get_texcoord(idx[1]) +
+               bary.y() * data->get_texcoord(idx[2]);
+    }
     if (!data->has_texcoord() || texcoord_slot == ~0) {
         return vec2::Zero();
     }
@@ -180,9 +353,9 @@ vec2 MeshGeometry::interpolate_texcoord(uint32_t prim_id, const vec2 &bary) cons
 
 vec3 MeshGeometry::interpolate_vertex_normal(uint32_t prim_id, const vec2 &bary, vec3 *ng_out) const
 {
-    int i0 = data->indices[3 * prim_id];
-    int i1 = data->indices[3 * prim_id + 1];
-    int i2 = data->indices[3 * prim_id + 2];
+    int i0 = data->index_buffer()[3 * prim_id];
+    int i1 = data->index_buffer()[3 * prim_id + 1];
+    int i2 = data->index_buffer()[3 * prim_id + 2];
     vec3 v0 = data->get_pos(i0);
     vec3 v1 = data->get_pos(i1);
     vec3 v2 = data->get_pos(i2);
@@ -196,13 +369,11 @@ vec3 MeshGeometry::interpolate_vertex_normal(uint32_t prim_id, const vec2 &bary,
 
     if (ng_out)
         *ng_out = ng;
-    if (!data->use_smooth_normal || !data->has_vertex_normal() || vertex_normal_slot == ~0) {
+    if (!data->use_smooth_normal || !data->has_vertex_normal() ||
+        (!data->packed_vertex_normal && vertex_normal_slot == ~0)) {
         return ng;
     }
-    vec4 vn4;
-    rtcInterpolate0(rtcgeom, prim_id, bary.x(), bary.y(), RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, vertex_normal_slot,
-                    vn4.data(), 3);
-    vec3 vn = vn4.head(3).normalized();
+    vec3 vn = interpolate_raw_vertex_normal(prim_id, bary).normalized();
     if (!vn.allFinite()) {
         // Revert to face normal if vertex normal is bad.
         return ng;
@@ -215,6 +386,20 @@ vec3 MeshGeometry::interpolate_vertex_normal(uint32_t prim_id, const vec2 &bary,
     }
 }
 
+vec3 MeshGeometry::interpolate_raw_vertex_normal(uint32_t prim_id, const vec2 &bary) const
+{
+    if (data->packed_vertex_normal) {
+        // One cache line usually covers the three vertices of a triangle.
+        const uint32_t *idx = &data->index_buffer()[3 * prim_id];
+        return (1.0f - bary.x() - bary.y()) * data->get_vertex_normal(idx[0]) +
+               bary.x() * data->get_vertex_normal(idx[1]) + bary.y() * data->get_vertex_normal(idx[2]);
+    }
+    vec4 vn4;
+    rtcInterpolate0(rtcgeom, prim_id, bary.x(), bary.y(), RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, vertex_normal_slot,
+                    vn4.data(), 3);
+    return vn4.head(3);
+}
+
 void SphereGeometry::create_rtc_geom(const EmbreeDevice &device)
 {
     rtcgeom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_SPHERE_POINT);
@@ -2,6 +2,10 @@
 #include "aabb.h"
 #include "embree_util.h"
 #include "ray.h"
+#include <array>
+#include <memory>
+#include <span>
+#include <vector>
 
 namespace ks
 {
@@ -17,27 +21,59 @@ struct Geometry
     RTCGeometry rtcgeom = nullptr;
 };
 
+struct MappedFile;
+
+// Octahedral unit vector encoding in two snorm16 (accurate to ~1e-4 rad).
+inline std::array<int16_t, 2> encode_octahedral(const vec3 &n)
+{
+    vec2 p = n.head(2) / (std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z()));
+    if (n.z() < 0.0f) {
+        p = vec2((1.0f - std::abs(p.y())) * (p.x() >= 0.0f ? 1.0f : -1.0f),
+                 (1.0f - std::abs(p.x())) * (p.y() >= 0.0f ? 1.0f : -1.0f));
+    }
+    return {(int16_t)std::round(std::clamp(p.x(), -1.0f, 1.0f) * 32767.0f),
+            (int16_t)std::round(std::clamp(p.y(), -1.0f, 1.0f) * 32767.0f)};
+}
+
+inline vec3 decode_octahedral(const std::array<int16_t, 2> &e)
+{
+    vec3 n((float)e[0] / 32767.0f, (float)e[1] / 32767.0f, 0.0f);
+    n.z() = 1.0f - std::abs(n.x()) - std::abs(n.y());
+    float t = std::max(-n.z(), 0.0f);
+    n.x() += n.x() >= 0.0f ? -t : t;
+    n.y() += n.y() >= 0.0f ? -t : t;
+    return n.normalized();
+}
+
 struct MeshData
 {
     void transform(const Transform &t);
     vec3 get_pos(uint32_t idx) const
     {
         uint32_t offset = 3 * idx;
-        return vec3(vertices[offset], vertices[offset + 1], vertices[offset + 2]);
+        std::span<const float> v = vertex_buffer();
+        return vec3(v[offset], v[offset + 1], v[offset + 2]);
     }
 
-    bool has_texcoord() const { return !texcoords.empty(); }
+    bool has_texcoord() const { return packed_texcoord || !texcoord_buffer().empty(); }
     vec2 get_texcoord(uint32_t idx) const
     {
+        if (is_packed())
+            return packed_uv_min +
+                   packed_uv_extent.cwiseProduct(vec2((float)packed[idx].uv[0], (float)packed[idx].uv[1]) / 65535.0f);
         uint32_t offset = 2 * idx;
-        return vec2(texcoords[offset], texcoords[offset + 1]);
+        std::span<const float> tc = texcoord_buffer();
+        return vec2(tc[offset], tc[offset + 1]);
     }
 
-    bool has_vertex_normal() const { return !vertex_normals.empty(); }
+    bool has_vertex_normal() const { return packed_vertex_normal || !vertex_normal_buffer().empty(); }
     vec3 get_vertex_normal(uint32_t idx) const
     {
+        if (is_packed())
+            return decode_octahedral(packed[idx].normal);
         uint32_t offset = 3 * idx;
-        return vec3(vertex_normals[offset], vertex_normals[offset + 1], vertex_normals[offset + 2]);
+        std::span<const float> vn = vertex_normal_buffer();
+        return vec3(vn[offset], vn[offset + 1], vn[offset + 2]);
     }
 
     // When the buffer will be used as a vertex buffer (RTC_BUFFER_TYPE_VER-
@@ -50,13 +86,70 @@ struct MeshData
     // pad 1 dummy float to vertex buffer
     // pad 2 dummy floats to texture coordinate buffer
     // pad 1 dummy float to vertex normal buffer
-    int vertex_count() const { return (vertices.size() - 1) / 3; }
-    int tri_count() const { return indices.size() / 3; };
+    int vertex_count() const { return (vertex_buffer().size() - 1) / 3; }
+    // Vertex buffer plus the motion blur steps.
+    uint32_t time_step_count() const { return 1 + (uint32_t)motion_vertices.size(); }
+    int tri_count() const { return index_buffer().size() / 3; };
+
+    // Read access to either the owned vectors or the memory-mapped buffers (same padding convention).
+    bool is_mapped() const { return mapping != nullptr; }
+    std::span<const float> vertex_buffer() const { return is_mapped() ? mapped.vertices : vertices; }
+    std::span<const float> texcoord_buffer() const { return is_mapped() ? mapped.texcoords : texcoords; }
+    std::span<const float> vertex_normal_buffer() const
+    {
+        return is_mapped() ? mapped.vertex_normals : vertex_normals;
+    }
+    std::span<const uint32_t> index_buffer() const { return is_mapped() ? mapped.indices : indices; }
+    // Empty unless the mesh was reordered.
+    std::span<const uint32_t> triangle_order_buffer() const
+    {
+        return is_mapped() ? mapped.triangle_order : triangle_order;
+    }
+    // Copy mapped buffers into the vectors, e.g. before modifying them.
+    void make_owned();
 
     std::vector<float> vertices;
     std::vector<float> texcoords;
     std::vector<float> vertex_normals;
     std::vector<uint32_t> indices;
+    // Set by reorder_for_locality: original index of each triangle, e.g. to map per-face data of the source file.
+    std::vector<uint32_t> triangle_order;
+    // Motion blur: more vertex buffers (same count and padding) for the later time steps, uniformly spaced over the
+    // shutter interval with the vertex buffer as the first step. Texture coordinates and normals don't move.
+    // Loaded from the motion_paths of a mesh asset (see create_mesh_asset) and kept by the mapped binary format.
+    std::vector<std::vector<float>> motion_vertices;
+
+    // Optional compact storage of texcoords and vertex normals, interleaved so that interpolation touches one
+    // array instead of two. Positions and indices stay full precision for embree.
+    struct PackedAttributes
+    {
+        // Quantized over [packed_uv_min, packed_uv_min + packed_uv_extent].
+        std::array<uint16_t, 2> uv = {0, 0};
+        std::array<int16_t, 2> normal = {0, 0};
+    };
+    bool is_packed() const { return packed_texcoord || packed_vertex_normal; }
+    // Replaces texcoords and vertex_normals (20 -> 8 bytes per vertex). Mapped meshes are copied first.
+    // NOTE: uvs are quantized to 1/65535 of their range, so heavily tiled uvs lose precision.
+    void compress_attributes();
+    // Sort triangles along a Morton curve of their centroids and renumber vertices by first use, so that the
+    // attributes fetched after neighboring hits are close in memory. Run it before compress_attributes.
+    void reorder_for_locality();
+    std::vector<PackedAttributes> packed;
+    vec2 packed_uv_min = vec2::Zero();
+    vec2 packed_uv_extent = vec2::Zero();
+    bool packed_texcoord = false;
+    bool packed_vertex_normal = false;
+
+    // Set by MeshAsset::load_from_binary. The vectors above are empty while mapped.
+    std::shared_ptr<const MappedFile> mapping;
+    struct MappedBuffers
+    {
+        std::span<const float> vertices;
+        std::span<const float> texcoords;
+        std::span<const float> vertex_normals;
+        std::span<const uint32_t> indices;
+        std::span<const uint32_t> triangle_order;
+    } mapped;
 
     // TODO: vertex normal later.
 
@@ -71,11 +164,14 @@ struct MeshGeometry : public Geometry
     MeshGeometry(const MeshData &data) : data(&data) {}
 
     void create_rtc_geom(const EmbreeDevice &device);
+    void set_vertex_buffers();
     Intersection compute_intersection(const RTCRayHit &rayhit, const Ray &ray, const Transform &transform) const;
 
     vec3 interpolate_position(uint32_t prim_id, const vec2 &bary) const;
     vec2 interpolate_texcoord(uint32_t prim_id, const vec2 &bary) const;
     vec3 interpolate_vertex_normal(uint32_t prim_id, const vec2 &bary, vec3 *ng = nullptr) const;
+    // Not normalized. Only valid if the mesh has smooth vertex normals.
+    vec3 interpolate_raw_vertex_normal(uint32_t prim_id, const vec2 &bary) const;
 
     uint32_t texcoord_slot = ~0;
     uint32_t vertex_normal_slot = ~0;
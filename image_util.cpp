@@ -1,5 +1,8 @@
 #include "image_util.h"
 #include "assertion.h"
+#include "texture_codec.h"
+#include <algorithm>
+#include <numeric>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 #define STB_IMAGE_IMPLEMENTATION
@@ -12,45 +15,178 @@
 namespace ks
 {
 
-std::unique_ptr<std::byte[]> load_from_ldr(const fs::path &path, int c, int &w, int &h, ColorSpace src_colorspace)
+DecodedImage::~DecodedImage()
 {
-    int comp;
-    stbi_uc *loaded = stbi_load(path.string().c_str(), &w, &h, &comp, c);
-    ASSERT(loaded);
-    std::unique_ptr<std::byte[]> copy = std::make_unique<std::byte[]>(w * h * c);
-    std::copy(reinterpret_cast<const std::byte *>(loaded), reinterpret_cast<const std::byte *>(loaded) + (w * h * c),
-              copy.get());
-    stbi_image_free(loaded);
-    if (src_colorspace == ColorSpace::sRGB) {
-        // TODO: converting srgb to linear for in u8 may have precision problem on the dark end...
-        // https://blog.demofox.org/2018/03/10/dont-convert-srgb-u8-to-linear-u8/
-        int n = w * h * c;
-        for (int i = 0; i < n; ++i) {
-            float f32 = (float)(*reinterpret_cast<uint8_t *>(&copy[i])) / 255.0f;
-            float linear_f32 = srgb_to_linear(f32);
-            uint8_t linear_u8 = (uint8_t)std::floor(linear_f32 * 255.0f);
-            (*reinterpret_cast<uint8_t *>(&copy[i])) = linear_u8;
-        }
+    stbi_image_free(u8);
+    stbi_image_free(f32);
+}
+
+std::unique_ptr<DecodedImage> decode_image(const fs::path &path, int c)
+{
+    std::string filename = path.string();
+    std::unique_ptr<DecodedImage> image = std::make_unique<DecodedImage>();
+    int comp = 0;
+    bool info = stbi_info(filename.c_str(), &image->width, &image->height, &comp);
+    ASSERT(info, "Failed to decode image [%s] (%s).", filename.c_str(), stbi_failure_reason());
+    // Channel expansion and swizzles are done by the (parallel) conversion. Only color to grey is left to stb.
+    int req_comp = (comp >= 3 && c <= 2) ? c : 0;
+    if (stbi_is_hdr(filename.c_str()))
+        image->f32 = stbi_loadf(filename.c_str(), &image->width, &image->height, &comp, req_comp);
+    else
+        image->u8 = stbi_load(filename.c_str(), &image->width, &image->height, &comp, req_comp);
+    ASSERT(image->u8 || image->f32, "Failed to decode image [%s] (%s).", filename.c_str(), stbi_failure_reason());
+    image->channels = req_comp ? req_comp : comp;
+    return image;
+}
+
+TexelConversion::TexelConversion(int src_channels, int dst_channels, ColorSpace src_colorspace, float scale)
+    : src_channels(src_channels), dst_channels(dst_channels), src_colorspace(src_colorspace), scale(scale)
+{
+    ASSERT(src_channels >= 1 && src_channels <= 4 && dst_channels >= 1 && dst_channels <= 4,
+           "Unsupported texel conversion (%d to %d channels).", src_channels, dst_channels);
+    bool grey = src_channels <= 2;
+    bool src_alpha = src_channels == 2 || src_channels == 4;
+    int dst_colors = dst_channels <= 2 ? 1 : 3;
+    swizzle.fill(-1);
+    for (int c = 0; c < dst_channels; ++c) {
+        if (c < dst_colors)
+            swizzle[c] = grey ? 0 : c;
+        else if (src_alpha)
+            swizzle[c] = src_channels - 1;
     }
-    return copy;
 }
 
-std::unique_ptr<float[]> load_from_ldr_to_float(const fs::path &path, int c, int &w, int &h, ColorSpace src_colorspace)
+template <typename T>
+static T texel_from_float(float f)
 {
-    int comp;
-    stbi_uc *loaded = stbi_load(path.string().c_str(), &w, &h, &comp, c);
-    ASSERT(loaded);
-    std::unique_ptr<float[]> float_data = std::make_unique<float[]>(w * h * c);
-    int n = w * h * c;
-    for (int i = 0; i < n; ++i) {
-        float_data[i] = (float)loaded[i] / 255.0f;
-    }
-    stbi_image_free(loaded);
-    if (src_colorspace == ColorSpace::sRGB) {
-        for (int i = 0; i < n; ++i) {
-            float_data[i] = srgb_to_linear(float_data[i]);
-        }
+    if constexpr (std::is_same_v<T, uint8_t>)
+        return (uint8_t)std::lround(std::clamp(f, 0.0f, 1.0f) * 255.0f);
+    else if constexpr (std::is_same_v<T, uint16_t>)
+        return float_to_half(f);
+    else
+        return f;
+}
+
+// 8-bit codes are converted through tables of all 256 values instead of a pow per texel.
+template <typename T>
+static std::array<T, 256> make_u8_lut(ColorSpace src_colorspace)
+{
+    std::array<T, 256> lut;
+    for (int i = 0; i < 256; ++i) {
+        float f = (float)i / 255.0f;
+        lut[i] = texel_from_float<T>(src_colorspace == ColorSpace::sRGB ? srgb_to_linear(f) : f);
+    }
+    return lut;
+}
+
+template <typename T>
+static const T *u8_lut(ColorSpace src_colorspace)
+{
+    static const std::array<T, 256> srgb = make_u8_lut<T>(ColorSpace::sRGB);
+    static const std::array<T, 256> linear = make_u8_lut<T>(ColorSpace::Linear);
+    return src_colorspace == ColorSpace::sRGB ? srgb.data() : linear.data();
+}
+
+// Fixed channel counts, so that the channel loops unroll and the texel loop vectorizes. Texels are read before they are
+// written for in-place conversion.
+template <int SC, int DC, typename S, typename T, typename Convert>
+static void convert_run(const S *src, T *dst, int count, const std::array<int8_t, 4> &swizzle, const Convert &convert)
+{
+    const T one = texel_from_float<T>(1.0f);
+    for (int i = 0; i < count; ++i) {
+        T texel[DC];
+        for (int c = 0; c < DC; ++c)
+            texel[c] = swizzle[c] >= 0 ? convert(src[SC * i + swizzle[c]]) : one;
+        for (int c = 0; c < DC; ++c)
+            dst[DC * i + c] = texel[c];
+    }
+}
+
+template <int SC, typename S, typename T, typename Convert>
+static void convert_run(const S *src, T *dst, int count, const TexelConversion &conversion, const Convert &convert)
+{
+    switch (conversion.dst_channels) {
+    case 1:
+        convert_run<SC, 1>(src, dst, count, conversion.swizzle, convert);
+        break;
+    case 2:
+        convert_run<SC, 2>(src, dst, count, conversion.swizzle, convert);
+        break;
+    case 3:
+        convert_run<SC, 3>(src, dst, count, conversion.swizzle, convert);
+        break;
+    case 4:
+    default:
+        convert_run<SC, 4>(src, dst, count, conversion.swizzle, convert);
+        break;
+    }
+}
+
+template <typename S, typename T, typename Convert>
+static void convert_run(const S *src, T *dst, int count, const TexelConversion &conversion, const Convert &convert)
+{
+    switch (conversion.src_channels) {
+    case 1:
+        convert_run<1>(src, dst, count, conversion, convert);
+        break;
+    case 2:
+        convert_run<2>(src, dst, count, conversion, convert);
+        break;
+    case 3:
+        convert_run<3>(src, dst, count, conversion, convert);
+        break;
+    case 4:
+    default:
+        convert_run<4>(src, dst, count, conversion, convert);
+        break;
+    }
+}
+
+template <typename T>
+void convert_texels(const uint8_t *src, T *dst, int count, const TexelConversion &conversion)
+{
+    if (conversion.scale != 1.0f) {
+        const float *lut = u8_lut<float>(conversion.src_colorspace);
+        float scale = conversion.scale;
+        convert_run(src, dst, count, conversion,
+                    [lut, scale](uint8_t x) { return texel_from_float<T>(lut[x] * scale); });
+        return;
     }
+    const T *lut = u8_lut<T>(conversion.src_colorspace);
+    convert_run(src, dst, count, conversion, [lut](uint8_t x) { return lut[x]; });
+}
+
+template <typename T>
+void convert_texels(const float *src, T *dst, int count, const TexelConversion &conversion)
+{
+    float scale = conversion.scale;
+    convert_run(src, dst, count, conversion, [scale](float x) { return texel_from_float<T>(x * scale); });
+}
+
+template void convert_texels(const uint8_t *src, uint8_t *dst, int count, const TexelConversion &conversion);
+template void convert_texels(const uint8_t *src, uint16_t *dst, int count, const TexelConversion &conversion);
+template void convert_texels(const uint8_t *src, float *dst, int count, const TexelConversion &conversion);
+template void convert_texels(const float *src, uint8_t *dst, int count, const TexelConversion &conversion);
+template void convert_texels(const float *src, uint16_t *dst, int count, const TexelConversion &conversion);
+template void convert_texels(const float *src, float *dst, int count, const TexelConversion &conversion);
+
+std::unique_ptr<std::byte[]> load_from_ldr(const fs::path &path, int c, int &w, int &h, ColorSpace src_colorspace)
+{
+    std::unique_ptr<DecodedImage> image = decode_image(path, c);
+    w = image->width;
+    h = image->height;
+    std::unique_ptr<std::byte[]> data = std::make_unique<std::byte[]>((size_t)w * h * c);
+    convert_image(*image, reinterpret_cast<uint8_t *>(data.get()), TexelConversion(image->channels, c, src_colorspace));
+    return data;
+}
+
+std::unique_ptr<float[]> load_from_ldr_to_float(const fs::path &path, int c, int &w, int &h, ColorSpace src_colorspace)
+{
+    std::unique_ptr<DecodedImage> image = decode_image(path, c);
+    w = image->width;
+    h = image->height;
+    std::unique_ptr<float[]> float_data = std::make_unique<float[]>((size_t)w * h * c);
+    convert_image(*image, float_data.get(), TexelConversion(image->channels, c, src_colorspace));
     return float_data;
 }
 
@@ -64,12 +200,12 @@ void save_to_png(const std::byte *data, int w, int h, int c, const fs::path &pat
 
 std::unique_ptr<float[]> load_from_hdr(const fs::path &path, int c, int &w, int &h)
 {
-    int comp;
-    float *loaded = stbi_loadf(path.string().c_str(), &w, &h, &comp, c);
-    ASSERT(loaded);
-    std::unique_ptr<float[]> float_data = std::make_unique<float[]>(w * h * c);
-    memcpy(float_data.get(), loaded, sizeof(float) * w * h * c);
-    stbi_image_free(loaded);
+    std::unique_ptr<DecodedImage> image = decode_image(path, c);
+    w = image->width;
+    h = image->height;
+    std::unique_ptr<float[]> float_data = std::make_unique<float[]>((size_t)w * h * c);
+    // LDR files are assumed to be sRGB.
+    convert_image(*image, float_data.get(), TexelConversion(image->channels, c, ColorSpace::sRGB));
     return float_data;
 }
 
@@ -201,4 +337,121 @@ void save_to_exr(const std::byte *data, bool half, int w, int h, int c, const fs
     free(header.requested_pixel_types);
 }
 
+static int tinyexr_compression_type(ExrCompression compression)
+{
+    switch (compression) {
+    case ExrCompression::None:
+        return TINYEXR_COMPRESSIONTYPE_NONE;
+    case ExrCompression::RLE:
+        return TINYEXR_COMPRESSIONTYPE_RLE;
+    case ExrCompression::ZIPS:
+        return TINYEXR_COMPRESSIONTYPE_ZIPS;
+    case ExrCompression::ZIP:
+        return TINYEXR_COMPRESSIONTYPE_ZIP;
+    case ExrCompression::PIZ:
+    default:
+        return TINYEXR_COMPRESSIONTYPE_PIZ;
+    }
+}
+
+void save_layers_to_exr(std::span<const ExrChannel> channels, int w, int h, const ExrOptions &options,
+                        const fs::path &path)
+{
+    ASSERT(!channels.empty());
+    // Readers expect the channel list sorted by name.
+    std::vector<int> order(channels.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return channels[a].name < channels[b].name; });
+
+    int c = (int)channels.size();
+    EXRHeader header;
+    InitEXRHeader(&header);
+    header.num_channels = c;
+    header.compression_type = tinyexr_compression_type(options.compression);
+    std::vector<EXRChannelInfo> channel_infos(c);
+    std::vector<int> pixel_types(c, TINYEXR_PIXELTYPE_FLOAT);
+    std::vector<int> requested_pixel_types(c, options.half ? TINYEXR_PIXELTYPE_HALF : TINYEXR_PIXELTYPE_FLOAT);
+    std::vector<const float *> image_ptr(c);
+    for (int i = 0; i < c; ++i) {
+        const ExrChannel &channel = channels[order[i]];
+        ASSERT(channel.data.size() == (size_t)w * h, "EXR channel [%s] has the wrong size.", channel.name.c_str());
+        ASSERT(channel.name.size() < sizeof(channel_infos[i].name), "EXR channel name [%s] is too long.",
+               channel.name.c_str());
+        std::fill(std::begin(channel_infos[i].name), std::end(channel_infos[i].name), '\0');
+        std::copy(channel.name.begin(), channel.name.end(), channel_infos[i].name);
+        image_ptr[i] = channel.data.data();
+    }
+    header.channels = channel_infos.data();
+    header.pixel_types = pixel_types.data();
+    header.requested_pixel_types = requested_pixel_types.data();
+
+    EXRImage image;
+    InitEXRImage(&image);
+    image.width = w;
+    image.height = h;
+    image.num_channels = c;
+    image.images = (unsigned char **)image_ptr.data();
+
+    const char *err = nullptr;
+    int ret = SaveEXRImageToFile(&image, &header, path.string().c_str(), &err);
+    if (ret != TINYEXR_SUCCESS) {
+        fprintf(stderr, "save_layers_to_exr error: %s\n", err);
+        FreeEXRErrorMessage(err);
+    }
+}
+
+BackgroundWriter::BackgroundWriter()
+{
+    worker = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return quit || !jobs.empty(); });
+            if (jobs.empty()) {
+                break;
+            }
+            std::function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            lock.unlock();
+            job();
+            lock.lock();
+            busy = false;
+            if (jobs.empty()) {
+                idle.notify_all();
+            }
+        }
+    });
+}
+
+BackgroundWriter::~BackgroundWriter()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+void BackgroundWriter::submit(std::function<void()> job)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+}
+
+void BackgroundWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [&]() { return jobs.empty() && !busy; });
+}
+
+BackgroundWriter &background_writer()
+{
+    static BackgroundWriter writer;
+    return writer;
+}
+
 } // namespace ks
\ No newline at end of file
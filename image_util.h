@@ -1,7 +1,19 @@
 #pragma once
+#include "assertion.h"
 #include "maths.h"
+#include "parallel.h"
+#include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
 namespace fs = std::filesystem;
 
 namespace ks
@@ -13,6 +25,90 @@ enum class ColorSpace
     Linear,
 };
 
+// An image as decoded by stb: 8-bit texels for LDR formats, floats for HDR (.hdr) ones. Has the channels of the file,
+// unless color has to be reduced to grey (stb's luminance weights) for the requested channel count. Conversion to
+// linear texels of the requested type and channels is left to convert_image, which writes straight into the
+// destination.
+struct DecodedImage
+{
+    DecodedImage() = default;
+    ~DecodedImage();
+    DecodedImage(const DecodedImage &) = delete;
+    DecodedImage &operator=(const DecodedImage &) = delete;
+
+    bool hdr() const { return f32 != nullptr; }
+
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    uint8_t *u8 = nullptr;
+    float *f32 = nullptr;
+};
+
+// c is the number of channels the image will be converted to.
+std::unique_ptr<DecodedImage> decode_image(const fs::path &path, int c);
+
+// How texels of a decoded image map to the destination. Destination texel types are uint8_t (unorm), uint16_t (half)
+// and float.
+struct TexelConversion
+{
+    // Expands channels like stb does: grey is replicated to rgb and missing alpha is opaque.
+    TexelConversion(int src_channels, int dst_channels, ColorSpace src_colorspace = ColorSpace::Linear,
+                    float scale = 1.0f);
+
+    int src_channels;
+    int dst_channels;
+    // Destination channel i is source channel swizzle[i], or one (opaque alpha) if negative.
+    std::array<int8_t, 4> swizzle;
+    // Of 8-bit sources, converted through lookup tables.
+    ColorSpace src_colorspace;
+    // Multiplies the linear values.
+    float scale;
+};
+
+// Converts count consecutive texels. May run in place (src == dst) if the source and destination texels are the same
+// size.
+template <typename T>
+void convert_texels(const uint8_t *src, T *dst, int count, const TexelConversion &conversion);
+template <typename T>
+void convert_texels(const float *src, T *dst, int count, const TexelConversion &conversion);
+
+// Converts a decoded image to row-major order, in parallel over rows.
+template <typename T>
+void convert_image(const DecodedImage &image, T *dst, const TexelConversion &conversion)
+{
+    int w = image.width;
+    int src_stride = w * conversion.src_channels;
+    int dst_stride = w * conversion.dst_channels;
+    parallel_for(image.height, [&](int y) {
+        if (image.hdr())
+            convert_texels(image.f32 + (size_t)y * src_stride, dst + (size_t)y * dst_stride, w, conversion);
+        else
+            convert_texels(image.u8 + (size_t)y * src_stride, dst + (size_t)y * dst_stride, w, conversion);
+    });
+}
+
+// Same, straight into the blocks of a BlockedArray (e.g. a TextureMip or a SkyMap) whose texels are dst_channels
+// values of T: the texels of a block row are contiguous, so rows are converted in runs of block_size() texels.
+template <typename T, typename BArray>
+void convert_image_to_blocked(const DecodedImage &image, BArray &dst, const TexelConversion &conversion)
+{
+    ASSERT(dst.ures == image.width && dst.vres == image.height, "Blocked array has the wrong resolution.");
+    int w = image.width;
+    int block_size = dst.block_size();
+    parallel_for(image.height, [&](int y) {
+        for (int x = 0; x < w; x += block_size) {
+            int count = std::min(block_size, w - x);
+            size_t src_offset = ((size_t)y * w + x) * conversion.src_channels;
+            T *run = reinterpret_cast<T *>(dst.fetch_multi(x, y));
+            if (image.hdr())
+                convert_texels(image.f32 + src_offset, run, count, conversion);
+            else
+                convert_texels(image.u8 + src_offset, run, count, conversion);
+        }
+    });
+}
+
 std::unique_ptr<std::byte[]> load_from_ldr(const fs::path &path, int c, int &w, int &h, ColorSpace src_colorspace);
 
 std::unique_ptr<float[]> load_from_ldr_to_float(const fs::path &path, int c, int &w, int &h, ColorSpace src_colorspace);
@@ -54,4 +150,56 @@ std::unique_ptr<color<C>[]> load_from_exr(const fs::path &path, int &w, int &h)
 
 void save_to_exr(const std::byte *data, bool half, int w, int h, int c, const fs::path &path);
 
+enum class ExrCompression
+{
+    None,
+    RLE,
+    // Zip over single scanlines / blocks of 16 scanlines.
+    ZIPS,
+    ZIP,
+    // Wavelet, usually the best for noisy renders.
+    PIZ,
+};
+
+struct ExrOptions
+{
+    // Store as half floats (converted on write).
+    bool half = false;
+    ExrCompression compression = ExrCompression::ZIP;
+};
+
+// One planar channel of w * h floats. Layers are name prefixes, e.g. "albedo.R" (see save_layers_to_exr).
+struct ExrChannel
+{
+    std::string name;
+    std::vector<float> data;
+};
+
+// Any number of named channels in one file, e.g. a beauty pass (R, G, B) with AOV layers.
+void save_layers_to_exr(std::span<const ExrChannel> channels, int w, int h, const ExrOptions &options,
+                        const fs::path &path);
+
+// A thread that runs file writes in submission order, so that rendering continues while images are compressed and
+// written. Jobs must own their data.
+struct BackgroundWriter
+{
+    BackgroundWriter();
+    // Finishes all submitted jobs.
+    ~BackgroundWriter();
+
+    void submit(std::function<void()> job);
+    // Blocks until all submitted jobs are done.
+    void flush();
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> jobs;
+    bool busy = false;
+    bool quit = false;
+    std::thread worker;
+};
+
+BackgroundWriter &background_writer();
+
 } // namespace ks
\ No newline at end of file
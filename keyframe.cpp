@@ -3,29 +3,18 @@
 namespace ks
 {
 
-float KeyframeFloat::eval(float t) const
+float KeyframeFloat::interpolate(int left, int right, float weight) const
 {
-    int left, right;
-    float weight;
-    lerp_time(t, left, right, weight);
-
     return std::lerp(values[left], values[right], weight);
 }
 
-vec2 KeyframeVec2::eval(float t) const
+vec2 KeyframeVec2::interpolate(int left, int right, float weight) const
 {
-    int left, right;
-    float weight;
-    lerp_time(t, left, right, weight);
     return lerp(values[left], values[right], weight);
 }
 
-vec3 KeyframeVec3::eval(float t) const
+vec3 KeyframeVec3::interpolate(int left, int right, float weight) const
 {
-    int left, right;
-    float weight;
-    lerp_time(t, left, right, weight);
-
     if (use_slerp) {
         return slerp(values[left], values[right], weight);
     } else {
@@ -33,16 +22,12 @@ vec3 KeyframeVec3::eval(float t) const
     }
 }
 
-vec4 KeyframeVec4::eval(float t) const
+vec4 KeyframeVec4::interpolate(int left, int right, float weight) const
 {
-    int left, right;
-    float weight;
-    lerp_time(t, left, right, weight);
-
     if (use_slerp) {
         quat q1(values[left].w(), values[left].x(), values[left].y(), values[left].z());
         quat q2(values[right].w(), values[right].x(), values[right].y(), values[right].z());
-        quat q = q1.slerp(t, q2);
+        quat q = q1.slerp(weight, q2);
         return vec4(q.x(), q.y(), q.z(), q.w());
     } else {
         return lerp(values[left], values[right], weight);
@@ -1,6 +1,7 @@
 #pragma once
 #include "assertion.h"
 #include "maths.h"
+#include <span>
 #include <vector>
 
 namespace ks
@@ -10,13 +11,72 @@ template <typename T>
 struct KeyframeField
 {
     virtual ~KeyframeField() = default;
-    virtual T eval(float t) const = 0;
+    T eval(float t) const
+    {
+        int left, right;
+        float weight;
+        lerp_time(t, left, right, weight);
+        return interpolate(left, right, weight);
+    }
+    // Batched eval, e.g. the frames of a sequence. Increasing times continue the segment walk from the previous time
+    // instead of looking the segment up again.
+    void eval_n(std::span<const float> t, std::span<T> out) const;
+    // Between values[left] and values[right].
+    virtual T interpolate(int left, int right, float weight) const = 0;
+    // Call after setting times: lerp_time then starts from a uniform grid over the keys instead of a binary search.
+    void bake_segments(uint32_t cells_per_key = 4);
     void lerp_time(float t, int &left, int &right, float &weight) const;
 
     std::vector<float> times;
     std::vector<T> values;
+    // Last key at or before the start of each grid cell (see bake_segments). Empty if not baked.
+    std::vector<uint32_t> segment_lut;
+    // Grid cells per unit of time.
+    float lut_scale = 0.0f;
 };
 
+template <typename T>
+void KeyframeField<T>::eval_n(std::span<const float> t, std::span<T> out) const
+{
+    ASSERT(t.size() == out.size());
+    int left = -1;
+    float prev_t = 0.0f;
+    for (size_t i = 0; i < t.size(); ++i) {
+        float ti = std::clamp(t[i], 0.0f, 1.0f);
+        int right;
+        float weight;
+        if (left >= 0 && ti >= prev_t && ti > times[0] && ti < times.back()) {
+            while (times[left + 1] <= ti)
+                ++left;
+            right = left + 1;
+            weight = (ti - times[left]) / (times[right] - times[left]);
+        } else {
+            lerp_time(ti, left, right, weight);
+        }
+        prev_t = ti;
+        out[i] = interpolate(left, right, weight);
+    }
+}
+
+template <typename T>
+void KeyframeField<T>::bake_segments(uint32_t cells_per_key)
+{
+    segment_lut.clear();
+    // A binary search over two keys is already as fast.
+    if (times.size() < 3 || !(times.back() > times[0]))
+        return;
+    uint32_t n_cells = cells_per_key * (uint32_t)(times.size() - 1);
+    lut_scale = (float)n_cells / (times.back() - times[0]);
+    segment_lut.resize(n_cells);
+    uint32_t left = 0;
+    for (uint32_t c = 0; c < n_cells; ++c) {
+        float cell_start = times[0] + (float)c / lut_scale;
+        while (left + 2 < times.size() && times[left + 1] <= cell_start)
+            ++left;
+        segment_lut[c] = left;
+    }
+}
+
 template <typename T>
 void KeyframeField<T>::lerp_time(float t, int &left, int &right, float &weight) const
 {
@@ -31,32 +91,42 @@ void KeyframeField<T>::lerp_time(float t, int &left, int &right, float &weight)
         weight = 0.0f;
         return;
     }
-    auto it = std::upper_bound(times.begin(), times.end(), t);
-    left = (int)std::distance(times.begin(), std::prev(it));
+    if (!segment_lut.empty()) {
+        uint32_t cell = std::min((uint32_t)((t - times[0]) * lut_scale), (uint32_t)segment_lut.size() - 1);
+        left = (int)segment_lut[cell];
+        // Only walks over the keys within the cell (and corrects rounding of the cell index).
+        while (left > 0 && times[left] > t)
+            --left;
+        while (times[left + 1] <= t)
+            ++left;
+    } else {
+        auto it = std::upper_bound(times.begin(), times.end(), t);
+        left = (int)std::distance(times.begin(), std::prev(it));
+    }
     right = left + 1;
     weight = (t - times[left]) / (times[right] - times[left]);
 }
 
 struct KeyframeFloat : public KeyframeField<float>
 {
-    float eval(float t) const;
+    float interpolate(int left, int right, float weight) const;
 };
 
 struct KeyframeVec2 : public KeyframeField<vec2>
 {
-    vec2 eval(float t) const;
+    vec2 interpolate(int left, int right, float weight) const;
 };
 
 struct KeyframeVec3 : public KeyframeField<vec3>
 {
-    vec3 eval(float t) const;
+    vec3 interpolate(int left, int right, float weight) const;
 
     bool use_slerp = false;
 };
 
 struct KeyframeVec4 : public KeyframeField<vec4>
 {
-    vec4 eval(float t) const;
+    vec4 interpolate(int left, int right, float weight) const;
 
     bool use_slerp = false;
 };
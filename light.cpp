@@ -1,4 +1,6 @@
 #include "light.h"
+#include "file_util.h"
+#include "hash.h"
 #include "image_util.h"
 #include "parallel.h"
 #include "ray.h"
@@ -7,89 +9,265 @@
 namespace ks
 {
 
-SkyLight::SkyLight(const fs::path &path, const Transform &l2w, bool transform_y_up, float strength)
-    : l2w(l2w), transform_y_up(transform_y_up), strength(strength)
+color3 Light::eval_with_distance(const vec3 &p_shade, const vec3 &wi, float &dist) const
 {
-    int width, height;
-    std::unique_ptr<color3[]> pixels = load_from_hdr<3>(path, width, height);
-    map = BlockedArray<color3>(width, height, 1, pixels.get());
+    dist = inf;
+    return eval(p_shade, wi);
+}
+
+color3 Light::sample_with_distance(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf, float &dist) const
+{
+    dist = inf;
+    return sample(p_shade, u, wi, pdf);
+}
+
+void Light::eval_n(std::span<const vec3> p_shade, std::span<const vec3> wi, std::span<color3> L) const
+{
+    ASSERT(p_shade.size() == wi.size() && L.size() == wi.size());
+    for (size_t i = 0; i < wi.size(); ++i) {
+        L[i] = eval(p_shade[i], wi[i]);
+    }
+}
+
+SkyLight::SkyLight(const fs::path &path, const Transform &l2w, bool transform_y_up, float strength,
+                   bool use_alias_table)
+    : use_alias_table(use_alias_table), l2w(l2w), transform_y_up(transform_y_up), strength(strength)
+{
+    // Decoded straight into the blocks of the map (LDR files are assumed to be sRGB).
+    std::unique_ptr<DecodedImage> image = decode_image(path, 3);
+    int width = image->width;
+    int height = image->height;
+    map = SkyMap(width, height, 1);
+    convert_image_to_blocked<float>(*image, map, TexelConversion(image->channels, 3, ColorSpace::sRGB));
+    image.reset();
     std::vector<float> lum(width * height);
-    parallel_for((int)lum.size(), [&](int i) {
-        int y = i / width;
+    parallel_for(height, [&](int y) {
         float theta = (y + 0.5f) / (float)height * pi;
         float sin_theta = std::sin(theta);
-        lum[i] = sin_theta * luminance(pixels[i]);
+        for (int x = 0; x < width; ++x) {
+            color3 &pixel = map(x, y);
+            lum[y * width + x] = sin_theta * luminance(pixel);
+            pixel *= strength;
+        }
     });
-    distrib = DistribTable2D(lum.data(), map.ures, map.vres);
+    if (use_alias_table) {
+        alias_distrib = AliasTable2D(lum.data(), map.ures, map.vres);
+    } else {
+        distrib = DistribTable2D(lum.data(), map.ures, map.vres);
+    }
+    bake();
 }
 
 SkyLight::SkyLight(const color3 &ambient)
 {
-    map = BlockedArray<color3>(1, 1, 1, &ambient);
+    map = SkyMap(1, 1, 1, &ambient);
     float lum = luminance(ambient);
     distrib = DistribTable2D(&lum, map.ures, map.vres);
+    bake();
 }
 
-color3 SkyLight::eval(const vec3 &p, const vec3 &wi) const
+constexpr const char *sky_light_snapshot_magic = "i_am_a_sky_light_snapshot";
+
+std::unique_ptr<SkyLight> SkyLight::from_snapshot(const fs::path &path, const Transform &l2w, bool transform_y_up)
 {
-    vec3 wi_local = l2w.inverse().direction(wi);
+    std::unique_ptr<SkyLight> light = std::make_unique<SkyLight>();
+    light->l2w = l2w;
+    light->transform_y_up = transform_y_up;
+    BinaryReader reader(path);
+    std::array<char, std::string_view(sky_light_snapshot_magic).size() + 1> magic;
+    reader.read_array<char>(magic.data(), magic.size() - 1);
+    magic.back() = 0;
+    ASSERT(!strcmp(magic.data(), sky_light_snapshot_magic), "Invalid sky light snapshot.");
+    light->strength = reader.read<float>();
+    light->use_alias_table = reader.read<bool>();
+    int width = reader.read<int>();
+    int height = reader.read<int>();
+    std::vector<color3> pixels = reader.read_vector<color3>();
+    ASSERT(pixels.size() == (size_t)width * height, "Corrupted sky light snapshot.");
+    light->map = SkyMap(width, height, 1, pixels.data());
+    uint32_t rows = reader.read<uint32_t>();
+    if (light->use_alias_table) {
+        light->alias_distrib.cond.resize(rows);
+        for (AliasTable &table : light->alias_distrib.cond) {
+            table.bins = reader.read_vector<AliasTable::Bin>();
+            table.acc = reader.read<float>();
+        }
+        light->alias_distrib.margin.bins = reader.read_vector<AliasTable::Bin>();
+        light->alias_distrib.margin.acc = reader.read<float>();
+    } else {
+        light->distrib.cond.resize(rows);
+        for (DistribTable &table : light->distrib.cond) {
+            table.cdf = reader.read_vector<float>();
+            table.acc = reader.read<float>();
+        }
+        light->distrib.margin.cdf = reader.read_vector<float>();
+        light->distrib.margin.acc = reader.read<float>();
+    }
+    light->bake();
+    return light;
+}
 
-    float phi, theta;
-    if (transform_y_up) {
-        to_spherical_yup(wi_local, phi, theta);
+void SkyLight::write_snapshot(const fs::path &path) const
+{
+    BinaryWriter writer(path);
+    writer.write_array<char>(sky_light_snapshot_magic, strlen(sky_light_snapshot_magic));
+    writer.write<float>(strength);
+    writer.write<bool>(use_alias_table);
+    writer.write<int>(map.ures);
+    writer.write<int>(map.vres);
+    std::vector<color3> pixels((size_t)map.ures * map.vres);
+    for (int v = 0; v < map.vres; ++v)
+        for (int u = 0; u < map.ures; ++u)
+            pixels[(size_t)v * map.ures + u] = map(u, v);
+    writer.write_vector(pixels);
+    if (use_alias_table) {
+        writer.write<uint32_t>((uint32_t)alias_distrib.cond.size());
+        for (const AliasTable &table : alias_distrib.cond) {
+            writer.write_vector(table.bins);
+            writer.write<float>(table.acc);
+        }
+        writer.write_vector(alias_distrib.margin.bins);
+        writer.write<float>(alias_distrib.margin.acc);
     } else {
-        to_spherical(wi_local, phi, theta);
+        writer.write<uint32_t>((uint32_t)distrib.cond.size());
+        for (const DistribTable &table : distrib.cond) {
+            writer.write_vector(table.cdf);
+            writer.write<float>(table.acc);
+        }
+        writer.write_vector(distrib.margin.cdf);
+        writer.write<float>(distrib.margin.acc);
     }
-    vec2 uv;
-    uv[0] = phi * inv_pi * 0.5f;
-    uv[1] = theta * inv_pi;
+}
+
+void SkyLight::bake()
+{
+    mat3 world_to_local = l2w.inv.block<3, 3>(0, 0);
+    mat3 local_to_world = l2w.m.block<3, 3>(0, 0);
+    if (transform_y_up) {
+        // (x, y, z) y-up <-> (x, z, y) z-up; the swizzle is its own inverse.
+        mat3 swizzle;
+        // clang-format off
+        swizzle <<
+            1.0f, 0.0f, 0.0f,
+            0.0f, 0.0f, 1.0f,
+            0.0f, 1.0f, 0.0f;
+        // clang-format on
+        world_to_local = swizzle * world_to_local;
+        local_to_world = local_to_world * swizzle;
+    }
+    baked.world_to_map = world_to_local;
+    baked.map_to_world = local_to_world;
+}
+
+color3 SkyLight::lookup(const vec2 &uv) const
+{
     vec2i res(map.ures, map.vres);
     WrapMode wrap[2] = {WrapMode::Repeat, WrapMode::Clamp};
     TickMode tick[2] = {TickMode::Middle, TickMode::Middle};
     vec2i uv0, uv1;
     vec2 t;
     lerp_helper<2>(uv.data(), res.data(), wrap, tick, uv0.data(), uv1.data(), t.data());
+    std::array<const color3 *, 4> quad = map.fetch_quad(uv0[0], uv0[1], uv1[0], uv1[1]);
     color3 L = color3::Zero();
-    L += (1.0f - t[0]) * (1.0f - t[1]) * map(uv0[0], uv0[1]);
-    L += (1.0f - t[0]) * t[1] * map(uv0[0], uv1[1]);
-    L += t[0] * (1.0f - t[1]) * map(uv1[0], uv0[1]);
-    L += t[0] * t[1] * map(uv1[0], uv1[1]);
-    L *= strength;
+    L += (1.0f - t[0]) * (1.0f - t[1]) * *quad[0];
+    L += t[0] * (1.0f - t[1]) * *quad[1];
+    L += (1.0f - t[0]) * t[1] * *quad[2];
+    L += t[0] * t[1] * *quad[3];
     return L;
 }
 
+color3 SkyLight::eval(const vec3 &p, const vec3 &wi) const
+{
+    vec3 wi_map = baked.world_to_map * wi;
+    float phi, theta;
+    to_spherical(wi_map, phi, theta);
+    vec2 uv;
+    uv[0] = phi * inv_pi * 0.5f;
+    uv[1] = theta * inv_pi;
+    return lookup(uv);
+}
+
+void SkyLight::eval_n(std::span<const vec3> p_shade, std::span<const vec3> wi, std::span<color3> L) const
+{
+    ASSERT(L.size() == wi.size());
+    constexpr size_t chunk = 64;
+    // SoA so that the direction -> uv loop (transform, acos, atan2) can be auto-vectorized.
+    alignas(64) float us[chunk];
+    alignas(64) float vs[chunk];
+    for (size_t begin = 0; begin < wi.size(); begin += chunk) {
+        size_t n = std::min(chunk, wi.size() - begin);
+        const mat3 &m = baked.world_to_map;
+        for (size_t i = 0; i < n; ++i) {
+            const vec3 &w = wi[begin + i];
+            float x = m(0, 0) * w.x() + m(0, 1) * w.y() + m(0, 2) * w.z();
+            float y = m(1, 0) * w.x() + m(1, 1) * w.y() + m(1, 2) * w.z();
+            float z = m(2, 0) * w.x() + m(2, 1) * w.y() + m(2, 2) * w.z();
+            float theta = std::acos(std::clamp(z, -1.0f, 1.0f));
+            float phi = std::atan2(y, x);
+            phi = phi < 0.0f ? phi + two_pi : phi;
+            us[i] = phi * inv_pi * 0.5f;
+            vs[i] = theta * inv_pi;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            L[begin + i] = lookup(vec2(us[i], vs[i]));
+        }
+    }
+}
+
+float SkyLight::portal_probability(const vec3 &p) const
+{
+    if (portals.empty() || !sky_portals_visible(portals, p))
+        return 0.0f;
+    return portal_fraction;
+}
+
 color3 SkyLight::sample(const vec3 &p, const vec2 &u, vec3 &wi, float &pdf) const
 {
-    vec2 uv = distrib.sample_linear(u, pdf);
+    float portal_prob = portal_probability(p);
+    vec2 u_map = u;
+    if (portal_prob > 0.0f) {
+        if (u[0] < portal_prob) {
+            vec2 u_portal(std::min(u[0] / portal_prob, before_one), u[1]);
+            float pdf_portal;
+            if (!sample_sky_portals(portals, p, u_portal, wi, pdf_portal)) {
+                pdf = 0.0f;
+                return color3::Zero();
+            }
+            pdf = portal_prob * pdf_portal + (1.0f - portal_prob) * map_pdf(p, wi);
+            return eval(p, wi) / pdf;
+        }
+        u_map[0] = std::min((u[0] - portal_prob) / (1.0f - portal_prob), before_one);
+    }
+
+    vec2 uv;
+    if (visibility)
+        uv = visibility->sample(p, u_map, pdf);
+    else
+        uv = use_alias_table ? alias_distrib.sample_linear(u_map, pdf) : distrib.sample_linear(u_map, pdf);
     if (pdf == 0.0f) {
         return color3::Zero();
     }
     float phi = uv[0] * 2.0f * pi;
     float theta = uv[1] * pi;
-    vec3 wi_local;
-    if (transform_y_up) {
-        wi_local = to_cartesian_yup(phi, theta);
-    } else {
-        wi_local = to_cartesian(phi, theta);
-    }
+    vec3 wi_map = to_cartesian(phi, theta);
     float sin_theta = std::sin(theta);
-    pdf /= (2.0f * pi * pi * sin_theta);
     if (sin_theta == 0.0f) {
         pdf = 0.0f;
+        return color3::Zero();
     }
-    wi = l2w.direction(wi_local);
-    return eval(p, wi) / pdf;
+    pdf /= (2.0f * pi * pi * sin_theta);
+    wi = baked.map_to_world * wi_map;
+    if (portal_prob > 0.0f)
+        pdf = portal_prob * sky_portals_pdf(portals, p, wi) + (1.0f - portal_prob) * pdf;
+    // Directly look up the sampled uv instead of going through eval().
+    return lookup(uv) / pdf;
 }
 
-float SkyLight::pdf(const vec3 &p, const vec3 &wi) const
+float SkyLight::map_pdf(const vec3 &p, const vec3 &wi) const
 {
-    vec3 wi_local = l2w.inverse().direction(wi);
+    vec3 wi_map = baked.world_to_map * wi;
     float phi, theta;
-    if (transform_y_up) {
-        to_spherical_yup(wi_local, phi, theta);
-    } else {
-        to_spherical(wi_local, phi, theta);
-    }
+    to_spherical(wi_map, phi, theta);
     float sin_theta = std::sin(theta);
     if (sin_theta == 0.0f) {
         return 0.0f;
@@ -99,11 +277,48 @@ float SkyLight::pdf(const vec3 &p, const vec3 &wi) const
     uv[0] = phi * inv_pi * 0.5f;
     uv[1] = theta * inv_pi;
 
-    float pdf = distrib.pdf(uv);
+    float pdf;
+    if (visibility)
+        pdf = visibility->pdf(p, uv);
+    else
+        pdf = use_alias_table ? alias_distrib.pdf(uv) : distrib.pdf(uv);
     pdf /= (2.0f * pi * pi * sin_theta);
     return pdf;
 }
 
+float SkyLight::pdf(const vec3 &p, const vec3 &wi) const
+{
+    float portal_prob = portal_probability(p);
+    float pdf = map_pdf(p, wi);
+    if (portal_prob > 0.0f)
+        pdf = portal_prob * sky_portals_pdf(portals, p, wi) + (1.0f - portal_prob) * pdf;
+    return pdf;
+}
+
+void SkyLight::build_visibility(const Scene &scene)
+{
+    if (!visibility_sampling)
+        return;
+    int width = map.ures;
+    int height = map.vres;
+    std::vector<float> weights((size_t)width * height);
+    parallel_for(height, [&](int y) {
+        float sin_theta = std::sin((y + 0.5f) / (float)height * pi);
+        for (int x = 0; x < width; ++x)
+            weights[(size_t)y * width + x] = sin_theta * luminance(map(x, y));
+    });
+    visibility = std::make_unique<SkyVisibility>(weights, width, height, baked.map_to_world, scene, visibility_options);
+}
+
+float SkyLight::power(const AABB3 &scene_bound) const
+{
+    float radius = 0.5f * scene_bound.extents().norm();
+    // distrib.margin.acc is the mean of sin(theta) * luminance over the map, which integrates to 2pi^2 * acc over
+    // the sphere.
+    float acc = use_alias_table ? alias_distrib.margin.acc : distrib.margin.acc;
+    return strength * 2.0f * pi * pi * acc * pi * sqr(radius);
+}
+
 color3 DirectionalLight::eval(const vec3 &p_shade, const vec3 &wi) const { return color3::Zero(); }
 
 color3 DirectionalLight::sample(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf) const
@@ -115,6 +330,12 @@ color3 DirectionalLight::sample(const vec3 &p_shade, const vec2 &u, vec3 &wi, fl
 
 float DirectionalLight::pdf(const vec3 &p_shade, const vec3 &wi) const { return 0.0f; }
 
+float DirectionalLight::power(const AABB3 &scene_bound) const
+{
+    float radius = 0.5f * scene_bound.extents().norm();
+    return luminance(L) * pi * sqr(radius);
+}
+
 std::unique_ptr<Light> create_light(const ConfigArgs &args)
 {
     std::string light_type = args.load_string("type");
@@ -127,7 +348,7 @@ std::unique_ptr<Light> create_light(const ConfigArgs &args)
     return light;
 }
 
-std::unique_ptr<SkyLight> create_sky_light(const ConfigArgs &args)
+static std::unique_ptr<SkyLight> create_sky_light_map(const ConfigArgs &args)
 {
     if (args.contains("ambient")) {
         color3 ambient = args.load_vec3("ambient").array();
@@ -139,8 +360,38 @@ std::unique_ptr<SkyLight> create_sky_light(const ConfigArgs &args)
             to_world = args.load_transform("to_world");
         bool transform_y_up = args.load_bool("transform_y_up", true);
         float strength = args.load_float("strength", 1.0f);
-        return std::make_unique<SkyLight>(map, to_world, transform_y_up, strength);
+        bool use_alias_table = args.load_bool("alias_table", false);
+        // The map and its distribution don't depend on the transform, so a snapshot can be reused across it.
+        fs::path snapshot_path;
+        if (!args.asset_table().snapshot_dir.empty()) {
+            uint64_t key = hash(args.asset_table().hash_input_file(map), strength, use_alias_table);
+            snapshot_path = args.asset_table().snapshot_path("sky_light", key);
+            if (fs::exists(snapshot_path))
+                return SkyLight::from_snapshot(snapshot_path, to_world, transform_y_up);
+        }
+        auto light = std::make_unique<SkyLight>(map, to_world, transform_y_up, strength, use_alias_table);
+        if (!snapshot_path.empty()) {
+            write_snapshot_file(snapshot_path, [&](const fs::path &temp_path) {
+                light->write_snapshot(temp_path);
+                return true;
+            });
+        }
+        return light;
+    }
+}
+
+std::unique_ptr<SkyLight> create_sky_light(const ConfigArgs &args)
+{
+    std::unique_ptr<SkyLight> light = create_sky_light_map(args);
+    if (args.contains("portals")) {
+        light->portals = load_sky_portals(args["portals"]);
+        light->portal_fraction = args.load_float("portal_fraction", light->portal_fraction);
+        ASSERT(light->portal_fraction >= 0.0f && light->portal_fraction <= 1.0f, "portal_fraction must be in [0, 1].");
     }
+    light->visibility_sampling = args.contains("visibility");
+    if (light->visibility_sampling)
+        light->visibility_options = load_sky_visibility_options(args["visibility"]);
+    return light;
 }
 
 std::unique_ptr<DirectionalLight> create_directional_light(const ConfigArgs &args)
@@ -1,9 +1,13 @@
 #pragma once
+#include "aabb.h"
 #include "barray.h"
 #include "config.h"
 #include "distrib.h"
 #include "maths.h"
+#include "sky_sampling.h"
 #include <filesystem>
+#include <memory>
+#include <span>
 namespace fs = std::filesystem;
 
 namespace ks
@@ -21,27 +25,79 @@ struct Light
     // NOTE: return throughput weight: (L / pdf)
     virtual color3 sample(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf) const = 0;
     virtual float pdf(const vec3 &p_shade, const vec3 &wi) const = 0;
+    // Also return the distance to the emitter along wi (for shadow rays), inf for infinitely far lights.
+    virtual color3 eval_with_distance(const vec3 &p_shade, const vec3 &wi, float &dist) const;
+    virtual color3 sample_with_distance(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf, float &dist) const;
+
+    // For light selection (see light_sampler.h).
+    // Infinite lights have an empty bound and use the scene bounding sphere to estimate power.
+    virtual AABB3 bound() const { return AABB3(); }
+    bool infinite() const { return bound().isEmpty(); }
+    // Approximate emitted power (luminance).
+    virtual float power(const AABB3 &scene_bound) const = 0;
+
+    // Batched version of eval (e.g. for all the escaped rays of a wavefront stream). The default just loops over eval.
+    virtual void eval_n(std::span<const vec3> p_shade, std::span<const vec3> wi, std::span<color3> L) const;
 };
 
 struct SkyLight : public Light
 {
-    SkyLight(const fs::path &path, const Transform &l2w, bool transform_y_up, float strength = 1.0f);
+    SkyLight() = default;
+    SkyLight(const fs::path &path, const Transform &l2w, bool transform_y_up, float strength = 1.0f,
+             bool use_alias_table = false);
     // Shortcut for ambient light.
     explicit SkyLight(const color3 &ambient);
+    // Restores the map and its sampling distribution from write_snapshot instead of rebuilding them.
+    static std::unique_ptr<SkyLight> from_snapshot(const fs::path &path, const Transform &l2w, bool transform_y_up);
+    void write_snapshot(const fs::path &path) const;
     bool delta_position() const { return false; };
     bool delta_direction() const { return false; };
 
-    // NOTE: the shading point is ignored for skylight
+    // NOTE: the shading point is ignored by eval. Sampling depends on it with portals or visibility sampling.
     color3 eval(const vec3 &p_shade, const vec3 &wi) const;
     // NOTE: return throughput weight: (L / pdf)
     color3 sample(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf) const;
     float pdf(const vec3 &p_shade, const vec3 &wi) const;
+    float power(const AABB3 &scene_bound) const;
+    void eval_n(std::span<const vec3> p_shade, std::span<const vec3> wi, std::span<color3> L) const;
+
+    // Must be called again after changing l2w or transform_y_up.
+    void bake();
+    // Builds the visibility-weighted distributions if visibility_sampling is set. Call after bake() once the scene BVH
+    // is built.
+    void build_visibility(const Scene &scene);
+    color3 lookup(const vec2 &uv) const;
+    // Probability of sampling through the portals from p_shade (portal_fraction if a portal is visible, 0 otherwise).
+    float portal_probability(const vec3 &p_shade) const;
+    // Solid angle pdf of the map distribution (visibility-weighted if built).
+    float map_pdf(const vec3 &p_shade, const vec3 &wi) const;
 
+    // Per-light data baked once so that eval/sample/pdf do not recompute them.
+    struct alignas(64) Baked
+    {
+        // World direction <-> z-up map direction, including the y-up swizzle.
+        mat3 world_to_map = mat3::Identity();
+        mat3 map_to_world = mat3::Identity();
+    } baked;
+
+    // Only one of them is built depending on use_alias_table.
     DistribTable2D distrib;
-    BlockedArray<color3> map;
+    AliasTable2D alias_distrib;
+    bool use_alias_table = false;
+    using SkyMap = BlockedArray<color3, 2, 1>;
+    SkyMap map;
     Transform l2w;
     bool transform_y_up = true;
+    // NOTE: already multiplied into map.
     float strength = 1.0f;
+
+    // Samples are split between the portals and the map distribution (with MIS-compatible mixture pdfs), so openings
+    // that aren't declared as portals are still sampled.
+    std::vector<SkyPortal> portals;
+    float portal_fraction = 0.5f;
+    bool visibility_sampling = false;
+    SkyVisibilityOptions visibility_options;
+    std::unique_ptr<SkyVisibility> visibility;
 };
 
 struct DirectionalLight : public Light
@@ -55,6 +111,7 @@ struct DirectionalLight : public Light
     // NOTE: return throughput weight: (L / pdf)
     color3 sample(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf) const;
     float pdf(const vec3 &p_shade, const vec3 &wi) const;
+    float power(const AABB3 &scene_bound) const;
 
     color3 L;
     vec3 dir;
@@ -0,0 +1,226 @@
+#include "light_sampler.h"
+#include "assertion.h"
+#include "light.h"
+#include <algorithm>
+
+namespace ks
+{
+
+const Light *UniformLightSampler::sample(const vec3 &p, const vec3 &n, float u, float &pmf) const
+{
+    if (lights.empty()) {
+        pmf = 0.0f;
+        return nullptr;
+    }
+    uint32_t index = std::min((uint32_t)(u * lights.size()), (uint32_t)lights.size() - 1);
+    pmf = 1.0f / (float)lights.size();
+    return lights[index];
+}
+
+float UniformLightSampler::pmf(const vec3 &p, const vec3 &n, const Light &light) const
+{
+    if (lights.empty())
+        return 0.0f;
+    return 1.0f / (float)lights.size();
+}
+
+PowerLightSampler::PowerLightSampler(std::span<const Light *const> lights, const AABB3 &scene_bound)
+    : lights(lights.begin(), lights.end())
+{
+    if (lights.empty())
+        return;
+    std::vector<float> powers(lights.size());
+    for (uint32_t i = 0; i < (uint32_t)lights.size(); ++i) {
+        powers[i] = lights[i]->power(scene_bound);
+        light_to_index[lights[i]] = i;
+    }
+    distrib = DistribTable(powers.data(), (uint32_t)powers.size());
+}
+
+const Light *PowerLightSampler::sample(const vec3 &p, const vec3 &n, float u, float &pmf) const
+{
+    if (lights.empty()) {
+        pmf = 0.0f;
+        return nullptr;
+    }
+    uint32_t index = distrib.sample(u, pmf);
+    return lights[index];
+}
+
+float PowerLightSampler::pmf(const vec3 &p, const vec3 &n, const Light &light) const
+{
+    auto it = light_to_index.find(&light);
+    if (it == light_to_index.end())
+        return 0.0f;
+    return distrib.pdf(it->second) / (float)lights.size();
+}
+
+BVHLightSampler::BVHLightSampler(std::span<const Light *const> all_lights, const AABB3 &scene_bound)
+{
+    std::vector<BuildItem> items;
+    std::vector<float> infinite_powers;
+    for (const Light *light : all_lights) {
+        if (light->infinite()) {
+            infinite_to_index[light] = (uint32_t)infinite_lights.size();
+            infinite_lights.push_back(light);
+            infinite_powers.push_back(light->power(scene_bound));
+        } else {
+            float power = light->power(scene_bound);
+            // Lights that never contribute are left out.
+            if (power > 0.0f) {
+                items.push_back({light->bound(), power, (uint32_t)lights.size()});
+                lights.push_back(light);
+            }
+        }
+    }
+
+    if (!infinite_lights.empty()) {
+        infinite_distrib = DistribTable(infinite_powers.data(), (uint32_t)infinite_powers.size());
+    }
+    if (!items.empty()) {
+        nodes.reserve(2 * items.size() - 1);
+        build(items, 0, 0);
+    }
+    // Same heuristic as pbrt-v4: the BVH counts as one more infinite light.
+    float n_infinite = (float)infinite_lights.size();
+    p_infinite = n_infinite / (n_infinite + (nodes.empty() ? 0.0f : 1.0f));
+}
+
+uint32_t BVHLightSampler::build(std::span<BuildItem> items, uint32_t bit_trail, int depth)
+{
+    ASSERT(depth < 32, "Light BVH too deep.");
+    uint32_t node_index = (uint32_t)nodes.size();
+    nodes.emplace_back();
+
+    if (items.size() == 1) {
+        Node &node = nodes[node_index];
+        node.bound = items[0].bound;
+        node.power = items[0].power;
+        node.second_child_or_light = items[0].light;
+        node.leaf = true;
+        bit_trails[lights[items[0].light]] = bit_trail;
+        return node_index;
+    }
+
+    AABB3 centroid_bound;
+    for (const BuildItem &item : items) {
+        centroid_bound.expand(item.bound.center());
+    }
+    uint32_t axis = centroid_bound.largestAxis();
+    size_t mid = items.size() / 2;
+    std::nth_element(items.begin(), items.begin() + mid, items.end(), [&](const BuildItem &a, const BuildItem &b) {
+        return a.bound.center()[axis] < b.bound.center()[axis];
+    });
+
+    build(items.subspan(0, mid), bit_trail, depth + 1);
+    uint32_t second = build(items.subspan(mid), bit_trail | (1u << depth), depth + 1);
+
+    // Don't hold references across build() since nodes may reallocate.
+    Node &node = nodes[node_index];
+    const Node &c0 = nodes[node_index + 1];
+    const Node &c1 = nodes[second];
+    node.bound = join(c0.bound, c1.bound);
+    node.power = c0.power + c1.power;
+    node.second_child_or_light = second;
+    node.leaf = false;
+    return node_index;
+}
+
+float BVHLightSampler::importance(const vec3 &p, const vec3 &n, const Node &node) const
+{
+    // NOTE: ignore n for now since transmissive BSDFs can receive light from below.
+    float d2 = (p - node.bound.center()).squaredNorm();
+    // Clamp to the node extent so the importance does not blow up near/inside the bound.
+    float r2 = 0.25f * node.bound.extents().squaredNorm();
+    d2 = std::max(d2, r2);
+    if (d2 == 0.0f)
+        return node.power;
+    return node.power / d2;
+}
+
+const Light *BVHLightSampler::sample(const vec3 &p, const vec3 &n, float u, float &pmf) const
+{
+    pmf = 0.0f;
+    if (u < p_infinite) {
+        u = std::min(u / p_infinite, before_one);
+        float prob;
+        uint32_t index = infinite_distrib.sample(u, prob);
+        pmf = p_infinite * prob;
+        return infinite_lights[index];
+    }
+    if (nodes.empty())
+        return nullptr;
+
+    u = std::min((u - p_infinite) / (1.0f - p_infinite), before_one);
+    float p_node = 1.0f - p_infinite;
+    uint32_t index = 0;
+    while (!nodes[index].leaf) {
+        uint32_t second = nodes[index].second_child_or_light;
+        float w0 = importance(p, n, nodes[index + 1]);
+        float w1 = importance(p, n, nodes[second]);
+        if (w0 == 0.0f && w1 == 0.0f)
+            return nullptr;
+        float p0 = w0 / (w0 + w1);
+        if (u < p0) {
+            u = std::min(u / p0, before_one);
+            p_node *= p0;
+            index = index + 1;
+        } else {
+            u = std::min((u - p0) / (1.0f - p0), before_one);
+            p_node *= 1.0f - p0;
+            index = second;
+        }
+    }
+    pmf = p_node;
+    return lights[nodes[index].second_child_or_light];
+}
+
+float BVHLightSampler::pmf(const vec3 &p, const vec3 &n, const Light &light) const
+{
+    auto inf_it = infinite_to_index.find(&light);
+    if (inf_it != infinite_to_index.end()) {
+        return p_infinite * infinite_distrib.pdf(inf_it->second) / (float)infinite_lights.size();
+    }
+    auto it = bit_trails.find(&light);
+    if (it == bit_trails.end())
+        return 0.0f;
+
+    uint32_t bit_trail = it->second;
+    float p_node = 1.0f - p_infinite;
+    uint32_t index = 0;
+    while (!nodes[index].leaf) {
+        uint32_t second = nodes[index].second_child_or_light;
+        float w0 = importance(p, n, nodes[index + 1]);
+        float w1 = importance(p, n, nodes[second]);
+        if (w0 == 0.0f && w1 == 0.0f)
+            return 0.0f;
+        if (bit_trail & 1) {
+            p_node *= w1 / (w0 + w1);
+            index = second;
+        } else {
+            p_node *= w0 / (w0 + w1);
+            index = index + 1;
+        }
+        bit_trail >>= 1;
+    }
+    return p_node;
+}
+
+std::unique_ptr<LightSampler> create_light_sampler(const ConfigArgs &args, std::span<const Light *const> lights,
+                                                   const AABB3 &scene_bound)
+{
+    std::string type = args.load_string("type", "bvh");
+    std::unique_ptr<LightSampler> sampler;
+    if (type == "uniform") {
+        sampler = std::make_unique<UniformLightSampler>(lights);
+    } else if (type == "power") {
+        sampler = std::make_unique<PowerLightSampler>(lights, scene_bound);
+    } else if (type == "bvh") {
+        sampler = std::make_unique<BVHLightSampler>(lights, scene_bound);
+    } else {
+        ASSERT(false, "Invalid light sampler type [%s].", type.c_str());
+    }
+    return sampler;
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,89 @@
+#pragma once
+#include "aabb.h"
+#include "config.h"
+#include "distrib.h"
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+namespace ks
+{
+
+struct Light;
+
+// Picks a single light per NEE event instead of looping over all of them.
+struct LightSampler
+{
+    virtual ~LightSampler() = default;
+    // Returns nullptr if no light can contribute. pmf is the discrete probability of the returned light.
+    virtual const Light *sample(const vec3 &p, const vec3 &n, float u, float &pmf) const = 0;
+    virtual float pmf(const vec3 &p, const vec3 &n, const Light &light) const = 0;
+};
+
+struct UniformLightSampler : public LightSampler
+{
+    explicit UniformLightSampler(std::span<const Light *const> lights) : lights(lights.begin(), lights.end()) {}
+
+    const Light *sample(const vec3 &p, const vec3 &n, float u, float &pmf) const;
+    float pmf(const vec3 &p, const vec3 &n, const Light &light) const;
+
+    std::vector<const Light *> lights;
+};
+
+struct PowerLightSampler : public LightSampler
+{
+    PowerLightSampler(std::span<const Light *const> lights, const AABB3 &scene_bound);
+
+    const Light *sample(const vec3 &p, const vec3 &n, float u, float &pmf) const;
+    float pmf(const vec3 &p, const vec3 &n, const Light &light) const;
+
+    std::vector<const Light *> lights;
+    std::unordered_map<const Light *, uint32_t> light_to_index;
+    DistribTable distrib;
+};
+
+// Finite lights are organized in a binary BVH and selected top-down by estimated importance (power over squared
+// distance) in O(log n). Infinite lights are not in the BVH and are picked by power.
+struct BVHLightSampler : public LightSampler
+{
+    BVHLightSampler(std::span<const Light *const> lights, const AABB3 &scene_bound);
+
+    const Light *sample(const vec3 &p, const vec3 &n, float u, float &pmf) const;
+    float pmf(const vec3 &p, const vec3 &n, const Light &light) const;
+
+    struct Node
+    {
+        AABB3 bound;
+        float power = 0.0f;
+        // Left child is always the next node. For leaves, this is the light index.
+        uint32_t second_child_or_light = 0;
+        bool leaf = false;
+    };
+
+    struct BuildItem
+    {
+        AABB3 bound;
+        float power;
+        uint32_t light;
+    };
+
+    uint32_t build(std::span<BuildItem> items, uint32_t bit_trail, int depth);
+    float importance(const vec3 &p, const vec3 &n, const Node &node) const;
+
+    std::vector<const Light *> lights;
+    std::vector<Node> nodes;
+
+    std::vector<const Light *> infinite_lights;
+    DistribTable infinite_distrib;
+    // Probability of picking an infinite light over the BVH.
+    float p_infinite = 0.0f;
+
+    // Path from the root (bit i = child taken at depth i) for pmf() queries.
+    std::unordered_map<const Light *, uint32_t> bit_trails;
+    std::unordered_map<const Light *, uint32_t> infinite_to_index;
+};
+
+std::unique_ptr<LightSampler> create_light_sampler(const ConfigArgs &args, std::span<const Light *const> lights,
+                                                   const AABB3 &scene_bound);
+
+} // namespace ks
\ No newline at end of file
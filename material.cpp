@@ -1,7 +1,10 @@
 #include "material.h"
+#include "bsdf.h"
 #include "nee.h"
 #include "normal_map.h"
-#include "rng.h"
+#include "parallel.h"
+#include "path_guide.h"
+#include "sampler.h"
 #include "scene.h"
 #include "subsurface.h"
 
@@ -37,12 +40,63 @@ inline color3 interpolate_fresnel_color(const vec3 &L, const vec3 &H, float ior,
     return cspec0 * (1.0f - FH) + color3::Constant(FH);
 }
 
+// Directions sampled with a higher (BSDF) pdf than any cosine-weighted diffuse lobe can have count as glossy.
+static LobeType classify_lobe(const BSDFClosure &closure, float bsdf_pdf)
+{
+    if (closure.delta())
+        return LobeType::Specular;
+    return bsdf_pdf > inv_pi ? LobeType::Glossy : LobeType::Diffuse;
+}
+
+// Sample wi from the closure, or from the guide with probability 1 - bsdf_sampling_fraction, and weight by the
+// mixture pdf. Returns f*cos(theta_i) / pdf. pdf is 0 for delta lobes (and failed samples).
+static color3 sample_guided(const BSDFClosure &closure, const Intersection &it, const vec3 &wo_local,
+                            const PathGuide *guide, Sampler &sampler, vec3 &wi_local, float &pdf, LobeType &lobe)
+{
+    if (!guide || closure.delta()) {
+        color3 beta = closure.sample(wo_local, wi_local, sampler.next2d(), pdf);
+        if (pdf == 0.0f) {
+            return color3::Zero();
+        }
+        lobe = classify_lobe(closure, pdf);
+        if (closure.delta()) {
+            pdf = 0.0f;
+        }
+        return beta;
+    }
+
+    float bsdf_fraction = guide->options.bsdf_sampling_fraction;
+    float u_select = sampler.next();
+    vec2 u = sampler.next2d();
+    color3 f;
+    float bsdf_pdf, guide_pdf;
+    if (u_select < bsdf_fraction) {
+        color3 beta = closure.sample(wo_local, wi_local, u, bsdf_pdf);
+        if (bsdf_pdf == 0.0f || beta.maxCoeff() == 0.0f) {
+            pdf = 0.0f;
+            return color3::Zero();
+        }
+        f = beta * bsdf_pdf;
+        guide_pdf = guide->pdf(it.p, it.sh_vector_to_world(wi_local));
+    } else {
+        vec3 wi = guide->sample(it.p, u, guide_pdf);
+        wi_local = it.sh_vector_to_local(wi);
+        std::tie(f, bsdf_pdf) = closure.eval_and_pdf(wo_local, wi_local);
+    }
+    pdf = bsdf_fraction * bsdf_pdf + (1.0f - bsdf_fraction) * guide_pdf;
+    if (pdf == 0.0f) {
+        return color3::Zero();
+    }
+    lobe = classify_lobe(closure, bsdf_pdf);
+    return f / pdf;
+}
+
 BlendedMaterial::BlendedMaterial() = default;
 
 BlendedMaterial::~BlendedMaterial() = default;
 
 color3 BlendedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &scene, const LocalGeometry &local_geom,
-                               RNG &rng, vec3 &wi, Intersection &exit) const
+                               Sampler &sampler, vec3 &wi, Intersection &exit) const
 {
     color3 beta = color3::Ones();
 
@@ -54,7 +108,7 @@ color3 BlendedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &
 
     bool sample_subsurface = false;
     if (subsurface) {
-        if (rng.next() < (bsdf_sample_weight / sum)) {
+        if (sampler.next() < (bsdf_sample_weight / sum)) {
             beta *= (sum / bsdf_sample_weight);
         } else {
             sample_subsurface = true;
@@ -69,7 +123,7 @@ color3 BlendedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &
     if (sample_subsurface) {
         vec3 ss_wi;
         SceneHit exit_hit;
-        if (!subsurface->sample(local_geom, entry, vec3::Zero(), rng, beta, exit_hit, ss_wi)) {
+        if (!subsurface->sample(local_geom, entry, vec3::Zero(), sampler, beta, exit_hit, ss_wi)) {
             return color3::Zero();
         }
         wo = -ss_wi;
@@ -86,22 +140,85 @@ color3 BlendedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &
     vec3 wo_local = exit.sh_vector_to_local(wo);
     vec3 wi_local;
     float pdf;
-    beta *= exit_bsdf->sample(wo_local, wi_local, exit, rng.next2d(), pdf);
+    beta *= exit_bsdf->sample(wo_local, wi_local, exit, sampler.next2d(), pdf);
     if (beta.maxCoeff() == 0.0f || pdf == 0.0f) {
         return color3::Zero();
     }
-    ASSERT(beta.allFinite() && (beta >= 0.0f).all());
+    ASSERT_HOT(beta.allFinite() && (beta >= 0.0f).all());
     wi = exit.sh_vector_to_world(wi_local);
 
     return beta;
 }
 
+// NEE at exit and sampling of wi from exit_bsdf, where s.beta is the throughput up to exit.
+static void sample_exit_with_direct(const BSDF &exit_bsdf, const vec3 &wo, const Intersection &exit,
+                                    const Scene &scene, std::span<const Light *const> lights, Sampler &sampler,
+                                    ShadowRayQueue *shadow_queue, const LightSampler *light_sampler,
+                                    const PathGuide *guide, MaterialSample &s, vec3 &wi)
+{
+    // NOTE: the integrator resets the arena after each sample.
+    BlockAllocator &arena = scratch_arena().local();
+    const BSDFClosure *exit_closure = exit_bsdf.closure(exit, arena);
+    s.Ld +=
+        s.beta * sample_direct(scene, lights, *exit_closure, exit, wo, sampler, shadow_queue, s.beta, light_sampler);
+    vec3 wo_local = exit.sh_vector_to_local(wo);
+    vec3 wi_local;
+    s.beta *= sample_guided(*exit_closure, exit, wo_local, guide, sampler, wi_local, s.pdf, s.lobe);
+    ASSERT_HOT(s.beta.allFinite() && (s.beta >= 0.0f).all());
+    if (s.beta.maxCoeff() > 0.0f) {
+        wi = exit.sh_vector_to_world(wi_local);
+    }
+}
+
+static void run_subsurface_walk(SubsurfaceWalk &walk, Sampler &sampler)
+{
+    walk.hit = walk.bssrdf->sample(walk.local_geometry, walk.entry, walk.D, sampler, walk.throughput, walk.exit,
+                                   walk.wi);
+}
+
+bool Material::begin_sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
+                                        const LocalGeometry &local_geom, std::span<const Light *const> lights,
+                                        Sampler &sampler, vec3 &wi, Intersection &exit, MaterialSample &s,
+                                        SubsurfaceWalk &walk, ShadowRayQueue *shadow_queue,
+                                        const LightSampler *light_sampler, const PathGuide *guide) const
+{
+    s = sample_with_direct(wo, entry, scene, local_geom, lights, sampler, wi, exit, shadow_queue, light_sampler, guide);
+    return false;
+}
+
+MaterialSample Material::finish_sample_with_direct(const SubsurfaceWalk &walk, const MaterialSample &s,
+                                                   const Scene &scene, std::span<const Light *const> lights,
+                                                   Sampler &sampler, vec3 &wi, Intersection &exit,
+                                                   ShadowRayQueue *shadow_queue, const LightSampler *light_sampler,
+                                                   const PathGuide *guide) const
+{
+    ASSERT(false, "Material did not queue a random walk.");
+    return s;
+}
+
 MaterialSample BlendedMaterial::sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
                                                    const LocalGeometry &local_geom,
-                                                   std::span<const Light *const> lights, RNG &rng, vec3 &wi,
-                                                   Intersection &exit) const
+                                                   std::span<const Light *const> lights, Sampler &sampler, vec3 &wi,
+                                                   Intersection &exit, ShadowRayQueue *shadow_queue,
+                                                   const LightSampler *light_sampler, const PathGuide *guide) const
 {
     MaterialSample s;
+    SubsurfaceWalk walk;
+    if (!begin_sample_with_direct(wo, entry, scene, local_geom, lights, sampler, wi, exit, s, walk, shadow_queue,
+                                  light_sampler, guide)) {
+        return s;
+    }
+    run_subsurface_walk(walk, sampler);
+    return finish_sample_with_direct(walk, s, scene, lights, sampler, wi, exit, shadow_queue, light_sampler, guide);
+}
+
+bool BlendedMaterial::begin_sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
+                                               const LocalGeometry &local_geom, std::span<const Light *const> lights,
+                                               Sampler &sampler, vec3 &wi, Intersection &exit, MaterialSample &s,
+                                               SubsurfaceWalk &walk, ShadowRayQueue *shadow_queue,
+                                               const LightSampler *light_sampler, const PathGuide *guide) const
+{
+    s = MaterialSample();
 
     // Heuristic loosely from Blender (Monaco)
     // float bsdf_sample_weight = 1.0f;
@@ -120,7 +237,7 @@ MaterialSample BlendedMaterial::sample_with_direct(vec3 wo, const Intersection &
 
     bool sample_subsurface = false;
     if (subsurface) {
-        if (rng.next() < (bsdf_sample_weight / sum)) {
+        if (sampler.next() < (bsdf_sample_weight / sum)) {
             s.beta *= (sum / bsdf_sample_weight);
         } else {
             sample_subsurface = true;
@@ -131,35 +248,36 @@ MaterialSample BlendedMaterial::sample_with_direct(vec3 wo, const Intersection &
         }
     }
 
-    const BSDF *exit_bsdf = nullptr;
     if (sample_subsurface) {
-        vec3 ss_wi;
-        SceneHit exit_hit;
-        if (!subsurface->sample(local_geom, entry, vec3::Zero(), rng, s.beta, exit_hit, ss_wi)) {
-            return {color3::Zero(), color3::Zero()};
-        }
-        wo = -ss_wi;
-        exit = exit_hit.it;
-        if (lambert_exit) {
-            exit_bsdf = lambert_exit.get();
-        } else
-            exit_bsdf = exit_hit.material->bsdf;
-    } else {
-        exit = entry;
-        exit_bsdf = bsdf;
+        walk.bssrdf = subsurface;
+        walk.local_geometry = local_geom;
+        walk.entry = entry;
+        walk.D = vec3::Zero();
+        walk.throughput = s.beta;
+        return true;
     }
+    exit = entry;
+    sample_exit_with_direct(*bsdf, wo, exit, scene, lights, sampler, shadow_queue, light_sampler, guide, s, wi);
+    return false;
+}
 
-    s.Ld = s.beta * sample_direct(scene, lights, *exit_bsdf, exit, wo, rng);
-    vec3 wo_local = exit.sh_vector_to_local(wo);
-    vec3 wi_local;
-    float pdf;
-    s.beta *= exit_bsdf->sample(wo_local, wi_local, exit, rng.next2d(), pdf);
-    ASSERT(s.beta.allFinite() && (s.beta >= 0.0f).all());
-    if (s.beta.maxCoeff() == 0.0f || pdf == 0.0f) {
-        return s;
+MaterialSample BlendedMaterial::finish_sample_with_direct(const SubsurfaceWalk &walk, const MaterialSample &partial,
+                                                          const Scene &scene, std::span<const Light *const> lights,
+                                                          Sampler &sampler, vec3 &wi, Intersection &exit,
+                                                          ShadowRayQueue *shadow_queue,
+                                                          const LightSampler *light_sampler,
+                                                          const PathGuide *guide) const
+{
+    if (!walk.hit) {
+        return {color3::Zero(), color3::Zero()};
     }
-    wi = exit.sh_vector_to_world(wi_local);
-
+    MaterialSample s = partial;
+    s.beta = walk.throughput;
+    exit = walk.exit.it;
+    const BSDF *exit_bsdf = lambert_exit ? lambert_exit.get() : walk.exit.material->bsdf;
+    sample_exit_with_direct(*exit_bsdf, -walk.wi, exit, scene, lights, sampler, shadow_queue, light_sampler, guide, s,
+                            wi);
+    s.lobe = LobeType::Subsurface;
     return s;
 }
 
@@ -175,7 +293,7 @@ std::unique_ptr<BlendedMaterial> create_blended_material(const ConfigArgs &args)
 }
 
 color3 StackedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &scene, const LocalGeometry &local_geom,
-                               RNG &rng, vec3 &wi, Intersection &exit) const
+                               Sampler &sampler, vec3 &wi, Intersection &exit) const
 {
     color3 beta = color3::Ones();
     // (assume radiance scaling due to refractive index handled in bsdf)
@@ -183,11 +301,11 @@ color3 StackedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &
     vec3 entry_wo_local = entry.sh_vector_to_local(wo);
     vec3 entry_wi_local;
     float pdf;
-    beta *= bsdf->sample(entry_wo_local, entry_wi_local, entry, rng.next2d(), pdf);
+    beta *= bsdf->sample(entry_wo_local, entry_wi_local, entry, sampler.next2d(), pdf);
     if (beta.maxCoeff() == 0.0f || pdf == 0.0f) {
         return color3::Zero();
     }
-    ASSERT(beta.allFinite() && (beta >= 0.0f).all());
+    ASSERT_HOT(beta.allFinite() && (beta >= 0.0f).all());
     wi = entry.sh_vector_to_world(entry_wi_local);
 
     // 2. if refracting in, sample BSSRDF
@@ -195,7 +313,7 @@ color3 StackedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &
         vec3 D = entry.sh_vector_to_world(entry_wi_local);
         vec3 ss_wi;
         SceneHit exit_hit;
-        if (!subsurface->sample(local_geom, entry, D, rng, beta, exit_hit, ss_wi)) {
+        if (!subsurface->sample(local_geom, entry, D, sampler, beta, exit_hit, ss_wi)) {
             return color3::Zero();
         }
         exit = exit_hit.it;
@@ -204,11 +322,11 @@ color3 StackedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &
         // 3. sample surface at exit
         vec3 exit_wo_local = exit.sh_vector_to_local(-ss_wi);
         vec3 exit_wi_local;
-        beta *= exit_bsdf->sample(exit_wo_local, exit_wi_local, exit, rng.next2d(), pdf);
+        beta *= exit_bsdf->sample(exit_wo_local, exit_wi_local, exit, sampler.next2d(), pdf);
         if (beta.maxCoeff() == 0.0f || pdf == 0.0f) {
             return color3::Zero();
         }
-        ASSERT(beta.allFinite() && (beta >= 0.0f).all());
+        ASSERT_HOT(beta.allFinite() && (beta >= 0.0f).all());
         wi = exit.sh_vector_to_world(exit_wi_local);
     }
     return beta;
@@ -216,48 +334,79 @@ color3 StackedMaterial::sample(vec3 wo, const Intersection &entry, const Scene &
 
 MaterialSample StackedMaterial::sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
                                                    const LocalGeometry &local_geom,
-                                                   std::span<const Light *const> lights, RNG &rng, vec3 &wi,
-                                                   Intersection &exit) const
+                                                   std::span<const Light *const> lights, Sampler &sampler, vec3 &wi,
+                                                   Intersection &exit, ShadowRayQueue *shadow_queue,
+                                                   const LightSampler *light_sampler, const PathGuide *guide) const
 {
     MaterialSample s;
+    SubsurfaceWalk walk;
+    if (!begin_sample_with_direct(wo, entry, scene, local_geom, lights, sampler, wi, exit, s, walk, shadow_queue,
+                                  light_sampler, guide)) {
+        return s;
+    }
+    run_subsurface_walk(walk, sampler);
+    return finish_sample_with_direct(walk, s, scene, lights, sampler, wi, exit, shadow_queue, light_sampler, guide);
+}
+
+bool StackedMaterial::begin_sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
+                                               const LocalGeometry &local_geom, std::span<const Light *const> lights,
+                                               Sampler &sampler, vec3 &wi, Intersection &exit, MaterialSample &s,
+                                               SubsurfaceWalk &walk, ShadowRayQueue *shadow_queue,
+                                               const LightSampler *light_sampler, const PathGuide *guide) const
+{
+    s = MaterialSample();
+    // NOTE: the integrator resets the arena after each sample.
+    BlockAllocator &arena = scratch_arena().local();
 
     // (assume radiance scaling due to refractive index handled in bsdf)
     // 1.1. nee at entry
-    s.Ld += sample_direct(scene, lights, *bsdf, entry, wo, rng);
+    const BSDFClosure *entry_closure = bsdf->closure(entry, arena);
+    s.Ld +=
+        sample_direct(scene, lights, *entry_closure, entry, wo, sampler, shadow_queue, color3::Ones(), light_sampler);
     // 1.2. sample surface at entry
     vec3 entry_wo_local = entry.sh_vector_to_local(wo);
     vec3 entry_wi_local;
-    float pdf;
-    s.beta *= bsdf->sample(entry_wo_local, entry_wi_local, entry, rng.next2d(), pdf);
-    if (s.beta.maxCoeff() == 0.0f || pdf == 0.0f) {
-        return {color3::Zero(), color3::Zero()};
+    s.beta *= sample_guided(*entry_closure, entry, entry_wo_local, guide, sampler, entry_wi_local, s.pdf,
+                            s.lobe);
+    if (s.beta.maxCoeff() == 0.0f) {
+        s = {color3::Zero(), color3::Zero()};
+        return false;
     }
-    ASSERT(s.beta.allFinite() && (s.beta >= 0.0f).all());
+    ASSERT_HOT(s.beta.allFinite() && (s.beta >= 0.0f).all());
     wi = entry.sh_vector_to_world(entry_wi_local);
+    exit = entry;
 
     // 2. if refracting in, sample BSSRDF
     if (entry_wo_local.z() > 0.0f && entry_wi_local.z() < 0.0f) {
-        vec3 D = wi;
-        vec3 ss_wi;
-        SceneHit exit_hit;
-        if (!subsurface->sample(local_geom, entry, D, rng, s.beta, exit_hit, ss_wi)) {
-            return {color3::Zero(), color3::Zero()};
-        }
-        exit = exit_hit.it;
-        const BSDF *exit_bsdf = exit_hit.material->bsdf;
+        walk.bssrdf = subsurface;
+        walk.local_geometry = local_geom;
+        walk.entry = entry;
+        walk.D = wi;
+        walk.throughput = s.beta;
+        return true;
+    }
+    return false;
+}
 
-        // 3.1 nee at exit
-        vec3 exit_wo = -ss_wi;
-        s.Ld += s.beta * sample_direct(scene, lights, *exit_bsdf, exit, exit_wo, rng);
-        // 3.2 sample surface at exit
-        vec3 exit_wo_local = exit.sh_vector_to_local(exit_wo);
-        vec3 exit_wi_local;
-        s.beta *= exit_bsdf->sample(exit_wo_local, exit_wi_local, exit, rng.next2d(), pdf);
-        if (s.beta.maxCoeff() == 0.0f || pdf == 0.0f) {
-            return {color3::Zero(), color3::Zero()};
-        }
-        ASSERT(s.beta.allFinite() && (s.beta >= 0.0f).all());
-        wi = exit.sh_vector_to_world(exit_wi_local);
+MaterialSample StackedMaterial::finish_sample_with_direct(const SubsurfaceWalk &walk, const MaterialSample &partial,
+                                                          const Scene &scene, std::span<const Light *const> lights,
+                                                          Sampler &sampler, vec3 &wi, Intersection &exit,
+                                                          ShadowRayQueue *shadow_queue,
+                                                          const LightSampler *light_sampler,
+                                                          const PathGuide *guide) const
+{
+    if (!walk.hit) {
+        return {color3::Zero(), color3::Zero()};
+    }
+    MaterialSample s = partial;
+    s.beta = walk.throughput;
+    exit = walk.exit.it;
+    // 3. nee and sample surface at exit
+    sample_exit_with_direct(*walk.exit.material->bsdf, -walk.wi, exit, scene, lights, sampler, shadow_queue,
+                            light_sampler, guide, s, wi);
+    s.lobe = LobeType::Subsurface;
+    if (s.beta.maxCoeff() == 0.0f) {
+        return {color3::Zero(), color3::Zero()};
     }
     return s;
 }
@@ -280,6 +429,9 @@ std::unique_ptr<Material> create_material(const ConfigArgs &args)
     } else if (type == "stacked") {
         material = create_stacked_material(args);
     }
+    if (material && args.contains("emission")) {
+        material->emission = args.load_vec3("emission").array() * args.load_float("emission_scale", 1.0f);
+    }
 
     return material;
 }
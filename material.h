@@ -1,5 +1,6 @@
 #pragma once
 #include "config.h"
+#include "path_termination.h"
 #include <span>
 
 namespace ks
@@ -8,31 +9,62 @@ namespace ks
 struct BSDF;
 struct BSSRDF;
 struct NormalMap;
-struct RNG;
+struct Sampler;
 struct Intersection;
 struct Scene;
 struct LocalGeometry;
 struct Light;
 struct LambertianSubsurfaceExitAdapter;
+struct ShadowRayQueue;
+struct LightSampler;
+struct PathGuide;
+struct SubsurfaceWalk;
 
 struct MaterialSample
 {
     color3 Ld = color3::Zero();
     color3 beta = color3::Ones();
+    // Solid angle pdf of wi (for training a path guide). 0 if a delta lobe was sampled.
+    float pdf = 0.0f;
+    LobeType lobe = LobeType::Diffuse;
 };
 
 struct Material : public Configurable
 {
     virtual color3 sample(vec3 wo, const Intersection &entry, const Scene &scene, const LocalGeometry &local_geom,
-                          RNG &rng, vec3 &wi, Intersection &exit) const = 0;
+                          Sampler &sampler, vec3 &wi, Intersection &exit) const = 0;
 
+    // If guide is given, BSDF sampling of wi is combined with sampling the guide (one-sample MIS).
     virtual MaterialSample sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
                                               const LocalGeometry &local_geom, std::span<const Light *const> lights,
-                                              RNG &rng, vec3 &wi, Intersection &exit) const = 0;
+                                              Sampler &sampler, vec3 &wi, Intersection &exit,
+                                              ShadowRayQueue *shadow_queue = nullptr,
+                                              const LightSampler *light_sampler = nullptr,
+                                              const PathGuide *guide = nullptr) const = 0;
+
+    // sample_with_direct split around its random walk, so that an integrator can run the walks of many samples
+    // together (see subsurface_random_walk_n). Returns false with the complete sample in s if no walk is needed.
+    // Otherwise walk is set up and s is partial: run the walk with sampler, then call finish_sample_with_direct.
+    // The defaults never queue a walk.
+    virtual bool begin_sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
+                                          const LocalGeometry &local_geom, std::span<const Light *const> lights,
+                                          Sampler &sampler, vec3 &wi, Intersection &exit, MaterialSample &s,
+                                          SubsurfaceWalk &walk, ShadowRayQueue *shadow_queue = nullptr,
+                                          const LightSampler *light_sampler = nullptr,
+                                          const PathGuide *guide = nullptr) const;
+    virtual MaterialSample finish_sample_with_direct(const SubsurfaceWalk &walk, const MaterialSample &s,
+                                                     const Scene &scene, std::span<const Light *const> lights,
+                                                     Sampler &sampler, vec3 &wi, Intersection &exit,
+                                                     ShadowRayQueue *shadow_queue = nullptr,
+                                                     const LightSampler *light_sampler = nullptr,
+                                                     const PathGuide *guide = nullptr) const;
 
     const BSDF *bsdf = nullptr;
     const BSSRDF *subsurface = nullptr;
     const NormalMap *normal_map = nullptr;
+    // Radiance emitted from the front side (both sides if the mesh is twosided). Meshes with emissive materials are
+    // turned into lights by create_mesh_lights.
+    color3 emission = color3::Zero();
 };
 
 struct BlendedMaterial : public Material
@@ -40,24 +72,50 @@ struct BlendedMaterial : public Material
     BlendedMaterial();
     ~BlendedMaterial();
 
-    color3 sample(vec3 wo, const Intersection &entry, const Scene &scene, const LocalGeometry &local_geom, RNG &rng,
-                  vec3 &wi, Intersection &exit) const;
+    color3 sample(vec3 wo, const Intersection &entry, const Scene &scene, const LocalGeometry &local_geom,
+                  Sampler &sampler, vec3 &wi, Intersection &exit) const;
 
     MaterialSample sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
-                                      const LocalGeometry &local_geom, std::span<const Light *const> lights, RNG &rng,
-                                      vec3 &wi, Intersection &exit) const;
+                                      const LocalGeometry &local_geom, std::span<const Light *const> lights,
+                                      Sampler &sampler, vec3 &wi, Intersection &exit,
+                                      ShadowRayQueue *shadow_queue = nullptr,
+                                      const LightSampler *light_sampler = nullptr,
+                                      const PathGuide *guide = nullptr) const;
+    bool begin_sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
+                                  const LocalGeometry &local_geom, std::span<const Light *const> lights,
+                                  Sampler &sampler, vec3 &wi, Intersection &exit, MaterialSample &s,
+                                  SubsurfaceWalk &walk, ShadowRayQueue *shadow_queue = nullptr,
+                                  const LightSampler *light_sampler = nullptr, const PathGuide *guide = nullptr) const;
+    MaterialSample finish_sample_with_direct(const SubsurfaceWalk &walk, const MaterialSample &s, const Scene &scene,
+                                             std::span<const Light *const> lights, Sampler &sampler, vec3 &wi,
+                                             Intersection &exit, ShadowRayQueue *shadow_queue = nullptr,
+                                             const LightSampler *light_sampler = nullptr,
+                                             const PathGuide *guide = nullptr) const;
 
     std::unique_ptr<LambertianSubsurfaceExitAdapter> lambert_exit;
 };
 
 struct StackedMaterial : public Material
 {
-    color3 sample(vec3 wo, const Intersection &entry, const Scene &scene, const LocalGeometry &local_geom, RNG &rng,
-                  vec3 &wi, Intersection &exit) const;
+    color3 sample(vec3 wo, const Intersection &entry, const Scene &scene, const LocalGeometry &local_geom,
+                  Sampler &sampler, vec3 &wi, Intersection &exit) const;
 
     MaterialSample sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
-                                      const LocalGeometry &local_geom, std::span<const Light *const> lights, RNG &rng,
-                                      vec3 &wi, Intersection &exit) const;
+                                      const LocalGeometry &local_geom, std::span<const Light *const> lights,
+                                      Sampler &sampler, vec3 &wi, Intersection &exit,
+                                      ShadowRayQueue *shadow_queue = nullptr,
+                                      const LightSampler *light_sampler = nullptr,
+                                      const PathGuide *guide = nullptr) const;
+    bool begin_sample_with_direct(vec3 wo, const Intersection &entry, const Scene &scene,
+                                  const LocalGeometry &local_geom, std::span<const Light *const> lights,
+                                  Sampler &sampler, vec3 &wi, Intersection &exit, MaterialSample &s,
+                                  SubsurfaceWalk &walk, ShadowRayQueue *shadow_queue = nullptr,
+                                  const LightSampler *light_sampler = nullptr, const PathGuide *guide = nullptr) const;
+    MaterialSample finish_sample_with_direct(const SubsurfaceWalk &walk, const MaterialSample &s, const Scene &scene,
+                                             std::span<const Light *const> lights, Sampler &sampler, vec3 &wi,
+                                             Intersection &exit, ShadowRayQueue *shadow_queue = nullptr,
+                                             const LightSampler *light_sampler = nullptr,
+                                             const PathGuide *guide = nullptr) const;
 };
 
 std::unique_ptr<Material> create_material(const ConfigArgs &args);
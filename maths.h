@@ -308,6 +308,15 @@ inline void to_spherical(const vec3 &dir, float &phi, float &theta)
     }
 }
 
+// Angle between unit vectors, accurate for nearly (anti)parallel ones.
+inline float angle_between(const vec3 &v1, const vec3 &v2)
+{
+    if (v1.dot(v2) < 0.0f)
+        return pi - 2.0f * std::asin(std::min((v1 + v2).norm() / 2.0f, 1.0f));
+    else
+        return 2.0f * std::asin(std::min((v2 - v1).norm() / 2.0f, 1.0f));
+}
+
 inline vec3 to_cartesian(float phi, float theta)
 {
     float cos_theta = std::cos(theta);
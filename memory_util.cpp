@@ -38,6 +38,8 @@ void BlockAllocator::swap(BlockAllocator &other)
     std::swap(used_blocks, other.used_blocks);
     std::swap(free_blocks, other.free_blocks);
     std::swap(max_num_blocks, other.max_num_blocks);
+    std::swap(curr_bytes, other.curr_bytes);
+    std::swap(max_bytes, other.max_bytes);
 }
 
 void *BlockAllocator::allocate(size_t byteCount)
@@ -83,6 +85,8 @@ void *BlockAllocator::allocate(size_t byteCount)
     }
     void *ret = curr_block + curr_block_pos;
     curr_block_pos += byteCount;
+    curr_bytes += byteCount;
+    max_bytes = std::max(max_bytes, curr_bytes);
     return ret;
 }
 
@@ -98,6 +102,9 @@ void BlockAllocator::reset()
     free_blocks.insert(free_blocks.end(), std::make_move_iterator(used_blocks.begin()),
                        std::make_move_iterator(used_blocks.end()));
     used_blocks.clear();
+    // The current block can be reused from the start as well.
+    curr_block_pos = 0;
+    curr_bytes = 0;
 }
 
 } // namespace ks
\ No newline at end of file
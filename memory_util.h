@@ -103,6 +103,12 @@ class BlockAllocator final : public Allocator
 
     void reset();
 
+    // For sizing: bytes handed out since the last reset, the peak of that over the lifetime, and the total number of
+    // blocks owned (in use or free).
+    size_t bytes_allocated() const { return curr_bytes; }
+    size_t peak_bytes() const { return max_bytes; }
+    size_t num_blocks() const { return used_blocks.size() + free_blocks.size() + (curr_block ? 1 : 0); }
+
   private:
     using byteptr_t = uint8_t *;
 
@@ -113,6 +119,8 @@ class BlockAllocator final : public Allocator
     std::vector<std::pair<size_t, byteptr_t>> used_blocks;
     std::vector<std::pair<size_t, byteptr_t>> free_blocks;
     size_t max_num_blocks;
+    size_t curr_bytes = 0;
+    size_t max_bytes = 0;
 };
 
 } // namespace ks
\ No newline at end of file
@@ -1,10 +1,12 @@
 #include "mesh_asset.h"
+#include "asset_store.h"
 #include "bsdf.h"
 #include "config.h"
 #include "file_util.h"
 #include "hash.h"
 #include "maths.h"
 #include "parallel.h"
+#include "stats.h"
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 #include <stb_image.h>
@@ -14,22 +16,22 @@
 #define TINYGLTF_NO_INCLUDE_STB_IMAGE_WRITE
 #include "tiny_gltf.h"
 #include <array>
+#include <cstddef>
 #include <iostream>
 #include <unordered_map>
 
 namespace ks
 {
 
-static void parse_tinyobj_material(const tinyobj::material_t &mat, const fs::path &base_path, MeshAsset &asset)
+static StatTimer stat_mesh_load("assets/load_mesh");
+static StatTimer stat_compound_mesh_load("assets/load_compound_mesh");
+
+static void parse_tinyobj_material(const tinyobj::material_t &mat, const Texture *albedo_map, MeshAsset &asset)
 {
     std::unique_ptr<Lambertian> lambert;
-    if (!mat.diffuse_texname.empty()) {
-        fs::path path = base_path / mat.diffuse_texname;
-        std::unique_ptr<Texture> albedo_map = create_texture_from_image(3, true, ColorSpace::sRGB, path);
+    if (albedo_map) {
         std::unique_ptr<LinearSampler> sampler = std::make_unique<LinearSampler>();
         std::unique_ptr<TextureField<3>> albedo = std::make_unique<TextureField<3>>(*albedo_map, std::move(sampler));
-        asset.textures.push_back(std::move(albedo_map));
-        asset.texture_names.push_back(mat.diffuse_texname);
         lambert = std::make_unique<Lambertian>(std::move(albedo));
     } else {
         color3 albedo(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]);
@@ -58,6 +60,86 @@ struct IndexEqual
     }
 };
 
+static std::unique_ptr<MeshData> build_tinyobj_mesh(const tinyobj::attrib_t &attrib, const tinyobj::shape_t &shape,
+                                                    bool load_materials, bool twosided, bool use_smooth_normal,
+                                                    int &material_id)
+{
+    std::unique_ptr<MeshData> mesh = std::make_unique<MeshData>();
+    mesh->twosided = twosided;
+    mesh->use_smooth_normal = use_smooth_normal;
+    mesh->indices.reserve(shape.mesh.num_face_vertices.size() * 3);
+    // Need to reconstruct index buffer per shape.
+    std::unordered_map<tinyobj::index_t, uint32_t, IndexHash, IndexEqual> index_remap;
+    mesh->vertices.reserve(shape.mesh.num_face_vertices.size() * 3 * 3);
+    mesh->texcoords.reserve(shape.mesh.num_face_vertices.size() * 3 * 2);
+    mesh->vertex_normals.reserve(shape.mesh.num_face_vertices.size() * 3 * 3);
+
+    for (int f = 0; f < (int)shape.mesh.num_face_vertices.size(); f++) {
+        int fv = int(shape.mesh.num_face_vertices[f]);
+        if (load_materials) {
+            if (material_id == -1) {
+                material_id = shape.mesh.material_ids[f];
+            } else {
+                ASSERT(material_id == shape.mesh.material_ids[f], "Don't allow per-face material.");
+            }
+        }
+        ASSERT(fv == 3, "Only accept triangular meshes.");
+        for (int v = 0; v < 3; v++) {
+            tinyobj::index_t idx = shape.mesh.indices[3 * f + v];
+            ASSERT(idx.vertex_index >= 0);
+            // idx.texcoord_index
+            auto insert = index_remap.insert({idx, (uint32_t)mesh->vertices.size() / 3});
+            if (insert.second) {
+                tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
+                tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
+                tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
+
+                mesh->vertices.push_back(vx);
+                mesh->vertices.push_back(vy);
+                mesh->vertices.push_back(vz);
+
+                if (idx.texcoord_index >= 0) {
+                    tinyobj::real_t tx = attrib.texcoords[2 * idx.texcoord_index + 0];
+                    tinyobj::real_t ty = attrib.texcoords[2 * idx.texcoord_index + 1];
+                    mesh->texcoords.push_back(tx);
+                    mesh->texcoords.push_back(ty);
+                } else {
+                    ASSERT(mesh->texcoords.empty(), "Either all or none vertices have uv.");
+                }
+
+                if (idx.normal_index >= 0) {
+                    tinyobj::real_t nx = attrib.normals[3 * idx.normal_index + 0];
+                    tinyobj::real_t ny = attrib.normals[3 * idx.normal_index + 1];
+                    tinyobj::real_t nz = attrib.normals[3 * idx.normal_index + 2];
+
+                    mesh->vertex_normals.push_back(nx);
+                    mesh->vertex_normals.push_back(ny);
+                    mesh->vertex_normals.push_back(nz);
+                } else {
+                    ASSERT(mesh->vertex_normals.empty(), "Either all or none vertices have vertex normal.");
+                }
+            }
+            mesh->indices.push_back(insert.first->second);
+        }
+    }
+
+    // Add a dummy value to vertex buffer for embree padding.
+    mesh->vertices.push_back(std::numeric_limits<float>::quiet_NaN());
+    mesh->vertices.shrink_to_fit();
+    // Add two dummy values to vertex buffer for embree padding.
+    if (!mesh->texcoords.empty()) {
+        mesh->texcoords.push_back(std::numeric_limits<float>::quiet_NaN());
+        mesh->texcoords.push_back(std::numeric_limits<float>::quiet_NaN());
+    }
+    mesh->texcoords.shrink_to_fit();
+    // Add a dummy values to vertex buffer for embree padding.
+    if (!mesh->vertex_normals.empty()) {
+        mesh->vertex_normals.push_back(std::numeric_limits<float>::quiet_NaN());
+    }
+    mesh->vertex_normals.shrink_to_fit();
+    return mesh;
+}
+
 void MeshAsset::load_from_obj(const fs::path &path, bool load_materials, bool twosided, bool use_smooth_normal)
 {
     fs::path base_path = path.parent_path();
@@ -79,110 +161,95 @@ void MeshAsset::load_from_obj(const fs::path &path, bool load_materials, bool tw
     const auto &shapes = reader.GetShapes();
     const auto &materials = reader.GetMaterials();
 
-    meshes.reserve(shapes.size());
-    if (load_materials)
-        bsdfs.reserve(shapes.size());
-
-    for (int s = 0; s < (int)shapes.size(); s++) {
-        const tinyobj::shape_t &shape = shapes[s];
-        std::unique_ptr<MeshData> mesh = std::make_unique<MeshData>();
-        mesh->twosided = twosided;
-        mesh->use_smooth_normal = use_smooth_normal;
-        mesh->indices.reserve(shape.mesh.num_face_vertices.size() * 3);
-        // Need to reconstruct index buffer per shape.
-        std::unordered_map<tinyobj::index_t, uint32_t, IndexHash, IndexEqual> index_remap;
-        mesh->vertices.reserve(shape.mesh.num_face_vertices.size() * 3 * 3);
-        mesh->texcoords.reserve(shape.mesh.num_face_vertices.size() * 3 * 2);
-        mesh->vertex_normals.reserve(shape.mesh.num_face_vertices.size() * 3 * 3);
-
-        int material_id = -1;
-        for (int f = 0; f < (int)shape.mesh.num_face_vertices.size(); f++) {
-            int fv = int(shape.mesh.num_face_vertices[f]);
-            if (load_materials) {
-                if (material_id == -1) {
-                    material_id = shape.mesh.material_ids[f];
-                } else {
-                    ASSERT(material_id == shape.mesh.material_ids[f], "Don't allow per-face material.");
-                }
-            }
-            ASSERT(fv == 3, "Only accept triangular meshes.");
-            for (int v = 0; v < 3; v++) {
-                tinyobj::index_t idx = shape.mesh.indices[3 * f + v];
-                ASSERT(idx.vertex_index >= 0);
-                // idx.texcoord_index
-                auto insert = index_remap.insert({idx, (uint32_t)mesh->vertices.size() / 3});
-                if (insert.second) {
-                    tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
-                    tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
-                    tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
-
-                    mesh->vertices.push_back(vx);
-                    mesh->vertices.push_back(vy);
-                    mesh->vertices.push_back(vz);
-
-                    if (idx.texcoord_index >= 0) {
-                        tinyobj::real_t tx = attrib.texcoords[2 * idx.texcoord_index + 0];
-                        tinyobj::real_t ty = attrib.texcoords[2 * idx.texcoord_index + 1];
-                        mesh->texcoords.push_back(tx);
-                        mesh->texcoords.push_back(ty);
-                    } else {
-                        ASSERT(mesh->texcoords.empty(), "Either all or none vertices have uv.");
-                    }
-
-                    if (idx.normal_index >= 0) {
-                        tinyobj::real_t nx = attrib.normals[3 * idx.normal_index + 0];
-                        tinyobj::real_t ny = attrib.normals[3 * idx.normal_index + 1];
-                        tinyobj::real_t nz = attrib.normals[3 * idx.normal_index + 2];
-
-                        mesh->vertex_normals.push_back(nx);
-                        mesh->vertex_normals.push_back(ny);
-                        mesh->vertex_normals.push_back(nz);
-                    } else {
-                        ASSERT(mesh->vertex_normals.empty(), "Either all or none vertices have vertex normal.");
-                    }
-                }
-                mesh->indices.push_back(insert.first->second);
-            }
-        }
+    // Shapes are independent: each one rebuilds its own index buffer.
+    meshes.resize(shapes.size());
+    std::vector<int> material_ids(shapes.size(), -1);
+    parallel_for((int)shapes.size(), [&](int s) {
+        meshes[s] = build_tinyobj_mesh(attrib, shapes[s], load_materials, twosided, use_smooth_normal, material_ids[s]);
+    });
+    mesh_names.reserve(shapes.size());
+    for (const tinyobj::shape_t &shape : shapes) {
+        mesh_names.push_back(shape.name);
+    }
 
-        // Add a dummy value to vertex buffer for embree padding.
-        mesh->vertices.push_back(std::numeric_limits<float>::quiet_NaN());
-        mesh->vertices.shrink_to_fit();
-        // Add two dummy values to vertex buffer for embree padding.
-        if (!mesh->texcoords.empty()) {
-            mesh->texcoords.push_back(std::numeric_limits<float>::quiet_NaN());
-            mesh->texcoords.push_back(std::numeric_limits<float>::quiet_NaN());
+    if (load_materials) {
+        // Decode every referenced texture once, in parallel.
+        std::vector<std::string> texnames;
+        for (int material_id : material_ids) {
+            const std::string &texname = materials[material_id].diffuse_texname;
+            if (!texname.empty() && std::find(texnames.begin(), texnames.end(), texname) == texnames.end())
+                texnames.push_back(texname);
         }
-        mesh->texcoords.shrink_to_fit();
-        // Add a dummy values to vertex buffer for embree padding.
-        if (!mesh->vertex_normals.empty()) {
-            mesh->vertex_normals.push_back(std::numeric_limits<float>::quiet_NaN());
-        }
-        mesh->vertex_normals.shrink_to_fit();
-
-        if (load_materials) {
-            parse_tinyobj_material(materials[material_id], base_path, *this);
+        size_t texture_begin = textures.size();
+        textures.resize(texture_begin + texnames.size());
+        // Interned right away: the materials keep references to them.
+        parallel_for((int)texnames.size(), [&](int i) {
+            textures[texture_begin + i] =
+                asset_store().intern(create_texture_from_image(3, true, ColorSpace::sRGB, base_path / texnames[i]));
+        });
+        texture_names.insert(texture_names.end(), texnames.begin(), texnames.end());
+
+        bsdfs.reserve(bsdfs.size() + shapes.size());
+        for (int material_id : material_ids) {
+            const tinyobj::material_t &mat = materials[material_id];
+            const Texture *albedo_map = nullptr;
+            if (!mat.diffuse_texname.empty()) {
+                size_t index = std::find(texnames.begin(), texnames.end(), mat.diffuse_texname) - texnames.begin();
+                albedo_map = textures[texture_begin + index].get();
+            }
+            parse_tinyobj_material(mat, albedo_map, *this);
         }
-        meshes.push_back(std::move(mesh));
-        mesh_names.push_back(shape.name);
     }
 }
 
+// Legacy streamed format. Still readable, but write_to_binary writes the mapped format.
 constexpr const char *binary_mesh_asset_magic = "i_am_a_binary_mesh_asset";
+// Mapped format: every buffer (including the embree padding, see MeshData) starts at a 16-byte aligned file offset
+// so that a memory-mapped file can be handed to embree without copies.
+constexpr const char *mapped_mesh_asset_magic = "i_am_a_mapped_mesh_asset";
+static_assert(std::string_view(binary_mesh_asset_magic).size() == std::string_view(mapped_mesh_asset_magic).size());
+// Version 2 added the triangle order (see MeshData::reorder_for_locality), version 3 the motion blur steps (see
+// MeshData::motion_vertices). Older files are still readable.
+constexpr uint32_t mapped_mesh_asset_version = 3;
+constexpr size_t mapped_mesh_buffer_alignment = 16;
+
+struct MappedMeshHeader
+{
+    uint8_t twosided;
+    uint8_t use_smooth_normal;
+    uint8_t has_texcoord;
+    uint8_t has_vertex_normal;
+    uint32_t n_verts;
+    uint32_t n_tris;
+    uint32_t padding = 0;
+    // Byte offsets from the start of the file. 0 if the buffer does not exist.
+    uint64_t vertices_offset;
+    uint64_t texcoords_offset;
+    uint64_t vertex_normals_offset;
+    uint64_t indices_offset;
+    uint64_t triangle_order_offset;
+    // motion_step_count vertex buffers (same size and padding as vertices), back to back.
+    uint64_t motion_vertices_offset;
+    uint32_t motion_step_count;
+    uint32_t padding2 = 0;
+};
+// Without triangle_order_offset.
+constexpr size_t mapped_mesh_header_v1_size = offsetof(MappedMeshHeader, triangle_order_offset);
+// Without the motion steps.
+constexpr size_t mapped_mesh_header_v2_size = offsetof(MappedMeshHeader, motion_vertices_offset);
 
-void MeshAsset::load_from_binary(const fs::path &path)
+struct MappedMeshFileHeader
+{
+    std::array<char, std::string_view(mapped_mesh_asset_magic).size()> magic;
+    uint32_t version;
+    uint32_t n_meshes;
+};
+
+static void load_from_legacy_binary(BinaryReader &reader, MeshAsset &asset)
 {
-    BinaryReader reader(path);
-    std::array<char, std::string_view(binary_mesh_asset_magic).size() + 1> magic;
-    reader.read_array<char>(magic.data(), magic.size() - 1);
-    magic.back() = 0;
-    if (strcmp(magic.data(), binary_mesh_asset_magic)) {
-        ASSERT(false, "Invalid binary mesh asset.");
-        return;
-    }
     int n_meshes = reader.read<int>();
-    meshes.resize(n_meshes);
-    for (auto &mesh : meshes) {
+    asset.meshes.resize(n_meshes);
+    for (auto &mesh : asset.meshes) {
         mesh = std::make_unique<MeshData>();
         mesh->twosided = reader.read<bool>();
         mesh->use_smooth_normal = reader.read<bool>();
@@ -208,31 +275,165 @@ void MeshAsset::load_from_binary(const fs::path &path)
     }
 }
 
+template <typename T>
+static std::span<const T> mapped_buffer(const MappedFile &file, uint64_t offset, size_t count)
+{
+    if (offset == 0)
+        return {};
+    ASSERT(offset % mapped_mesh_buffer_alignment == 0 && offset + count * sizeof(T) <= file.size(),
+           "Corrupted mapped mesh asset.");
+    return {reinterpret_cast<const T *>(file.data() + offset), count};
+}
+
+void MeshAsset::load_from_binary(const fs::path &path, bool prefault)
+{
+    std::array<char, std::string_view(binary_mesh_asset_magic).size() + 1> magic;
+    {
+        BinaryReader reader(path);
+        reader.read_array<char>(magic.data(), magic.size() - 1);
+        magic.back() = 0;
+        if (!strcmp(magic.data(), binary_mesh_asset_magic)) {
+            load_from_legacy_binary(reader, *this);
+            return;
+        }
+    }
+    if (strcmp(magic.data(), mapped_mesh_asset_magic)) {
+        ASSERT(false, "Invalid binary mesh asset.");
+        return;
+    }
+
+    std::shared_ptr<const MappedFile> file = std::make_shared<MappedFile>(path);
+    ASSERT(file->size() >= sizeof(MappedMeshFileHeader), "Corrupted mapped mesh asset.");
+    // Mesh data is read by every node: fault the pages in from all of them rather than from the first ray's.
+    if (prefault)
+        numa_interleave_read(file->data(), file->size());
+    MappedMeshFileHeader file_header;
+    memcpy(&file_header, file->data(), sizeof(MappedMeshFileHeader));
+    if (file_header.version > mapped_mesh_asset_version || file_header.version == 0) {
+        ASSERT(false, "Unsupported mapped mesh asset version %u (expected %u).", file_header.version,
+               mapped_mesh_asset_version);
+        return;
+    }
+    size_t header_size = file_header.version == 1   ? mapped_mesh_header_v1_size
+                         : file_header.version == 2 ? mapped_mesh_header_v2_size
+                                                    : sizeof(MappedMeshHeader);
+    ASSERT(sizeof(MappedMeshFileHeader) + file_header.n_meshes * header_size <= file->size(),
+           "Corrupted mapped mesh asset.");
+    meshes.resize(file_header.n_meshes);
+    for (uint32_t i = 0; i < file_header.n_meshes; ++i) {
+        MappedMeshHeader header;
+        header.triangle_order_offset = 0;
+        header.motion_vertices_offset = 0;
+        header.motion_step_count = 0;
+        memcpy(&header, file->data() + sizeof(MappedMeshFileHeader) + i * header_size, header_size);
+        std::shared_ptr<MeshData> &mesh = meshes[i];
+        mesh = std::make_shared<MeshData>();
+        mesh->twosided = header.twosided;
+        mesh->use_smooth_normal = header.use_smooth_normal;
+        mesh->mapping = file;
+        mesh->mapped.vertices = mapped_buffer<float>(*file, header.vertices_offset, 3 * header.n_verts + 1);
+        mesh->mapped.indices = mapped_buffer<uint32_t>(*file, header.indices_offset, 3 * header.n_tris);
+        if (header.has_texcoord) {
+            mesh->mapped.texcoords = mapped_buffer<float>(*file, header.texcoords_offset, 2 * header.n_verts + 2);
+        }
+        if (header.has_vertex_normal) {
+            mesh->mapped.vertex_normals =
+                mapped_buffer<float>(*file, header.vertex_normals_offset, 3 * header.n_verts + 1);
+        }
+        mesh->mapped.triangle_order = mapped_buffer<uint32_t>(*file, header.triangle_order_offset, header.n_tris);
+        // Rare enough to just copy out of the mapping.
+        size_t step_size = 3 * header.n_verts + 1;
+        std::span<const float> steps =
+            mapped_buffer<float>(*file, header.motion_vertices_offset, header.motion_step_count * step_size);
+        for (uint32_t t = 0; t < header.motion_step_count; ++t) {
+            std::span<const float> step = steps.subspan(t * step_size, step_size);
+            mesh->motion_vertices.emplace_back(step.begin(), step.end());
+        }
+    }
+}
+
 void MeshAsset::write_to_binary(const fs::path &path) const
 {
+    MappedMeshFileHeader file_header;
+    std::copy_n(mapped_mesh_asset_magic, file_header.magic.size(), file_header.magic.begin());
+    file_header.version = mapped_mesh_asset_version;
+    file_header.n_meshes = (uint32_t)meshes.size();
+
+    // Lay out all buffers first so that the headers can be written in one go.
+    uint64_t offset = sizeof(MappedMeshFileHeader) + meshes.size() * sizeof(MappedMeshHeader);
+    auto place = [&](size_t bytes) {
+        constexpr uint64_t alignment = mapped_mesh_buffer_alignment;
+        offset = (offset + alignment - 1) / alignment * alignment;
+        uint64_t start = offset;
+        offset += bytes;
+        return start;
+    };
+    std::vector<MappedMeshHeader> headers(meshes.size());
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        const MeshData &mesh = *meshes[i];
+        ASSERT(!mesh.is_packed(), "Packed attributes can't be written to binary meshes.");
+        MappedMeshHeader &header = headers[i];
+        header.twosided = mesh.twosided;
+        header.use_smooth_normal = mesh.use_smooth_normal;
+        header.has_texcoord = mesh.has_texcoord();
+        header.has_vertex_normal = mesh.has_vertex_normal();
+        header.n_verts = (uint32_t)mesh.vertex_count();
+        header.n_tris = (uint32_t)mesh.tri_count();
+        header.vertices_offset = place(mesh.vertex_buffer().size_bytes());
+        header.indices_offset = place(mesh.index_buffer().size_bytes());
+        header.texcoords_offset = mesh.has_texcoord() ? place(mesh.texcoord_buffer().size_bytes()) : 0;
+        header.vertex_normals_offset = mesh.has_vertex_normal() ? place(mesh.vertex_normal_buffer().size_bytes()) : 0;
+        std::span<const uint32_t> triangle_order = mesh.triangle_order_buffer();
+        header.triangle_order_offset = triangle_order.empty() ? 0 : place(triangle_order.size_bytes());
+        header.motion_step_count = (uint32_t)mesh.motion_vertices.size();
+        header.motion_vertices_offset =
+            mesh.motion_vertices.empty() ? 0 : place(header.motion_step_count * mesh.vertex_buffer().size_bytes());
+    }
+
     BinaryWriter writer(path);
-    writer.write_array<char>(binary_mesh_asset_magic, strlen(binary_mesh_asset_magic));
-    writer.write<int>((int)meshes.size());
-    for (const auto &mesh : meshes) {
-        writer.write<bool>(mesh->twosided);
-        writer.write<bool>(mesh->use_smooth_normal);
-        writer.write<int>(mesh->vertex_count());
-        writer.write<int>(mesh->tri_count());
-        writer.write<bool>(mesh->has_texcoord());
-        writer.write<bool>(mesh->has_vertex_normal());
-        writer.write_array<float>(mesh->vertices.data(), mesh->vertices.size());
-        writer.write_array<uint32_t>(mesh->indices.data(), mesh->indices.size());
-        if (mesh->has_texcoord()) {
-            writer.write_array<float>(mesh->texcoords.data(), mesh->texcoords.size());
-        }
-        if (mesh->has_vertex_normal()) {
-            writer.write_array<float>(mesh->vertex_normals.data(), mesh->vertex_normals.size());
+    writer.write(file_header);
+    writer.write_array(headers.data(), headers.size());
+    uint64_t pos = sizeof(MappedMeshFileHeader) + meshes.size() * sizeof(MappedMeshHeader);
+    auto write_at = [&](uint64_t buffer_offset, const void *src, size_t bytes) {
+        static constexpr std::array<std::byte, mapped_mesh_buffer_alignment> zeros{};
+        ASSERT(buffer_offset >= pos && buffer_offset - pos < mapped_mesh_buffer_alignment);
+        writer.write(zeros.data(), buffer_offset - pos);
+        writer.write(src, bytes);
+        pos = buffer_offset + bytes;
+    };
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        const MeshData &mesh = *meshes[i];
+        const MappedMeshHeader &header = headers[i];
+        write_at(header.vertices_offset, mesh.vertex_buffer().data(), mesh.vertex_buffer().size_bytes());
+        write_at(header.indices_offset, mesh.index_buffer().data(), mesh.index_buffer().size_bytes());
+        if (mesh.has_texcoord()) {
+            write_at(header.texcoords_offset, mesh.texcoord_buffer().data(), mesh.texcoord_buffer().size_bytes());
+        }
+        if (mesh.has_vertex_normal()) {
+            write_at(header.vertex_normals_offset, mesh.vertex_normal_buffer().data(),
+                     mesh.vertex_normal_buffer().size_bytes());
+        }
+        if (header.triangle_order_offset) {
+            write_at(header.triangle_order_offset, mesh.triangle_order_buffer().data(),
+                     mesh.triangle_order_buffer().size_bytes());
+        }
+        for (size_t t = 0; t < mesh.motion_vertices.size(); ++t) {
+            const std::vector<float> &step = mesh.motion_vertices[t];
+            ASSERT(step.size() == mesh.vertex_buffer().size(), "Motion steps must have the same vertex count.");
+            // Steps are contiguous, so only the first one can need alignment padding.
+            write_at(t == 0 ? header.motion_vertices_offset : pos, step.data(), step.size() * sizeof(float));
         }
     }
 }
 
+void MeshAsset::dedup_meshes()
+{
+    parallel_for((int)meshes.size(), [&](int i) { meshes[i] = asset_store().intern(std::move(meshes[i])); });
+}
+
 std::unique_ptr<MeshAsset> create_mesh_asset(const ConfigArgs &args)
 {
+    ScopedStatTimer timer(stat_mesh_load);
     std::unique_ptr<MeshAsset> mesh_asset = std::make_unique<MeshAsset>();
     fs::path path = args.load_path("path");
     std::string fmt = args.load_string("format", "obj");
@@ -242,20 +443,74 @@ std::unique_ptr<MeshAsset> create_mesh_asset(const ConfigArgs &args)
         bool use_smooth_normal = args.load_bool("use_smooth_normal", true);
         mesh_asset->load_from_obj(path, load_materials, twosided, use_smooth_normal);
     } else if (fmt == "bin") {
-        mesh_asset->load_from_binary(path);
+        mesh_asset->load_from_binary(path, true);
     } else {
         ASSERT(false, "Unsupported mesh asset format [%s].", fmt.c_str());
     }
+    if (args.contains("motion_paths")) {
+        // Deformation motion blur: the same meshes (same format, order and topology) at later time steps, uniformly
+        // spaced over the shutter interval (see MeshData::motion_vertices).
+        ConfigArgs motion_args = args["motion_paths"];
+        for (int t = 0; t < (int)motion_args.array_size(); ++t) {
+            MeshAsset step_asset;
+            fs::path step_path = motion_args.load_path(t);
+            if (fmt == "obj") {
+                step_asset.load_from_obj(step_path, false, false, args.load_bool("use_smooth_normal", true));
+            } else {
+                step_asset.load_from_binary(step_path);
+            }
+            ASSERT(step_asset.meshes.size() == mesh_asset->meshes.size(),
+                   "Motion step [%s] has a different mesh count.", step_path.string().c_str());
+            for (size_t i = 0; i < mesh_asset->meshes.size(); ++i) {
+                std::span<const float> vertices = step_asset.meshes[i]->vertex_buffer();
+                ASSERT(vertices.size() == mesh_asset->meshes[i]->vertex_buffer().size(),
+                       "Motion step [%s] has a different vertex count.", step_path.string().c_str());
+                mesh_asset->meshes[i]->motion_vertices.emplace_back(vertices.begin(), vertices.end());
+            }
+        }
+    }
     Transform to_world = args.load_transform("to_world", Transform());
     if (!to_world.m.isIdentity()) {
         for (const auto &m : mesh_asset->meshes) {
             m->transform(to_world);
         }
     }
+    if (args.load_bool("compress_attributes", false)) {
+        for (const auto &m : mesh_asset->meshes) {
+            m->compress_attributes();
+        }
+    }
+    if (args.load_bool("dedup", true)) {
+        mesh_asset->dedup_meshes();
+    }
     return mesh_asset;
 }
 
-Scene create_scene_from_mesh_asset(const MeshAsset &mesh_asset, const EmbreeDevice &device)
+ConfigurableSnapshot mesh_asset_snapshot()
+{
+    ConfigurableSnapshot snapshot;
+    snapshot.write = [](const Configurable &asset, const fs::path &path) {
+        const MeshAsset &mesh_asset = dynamic_cast<const MeshAsset &>(asset);
+        if (!mesh_asset.materials.empty() || !mesh_asset.textures.empty())
+            return false;
+        for (const auto &m : mesh_asset.meshes) {
+            if (m->is_packed())
+                return false;
+        }
+        mesh_asset.write_to_binary(path);
+        return true;
+    };
+    snapshot.read = [](const fs::path &path) -> std::unique_ptr<Configurable> {
+        std::unique_ptr<MeshAsset> mesh_asset = std::make_unique<MeshAsset>();
+        mesh_asset->load_from_binary(path, true);
+        mesh_asset->dedup_meshes();
+        return mesh_asset;
+    };
+    return snapshot;
+}
+
+Scene create_scene_from_mesh_asset(const MeshAsset &mesh_asset, const EmbreeDevice &device,
+                                   const EmbreeBuildOptions &build_options)
 {
     SubScene subscene;
     for (const auto &m : mesh_asset.meshes) {
@@ -264,12 +519,12 @@ Scene create_scene_from_mesh_asset(const MeshAsset &mesh_asset, const EmbreeDevi
     for (const auto &m : mesh_asset.materials) {
         subscene.materials.push_back(&*m);
     }
-    subscene.create_rtc_scene(device);
+    subscene.create_rtc_scene(device, build_options);
 
     Scene scene;
     scene.add_subscene(std::move(subscene));
     scene.add_instance(device, 0, Transform());
-    scene.create_rtc_scene(device);
+    scene.create_rtc_scene(device, build_options);
 
     return scene;
 }
@@ -296,10 +551,25 @@ void convert_mesh_asset_task(const ConfigArgs &args, const fs::path &task_dir, i
         std::string asset_path = args["assets"].load_string(i);
         const MeshAsset *mesh_asset = args.asset_table().get<MeshAsset>(asset_path);
         std::string name = asset_path.substr(asset_path.rfind(".") + 1);
-        mesh_asset->write_to_binary(task_dir / (name + ".bin"));
+        if (args.load_bool("reorder", false)) {
+            // Only the meshes are written, so reorder copies of them.
+            MeshAsset reordered;
+            reordered.meshes.reserve(mesh_asset->meshes.size());
+            for (const auto &m : mesh_asset->meshes) {
+                auto mesh = std::make_unique<MeshData>(*m);
+                mesh->reorder_for_locality();
+                reordered.meshes.push_back(std::move(mesh));
+            }
+            reordered.write_to_binary(task_dir / (name + ".bin"));
+        } else {
+            mesh_asset->write_to_binary(task_dir / (name + ".bin"));
+        }
     }
 }
 
+// Large accessors are copied in parallel chunks.
+constexpr int accessor_copy_chunk_size = 1 << 14;
+
 void copy_accessor_to_linear(const tinygltf::Buffer &buf, const tinygltf::BufferView &view,
                              const tinygltf::Accessor &acc, uint8_t *dest)
 {
@@ -312,11 +582,16 @@ void copy_accessor_to_linear(const tinygltf::Buffer &buf, const tinygltf::Buffer
     int element_size_in_bytes = comp_size_in_bytes * num_comp;
 
     int stride = acc.ByteStride(view);
-    for (int i = 0; i < acc.count; ++i) {
-        std::copy(src, src + element_size_in_bytes, dest);
-        dest += element_size_in_bytes;
-        src += stride;
-    }
+    int count = (int)acc.count;
+    int num_chunks = (count + accessor_copy_chunk_size - 1) / accessor_copy_chunk_size;
+    parallel_for(num_chunks, [&](int chunk) {
+        int begin = chunk * accessor_copy_chunk_size;
+        int end = std::min(begin + accessor_copy_chunk_size, count);
+        for (int i = begin; i < end; ++i) {
+            const uint8_t *elem = src + (size_t)i * stride;
+            std::copy(elem, elem + element_size_in_bytes, dest + (size_t)i * element_size_in_bytes);
+        }
+    });
 }
 
 template <typename CastFn>
@@ -327,19 +602,19 @@ void copy_and_cast_accessor_to_linear(const tinygltf::Buffer &buf, const tinyglt
     const uint8_t *buf_data = buf.data.data();
     const uint8_t *src = buf_data + view.byteOffset + acc.byteOffset;
 
-    int comp_size_in_bytes = tinygltf::GetComponentSizeInBytes(static_cast<uint32_t>(acc.componentType));
-    int num_comp = tinygltf::GetNumComponentsInType(static_cast<uint32_t>(acc.type));
-    int element_size_in_bytes = comp_size_in_bytes * num_comp;
-
     int stride = acc.ByteStride(view);
-    VLA(after_cast, uint8_t, fn.cast_element_size_in_bytes);
-    for (int i = 0; i < acc.count; ++i) {
-        fn(src, after_cast);
-
-        std::copy(after_cast, after_cast + fn.cast_element_size_in_bytes, dest);
-        dest += fn.cast_element_size_in_bytes;
-        src += stride;
-    }
+    size_t dest_size = fn.cast_element_size_in_bytes;
+    int count = (int)acc.count;
+    int num_chunks = (count + accessor_copy_chunk_size - 1) / accessor_copy_chunk_size;
+    parallel_for(num_chunks, [&](int chunk) {
+        VLA(after_cast, uint8_t, dest_size);
+        int begin = chunk * accessor_copy_chunk_size;
+        int end = std::min(begin + accessor_copy_chunk_size, count);
+        for (int i = begin; i < end; ++i) {
+            fn(src + (size_t)i * stride, after_cast);
+            std::copy(after_cast, after_cast + dest_size, dest + (size_t)i * dest_size);
+        }
+    });
 }
 
 struct CastU16ToU32
@@ -373,91 +648,96 @@ void CompoundMeshAsset::load_from_gltf_binary(const fs::path &path, bool load_ma
     const std::vector<tinygltf::BufferView> &bufferviews = model.bufferViews;
     const std::vector<tinygltf::Accessor> &accessors = model.accessors;
 
+    // Flatten all primitives so that they are built in parallel regardless of how they are grouped into meshes.
+    std::vector<std::pair<int, int>> prim_list;
     prototypes.resize(src_meshes.size());
-    for (int i = 0; i < src_meshes.size(); ++i) {
-        MeshAsset mesh_asset;
-        const auto &primtives = src_meshes[i].primitives;
-        for (int j = 0; j < primtives.size(); ++j) {
-            MeshData mesh_data;
-
-            ASSERT(primtives[j].mode == TINYGLTF_MODE_TRIANGLES, "GLTF: Only support triangle primitives!");
-            const auto &acc_idx = accessors[primtives[j].indices];
-            ASSERT(acc_idx.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT ||
-                       acc_idx.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT,
-                   "GLTF: Unsupported index buffer component type!");
-            ASSERT(acc_idx.type == TINYGLTF_TYPE_SCALAR, "GLTF: Unsupport index buffer data type!");
-            ASSERT(acc_idx.count % 3 == 0);
-            mesh_data.indices.resize(acc_idx.count);
-            if (acc_idx.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) {
-                const auto &view = bufferviews[acc_idx.bufferView];
-                const auto &buf = buffers[view.buffer];
-                copy_accessor_to_linear(buf, view, acc_idx, reinterpret_cast<uint8_t *>(mesh_data.indices.data()));
-            } else {
-                const auto &view = bufferviews[acc_idx.bufferView];
-                const auto &buf = buffers[view.buffer];
-                copy_and_cast_accessor_to_linear<CastU16ToU32>(buf, view, acc_idx,
-                                                               reinterpret_cast<uint8_t *>(mesh_data.indices.data()));
-            }
+    for (int i = 0; i < (int)src_meshes.size(); ++i) {
+        int num_prims = (int)src_meshes[i].primitives.size();
+        prototypes[i].meshes.resize(num_prims);
+        for (int j = 0; j < num_prims; ++j) {
+            prim_list.push_back({i, j});
+        }
+    }
+    parallel_for((int)prim_list.size(), [&](int p) {
+        auto [i, j] = prim_list[p];
+        const tinygltf::Primitive &prim = src_meshes[i].primitives[j];
+        MeshData mesh_data;
+
+        ASSERT(prim.mode == TINYGLTF_MODE_TRIANGLES, "GLTF: Only support triangle primitives!");
+        const auto &acc_idx = accessors[prim.indices];
+        ASSERT(acc_idx.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT ||
+                   acc_idx.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT,
+               "GLTF: Unsupported index buffer component type!");
+        ASSERT(acc_idx.type == TINYGLTF_TYPE_SCALAR, "GLTF: Unsupport index buffer data type!");
+        ASSERT(acc_idx.count % 3 == 0);
+        mesh_data.indices.resize(acc_idx.count);
+        if (acc_idx.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) {
+            const auto &view = bufferviews[acc_idx.bufferView];
+            const auto &buf = buffers[view.buffer];
+            copy_accessor_to_linear(buf, view, acc_idx, reinterpret_cast<uint8_t *>(mesh_data.indices.data()));
+        } else {
+            const auto &view = bufferviews[acc_idx.bufferView];
+            const auto &buf = buffers[view.buffer];
+            copy_and_cast_accessor_to_linear<CastU16ToU32>(buf, view, acc_idx,
+                                                           reinterpret_cast<uint8_t *>(mesh_data.indices.data()));
+        }
+
+        auto it_pos = prim.attributes.find("POSITION");
+        ASSERT(it_pos != prim.attributes.end(), "GLTF primitive must have positions!");
+        const auto &acc_pos = accessors[it_pos->second];
+        ASSERT(acc_pos.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT,
+               "GLTF: Unsupported vertex position component type!");
+        ASSERT(acc_pos.type == TINYGLTF_TYPE_VEC3, "GLTF: Unsupport vertex position data type!");
+        // Add a dummy value to vertex buffer for embree padding.
+        mesh_data.vertices.resize(acc_pos.count * 3 + 1);
+        {
+            const auto &view = bufferviews[acc_pos.bufferView];
+            const auto &buf = buffers[view.buffer];
+            copy_accessor_to_linear(buf, view, acc_pos, reinterpret_cast<uint8_t *>(mesh_data.vertices.data()));
+        }
+
+        auto it_normal = prim.attributes.find("NORMAL");
+        bool has_normal = it_normal != prim.attributes.end();
+        if (has_normal) {
+            const auto &acc_normal = accessors[it_normal->second];
+            ASSERT(acc_normal.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT,
+                   "GLTF: Unsupported vertex normal component type!");
+            ASSERT(acc_normal.type == TINYGLTF_TYPE_VEC3, "GLTF: Unsupport vertex normal data type!");
 
-            auto it_pos = primtives[j].attributes.find("POSITION");
-            ASSERT(it_pos != primtives[j].attributes.end(), "GLTF primitive must have positions!");
-            const auto &acc_pos = accessors[it_pos->second];
-            ASSERT(acc_pos.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT,
-                   "GLTF: Unsupported vertex position component type!");
-            ASSERT(acc_pos.type == TINYGLTF_TYPE_VEC3, "GLTF: Unsupport vertex position data type!");
             // Add a dummy value to vertex buffer for embree padding.
-            mesh_data.vertices.resize(acc_pos.count * 3 + 1);
+            mesh_data.vertex_normals.resize(acc_normal.count * 3 + 1);
             {
-                const auto &view = bufferviews[acc_pos.bufferView];
+                const auto &view = bufferviews[acc_normal.bufferView];
                 const auto &buf = buffers[view.buffer];
-                copy_accessor_to_linear(buf, view, acc_pos, reinterpret_cast<uint8_t *>(mesh_data.vertices.data()));
-            }
-
-            auto it_normal = primtives[j].attributes.find("NORMAL");
-            bool has_normal = it_normal != primtives[j].attributes.end();
-            if (has_normal) {
-                const auto &acc_normal = accessors[it_normal->second];
-                ASSERT(acc_normal.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT,
-                       "GLTF: Unsupported vertex normal component type!");
-                ASSERT(acc_normal.type == TINYGLTF_TYPE_VEC3, "GLTF: Unsupport vertex normal data type!");
-
-                // Add a dummy value to vertex buffer for embree padding.
-                mesh_data.vertex_normals.resize(acc_normal.count * 3 + 1);
-                {
-                    const auto &view = bufferviews[acc_normal.bufferView];
-                    const auto &buf = buffers[view.buffer];
-                    copy_accessor_to_linear(buf, view, acc_normal,
-                                            reinterpret_cast<uint8_t *>(mesh_data.vertex_normals.data()));
-                }
+                copy_accessor_to_linear(buf, view, acc_normal,
+                                        reinterpret_cast<uint8_t *>(mesh_data.vertex_normals.data()));
             }
+        }
 
-            auto it_tc0 = primtives[j].attributes.find("TEXCOORD_0");
-            bool has_tc0 = it_tc0 != primtives[j].attributes.end();
-            if (has_tc0) {
-                const auto &acc_tc0 = accessors[it_tc0->second];
-                ASSERT(acc_tc0.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT,
-                       "GLTF: Unsupported texcoord component type!");
-                ASSERT(acc_tc0.type == TINYGLTF_TYPE_VEC2, "GLTF: Unsupport texcoord data type!");
-
-                // Add two dummy value to vertex buffer for embree padding.
-                mesh_data.texcoords.resize(acc_tc0.count * 2 + 2);
-                {
-                    const auto &view = bufferviews[acc_tc0.bufferView];
-                    const auto &buf = buffers[view.buffer];
-                    copy_accessor_to_linear(buf, view, acc_tc0,
-                                            reinterpret_cast<uint8_t *>(mesh_data.texcoords.data()));
-                }
-            }
+        auto it_tc0 = prim.attributes.find("TEXCOORD_0");
+        bool has_tc0 = it_tc0 != prim.attributes.end();
+        if (has_tc0) {
+            const auto &acc_tc0 = accessors[it_tc0->second];
+            ASSERT(acc_tc0.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT,
+                   "GLTF: Unsupported texcoord component type!");
+            ASSERT(acc_tc0.type == TINYGLTF_TYPE_VEC2, "GLTF: Unsupport texcoord data type!");
 
-            if (load_materials) {
-                // TODO:
-                // src_materials[primtives[j].material].
+            // Add two dummy value to vertex buffer for embree padding.
+            mesh_data.texcoords.resize(acc_tc0.count * 2 + 2);
+            {
+                const auto &view = bufferviews[acc_tc0.bufferView];
+                const auto &buf = buffers[view.buffer];
+                copy_accessor_to_linear(buf, view, acc_tc0, reinterpret_cast<uint8_t *>(mesh_data.texcoords.data()));
             }
+        }
 
-            mesh_asset.meshes.emplace_back(std::make_unique<MeshData>(std::move(mesh_data)));
+        if (load_materials) {
+            // TODO:
+            // src_materials[prim.material].
         }
-        prototypes[i] = std::move(mesh_asset);
-    }
+
+        prototypes[i].meshes[j] = std::make_unique<MeshData>(std::move(mesh_data));
+    });
 
     auto dfs_add_instance = [&](int node_idx, Transform transform, auto &self) -> void {
         const auto &node = model.nodes[node_idx];
@@ -507,12 +787,11 @@ void CompoundMeshAsset::load_from_gltf_binary(const fs::path &path, bool load_ma
         Transform transform;
         dfs_add_instance(root, transform, dfs_add_instance);
     }
-
-    return;
 }
 
 std::unique_ptr<CompoundMeshAsset> create_compound_mesh_asset(const ConfigArgs &args)
 {
+    ScopedStatTimer timer(stat_compound_mesh_load);
     std::unique_ptr<CompoundMeshAsset> compound = std::make_unique<CompoundMeshAsset>();
 
     fs::path path = args.load_path("path");
@@ -524,11 +803,48 @@ std::unique_ptr<CompoundMeshAsset> create_compound_mesh_asset(const ConfigArgs &
     } else {
         ASSERT(false, "Unsupported mesh asset format [%s].", fmt.c_str());
     }
+    if (args.contains("groups")) {
+        // [[groups]] with instances = [{prototype, to_world}] and groups = [{group, to_world}] of earlier groups.
+        auto load_list = [](const ConfigArgs &list, std::string_view key, uint32_t limit,
+                            std::vector<std::pair<uint32_t, Transform>> &out) {
+            for (int i = 0; i < (int)list.array_size(); ++i) {
+                uint32_t id = (uint32_t)list[i].load_integer(key);
+                ASSERT(id < limit, "Invalid %s [%u].", std::string(key).c_str(), id);
+                out.push_back({id, list[i].load_transform("to_world")});
+            }
+        };
+        ConfigArgs group_args = args["groups"];
+        compound->groups.resize(group_args.array_size());
+        for (int g = 0; g < (int)compound->groups.size(); ++g) {
+            CompoundMeshAsset::Group &group = compound->groups[g];
+            if (group_args[g].contains("instances"))
+                load_list(group_args[g]["instances"], "prototype", (uint32_t)compound->prototypes.size(),
+                          group.instances);
+            if (group_args[g].contains("groups"))
+                load_list(group_args[g]["groups"], "group", (uint32_t)g, group.groups);
+        }
+        if (args.contains("group_instances"))
+            load_list(args["group_instances"], "group", (uint32_t)compound->groups.size(), compound->group_instances);
+    }
+    if (args.load_bool("compress_attributes", false)) {
+        for (MeshAsset &prototype : compound->prototypes) {
+            for (const auto &m : prototype.meshes) {
+                m->compress_attributes();
+            }
+        }
+    }
+    // Kits often repeat the same primitives under different meshes.
+    if (args.load_bool("dedup", true)) {
+        for (MeshAsset &prototype : compound->prototypes) {
+            prototype.dedup_meshes();
+        }
+    }
 
     return compound;
 }
 
-Scene create_scene_from_compound_mesh_asset(const CompoundMeshAsset &compound, const EmbreeDevice &device)
+Scene create_scene_from_compound_mesh_asset(const CompoundMeshAsset &compound, const EmbreeDevice &device,
+                                            const EmbreeBuildOptions &build_options)
 {
     Scene scene;
     for (const auto &p : compound.prototypes) {
@@ -541,14 +857,26 @@ Scene create_scene_from_compound_mesh_asset(const CompoundMeshAsset &compound, c
         for (const auto &m : p.materials) {
             subscene.materials.push_back(&*m);
         }
-        subscene.create_rtc_scene(device);
         scene.add_subscene(std::move(subscene));
     }
-    scene.instances.reserve(compound.instances.size());
+    scene.create_subscene_rtc_scenes(device, build_options);
+    for (const CompoundMeshAsset::Group &group : compound.groups) {
+        uint32_t group_id = scene.add_instance_group(device);
+        for (const auto &[prototype, transform] : group.instances) {
+            scene.add_group_member(device, group_id, prototype, false, transform);
+        }
+        for (const auto &[nested, transform] : group.groups) {
+            scene.add_group_member(device, group_id, nested, true, transform);
+        }
+    }
+    scene.instances.reserve(compound.instances.size() + compound.group_instances.size());
     for (const auto &[prototype, transform] : compound.instances) {
         scene.add_instance(device, prototype, transform);
     }
-    scene.create_rtc_scene(device);
+    for (const auto &[group_id, transform] : compound.group_instances) {
+        scene.add_group_instance(device, group_id, transform);
+    }
+    scene.create_rtc_scene(device, build_options);
     return scene;
 }
 
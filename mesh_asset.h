@@ -16,13 +16,18 @@ struct MeshAsset : public Configurable
 {
     // TODO: a smarter way to specify twosided
     void load_from_obj(const fs::path &path, bool load_materials, bool twosided, bool use_smooth_normal);
-    void load_from_binary(const fs::path &path);
+    // With prefault, the pages of a mapped asset are faulted in up front, interleaved over the NUMA nodes (see
+    // numa_interleave_read). Only worth it for assets that stay resident and are read by every node.
+    void load_from_binary(const fs::path &path, bool prefault = false);
     void write_to_binary(const fs::path &path) const;
+    // Replace the meshes with shared copies of identical content from asset_store(). Call after modifying them.
+    void dedup_meshes();
 
-    std::vector<std::unique_ptr<MeshData>> meshes;
+    // Meshes and textures may be shared with other assets (see AssetStore).
+    std::vector<std::shared_ptr<MeshData>> meshes;
     std::vector<std::unique_ptr<Material>> materials;
     std::vector<std::unique_ptr<BSDF>> bsdfs;
-    std::vector<std::unique_ptr<Texture>> textures;
+    std::vector<std::shared_ptr<Texture>> textures;
 
     std::vector<std::string> mesh_names;
     std::vector<std::string> material_names;
@@ -30,9 +35,13 @@ struct MeshAsset : public Configurable
 };
 
 std::unique_ptr<MeshAsset> create_mesh_asset(const ConfigArgs &args);
+// Snapshots mesh assets in the mapped binary format, so that later launches map them instead of parsing.
+// Assets with materials or packed attributes are not snapshotted.
+ConfigurableSnapshot mesh_asset_snapshot();
 
 // Convenient function: create a scene from a single mesh asset.
-Scene create_scene_from_mesh_asset(const MeshAsset &mesh_asset, const EmbreeDevice &device);
+Scene create_scene_from_mesh_asset(const MeshAsset &mesh_asset, const EmbreeDevice &device,
+                                   const EmbreeBuildOptions &build_options = {});
 void assign_material_list(Scene &scene, const ConfigArgs &args_materials);
 
 struct CompoundMeshAsset : public Configurable
@@ -41,9 +50,21 @@ struct CompoundMeshAsset : public Configurable
 
     std::vector<MeshAsset> prototypes;
     std::vector<std::pair<uint32_t, Transform>> instances;
+
+    // Optional prototype hierarchy, kept as instance groups in the scene (see InstanceGroup) instead of flattened.
+    struct Group
+    {
+        std::vector<std::pair<uint32_t, Transform>> instances;
+        // Of earlier groups.
+        std::vector<std::pair<uint32_t, Transform>> groups;
+    };
+    std::vector<Group> groups;
+    // Top-level instances of groups, next to the flat instances.
+    std::vector<std::pair<uint32_t, Transform>> group_instances;
 };
 
 std::unique_ptr<CompoundMeshAsset> create_compound_mesh_asset(const ConfigArgs &args);
-Scene create_scene_from_compound_mesh_asset(const CompoundMeshAsset &compound, const EmbreeDevice &device);
+Scene create_scene_from_compound_mesh_asset(const CompoundMeshAsset &compound, const EmbreeDevice &device,
+                                            const EmbreeBuildOptions &build_options = {});
 
 } // namespace ks
\ No newline at end of file
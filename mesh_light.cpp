@@ -0,0 +1,250 @@
+#include "mesh_light.h"
+#include "geometry.h"
+#include "material.h"
+#include "scene.h"
+
+namespace ks
+{
+
+// Spherical triangle sampling is unstable for tiny (far) or huge (close to the shading point) solid angles.
+static constexpr float min_sampling_solid_angle = 3e-4f;
+static constexpr float max_sampling_solid_angle = two_pi - 0.06f;
+
+static vec3 gram_schmidt(const vec3 &v, const vec3 &w) { return v - v.dot(w) * w; }
+
+// Solid angle of the triangle seen from p (Van Oosterom and Strackee 83).
+static float spherical_triangle_area(const vec3 &a, const vec3 &b, const vec3 &c)
+{
+    return std::abs(2.0f * std::atan2(a.dot(b.cross(c)), 1.0f + a.dot(b) + a.dot(c) + b.dot(c)));
+}
+
+// Arvo 95, as in pbrt-v4. a, b, c are the normalized directions to the vertices. Returns false if degenerate.
+static bool sample_spherical_triangle(const vec3 &a, const vec3 &b, const vec3 &c, const vec2 &u, vec3 &w)
+{
+    vec3 n_ab = a.cross(b);
+    vec3 n_bc = b.cross(c);
+    vec3 n_ca = c.cross(a);
+    if (n_ab.squaredNorm() == 0.0f || n_bc.squaredNorm() == 0.0f || n_ca.squaredNorm() == 0.0f)
+        return false;
+    n_ab.normalize();
+    n_bc.normalize();
+    n_ca.normalize();
+    float alpha = angle_between(n_ab, -n_ca);
+    float beta = angle_between(n_bc, -n_ab);
+    float gamma = angle_between(n_ca, -n_bc);
+
+    // Sample the sub-triangle area, which determines the vertex c' on the arc ac.
+    float A_pi = alpha + beta + gamma;
+    float Ap_pi = std::lerp(pi, A_pi, u.x());
+    float cos_alpha = std::cos(alpha);
+    float sin_alpha = std::sin(alpha);
+    float sin_phi = std::sin(Ap_pi) * cos_alpha - std::cos(Ap_pi) * sin_alpha;
+    float cos_phi = std::cos(Ap_pi) * cos_alpha + std::sin(Ap_pi) * sin_alpha;
+    float k1 = cos_phi + cos_alpha;
+    float k2 = sin_phi - sin_alpha * a.dot(b);
+    float cos_bp = (k2 + (k2 * cos_phi - k1 * sin_phi) * cos_alpha) / ((k2 * sin_phi + k1 * cos_phi) * sin_alpha);
+    cos_bp = std::clamp(cos_bp, -1.0f, 1.0f);
+    float sin_bp = safe_sqrt(1.0f - sqr(cos_bp));
+    vec3 cp = cos_bp * a + sin_bp * gram_schmidt(c, a).normalized();
+
+    // Then a point on the arc bc'.
+    float cos_theta = 1.0f - u.y() * (1.0f - cp.dot(b));
+    float sin_theta = safe_sqrt(1.0f - sqr(cos_theta));
+    w = (cos_theta * b + sin_theta * gram_schmidt(cp, b).normalized()).normalized();
+    return w.allFinite();
+}
+
+MeshLight::MeshLight(const MeshData &mesh, const Transform &to_world, const color3 &L, const EmbreeDevice &device)
+    : L(L), twosided(mesh.twosided)
+{
+    int n_verts = mesh.vertex_count();
+    vertices.resize(3 * n_verts + 1, 0.0f);
+    for (int i = 0; i < n_verts; ++i) {
+        vec3 p = to_world.point(mesh.get_pos(i));
+        vertices[3 * i] = p.x();
+        vertices[3 * i + 1] = p.y();
+        vertices[3 * i + 2] = p.z();
+        box.expand(p);
+    }
+    std::span<const uint32_t> index_buffer = mesh.index_buffer();
+    indices.assign(index_buffer.begin(), index_buffer.end());
+
+    uint32_t n_tris = tri_count();
+    normals.resize(n_tris);
+    areas.resize(n_tris);
+    for (uint32_t t = 0; t < n_tris; ++t) {
+        auto [v0, v1, v2] = triangle(t);
+        // Same orientation as the embree geometric normal (and Intersection::frame after transform_it).
+        normals[t] = (v1 - v0).cross(v2 - v0);
+        areas[t] = 0.5f * normals[t].norm();
+        total_area += areas[t];
+    }
+    distrib = DistribTable(areas.data(), n_tris);
+
+    rtcscene = rtcNewScene(device);
+    RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+    rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, vertices.data(), 0,
+                               3 * sizeof(float), n_verts);
+    rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, indices.data(), 0,
+                               3 * sizeof(uint32_t), n_tris);
+    rtcCommitGeometry(geom);
+    rtcAttachGeometry(rtcscene, geom);
+    rtcReleaseGeometry(geom);
+    rtcCommitScene(rtcscene);
+}
+
+MeshLight::~MeshLight()
+{
+    if (rtcscene)
+        rtcReleaseScene(rtcscene);
+}
+
+std::array<vec3, 3> MeshLight::triangle(uint32_t tri) const
+{
+    std::array<vec3, 3> v;
+    for (int i = 0; i < 3; ++i) {
+        const float *p = &vertices[3 * indices[3 * tri + i]];
+        v[i] = vec3(p[0], p[1], p[2]);
+    }
+    return v;
+}
+
+bool MeshLight::intersect(const vec3 &p_shade, const vec3 &wi, uint32_t &tri, float &t) const
+{
+    // The shading point may lie on the light itself.
+    float tnear = 1e-5f * (1.0f + p_shade.cwiseAbs().maxCoeff());
+    RTCRayHit rayhit = spawn_rtcrayhit(p_shade, wi, tnear, inf);
+    if (!intersect1(rtcscene, rayhit))
+        return false;
+    tri = rayhit.hit.primID;
+    t = rayhit.ray.tfar;
+    return true;
+}
+
+float MeshLight::direction_pdf(uint32_t tri, const vec3 &p_shade, const vec3 &wi, float t) const
+{
+    auto [v0, v1, v2] = triangle(tri);
+    vec3 a = (v0 - p_shade).normalized();
+    vec3 b = (v1 - p_shade).normalized();
+    vec3 c = (v2 - p_shade).normalized();
+    float solid_angle = spherical_triangle_area(a, b, c);
+    if (solid_angle >= min_sampling_solid_angle && solid_angle <= max_sampling_solid_angle)
+        return 1.0f / solid_angle;
+    float cos = std::abs(normals[tri].normalized().dot(wi));
+    if (cos == 0.0f)
+        return 0.0f;
+    return sqr(t) / (areas[tri] * cos);
+}
+
+color3 MeshLight::eval_with_distance(const vec3 &p_shade, const vec3 &wi, float &dist) const
+{
+    uint32_t tri;
+    if (!intersect(p_shade, wi, tri, dist))
+        return color3::Zero();
+    if (!twosided && normals[tri].dot(wi) >= 0.0f)
+        return color3::Zero();
+    return L;
+}
+
+color3 MeshLight::eval(const vec3 &p_shade, const vec3 &wi) const
+{
+    float dist;
+    return eval_with_distance(p_shade, wi, dist);
+}
+
+color3 MeshLight::sample_with_distance(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf, float &dist) const
+{
+    pdf = 0.0f;
+    float prob;
+    uint32_t tri = distrib.sample(u.x(), prob);
+    if (prob == 0.0f)
+        return color3::Zero();
+    // Reuse the sample within the chosen triangle.
+    vec2 u_tri(std::min((u.x() - distrib.cdf[tri]) / prob, std::nextafter(1.0f, 0.0f)), u.y());
+
+    auto [v0, v1, v2] = triangle(tri);
+    const vec3 &ng = normals[tri];
+    vec3 a = (v0 - p_shade).normalized();
+    vec3 b = (v1 - p_shade).normalized();
+    vec3 c = (v2 - p_shade).normalized();
+    float solid_angle = spherical_triangle_area(a, b, c);
+    if (solid_angle >= min_sampling_solid_angle && solid_angle <= max_sampling_solid_angle &&
+        sample_spherical_triangle(a, b, c, u_tri, wi)) {
+        float denom = ng.dot(wi);
+        if (denom == 0.0f)
+            return color3::Zero();
+        dist = ng.dot(v0 - p_shade) / denom;
+        pdf = 1.0f / solid_angle;
+    } else {
+        float su0 = std::sqrt(u_tri.x());
+        float b0 = 1.0f - su0;
+        float b1 = u_tri.y() * su0;
+        vec3 p = b0 * v0 + b1 * v1 + (1.0f - b0 - b1) * v2;
+        wi = p - p_shade;
+        dist = wi.norm();
+        if (dist == 0.0f)
+            return color3::Zero();
+        wi /= dist;
+        float cos = std::abs(ng.normalized().dot(wi));
+        if (cos == 0.0f)
+            return color3::Zero();
+        pdf = sqr(dist) / (areas[tri] * cos);
+    }
+    if (!(dist > 0.0f) || !std::isfinite(pdf) || (!twosided && ng.dot(wi) >= 0.0f)) {
+        pdf = 0.0f;
+        return color3::Zero();
+    }
+    pdf *= prob;
+    return L / pdf;
+}
+
+color3 MeshLight::sample(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf) const
+{
+    float dist;
+    return sample_with_distance(p_shade, u, wi, pdf, dist);
+}
+
+float MeshLight::pdf(const vec3 &p_shade, const vec3 &wi) const
+{
+    uint32_t tri;
+    float t;
+    if (!intersect(p_shade, wi, tri, t))
+        return 0.0f;
+    // NOTE: the first triangle along wi may not be the sampled one (a closed mesh, or overlapping triangles). The
+    // unbiased pdf would sum over all triangles along wi, but sampling occluded triangles only adds zero shadow rays.
+    return distrib.pdf(tri) / (float)tri_count() * direction_pdf(tri, p_shade, wi, t);
+}
+
+float MeshLight::power(const AABB3 &scene_bound) const
+{
+    return luminance(L) * pi * total_area * (twosided ? 2.0f : 1.0f);
+}
+
+std::vector<std::unique_ptr<MeshLight>> create_mesh_lights(const Scene &scene, const EmbreeDevice &device)
+{
+    // NOTE: lights are built at the instance transforms, so motion blurred and updated instances aren't tracked.
+    std::vector<std::unique_ptr<MeshLight>> lights;
+    scene.for_each_subscene_instance([&](const SubSceneInstance &instance, const Transform &to_world) {
+        const SubScene &subscene = *scene.subscenes[instance.prototype];
+        for (uint32_t geom_id = 0; geom_id < (uint32_t)subscene.geometries.size(); ++geom_id) {
+            const MeshGeometry *mesh = dynamic_cast<const MeshGeometry *>(subscene.geometries[geom_id].get());
+            if (!mesh || geom_id >= subscene.materials.size() || !subscene.materials[geom_id])
+                continue;
+            const color3 &L = subscene.materials[geom_id]->emission;
+            if ((L <= 0.0f).all() || mesh->data->tri_count() == 0)
+                continue;
+            lights.push_back(std::make_unique<MeshLight>(*mesh->data, to_world, L, device));
+        }
+    });
+    return lights;
+}
+
+color3 emitted_radiance(const SceneHit &hit, const vec3 &wo)
+{
+    // The geometric normal is already flipped towards wo if the mesh is twosided.
+    if (!hit.material || hit.it.frame.n.dot(wo) <= 0.0f)
+        return color3::Zero();
+    return hit.material->emission;
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+#include "distrib.h"
+#include "embree_util.h"
+#include "light.h"
+#include <memory>
+#include <vector>
+
+namespace ks
+{
+
+struct MeshData;
+struct Scene;
+struct SceneHit;
+
+// Area light of an emissive triangle mesh (see Material::emission) in world space. Radiance is emitted from the front
+// side (the side of the geometric normal) unless the mesh is twosided.
+// A triangle is picked by power, then a direction in its solid angle (spherical triangle sampling, Arvo 95). Triangles
+// that subtend too small or too large solid angles for that to be stable are sampled by area instead.
+struct MeshLight : public Light
+{
+    MeshLight(const MeshData &mesh, const Transform &to_world, const color3 &L, const EmbreeDevice &device);
+    ~MeshLight();
+    MeshLight(const MeshLight &) = delete;
+    MeshLight &operator=(const MeshLight &) = delete;
+
+    bool delta_position() const { return false; }
+    bool delta_direction() const { return false; }
+    color3 eval(const vec3 &p_shade, const vec3 &wi) const;
+    // NOTE: return throughput weight: (L / pdf)
+    color3 sample(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf) const;
+    float pdf(const vec3 &p_shade, const vec3 &wi) const;
+    color3 eval_with_distance(const vec3 &p_shade, const vec3 &wi, float &dist) const;
+    color3 sample_with_distance(const vec3 &p_shade, const vec2 &u, vec3 &wi, float &pdf, float &dist) const;
+    AABB3 bound() const { return box; }
+    float power(const AABB3 &scene_bound) const;
+
+    uint32_t tri_count() const { return (uint32_t)indices.size() / 3; }
+    std::array<vec3, 3> triangle(uint32_t tri) const;
+    // Solid angle pdf of wi, given that the ray (p_shade, wi) hits tri first at distance t.
+    float direction_pdf(uint32_t tri, const vec3 &p_shade, const vec3 &wi, float t) const;
+    // First triangle of this light along the ray, or false if there is none.
+    bool intersect(const vec3 &p_shade, const vec3 &wi, uint32_t &tri, float &t) const;
+
+    // World space, with the embree padding (see MeshData).
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    // Unnormalized geometric normals (the emitting side).
+    std::vector<vec3> normals;
+    std::vector<float> areas;
+    // Over triangles, proportional to area (the radiance is constant).
+    DistribTable distrib;
+    float total_area = 0.0f;
+    color3 L;
+    bool twosided = false;
+    AABB3 box;
+    RTCScene rtcscene = nullptr;
+};
+
+// One light per instance of each emissive mesh geometry of the scene (at the static instance transforms).
+std::vector<std::unique_ptr<MeshLight>> create_mesh_lights(const Scene &scene, const EmbreeDevice &device);
+
+// Radiance emitted by the surface of hit towards wo (zero if its material isn't emissive). For camera rays: after the
+// first bounce, emitters are accounted for by NEE.
+color3 emitted_radiance(const SceneHit &hit, const vec3 &wo);
+
+} // namespace ks
\ No newline at end of file
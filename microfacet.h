@@ -151,6 +151,87 @@ struct GGX : public MicrofacetDistribution
     static constexpr float min_alpha = 1e-3f;
 };
 
+// Batched GGX for SoA inputs (one lane per element). The per-lane functions replace branches with selects so the
+// array loops below can be auto-vectorized (and map 1:1 to ISPC varyings). Each lane computes the same value as
+// GGX(ax, ay).D / lambda / G1 / G2, including the alpha clamping done by the GGX constructors.
+struct GGXBatch
+{
+    static float clamp_alpha(float alpha) { return std::clamp(alpha, GGX::min_alpha, 1.0f); }
+
+    static float D(float ax, float ay, float hx, float hy, float hz)
+    {
+        ax = clamp_alpha(ax);
+        ay = clamp_alpha(ay);
+        float a2 = ax * ax;
+        float t_iso = 1.0f + (a2 - 1.0f) * hz * hz;
+        float D_iso = a2 / (pi * t_iso * t_iso);
+        float sx = hx / ax;
+        float sy = hy / ay;
+        float t_aniso = sqr(sx) + sqr(sy) + sqr(hz);
+        float D_aniso = 1.0f / (pi * ax * ay * sqr(t_aniso));
+        float D = ax == ay ? D_iso : D_aniso;
+        return hz <= 0.0f ? 0.0f : D;
+    }
+
+    static float lambda(float ax, float ay, float wx, float wy, float wz)
+    {
+        ax = clamp_alpha(ax);
+        ay = clamp_alpha(ay);
+        float inv_sin_theta2 = 1.0f / (1.0f - wz * wz);
+        float cos_phi2 = wx * wx * inv_sin_theta2;
+        float sin_phi2 = wy * wy * inv_sin_theta2;
+        float alpha_aniso = std::sqrt(cos_phi2 * ax * ax + sin_phi2 * ay * ay);
+        float alpha = ax == ay ? ax : alpha_aniso;
+        float alpha2 = alpha * alpha;
+        float NdotV2 = wz * wz;
+        float t = (1.0f - NdotV2) * alpha2 / NdotV2;
+        float lambda = 0.5f * (-1.0f + std::sqrt(1.0f + t));
+        return std::abs(wz) >= 1.0f ? 0.0f : lambda;
+    }
+
+    static float G1(float lambda) { return 1.0f / (1.0f + lambda); }
+
+    // NOTE: the transmission case needs std::beta, which does not vectorize. Keep it out of hot loops when possible.
+    static float G2(float lambda_o, float lambda_i, bool same_side)
+    {
+        if (same_side)
+            return 1.0f / (1.0f + lambda_o + lambda_i);
+        return (float)std::beta(1.0f + lambda_o, 1.0f + lambda_i);
+    }
+
+    static void D_n(int n, const float *ax, const float *ay, const float *hx, const float *hy, const float *hz,
+                    float *D_out)
+    {
+        for (int i = 0; i < n; ++i)
+            D_out[i] = D(ax[i], ay[i], hx[i], hy[i], hz[i]);
+    }
+
+    static void lambda_n(int n, const float *ax, const float *ay, const float *wx, const float *wy, const float *wz,
+                         float *lambda_out)
+    {
+        for (int i = 0; i < n; ++i)
+            lambda_out[i] = lambda(ax[i], ay[i], wx[i], wy[i], wz[i]);
+    }
+
+    static void G1_n(int n, const float *lambda, float *G1_out)
+    {
+        for (int i = 0; i < n; ++i)
+            G1_out[i] = G1(lambda[i]);
+    }
+
+    static void G2_n(int n, const float *lambda_o, const float *lambda_i, const float *wo_z, const float *wi_z,
+                     float *G2_out)
+    {
+        // Vectorizable pass first, then patch the (usually few) transmission lanes.
+        for (int i = 0; i < n; ++i)
+            G2_out[i] = 1.0f / (1.0f + lambda_o[i] + lambda_i[i]);
+        for (int i = 0; i < n; ++i) {
+            if (wo_z[i] * wi_z[i] < 0.0f)
+                G2_out[i] = G2(lambda_o[i], lambda_i[i], false);
+        }
+    }
+};
+
 static void BeckmannSample11(float cosThetaI, float U1, float U2, float *slope_x, float *slope_y)
 {
     /* Special case (normal incidence) */
@@ -221,10 +302,10 @@ static void BeckmannSample11(float cosThetaI, float U1, float U2, float *slope_x
     /* Simulate Y component */
     *slope_y = erfinv(2.0f * std::max(U2, (float)1e-6f) - 1.0f);
 
-    ASSERT(!std::isinf(*slope_x));
-    ASSERT(!std::isnan(*slope_x));
-    ASSERT(!std::isinf(*slope_y));
-    ASSERT(!std::isnan(*slope_y));
+    ASSERT_HOT(!std::isinf(*slope_x));
+    ASSERT_HOT(!std::isnan(*slope_x));
+    ASSERT_HOT(!std::isinf(*slope_y));
+    ASSERT_HOT(!std::isnan(*slope_y));
 }
 
 static vec3 BeckmannSample(const vec3 &wi, float alpha_x, float alpha_y, float U1, float U2)
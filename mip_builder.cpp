@@ -0,0 +1,209 @@
+#include "mip_builder.h"
+#include "assertion.h"
+#include "parallel.h"
+#include "texture_codec.h"
+#include <cmath>
+#include <cstring>
+
+namespace ks
+{
+
+// Per output coordinate: the first input coordinate and taps weights (indices clamped to the edge).
+struct MipWeights
+{
+    int taps = 0;
+    std::vector<int> start;
+    std::vector<float> weights;
+};
+
+// Zeroth order modified Bessel function of the first kind.
+static float bessel_i0(float x)
+{
+    float sum = 1.0f;
+    float term = 1.0f;
+    for (int k = 1; k < 16; ++k) {
+        term *= sqr(x / (2.0f * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// Windowed sinc with the given radius in output texels.
+static float kaiser_sinc(float t, float radius)
+{
+    constexpr float alpha = 4.0f;
+    float x = t / radius;
+    if (std::abs(x) >= 1.0f)
+        return 0.0f;
+    float window = bessel_i0(alpha * std::sqrt(1.0f - x * x)) / bessel_i0(alpha);
+    float sinc = t == 0.0f ? 1.0f : std::sin(pi * t) / (pi * t);
+    return sinc * window;
+}
+
+static MipWeights mip_weights(int src, int dst, MipFilter filter)
+{
+    MipWeights w;
+    w.start.resize(dst);
+    if (src == 1) {
+        w.taps = 1;
+        w.weights.assign(dst, 1.0f);
+        return w;
+    }
+    if (filter == MipFilter::Box) {
+        bool round_up = (src == 2 * dst - 1);
+        w.taps = round_up ? 3 : 2;
+        w.weights.resize(dst * w.taps);
+        for (int x = 0; x < dst; ++x) {
+            float *weights = &w.weights[x * w.taps];
+            if (round_up) {
+                w.start[x] = 2 * x - 1;
+                weights[0] = (float)x / (float)src;
+                weights[1] = (float)dst / (float)src;
+                weights[2] = (float)(dst - x - 1) / (float)src;
+            } else {
+                w.start[x] = 2 * x;
+                weights[0] = weights[1] = 0.5f;
+            }
+        }
+        return w;
+    }
+
+    constexpr float radius = 2.0f;
+    float scale = (float)src / (float)dst;
+    w.taps = (int)std::ceil(2.0f * radius * scale) + 1;
+    w.weights.resize(dst * w.taps);
+    for (int x = 0; x < dst; ++x) {
+        float center = ((float)x + 0.5f) * scale - 0.5f;
+        w.start[x] = (int)std::floor(center - radius * scale) + 1;
+        float *weights = &w.weights[x * w.taps];
+        float sum = 0.0f;
+        for (int k = 0; k < w.taps; ++k) {
+            weights[k] = kaiser_sinc(((float)(w.start[x] + k) - center) / scale, radius);
+            sum += weights[k];
+        }
+        for (int k = 0; k < w.taps; ++k)
+            weights[k] /= sum;
+    }
+    return w;
+}
+
+static void row_to_float(const std::byte *src, int n, TextureDataType data_type, float *dst)
+{
+    switch (data_type) {
+    case TextureDataType::u8: {
+        const uint8_t *u8_data = reinterpret_cast<const uint8_t *>(src);
+        for (int i = 0; i < n; ++i)
+            dst[i] = (float)u8_data[i] / 255.0f;
+        break;
+    }
+    case TextureDataType::f16: {
+        const uint16_t *f16_data = reinterpret_cast<const uint16_t *>(src);
+        for (int i = 0; i < n; ++i)
+            dst[i] = half_to_float(f16_data[i]);
+        break;
+    }
+    case TextureDataType::f32:
+    default: {
+        std::memcpy(dst, src, n * sizeof(float));
+        break;
+    }
+    }
+}
+
+static void texel_from_float(const float *src, int num_channels, TextureDataType data_type, std::byte *dst)
+{
+    switch (data_type) {
+    case TextureDataType::u8: {
+        uint8_t *u8_data = reinterpret_cast<uint8_t *>(dst);
+        for (int c = 0; c < num_channels; ++c)
+            u8_data[c] = (uint8_t)std::floor(std::clamp(src[c], 0.0f, 1.0f) * 255.0f);
+        break;
+    }
+    case TextureDataType::f16: {
+        uint16_t *f16_data = reinterpret_cast<uint16_t *>(dst);
+        for (int c = 0; c < num_channels; ++c)
+            f16_data[c] = float_to_half(src[c]);
+        break;
+    }
+    case TextureDataType::f32:
+    default: {
+        std::memcpy(dst, src, num_channels * sizeof(float));
+        break;
+    }
+    }
+}
+
+std::vector<TextureMip> build_mips(const std::byte *level0, int width, int height, int num_channels,
+                                                TextureDataType data_type, MipFilter filter)
+{
+    ASSERT(!is_block_compressed(data_type), "Build mips before block compression.");
+    int levels = 1 + (int)std::ceil(std::log2(std::max(width, height)));
+    int stride = texture_element_bytes(data_type, num_channels);
+    int nc = num_channels;
+    std::vector<TextureMip> mips;
+    mips.reserve(levels - 1);
+
+    // Float rows of the previous level (except level 0, which is converted on the fly).
+    std::vector<float> prev;
+    std::vector<float> cur;
+    int src_w = width;
+    int src_h = height;
+    for (int l = 1; l < levels; ++l) {
+        int dst_w = std::max(1, (src_w + 1) / 2);
+        int dst_h = std::max(1, (src_h + 1) / 2);
+        MipWeights wx = mip_weights(src_w, dst_w, filter);
+        MipWeights wy = mip_weights(src_h, dst_h, filter);
+        TextureMip &mip = mips.emplace_back(dst_w, dst_h, stride);
+        bool last = (l == levels - 1);
+        cur.resize(last ? 0 : (size_t)dst_w * dst_h * nc);
+
+        parallel_for(dst_h, [&](int y) {
+            static thread_local std::vector<float> src_row;
+            static thread_local std::vector<float> tmp;
+            static thread_local std::vector<float> out;
+            src_row.resize((size_t)src_w * nc);
+            tmp.assign((size_t)src_w * nc, 0.0f);
+            out.assign((size_t)dst_w * nc, 0.0f);
+
+            // Vertical.
+            const float *weights_y = &wy.weights[y * wy.taps];
+            for (int k = 0; k < wy.taps; ++k) {
+                float w = weights_y[k];
+                if (w == 0.0f)
+                    continue;
+                int sy = std::clamp(wy.start[y] + k, 0, src_h - 1);
+                const float *row;
+                if (l == 1) {
+                    row_to_float(level0 + (size_t)sy * src_w * stride, src_w * nc, data_type, src_row.data());
+                    row = src_row.data();
+                } else {
+                    row = prev.data() + (size_t)sy * src_w * nc;
+                }
+                for (int i = 0; i < src_w * nc; ++i)
+                    tmp[i] += w * row[i];
+            }
+            // Horizontal.
+            for (int x = 0; x < dst_w; ++x) {
+                const float *weights_x = &wx.weights[x * wx.taps];
+                float *o = &out[x * nc];
+                for (int k = 0; k < wx.taps; ++k) {
+                    float w = weights_x[k];
+                    const float *t = &tmp[std::clamp(wx.start[x] + k, 0, src_w - 1) * nc];
+                    for (int c = 0; c < nc; ++c)
+                        o[c] += w * t[c];
+                }
+            }
+            if (!last)
+                std::copy(out.begin(), out.end(), cur.begin() + (size_t)y * dst_w * nc);
+            for (int x = 0; x < dst_w; ++x)
+                texel_from_float(&out[x * nc], nc, data_type, mip.fetch_multi(x, y));
+        });
+
+        std::swap(prev, cur);
+        src_w = dst_w;
+        src_h = dst_h;
+    }
+    return mips;
+}
+
+} // namespace ks
\ No newline at end of file
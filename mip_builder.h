@@ -0,0 +1,17 @@
+#pragma once
+#include "barray.h"
+#include "texture.h"
+#include <vector>
+
+namespace ks
+{
+
+// Builds mip levels 1, 2, ... (NPOT with rounding up) from level 0 given in linear row-major order.
+// Every output row is a separable weighted sum: input rows are combined vertically, then horizontally, on linear float
+// rows (vectorizable loops), and texels are converted from/to the storage type once per row.
+// Box reproduces the polyphase NPOT box filter (https://www.nvidia.com/en-us/drivers/np2-mipmapping/). Kaiser is a
+// Kaiser-windowed sinc: sharper, but may ring (u8 output is clamped to [0, 1]).
+std::vector<TextureMip> build_mips(const std::byte *level0, int width, int height, int num_channels,
+                                                TextureDataType data_type, MipFilter filter);
+
+} // namespace ks
\ No newline at end of file
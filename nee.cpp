@@ -1,13 +1,22 @@
 #include "nee.h"
 #include "bsdf.h"
 #include "light.h"
+#include "light_sampler.h"
+#include "principled_bsdf.h"
 #include "ray.h"
-#include "rng.h"
+#include "sampler.h"
 #include "scene.h"
+#include "stats.h"
 
 namespace ks
 {
 
+static StatCounter stat_nee_samples("nee/samples");
+static StatCounter stat_nee_shadow_rays("nee/shadow_rays");
+
+// Shadow rays towards a light at a finite distance stop short of the emitter, so that it does not occlude itself.
+static inline float shadow_ray_tmax(float dist) { return std::isfinite(dist) ? dist * (1.0f - 1e-3f) : inf; }
+
 static inline float power_heur(float pf, float pg)
 {
     float pf2 = sqr(pf);
@@ -15,8 +24,9 @@ static inline float power_heur(float pf, float pg)
     return pf2 / (pf2 + pg2);
 }
 
-static color3 sample_direct(const Light &light, const BSDF &bsdf, const Intersection &hit, const Scene &geom,
-                            const vec3 &wo, const vec2 &u_light, const vec2 &u_bsdf)
+static color3 sample_direct(const Light &light, const BSDFClosure &bsdf, const Intersection &hit, const Scene &geom,
+                            const vec3 &wo, const vec2 &u_light, const vec2 &u_bsdf, ShadowRayQueue *shadow_queue,
+                            const color3 &weight)
 {
     color3 Ld = color3::Zero();
     vec3 wo_local = hit.sh_vector_to_local(wo);
@@ -27,21 +37,35 @@ static color3 sample_direct(const Light &light, const BSDF &bsdf, const Intersec
     if (!delta_bsdf) {
         vec3 wi;
         float pdf_light;
-        color3 L_beta = light.sample(hit.p, u_light, wi, pdf_light);
+        float dist;
+        color3 L_beta = light.sample_with_distance(hit.p, u_light, wi, pdf_light, dist);
         if (pdf_light > 0.0f && !L_beta.isZero()) {
             vec3 wi_local = hit.sh_vector_to_local(wi);
-            // Combine these two is in general faster.
-            auto [f, pdf_bsdf] = bsdf.eval_and_pdf(wo_local, wi_local, hit);
-            if (!f.isZero() && pdf_bsdf > 0.0f) {
-                Ray shadow_ray = spawn_ray<OffsetType::NextBounce>(hit.p, wi, hit.frame.n, 0.0f, inf);
-                if (!geom.occlude1(shadow_ray)) {
+            if (shadow_queue && shadow_queue->eval_batch &&
+                bsdf.queue_eval(wo_local, wi_local, *shadow_queue->eval_batch)) {
+                Ray shadow_ray =
+                    spawn_ray<OffsetType::NextBounce>(hit.p, wi, hit.frame.n, 0.0f, shadow_ray_tmax(dist));
+                shadow_ray.time = hit.time;
+                shadow_queue->defer(shadow_ray, weight * L_beta, delta_light ? -1.0f : pdf_light);
+            } else {
+                // Combine these two is in general faster.
+                auto [f, pdf_bsdf] = bsdf.eval_and_pdf(wo_local, wi_local);
+                if (!f.isZero() && pdf_bsdf > 0.0f) {
+                    Ray shadow_ray =
+                        spawn_ray<OffsetType::NextBounce>(hit.p, wi, hit.frame.n, 0.0f, shadow_ray_tmax(dist));
+                    shadow_ray.time = hit.time;
                     float mis = 1.0f;
                     if (!delta_light) {
                         // float pdf_bsdf = bsdf.pdf(wo_local, wi_local, hit);
                         mis = power_heur(pdf_light, pdf_bsdf);
                     }
-                    Ld += f * L_beta * mis;
-                    ASSERT(Ld.allFinite() && (Ld >= 0.0f).all());
+                    stat_nee_shadow_rays.add();
+                    if (shadow_queue) {
+                        shadow_queue->push(shadow_ray, weight * f * L_beta * mis);
+                    } else if (!geom.occlude1(shadow_ray)) {
+                        Ld += f * L_beta * mis;
+                        ASSERT_HOT(Ld.allFinite() && (Ld >= 0.0f).all());
+                    }
                 }
             }
         }
@@ -49,21 +73,27 @@ static color3 sample_direct(const Light &light, const BSDF &bsdf, const Intersec
     if (!delta_light) {
         vec3 wi_local;
         float pdf_bsdf;
-        color3 f_beta = bsdf.sample(wo_local, wi_local, hit, u_bsdf, pdf_bsdf);
+        color3 f_beta = bsdf.sample(wo_local, wi_local, u_bsdf, pdf_bsdf);
         if (pdf_bsdf > 0.0f && !f_beta.isZero()) {
             vec3 wi = hit.sh_vector_to_world(wi_local);
-            color3 L = light.eval(hit.p, wi);
+            float dist;
+            color3 L = light.eval_with_distance(hit.p, wi, dist);
             if (!L.isZero()) {
-                Ray shadow_ray = spawn_ray<OffsetType::NextBounce>(hit.p, wi, hit.frame.n, 0.0f, inf);
-                if (!geom.occlude1(shadow_ray)) {
-                    // float mis = delta_bsdf ? 1.0f : power_heur(pdf_bsdf, pdf_light);
-                    float mis = 1.0f;
-                    if (!delta_bsdf) {
-                        float pdf_light = light.pdf(hit.p, wi);
-                        mis = power_heur(pdf_bsdf, pdf_light);
-                    }
+                Ray shadow_ray =
+                    spawn_ray<OffsetType::NextBounce>(hit.p, wi, hit.frame.n, 0.0f, shadow_ray_tmax(dist));
+                shadow_ray.time = hit.time;
+                // float mis = delta_bsdf ? 1.0f : power_heur(pdf_bsdf, pdf_light);
+                float mis = 1.0f;
+                if (!delta_bsdf) {
+                    float pdf_light = light.pdf(hit.p, wi);
+                    mis = power_heur(pdf_bsdf, pdf_light);
+                }
+                stat_nee_shadow_rays.add();
+                if (shadow_queue) {
+                    shadow_queue->push(shadow_ray, weight * f_beta * L * mis);
+                } else if (!geom.occlude1(shadow_ray)) {
                     Ld += f_beta * L * mis;
-                    ASSERT(Ld.allFinite() && (Ld >= 0.0f).all());
+                    ASSERT_HOT(Ld.allFinite() && (Ld >= 0.0f).all());
                 }
             }
         }
@@ -72,16 +102,54 @@ static color3 sample_direct(const Light &light, const BSDF &bsdf, const Intersec
     return Ld;
 }
 
-color3 sample_direct(const Scene &scene, std::span<const Light *const> lights, const BSDF &bsdf,
-                     const Intersection &hit, const vec3 &wo, RNG &rng)
+color3 sample_direct(const Scene &scene, std::span<const Light *const> lights, const BSDFClosure &bsdf,
+                     const Intersection &hit, const vec3 &wo, Sampler &sampler, ShadowRayQueue *shadow_queue,
+                     const color3 &weight, const LightSampler *light_sampler)
 {
+    stat_nee_samples.add();
+    if (light_sampler) {
+        float pmf;
+        const Light *light = light_sampler->sample(hit.p, hit.frame.n, sampler.next(), pmf);
+        if (!light || pmf == 0.0f) {
+            return color3::Zero();
+        }
+        vec2 u_light = sampler.next2d();
+        vec2 u_bsdf = sampler.next2d();
+        // Both strategies are conditioned on the same light choice, so the MIS weights are unchanged.
+        float inv_pmf = 1.0f / pmf;
+        return inv_pmf * sample_direct(*light, bsdf, hit, scene, wo, u_light, u_bsdf, shadow_queue, weight * inv_pmf);
+    }
+
     color3 Ld = color3::Zero();
     for (int i = 0; i < lights.size(); ++i) {
-        vec2 u_light = rng.next2d();
-        vec2 u_bsdf = rng.next2d();
-        Ld += sample_direct(*lights[i], bsdf, hit, scene, wo, u_light, u_bsdf);
+        vec2 u_light = sampler.next2d();
+        vec2 u_bsdf = sampler.next2d();
+        Ld += sample_direct(*lights[i], bsdf, hit, scene, wo, u_light, u_bsdf, shadow_queue, weight);
     }
     return Ld;
 }
 
+void flush_deferred(ShadowRayQueue &shadow_queue)
+{
+    if (shadow_queue.deferred.empty())
+        return;
+    BSDFEvalBatch &batch = *shadow_queue.eval_batch;
+    ASSERT(batch.size() == shadow_queue.deferred.size());
+    batch.eval();
+    for (uint32_t i = 0; i < batch.size(); ++i) {
+        const ShadowRayQueue::DeferredSample &sample = shadow_queue.deferred[i];
+        color3 f(batch.f.x[i], batch.f.y[i], batch.f.z[i]);
+        float pdf_bsdf = batch.pdf[i];
+        if (f.isZero() || pdf_bsdf <= 0.0f)
+            continue;
+        float mis = sample.pdf_light < 0.0f ? 1.0f : power_heur(sample.pdf_light, pdf_bsdf);
+        stat_nee_shadow_rays.add();
+        shadow_queue.rays.push_back(sample.ray);
+        shadow_queue.contribs.push_back(f * sample.L * mis);
+        shadow_queue.path_ids.push_back(sample.path_id);
+    }
+    shadow_queue.deferred.clear();
+    batch.clear();
+}
+
 } // namespace ks
\ No newline at end of file
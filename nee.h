@@ -1,17 +1,80 @@
 #pragma once
 #include "maths.h"
+#include "ray.h"
 #include <span>
+#include <vector>
 
 namespace ks
 {
 
 struct Light;
 struct Intersection;
-struct BSDF;
-struct RNG;
+struct BSDFClosure;
+struct Sampler;
 struct Scene;
+struct LightSampler;
+struct BSDFEvalBatch;
 
-color3 sample_direct(const Scene &scene, std::span<const Light *const> lights, const BSDF &bsdf,
-                     const Intersection &hit, const vec3 &wo, RNG &rng);
+// Shadow rays deferred to a batched occlusion query (Scene::occlude_stream).
+// Each ray carries the contribution added to its path if unoccluded.
+struct ShadowRayQueue
+{
+    void push(const Ray &ray, const color3 &L)
+    {
+        rays.push_back(ray);
+        contribs.push_back(beta * L);
+        path_ids.push_back(path_id);
+    }
+
+    // A light sample whose BSDF value and pdf were queued into eval_batch. L is the contribution without the BSDF and
+    // MIS weight. pdf_light is negative for delta lights (no MIS).
+    void defer(const Ray &ray, const color3 &L, float pdf_light)
+    {
+        deferred.push_back({ray, beta * L, pdf_light, path_id});
+    }
+
+    void clear()
+    {
+        rays.clear();
+        contribs.clear();
+        path_ids.clear();
+        deferred.clear();
+    }
+
+    uint32_t size() const { return (uint32_t)rays.size(); }
+
+    std::vector<Ray> rays;
+    std::vector<color3> contribs;
+    std::vector<uint32_t> path_ids;
+    // Set by the caller before shading each path.
+    uint32_t path_id = 0;
+    color3 beta = color3::Ones();
+
+    // If set, closures with a batched evaluation (BSDFClosure::queue_eval) defer their light samples until
+    // flush_deferred.
+    BSDFEvalBatch *eval_batch = nullptr;
+    struct DeferredSample
+    {
+        Ray ray;
+        color3 L;
+        float pdf_light;
+        uint32_t path_id;
+    };
+    // Matches eval_batch entry by entry.
+    std::vector<DeferredSample> deferred;
+};
+
+// Evaluates the queued BSDF queries of shadow_queue in one batch and pushes the shadow rays of the deferred samples.
+// Call before tracing the queue.
+void flush_deferred(ShadowRayQueue &shadow_queue);
+
+// bsdf is the closure already evaluated at hit (see BSDF::closure).
+// If shadow_queue is given, shadow rays are pushed (scaled by weight) instead of traced, and the returned radiance
+// only contains the non-deferred part (currently always zero).
+// If light_sampler is given, a single light is picked from it (and lights is ignored), otherwise all lights are
+// sampled.
+color3 sample_direct(const Scene &scene, std::span<const Light *const> lights, const BSDFClosure &bsdf,
+                     const Intersection &hit, const vec3 &wo, Sampler &sampler, ShadowRayQueue *shadow_queue = nullptr,
+                     const color3 &weight = color3::Ones(), const LightSampler *light_sampler = nullptr);
 
 } // namespace ks
\ No newline at end of file
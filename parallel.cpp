@@ -1,7 +1,12 @@
 #include "parallel.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <mutex>
 #include <tbb/global_control.h>
+#include <tbb/info.h>
 #include <tbb/task_arena.h>
+#include <tbb/task_group.h>
 
 namespace ks
 {
@@ -12,7 +17,41 @@ std::unique_ptr<tbb::global_control> global_control;
 
 inline int get_default_num_threads() { return tbb::this_task_arena::max_concurrency(); }
 
-void init_parallel(int nthreads)
+struct NumaNode
+{
+    std::unique_ptr<tbb::task_arena> arena;
+    int concurrency = 0;
+    NumaNodeStats stats;
+};
+std::vector<NumaNode> numa_nodes;
+std::mutex mutex_numa_stats;
+
+static void init_numa_nodes(int nthreads)
+{
+    std::vector<tbb::numa_node_id> ids = tbb::info::numa_nodes();
+    // A single id (-1 without tbbbind): nothing to place.
+    if (ids.size() <= 1)
+        return;
+    int total = 0;
+    for (tbb::numa_node_id id : ids)
+        total += tbb::info::default_concurrency(id);
+    int assigned = 0;
+    for (int i = 0; i < (int)ids.size(); ++i) {
+        int node_total = tbb::info::default_concurrency(ids[i]);
+        // Scale down to nthreads in total, at least one thread per node.
+        int begin = (int)((int64_t)assigned * nthreads / total);
+        assigned += node_total;
+        int end = (int)((int64_t)assigned * nthreads / total);
+        NumaNode node;
+        node.concurrency = std::max(end - begin, 1);
+        node.arena = std::make_unique<tbb::task_arena>(tbb::task_arena::constraints(ids[i], node.concurrency));
+        node.arena->initialize();
+        node.stats.concurrency = node.concurrency;
+        numa_nodes.push_back(std::move(node));
+    }
+}
+
+void init_parallel(int nthreads, bool numa)
 {
     // Make sure no race condition...
     std::scoped_lock lock(mutex_init_parallel);
@@ -24,7 +63,121 @@ void init_parallel(int nthreads)
             nthreads = get_default_num_threads();
         }
         global_control = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, nthreads);
+        if (numa)
+            init_numa_nodes(nthreads);
+    }
+}
+
+int num_numa_nodes() { return numa_nodes.empty() ? 1 : (int)numa_nodes.size(); }
+
+int numa_node_concurrency(int node)
+{
+    return numa_nodes.empty() ? tbb::this_task_arena::max_concurrency() : numa_nodes[node].concurrency;
+}
+
+std::vector<int64_t> numa_partition(int64_t N)
+{
+    int n = num_numa_nodes();
+    std::vector<int64_t> bounds(n + 1, 0);
+    int64_t total = 0;
+    for (int i = 0; i < n; ++i)
+        total += numa_node_concurrency(i);
+    int64_t acc = 0;
+    for (int i = 0; i < n; ++i) {
+        acc += numa_node_concurrency(i);
+        bounds[i + 1] = N * acc / total;
+    }
+    return bounds;
+}
+
+void numa_run(const std::function<uint64_t(int node)> &node_func)
+{
+    if (numa_nodes.empty()) {
+        node_func(0);
+        return;
+    }
+    using clock = std::chrono::steady_clock;
+    int n = (int)numa_nodes.size();
+    std::vector<tbb::task_group> groups(n);
+    std::vector<uint64_t> items(n, 0);
+    std::vector<double> busy(n, 0.0);
+    clock::time_point start = clock::now();
+    for (int i = 0; i < n; ++i) {
+        numa_nodes[i].arena->execute([&, i] {
+            groups[i].run([&, i] {
+                items[i] = node_func(i);
+                busy[i] = std::chrono::duration<double>(clock::now() - start).count();
+            });
+        });
+    }
+    // Waiting inside each arena makes the calling thread help that node instead of running its tasks elsewhere.
+    for (int i = 0; i < n; ++i)
+        numa_nodes[i].arena->execute([&, i] { groups[i].wait(); });
+    double wall = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::scoped_lock lock(mutex_numa_stats);
+    for (int i = 0; i < n; ++i) {
+        numa_nodes[i].stats.items += items[i];
+        numa_nodes[i].stats.busy_seconds += busy[i];
+        numa_nodes[i].stats.wall_seconds += wall;
     }
 }
 
+static constexpr size_t numa_page_bytes = 4096;
+
+template <typename Touch>
+static void numa_touch_pages(size_t bytes, const Touch &touch)
+{
+    if (num_numa_nodes() == 1 || bytes < numa_interleave_min_bytes)
+        return;
+    size_t num_pages = (bytes + numa_page_bytes - 1) / numa_page_bytes;
+    int n = num_numa_nodes();
+    numa_run([&](int node) {
+        size_t node_pages = (num_pages - node + n - 1) / n;
+        parallel_for(node_pages, [&](size_t i) { touch(node + i * n); });
+        return (uint64_t)0;
+    });
+}
+
+void numa_interleave(void *ptr, size_t bytes)
+{
+    std::byte *data = (std::byte *)ptr;
+    numa_touch_pages(bytes, [&](size_t page) {
+        size_t begin = page * numa_page_bytes;
+        std::fill(data + begin, data + std::min(begin + numa_page_bytes, bytes), std::byte(0));
+    });
+}
+
+void numa_interleave_read(const void *ptr, size_t bytes)
+{
+    const volatile std::byte *data = (const volatile std::byte *)ptr;
+    numa_touch_pages(bytes, [&](size_t page) { (void)data[page * numa_page_bytes]; });
+}
+
+std::vector<NumaNodeStats> numa_node_stats()
+{
+    std::scoped_lock lock(mutex_numa_stats);
+    std::vector<NumaNodeStats> stats;
+    for (const NumaNode &node : numa_nodes)
+        stats.push_back(node.stats);
+    return stats;
+}
+
+ThreadLocalArena::Stats ThreadLocalArena::stats()
+{
+    Stats stats;
+    arenas.combine_each([&](const BlockAllocator &arena) {
+        stats.peak_bytes = std::max(stats.peak_bytes, arena.peak_bytes());
+        stats.num_blocks += arena.num_blocks();
+        ++stats.num_threads;
+    });
+    return stats;
+}
+
+ThreadLocalArena &scratch_arena()
+{
+    static ThreadLocalArena arena;
+    return arena;
+}
+
 } // namespace ks
\ No newline at end of file
@@ -20,16 +20,23 @@
 #endif
 #endif
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
 #include <tbb/parallel_sort.h>
+#include "memory_util.h"
+#include <cstdint>
+#include <functional>
 #include <tbb/spin_mutex.h>
 #include <thread>
+#include <vector>
 
 namespace ks
 {
 
 inline int num_system_cores() { return std::max(1u, std::thread::hardware_concurrency()); }
 
-void init_parallel(int nthreads = 0);
+// With numa, also creates a task arena per NUMA node whose threads stay on the node's cores (TBB needs tbbbind, i.e.
+// hwloc, at runtime to see the topology). Otherwise, or on single-node machines, everything runs as a single node.
+void init_parallel(int nthreads = 0, bool numa = false);
 
 template <typename Index, typename Func>
 void parallel_for(const Index N, const Func &func, Index grainsize = 1)
@@ -41,6 +48,55 @@ void parallel_for(const Index N, const Func &func, Index grainsize = 1)
     tbb::parallel_for(tbb::blocked_range<Index>(0, N, grainsize), body);
 }
 
+int num_numa_nodes();
+int numa_node_concurrency(int node);
+// Bounds of one contiguous range of [0, N) per node, proportional to the node's threads (num_numa_nodes() + 1 values).
+std::vector<int64_t> numa_partition(int64_t N);
+// Calls node_func(node) once per node in the node's arena, all nodes concurrently. node_func returns the number of
+// items it processed (for numa_node_stats).
+void numa_run(const std::function<uint64_t(int node)> &node_func);
+
+// parallel_for where each node runs its range of numa_partition(N). Calls with the same N give every node the same
+// indices, so data indexed by them stays on the node that first touched it.
+template <typename Index, typename Func>
+void numa_parallel_for(const Index N, const Func &func)
+{
+    if (num_numa_nodes() == 1) {
+        parallel_for(N, func);
+        return;
+    }
+    std::vector<int64_t> bounds = numa_partition((int64_t)N);
+    numa_run([&](int node) {
+        Index begin = (Index)bounds[node];
+        Index end = (Index)bounds[node + 1];
+        parallel_for(end - begin, [&](Index i) { func(begin + i); });
+        return (uint64_t)(end - begin);
+    });
+}
+
+// First-touch placement of a fresh allocation: page p is touched by a thread of node p % num_numa_nodes(), so
+// read-mostly data that every node reads (textures, meshes) is interleaved instead of sitting on the node of the
+// loading thread. Writes zeros, so call it before the memory is filled. Allocations below
+// numa_interleave_min_bytes, and single-node machines, are skipped.
+void numa_interleave(void *ptr, size_t bytes);
+// Same for memory that can't be written (e.g. read-only mapped files): prefaults the pages by reading them. Only
+// places pages that aren't in memory yet.
+void numa_interleave_read(const void *ptr, size_t bytes);
+constexpr size_t numa_interleave_min_bytes = 4 << 20;
+
+struct NumaNodeStats
+{
+    int concurrency = 0;
+    // Summed over numa_run calls: items processed, time until the node was done and time until all nodes were.
+    uint64_t items = 0;
+    double busy_seconds = 0.0;
+    double wall_seconds = 0.0;
+
+    // Below 1 if the node waited for the others.
+    float utilization() const { return wall_seconds > 0.0 ? (float)(busy_seconds / wall_seconds) : 0.0f; }
+};
+std::vector<NumaNodeStats> numa_node_stats();
+
 template <typename RandomAccessIterator>
 void parallel_sort(RandomAccessIterator begin, RandomAccessIterator end)
 {
@@ -53,6 +109,13 @@ void parallel_sort(RandomAccessIterator begin, RandomAccessIterator end, const C
     tbb::parallel_sort(begin, end, comp);
 }
 
+// Run independent tasks (e.g. the two subtrees of a BVH build) concurrently.
+template <typename... Funcs>
+void parallel_invoke(const Funcs &...funcs)
+{
+    tbb::parallel_invoke(funcs...);
+}
+
 template <typename T>
 class Combinable
 {
@@ -90,27 +153,36 @@ class Combinable
     tbb::combinable<T> cb;
 };
 
-template <typename Func>
-void parallel_tile_2d(int width, int height, const Func &pixel_func)
+// Per-thread scratch memory for short-lived render-path allocations (BSDF closures etc.).
+// The owner of a sample calls reset() once it is done; everything allocated since the last reset on the calling thread
+// becomes invalid.
+class ThreadLocalArena
 {
-    constexpr int tile_width = 4;
-    constexpr int tile_height = 4;
-    int num_tiles_x = (width + tile_width - 1) / tile_width;
-    int num_tiles_y = (height + tile_height - 1) / tile_height;
-    int num_tiles = num_tiles_x * num_tiles_y;
-    parallel_for(num_tiles, [&](int tile_idx) {
-        int tile_idx_y = tile_idx / num_tiles_x;
-        int tile_idx_x = tile_idx - tile_idx_y * num_tiles_x;
-
-        int y_start = tile_idx_y * tile_height;
-        int y_end = std::min(y_start + tile_height, height);
-        int x_start = tile_idx_x * tile_width;
-        int x_end = std::min(x_start + tile_width, width);
-        for (int y = y_start; y < y_end; ++y)
-            for (int x = x_start; x < x_end; ++x)
-                pixel_func(x, y);
-    });
-}
+  public:
+    explicit ThreadLocalArena(size_t block_size = 16384)
+        : arenas([block_size]() { return BlockAllocator(block_size); })
+    {}
+
+    BlockAllocator &local() { return arenas.local(); }
+    void reset() { arenas.local().reset(); }
+
+    struct Stats
+    {
+        // Max over threads.
+        size_t peak_bytes = 0;
+        // Sum over threads.
+        size_t num_blocks = 0;
+        size_t num_threads = 0;
+    };
+    // NOTE: not thread-safe against concurrent allocations.
+    Stats stats();
+
+  private:
+    Combinable<BlockAllocator> arenas;
+};
+
+// Shared by the render path.
+ThreadLocalArena &scratch_arena();
 
 using spin_lock = tbb::spin_mutex;
 
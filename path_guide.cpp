@@ -0,0 +1,286 @@
+#include "path_guide.h"
+#include "parallel.h"
+
+namespace ks
+{
+
+PathGuideOptions load_path_guide_options(const ConfigArgs &args)
+{
+    PathGuideOptions options;
+    options.training_spp = args.load_integer("training_spp", options.training_spp);
+    options.bsdf_sampling_fraction = args.load_float("bsdf_sampling_fraction", options.bsdf_sampling_fraction);
+    options.spatial_threshold = args.load_integer("spatial_threshold", options.spatial_threshold);
+    options.max_spatial_depth = args.load_integer("max_spatial_depth", options.max_spatial_depth);
+    options.directional_threshold = args.load_float("directional_threshold", options.directional_threshold);
+    options.max_directional_depth = args.load_integer("max_directional_depth", options.max_directional_depth);
+    ASSERT(options.bsdf_sampling_fraction > 0.0f && options.bsdf_sampling_fraction <= 1.0f,
+           "bsdf_sampling_fraction must be in (0, 1] so that the BSDF still covers everything the guide misses.");
+    ASSERT(options.max_spatial_depth <= 255, "max_spatial_depth must be at most 255.");
+    return options;
+}
+
+// Picks the upper half with probability p1 and remaps u back to [0, 1).
+static int sample_half(float p1, float &u)
+{
+    float p0 = 1.0f - p1;
+    if (u < p0) {
+        u = std::min(u / p0, before_one);
+        return 0;
+    }
+    u = std::min((u - p0) / p1, before_one);
+    return 1;
+}
+
+float DirectionalTree::total() const
+{
+    const Node &root = nodes[0];
+    return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+}
+
+vec2 DirectionalTree::sample(vec2 u, float &pdf) const
+{
+    vec2 origin = vec2::Zero();
+    float size = 1.0f;
+    pdf = 1.0f;
+    uint32_t n = 0;
+    while (true) {
+        const Node &node = nodes[n];
+        float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        int qx, qy;
+        if (total > 0.0f) {
+            qx = sample_half((node.sum[1] + node.sum[3]) / total, u.x());
+            float column = node.sum[qx] + node.sum[qx + 2];
+            qy = sample_half(column > 0.0f ? node.sum[qx + 2] / column : 0.5f, u.y());
+            pdf *= 4.0f * node.sum[qx + 2 * qy] / total;
+        } else {
+            qx = sample_half(0.5f, u.x());
+            qy = sample_half(0.5f, u.y());
+        }
+        size *= 0.5f;
+        origin += size * vec2((float)qx, (float)qy);
+        uint32_t child = node.child[qx + 2 * qy];
+        if (!child) {
+            return (origin + size * u).cwiseMin(vec2::Constant(before_one));
+        }
+        n = child;
+    }
+}
+
+float DirectionalTree::pdf(vec2 c) const
+{
+    float pdf = 1.0f;
+    uint32_t n = 0;
+    while (true) {
+        const Node &node = nodes[n];
+        int qx = c.x() >= 0.5f;
+        int qy = c.y() >= 0.5f;
+        c = 2.0f * c - vec2((float)qx, (float)qy);
+        int q = qx + 2 * qy;
+        float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        if (total > 0.0f) {
+            pdf *= 4.0f * node.sum[q] / total;
+        }
+        if (!node.child[q] || pdf == 0.0f) {
+            return pdf;
+        }
+        n = node.child[q];
+    }
+}
+
+uint32_t DirectionalTree::find(vec2 c, int &quadrant) const
+{
+    uint32_t n = 0;
+    while (true) {
+        int qx = c.x() >= 0.5f;
+        int qy = c.y() >= 0.5f;
+        c = 2.0f * c - vec2((float)qx, (float)qy);
+        quadrant = qx + 2 * qy;
+        uint32_t child = nodes[n].child[quadrant];
+        if (!child) {
+            return n;
+        }
+        n = child;
+    }
+}
+
+void DirectionalTree::gather(const std::atomic<float> *flux)
+{
+    // Children are always created after their parent.
+    for (uint32_t n = (uint32_t)nodes.size(); n-- > 0;) {
+        Node &node = nodes[n];
+        for (int q = 0; q < 4; ++q) {
+            if (node.child[q]) {
+                const Node &child = nodes[node.child[q]];
+                node.sum[q] = child.sum[0] + child.sum[1] + child.sum[2] + child.sum[3];
+            } else {
+                node.sum[q] = flux[4 * n + q].load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+DirectionalTree DirectionalTree::refined(float threshold, int max_depth) const
+{
+    float total = this->total();
+    if (total <= 0.0f) {
+        // Nothing learned: keep the structure.
+        DirectionalTree tree = *this;
+        for (Node &node : tree.nodes)
+            node.sum.fill(0.0f);
+        return tree;
+    }
+
+    struct Entry
+    {
+        // Sums to refine against. Quadrants not present in this tree inherit a quarter of their parent.
+        std::array<float, 4> sum;
+        // Node of this tree, if there is one.
+        bool has_old;
+        uint32_t old_node;
+        uint32_t new_node;
+        int depth;
+    };
+    DirectionalTree tree;
+    std::vector<Entry> stack;
+    stack.push_back({nodes[0].sum, true, 0, 0, 1});
+    while (!stack.empty()) {
+        Entry e = stack.back();
+        stack.pop_back();
+        for (int q = 0; q < 4; ++q) {
+            if (e.depth >= max_depth || e.sum[q] <= threshold * total) {
+                continue;
+            }
+            uint32_t child = (uint32_t)tree.nodes.size();
+            tree.nodes.emplace_back();
+            tree.nodes[e.new_node].child[q] = child;
+            uint32_t old_child = e.has_old ? nodes[e.old_node].child[q] : 0;
+            if (old_child) {
+                stack.push_back({nodes[old_child].sum, true, old_child, child, e.depth + 1});
+            } else {
+                float quarter = 0.25f * e.sum[q];
+                stack.push_back({{quarter, quarter, quarter, quarter}, false, 0, child, e.depth + 1});
+            }
+        }
+    }
+    return tree;
+}
+
+void PathGuide::Leaf::reset_flux()
+{
+    size_t n = 4 * building.nodes.size();
+    flux = std::make_unique<std::atomic<float>[]>(n);
+    for (size_t i = 0; i < n; ++i)
+        flux[i].store(0.0f, std::memory_order_relaxed);
+    num_samples.store(0, std::memory_order_relaxed);
+}
+
+PathGuide::PathGuide(const AABB3 &scene_bound, const PathGuideOptions &options) : options(options)
+{
+    // Slightly enlarged so that points on the boundary do not need clamping.
+    size = scene_bound.extents().maxCoeff() * 1.01f;
+    origin = scene_bound.center() - vec3::Constant(0.5f * size);
+
+    nodes.emplace_back();
+    leaves.push_back(std::make_unique<Leaf>());
+    leaves[0]->reset_flux();
+}
+
+uint32_t PathGuide::leaf_index(const vec3 &p) const
+{
+    vec3 x = ((p - origin) / size).cwiseMax(vec3::Zero()).cwiseMin(vec3::Constant(before_one));
+    uint32_t n = 0;
+    while (nodes[n].child[0]) {
+        const SpatialNode &node = nodes[n];
+        int side = x[node.axis] >= 0.5f;
+        x[node.axis] = 2.0f * x[node.axis] - (float)side;
+        n = node.child[side];
+    }
+    return nodes[n].leaf;
+}
+
+vec3 PathGuide::sample(const vec3 &p, const vec2 &u, float &pdf) const
+{
+    const DirectionalTree &tree = leaves[leaf_index(p)]->sampling;
+    float canonical_pdf;
+    vec3 wi = canonical_to_dir(tree.sample(u, canonical_pdf));
+    // NOTE: the pdf of the rounded direction, so that it always agrees with pdf() near quadrant boundaries.
+    pdf = tree.pdf(dir_to_canonical(wi)) * (0.25f * inv_pi);
+    return wi;
+}
+
+float PathGuide::pdf(const vec3 &p, const vec3 &wi) const
+{
+    const DirectionalTree &tree = leaves[leaf_index(p)]->sampling;
+    return tree.pdf(dir_to_canonical(wi)) * (0.25f * inv_pi);
+}
+
+float PathGuide::radiance_estimate(const vec3 &p) const
+{
+    const Leaf &leaf = *leaves[leaf_index(p)];
+    if (leaf.learned_samples == 0) {
+        return 0.0f;
+    }
+    // Flux is the sum of radiance / pdf over all samples.
+    return leaf.sampling.total() / ((float)leaf.learned_samples * 4.0f * pi);
+}
+
+void PathGuide::record(const vec3 &p, const vec3 &wi, float radiance, float pdf)
+{
+    Leaf &leaf = *leaves[leaf_index(p)];
+    leaf.num_samples.fetch_add(1, std::memory_order_relaxed);
+    if (!(radiance > 0.0f && pdf > 0.0f) || !std::isfinite(radiance / pdf)) {
+        return;
+    }
+    int q;
+    uint32_t n = leaf.building.find(dir_to_canonical(wi), q);
+    leaf.flux[4 * n + q].fetch_add(radiance / pdf, std::memory_order_relaxed);
+}
+
+void PathGuide::update()
+{
+    // 1. Collect what was splatted since the last update.
+    parallel_for(leaves.size(), [&](size_t i) {
+        Leaf &leaf = *leaves[i];
+        leaf.building.gather(leaf.flux.get());
+        leaf.learned_samples = leaf.num_samples.load(std::memory_order_relaxed);
+    });
+
+    // 2. Split spatial leaves with enough samples. Both halves start from the directional tree of their parent.
+    uint32_t threshold = (uint32_t)(options.spatial_threshold * std::sqrt(std::exp2((float)iteration)));
+    for (uint32_t n = 0; n < (uint32_t)nodes.size(); ++n) {
+        if (nodes[n].child[0] || nodes[n].depth >= options.max_spatial_depth) {
+            continue;
+        }
+        Leaf &leaf = *leaves[nodes[n].leaf];
+        uint32_t num_samples = leaf.num_samples.load(std::memory_order_relaxed);
+        if (num_samples <= threshold) {
+            continue;
+        }
+        auto split = std::make_unique<Leaf>();
+        split->building = leaf.building;
+        split->learned_samples = leaf.learned_samples;
+        split->num_samples.store(num_samples / 2, std::memory_order_relaxed);
+        leaf.num_samples.store(num_samples - num_samples / 2, std::memory_order_relaxed);
+
+        SpatialNode first, second;
+        first.leaf = nodes[n].leaf;
+        second.leaf = (uint32_t)leaves.size();
+        leaves.push_back(std::move(split));
+        first.axis = second.axis = (nodes[n].axis + 1) % 3;
+        first.depth = second.depth = nodes[n].depth + 1;
+        nodes[n].child = {(uint32_t)nodes.size(), (uint32_t)nodes.size() + 1};
+        nodes.push_back(first);
+        nodes.push_back(second);
+    }
+
+    // 3. Sample what was just learned and splat into a refined copy of it.
+    parallel_for(leaves.size(), [&](size_t i) {
+        Leaf &leaf = *leaves[i];
+        leaf.sampling = std::move(leaf.building);
+        leaf.building = leaf.sampling.refined(options.directional_threshold, options.max_directional_depth);
+        leaf.reset_flux();
+    });
+    ++iteration;
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,128 @@
+#pragma once
+#include "aabb.h"
+#include "config.h"
+#include "maths.h"
+#include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace ks
+{
+
+struct PathGuideOptions
+{
+    // Train during passes of 1, 2, 4, ... spp until this many samples per pixel are taken. The guide is frozen after.
+    int training_spp = 64;
+    // Probability of sampling the BSDF instead of the guide (one-sample MIS between the two).
+    float bsdf_sampling_fraction = 0.5f;
+    // A spatial leaf is split once it has received more than spatial_threshold * sqrt(2^iteration) samples.
+    int spatial_threshold = 12000;
+    int max_spatial_depth = 48;
+    // A directional quadrant is subdivided while it holds more than this fraction of its tree's flux.
+    float directional_threshold = 0.01f;
+    int max_directional_depth = 20;
+};
+
+PathGuideOptions load_path_guide_options(const ConfigArgs &args);
+
+// Area-preserving cylindrical mapping of the sphere: (cos(theta), phi) <-> [0,1)^2.
+inline vec3 canonical_to_dir(const vec2 &c)
+{
+    float z = 2.0f * c.x() - 1.0f;
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    float phi = two_pi * c.y();
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+inline vec2 dir_to_canonical(const vec3 &d)
+{
+    float z = std::clamp(d.z(), -1.0f, 1.0f);
+    float phi = std::atan2(d.y(), d.x());
+    if (phi < 0.0f)
+        phi += two_pi;
+    return vec2(std::clamp(0.5f * (z + 1.0f), 0.0f, before_one), std::clamp(phi / two_pi, 0.0f, before_one));
+}
+
+// Quadtree over the canonical square (see canonical_to_dir). Quadrant q of a node covers
+// [qx/2, (qx+1)/2) x [qy/2, (qy+1)/2) with q = qx + 2 * qy.
+struct DirectionalTree
+{
+    struct Node
+    {
+        // Index of the child node of each quadrant, 0 for leaf quadrants (the root is never a child).
+        std::array<uint32_t, 4> child = {0, 0, 0, 0};
+        // Flux of each quadrant.
+        std::array<float, 4> sum = {0.0f, 0.0f, 0.0f, 0.0f};
+    };
+
+    float total() const;
+    // A node without flux is sampled uniformly. pdf is with respect to the canonical square.
+    vec2 sample(vec2 u, float &pdf) const;
+    float pdf(vec2 c) const;
+    // Returns the node whose leaf quadrant contains c.
+    uint32_t find(vec2 c, int &quadrant) const;
+    // Recompute the sums of all nodes from the flux of the leaf quadrants (4 per node).
+    void gather(const std::atomic<float> *flux);
+    // New (empty) tree whose leaf quadrants each hold at most threshold of the flux of this tree.
+    DirectionalTree refined(float threshold, int max_depth) const;
+
+    std::vector<Node> nodes = std::vector<Node>(1);
+};
+
+// SD-tree (Mueller et al. 2017, "Practical Path Guiding for Efficient Light-Transport Simulation"): a binary tree
+// over space whose leaves hold a directional quadtree of incident radiance.
+// Each leaf keeps two directional trees. Rendering samples the one learned in the previous pass while record() splats
+// into the other one with atomics, so neither side needs locks. update() swaps them between passes.
+struct PathGuide
+{
+    PathGuide(const AABB3 &scene_bound, const PathGuideOptions &options);
+
+    // Solid angle pdf. Thread-safe, also concurrently with record().
+    vec3 sample(const vec3 &p, const vec2 &u, float &pdf) const;
+    float pdf(const vec3 &p, const vec3 &wi) const;
+    // Mean radiance arriving at p over the sphere, as learned by the sampling tree (0 before the first update).
+    float radiance_estimate(const vec3 &p) const;
+
+    // Splat the (luminance of the) radiance arriving at p from wi, where wi was sampled with (solid angle) pdf.
+    // Thread-safe.
+    void record(const vec3 &p, const vec3 &wi, float radiance, float pdf);
+    // Call between passes: refines the trees from what was recorded since the last update and makes it the new
+    // sampling distribution.
+    void update();
+
+    uint32_t leaf_index(const vec3 &p) const;
+
+    struct SpatialNode
+    {
+        // Both 0 for leaves.
+        std::array<uint32_t, 2> child = {0, 0};
+        uint32_t leaf = 0;
+        uint8_t axis = 0;
+        uint8_t depth = 0;
+    };
+
+    struct Leaf
+    {
+        void reset_flux();
+
+        DirectionalTree sampling;
+        DirectionalTree building;
+        // Flux splatted into the leaf quadrants of building, 4 per node.
+        std::unique_ptr<std::atomic<float>[]> flux;
+        std::atomic<uint32_t> num_samples{0};
+        // Number of samples the flux of sampling was learned from.
+        uint32_t learned_samples = 0;
+    };
+
+    PathGuideOptions options;
+    // Number of update() calls so far.
+    int iteration = 0;
+    // The spatial tree splits a cube around the scene in halves.
+    vec3 origin;
+    float size;
+    std::vector<SpatialNode> nodes;
+    std::vector<std::unique_ptr<Leaf>> leaves;
+};
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "path_termination.h"
+#include "assertion.h"
+
+namespace ks
+{
+
+bool RussianRouletteOptions::survive(color3 &beta, int depth, float u, float expected_ratio) const
+{
+    if (mode == RussianRouletteMode::Off || depth < start_depth) {
+        return true;
+    }
+    float p = 1.0f;
+    if (mode == RussianRouletteMode::Efficiency && expected_ratio >= 0.0f) {
+        float lower = 2.0f / (1.0f + window);
+        if (expected_ratio < lower) {
+            // NOTE: keep a small survival probability since the estimates are rough.
+            p = std::max(expected_ratio / lower, 0.01f);
+        }
+    } else {
+        float metric = mode == RussianRouletteMode::Throughput ? beta.maxCoeff() : luminance(beta);
+        if (metric < threshold) {
+            p = std::min(metric, 0.95f);
+        }
+    }
+    if (p >= 1.0f) {
+        return true;
+    }
+    if (!(u < p)) {
+        return false;
+    }
+    beta /= p;
+    return true;
+}
+
+RussianRouletteOptions load_russian_roulette_options(const ConfigArgs &args, std::string_view prefix,
+                                                     const RussianRouletteOptions &defaults)
+{
+    auto name = [&](const char *option) { return std::string(prefix) + option; };
+    RussianRouletteOptions options = defaults;
+    if (args.contains(name("mode"))) {
+        std::string mode = args.load_string(name("mode"));
+        if (mode == "off") {
+            options.mode = RussianRouletteMode::Off;
+        } else if (mode == "throughput") {
+            options.mode = RussianRouletteMode::Throughput;
+        } else if (mode == "luminance") {
+            options.mode = RussianRouletteMode::Luminance;
+        } else if (mode == "efficiency") {
+            options.mode = RussianRouletteMode::Efficiency;
+        } else {
+            ASSERT(false, "Invalid russian roulette mode [%s].", mode.c_str());
+        }
+    }
+    options.start_depth = args.load_integer(name("depth"), options.start_depth);
+    options.threshold = args.load_float(name("threshold"), options.threshold);
+    options.window = args.load_float(name("window"), options.window);
+    ASSERT(options.window >= 1.0f, "Russian roulette window must be at least 1.");
+    return options;
+}
+
+bool PathTerminationOptions::exceeds_depth(int depth, LobeType lobe, LobeBounces &bounces) const
+{
+    if (depth + 1 >= max_depth) {
+        return true;
+    }
+    int max_bounces = max_lobe_bounces[(int)lobe];
+    uint8_t &count = bounces[(int)lobe];
+    if (max_bounces >= 0 && count >= max_bounces) {
+        return true;
+    }
+    count = (uint8_t)std::min(count + 1, 255);
+    return false;
+}
+
+PathTerminationOptions load_path_termination_options(const ConfigArgs &args)
+{
+    PathTerminationOptions options;
+    options.max_depth = args.load_integer("max_depth", options.max_depth);
+    const char *lobe_names[num_lobe_types] = {"diffuse", "glossy", "specular", "subsurface"};
+    for (int i = 0; i < num_lobe_types; ++i) {
+        std::string name = std::string("max_") + lobe_names[i] + "_bounces";
+        options.max_lobe_bounces[i] = args.load_integer(name, options.max_lobe_bounces[i]);
+    }
+    options.rr = load_russian_roulette_options(args, "rr_", options.rr);
+    return options;
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,68 @@
+#pragma once
+#include "config.h"
+#include "maths.h"
+#include <array>
+
+namespace ks
+{
+
+// Kind of lobe a bounce scattered off, used for per-lobe bounce budgets.
+enum class LobeType : uint8_t
+{
+    Diffuse,
+    Glossy,
+    Specular,
+    Subsurface,
+};
+constexpr int num_lobe_types = 4;
+
+enum class RussianRouletteMode
+{
+    Off,
+    // Survival probability from the largest throughput component.
+    Throughput,
+    // Survival probability from the luminance of the throughput.
+    Luminance,
+    // Weight window around the pixel estimate (Vorba and Krivanek 2016, "Adjoint-Driven Russian Roulette and
+    // Splitting"), without splitting. Needs an estimate of the radiance arriving at the vertex and falls back to
+    // Luminance without one.
+    Efficiency,
+};
+
+struct RussianRouletteOptions
+{
+    // Returns false if the path is terminated, otherwise beta is rescaled by the inverse survival probability.
+    // expected_ratio is the expected contribution of the path relative to the pixel estimate (Efficiency only,
+    // negative if unknown).
+    bool survive(color3 &beta, int depth, float u, float expected_ratio = -1.0f) const;
+
+    RussianRouletteMode mode = RussianRouletteMode::Throughput;
+    // Start russian roulette after this many bounces.
+    int start_depth = 3;
+    // Throughput and Luminance: paths below this survive with a probability equal to the metric (at most 0.95).
+    float threshold = 0.05f;
+    // Efficiency: paths expected to contribute less than 2 / (1 + window) of the pixel estimate are played.
+    float window = 5.0f;
+};
+
+// prefix is prepended to the option names (e.g. "rr_" gives rr_mode, rr_depth, ...).
+RussianRouletteOptions load_russian_roulette_options(const ConfigArgs &args, std::string_view prefix,
+                                                     const RussianRouletteOptions &defaults = {});
+
+using LobeBounces = std::array<uint8_t, num_lobe_types>;
+
+struct PathTerminationOptions
+{
+    // Count a bounce of the given lobe at depth (0 for the camera ray hit). Returns true if the path must stop.
+    bool exceeds_depth(int depth, LobeType lobe, LobeBounces &bounces) const;
+
+    int max_depth = 5;
+    // Maximum number of bounces continued after scattering off each lobe type, negative for no limit.
+    std::array<int, num_lobe_types> max_lobe_bounces = {-1, -1, -1, -1};
+    RussianRouletteOptions rr;
+};
+
+// Reads max_depth, max_{diffuse,glossy,specular,subsurface}_bounces and rr_* from the integrator table.
+PathTerminationOptions load_path_termination_options(const ConfigArgs &args);
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "pool_allocator.h"
+#include "assertion.h"
+#include <bit>
+
+namespace ks
+{
+
+static constexpr uint64_t pointer_mask = (uint64_t(1) << 48) - 1;
+
+void PoolAllocator::FreeList::push(Header *node)
+{
+    uint64_t old_head = head.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        node->next = reinterpret_cast<Header *>(old_head & pointer_mask);
+        uint64_t tag = (old_head >> 48) + 1;
+        new_head = (tag << 48) | reinterpret_cast<uint64_t>(node);
+    } while (!head.compare_exchange_weak(old_head, new_head, std::memory_order_release, std::memory_order_relaxed));
+}
+
+PoolAllocator::Header *PoolAllocator::FreeList::pop()
+{
+    uint64_t old_head = head.load(std::memory_order_acquire);
+    while (Header *node = reinterpret_cast<Header *>(old_head & pointer_mask)) {
+        // NOTE: node may be popped and reused concurrently, but chunks are never released while the pool is alive, so
+        // reading next is safe and the tag makes the CAS fail in that case.
+        uint64_t tag = (old_head >> 48) + 1;
+        uint64_t new_head = (tag << 48) | reinterpret_cast<uint64_t>(node->next);
+        if (head.compare_exchange_weak(old_head, new_head, std::memory_order_acquire, std::memory_order_acquire)) {
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+PoolAllocator::PoolAllocator() = default;
+
+PoolAllocator::~PoolAllocator()
+{
+    for (auto &chunk : chunks) {
+        free_aligned(chunk.second);
+    }
+}
+
+int PoolAllocator::size_class(size_t byte_count)
+{
+    if (byte_count <= min_pooled_size)
+        return 0;
+    return (int)std::bit_width(byte_count - 1) - (int)std::bit_width(min_pooled_size - 1);
+}
+
+PoolAllocator::Header *PoolAllocator::refill(int c)
+{
+    constexpr size_t target_chunk_size = 256 * 1024;
+    constexpr size_t cache_line = 64;
+    size_t size = block_size(c);
+    size_t count = std::max<size_t>(8, target_chunk_size / size);
+    size_t chunk_size = (count * size + cache_line - 1) & ~(cache_line - 1);
+    std::byte *chunk = (std::byte *)alloc_aligned(chunk_size, cache_line);
+    ASSERT(chunk, "PoolAllocator: out of memory.");
+    {
+        std::lock_guard<spin_lock> lock(chunk_lock);
+        chunks.push_back({chunk_size, chunk});
+    }
+
+    // Keep one block for the caller and put the rest into the local cache.
+    ThreadCache &cache = caches.local();
+    for (size_t i = 1; i < count; ++i) {
+        Header *node = reinterpret_cast<Header *>(chunk + i * size);
+        node->size_class = (uint32_t)c;
+        node->next = cache.heads[c];
+        cache.heads[c] = node;
+        ++cache.counts[c];
+    }
+    Header *node = reinterpret_cast<Header *>(chunk);
+    node->size_class = (uint32_t)c;
+    return node;
+}
+
+void *PoolAllocator::allocate(size_t byte_count)
+{
+    if (byte_count > max_pooled_size) {
+        constexpr size_t cache_line = 64;
+        size_t size = (sizeof(Header) + byte_count + cache_line - 1) & ~(cache_line - 1);
+        Header *header = (Header *)alloc_aligned(size, cache_line);
+        ASSERT(header, "PoolAllocator: out of memory.");
+        header->size_class = large_class;
+        header->large_size = byte_count;
+        num_large_allocations.fetch_add(1, std::memory_order_relaxed);
+        return header + 1;
+    }
+
+    int c = size_class(byte_count);
+    ThreadCache &cache = caches.local();
+    Header *node = cache.heads[c];
+    if (node) {
+        cache.heads[c] = node->next;
+        --cache.counts[c];
+    } else {
+        node = global_lists[c].pop();
+        if (!node)
+            node = refill(c);
+    }
+    return node + 1;
+}
+
+void PoolAllocator::free(void *bytes)
+{
+    if (!bytes)
+        return;
+    Header *header = reinterpret_cast<Header *>(bytes) - 1;
+    if (header->size_class == large_class) {
+        num_large_allocations.fetch_sub(1, std::memory_order_relaxed);
+        free_aligned(header);
+        return;
+    }
+
+    int c = (int)header->size_class;
+    ASSERT(c < num_size_classes, "PoolAllocator: freeing a pointer that was not allocated by this pool?");
+    ThreadCache &cache = caches.local();
+    header->next = cache.heads[c];
+    cache.heads[c] = header;
+    // Hand half of the cache over to other threads once it grows too large.
+    if (++cache.counts[c] > ThreadCache::capacity) {
+        for (uint32_t i = 0; i < ThreadCache::capacity / 2; ++i) {
+            Header *node = cache.heads[c];
+            cache.heads[c] = node->next;
+            global_lists[c].push(node);
+        }
+        cache.counts[c] -= ThreadCache::capacity / 2;
+    }
+}
+
+PoolAllocator::Stats PoolAllocator::stats() const
+{
+    Stats stats;
+    {
+        std::lock_guard<spin_lock> lock(chunk_lock);
+        for (auto &chunk : chunks)
+            stats.chunk_bytes += chunk.first;
+    }
+    stats.large_allocations = num_large_allocations.load(std::memory_order_relaxed);
+    return stats;
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,82 @@
+#pragma once
+#include "memory_util.h"
+#include "parallel.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace ks
+{
+
+// Thread-safe allocator for many small allocations made concurrently (e.g. texture tiles of TextureTileCache).
+// Requests are rounded up to power-of-two size classes. Each thread keeps a small cache of free blocks per class, and
+// overflows/refills go through a lock-free global freelist per class, so allocate/free are O(1) and normally touch no
+// shared state. Requests larger than max_pooled_size go straight to alloc_aligned.
+// Unlike BlockAllocator, free() really returns memory (to the pool). Chunks are only released on destruction.
+class PoolAllocator final : public Allocator
+{
+  public:
+    PoolAllocator();
+    ~PoolAllocator();
+
+    PoolAllocator(const PoolAllocator &other) = delete;
+    PoolAllocator &operator=(const PoolAllocator &other) = delete;
+
+    void *allocate(size_t byte_count) final;
+    void free(void *bytes) final;
+
+    static constexpr size_t min_pooled_size = 16;
+    static constexpr int num_size_classes = 13;
+    static constexpr size_t max_pooled_size = min_pooled_size << (num_size_classes - 1);
+
+    struct Stats
+    {
+        size_t chunk_bytes = 0;
+        size_t large_allocations = 0;
+    };
+    Stats stats() const;
+
+  private:
+    // Prepended to every allocation. Free blocks reuse it as a freelist link.
+    struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) Header
+    {
+        union {
+            Header *next;
+            size_t large_size;
+        };
+        uint32_t size_class;
+    };
+    static constexpr uint32_t large_class = ~0u;
+
+    // Treiber stack. The upper 16 bits of the head hold an ABA tag (user-space pointers fit in 48 bits on the
+    // platforms we target).
+    struct FreeList
+    {
+        void push(Header *node);
+        Header *pop();
+
+        std::atomic<uint64_t> head{0};
+    };
+
+    struct ThreadCache
+    {
+        static constexpr uint32_t capacity = 64;
+
+        std::array<Header *, num_size_classes> heads{};
+        std::array<uint32_t, num_size_classes> counts{};
+    };
+
+    static int size_class(size_t byte_count);
+    static size_t block_size(int size_class) { return sizeof(Header) + (min_pooled_size << size_class); }
+    Header *refill(int size_class);
+
+    std::array<FreeList, num_size_classes> global_lists;
+    Combinable<ThreadCache> caches;
+
+    // Chunk bookkeeping is rare enough to just lock.
+    mutable spin_lock chunk_lock;
+    std::vector<std::pair<size_t, std::byte *>> chunks;
+    std::atomic<size_t> num_large_allocations{0};
+};
+
+} // namespace ks
\ No newline at end of file
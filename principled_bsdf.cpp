@@ -1,22 +1,61 @@
 #include "principled_bsdf.h"
 #include "fresnel.h"
+#include "memory_util.h"
 #include "rng.h"
+#include <type_traits>
+#include <typeinfo>
 
 namespace ks
 {
 
+namespace
+{
+
+template <typename PrincipledType>
+struct PrincipledClosure : public BSDFClosure
+{
+    using internal = typename PrincipledType::internal;
+
+    explicit PrincipledClosure(const typename PrincipledType::Closure &closure) : closure(closure) {}
+
+    bool delta() const { return false; }
+    color3 eval(const vec3 &wo, const vec3 &wi) const { return internal::eval(wo, wi, closure); }
+    color3 sample(const vec3 &wo, vec3 &wi, const vec2 &u, float &pdf) const
+    {
+        return internal::sample(wo, wi, closure, u, pdf);
+    }
+    float pdf(const vec3 &wo, const vec3 &wi) const { return internal::pdf(wo, wi, closure); }
+    bool queue_eval(const vec3 &wo, const vec3 &wi, BSDFEvalBatch &batch) const
+    {
+        // Other microfacet models would only take the scalar fallback of eval_and_pdf_n.
+        if constexpr (std::is_same_v<PrincipledType, PrincipledBSDF>) {
+            if (dynamic_cast<const MicrofacetAdapterDerived<GGX> *>(closure.microfacet)) {
+                batch.push(wo, wi, closure);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    typename PrincipledType::Closure closure;
+};
+
+} // namespace
+
 PrincipledBRDF::Closure PrincipledBRDF::eval_closure(const Intersection &it) const
 {
     Closure closure;
-    closure.basecolor = (*basecolor)(it);
+    FusedFieldFetch<4>::Lookups lookups;
+    fused_fields.lookup(it, lookups);
+    closure.basecolor = fused_fields.get(lookups, 0, *basecolor);
     closure.basecolor = clamp(closure.basecolor, color3::Zero(), color3::Ones());
-    closure.ax = (*roughness)(it)[0];
+    closure.ax = fused_fields.get(lookups, 1, *roughness)[0];
     closure.ax = clamp(closure.ax, 0.0f, 1.0f);
     closure.ax = sqr(closure.ax);
     closure.ay = closure.ax;
-    closure.metallic = (*metallic)(it)[0];
+    closure.metallic = fused_fields.get(lookups, 2, *metallic)[0];
     closure.metallic = clamp(closure.metallic, 0.0f, 1.0f);
-    closure.specular = (*specular)(it)[0];
+    closure.specular = fused_fields.get(lookups, 3, *specular)[0];
     closure.specular = clamp(closure.specular, 0.0f, 1.0f) * 0.08f;
     closure.microfacet = &*microfacet;
     return closure;
@@ -40,6 +79,11 @@ float PrincipledBRDF::pdf(const vec3 &wo, const vec3 &wi, const Intersection &it
     return internal::pdf(wo, wi, closure);
 }
 
+const BSDFClosure *PrincipledBRDF::closure(const Intersection &it, Allocator &arena) const
+{
+    return arena.allocate_typed<PrincipledClosure<PrincipledBRDF>>(eval_closure(it));
+}
+
 color3 PrincipledBRDF::internal::eval(const vec3 &wo, const vec3 &wi, const Closure &closure)
 {
     if (wo.z() == 0.0f || wi.z() == 0.0f) {
@@ -90,7 +134,7 @@ color3 PrincipledBRDF::internal::sample(const vec3 &wo, vec3 &wi, const Closure
     }
 
     pdf = pdf_lobe.dot(sample_weights);
-    ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+    ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     return eval(wo, wi, closure) / pdf;
 }
 
@@ -135,7 +179,7 @@ color3 PrincipledBRDF::internal::eval_specular(const vec3 &wo, const vec3 &wi, c
     color3 R0 = lerp(color3::Constant(c.specular), c.basecolor, c.metallic);
     color3 Fr = lerp(R0, color3::Ones(), fresnel_schlick(wo.dot(wh)));
     color3 f = D * G * Fr / (4.0f * wo.z());
-    ASSERT(f.allFinite() && (f >= 0.0f).all());
+    ASSERT_HOT(f.allFinite() && (f >= 0.0f).all());
     return f;
 }
 
@@ -157,7 +201,7 @@ vec2 PrincipledBRDF::internal::lobe_sample_weights(const vec3 &wo, const Closure
     weight_specular = weight_specular * inv_sum;
 
     vec2 weights(weight_diffuse, weight_specular);
-    ASSERT(weights.allFinite() && (weights.array() >= 0.0f).all());
+    ASSERT_HOT(weights.allFinite() && (weights.array() >= 0.0f).all());
     return weights;
 }
 
@@ -186,7 +230,7 @@ vec3 PrincipledBRDF::internal::sample_specular(const vec3 &wo, const Closure &c,
     float D = c.microfacet->D(c.ax, c.ay, wh);
     float G1 = c.microfacet->G1(c.ax, c.ay, wo);
     pdf = D * G1 / (4.0f * std::abs(wo.z()));
-    ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+    ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     return wi;
 }
 
@@ -201,7 +245,7 @@ float PrincipledBRDF::internal::pdf_specular(const vec3 &wo, const vec3 &wi, con
     float D = c.microfacet->D(c.ax, c.ay, wh);
     float G1 = c.microfacet->G1(c.ax, c.ay, wo);
     float pdf = D * G1 / (4.0f * std::abs(wo.z()));
-    ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+    ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     return pdf;
 }
 
@@ -213,6 +257,8 @@ std::unique_ptr<PrincipledBRDF> create_principled_brdf(const ConfigArgs &args)
     bsdf->roughness = args.asset_table().create_in_place<ShaderField1>("shader_field_1", args["roughness"]);
     bsdf->metallic = args.asset_table().create_in_place<ShaderField1>("shader_field_1", args["metallic"]);
     bsdf->specular = args.asset_table().create_in_place<ShaderField1>("shader_field_1", args["specular"]);
+    bsdf->fused_fields = FusedFieldFetch<4>({bsdf->basecolor.get(), bsdf->roughness.get(), bsdf->metallic.get(),
+                                             bsdf->specular.get()});
     std::string m = args.load_string("microfacet", "ggx");
     if (m == "ggx") {
         bsdf->microfacet = std::make_unique<MicrofacetAdapterDerived<GGX>>();
@@ -228,17 +274,19 @@ std::unique_ptr<PrincipledBRDF> create_principled_brdf(const ConfigArgs &args)
 PrincipledBSDF::Closure PrincipledBSDF::eval_closure(const Intersection &it) const
 {
     Closure closure;
-    closure.basecolor = (*basecolor)(it);
+    FusedFieldFetch<5>::Lookups lookups;
+    fused_fields.lookup(it, lookups);
+    closure.basecolor = fused_fields.get(lookups, 0, *basecolor);
     closure.basecolor = clamp(closure.basecolor, color3::Zero(), color3::Ones());
-    closure.ax = (*roughness)(it)[0];
+    closure.ax = fused_fields.get(lookups, 1, *roughness)[0];
     closure.ax = clamp(closure.ax, 0.0f, 1.0f);
     closure.ax = sqr(closure.ax);
     closure.ay = closure.ax;
-    closure.metallic = (*metallic)(it)[0];
+    closure.metallic = fused_fields.get(lookups, 2, *metallic)[0];
     closure.metallic = clamp(closure.metallic, 0.0f, 1.0f);
-    closure.ior = (*ior)(it)[0];
+    closure.ior = fused_fields.get(lookups, 3, *ior)[0];
     closure.ior = clamp(closure.ior, 1.0f, 4.0f);
-    closure.specular_trans = (*specular_trans)(it)[0];
+    closure.specular_trans = fused_fields.get(lookups, 4, *specular_trans)[0];
     closure.specular_trans = clamp(closure.specular_trans, 0.0f, 1.0f);
     closure.microfacet = &*microfacet;
     return closure;
@@ -262,6 +310,11 @@ float PrincipledBSDF::pdf(const vec3 &wo, const vec3 &wi, const Intersection &it
     return internal::pdf(wo, wi, closure);
 }
 
+const BSDFClosure *PrincipledBSDF::closure(const Intersection &it, Allocator &arena) const
+{
+    return arena.allocate_typed<PrincipledClosure<PrincipledBSDF>>(eval_closure(it));
+}
+
 ks::color3 PrincipledBSDF::internal::eval(const ks::vec3 &wo, const ks::vec3 &wi, const Closure &closure)
 {
     if (wo.z() == 0.0f || wi.z() == 0.0f) {
@@ -326,7 +379,7 @@ ks::color3 PrincipledBSDF::internal::sample(const ks::vec3 &wo, ks::vec3 &wi, co
     }
 
     pdf = pdf_lobe.dot(sample_weights);
-    ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+    ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     return eval(wo, wi, closure) / pdf;
 }
 
@@ -376,7 +429,7 @@ color3 PrincipledBSDF::internal::eval_metallic_specular(const vec3 &wo, const ve
     float G = c.microfacet->G2(c.ax, c.ay, wo, wi);
     color3 Fr = lerp(c.basecolor, color3::Ones(), fresnel_schlick(wo.dot(wh)));
     color3 f = lobe_weight * D * G * Fr / (4.0f * wo.z());
-    ASSERT(f.allFinite() && (f >= 0.0f).all());
+    ASSERT_HOT(f.allFinite() && (f >= 0.0f).all());
     return f;
 }
 
@@ -422,7 +475,7 @@ color3 PrincipledBSDF::internal::eval_dielectric_specular(const vec3 &wo, const
         f = color3::Constant(specular);
     }
     f *= lobe_weight;
-    ASSERT(f.allFinite() && (f >= 0.0f).all());
+    ASSERT_HOT(f.allFinite() && (f >= 0.0f).all());
     return f;
 }
 
@@ -448,7 +501,7 @@ vec3 PrincipledBSDF::internal::lobe_sample_weights(const vec3 &wo, const Closure
     weight_dielectric_specular = weight_dielectric_specular * inv_sum;
 
     vec3 weights(weight_diffuse, weight_metallic_specular, weight_dielectric_specular);
-    ASSERT(weights.allFinite() && (weights.array() >= 0.0f).all());
+    ASSERT_HOT(weights.allFinite() && (weights.array() >= 0.0f).all());
     return weights;
 }
 
@@ -477,7 +530,7 @@ vec3 PrincipledBSDF::internal::sample_metallic_specular(const vec3 &wo, const Cl
     float D = c.microfacet->D(c.ax, c.ay, wh);
     float G1 = c.microfacet->G1(c.ax, c.ay, wo);
     pdf = D * G1 / (4.0f * std::abs(wo.z()));
-    ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+    ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     return wi;
 }
 
@@ -509,7 +562,7 @@ vec3 PrincipledBSDF::internal::sample_dielectric_specular(const vec3 &wo, const
         }
         pdf = D * G1 / (4.0f * std::abs(wo.z()));
         pdf *= Fr / (Fr + (1.0f - Fr) * c.specular_trans);
-        ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+        ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     } else {
         // sample refraction
         if (!refract(wo, sgn(wo.z()) * wh, 1.0f / eta, wi)) {
@@ -526,7 +579,7 @@ vec3 PrincipledBSDF::internal::sample_dielectric_specular(const vec3 &wo, const
         float jacobian = eta * eta * std::abs(wi.dot(wh)) / denom;
         pdf = D * G1 * std::abs(wo.dot(wh)) / std::abs(wo.z()) * jacobian;
         pdf *= (1.0f - Fr) * c.specular_trans / (Fr + (1.0f - Fr) * c.specular_trans);
-        ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+        ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     }
 
     return wi;
@@ -543,7 +596,7 @@ float PrincipledBSDF::internal::pdf_metallic_specular(const vec3 &wo, const vec3
     float D = c.microfacet->D(c.ax, c.ay, wh);
     float G1 = c.microfacet->G1(c.ax, c.ay, wo);
     float pdf = D * G1 / (4.0f * std::abs(wo.z()));
-    ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+    ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     return pdf;
 }
 
@@ -569,17 +622,261 @@ float PrincipledBSDF::internal::pdf_dielectric_specular(const ks::vec3 &wo, cons
     if (reflect) {
         pdf = D * G1 / (4.0f * std::abs(wo.z()));
         pdf *= Fr / (Fr + (1.0f - Fr) * c.specular_trans);
-        ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+        ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     } else {
         float denom = sqr(wo.dot(wh) + eta * wi.dot(wh));
         float jacobian = eta * eta * std::abs(wi.dot(wh)) / denom;
         pdf = D * G1 * std::abs(wo.dot(wh)) / std::abs(wo.z()) * jacobian;
         pdf *= (1.0f - Fr) * c.specular_trans / (Fr + (1.0f - Fr) * c.specular_trans);
-        ASSERT(std::isfinite(pdf) && pdf >= 0.0f);
+        ASSERT_HOT(std::isfinite(pdf) && pdf >= 0.0f);
     }
     return pdf;
 }
 
+void PrincipledBSDF::ClosureBatch::resize(uint32_t n)
+{
+    for (auto &c : basecolor)
+        c.resize(n);
+    ax.resize(n);
+    ay.resize(n);
+    metallic.resize(n);
+    ior.resize(n);
+    specular_trans.resize(n);
+}
+
+void PrincipledBSDF::ClosureBatch::set(uint32_t i, const Closure &closure)
+{
+    ASSERT(!microfacet || typeid(*microfacet) == typeid(*closure.microfacet),
+           "All closures in a batch must share the microfacet model.");
+    microfacet = closure.microfacet;
+    for (int c = 0; c < 3; ++c)
+        basecolor[c][i] = closure.basecolor[c];
+    ax[i] = closure.ax;
+    ay[i] = closure.ay;
+    metallic[i] = closure.metallic;
+    ior[i] = closure.ior;
+    specular_trans[i] = closure.specular_trans;
+}
+
+PrincipledBSDF::Closure PrincipledBSDF::ClosureBatch::get(uint32_t i) const
+{
+    Closure closure;
+    closure.basecolor = color3(basecolor[0][i], basecolor[1][i], basecolor[2][i]);
+    closure.ax = ax[i];
+    closure.ay = ay[i];
+    closure.metallic = metallic[i];
+    closure.ior = ior[i];
+    closure.specular_trans = specular_trans[i];
+    closure.microfacet = microfacet;
+    return closure;
+}
+
+// Per-lane kernels for the batched versions. These mirror the scalar code above with branches turned into selects.
+// Values computed for lanes that the scalar code would early out are discarded by the selects.
+namespace
+{
+
+inline void normalize_lane(float &x, float &y, float &z)
+{
+    // Same as Eigen normalized(): leave zero vectors alone.
+    float n2 = x * x + y * y + z * z;
+    float n = n2 > 0.0f ? std::sqrt(n2) : 1.0f;
+    x /= n;
+    y /= n;
+    z /= n;
+}
+
+inline void lobe_sample_weights_lane(float wo_z, float lum_basecolor, float metallic, float ior, float specular_trans,
+                                     float &weight_diffuse, float &weight_metallic_specular,
+                                     float &weight_dielectric_specular)
+{
+    bool upper = wo_z > 0.0f;
+    weight_diffuse = upper ? (1.0f - metallic) * (1.0f - specular_trans) * lum_basecolor * inv_pi : 0.0f;
+    weight_metallic_specular = upper ? metallic * std::lerp(lum_basecolor, 1.0f, fresnel_schlick(wo_z)) : 0.0f;
+    float eta = wo_z >= 0.0f ? ior : (1.0f / ior);
+    weight_dielectric_specular = (1.0f - metallic) * fresnel_dielectric(std::abs(wo_z), 1.0f / eta);
+
+    float sum = weight_diffuse + weight_metallic_specular + weight_dielectric_specular;
+    float inv_sum = sum == 0.0f ? 0.0f : 1.0f / sum;
+    weight_diffuse = weight_diffuse * inv_sum;
+    weight_metallic_specular = weight_metallic_specular * inv_sum;
+    weight_dielectric_specular = weight_dielectric_specular * inv_sum;
+}
+
+inline float luminance_lane(float r, float g, float b)
+{
+    constexpr float lum_weight[3] = {0.212671f, 0.715160f, 0.072169f};
+    return lum_weight[0] * r + lum_weight[1] * g + lum_weight[2] * b;
+}
+
+} // namespace
+
+void PrincipledBSDF::internal::lobe_sample_weights_n(const Float3Batch &wo, const ClosureBatch &c, Float3Batch &weights)
+{
+    uint32_t n = wo.size();
+    ASSERT(c.size() == n && weights.size() == n);
+    for (uint32_t i = 0; i < n; ++i) {
+        float lum_basecolor = luminance_lane(c.basecolor[0][i], c.basecolor[1][i], c.basecolor[2][i]);
+        lobe_sample_weights_lane(wo.z[i], lum_basecolor, c.metallic[i], c.ior[i], c.specular_trans[i], weights.x[i],
+                                 weights.y[i], weights.z[i]);
+    }
+}
+
+void PrincipledBSDF::internal::lobe_sample_weights_n_scalar(const Float3Batch &wo, const ClosureBatch &c,
+                                                            Float3Batch &weights)
+{
+    uint32_t n = wo.size();
+    ASSERT(c.size() == n && weights.size() == n);
+    for (uint32_t i = 0; i < n; ++i) {
+        weights.set(i, lobe_sample_weights(wo.get(i), c.get(i)));
+    }
+}
+
+void PrincipledBSDF::internal::eval_and_pdf_n(const Float3Batch &wo, const Float3Batch &wi, const ClosureBatch &c,
+                                              Float3Batch &f, std::span<float> pdf)
+{
+    if (!dynamic_cast<const MicrofacetAdapterDerived<GGX> *>(c.microfacet)) {
+        eval_and_pdf_n_scalar(wo, wi, c, f, pdf);
+        return;
+    }
+
+    uint32_t n = wo.size();
+    ASSERT(wi.size() == n && c.size() == n && f.size() == n && pdf.size() == n);
+
+    static thread_local Float3Batch weights;
+    static thread_local std::vector<float> lambda_o, lambda_i, G1, G2;
+    weights.resize(n);
+    lambda_o.resize(n);
+    lambda_i.resize(n);
+    G1.resize(n);
+    G2.resize(n);
+
+    lobe_sample_weights_n(wo, c, weights);
+    GGXBatch::lambda_n(n, c.ax.data(), c.ay.data(), wo.x.data(), wo.y.data(), wo.z.data(), lambda_o.data());
+    GGXBatch::lambda_n(n, c.ax.data(), c.ay.data(), wi.x.data(), wi.y.data(), wi.z.data(), lambda_i.data());
+    GGXBatch::G1_n(n, lambda_o.data(), G1.data());
+    GGXBatch::G2_n(n, lambda_o.data(), lambda_i.data(), wo.z.data(), wi.z.data(), G2.data());
+
+    for (uint32_t i = 0; i < n; ++i) {
+        float ox = wo.x[i], oy = wo.y[i], oz = wo.z[i];
+        float ix = wi.x[i], iy = wi.y[i], iz = wi.z[i];
+        float br = c.basecolor[0][i], bg = c.basecolor[1][i], bb = c.basecolor[2][i];
+        float ax = c.ax[i], ay = c.ay[i];
+        float metallic = c.metallic[i], ior = c.ior[i], specular_trans = c.specular_trans[i];
+
+        bool valid = oz != 0.0f && iz != 0.0f;
+        bool upper = oz > 0.0f && iz > 0.0f;
+
+        // diffuse
+        float lw_diffuse = (1.0f - metallic) * (1.0f - specular_trans);
+        bool has_diffuse = upper && lw_diffuse != 0.0f;
+        float fd_r = lw_diffuse * br * inv_pi * iz;
+        float fd_g = lw_diffuse * bg * inv_pi * iz;
+        float fd_b = lw_diffuse * bb * inv_pi * iz;
+        float pdf_diffuse = iz * inv_pi;
+
+        // metallic specular
+        float hx = ox + ix, hy = oy + iy, hz = oz + iz;
+        normalize_lane(hx, hy, hz);
+        float D_metallic = GGXBatch::D(ax, ay, hx, hy, hz);
+        float Fs = fresnel_schlick(ox * hx + oy * hy + oz * hz);
+        bool has_metallic = upper && metallic != 0.0f;
+        float fm = metallic * D_metallic * G2[i];
+        float fm_r = fm * ((1.0f - Fs) * br + Fs) / (4.0f * oz);
+        float fm_g = fm * ((1.0f - Fs) * bg + Fs) / (4.0f * oz);
+        float fm_b = fm * ((1.0f - Fs) * bb + Fs) / (4.0f * oz);
+        float pdf_metallic = D_metallic * G1[i] / (4.0f * std::abs(oz));
+
+        // dielectric specular
+        bool reflect = oz * iz >= 0.0f;
+        float eta = oz >= 0.0f ? ior : (1.0f / ior);
+        float lw_dielectric = 1.0f - metallic;
+        bool has_dielectric = lw_dielectric != 0.0f;
+        lw_dielectric *= reflect ? 1.0f : specular_trans;
+        float sx = reflect ? ox + ix : ox + ix * eta;
+        float sy = reflect ? oy + iy : oy + iy * eta;
+        float sz = reflect ? oz + iz : oz + iz * eta;
+        normalize_lane(sx, sy, sz);
+        float flip = sz < 0.0f ? -1.0f : 1.0f;
+        sx *= flip;
+        sy *= flip;
+        sz *= flip;
+        float D_dielectric = GGXBatch::D(ax, ay, sx, sy, sz);
+        float wo_dot_wh = ox * sx + oy * sy + oz * sz;
+        float wi_dot_wh = ix * sx + iy * sy + iz * sz;
+        float Fr = fresnel_dielectric(std::abs(wo_dot_wh), 1.0f / eta);
+        float denom = sqr(wo_dot_wh + eta * wi_dot_wh);
+        float fs_reflect = D_dielectric * G2[i] * Fr / (4.0f * std::abs(oz));
+        float fs_refract =
+            std::abs(D_dielectric * G2[i] * (1.0f - Fr) * wo_dot_wh * wi_dot_wh / (denom * oz));
+        float fs = has_dielectric ? (reflect ? fs_reflect : fs_refract) * lw_dielectric : 0.0f;
+        float pick_reflect = Fr + (1.0f - Fr) * specular_trans;
+        float pdf_reflect = D_dielectric * G1[i] / (4.0f * std::abs(oz)) * (Fr / pick_reflect);
+        float jacobian = eta * eta * std::abs(wi_dot_wh) / denom;
+        float pdf_refract = D_dielectric * G1[i] * std::abs(wo_dot_wh) / std::abs(oz) * jacobian *
+                            ((1.0f - Fr) * specular_trans / pick_reflect);
+        float pdf_dielectric = reflect ? pdf_reflect : pdf_refract;
+
+        float f_r = (has_diffuse ? fd_r : 0.0f) + (has_metallic ? fm_r : 0.0f) + fs;
+        float f_g = (has_diffuse ? fd_g : 0.0f) + (has_metallic ? fm_g : 0.0f) + fs;
+        float f_b = (has_diffuse ? fd_b : 0.0f) + (has_metallic ? fm_b : 0.0f) + fs;
+        f.x[i] = valid ? f_r : 0.0f;
+        f.y[i] = valid ? f_g : 0.0f;
+        f.z[i] = valid ? f_b : 0.0f;
+
+        float w0 = weights.x[i], w1 = weights.y[i], w2 = weights.z[i];
+        bool no_weight = w0 == 0.0f && w1 == 0.0f && w2 == 0.0f;
+        w0 = upper ? w0 : 0.0f;
+        w1 = upper ? w1 : 0.0f;
+        w2 = upper ? w2 : 1.0f;
+        float p = (upper ? pdf_diffuse * w0 + pdf_metallic * w1 : 0.0f) + pdf_dielectric * w2;
+        pdf[i] = (valid && !no_weight) ? p : 0.0f;
+    }
+}
+
+void PrincipledBSDF::internal::eval_and_pdf_n_scalar(const Float3Batch &wo, const Float3Batch &wi,
+                                                     const ClosureBatch &c, Float3Batch &f, std::span<float> pdf)
+{
+    uint32_t n = wo.size();
+    ASSERT(wi.size() == n && c.size() == n && f.size() == n && pdf.size() == n);
+    for (uint32_t i = 0; i < n; ++i) {
+        vec3 wo_i = wo.get(i);
+        vec3 wi_i = wi.get(i);
+        Closure closure = c.get(i);
+        color3 fi = eval(wo_i, wi_i, closure);
+        f.x[i] = fi[0];
+        f.y[i] = fi[1];
+        f.z[i] = fi[2];
+        pdf[i] = internal::pdf(wo_i, wi_i, closure);
+    }
+}
+
+void BSDFEvalBatch::clear()
+{
+    wo.resize(0);
+    wi.resize(0);
+    closures.resize(0);
+    closures.microfacet = nullptr;
+}
+
+void BSDFEvalBatch::push(const vec3 &wo, const vec3 &wi, const PrincipledBSDF::Closure &closure)
+{
+    uint32_t i = size();
+    this->wo.resize(i + 1);
+    this->wo.set(i, wo);
+    this->wi.resize(i + 1);
+    this->wi.set(i, wi);
+    closures.resize(i + 1);
+    closures.set(i, closure);
+}
+
+void BSDFEvalBatch::eval()
+{
+    f.resize(size());
+    pdf.resize(size());
+    PrincipledBSDF::internal::eval_and_pdf_n(wo, wi, closures, f, pdf);
+}
+
 std::unique_ptr<PrincipledBSDF> create_principled_bsdf(const ConfigArgs &args)
 {
     printf("The current implementation of Principled B[S]DF may require some rework!!!\n");
@@ -591,6 +888,8 @@ std::unique_ptr<PrincipledBSDF> create_principled_bsdf(const ConfigArgs &args)
     bsdf->metallic = args.asset_table().create_in_place<ShaderField1>("shader_field_1", args["metallic"]);
     bsdf->ior = args.asset_table().create_in_place<ShaderField1>("shader_field_1", args["ior"]);
     bsdf->specular_trans = args.asset_table().create_in_place<ShaderField1>("shader_field_1", args["specular_trans"]);
+    bsdf->fused_fields = FusedFieldFetch<5>({bsdf->basecolor.get(), bsdf->roughness.get(), bsdf->metallic.get(),
+                                             bsdf->ior.get(), bsdf->specular_trans.get()});
     std::string m = args.load_string("microfacet", "ggx");
     if (m == "ggx") {
         bsdf->microfacet = std::make_unique<MicrofacetAdapterDerived<GGX>>();
@@ -3,6 +3,9 @@
 #include "config.h"
 #include "microfacet.h"
 #include "shader_field.h"
+#include <array>
+#include <span>
+#include <vector>
 
 namespace ks
 {
@@ -28,6 +31,8 @@ struct PrincipledBRDF : public ks::BSDF
     ks::color3 sample(const ks::vec3 &wo, ks::vec3 &wi, const ks::Intersection &it, const ks::vec2 &u,
                       float &pdf) const;
     float pdf(const ks::vec3 &wo, const ks::vec3 &wi, const ks::Intersection &it) const;
+    // Evaluates eval_closure(it) once for all subsequent queries.
+    const ks::BSDFClosure *closure(const ks::Intersection &it, ks::Allocator &arena) const;
 
     struct internal
     {
@@ -53,6 +58,8 @@ struct PrincipledBRDF : public ks::BSDF
     std::unique_ptr<ks::ShaderField1> roughness;
     std::unique_ptr<ks::ShaderField1> metallic;
     std::unique_ptr<ks::ShaderField1> specular;
+    // Over (basecolor, roughness, metallic, specular). Rebuild after replacing a field.
+    ks::FusedFieldFetch<4> fused_fields;
 
     std::unique_ptr<ks::MicrofacetAdapter> microfacet;
 };
@@ -77,12 +84,48 @@ struct PrincipledBSDF : public ks::BSDF
     };
     Closure eval_closure(const ks::Intersection &it) const;
 
+    // SoA batches for the batched kernels below, one lane per (wo, wi, closure) tuple.
+    struct Float3Batch
+    {
+        void resize(uint32_t n)
+        {
+            x.resize(n);
+            y.resize(n);
+            z.resize(n);
+        }
+        uint32_t size() const { return (uint32_t)x.size(); }
+        void set(uint32_t i, const ks::vec3 &v)
+        {
+            x[i] = v.x();
+            y[i] = v.y();
+            z[i] = v.z();
+        }
+        ks::vec3 get(uint32_t i) const { return ks::vec3(x[i], y[i], z[i]); }
+
+        std::vector<float> x, y, z;
+    };
+
+    struct ClosureBatch
+    {
+        void resize(uint32_t n);
+        uint32_t size() const { return (uint32_t)ax.size(); }
+        void set(uint32_t i, const Closure &closure);
+        Closure get(uint32_t i) const;
+
+        std::array<std::vector<float>, 3> basecolor;
+        std::vector<float> ax, ay, metallic, ior, specular_trans;
+        // NOTE: all closures in a batch must share the same microfacet model (the adapters may differ).
+        const ks::MicrofacetAdapter *microfacet = nullptr;
+    };
+
     // NOTE: return cosine-weighted bsdf: f*cos(theta_i)
     ks::color3 eval(const ks::vec3 &wo, const ks::vec3 &wi, const ks::Intersection &it) const;
     // NOTE: return cosine-weighted throughput weight: (f*cos(theta_i) / pdf)
     ks::color3 sample(const ks::vec3 &wo, ks::vec3 &wi, const ks::Intersection &it, const ks::vec2 &u,
                       float &pdf) const;
     float pdf(const ks::vec3 &wo, const ks::vec3 &wi, const ks::Intersection &it) const;
+    // Evaluates eval_closure(it) once for all subsequent queries.
+    const ks::BSDFClosure *closure(const ks::Intersection &it, ks::Allocator &arena) const;
 
     struct internal
     {
@@ -93,6 +136,17 @@ struct PrincipledBSDF : public ks::BSDF
                                  float &pdf);
         static float pdf(const ks::vec3 &wo, const ks::vec3 &wi, const Closure &closure);
 
+        // Batched eval() + pdf() and lobe_sample_weights(). Outputs must be sized like the inputs.
+        // GGX batches run branch-free SoA loops (see GGXBatch); other microfacet models use the scalar fallback.
+        // Both paths agree up to floating point rounding.
+        static void eval_and_pdf_n(const Float3Batch &wo, const Float3Batch &wi, const ClosureBatch &closure,
+                                   Float3Batch &f, std::span<float> pdf);
+        static void eval_and_pdf_n_scalar(const Float3Batch &wo, const Float3Batch &wi, const ClosureBatch &closure,
+                                          Float3Batch &f, std::span<float> pdf);
+        static void lobe_sample_weights_n(const Float3Batch &wo, const ClosureBatch &closure, Float3Batch &weights);
+        static void lobe_sample_weights_n_scalar(const Float3Batch &wo, const ClosureBatch &closure,
+                                                 Float3Batch &weights);
+
         static ks::color3 eval_diffuse(const ks::vec3 &wo, const ks::vec3 &wi, const Closure &closure);
         static ks::color3 eval_metallic_specular(const ks::vec3 &wo, const ks::vec3 &wi, const Closure &closure);
         static ks::color3 eval_dielectric_specular(const ks::vec3 &wo, const ks::vec3 &wi, const Closure &closure);
@@ -114,10 +168,33 @@ struct PrincipledBSDF : public ks::BSDF
     std::unique_ptr<ks::ShaderField1> metallic;
     std::unique_ptr<ks::ShaderField1> ior;
     std::unique_ptr<ks::ShaderField1> specular_trans;
+    // Over (basecolor, roughness, metallic, ior, specular_trans). Rebuild after replacing a field.
+    ks::FusedFieldFetch<5> fused_fields;
 
     std::unique_ptr<ks::MicrofacetAdapter> microfacet;
 };
 
 std::unique_ptr<PrincipledBSDF> create_principled_bsdf(const ks::ConfigArgs &args);
 
+// eval_and_pdf queries of GGX principled BSDF closures, evaluated together by PrincipledBSDF::internal::eval_and_pdf_n
+// (e.g. the NEE light samples of a wavefront shading stream, see ShadowRayQueue).
+struct BSDFEvalBatch
+{
+    uint32_t size() const { return wo.size(); }
+    void clear();
+    void push(const ks::vec3 &wo, const ks::vec3 &wi, const PrincipledBSDF::Closure &closure);
+    // Fills f and pdf for all queued queries.
+    void eval();
+
+    PrincipledBSDF::Float3Batch wo;
+    PrincipledBSDF::Float3Batch wi;
+    PrincipledBSDF::ClosureBatch closures;
+    PrincipledBSDF::Float3Batch f;
+    std::vector<float> pdf;
+};
+
+// Compares the batched kernels (eval_and_pdf_n, lobe_sample_weights_n) against the scalar eval/pdf over random
+// closures and directions, for both microfacet models. Asserts on mismatch.
+void test_principled_bsdf_batch_task(const ks::ConfigArgs &args, const fs::path &task_dir, int task_id);
+
 } // namespace ks
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "principled_bsdf.h"
+#include "rng.h"
+#include "test_util.h"
+#include <fstream>
+#include <sstream>
+
+namespace ks
+{
+
+// Relative error, with an absolute floor so that values near zero don't blow it up.
+static float relative_error(float a, float b)
+{
+    return std::abs(a - b) / std::max({std::abs(a), std::abs(b), 1e-3f});
+}
+
+template <typename M>
+static void test_principled_bsdf_batch(const fs::path &output_dir, uint32_t n, uint64_t seed, float tolerance)
+{
+    using internal = PrincipledBSDF::internal;
+    MicrofacetAdapterDerived<M> microfacet;
+    RNG rng(seed);
+
+    PrincipledBSDF::Float3Batch wo, wi;
+    PrincipledBSDF::ClosureBatch closures;
+    wo.resize(n);
+    wi.resize(n);
+    closures.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        PrincipledBSDF::Closure closure;
+        closure.basecolor = color3(rng.next(), rng.next(), rng.next());
+        // Both isotropic and anisotropic lanes, including the alpha clamp.
+        closure.ax = rng.next();
+        closure.ay = i % 2 == 0 ? closure.ax : rng.next();
+        // Exact 0 and 1 take the early outs of the scalar code.
+        closure.metallic = i % 5 == 0 ? 0.0f : (i % 5 == 1 ? 1.0f : rng.next());
+        closure.ior = 1.0f + rng.next();
+        closure.specular_trans = i % 7 == 0 ? 0.0f : rng.next();
+        closure.microfacet = &microfacet;
+        closures.set(i, closure);
+        // Reflection and transmission in both hemispheres.
+        wo.set(i, sample_uniform_sphere(rng.next2d()));
+        wi.set(i, sample_uniform_sphere(rng.next2d()));
+    }
+
+    PrincipledBSDF::Float3Batch f, weights;
+    std::vector<float> pdf(n);
+    f.resize(n);
+    weights.resize(n);
+    internal::eval_and_pdf_n(wo, wi, closures, f, pdf);
+    internal::lobe_sample_weights_n(wo, closures, weights);
+
+    float max_f_error = 0.0f;
+    float max_pdf_error = 0.0f;
+    float max_weight_error = 0.0f;
+    uint32_t failures = 0;
+    std::ofstream log(output_dir / "failures.txt");
+    for (uint32_t i = 0; i < n; ++i) {
+        PrincipledBSDF::Closure closure = closures.get(i);
+        color3 f_ref = internal::eval(wo.get(i), wi.get(i), closure);
+        float pdf_ref = internal::pdf(wo.get(i), wi.get(i), closure);
+        vec3 weights_ref = internal::lobe_sample_weights(wo.get(i), closure);
+        float f_error = 0.0f;
+        float weight_error = 0.0f;
+        for (int c = 0; c < 3; ++c) {
+            f_error = std::max(f_error, relative_error(f_ref[c], f.get(i)[c]));
+            weight_error = std::max(weight_error, relative_error(weights_ref[c], weights.get(i)[c]));
+        }
+        float pdf_error = relative_error(pdf_ref, pdf[i]);
+        max_f_error = std::max(max_f_error, f_error);
+        max_pdf_error = std::max(max_pdf_error, pdf_error);
+        max_weight_error = std::max(max_weight_error, weight_error);
+        if (f_error > tolerance || pdf_error > tolerance || weight_error > tolerance) {
+            ++failures;
+            log << i << ": f " << f_ref.transpose() << " vs " << f.get(i).transpose() << ", pdf " << pdf_ref << " vs "
+                << pdf[i] << ", weights " << weights_ref.transpose() << " vs " << weights.get(i).transpose() << "\n";
+        }
+    }
+    printf("Max relative error over %u lanes: f %g, pdf %g, lobe weights %g.\n", n, max_f_error, max_pdf_error,
+           max_weight_error);
+    ASSERT(failures == 0, "%u of %u lanes differ from the scalar code (see failures.txt).", failures, n);
+}
+
+void test_principled_bsdf_batch_task(const ConfigArgs &args, const fs::path &task_dir, int task_id)
+{
+    uint32_t n = (uint32_t)args.load_integer("lanes", 1 << 16);
+    uint64_t seed = (uint64_t)args.load_integer("seed", 0);
+    float tolerance = args.load_float("tolerance", 1e-3f);
+    // GGX runs the SoA kernels, Beckmann the scalar fallback.
+    test_case(task_dir, "eval_and_pdf_n_ggx",
+              [&](const fs::path &dir) { test_principled_bsdf_batch<GGX>(dir, n, seed, tolerance); });
+    test_case(task_dir, "eval_and_pdf_n_beckmann",
+              [&](const fs::path &dir) { test_principled_bsdf_batch<Beckmann>(dir, n, seed, tolerance); });
+}
+
+} // namespace ks
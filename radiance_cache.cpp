@@ -0,0 +1,122 @@
+#include "radiance_cache.h"
+#include "hash.h"
+#include "parallel.h"
+
+namespace ks
+{
+
+RadianceCacheOptions load_radiance_cache_options(const ConfigArgs &args)
+{
+    RadianceCacheOptions options;
+    options.log2_size = args.load_integer("log2_size", options.log2_size);
+    options.cell_size = args.load_float("cell_size", options.cell_size);
+    options.lod_distance = args.load_float("lod_distance", options.lod_distance);
+    options.footprint_threshold = args.load_float("footprint_threshold", options.footprint_threshold);
+    options.min_samples = args.load_integer("min_samples", options.min_samples);
+    options.max_samples = args.load_integer("max_samples", options.max_samples);
+    options.warmup_spp = args.load_integer("warmup_spp", options.warmup_spp);
+    ASSERT(options.log2_size >= 4 && options.log2_size <= 30, "log2_size must be in [4, 30].");
+    ASSERT(options.cell_size > 0.0f && options.lod_distance > 0.0f, "cell_size and lod_distance must be positive.");
+    ASSERT(options.max_samples >= options.min_samples && options.min_samples >= 1,
+           "Need 1 <= min_samples <= max_samples.");
+    return options;
+}
+
+RadianceCache::RadianceCache(const AABB3 &scene_bound, const RadianceCacheOptions &options) : options(options)
+{
+    float diagonal = scene_bound.isEmpty() ? 1.0f : scene_bound.extents().norm();
+    base_cell_size = options.cell_size * diagonal;
+    lod_distance = options.lod_distance * diagonal;
+    mask = (1u << options.log2_size) - 1;
+    cells = std::make_unique<Cell[]>((size_t)mask + 1);
+}
+
+static int cell_level(float distance, float lod_distance)
+{
+    if (!(distance > lod_distance))
+        return 0;
+    return std::min((int)std::floor(std::log2(distance / lod_distance)) + 1, 30);
+}
+
+float RadianceCache::cell_size(const vec3 &p, const vec3 &view_pos) const
+{
+    return std::ldexp(base_cell_size, cell_level((p - view_pos).norm(), lod_distance));
+}
+
+uint64_t RadianceCache::cell_key(const vec3 &p, const vec3 &n, const vec3 &view_pos, uint32_t &slot) const
+{
+    int level = cell_level((p - view_pos).norm(), lod_distance);
+    float inv_size = 1.0f / std::ldexp(base_cell_size, level);
+    arr3u q;
+    for (int i = 0; i < 3; ++i)
+        q[i] = (uint32_t)(int32_t)std::floor(p[i] * inv_size);
+    uint32_t octant = (n.x() > 0.0f) | (n.y() > 0.0f) << 1 | (n.z() > 0.0f) << 2;
+    uint64_t lod = (uint64_t)level << 3 | octant;
+    // pcg3d is a bijection, so cells only share keys through the 64 of its 96 bits we keep.
+    arr3u h = hash33u(q);
+    slot = (h.x() ^ (uint32_t)mix_bits(lod)) & mask;
+    uint64_t key = mix_bits(((uint64_t)h.y() << 32 | h.z()) ^ lod);
+    // 0 marks empty cells.
+    return key ? key : 1;
+}
+
+bool RadianceCache::lookup(const vec3 &p, const vec3 &n, const vec3 &view_pos, color3 &radiance) const
+{
+    uint32_t slot;
+    uint64_t key = cell_key(p, n, view_pos, slot);
+    for (int i = 0; i < max_probes; ++i) {
+        const Cell &cell = cells[(slot + i) & mask];
+        uint64_t cell_key = cell.key.load(std::memory_order_relaxed);
+        if (cell_key == 0)
+            return false;
+        if (cell_key == key) {
+            if (cell.samples < (uint32_t)options.min_samples)
+                return false;
+            radiance = cell.mean;
+            return true;
+        }
+    }
+    return false;
+}
+
+void RadianceCache::record(const vec3 &p, const vec3 &n, const vec3 &view_pos, const color3 &radiance)
+{
+    if (!radiance.allFinite())
+        return;
+    uint32_t slot;
+    uint64_t key = cell_key(p, n, view_pos, slot);
+    for (int i = 0; i < max_probes; ++i) {
+        Cell &cell = cells[(slot + i) & mask];
+        uint64_t cell_key = cell.key.load(std::memory_order_relaxed);
+        if (cell_key == 0 && cell.key.compare_exchange_strong(cell_key, key, std::memory_order_relaxed))
+            cell_key = key;
+        if (cell_key != key)
+            continue;
+        for (int c = 0; c < 3; ++c)
+            cell.sum[c].fetch_add(radiance[c], std::memory_order_relaxed);
+        cell.count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+}
+
+void RadianceCache::update()
+{
+    uint32_t max_samples = (uint32_t)options.max_samples;
+    parallel_for<uint32_t>(mask + 1, [&](uint32_t i) {
+        Cell &cell = cells[i];
+        uint32_t count = cell.count.load(std::memory_order_relaxed);
+        if (count == 0)
+            return;
+        color3 sum(cell.sum[0].load(std::memory_order_relaxed), cell.sum[1].load(std::memory_order_relaxed),
+                   cell.sum[2].load(std::memory_order_relaxed));
+        uint32_t old_samples = std::min(cell.samples, max_samples);
+        cell.mean = (cell.mean * (float)old_samples + sum) / (float)(old_samples + count);
+        cell.samples = std::min(old_samples + count, max_samples);
+        for (int c = 0; c < 3; ++c)
+            cell.sum[c].store(0.0f, std::memory_order_relaxed);
+        cell.count.store(0, std::memory_order_relaxed);
+    }, 4096u);
+    ++iteration;
+}
+
+} // namespace ks
\ No newline at end of file
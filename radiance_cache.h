@@ -0,0 +1,76 @@
+#pragma once
+#include "aabb.h"
+#include "config.h"
+#include "maths.h"
+#include <array>
+#include <atomic>
+#include <memory>
+
+namespace ks
+{
+
+struct RadianceCacheOptions
+{
+    // Table of 2^log2_size cells (about 40 bytes each), allocated up front.
+    int log2_size = 20;
+    // Cell size near the viewer, as a fraction of the scene bound diagonal.
+    float cell_size = 1.0f / 512.0f;
+    // Beyond this distance from the viewer (same units), the cell size doubles each time the distance doubles.
+    float lod_distance = 1.0f / 16.0f;
+    // A path terminates into the cache once its footprint (see below) exceeds footprint_threshold cells, so that the
+    // resolution of the cache stays below what the path could resolve anyway.
+    float footprint_threshold = 2.0f;
+    // Cells are only used once they hold at least this many samples.
+    int min_samples = 8;
+    // Samples of older passes are down-weighted to this many so that cells keep adapting.
+    int max_samples = 1024;
+    // The first passes double in length until this many samples per pixel are taken, so that the cache is filled
+    // early. Queries start after the first pass.
+    int warmup_spp = 16;
+};
+
+RadianceCacheOptions load_radiance_cache_options(const ConfigArgs &args);
+
+// World-space hash grid of the radiance scattered off surfaces (towards any direction, i.e. a diffuse approximation),
+// in the spirit of SHaRC. A cell is keyed by the quantized position, its level of detail and the octant of the
+// normal. Cells live in a fixed open-addressing table: inserting claims an empty key with a CAS and samples are
+// splatted with atomics, so record() needs no locks. lookup() reads the radiance resolved by the last update(), which
+// folds the samples of a pass into the running mean of each cell.
+struct RadianceCache
+{
+    RadianceCache(const AABB3 &scene_bound, const RadianceCacheOptions &options);
+
+    // Edge length of the cell around p, seen from view_pos.
+    float cell_size(const vec3 &p, const vec3 &view_pos) const;
+    // Returns false if the cell has too few samples (or isn't in the table). Thread-safe, also concurrently with
+    // record().
+    bool lookup(const vec3 &p, const vec3 &n, const vec3 &view_pos, color3 &radiance) const;
+    // Thread-safe. Samples are dropped if the cell can't be inserted (table full around its slot).
+    void record(const vec3 &p, const vec3 &n, const vec3 &view_pos, const color3 &radiance);
+    // Call between passes. Cells are never evicted: the table is sized for the whole render.
+    void update();
+
+    struct Cell
+    {
+        std::atomic<uint64_t> key{0};
+        std::array<std::atomic<float>, 3> sum{0.0f, 0.0f, 0.0f};
+        std::atomic<uint32_t> count{0};
+        // Resolved by update().
+        color3 mean = color3::Zero();
+        uint32_t samples = 0;
+    };
+
+    static constexpr int max_probes = 8;
+
+    uint64_t cell_key(const vec3 &p, const vec3 &n, const vec3 &view_pos, uint32_t &slot) const;
+
+    RadianceCacheOptions options;
+    float base_cell_size;
+    float lod_distance;
+    uint32_t mask;
+    std::unique_ptr<Cell[]> cells;
+    // Number of update() calls so far.
+    int iteration = 0;
+};
+
+} // namespace ks
\ No newline at end of file
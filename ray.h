@@ -23,6 +23,9 @@ struct Ray
     vec3 ry_origin = vec3::Zero();
     vec3 ry_dir = vec3::Zero();
 
+    // Normalized shutter time in [0, 1] for motion blur.
+    float time = 0.0f;
+
     void *extra = nullptr;
 };
 
@@ -33,6 +36,7 @@ inline Ray transform_ray(const mat4 &m, const Ray &r)
     r_out.dir = transform_dir(m, r.dir);
     r_out.tmin = r.tmin;
     r_out.tmax = r.tmax;
+    r_out.time = r.time;
     return r_out;
 }
 
@@ -43,6 +47,7 @@ inline Ray transform_ray(const Transform &t, const Ray &r)
     r_out.dir = t.direction(r.dir);
     r_out.tmin = r.tmin;
     r_out.tmax = r.tmax;
+    r_out.time = r.time;
     return r_out;
 }
 
@@ -137,6 +142,9 @@ struct Intersection
     float dudx = 0.0f, dvdx = 0.0f;
     float dudy = 0.0f, dvdy = 0.0f;
 
+    // Time of the incoming ray, inherited by rays spawned from here.
+    float time = 0.0f;
+
     void *extra = nullptr;
 };
 
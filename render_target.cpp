@@ -1,27 +1,431 @@
 #include "render_target.h"
+#include "colormap.h"
+#include "compression.h"
+#include "file_util.h"
 #include "image_util.h"
+#include "parallel.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <tuple>
 
 namespace ks
 {
 
+// Elementwise kernels run over chunks of this many pixels, each an Eigen expression over the chunk so that it is
+// vectorized.
+constexpr size_t kernel_chunk_size = 1 << 14;
+
+template <typename Func>
+static void parallel_chunks(size_t size, const Func &func)
+{
+    int num_chunks = (int)((size + kernel_chunk_size - 1) / kernel_chunk_size);
+    parallel_for(num_chunks, [&](int i) {
+        size_t begin = (size_t)i * kernel_chunk_size;
+        func(begin, std::min(size, begin + kernel_chunk_size) - begin);
+    });
+}
+
+using ColorArray = Eigen::Map<Eigen::Array<float, 3, Eigen::Dynamic>>;
+using ConstColorArray = Eigen::Map<const Eigen::Array<float, 3, Eigen::Dynamic>>;
+
+RenderTarget &RenderTarget::operator+=(const RenderTarget &other)
+{
+    ASSERT(width == other.width && height == other.height && tile_size == other.tile_size);
+    parallel_chunks(pixels.size(), [&](size_t begin, size_t n) {
+        ColorArray(pixels[begin].data(), 3, n) += ConstColorArray(other.pixels[begin].data(), 3, n);
+    });
+    return *this;
+}
+
+RenderTarget &RenderTarget::operator*=(const color3 &scalar)
+{
+    parallel_chunks(pixels.size(),
+                    [&](size_t begin, size_t n) { ColorArray(pixels[begin].data(), 3, n).colwise() *= scalar; });
+    return *this;
+}
+
+void RenderTarget::merge(const RenderTarget &other)
+{
+    ASSERT(width == other.width && height == other.height && tile_size == other.tile_size);
+    ASSERT(has_statistics() && other.has_statistics());
+    parallel_chunks(stats.size(), [&](size_t begin, size_t n) {
+        for (size_t i = begin; i < begin + n; ++i)
+            stats[i].merge(other.stats[i]);
+    });
+}
+
+void RenderTarget::resolve_statistics()
+{
+    parallel_chunks(pixels.size(), [&](size_t begin, size_t n) {
+        for (size_t i = begin; i < begin + n; ++i)
+            pixels[i] = stats[i].mean;
+    });
+}
+
+// Same lz4 block layout as serialized textures.
+
+constexpr const char *render_checkpoint_magic = "i_am_a_render_checkpoint";
+constexpr int render_checkpoint_version = 1;
+
+void RenderTarget::save_checkpoint(const fs::path &path, int samples_taken) const
+{
+    // Write to a temporary file first so that an interruption never leaves a truncated checkpoint behind.
+    fs::path tmp_path = path;
+    tmp_path += ".tmp";
+    {
+        BinaryWriter writer(tmp_path);
+        writer.write_array<char>(render_checkpoint_magic, strlen(render_checkpoint_magic));
+        writer.write<int>(render_checkpoint_version);
+        writer.write<int>(width);
+        writer.write<int>(height);
+        writer.write<int>(samples_taken);
+        writer.write<bool>(has_statistics());
+
+        size_t pixel_bytes = pixels.size() * sizeof(color3);
+        size_t stats_bytes = stats.size() * sizeof(PixelStatistics);
+        size_t total_size = pixel_bytes + stats_bytes;
+        writer.write<size_t>(total_size);
+        std::unique_ptr<std::byte[]> buf = std::make_unique<std::byte[]>(total_size);
+        std::memcpy(buf.get(), linear_pixels().data(), pixel_bytes);
+        if (stats_bytes > 0)
+            std::memcpy(buf.get() + pixel_bytes, linearize<PixelStatistics>(stats).data(), stats_bytes);
+        write_lz4_compressed(writer, buf.get(), total_size);
+    }
+    fs::rename(tmp_path, path);
+}
+
+int RenderTarget::load_checkpoint(const fs::path &path)
+{
+    if (!fs::exists(path))
+        return -1;
+    BinaryReader reader(path);
+    std::array<char, std::string_view(render_checkpoint_magic).size() + 1> magic;
+    reader.read_array<char>(magic.data(), magic.size() - 1);
+    magic.back() = 0;
+    if (strcmp(magic.data(), render_checkpoint_magic) || reader.read<int>() != render_checkpoint_version) {
+        printf("Invalid render checkpoint [%s]\n", path.string().c_str());
+        return -1;
+    }
+    int w = reader.read<int>();
+    int h = reader.read<int>();
+    if (w != width || h != height) {
+        printf("Render checkpoint [%s] is %dx%d, expected %dx%d\n", path.string().c_str(), w, h, width, height);
+        return -1;
+    }
+    int samples_taken = reader.read<int>();
+    bool with_statistics = reader.read<bool>();
+    if (with_statistics)
+        enable_statistics();
+    else
+        stats.clear();
+
+    size_t pixel_bytes = pixels.size() * sizeof(color3);
+    size_t stats_bytes = stats.size() * sizeof(PixelStatistics);
+    size_t total_size = reader.read<size_t>();
+    ASSERT(total_size == pixel_bytes + stats_bytes, "Corrupted render checkpoint.");
+    std::unique_ptr<std::byte[]> buf = std::make_unique<std::byte[]>(total_size);
+    read_lz4_compressed(reader, buf.get(), total_size);
+    const color3 *linear_pixels = reinterpret_cast<const color3 *>(buf.get());
+    const PixelStatistics *linear_stats = reinterpret_cast<const PixelStatistics *>(buf.get() + pixel_bytes);
+    for_each_run([&](uint32_t linear, uint32_t i, int n) {
+        std::copy_n(linear_pixels + linear, n, &pixels[i]);
+        if (stats_bytes > 0)
+            std::copy_n(linear_stats + linear, n, &stats[i]);
+    });
+    return samples_taken;
+}
+
+ProgressiveOptions load_progressive_options(const ConfigArgs &args, const fs::path &task_dir)
+{
+    ProgressiveOptions options;
+    options.spp_per_pass = args.load_integer("spp_per_pass", options.spp_per_pass);
+    options.time_budget = args.load_float("time_budget", options.time_budget);
+    options.checkpoint_interval = args.load_float("checkpoint_interval", options.checkpoint_interval);
+    // The task directory is timestamped per run (unless output_dir is set), so a restarted render would never find its
+    // checkpoint there.
+    options.checkpoint_path =
+        args.load_path("checkpoint", fs::path("checkpoints") / task_dir.filename() / "checkpoint.bin");
+    if (options.checkpoint_interval > 0.0f)
+        fs::create_directories(options.checkpoint_path.parent_path());
+    options.resume = args.load_bool("resume", options.resume);
+    ASSERT(options.spp_per_pass > 0, "Invalid progressive options.");
+    return options;
+}
+
+int aov_channel_count(AOV aov)
+{
+    switch (aov) {
+    case AOV::Depth:
+    case AOV::SampleCount:
+    case AOV::Variance:
+    case AOV::Cycles:
+    case AOV::RayCount:
+    case AOV::PathDepth:
+    case AOV::SubsurfaceSteps:
+        return 1;
+    default:
+        return 3;
+    }
+}
+
+static constexpr const char *aov_names[num_aovs] = {
+    "albedo",
+    "normal",
+    "depth",
+    "direct",
+    "indirect_diffuse",
+    "indirect_glossy",
+    "indirect_specular",
+    "indirect_subsurface",
+    "sample_count",
+    "variance",
+    "cycles",
+    "ray_count",
+    "path_depth",
+    "subsurface_steps",
+};
+
+const char *aov_name(AOV aov) { return aov_names[(int)aov]; }
+
+AOV aov_from_name(std::string_view name)
+{
+    for (int i = 0; i < num_aovs; ++i) {
+        if (name == aov_names[i])
+            return (AOV)i;
+    }
+    ASSERT(false, "Invalid AOV [%s].", std::string(name).c_str());
+    return AOV::Albedo;
+}
+
+void RenderTarget::enable_aov(AOV aov, bool half)
+{
+    ASSERT(!half || aov == AOV::Albedo || aov == AOV::Normal || aov == AOV::Depth,
+           "Only the first-hit AOVs can be stored in half precision.");
+    auto allocate = [&](AOV a) {
+        if (aov_enabled[(int)a])
+            return;
+        aov_enabled[(int)a] = true;
+        // The variance comes from the statistics.
+        if (a == AOV::Variance)
+            return;
+        aov_half[(int)a] = half && a == aov;
+        for (int c = 0; c < aov_channel_count(a); ++c) {
+            if (aov_half[(int)a])
+                aov_half_planes[(int)a][c].assign(pixels.size(), 0);
+            else
+                aov_planes[(int)a][c].assign(pixels.size(), 0.0f);
+        }
+    };
+    allocate(aov);
+    // Needed to normalize the sums (and as n of the half means).
+    allocate(AOV::SampleCount);
+    if (aov == AOV::Variance && !has_statistics()) {
+        enable_statistics();
+    }
+}
+
+std::vector<ExrChannel> RenderTarget::resolve_aov(AOV aov) const
+{
+    ASSERT(has_aov(aov));
+    static constexpr const char *color_channels[3] = {"R", "G", "B"};
+    static constexpr const char *vector_channels[3] = {"X", "Y", "Z"};
+    std::string layer = std::string(aov_name(aov)) + ".";
+    std::vector<ExrChannel> channels;
+    if (aov == AOV::Variance) {
+        ExrChannel &channel = channels.emplace_back();
+        channel.name = layer + "Y";
+        channel.data.resize(pixels.size());
+        for_each_run([&](uint32_t linear, uint32_t i, int n) {
+            for (int j = 0; j < n; ++j)
+                channel.data[linear + j] = stats[i + j].variance();
+        });
+        return channels;
+    }
+    const std::vector<float> &count = aov_planes[(int)AOV::SampleCount][0];
+    for (int c = 0; c < aov_channel_count(aov); ++c) {
+        ExrChannel &channel = channels.emplace_back();
+        if (aov == AOV::Normal) {
+            channel.name = layer + vector_channels[c];
+        } else if (aov == AOV::Depth) {
+            channel.name = layer + "Z";
+        } else if (aov == AOV::SampleCount || is_cost_aov(aov)) {
+            channel.name = layer + "Y";
+        } else {
+            channel.name = layer + color_channels[c];
+        }
+        channel.data.resize(pixels.size());
+        if (is_half_aov(aov)) {
+            const std::vector<uint16_t> &mean = aov_half_planes[(int)aov][c];
+            for_each_run([&](uint32_t linear, uint32_t i, int n) {
+                for (int j = 0; j < n; ++j)
+                    channel.data[linear + j] = half_to_float(mean[i + j]);
+            });
+            continue;
+        }
+        const std::vector<float> &sum = aov_planes[(int)aov][c];
+        for_each_run([&](uint32_t linear, uint32_t i, int n) {
+            Eigen::Map<Eigen::ArrayXf> out(&channel.data[linear], n);
+            Eigen::Map<const Eigen::ArrayXf> sums(&sum[i], n);
+            if (aov == AOV::SampleCount) {
+                out = sums;
+            } else {
+                Eigen::Map<const Eigen::ArrayXf> counts(&count[i], n);
+                out = (counts > 0.0f).select(sums / counts, 0.0f);
+            }
+        });
+    }
+    return channels;
+}
+
+ExrOptions load_exr_options(const ConfigArgs &args)
+{
+    ExrOptions options;
+    options.half = args.load_bool("half", options.half);
+    std::string compression = args.load_string("compression", "zip");
+    if (compression == "none") {
+        options.compression = ExrCompression::None;
+    } else if (compression == "rle") {
+        options.compression = ExrCompression::RLE;
+    } else if (compression == "zips") {
+        options.compression = ExrCompression::ZIPS;
+    } else if (compression == "zip") {
+        options.compression = ExrCompression::ZIP;
+    } else if (compression == "piz") {
+        options.compression = ExrCompression::PIZ;
+    } else {
+        ASSERT(false, "Invalid EXR compression [%s].", compression.c_str());
+    }
+    return options;
+}
+
+void NonFiniteLog::record(uint32_t pixel, int sample, const color3 &L)
+{
+    count.fetch_add(1, std::memory_order_relaxed);
+    std::scoped_lock lock(mutex);
+    if (entries.size() < max_entries)
+        entries.push_back({pixel, sample, L});
+}
+
+void NonFiniteLog::write(const fs::path &path, const RenderTarget &rt) const
+{
+    std::vector<Entry> sorted;
+    {
+        std::scoped_lock lock(mutex);
+        sorted = entries;
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const Entry &a, const Entry &b) {
+        return std::tie(a.sample, a.pixel) < std::tie(b.sample, b.pixel);
+    });
+    std::ofstream out(path);
+    for (const Entry &e : sorted) {
+        vec2i xy = rt.coords(e.pixel);
+        out << xy.x() << " " << xy.y() << " " << e.sample << " " << e.L[0] << " " << e.L[1] << " " << e.L[2] << "\n";
+    }
+}
+
 void RenderTarget::save_to_png(const fs::path &path) const
 {
     auto buf = std::make_unique<std::uint8_t[]>(width * height * 3);
-    for (int i = 0; i < (int)pixels.size(); ++i) {
-        for (int c = 0; c < 3; ++c)
-            buf[3 * i + c] = (uint8_t)std::floor(pixels[i][c] * 255.0f);
+    for_each_run([&](uint32_t linear, uint32_t i, int n) {
+        Eigen::Map<Eigen::Array<uint8_t, 3, Eigen::Dynamic>> out(&buf[3 * linear], 3, n);
+        out = (ConstColorArray(pixels[i].data(), 3, n).min(1.0f).max(0.0f) * 255.0f).floor().cast<uint8_t>();
+    });
+    ks::save_to_png((const std::byte *)buf.get(), width, height, 3, path);
+}
+
+HeatmapOptions load_heatmap_options(const ConfigArgs &args)
+{
+    HeatmapOptions options;
+    options.colormap = args.load_string("colormap", options.colormap);
+    ASSERT(options.colormap == "plasma" || options.colormap == "viridis", "Invalid colormap [%s].",
+           options.colormap.c_str());
+    options.total = args.load_bool("total", options.total);
+    options.log_scale = args.load_bool("log_scale", options.log_scale);
+    options.percentile = args.load_float("percentile", options.percentile);
+    ASSERT(options.percentile > 0.0f && options.percentile <= 1.0f, "Invalid heatmap percentile.");
+    return options;
+}
+
+void RenderTarget::save_heatmap(AOV aov, const fs::path &path, const HeatmapOptions &options) const
+{
+    std::vector<float> values = std::move(resolve_aov(aov)[0].data);
+    if (options.total && is_cost_aov(aov)) {
+        std::vector<float> count = std::move(resolve_aov(AOV::SampleCount)[0].data);
+        for (size_t i = 0; i < values.size(); ++i)
+            values[i] *= count[i];
+    }
+    if (options.log_scale) {
+        for (float &v : values)
+            v = std::log1p(std::max(v, 0.0f));
+    }
+    std::vector<float> sorted = values;
+    size_t rank = std::min((size_t)(options.percentile * (float)sorted.size()), sorted.size() - 1);
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    float scale = sorted[rank] > 0.0f ? 1.0f / sorted[rank] : 0.0f;
+
+    const color3 *map = options.colormap == "viridis" ? colormap::viridis : colormap::plasma;
+    int map_size = options.colormap == "viridis" ? colormap::viridis_size : colormap::plasma_size;
+    auto buf = std::make_unique<std::uint8_t[]>(width * height * 3);
+    for (int i = 0; i < (int)values.size(); ++i) {
+        float t = std::clamp(values[i] * scale, 0.0f, 1.0f);
+        const color3 &c = map[std::min((int)(t * (float)map_size), map_size - 1)];
+        for (int ch = 0; ch < 3; ++ch)
+            buf[3 * i + ch] = (uint8_t)std::floor(std::clamp(c[ch], 0.0f, 1.0f) * 255.0f);
     }
     ks::save_to_png((const std::byte *)buf.get(), width, height, 3, path);
 }
 
 void RenderTarget::save_to_hdr(const fs::path &path) const
 {
-    ks::save_to_hdr(reinterpret_cast<const float *>(pixels.data()), width, height, 3, path);
+    std::vector<color3> linear = linear_pixels();
+    ks::save_to_hdr(reinterpret_cast<const float *>(linear.data()), width, height, 3, path);
 }
 
 void RenderTarget::save_to_exr(const fs::path &path) const
 {
-    ks::save_to_exr(reinterpret_cast<const std::byte *>(pixels.data()), false, width, height, 3, path);
+    std::vector<color3> linear = linear_pixels();
+    ks::save_to_exr(reinterpret_cast<const std::byte *>(linear.data()), false, width, height, 3, path);
+}
+
+// Beauty and AOV layers, resolved.
+static std::vector<ExrChannel> exr_layers(const RenderTarget &rt)
+{
+    std::vector<ExrChannel> channels(3);
+    static constexpr const char *names[3] = {"R", "G", "B"};
+    for (int c = 0; c < 3; ++c) {
+        channels[c].name = names[c];
+        channels[c].data.resize(rt.pixels.size());
+    }
+    rt.for_each_run([&](uint32_t linear, uint32_t i, int n) {
+        ConstColorArray beauty(rt.pixels[i].data(), 3, n);
+        for (int c = 0; c < 3; ++c)
+            Eigen::Map<Eigen::ArrayXf>(&channels[c].data[linear], n) = beauty.row(c).transpose();
+    });
+    for (int a = 0; a < num_aovs; ++a) {
+        if (!rt.has_aov((AOV)a))
+            continue;
+        std::vector<ExrChannel> layer = rt.resolve_aov((AOV)a);
+        std::move(layer.begin(), layer.end(), std::back_inserter(channels));
+    }
+    return channels;
+}
+
+void RenderTarget::save_layers_to_exr(const fs::path &path, const ExrOptions &options) const
+{
+    std::vector<ExrChannel> channels = exr_layers(*this);
+    ks::save_layers_to_exr(channels, width, height, options, path);
+}
+
+void RenderTarget::save_layers_to_exr_async(const fs::path &path, const ExrOptions &options) const
+{
+    auto channels = std::make_shared<std::vector<ExrChannel>>(exr_layers(*this));
+    background_writer().submit([channels, w = width, h = height, options, path]() {
+        ks::save_layers_to_exr(*channels, w, h, options, path);
+    });
 }
 
 } // namespace ks
\ No newline at end of file
@@ -1,47 +1,313 @@
 #pragma once
 #include "assertion.h"
+#include "config.h"
+#include "image_util.h"
 #include "maths.h"
+#include "parallel.h"
+#include "texture_codec.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <filesystem>
+#include <mutex>
+#include <span>
 #include <vector>
 namespace fs = std::filesystem;
 
 namespace ks
 {
 
+// Running per-pixel mean and variance (Welford's algorithm). Variance is only tracked for luminance.
+struct PixelStatistics
+{
+    void add(const color3 &L)
+    {
+        ++count;
+        float delta = luminance(L) - luminance(mean);
+        mean += (L - mean) / (float)count;
+        m2 += delta * (luminance(L) - luminance(mean));
+    }
+
+    // Combine with statistics of disjoint samples of the same pixel (Chan et al.'s parallel update).
+    void merge(const PixelStatistics &other)
+    {
+        if (other.count == 0)
+            return;
+        uint32_t n = count + other.count;
+        float delta = luminance(other.mean) - luminance(mean);
+        m2 += other.m2 + sqr(delta) * ((float)count * (float)other.count / (float)n);
+        mean += (other.mean - mean) * ((float)other.count / (float)n);
+        count = n;
+    }
+
+    // Sample variance of the luminance.
+    float variance() const { return count > 1 ? m2 / (float)(count - 1) : 0.0f; }
+    // Standard error of the mean luminance, relative to sqrt(mean) so that dark pixels are not oversampled.
+    float error() const
+    {
+        if (count < 2)
+            return inf;
+        float std_error = std::sqrt(variance() / (float)count);
+        return std_error / std::sqrt(std::max(luminance(mean), 1e-4f));
+    }
+
+    color3 mean = color3::Zero();
+    float m2 = 0.0f;
+    uint32_t count = 0;
+};
+
+// Auxiliary outputs accumulated per sample next to the beauty pass, e.g. as denoiser guides.
+enum class AOV
+{
+    // Albedo of the first hit, estimated by the BSDF sampling weight.
+    Albedo,
+    // Shading normal of the first hit in world space.
+    Normal,
+    // Distance to the first hit.
+    Depth,
+    // Emission seen by the camera and direct lighting at the first hit.
+    Direct,
+    // The rest of the path, split by the lobe sampled at the first hit.
+    IndirectDiffuse,
+    IndirectGlossy,
+    IndirectSpecular,
+    IndirectSubsurface,
+    // Samples taken per pixel.
+    SampleCount,
+    // Sample variance of the luminance (see PixelStatistics).
+    Variance,
+    // Render cost per sample: CPU cycles (see read_cycle_counter) spent on the path, including its share of the
+    // batched traversals.
+    Cycles,
+    // Camera, bounce, shadow and subsurface rays traced.
+    RayCount,
+    // Bounce rays traced (the camera ray included).
+    PathDepth,
+    // Random walk steps of BSSRDFs (only counted with batched walks, see WavefrontOptions::batch_subsurface).
+    SubsurfaceSteps,
+};
+constexpr int num_aovs = 14;
+
+int aov_channel_count(AOV aov);
+// Layer name in multi-layer EXR files.
+const char *aov_name(AOV aov);
+AOV aov_from_name(std::string_view name);
+inline bool is_cost_aov(AOV aov) { return aov >= AOV::Cycles; }
+
+// False-color images of AOVs (e.g. the render cost ones) with colormap::plasma or colormap::viridis.
+struct HeatmapOptions
+{
+    // "plasma" or "viridis".
+    std::string colormap = "plasma";
+    // Cost AOVs are mapped as per-pixel totals over all samples (what the pixel cost the frame, adaptive sampling
+    // included) instead of per-sample means.
+    bool total = true;
+    bool log_scale = false;
+    // Values are normalized by this percentile over the pixels, so that a few outliers don't flatten the rest.
+    float percentile = 0.99f;
+};
+
+HeatmapOptions load_heatmap_options(const ConfigArgs &args);
+
 struct RenderTarget
 {
     RenderTarget() = default;
-    RenderTarget(int width, int height, const color3 &clear) : width(width), height(height)
+    // With tile_size > 0, pixels, statistics and AOVs are stored tile by tile (see index).
+    RenderTarget(int width, int height, const color3 &clear, int tile_size = 0)
+        : width(width), height(height), tile_size(tile_size)
     {
+        ASSERT(tile_size >= 0, "Invalid render target tile size.");
         pixels.resize(width * height, clear);
     }
 
-    color3 &operator()(int x, int y) { return pixels[y * width + x]; }
-    const color3 &operator()(int x, int y) const { return pixels[y * width + x]; }
+    // Storage index of a pixel, which renderers pass to add_sample and add_aov. Row-major by default. Tiled targets are
+    // row-major over tile_size x tile_size tiles (cut at the right and bottom edges), each tile contiguous and
+    // row-major inside, so that the samples of an image tile are written to one block of memory.
+    uint32_t index(int x, int y) const
+    {
+        if (tile_size == 0)
+            return (uint32_t)(y * width + x);
+        int x0 = x - x % tile_size;
+        int y0 = y - y % tile_size;
+        int tw = std::min(tile_size, width - x0);
+        int th = std::min(tile_size, height - y0);
+        return (uint32_t)(y0 * width + x0 * th + (y - y0) * tw + (x - x0));
+    }
+    vec2i coords(uint32_t index) const
+    {
+        if (tile_size == 0)
+            return vec2i((int)(index % width), (int)(index / width));
+        int y0 = (int)(index / ((uint32_t)tile_size * width)) * tile_size;
+        int th = std::min(tile_size, height - y0);
+        int r = (int)index - y0 * width;
+        int x0 = r / (tile_size * th) * tile_size;
+        int tw = std::min(tile_size, width - x0);
+        r -= x0 * th;
+        return vec2i(x0 + r % tw, y0 + r / tw);
+    }
+    bool tiled() const { return tile_size > 0; }
+    // Calls func(row_major_index, index, n) in parallel for runs of n pixels that are contiguous in both orders.
+    template <typename Func>
+    void for_each_run(const Func &func) const
+    {
+        int run = tiled() ? tile_size : width;
+        parallel_for(height, [&](int y) {
+            for (int x = 0; x < width; x += run)
+                func((uint32_t)(y * width + x), index(x, y), std::min(run, width - x));
+        });
+    }
+    // Row-major copy of a plane (pixels, stats or an AOV plane) for output.
+    template <typename T>
+    std::vector<T> linearize(std::span<const T> plane) const
+    {
+        if (!tiled())
+            return std::vector<T>(plane.begin(), plane.end());
+        std::vector<T> out(plane.size());
+        for_each_run([&](uint32_t linear, uint32_t i, int n) { std::copy_n(&plane[i], n, &out[linear]); });
+        return out;
+    }
+    std::vector<color3> linear_pixels() const { return linearize<color3>(pixels); }
+
+    color3 &operator()(int x, int y) { return pixels[index(x, y)]; }
+    const color3 &operator()(int x, int y) const { return pixels[index(x, y)]; }
+
+    // NOTE: the kernels below (and the output conversions) run in parallel over chunks of the planes.
+    RenderTarget &operator+=(const RenderTarget &other);
+    RenderTarget &operator*=(const color3 &scalar);
+
+    // Per-pixel statistics are only allocated on demand (e.g. for adaptive sampling).
+    void enable_statistics() { stats.resize(pixels.size()); }
+    bool has_statistics() const { return !stats.empty(); }
+    void add_sample(uint32_t pixel, const color3 &L) { stats[pixel].add(L); }
+    // Sample-count weighted merge of another target's statistics (e.g. a partial render of another worker).
+    void merge(const RenderTarget &other);
+    // Write the per-pixel mean into pixels.
+    void resolve_statistics();
+
+    // Checkpoint the accumulation state (pixels, and statistics if enabled) so that an interrupted progressive
+    // render can be resumed. samples_taken is the number of samples already taken per (active) pixel.
+    // NOTE: written in row-major order whatever the layout, so that targets of any tile size can load it.
+    void save_checkpoint(const fs::path &path, int samples_taken) const;
+    // Returns samples_taken of the checkpoint, or -1 if it does not exist or does not match this target.
+    // Enables statistics if the checkpoint has them.
+    int load_checkpoint(const fs::path &path);
 
-    RenderTarget &operator+=(const RenderTarget &other)
+    // Renderers add one sample of every enabled AOV (and a sample count) per pixel sample. Values are sums over the
+    // samples until written. Enabling the variance enables per-pixel statistics.
+    // With half, the first-hit AOVs (albedo, normal, depth) are stored as f16 running means instead of f32 sums. Their
+    // samples barely vary within a pixel, so that the mean doesn't stall once (value - mean) / n is below half an ulp.
+    // Renderers must then add them once per sample (zero if nothing was hit), after the sample count.
+    // NOTE: AOVs are not part of checkpoints.
+    void enable_aov(AOV aov, bool half = false);
+    bool has_aov(AOV aov) const { return aov_enabled[(int)aov]; }
+    bool has_aovs() const { return aov_enabled[(int)AOV::SampleCount]; }
+    bool is_half_aov(AOV aov) const { return aov_half[(int)aov]; }
+    void add_aov(uint32_t pixel, AOV aov, const vec3 &value)
     {
-        ASSERT(width == other.width && height == other.height);
-        for (int i = 0; i < (int)pixels.size(); ++i) {
-            pixels[i] += other.pixels[i];
+        if (aov_half[(int)aov]) {
+            add_half_aov(pixel, aov, value);
+            return;
         }
-        return *this;
+        std::array<std::vector<float>, 3> &planes = aov_planes[(int)aov];
+        for (int c = 0; c < aov_channel_count(aov); ++c)
+            planes[c][pixel] += value[c];
     }
-
-    RenderTarget &operator*=(const color3 &scalar)
+    void add_aov(uint32_t pixel, AOV aov, float value)
     {
-        for (int i = 0; i < (int)pixels.size(); ++i) {
-            pixels[i] = pixels[i].cwiseProduct(scalar);
+        if (aov_half[(int)aov]) {
+            add_half_aov(pixel, aov, vec3::Constant(value));
+            return;
         }
-        return *this;
+        aov_planes[(int)aov][0][pixel] += value;
     }
+    // Per-sample mean of an AOV, one row-major plane per channel.
+    std::vector<ExrChannel> resolve_aov(AOV aov) const;
 
     void save_to_png(const fs::path &path) const;
+    // First channel of an enabled AOV as a false-color PNG.
+    void save_heatmap(AOV aov, const fs::path &path, const HeatmapOptions &options = {}) const;
     void save_to_hdr(const fs::path &path) const;
     void save_to_exr(const fs::path &path) const;
+    // Beauty as R, G, B and every enabled AOV as a layer (albedo.R, normal.X, depth.Z, ...).
+    void save_layers_to_exr(const fs::path &path, const ExrOptions &options = {}) const;
+    // Copies the channels and writes them on the background writer. Call background_writer().flush() before reading
+    // the file.
+    void save_layers_to_exr_async(const fs::path &path, const ExrOptions &options = {}) const;
 
     int width, height;
+    // 0 for row-major storage.
+    int tile_size = 0;
     std::vector<color3> pixels;
+    std::vector<PixelStatistics> stats;
+    // Structure of arrays: planes of the enabled AOVs only, in aov_planes or (if half) in aov_half_planes.
+    std::array<bool, num_aovs> aov_enabled = {};
+    std::array<bool, num_aovs> aov_half = {};
+    std::array<std::array<std::vector<float>, 3>, num_aovs> aov_planes;
+    std::array<std::array<std::vector<uint16_t>, 3>, num_aovs> aov_half_planes;
+
+  private:
+    void add_half_aov(uint32_t pixel, AOV aov, const vec3 &value)
+    {
+        float w = 1.0f / aov_planes[(int)AOV::SampleCount][0][pixel];
+        std::array<std::vector<uint16_t>, 3> &planes = aov_half_planes[(int)aov];
+        for (int c = 0; c < aov_channel_count(aov); ++c) {
+            float mean = half_to_float(planes[c][pixel]);
+            planes[c][pixel] = float_to_half(mean + (value[c] - mean) * w);
+        }
+    }
 };
 
+// Debugging fireflies without hot-path assertions (see ASSERT_HOT): renderers check each sample's contribution and
+// record the non-finite ones here instead of aborting. The sample index and pixel are enough to replay the path with
+// the same seed.
+struct NonFiniteLog
+{
+    struct Entry
+    {
+        uint32_t pixel;
+        int sample;
+        color3 L;
+    };
+
+    // Returns false (and records the sample) if L is not finite.
+    bool check(uint32_t pixel, int sample, const color3 &L)
+    {
+        if (L.allFinite())
+            return true;
+        record(pixel, sample, L);
+        return false;
+    }
+    void record(uint32_t pixel, int sample, const color3 &L);
+    // One line per entry: x y sample r g b, sorted by (sample, pixel). Pixels are storage indices of rt.
+    void write(const fs::path &path, const RenderTarget &rt) const;
+
+    // Only the first max_entries are kept, count includes all.
+    size_t max_entries = 1 << 16;
+    std::atomic<uint64_t> count = 0;
+    mutable std::mutex mutex;
+    std::vector<Entry> entries;
+};
+
+ExrOptions load_exr_options(const ConfigArgs &args);
+
+// Progressive rendering: samples are accumulated pass by pass (in the per-pixel statistics) so that the render can
+// stop at any pass boundary and still resolve to a correct mean.
+struct ProgressiveOptions
+{
+    // Samples per pixel per pass. Ignored with adaptive sampling, which has its own pass schedule.
+    int spp_per_pass = 16;
+    // Wall-clock budget in seconds. The render stops before a pass that is predicted to exceed it. <= 0 is unlimited.
+    float time_budget = 0.0f;
+    // Minimum seconds between two checkpoints. A checkpoint is always written when the render stops.
+    // <= 0 disables checkpoints.
+    float checkpoint_interval = 0.0f;
+    fs::path checkpoint_path;
+    // Continue from checkpoint_path if it exists.
+    bool resume = true;
+};
+
+// checkpoint_path is resolved like other config paths (see ConfigArgs::load_path), not against the per-run task_dir.
+// It defaults to checkpoints/<task dir name>/checkpoint.bin.
+ProgressiveOptions load_progressive_options(const ConfigArgs &args, const fs::path &task_dir);
+
 } // namespace ks
\ No newline at end of file
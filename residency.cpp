@@ -0,0 +1,247 @@
+#include "residency.h"
+#include "bsdf.h"
+#include "mesh_asset.h"
+#include "stats.h"
+#include <algorithm>
+#include <tbb/task_arena.h>
+
+namespace ks
+{
+
+static StatCounter stat_loads("residency/loads");
+static StatCounter stat_evictions("residency/evictions");
+
+SubSceneProxy::~SubSceneProxy()
+{
+    if (inner_rtcscene) {
+        rtcReleaseScene(inner_rtcscene);
+        inner_rtcscene = nullptr;
+    }
+}
+
+ResidencyOptions load_residency_options(const ConfigArgs &args)
+{
+    ResidencyOptions options;
+    options.budget_bytes = (size_t)(args.load_float("budget_mb", 0.0f) * (1 << 20));
+    return options;
+}
+
+static void proxy_bounds(const RTCBoundsFunctionArguments *args)
+{
+    const SubSceneProxy &proxy = *(const SubSceneProxy *)args->geometryUserPtr;
+    RTCBounds &b = *args->bounds_o;
+    b.lower_x = proxy.bound.min.x();
+    b.lower_y = proxy.bound.min.y();
+    b.lower_z = proxy.bound.min.z();
+    b.upper_x = proxy.bound.max.x();
+    b.upper_y = proxy.bound.max.y();
+    b.upper_z = proxy.bound.max.z();
+}
+
+static RTCRay proxy_ray(RTCRayN *rays, uint32_t N, uint32_t i)
+{
+    RTCRay ray;
+    ray.org_x = RTCRayN_org_x(rays, N, i);
+    ray.org_y = RTCRayN_org_y(rays, N, i);
+    ray.org_z = RTCRayN_org_z(rays, N, i);
+    ray.tnear = RTCRayN_tnear(rays, N, i);
+    ray.dir_x = RTCRayN_dir_x(rays, N, i);
+    ray.dir_y = RTCRayN_dir_y(rays, N, i);
+    ray.dir_z = RTCRayN_dir_z(rays, N, i);
+    ray.time = RTCRayN_time(rays, N, i);
+    ray.tfar = RTCRayN_tfar(rays, N, i);
+    ray.mask = RTCRayN_mask(rays, N, i);
+    ray.id = RTCRayN_id(rays, N, i);
+    ray.flags = RTCRayN_flags(rays, N, i);
+    return ray;
+}
+
+// The rays are already in prototype space. Tracing the inner BVH with the same context keeps the filter callbacks and
+// the instance ids of the hit.
+static void proxy_intersect(const RTCIntersectFunctionNArguments *args)
+{
+    SubSceneProxy &proxy = *(SubSceneProxy *)args->geometryUserPtr;
+    RTCScene inner = proxy.manager->acquire(proxy);
+    uint32_t N = args->N;
+    RTCRayN *rays = RTCRayHitN_RayN(args->rayhit, N);
+    RTCHitN *hits = RTCRayHitN_HitN(args->rayhit, N);
+    for (uint32_t i = 0; i < N; ++i) {
+        if (args->valid[i] == 0)
+            continue;
+        RTCRayHit rayhit;
+        rayhit.ray = proxy_ray(rays, N, i);
+        rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+        rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+        rtcIntersect1(inner, args->context, &rayhit);
+        if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID)
+            continue;
+        RTCRayN_tfar(rays, N, i) = rayhit.ray.tfar;
+        RTCHitN_Ng_x(hits, N, i) = rayhit.hit.Ng_x;
+        RTCHitN_Ng_y(hits, N, i) = rayhit.hit.Ng_y;
+        RTCHitN_Ng_z(hits, N, i) = rayhit.hit.Ng_z;
+        RTCHitN_u(hits, N, i) = rayhit.hit.u;
+        RTCHitN_v(hits, N, i) = rayhit.hit.v;
+        RTCHitN_primID(hits, N, i) = rayhit.hit.primID;
+        // Index of the geometry in SubScene::geometries, as for resident subscenes.
+        RTCHitN_geomID(hits, N, i) = rayhit.hit.geomID;
+        for (uint32_t l = 0; l < RTC_MAX_INSTANCE_LEVEL_COUNT; ++l)
+            RTCHitN_instID(hits, N, i, l) = args->context->instID[l];
+    }
+}
+
+static void proxy_occluded(const RTCOccludedFunctionNArguments *args)
+{
+    SubSceneProxy &proxy = *(SubSceneProxy *)args->geometryUserPtr;
+    RTCScene inner = proxy.manager->acquire(proxy);
+    uint32_t N = args->N;
+    for (uint32_t i = 0; i < N; ++i) {
+        if (args->valid[i] == 0)
+            continue;
+        RTCRay ray = proxy_ray(args->ray, N, i);
+        rtcOccluded1(inner, args->context, &ray);
+        if (ray.tfar == -inf)
+            RTCRayN_tfar(args->ray, N, i) = -inf;
+    }
+}
+
+SubScene ResidencyManager::create_proxy_subscene(const fs::path &path)
+{
+    std::unique_ptr<SubSceneProxy> proxy = std::make_unique<SubSceneProxy>();
+    proxy->path = path;
+    proxy->manager = this;
+    SubScene subscene;
+    {
+        // Read once for the bounds. Only the vertex buffers of a mapped asset are touched.
+        MeshAsset asset;
+        asset.load_from_binary(path);
+        for (const std::shared_ptr<MeshData> &mesh : asset.meshes) {
+            for (int i = 0; i < mesh->vertex_count(); ++i)
+                proxy->bound.expand(mesh->get_pos(i));
+        }
+        subscene.geometries.resize(asset.meshes.size());
+    }
+    ASSERT(!proxy->bound.isEmpty(), "Out-of-core prototype [%s] has no geometry.", path.string().c_str());
+
+    subscene.rtcscene = rtcNewScene(device);
+    rtcSetSceneFlags(subscene.rtcscene, (RTCSceneFlags)(RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION | build_options.flags));
+    RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_USER);
+    rtcSetGeometryUserPrimitiveCount(geom, 1);
+    rtcSetGeometryUserData(geom, proxy.get());
+    rtcSetGeometryBoundsFunction(geom, proxy_bounds, proxy.get());
+    rtcSetGeometryIntersectFunction(geom, proxy_intersect);
+    rtcSetGeometryOccludedFunction(geom, proxy_occluded);
+    rtcCommitGeometry(geom);
+    rtcAttachGeometry(subscene.rtcscene, geom);
+    rtcReleaseGeometry(geom);
+    rtcCommitScene(subscene.rtcscene);
+    subscene.local_scenes = std::make_unique<SubScene::LocalScenes>(device, (uint32_t)subscene.geometries.size());
+
+    proxies.push_back(proxy.get());
+    subscene.proxy = std::move(proxy);
+    return subscene;
+}
+
+RTCScene ResidencyManager::acquire(SubSceneProxy &proxy)
+{
+    uint64_t e = epoch.load(std::memory_order_relaxed);
+    // Avoid writing the shared cache line on every traversal.
+    if (proxy.last_use.load(std::memory_order_relaxed) != e)
+        proxy.last_use.store(e, std::memory_order_relaxed);
+    if (proxy.is_resident())
+        return proxy.inner_rtcscene;
+
+    std::lock_guard<std::mutex> lock(load_mutex);
+    if (proxy.is_resident())
+        return proxy.inner_rtcscene;
+    stat_loads.add();
+    // NOTE: the build runs its own tbb tasks. Isolated so that this thread doesn't pick up other traversals while
+    // holding load_mutex (they may need to load a proxy too).
+    tbb::this_task_arena::isolate([&] {
+        int64_t start_memory = device.memory_usage();
+        proxy.asset = std::make_unique<MeshAsset>();
+        proxy.asset->load_from_binary(proxy.path);
+        SubScene inner;
+        for (const std::shared_ptr<MeshData> &mesh : proxy.asset->meshes)
+            inner.geometries.push_back(std::make_unique<MeshGeometry>(*mesh));
+        EmbreeBuildOptions inner_options = build_options;
+        inner_options.report = false;
+        inner.create_rtc_scene(device, inner_options);
+
+        SubScene &subscene = *proxy.subscene;
+        ASSERT(inner.geometries.size() == subscene.geometries.size(), "Out-of-core prototype [%s] changed on disk.",
+               proxy.path.string().c_str());
+        for (size_t i = 0; i < inner.geometries.size(); ++i)
+            subscene.geometries[i] = std::move(inner.geometries[i]);
+        proxy.inner_rtcscene = inner.rtcscene;
+        inner.rtcscene = nullptr;
+        int64_t bvh_bytes = std::max<int64_t>(device.memory_usage() - start_memory, 0);
+        proxy.bytes = (size_t)fs::file_size(proxy.path) + (size_t)bvh_bytes;
+    });
+    resident_bytes.fetch_add(proxy.bytes, std::memory_order_relaxed);
+    proxy.resident.store(true, std::memory_order_release);
+    return proxy.inner_rtcscene;
+}
+
+void ResidencyManager::evict(SubSceneProxy &proxy)
+{
+    stat_evictions.add();
+    SubScene &subscene = *proxy.subscene;
+    for (std::atomic<RTCScene> &slot : subscene.local_scenes->scenes) {
+        if (RTCScene local = slot.exchange(nullptr, std::memory_order_relaxed))
+            rtcReleaseScene(local);
+    }
+    rtcReleaseScene(proxy.inner_rtcscene);
+    proxy.inner_rtcscene = nullptr;
+    for (std::unique_ptr<Geometry> &geom : subscene.geometries)
+        geom.reset();
+    // Unmaps the file (unless the meshes are shared through the asset store).
+    proxy.asset.reset();
+    resident_bytes.fetch_sub(proxy.bytes, std::memory_order_relaxed);
+    proxy.bytes = 0;
+    proxy.resident.store(false, std::memory_order_release);
+}
+
+void ResidencyManager::trim()
+{
+    if (options.budget_bytes > 0 && resident_bytes.load(std::memory_order_relaxed) > options.budget_bytes) {
+        std::vector<SubSceneProxy *> lru;
+        for (SubSceneProxy *proxy : proxies) {
+            if (proxy->is_resident())
+                lru.push_back(proxy);
+        }
+        std::sort(lru.begin(), lru.end(), [](const SubSceneProxy *a, const SubSceneProxy *b) {
+            return a->last_use.load(std::memory_order_relaxed) < b->last_use.load(std::memory_order_relaxed);
+        });
+        // NOTE: the working set of the last epoch may not fit either, then it is reloaded as needed.
+        for (SubSceneProxy *proxy : lru) {
+            if (resident_bytes.load(std::memory_order_relaxed) <= options.budget_bytes)
+                break;
+            evict(*proxy);
+        }
+    }
+    epoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+Scene create_out_of_core_scene(const ConfigArgs &args, const EmbreeDevice &device,
+                               const EmbreeBuildOptions &build_options)
+{
+    Scene scene;
+    ResidencyOptions options;
+    if (args.contains("residency"))
+        options = load_residency_options(args["residency"]);
+    scene.residency = std::make_shared<ResidencyManager>(device, options, build_options);
+    int n_prototypes = args["prototypes"].array_size();
+    for (int i = 0; i < n_prototypes; ++i)
+        scene.add_subscene(scene.residency->create_proxy_subscene(args["prototypes"].load_path(i)));
+    int n_instances = args["instances"].array_size();
+    for (int i = 0; i < n_instances; ++i) {
+        ConfigArgs inst_args = args["instances"][i];
+        int prototype = inst_args.load_integer("prototype");
+        ASSERT(prototype >= 0 && prototype < n_prototypes, "Invalid prototype %d.", prototype);
+        scene.add_instance(device, (uint32_t)prototype, inst_args.load_transform("to_world", Transform()));
+    }
+    scene.create_rtc_scene(device, build_options);
+    return scene;
+}
+
+} // namespace ks
\ No newline at end of file
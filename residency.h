@@ -0,0 +1,85 @@
+#pragma once
+#include "config.h"
+#include "scene.h"
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <vector>
+namespace fs = std::filesystem;
+
+namespace ks
+{
+
+struct MeshAsset;
+struct ResidencyManager;
+
+// Out-of-core prototype: until a ray enters its bounds, the subscene only holds a user geometry with the bounds
+// (SubScene::rtcscene, so instances never change). The first hit maps the meshes from a binary mesh asset (see
+// MeshAsset::load_from_binary) and builds their BVH, which then answers the rays entering the bounds.
+struct SubSceneProxy
+{
+    ~SubSceneProxy();
+
+    bool is_resident() const { return resident.load(std::memory_order_acquire); }
+
+    fs::path path;
+    // In prototype space.
+    AABB3 bound;
+    SubScene *subscene = nullptr;
+    ResidencyManager *manager = nullptr;
+
+    // Set while resident.
+    std::unique_ptr<MeshAsset> asset;
+    RTCScene inner_rtcscene = nullptr;
+    // Mapped file and BVH.
+    size_t bytes = 0;
+    std::atomic<bool> resident = false;
+    // ResidencyManager::epoch of the last traversal.
+    std::atomic<uint64_t> last_use = 0;
+};
+
+struct ResidencyOptions
+{
+    // Evict least recently used prototypes above this (0: never evict).
+    size_t budget_bytes = 0;
+};
+
+ResidencyOptions load_residency_options(const ConfigArgs &args);
+
+// Loads proxies on demand and evicts them under the memory budget.
+struct ResidencyManager
+{
+    ResidencyManager(const EmbreeDevice &device, const ResidencyOptions &options,
+                     const EmbreeBuildOptions &build_options = {})
+        : device(device), options(options), build_options(build_options)
+    {}
+
+    // Out-of-core subscene of the meshes in path (a binary mesh asset). The file is only read for the bounds.
+    SubScene create_proxy_subscene(const fs::path &path);
+    // Called from traversal. Thread-safe: concurrent first hits on the same proxy wait for a single load.
+    RTCScene acquire(SubSceneProxy &proxy);
+    // Evict least recently used proxies until the resident bytes fit the budget, and start a new epoch.
+    // NOTE: not thread-safe with traversal or with uses of the geometries of the last hits, so call it between
+    // traversals (e.g. between the bounces of a wave).
+    void trim();
+
+    const EmbreeDevice &device;
+    ResidencyOptions options;
+    EmbreeBuildOptions build_options;
+    std::vector<SubSceneProxy *> proxies;
+    std::atomic<uint64_t> epoch = 0;
+    std::atomic<size_t> resident_bytes = 0;
+    // Loads are serialized so that the BVH memory of each one can be measured with EmbreeDevice::memory_usage.
+    std::mutex load_mutex;
+
+  private:
+    void evict(SubSceneProxy &proxy);
+};
+
+// Scene of out-of-core prototypes ("prototypes": paths of binary mesh assets) and their "instances" (prototype,
+// to_world). Materials are assigned with a material list.
+Scene create_out_of_core_scene(const ConfigArgs &args, const EmbreeDevice &device,
+                               const EmbreeBuildOptions &build_options = {});
+
+} // namespace ks
\ No newline at end of file
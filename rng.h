@@ -188,18 +188,6 @@ inline std::array<float, N> sample_normal(RNG &rng)
     return samples;
 }
 
-inline bool russian_roulette(color3 &beta, float u)
-{
-    if (beta.maxCoeff() < 0.05f) {
-        float q = std::max(0.05f, 1.0f - beta.maxCoeff());
-        if (u < q) {
-            return false;
-        }
-        beta /= 1.0f - q;
-    }
-    return true;
-}
-
 inline vec3 sample_triangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, const vec2 &u, vec2 *bary)
 {
     float su0 = std::sqrt(u[0]);
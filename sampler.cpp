@@ -0,0 +1,170 @@
+#include "sampler.h"
+#include "assertion.h"
+#include "hash.h"
+#include "sobol.h"
+#include <algorithm>
+
+namespace ks
+{
+
+static constexpr uint32_t max_sobol_dimension = 64;
+
+static inline uint32_t reverse_bits(uint32_t bits)
+{
+    bits = (bits << 16u) | (bits >> 16u);
+    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+    return bits;
+}
+
+// Burley. "Practical Hash-based Owen Scrambling." JCGT 2020.
+// Shuffles sample indices such that every power-of-two prefix maps to an aligned block of the same size, which keeps
+// the stratification of (0,2)-sequence prefixes.
+static inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// http://extremelearning.com.au/unreasonable-effectiveness-of-quasirandom-sequences/ (dithering section).
+// Screen-space R2 dither mask, offset per dimension by the golden ratio.
+static inline float r2_dither_mask(const vec2i &p, uint32_t dim)
+{
+    constexpr float a1 = 0.7548776662f;
+    constexpr float a2 = 0.5698402910f;
+    constexpr float golden = 0.6180339887f;
+    return fract(a1 * (float)p.x() + a2 * (float)p.y() + golden * (float)dim);
+}
+
+void Sampler::start_pixel_sample(const vec2i &p, uint32_t index, uint32_t dim)
+{
+    pixel = p;
+    sample_index = index;
+    dimension = dim;
+    batch_begin = batch_end = 0;
+    if (type == SamplerType::BlueNoise) {
+        pixel_seed = (uint32_t)hash(seed);
+    } else if (seed_table) {
+        pixel_seed = (*seed_table)(p.x(), p.y());
+    } else {
+        pixel_seed = (uint32_t)hash(p.x(), p.y(), seed);
+    }
+    rng = RNG(hash(p.x(), p.y(), index, seed));
+}
+
+void Sampler::fill_batch()
+{
+    std::array<int, batch_size> idx;
+    std::array<int, batch_size> dim;
+    std::array<uint32_t, batch_size> seeds;
+    int n;
+    if (type == SamplerType::Sobol) {
+        n = std::min(batch_size, (int)(max_sobol_dimension - dimension));
+        for (int i = 0; i < n; ++i) {
+            idx[i] = (int)sample_index;
+            dim[i] = (int)dimension + i;
+            seeds[i] = pixel_seed;
+        }
+        batch_end = dimension + n;
+        sobol_owen_n(std::span(idx.data(), n), std::span(dim.data(), n), std::span(seeds.data(), n),
+                     max_sobol_dimension, std::span(batch.data(), n));
+    } else {
+        n = batch_size;
+        for (int i = 0; i < batch_size / 2; ++i) {
+            uint32_t d = dimension + i;
+            uint32_t dim_seed = (uint32_t)hash(pixel_seed, d);
+            uint32_t shuffled = nested_uniform_scramble(sample_index, dim_seed);
+            if (type == SamplerType::BlueNoise) {
+                // Rank scrambling: XOR the index with the dither mask value (reversed, so that its leading digits pick
+                // the coarse strata). Each pixel still gets an aligned block of the (0,2)-sequence, but the first
+                // samples of neighboring pixels land in different strata following the mask.
+                shuffled ^= reverse_bits((uint32_t)(r2_dither_mask(pixel, d) * 0x1p32f));
+            }
+            // NOTE: sobol_owen hashes idx * nd, which must stay within an int.
+            shuffled &= 0x3FFFFFFFu;
+            idx[2 * i] = idx[2 * i + 1] = (int)shuffled;
+            dim[2 * i] = 0;
+            dim[2 * i + 1] = 1;
+            seeds[2 * i] = seeds[2 * i + 1] = dim_seed;
+        }
+        batch_end = dimension + batch_size / 2;
+        sobol_owen_n(idx, dim, seeds, 2, batch);
+    }
+    batch_begin = dimension;
+}
+
+float Sampler::next()
+{
+    switch (type) {
+    case SamplerType::Sobol:
+        if (dimension < max_sobol_dimension) {
+            if (dimension < batch_begin || dimension >= batch_end) {
+                fill_batch();
+            }
+            return batch[dimension++ - batch_begin];
+        }
+        break;
+    case SamplerType::PMJ02:
+    case SamplerType::BlueNoise:
+        return next2d().x();
+    default:
+        break;
+    }
+    return rng.next();
+}
+
+vec2 Sampler::next2d()
+{
+    switch (type) {
+    case SamplerType::Sobol:
+        if (dimension + 1 < max_sobol_dimension) {
+            if (dimension < batch_begin || dimension + 1 >= batch_end) {
+                fill_batch();
+            }
+            uint32_t i = dimension - batch_begin;
+            dimension += 2;
+            return vec2(batch[i], batch[i + 1]);
+        }
+        break;
+    case SamplerType::PMJ02:
+    case SamplerType::BlueNoise: {
+        if (dimension < batch_begin || dimension >= batch_end) {
+            fill_batch();
+        }
+        uint32_t i = 2 * (dimension - batch_begin);
+        ++dimension;
+        return vec2(batch[i], batch[i + 1]);
+    }
+    default:
+        break;
+    }
+    return rng.next2d();
+}
+
+SamplerType load_sampler_type(const ConfigArgs &args, std::string_view name, SamplerType default_type)
+{
+    if (!args.contains(name)) {
+        return default_type;
+    }
+    std::string type = args.load_string(name);
+    if (type == "independent") {
+        return SamplerType::Independent;
+    } else if (type == "sobol") {
+        return SamplerType::Sobol;
+    } else if (type == "pmj02") {
+        return SamplerType::PMJ02;
+    } else if (type == "blue_noise") {
+        return SamplerType::BlueNoise;
+    }
+    ASSERT(false, "Invalid sampler type [%s].", type.c_str());
+    return default_type;
+}
+
+} // namespace ks
\ No newline at end of file
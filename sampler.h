@@ -0,0 +1,74 @@
+#pragma once
+#include "config.h"
+#include "maths.h"
+#include "rng.h"
+#include <array>
+
+namespace ks
+{
+
+struct SobolSeedTable;
+
+enum class SamplerType
+{
+    // pcg32 for every dimension (the old behavior).
+    Independent,
+    // Owen-scrambled Sobol over the first 64 dimensions of each sample (see sobol_owen). Later dimensions are
+    // independent.
+    Sobol,
+    // Padded 2D (0,2)-sequences: every draw uses its own Owen-scrambled Sobol (0,2) pair with a shuffled sample index.
+    // Same stratification as PMJ02 and not limited in dimensions.
+    PMJ02,
+    // PMJ02 with the scrambling shared by all pixels and the sample index rank-scrambled per pixel by a screen-space
+    // R2 dither mask, so that the error is distributed as blue noise.
+    BlueNoise,
+};
+
+// Sample generator addressed by (pixel, sample index, dimension). Each next()/next2d() consumes one dimension (two
+// for next2d with Sobol), and callers just draw in a fixed order like they would from an RNG.
+struct Sampler
+{
+    Sampler() = default;
+    explicit Sampler(SamplerType type, uint32_t seed = 0) : type(type), seed(seed) {}
+
+    void start_pixel_sample(const vec2i &pixel, uint32_t sample_index, uint32_t dim = 0);
+    uint32_t get_dimension() const { return dimension; }
+    void set_dimension(uint32_t dim)
+    {
+        dimension = dim;
+        batch_begin = batch_end = 0;
+    }
+
+    float next();
+    vec2 next2d();
+    vec3 next3d()
+    {
+        vec2 u = next2d();
+        return vec3(u.x(), u.y(), next());
+    }
+
+    SamplerType type = SamplerType::Independent;
+    uint32_t seed = 0;
+
+    vec2i pixel = vec2i::Zero();
+    uint32_t sample_index = 0;
+    uint32_t dimension = 0;
+    // Scramble seed of this pixel (shared by all pixels for BlueNoise).
+    uint32_t pixel_seed = 0;
+    // Optional per-pixel seeds (built with the same seed) to skip hashing the pixel for every sample.
+    const SobolSeedTable *seed_table = nullptr;
+
+    // Upcoming dimensions are evaluated together with sobol_owen_n. Holds one value per dimension for Sobol and a
+    // pair per dimension for PMJ02/BlueNoise, covering dimensions [batch_begin, batch_end).
+    static constexpr int batch_size = 16;
+    void fill_batch();
+    std::array<float, batch_size> batch;
+    uint32_t batch_begin = 0;
+    uint32_t batch_end = 0;
+    // Independent samples, seeded per (pixel, sample). Also for anything that needs an RNG (e.g. sample_normal).
+    RNG rng;
+};
+
+SamplerType load_sampler_type(const ConfigArgs &args, std::string_view name, SamplerType default_type);
+
+} // namespace ks
\ No newline at end of file
@@ -1,10 +1,30 @@
 #include "scene.h"
 #include "mesh_asset.h"
 #include "normal_map.h"
+#include "parallel.h"
+#include "residency.h"
+#include "stats.h"
+#include <chrono>
+#include <numeric>
+#include <tuple>
 
 namespace ks
 {
 
+static StatCounter stat_intersect1("scene/intersect1");
+static StatCounter stat_occlude1("scene/occlude1");
+static StatCounter stat_intersect_stream_rays("scene/intersect_stream_rays");
+static StatCounter stat_occlude_stream_rays("scene/occlude_stream_rays");
+static StatCounter stat_local_rays("scene/local_geometry_rays");
+
+SubScene::LocalScenes::~LocalScenes()
+{
+    for (std::atomic<RTCScene> &scene : scenes) {
+        if (RTCScene local = scene.load(std::memory_order_relaxed))
+            rtcReleaseScene(local);
+    }
+}
+
 SubScene::~SubScene()
 {
     if (rtcscene) {
@@ -18,6 +38,10 @@ SubScene::SubScene(SubScene &&other)
     geometries = std::move(other.geometries);
     materials = std::move(other.materials);
     rtcscene = other.rtcscene;
+    local_scenes = std::move(other.local_scenes);
+    proxy = std::move(other.proxy);
+    if (proxy)
+        proxy->subscene = this;
     // Avoid releasing...
     other.rtcscene = nullptr;
 }
@@ -36,16 +60,24 @@ SubScene &SubScene::operator=(SubScene &&other)
     geometries = std::move(other.geometries);
     materials = std::move(other.materials);
     rtcscene = other.rtcscene;
+    local_scenes = std::move(other.local_scenes);
+    proxy = std::move(other.proxy);
+    if (proxy)
+        proxy->subscene = this;
     // Avoid releasing...
     other.rtcscene = nullptr;
     return *this;
 }
 
-void SubScene::create_rtc_scene(const EmbreeDevice &device)
+void SubScene::create_rtc_scene(const EmbreeDevice &device, const EmbreeBuildOptions &options)
 {
     rtcscene = rtcNewScene(device);
     // Later useful for different custom precomputation operations.
-    rtcSetSceneFlags(rtcscene, RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION);
+    int flags = RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION | options.flags;
+    if (options.dynamic)
+        flags |= RTC_SCENE_FLAG_DYNAMIC;
+    rtcSetSceneFlags(rtcscene, (RTCSceneFlags)flags);
+    rtcSetSceneBuildQuality(rtcscene, options.quality);
 
     for (int i = 0; i < (int)geometries.size(); ++i) {
         Geometry &geom = *geometries[i];
@@ -56,6 +88,35 @@ void SubScene::create_rtc_scene(const EmbreeDevice &device)
 
     // build bvh, etc.
     rtcCommitScene(rtcscene);
+    local_scenes = std::make_unique<LocalScenes>(device, (uint32_t)geometries.size());
+}
+
+RTCScene SubScene::local_rtc_scene(uint32_t geom_id) const
+{
+    ASSERT_HOT(local_scenes && geom_id < geometries.size());
+    std::atomic<RTCScene> &slot = local_scenes->scenes[geom_id];
+    RTCScene local = slot.load(std::memory_order_acquire);
+    if (local) {
+        return local;
+    }
+    // NOTE: builds are rare (once per BSSRDF-bearing geometry), so a single lock per subscene is enough.
+    std::lock_guard<std::mutex> lock(local_scenes->build_mutex);
+    local = slot.load(std::memory_order_relaxed);
+    if (!local) {
+        local = rtcNewScene(local_scenes->device);
+        rtcAttachGeometry(local, geometries[geom_id]->rtcgeom);
+        rtcCommitScene(local);
+        slot.store(local, std::memory_order_release);
+    }
+    return local;
+}
+
+InstanceGroup::~InstanceGroup()
+{
+    for (const SubSceneInstance &instance : instances)
+        rtcReleaseGeometry(instance.rtgeom_inst);
+    if (rtcscene)
+        rtcReleaseScene(rtcscene);
 }
 
 Scene::~Scene()
@@ -72,7 +133,10 @@ Scene::~Scene()
 Scene::Scene(Scene &&other)
 {
     subscenes = std::move(other.subscenes);
+    groups = std::move(other.groups);
     instances = std::move(other.instances);
+    residency = std::move(other.residency);
+    dirty = other.dirty;
     rtcscene = other.rtcscene;
     // Avoid releasing...
     other.rtcscene = nullptr;
@@ -93,7 +157,10 @@ Scene &Scene::operator=(Scene &&other)
     }
 
     subscenes = std::move(other.subscenes);
+    groups = std::move(other.groups);
     instances = std::move(other.instances);
+    residency = std::move(other.residency);
+    dirty = other.dirty;
     rtcscene = other.rtcscene;
     // Avoid releasing...
     other.rtcscene = nullptr;
@@ -102,37 +169,241 @@ Scene &Scene::operator=(Scene &&other)
 
 void Scene::add_subscene(SubScene &&subscene)
 {
-    subscenes.emplace_back(std::make_unique<SubScene>(std::move(subscene)));
+    subscenes.emplace_back(std::make_shared<SubScene>(std::move(subscene)));
 }
 
-void Scene::add_instance(const EmbreeDevice &device, uint32_t subscene_id, const Transform &transform)
+Transform SubSceneInstance::transform_at(float time) const
+{
+    if (motion.empty())
+        return transform;
+    // Same as embree: linear interpolation of the matrices between the two nearest time steps.
+    float t = std::clamp(time, 0.0f, 1.0f) * (float)(motion.size() - 1);
+    uint32_t k = std::min((uint32_t)t, (uint32_t)motion.size() - 2);
+    float w = t - (float)k;
+    return Transform((1.0f - w) * motion[k].m + w * motion[k + 1].m);
+}
+
+void Scene::create_subscene_rtc_scenes(const EmbreeDevice &device, const EmbreeBuildOptions &options)
+{
+    std::vector<uint32_t> pending;
+    for (uint32_t i = 0; i < (uint32_t)subscenes.size(); ++i) {
+        if (!subscenes[i]->rtcscene)
+            pending.push_back(i);
+    }
+    if (pending.empty())
+        return;
+
+    using clock = std::chrono::steady_clock;
+    clock::time_point start = clock::now();
+    int64_t start_memory = device.memory_usage();
+    std::vector<float> seconds(pending.size());
+    std::vector<int64_t> bytes(pending.size());
+    auto build = [&](uint32_t k) {
+        clock::time_point subscene_start = clock::now();
+        int64_t subscene_start_memory = device.memory_usage();
+        subscenes[pending[k]]->create_rtc_scene(device, options);
+        seconds[k] = std::chrono::duration<float>(clock::now() - subscene_start).count();
+        bytes[k] = device.memory_usage() - subscene_start_memory;
+    };
+    // Embree builds each BVH with TBB too, so this nests into the same thread pool. Big subscenes still get all
+    // threads while thousands of small prototypes no longer build one after another.
+    if (options.parallel_subscenes) {
+        parallel_for((uint32_t)pending.size(), build);
+    } else {
+        for (uint32_t k = 0; k < (uint32_t)pending.size(); ++k)
+            build(k);
+    }
+
+    if (!options.report)
+        return;
+    float total_seconds = std::chrono::duration<float>(clock::now() - start).count();
+    int64_t total_bytes = device.memory_usage() - start_memory;
+    for (uint32_t k = 0; k < (uint32_t)pending.size(); ++k) {
+        // NOTE: the memory monitor is per device, so concurrent builds are attributed to whichever subscene
+        // was building at the time. Set parallel_subscenes = false for exact numbers.
+        printf("Subscene %u: %zu geometries, BVH built in %.3f sec, %.2f MB.\n", pending[k],
+               subscenes[pending[k]]->geometries.size(), seconds[k], (double)bytes[k] / (1 << 20));
+    }
+    printf("Built %zu subscene BVHs in %.3f sec (%.2f MB).\n", pending.size(), total_seconds,
+           (double)total_bytes / (1 << 20));
+}
+
+static RTCGeometry new_instance_geometry(const EmbreeDevice &device, RTCScene prototype, const Transform &transform)
 {
-    ASSERT(subscene_id < subscenes.size());
     RTCGeometry rtcgeom_inst = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
-    rtcSetGeometryInstancedScene(rtcgeom_inst, subscenes[subscene_id]->rtcscene);
+    rtcSetGeometryInstancedScene(rtcgeom_inst, prototype);
     rtcSetGeometryTransform(rtcgeom_inst, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, transform.m.data());
     rtcCommitGeometry(rtcgeom_inst);
+    return rtcgeom_inst;
+}
+
+void Scene::add_instance(const EmbreeDevice &device, uint32_t subscene_id, const Transform &transform)
+{
+    ASSERT(subscene_id < subscenes.size());
+    RTCGeometry rtcgeom_inst = new_instance_geometry(device, subscenes[subscene_id]->rtcscene, transform);
 
-    instances.push_back({subscene_id, transform, rtcgeom_inst});
+    SubSceneInstance &instance = instances.emplace_back();
+    instance.prototype = subscene_id;
+    instance.transform = transform;
+    instance.rtgeom_inst = rtcgeom_inst;
 }
 
-void Scene::create_rtc_scene(const EmbreeDevice &device)
+uint32_t Scene::add_instance_group(const EmbreeDevice &device)
+{
+    std::shared_ptr<InstanceGroup> group = std::make_shared<InstanceGroup>();
+    group->rtcscene = rtcNewScene(device);
+    groups.push_back(std::move(group));
+    return (uint32_t)groups.size() - 1;
+}
+
+void Scene::add_group_member(const EmbreeDevice &device, uint32_t group_id, uint32_t prototype, bool instance_group,
+                             const Transform &transform)
+{
+    ASSERT(group_id < groups.size());
+    InstanceGroup &group = *groups[group_id];
+    ASSERT(!group.committed, "Instance group [%u] is already built.", group_id);
+    RTCScene instanced;
+    if (instance_group) {
+        ASSERT(prototype < group_id, "Groups can only instance earlier groups.");
+        instanced = groups[prototype]->rtcscene;
+    } else {
+        ASSERT(prototype < subscenes.size());
+        instanced = subscenes[prototype]->rtcscene;
+    }
+    ASSERT(instanced, "Subscenes must be built before instancing them.");
+    RTCGeometry rtcgeom_inst = new_instance_geometry(device, instanced, transform);
+    rtcAttachGeometryByID(group.rtcscene, rtcgeom_inst, (uint32_t)group.instances.size());
+
+    SubSceneInstance &instance = group.instances.emplace_back();
+    instance.prototype = prototype;
+    instance.group = instance_group;
+    instance.transform = transform;
+    instance.rtgeom_inst = rtcgeom_inst;
+}
+
+void Scene::add_group_instance(const EmbreeDevice &device, uint32_t group_id, const Transform &transform)
+{
+    ASSERT(group_id < groups.size());
+    SubSceneInstance &instance = instances.emplace_back();
+    instance.prototype = group_id;
+    instance.group = true;
+    instance.transform = transform;
+    instance.rtgeom_inst = new_instance_geometry(device, groups[group_id]->rtcscene, transform);
+}
+
+void Scene::set_instance_transform(uint32_t inst_id, const Transform &transform)
+{
+    ASSERT(inst_id < instances.size());
+    SubSceneInstance &instance = instances[inst_id];
+    if (!instance.motion.empty()) {
+        instance.motion.clear();
+        rtcSetGeometryTimeStepCount(instance.rtgeom_inst, 1);
+    }
+    instance.transform = transform;
+    rtcSetGeometryTransform(instance.rtgeom_inst, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, transform.m.data());
+    rtcCommitGeometry(instance.rtgeom_inst);
+    dirty = true;
+}
+
+void Scene::set_instance_motion(uint32_t inst_id, std::span<const Transform> transforms)
+{
+    ASSERT(inst_id < instances.size());
+    ASSERT(!transforms.empty());
+    SubSceneInstance &instance = instances[inst_id];
+    instance.transform = transforms[0];
+    if (transforms.size() == 1) {
+        instance.motion.clear();
+    } else {
+        instance.motion.assign(transforms.begin(), transforms.end());
+    }
+    rtcSetGeometryTimeStepCount(instance.rtgeom_inst, (uint32_t)transforms.size());
+    for (uint32_t t = 0; t < (uint32_t)transforms.size(); ++t) {
+        rtcSetGeometryTransform(instance.rtgeom_inst, t, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, transforms[t].m.data());
+    }
+    rtcCommitGeometry(instance.rtgeom_inst);
+    dirty = true;
+}
+
+bool Scene::commit_updates()
+{
+    if (!dirty)
+        return false;
+    ASSERT(rtcscene);
+    rtcCommitScene(rtcscene);
+    dirty = false;
+    return true;
+}
+
+void Scene::create_rtc_scene(const EmbreeDevice &device, const EmbreeBuildOptions &options)
 {
     rtcscene = rtcNewScene(device);
     // Later useful for different custom precomputation operations.
-    rtcSetSceneFlags(rtcscene, RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION);
-
-    for (int i = 0; i < (int)subscenes.size(); ++i) {
-        SubScene &subscene = *subscenes[i];
-        if (!subscene.rtcscene)
-            subscene.create_rtc_scene(device);
+    int flags = RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION | options.flags;
+    if (options.dynamic)
+        flags |= RTC_SCENE_FLAG_DYNAMIC;
+    rtcSetSceneFlags(rtcscene, (RTCSceneFlags)flags);
+    rtcSetSceneBuildQuality(rtcscene, options.quality);
+
+    create_subscene_rtc_scenes(device, options);
+    // Groups only instance earlier groups, so they are built in order.
+    for (uint32_t g = 0; g < (uint32_t)groups.size(); ++g) {
+        InstanceGroup &group = *groups[g];
+        group.levels = 1;
+        for (const SubSceneInstance &member : group.instances) {
+            if (member.group)
+                group.levels = std::max(group.levels, 1 + groups[member.prototype]->levels);
+        }
+        if (!group.committed) {
+            rtcSetSceneBuildQuality(group.rtcscene, options.quality);
+            rtcCommitScene(group.rtcscene);
+            group.committed = true;
+        }
+    }
+    for (const SubSceneInstance &instance : instances) {
+        uint32_t levels = instance.group ? 1 + groups[instance.prototype]->levels : 1;
+        ASSERT(levels <= RTC_MAX_INSTANCE_LEVEL_COUNT,
+               "%u instance levels need embree built with EMBREE_MAX_INSTANCE_LEVEL_COUNT >= %u.", levels, levels);
     }
     for (int j = 0; j < instances.size(); ++j) {
         rtcAttachGeometry(rtcscene, instances[j].rtgeom_inst);
     }
 
     // build bvh, etc.
+    using clock = std::chrono::steady_clock;
+    clock::time_point start = clock::now();
+    int64_t start_memory = device.memory_usage();
     rtcCommitScene(rtcscene);
+    if (options.report) {
+        printf("Top-level BVH over %zu instances built in %.3f sec, %.2f MB.\n", instances.size(),
+               std::chrono::duration<float>(clock::now() - start).count(),
+               (double)(device.memory_usage() - start_memory) / (1 << 20));
+    }
+    dirty = false;
+}
+
+Scene Scene::share_prototypes(const EmbreeDevice &device, const EmbreeBuildOptions &options,
+                              std::span<const Transform> transforms) const
+{
+    ASSERT(transforms.empty() || transforms.size() == instances.size());
+    Scene scene;
+    scene.subscenes = subscenes;
+    scene.groups = groups;
+    scene.residency = residency;
+    for (uint32_t inst_id = 0; inst_id < (uint32_t)instances.size(); ++inst_id) {
+        const SubSceneInstance &instance = instances[inst_id];
+        ASSERT(instance.group ? groups[instance.prototype]->committed : (bool)subscenes[instance.prototype]->rtcscene,
+               "Prototypes must be built before sharing them.");
+        const Transform &transform = transforms.empty() ? instance.transform : transforms[inst_id];
+        if (instance.group) {
+            scene.add_group_instance(device, instance.prototype, transform);
+        } else {
+            scene.add_instance(device, instance.prototype, transform);
+        }
+        if (transforms.empty() && !instance.motion.empty())
+            scene.set_instance_motion(inst_id, instance.motion);
+    }
+    scene.create_rtc_scene(device, options);
+    return scene;
 }
 
 AABB3 Scene::bound() const
@@ -145,38 +416,136 @@ AABB3 Scene::bound() const
 
 bool Scene::intersect1(const Ray &ray, SceneHit &hit, const IntersectContext &ctx) const
 {
-    RTCRayHit rayhit = spawn_rtcrayhit(ray.origin, ray.dir, ray.tmin, ray.tmax);
+    stat_intersect1.add();
+    RTCRayHit rayhit = spawn_rtcrayhit(ray.origin, ray.dir, ray.tmin, ray.tmax, ray.time);
+    if (!ks::intersect1(rtcscene, ctx, rayhit)) {
+        return false;
+    }
+
+    fill_scene_hit(rayhit, ray, hit);
+    return true;
+}
+
+static HitRecord to_hit_record(const RTCRayHit &rayhit)
+{
+    HitRecord record;
+    record.t = rayhit.ray.tfar;
+    record.uv = vec2(rayhit.hit.u, rayhit.hit.v);
+    record.ng = vec3(rayhit.hit.Ng_x, rayhit.hit.Ng_y, rayhit.hit.Ng_z);
+    record.prim_id = rayhit.hit.primID;
+    record.geom_id = rayhit.hit.geomID;
+    std::copy_n(rayhit.hit.instID, RTC_MAX_INSTANCE_LEVEL_COUNT, record.inst_path.begin());
+    return record;
+}
+
+bool Scene::intersect1(const Ray &ray, HitRecord &record, const IntersectContext &ctx) const
+{
+    stat_intersect1.add();
+    RTCRayHit rayhit = spawn_rtcrayhit(ray.origin, ray.dir, ray.tmin, ray.tmax, ray.time);
     if (!ks::intersect1(rtcscene, ctx, rayhit)) {
         return false;
     }
+    record = to_hit_record(rayhit);
+    return true;
+}
 
-    uint32_t inst_id = rayhit.hit.instID[0];
-    hit.subscene_id = instances[inst_id].prototype;
+void Scene::promote(const HitRecord &record, const Ray &ray, SceneHit &hit, bool apply_normal_map) const
+{
+    RTCRayHit rayhit = spawn_rtcrayhit(ray.origin, ray.dir, ray.tmin, record.t, ray.time);
+    rayhit.hit.u = record.uv.x();
+    rayhit.hit.v = record.uv.y();
+    rayhit.hit.Ng_x = record.ng.x();
+    rayhit.hit.Ng_y = record.ng.y();
+    rayhit.hit.Ng_z = record.ng.z();
+    rayhit.hit.primID = record.prim_id;
+    rayhit.hit.geomID = record.geom_id;
+    std::copy_n(record.inst_path.begin(), RTC_MAX_INSTANCE_LEVEL_COUNT, rayhit.hit.instID);
+    fill_scene_hit(rayhit, ray, hit, apply_normal_map);
+}
+
+void Scene::fill_scene_hit(const RTCRayHit &rayhit, const Ray &ray, SceneHit &hit, bool apply_normal_map) const
+{
+    std::copy_n(rayhit.hit.instID, RTC_MAX_INSTANCE_LEVEL_COUNT, hit.inst_path.begin());
+    Transform to_world;
+    const SubSceneInstance &instance = resolve_instance(hit.inst_path, ray.time, to_world);
+    hit.subscene_id = instance.prototype;
     hit.geom_id = rayhit.hit.geomID;
+    hit.inst_id = hit.inst_path[0];
 
     const SubScene &subscene = *subscenes[hit.subscene_id];
     const Geometry &geom = *subscene.geometries[hit.geom_id];
-    const Transform &transform = instances[inst_id].transform;
-    hit.it = geom.compute_intersection(rayhit, ray, transform);
+    hit.it = geom.compute_intersection(rayhit, ray, to_world);
+    hit.it.time = ray.time;
 
     if (!subscene.materials.empty()) {
         hit.material = subscene.materials[rayhit.hit.geomID];
-        if (hit.material->normal_map) {
+        if (apply_normal_map && hit.material->normal_map) {
             hit.material->normal_map->apply(hit.it);
         }
     }
-
-    return true;
 }
 
 bool Scene::occlude1(const Ray &ray, const IntersectContext &ctx) const
 {
-    RTCRay rtcray = spawn_ray(ray.origin, ray.dir, ray.tmin, ray.tmax);
+    stat_occlude1.add();
+    RTCRay rtcray = spawn_ray(ray.origin, ray.dir, ray.tmin, ray.tmax, ray.time);
     return ks::occlude1(rtcscene, ctx, rtcray);
 }
 
+void Scene::intersect_stream(std::span<const Ray> rays, std::span<SceneHit> hits, std::span<uint8_t> found,
+                             bool coherent, const IntersectContext &ctx) const
+{
+    ASSERT(hits.size() == rays.size() && found.size() == rays.size());
+    // Reuse per-thread SoA buffers to avoid allocating on every call.
+    static thread_local RayHitStream stream;
+    uint32_t n = (uint32_t)rays.size();
+    stat_intersect_stream_rays.add(n);
+    stream.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        stream.set_ray(i, rays[i].origin, rays[i].dir, rays[i].tmin, rays[i].tmax, rays[i].time);
+    }
+    ks::intersect_stream(rtcscene, ctx, stream, coherent);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        found[i] = stream.hit(i);
+        if (found[i]) {
+            fill_scene_hit(stream.rayhit(i), rays[i], hits[i]);
+        }
+    }
+}
+
+void Scene::occlude_stream(std::span<const Ray> rays, std::span<uint8_t> occluded, bool coherent,
+                           const IntersectContext &ctx) const
+{
+    ASSERT(occluded.size() == rays.size());
+    static thread_local RayStream stream;
+    uint32_t n = (uint32_t)rays.size();
+    stat_occlude_stream_rays.add(n);
+    stream.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        stream.set_ray(i, rays[i].origin, rays[i].dir, rays[i].tmin, rays[i].tmax, rays[i].time);
+    }
+    ks::occlude_stream(rtcscene, ctx, stream, coherent);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        occluded[i] = stream.tfar[i] == -inf;
+    }
+}
+
 const Transform &Scene::get_instance_transform(uint32_t inst_id) const { return instances[inst_id].transform; }
 
+const SubSceneInstance &Scene::resolve_instance(const InstancePath &path, float time, Transform &to_world) const
+{
+    const SubSceneInstance *instance = &instances[path[0]];
+    to_world = instance->motion.empty() ? instance->transform : instance->transform_at(time);
+    for (uint32_t level = 1; instance->group; ++level) {
+        ASSERT_HOT(level < path.size() && path[level] != RTC_INVALID_GEOMETRY_ID);
+        instance = &groups[instance->prototype]->instances[path[level]];
+        to_world = to_world * instance->transform;
+    }
+    return *instance;
+}
+
 const MeshGeometry &Scene::get_prototype_mesh_geometry(uint32_t subscene_id, uint32_t geom_id) const
 {
     return dynamic_cast<const MeshGeometry &>(*subscenes[subscene_id]->geometries[geom_id]);
@@ -199,12 +568,107 @@ bool Scene::are_material_assigned() const
     return true;
 }
 
+bool LocalGeometry::intersect1(const Ray &ray, HitRecord &record) const
+{
+    stat_local_rays.add();
+    if (inst_path[0] == unknown_instance) {
+        IntersectContext ctx;
+        ctx.context.filter = filter_local_geometry;
+        ctx.ext = (void *)&geom_id;
+        return scene->intersect1(ray, record, ctx);
+    }
+
+    Transform to_world;
+    const SubSceneInstance &instance = scene->resolve_instance(inst_path, ray.time, to_world);
+    RTCScene local = scene->subscenes[instance.prototype]->local_rtc_scene(geom_id);
+    // The direction is not normalized, so that distances along the ray stay the same in prototype space.
+    vec3 origin = transform_point(to_world.inv, ray.origin);
+    vec3 dir = transform_dir(to_world.inv, ray.dir);
+    RTCRayHit rayhit = spawn_rtcrayhit(origin, dir, ray.tmin, ray.tmax, ray.time);
+    if (!ks::intersect1(local, rayhit)) {
+        return false;
+    }
+    record = to_hit_record(rayhit);
+    // Make it look like a hit of the full scene.
+    record.geom_id = geom_id;
+    record.inst_path = inst_path;
+    return true;
+}
+
 bool LocalGeometry::intersect1(const Ray &ray, SceneHit &hit) const
 {
-    IntersectContext ctx;
-    ctx.context.filter = filter_local_geometry;
-    ctx.ext = (void *)&geom_id;
-    return scene->intersect1(ray, hit, ctx);
+    HitRecord record;
+    if (!intersect1(ray, record)) {
+        return false;
+    }
+    scene->promote(record, ray, hit);
+    return true;
+}
+
+void LocalGeometry::intersect_stream(std::span<const LocalGeometry> local_geometries, std::span<const Ray> rays,
+                                     std::span<HitRecord> records, std::span<uint8_t> found)
+{
+    ASSERT(local_geometries.size() == rays.size() && records.size() == rays.size() && found.size() == rays.size());
+    static thread_local std::vector<uint32_t> order;
+    static thread_local RayHitStream stream;
+    uint32_t n = (uint32_t)rays.size();
+    stat_local_rays.add(n);
+    auto key = [&](uint32_t i) {
+        const LocalGeometry &local = local_geometries[i];
+        return std::tuple((uintptr_t)local.scene, local.inst_path, local.geom_id);
+    };
+    order.resize(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return key(a) < key(b); });
+
+    for (uint32_t begin = 0, end; begin < n; begin = end) {
+        end = begin + 1;
+        while (end < n && key(order[end]) == key(order[begin])) {
+            ++end;
+        }
+        const LocalGeometry &local = local_geometries[order[begin]];
+        stream.resize(end - begin);
+        // Same setup as intersect1, but for the whole group.
+        IntersectContext ctx;
+        RTCScene target;
+        bool unknown = local.inst_path[0] == unknown_instance;
+        if (unknown) {
+            ctx.context.filter = filter_local_geometry;
+            ctx.ext = (void *)&local.geom_id;
+            target = local.scene->rtcscene;
+            for (uint32_t j = begin; j < end; ++j) {
+                const Ray &ray = rays[order[j]];
+                stream.set_ray(j - begin, ray.origin, ray.dir, ray.tmin, ray.tmax, ray.time);
+            }
+        } else {
+            Transform to_world;
+            const SubSceneInstance &instance = local.scene->resolve_instance(local.inst_path, 0.0f, to_world);
+            target = local.scene->subscenes[instance.prototype]->local_rtc_scene(local.geom_id);
+            // Only top-level instances have motion.
+            bool moving = !local.scene->instances[local.inst_path[0]].motion.empty();
+            for (uint32_t j = begin; j < end; ++j) {
+                const Ray &ray = rays[order[j]];
+                if (moving)
+                    local.scene->resolve_instance(local.inst_path, ray.time, to_world);
+                vec3 origin = transform_point(to_world.inv, ray.origin);
+                vec3 dir = transform_dir(to_world.inv, ray.dir);
+                stream.set_ray(j - begin, origin, dir, ray.tmin, ray.tmax, ray.time);
+            }
+        }
+        ks::intersect_stream(target, ctx, stream);
+
+        for (uint32_t j = begin; j < end; ++j) {
+            uint32_t i = order[j];
+            found[i] = stream.hit(j - begin);
+            if (found[i]) {
+                records[i] = to_hit_record(stream.rayhit(j - begin));
+                if (!unknown) {
+                    records[i].geom_id = local.geom_id;
+                    records[i].inst_path = local.inst_path;
+                }
+            }
+        }
+    }
 }
 
 } // namespace ks
\ No newline at end of file
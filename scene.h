@@ -1,7 +1,10 @@
 #pragma once
 #include "embree_util.h"
 #include "geometry.h"
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <span>
 
 namespace ks
 {
@@ -9,6 +12,20 @@ namespace ks
 struct BSDF;
 struct BSSRDF;
 struct Material;
+struct ResidencyManager;
+struct SubSceneProxy;
+
+// Instance ids of a hit from the top level down (embree's instID stack), RTC_INVALID_GEOMETRY_ID below the last level.
+// Paths are longer than one level only through instance groups (see InstanceGroup).
+using InstancePath = std::array<uint32_t, RTC_MAX_INSTANCE_LEVEL_COUNT>;
+
+inline InstancePath make_instance_path(uint32_t inst_id)
+{
+    InstancePath path;
+    path.fill(RTC_INVALID_GEOMETRY_ID);
+    path[0] = inst_id;
+    return path;
+}
 
 struct SceneHit
 {
@@ -16,6 +33,25 @@ struct SceneHit
     const Material *material = nullptr;
     uint32_t subscene_id = 0;
     uint32_t geom_id = 0; //
+    // Top-level instance (inst_path[0]).
+    uint32_t inst_id = 0;
+    InstancePath inst_path = make_instance_path(0);
+};
+
+// Minimal record of a hit for queries that only need the distance or position (e.g. subsurface probes).
+// Scene::promote computes the full SceneHit (shading frame, differentials, normal mapping) on demand.
+struct HitRecord
+{
+    vec3 position(const Ray &ray) const { return ray.origin + t * ray.dir; }
+
+    float t = inf;
+    // Barycentrics as returned by embree.
+    vec2 uv = vec2::Zero();
+    // Unnormalized geometric normal in prototype space.
+    vec3 ng = vec3::Zero();
+    uint32_t prim_id = 0;
+    uint32_t geom_id = 0;
+    InstancePath inst_path = make_instance_path(0);
 };
 
 struct SubScene
@@ -25,21 +61,60 @@ struct SubScene
     SubScene(SubScene &&other);
     SubScene &operator=(SubScene &&other);
 
-    void create_rtc_scene(const EmbreeDevice &device);
+    void create_rtc_scene(const EmbreeDevice &device, const EmbreeBuildOptions &options = {});
+    // BVH over geometries[geom_id] alone (in prototype space) for LocalGeometry queries. Built on first use with the
+    // device of create_rtc_scene. Thread-safe.
+    RTCScene local_rtc_scene(uint32_t geom_id) const;
 
+    // Null while an out-of-core subscene isn't resident (see SubSceneProxy).
     std::vector<std::unique_ptr<Geometry>> geometries;
     std::vector<const Material *> materials;
 
     RTCScene rtcscene = nullptr;
+
+    struct LocalScenes
+    {
+        LocalScenes(RTCDevice device, uint32_t num_geometries) : device(device), scenes(num_geometries) {}
+        ~LocalScenes();
+
+        RTCDevice device;
+        std::vector<std::atomic<RTCScene>> scenes;
+        std::mutex build_mutex;
+    };
+    std::unique_ptr<LocalScenes> local_scenes;
+    // Set for out-of-core subscenes: rtcscene then only holds their bounds.
+    std::unique_ptr<SubSceneProxy> proxy;
 };
 
 struct SubSceneInstance
 {
+    // Shading transform at the shutter time in [0, 1].
+    Transform transform_at(float time) const;
+
+    // A subscene, or an instance group if group is set.
     uint32_t prototype = 0;
+    bool group = false;
+    // The first time step if the instance is motion blurred.
     Transform transform;
+    // Transforms uniformly spaced over the shutter interval. Empty if static.
+    std::vector<Transform> motion;
     RTCGeometry rtgeom_inst = nullptr;
 };
 
+// A scene of instances (of subscenes or of other groups) that is itself instanced like a subscene, for prototype
+// hierarchies such as kits of kits: each level is stored once instead of flattening it into top-level instances.
+// Every level of nesting takes one level of embree instancing (EMBREE_MAX_INSTANCE_LEVEL_COUNT, 1 by default).
+struct InstanceGroup
+{
+    ~InstanceGroup();
+
+    std::vector<SubSceneInstance> instances;
+    // Instance levels inside the group (1 without nested groups).
+    uint32_t levels = 1;
+    RTCScene rtcscene = nullptr;
+    bool committed = false;
+};
+
 struct Scene
 {
     ~Scene();
@@ -48,30 +123,112 @@ struct Scene
     Scene &operator=(Scene &&other);
 
     void add_subscene(SubScene && subscene);
+    // Build the BVHs of subscenes that don't have one yet (concurrently unless disabled in options).
+    // Must be called before adding instances of them.
+    void create_subscene_rtc_scenes(const EmbreeDevice &device, const EmbreeBuildOptions &options = {});
     void add_instance(const EmbreeDevice &device, uint32_t subscene_id, const Transform &transform);
-    void create_rtc_scene(const EmbreeDevice &device);
+    // Instance groups: add groups before the groups and instances that refer to them. Group BVHs are built by
+    // create_rtc_scene.
+    uint32_t add_instance_group(const EmbreeDevice &device);
+    // Adds an instance of a subscene (or of an earlier group if instance_group) to group_id.
+    void add_group_member(const EmbreeDevice &device, uint32_t group_id, uint32_t prototype, bool instance_group,
+                          const Transform &transform);
+    // Adds a top-level instance of a group.
+    void add_group_instance(const EmbreeDevice &device, uint32_t group_id, const Transform &transform);
+    void create_rtc_scene(const EmbreeDevice &device, const EmbreeBuildOptions &options = {});
+    // New scene with the same instances of the same (shared, already built) subscenes and a top-level BVH of its own,
+    // so that it can be rendered concurrently with this one under other instance transforms (e.g. the frames of a
+    // sequence). If not empty, transforms replace the instance transforms (and motion).
+    Scene share_prototypes(const EmbreeDevice &device, const EmbreeBuildOptions &options = {},
+                           std::span<const Transform> transforms = {}) const;
+
+    // Incremental updates for animation (see render_sequence_task). Instead of creating a new scene per frame, change
+    // instance transforms, then call commit_updates() once before rendering. Only the top-level BVH is rebuilt.
+    void set_instance_transform(uint32_t inst_id, const Transform &transform);
+    // NOTE: only top-level instances can be updated.
+    // Motion blur: at least one transform, uniformly spaced over the shutter interval.
+    void set_instance_motion(uint32_t inst_id, std::span<const Transform> transforms);
+    // Returns false if nothing changed since the last commit.
+    bool commit_updates();
+
     AABB3 bound() const;
     bool intersect1(const Ray &ray, SceneHit &hit, const IntersectContext &ctx = IntersectContext()) const;
+    bool intersect1(const Ray &ray, HitRecord &record, const IntersectContext &ctx = IntersectContext()) const;
+    // Full shading data of a record found along ray. Normal mapping (a texture fetch) can be skipped if only the
+    // geometric data is needed.
+    void promote(const HitRecord &record, const Ray &ray, SceneHit &hit, bool apply_normal_map = true) const;
     bool occlude1(const Ray &ray, const IntersectContext &ctx = IntersectContext()) const;
+    // Batched versions of the above: found/occluded is written per ray (0 or 1).
+    // Set coherent only for rays with similar origins and directions (e.g. camera rays).
+    void intersect_stream(std::span<const Ray> rays, std::span<SceneHit> hits, std::span<uint8_t> found,
+                          bool coherent = false, const IntersectContext &ctx = IntersectContext()) const;
+    void occlude_stream(std::span<const Ray> rays, std::span<uint8_t> occluded, bool coherent = false,
+                        const IntersectContext &ctx = IntersectContext()) const;
 
     // Convenience methods
     const Transform &get_instance_transform(uint32_t inst_id) const;
+    // The subscene instance at the end of path, and its transform to world space at time (composed along the path).
+    const SubSceneInstance &resolve_instance(const InstancePath &path, float time, Transform &to_world) const;
+    // Calls func(instance, to_world) for every subscene instance, expanding groups (at their static transforms).
+    template <typename Func>
+    void for_each_subscene_instance(const Func &func) const;
     const MeshGeometry &get_prototype_mesh_geometry(uint32_t subscene_id, uint32_t geom_id) const;
     const Material &get_prototype_material(uint32_t subscene_id, uint32_t geom_id) const;
     bool are_material_assigned() const;
 
-    std::vector<std::unique_ptr<SubScene>> subscenes;
+    // NOTE: may be shared with other scenes (see share_prototypes).
+    std::vector<std::shared_ptr<SubScene>> subscenes;
+    std::vector<std::shared_ptr<InstanceGroup>> groups;
     std::vector<SubSceneInstance> instances;
+    // Set if some subscenes are out-of-core. Renderers call residency->trim() between traversals.
+    std::shared_ptr<ResidencyManager> residency;
 
     RTCScene rtcscene = nullptr;
+    bool dirty = false;
+
+  private:
+    void fill_scene_hit(const RTCRayHit &rayhit, const Ray &ray, SceneHit &hit, bool apply_normal_map = true) const;
+    template <typename Func>
+    void for_each_subscene_instance(const SubSceneInstance &instance, const Transform &to_world,
+                                    const Func &func) const;
 };
 
+template <typename Func>
+void Scene::for_each_subscene_instance(const Func &func) const
+{
+    for (const SubSceneInstance &instance : instances)
+        for_each_subscene_instance(instance, instance.transform, func);
+}
+
+template <typename Func>
+void Scene::for_each_subscene_instance(const SubSceneInstance &instance, const Transform &to_world,
+                                       const Func &func) const
+{
+    if (!instance.group) {
+        func(instance, to_world);
+        return;
+    }
+    for (const SubSceneInstance &member : groups[instance.prototype]->instances)
+        for_each_subscene_instance(member, to_world * member.transform, func);
+}
+
+// Hits of a single geometry instance (e.g. for subsurface random walks).
 struct LocalGeometry
 {
-    const Scene *scene = nullptr;
-    uint32_t geom_id = 0;
+    static constexpr uint32_t unknown_instance = ~0u;
 
+    // Traces the per-geometry BVH of the prototype (see SubScene::local_rtc_scene). Without an instance, traces the
+    // full scene and rejects hits on geom_id of other geometries in a filter callback.
+    bool intersect1(const Ray &ray, HitRecord &record) const;
     bool intersect1(const Ray &ray, SceneHit &hit) const;
+    // Same results as intersect1 for each (local_geometries[i], rays[i]). Rays that query the same local BVH are
+    // traced together as one stream.
+    static void intersect_stream(std::span<const LocalGeometry> local_geometries, std::span<const Ray> rays,
+                                 std::span<HitRecord> records, std::span<uint8_t> found);
+
+    const Scene *scene = nullptr;
+    uint32_t geom_id = 0;
+    InstancePath inst_path = make_instance_path(unknown_instance);
 };
 
 } // namespace ks
\ No newline at end of file
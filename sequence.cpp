@@ -0,0 +1,143 @@
+#include "sequence.h"
+#include "camera.h"
+#include "embree_util.h"
+#include "file_util.h"
+#include "light_sampler.h"
+#include "parallel.h"
+#include "render_target.h"
+#include "scene.h"
+#include "wavefront.h"
+#include <atomic>
+#include <chrono>
+#include <tbb/task_arena.h>
+
+namespace ks
+{
+
+struct SequenceFrame
+{
+    float time = 0.0f;
+    std::unique_ptr<Camera> camera;
+    // Of the animated instances, in the order of SequenceAnimation::instances.
+    std::vector<Transform> transforms;
+};
+
+struct SequenceAnimation
+{
+    std::vector<uint32_t> instances;
+};
+
+// scene is the frame scene of the calling worker (see render_sequence_task). Only its top-level BVH is rebuilt.
+static void render_frame(const WavefrontTask &task, Scene &scene, const SequenceAnimation &animation,
+                         const SequenceFrame &frame, int frame_id, const fs::path &task_dir)
+{
+    for (size_t i = 0; i < animation.instances.size(); ++i)
+        scene.set_instance_transform(animation.instances[i], frame.transforms[i]);
+    scene.commit_updates();
+    RenderTarget rt = task.create_render_target();
+    WavefrontOptions options = task.options;
+    std::unique_ptr<NonFiniteLog> nonfinite_log;
+    if (task.nonfinite_log) {
+        nonfinite_log = std::make_unique<NonFiniteLog>();
+        options.nonfinite_log = nonfinite_log.get();
+    }
+    render_wavefront(scene, *frame.camera, task.light_ptrs, options, rt, task.light_sampler.get());
+
+    if (nonfinite_log && nonfinite_log->count > 0) {
+        nonfinite_log->write(task_dir / string_format("nonfinite_%04d.txt", frame_id), rt);
+    }
+    rt.save_layers_to_exr_async(task_dir / string_format("frame_%04d.exr", frame_id), task.exr_options);
+    if (task.denoise) {
+        RenderTarget denoised(rt.width, rt.height, color3::Zero());
+        denoised.pixels = denoise(rt, *task.denoise);
+        denoised.save_layers_to_exr_async(task_dir / string_format("denoised_%04d.exr", frame_id), task.exr_options);
+    }
+}
+
+void render_sequence_task(const ConfigArgs &args, const fs::path &task_dir, int task_id)
+{
+    int n_frames = args.load_integer("frames");
+    float time_start = args.load_float("time_start", 0.0f);
+    float time_end = args.load_float("time_end", 1.0f);
+    ASSERT(n_frames > 0);
+    ASSERT(!args.contains("progressive") && !args.contains("distributed") && !args.contains("motion_blur"),
+           "Sequences don't support progressive, distributed or motion blurred rendering.");
+
+    auto start = std::chrono::steady_clock::now();
+    args.update_time(time_start);
+    std::unique_ptr<WavefrontTask> task = load_wavefront_task(args, task_dir);
+    EmbreeBuildOptions build_options;
+    if (args.contains("bvh")) {
+        build_options = load_embree_build_options(args["bvh"]);
+    }
+    std::chrono::duration<double> load_duration = std::chrono::steady_clock::now() - start;
+    printf("Loading the static scene took %.3f sec.\n", load_duration.count());
+
+    // Evaluate every frame up front: ConfigArgs times are not meant to be updated concurrently.
+    // NOTE: lights (including mesh lights of animated instances) are not animated.
+    SequenceAnimation animation;
+    int n_animated = args.contains("animation") ? args["animation"].array_size() : 0;
+    for (int i = 0; i < n_animated; ++i) {
+        int inst_id = args["animation"][i].load_integer("instance");
+        ASSERT(inst_id >= 0 && inst_id < (int)task->scene->instances.size(), "Invalid instance [%d].", inst_id);
+        animation.instances.push_back((uint32_t)inst_id);
+    }
+    std::vector<SequenceFrame> frames(n_frames);
+    std::vector<float> times(n_frames);
+    for (int f = 0; f < n_frames; ++f) {
+        SequenceFrame &frame = frames[f];
+        frame.time = n_frames == 1 ? time_start : std::lerp(time_start, time_end, (float)f / (float)(n_frames - 1));
+        times[f] = frame.time;
+        args.update_time(frame.time);
+        frame.camera = create_camera(args["camera"]);
+    }
+    // All frames of an instance at once: a single walk over its keyframes.
+    for (int i = 0; i < n_animated; ++i) {
+        std::vector<Transform> transforms = args["animation"][i].load_transform_n("to_world", times);
+        for (int f = 0; f < n_frames; ++f)
+            frames[f].transforms.push_back(transforms[f]);
+    }
+
+    // Small frames don't have enough paths per wave to keep all threads busy, so render several at once.
+    int num_threads = tbb::this_task_arena::max_concurrency();
+    int concurrent_frames = args.load_integer("concurrent_frames", 0);
+    if (concurrent_frames <= 0) {
+        int min_pixels = args.load_integer("min_pixels_per_frame", 1 << 20);
+        concurrent_frames = std::max(1, min_pixels / std::max(1, task->width * task->height));
+    }
+    concurrent_frames = std::clamp(concurrent_frames, 1, std::min(n_frames, num_threads));
+    // Frames share the out-of-core prototypes, which are only evicted between the bounces of a single render.
+    if (task->scene->residency)
+        concurrent_frames = 1;
+    int threads_per_frame = std::max(1, num_threads / concurrent_frames);
+    printf("Rendering %d frames, %d at a time with %d threads each.\n", n_frames, concurrent_frames,
+           threads_per_frame);
+
+    start = std::chrono::steady_clock::now();
+    std::atomic<int> next_frame = 0;
+    // Each worker keeps one scene sharing the prototypes for all its frames and updates the animated instances in
+    // place; its top-level BVH is rebuilt every frame.
+    build_options.dynamic = true;
+    auto worker = [&]() {
+        tbb::task_arena arena(threads_per_frame);
+        Scene scene;
+        arena.execute([&]() { scene = task->scene->share_prototypes(*task->device, build_options); });
+        for (int f = next_frame++; f < n_frames; f = next_frame++) {
+            arena.execute([&]() { render_frame(*task, scene, animation, frames[f], f, task_dir); });
+        }
+    };
+    if (concurrent_frames == 1) {
+        worker();
+    } else {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < concurrent_frames; ++i)
+            threads.emplace_back(worker);
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    printf("Rendering %d frames took %.3f sec (%.3f sec per frame).\n", n_frames, duration.count(),
+           duration.count() / n_frames);
+}
+
+} // namespace ks
\ No newline at end of file
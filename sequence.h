@@ -0,0 +1,26 @@
+#pragma once
+#include "config.h"
+#include <filesystem>
+namespace fs = std::filesystem;
+
+namespace ks
+{
+
+// Renders the frames of an animation with the wavefront path tracer. Assets, subscene BVHs, lights and the light
+// sampler are loaded once and shared read-only by all frames. Each frame worker keeps one scene over the shared
+// subscenes; per frame, only the camera and the animated instance transforms are re-evaluated and the top-level BVH is
+// rebuilt (Scene::set_instance_transform + commit_updates). Frames too small to keep all cores busy are rendered
+// concurrently, each worker in a TBB arena of its own. Writes task_dir/frame_XXXX.exr (and denoised_XXXX.exr).
+//
+// ...                  # same arguments as render_wavefront_task (without progressive, distributed and motion_blur)
+// frames = 24
+// time_start = 0.0     # normalized keyframe time of the first and last frames
+// time_end = 1.0
+// concurrent_frames = 0 # 0: from the resolution (see min_pixels_per_frame)
+// min_pixels_per_frame = 1048576
+// [[animation]]        # keyframed instance transforms
+// instance = 0
+// to_world = ...
+void render_sequence_task(const ConfigArgs &args, const fs::path &task_dir, int task_id);
+
+} // namespace ks
\ No newline at end of file
@@ -1 +1,26 @@
-#include "shader_field.h"
\ No newline at end of file
+#include "shader_field.h"
+#include <typeinfo>
+
+namespace ks
+{
+
+TextureFieldBase::TextureFieldBase(const Texture &texture, std::unique_ptr<TextureSampler> &&sampler, bool flip_v,
+                                   const vec2 &uv_scale, const vec2 &uv_offset)
+    : texture(&texture), sampler(std::move(sampler)), flip_v(flip_v), uv_scale(uv_scale), uv_offset(uv_offset)
+{
+    fast_lookup = resolve_texture_lookup(*this->sampler, texture);
+}
+
+bool TextureFieldBase::same_lookup(const TextureFieldBase &other) const
+{
+    if (texture != other.texture || flip_v != other.flip_v || uv_scale != other.uv_scale ||
+        uv_offset != other.uv_offset) {
+        return false;
+    }
+    if (sampler->wrap_mode_u != other.sampler->wrap_mode_u || sampler->wrap_mode_v != other.sampler->wrap_mode_v)
+        return false;
+    // Specialized lookups only exist for samplers without parameters beyond the wrap modes.
+    return fast_lookup && fast_lookup == other.fast_lookup && typeid(*sampler) == typeid(*other.sampler);
+}
+
+} // namespace ks
\ No newline at end of file
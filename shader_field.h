@@ -2,6 +2,7 @@
 #include "config.h"
 #include "ray.h"
 #include "texture.h"
+#include <array>
 #include <numeric>
 
 namespace ks
@@ -33,51 +34,137 @@ struct ConstantField : public ShaderField<T>
     T value;
 };
 
+// Texture lookup of a TextureField. The lookup is specialized on the sampler, data type and channel count when the
+// field is built (see resolve_texture_lookup), with the virtual sampler call as the fallback.
+struct TextureFieldBase
+{
+    TextureFieldBase() = default;
+    TextureFieldBase(const Texture &texture, std::unique_ptr<TextureSampler> &&sampler, bool flip_v,
+                     const vec2 &uv_scale, const vec2 &uv_offset);
+    virtual ~TextureFieldBase() = default;
+
+    // All channels of the texture (up to 4).
+    void lookup(const vec2 &uv, const mat2 &duvdxy, std::array<float, 4> &out) const
+    {
+        vec2 flip_uv = uv;
+        mat2 flip_duvdxy = duvdxy;
+        if (flip_v) {
+            flip_uv[1] = 1.0f - flip_uv[1];
+            flip_duvdxy(0, 1) *= -1.0f;
+            flip_duvdxy(1, 1) *= -1.0f;
+        }
+        flip_uv = flip_uv.cwiseProduct(uv_scale) + uv_offset;
+        flip_duvdxy(0, 0) *= uv_scale[0];
+        flip_duvdxy(1, 0) *= uv_scale[0];
+        flip_duvdxy(0, 1) *= uv_scale[1];
+        flip_duvdxy(1, 1) *= uv_scale[1];
+
+        if (fast_lookup)
+            fast_lookup(*sampler, *texture, flip_uv, flip_duvdxy, out.data());
+        else
+            (*sampler)(*texture, flip_uv, flip_duvdxy, {out.data(), out.size()});
+    }
+    // True if lookup gives the same results for both fields (same texture, sampler and uv transform).
+    bool same_lookup(const TextureFieldBase &other) const;
+
+    const Texture *texture = nullptr;
+    std::unique_ptr<TextureSampler> sampler;
+    TextureLookup fast_lookup = nullptr;
+    bool flip_v = true; // This is very common for some reasons...
+    vec2 uv_scale = vec2::Ones();
+    vec2 uv_offset = vec2::Zero();
+};
+
 template <int N>
-struct TextureField : public ShaderField<color<N>>
+struct TextureField : public ShaderField<color<N>>, public TextureFieldBase
 {
     TextureField() = default;
     TextureField(const Texture &texture, std::unique_ptr<TextureSampler> &&sampler, bool flip_v = true,
                  const arri<N> *swizzle = nullptr, const vec2 &uv_scale = vec2::Ones(),
                  const vec2 &uv_offset = vec2::Zero())
-        : texture(&texture), sampler(std::move(sampler)), flip_v(flip_v), uv_scale(uv_scale), uv_offset(uv_offset)
+        : TextureFieldBase(texture, std::move(sampler), flip_v, uv_scale, uv_offset)
     {
         if (!swizzle)
             std::iota(this->swizzle.data(), this->swizzle.data() + N, 0);
         else {
             this->swizzle = *swizzle;
         }
+        for (int i = 0; i < N; ++i)
+            ASSERT(this->swizzle[i] < std::min(texture.num_channels, 4), "Invalid texture swizzle.");
     }
 
     color<N> operator()(const vec2 &uv, const mat2 &duvdxy) const
     {
-        vec2 flip_uv = uv;
-        mat2 flip_duvdxy = duvdxy;
-        if (flip_v) {
-            flip_uv[1] = 1.0f - flip_uv[1];
-            flip_duvdxy(0, 1) *= -1.0f;
-            flip_duvdxy(1, 1) *= -1.0f;
-        }
-        flip_uv = flip_uv.cwiseProduct(uv_scale) + uv_offset;
-        flip_duvdxy(0, 0) *= uv_scale[0];
-        flip_duvdxy(1, 0) *= uv_scale[0];
-        flip_duvdxy(0, 1) *= uv_scale[1];
-        flip_duvdxy(1, 1) *= uv_scale[1];
+        std::array<float, 4> out;
+        lookup(uv, duvdxy, out);
+        return apply_swizzle(out);
+    }
 
-        VLA(out, float, texture->num_channels);
-        (*sampler)(*texture, flip_uv, flip_duvdxy, {out, (size_t)texture->num_channels});
+    color<N> apply_swizzle(const std::array<float, 4> &out) const
+    {
         color<N> c;
         for (int i = 0; i < N; ++i)
             c[i] = swizzle[i] >= 0 ? out[swizzle[i]] : 0.0f;
         return c;
     }
 
-    const Texture *texture = nullptr;
-    std::unique_ptr<TextureSampler> sampler;
     arri<N> swizzle;
-    bool flip_v = true; // This is very common for some reasons...
-    vec2 uv_scale = vec2::Ones();
-    vec2 uv_offset = vec2::Zero();
+};
+
+// Evaluates M fields of a material at one hit. Texture fields with the same lookup (e.g. roughness and metallic
+// packed in one texture) share it, so the footprint is computed and the texels fetched once for all of them.
+// Which fields share is resolved once when the material is built.
+template <int M>
+struct FusedFieldFetch
+{
+    FusedFieldFetch() = default;
+    // Fields that aren't texture fields are evaluated on their own.
+    explicit FusedFieldFetch(const std::array<const Configurable *, M> &fields)
+    {
+        for (int i = 0; i < M; ++i) {
+            textures[i] = dynamic_cast<const TextureFieldBase *>(fields[i]);
+            leaders[i] = i;
+            for (int j = 0; j < i; ++j) {
+                if (textures[i] && textures[j] && leaders[j] == j && textures[i]->same_lookup(*textures[j])) {
+                    leaders[i] = j;
+                    break;
+                }
+            }
+        }
+    }
+
+    struct Lookups
+    {
+        vec2 uv;
+        mat2 duvdxy;
+        // Indexed by the leader of each texture field.
+        std::array<std::array<float, 4>, M> channels;
+    };
+
+    void lookup(const Intersection &it, Lookups &lookups) const
+    {
+        lookups.uv = it.uv;
+        lookups.duvdxy(0, 0) = it.dudx;
+        lookups.duvdxy(0, 1) = it.dvdx;
+        lookups.duvdxy(1, 0) = it.dudy;
+        lookups.duvdxy(1, 1) = it.dvdy;
+        for (int i = 0; i < M; ++i) {
+            if (textures[i] && leaders[i] == i)
+                textures[i]->lookup(lookups.uv, lookups.duvdxy, lookups.channels[i]);
+        }
+    }
+
+    // field must be the i-th field given at construction.
+    template <int N>
+    color<N> get(const Lookups &lookups, int i, const ShaderField<color<N>> &field) const
+    {
+        if (textures[i])
+            return static_cast<const TextureField<N> &>(field).apply_swizzle(lookups.channels[leaders[i]]);
+        return field(lookups.uv, lookups.duvdxy);
+    }
+
+    std::array<const TextureFieldBase *, M> textures = {};
+    std::array<int, M> leaders = {};
 };
 
 template <int N>
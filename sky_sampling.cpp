@@ -0,0 +1,293 @@
+#include "sky_sampling.h"
+#include "hash.h"
+#include "parallel.h"
+#include "ray.h"
+#include "rng.h"
+#include "scene.h"
+#include "stats.h"
+#include <array>
+
+namespace ks
+{
+
+static StatCounter stat_visibility_rays("sky/visibility_rays");
+
+// Portals are set up per call on the stack.
+constexpr int max_sky_portals = 32;
+
+bool SkyPortal::intersect(const vec3 &p, const vec3 &wi, float &t) const
+{
+    vec3 n = edge_u.cross(edge_v);
+    // Only leaving the interior.
+    float denom = n.dot(wi);
+    if (denom <= 0.0f)
+        return false;
+    t = n.dot(corner - p) / denom;
+    if (!(t > 0.0f))
+        return false;
+    vec3 q = p + t * wi - corner;
+    float a = q.dot(edge_u) / edge_u.squaredNorm();
+    float b = q.dot(edge_v) / edge_v.squaredNorm();
+    return a >= 0.0f && a <= 1.0f && b >= 0.0f && b <= 1.0f;
+}
+
+std::vector<SkyPortal> load_sky_portals(const ConfigArgs &args)
+{
+    int n = (int)args.array_size();
+    ASSERT(n <= max_sky_portals, "Too many sky portals (%d, at most %d).", n, max_sky_portals);
+    std::vector<SkyPortal> portals(n);
+    for (int i = 0; i < n; ++i) {
+        SkyPortal &portal = portals[i];
+        portal.corner = args[i].load_vec3("corner");
+        portal.edge_u = args[i].load_vec3("edge_u");
+        portal.edge_v = args[i].load_vec3("edge_v");
+        ASSERT(portal.area() > 0.0f, "Sky portal %d is degenerate.", i);
+        ASSERT(std::abs(portal.edge_u.normalized().dot(portal.edge_v.normalized())) < 1e-3f,
+               "Edges of sky portal %d are not orthogonal.", i);
+    }
+    return portals;
+}
+
+SphericalRectangle::SphericalRectangle(const SkyPortal &portal, const vec3 &p) : portal(&portal), p(p)
+{
+    float exl = portal.edge_u.norm();
+    float eyl = portal.edge_v.norm();
+    frame = Frame(portal.edge_u / exl, portal.edge_v / eyl);
+    vec3 d = frame.to_local(portal.corner - p);
+    // The normal points outwards: p must be behind the portal.
+    if (!(d.z() > 0.0f))
+        return;
+    // z points away from the rectangle.
+    frame.n = -frame.n;
+    x0 = d.x();
+    y0 = d.y();
+    z0 = -d.z();
+    x1 = x0 + exl;
+    y1 = y0 + eyl;
+
+    vec3 v00(x0, y0, z0), v01(x0, y1, z0);
+    vec3 v10(x1, y0, z0), v11(x1, y1, z0);
+    vec3 n0 = v00.cross(v10).normalized();
+    vec3 n1 = v10.cross(v11).normalized();
+    vec3 n2 = v11.cross(v01).normalized();
+    vec3 n3 = v01.cross(v00).normalized();
+    float g0 = angle_between(-n0, n1);
+    float g1 = angle_between(-n1, n2);
+    float g2 = angle_between(-n2, n3);
+    float g3 = angle_between(-n3, n0);
+    b0 = n0.z();
+    b1 = n2.z();
+    k = two_pi - g2 - g3;
+    solid_angle = std::max(g0 + g1 + g2 + g3 - two_pi, 0.0f);
+}
+
+vec3 SphericalRectangle::sample(const vec2 &u, float &pdf) const
+{
+    if (area_sampled()) {
+        vec3 wi = portal->corner + u.x() * portal->edge_u + u.y() * portal->edge_v - p;
+        float dist = wi.norm();
+        wi /= dist;
+        pdf = this->pdf(wi, dist);
+        return wi;
+    }
+    float au = u.x() * solid_angle + k;
+    float fu = (std::cos(au) * b0 - b1) / std::sin(au);
+    float cu = std::copysign(1.0f / std::sqrt(sqr(fu) + sqr(b0)), fu);
+    cu = std::clamp(cu, -before_one, before_one);
+    float xu = std::clamp(-(cu * z0) / safe_sqrt(1.0f - sqr(cu)), x0, x1);
+    float dd = std::sqrt(sqr(xu) + sqr(z0));
+    float h0 = y0 / std::sqrt(sqr(dd) + sqr(y0));
+    float h1 = y1 / std::sqrt(sqr(dd) + sqr(y1));
+    float hv = h0 + u.y() * (h1 - h0);
+    float hv2 = sqr(hv);
+    float yv = hv2 < 1.0f - 1e-6f ? (hv * dd) / std::sqrt(1.0f - hv2) : y1;
+    pdf = 1.0f / solid_angle;
+    return frame.to_world(vec3(xu, yv, z0)).normalized();
+}
+
+float SphericalRectangle::pdf(const vec3 &wi, float t) const
+{
+    if (!area_sampled())
+        return 1.0f / solid_angle;
+    float cos = std::abs(frame.n.dot(wi));
+    return cos == 0.0f ? 0.0f : sqr(t) / (portal->area() * cos);
+}
+
+// Solid angles of the portals from p, returns their sum.
+static float setup_portals(std::span<const SkyPortal> portals, const vec3 &p,
+                           std::array<SphericalRectangle, max_sky_portals> &rects)
+{
+    float total = 0.0f;
+    for (size_t i = 0; i < portals.size(); ++i) {
+        rects[i] = SphericalRectangle(portals[i], p);
+        total += rects[i].solid_angle;
+    }
+    return total;
+}
+
+bool sample_sky_portals(std::span<const SkyPortal> portals, const vec3 &p, const vec2 &u, vec3 &wi, float &pdf)
+{
+    pdf = 0.0f;
+    std::array<SphericalRectangle, max_sky_portals> rects;
+    float total = setup_portals(portals, p, rects);
+    if (total == 0.0f)
+        return false;
+    float cdf = 0.0f;
+    for (size_t i = 0; i < portals.size(); ++i) {
+        float prob = rects[i].solid_angle / total;
+        if (prob == 0.0f || (u.x() >= cdf + prob && i + 1 < portals.size())) {
+            cdf += prob;
+            continue;
+        }
+        // Reuse the sample within the chosen portal.
+        vec2 u_rect(std::clamp((u.x() - cdf) / prob, 0.0f, before_one), u.y());
+        float pdf_rect;
+        wi = rects[i].sample(u_rect, pdf_rect);
+        // Portals may overlap as seen from p.
+        pdf = sky_portals_pdf(portals, p, wi);
+        return pdf > 0.0f && std::isfinite(pdf);
+    }
+    return false;
+}
+
+float sky_portals_pdf(std::span<const SkyPortal> portals, const vec3 &p, const vec3 &wi)
+{
+    std::array<SphericalRectangle, max_sky_portals> rects;
+    float total = setup_portals(portals, p, rects);
+    if (total == 0.0f)
+        return 0.0f;
+    float pdf = 0.0f;
+    for (size_t i = 0; i < portals.size(); ++i) {
+        float t;
+        if (rects[i].empty() || !portals[i].intersect(p, wi, t))
+            continue;
+        pdf += rects[i].solid_angle / total * rects[i].pdf(wi, t);
+    }
+    return pdf;
+}
+
+bool sky_portals_visible(std::span<const SkyPortal> portals, const vec3 &p)
+{
+    for (const SkyPortal &portal : portals) {
+        if (portal.edge_u.cross(portal.edge_v).dot(portal.corner - p) > 0.0f)
+            return true;
+    }
+    return false;
+}
+
+SkyVisibilityOptions load_sky_visibility_options(const ConfigArgs &args)
+{
+    SkyVisibilityOptions options;
+    options.grid_res = args.load_integer("grid_res", options.grid_res);
+    options.dir_res = args.load_integer("dir_res", options.dir_res);
+    options.rays_per_cell = args.load_integer("rays_per_cell", options.rays_per_cell);
+    options.min_visibility = args.load_float("min_visibility", options.min_visibility);
+    ASSERT(options.grid_res > 0 && options.dir_res > 0 && options.rays_per_cell > 0,
+           "Invalid sky visibility options.");
+    return options;
+}
+
+SkyVisibility::SkyVisibility(std::span<const float> weights, int ures, int vres, const mat3 &map_to_world,
+                             const Scene &scene, const SkyVisibilityOptions &options)
+    : bound(scene.bound()), grid_res(options.grid_res), ures(ures), vres(vres)
+{
+    ASSERT(weights.size() == (size_t)ures * vres);
+    cu = std::clamp(options.dir_res, 1, ures);
+    cv = std::clamp(options.dir_res / 2, 1, vres);
+    int num_cells = cu * cv;
+    cells.resize(num_cells);
+    std::vector<float> cell_weights(num_cells);
+    parallel_for(num_cells, [&](int c) {
+        int cx = c % cu;
+        int cy = c / cu;
+        int x0 = cell_x(cx), x1 = cell_x(cx + 1);
+        int y0 = cell_y(cy), y1 = cell_y(cy + 1);
+        std::vector<float> texels((size_t)(x1 - x0) * (y1 - y0));
+        double sum = 0.0;
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x) {
+                float w = weights[(size_t)y * ures + x];
+                texels[(size_t)(y - y0) * (x1 - x0) + (x - x0)] = w;
+                sum += w;
+            }
+        cells[c] = DistribTable2D(texels.data(), x1 - x0, y1 - y0);
+        cell_weights[c] = (float)sum;
+    });
+
+    int num_regions = grid_res * grid_res * grid_res;
+    int rays_per_cell = options.rays_per_cell;
+    float min_visibility = options.min_visibility;
+    vec3 extent = bound.extents().cwiseMax(1e-6f);
+    regions.resize(num_regions);
+    parallel_for(num_regions, [&](int r) {
+        vec3 index((float)(r % grid_res), (float)(r / grid_res % grid_res), (float)(r / (grid_res * grid_res)));
+        RNG rng(hash(r, grid_res));
+        std::vector<Ray> rays((size_t)num_cells * rays_per_cell);
+        for (int c = 0; c < num_cells; ++c) {
+            int cx = c % cu;
+            int cy = c / cu;
+            for (int i = 0; i < rays_per_cell; ++i) {
+                vec3 origin = bound.min + (index + rng.next3d()).cwiseProduct(extent) / (float)grid_res;
+                vec2 uv(((float)cx + rng.next()) / (float)cu, ((float)cy + rng.next()) / (float)cv);
+                vec3 dir = map_to_world * to_cartesian(uv.x() * two_pi, uv.y() * pi);
+                rays[(size_t)c * rays_per_cell + i] = Ray(origin, dir, 0.0f, inf);
+            }
+        }
+        std::vector<uint8_t> occluded(rays.size());
+        scene.occlude_stream(rays, occluded);
+        stat_visibility_rays.add(rays.size());
+
+        std::vector<float> region_weights(num_cells);
+        for (int c = 0; c < num_cells; ++c) {
+            int escaped = 0;
+            for (int i = 0; i < rays_per_cell; ++i)
+                escaped += !occluded[(size_t)c * rays_per_cell + i];
+            float visibility = (float)escaped / (float)rays_per_cell;
+            region_weights[c] = cell_weights[c] * std::lerp(min_visibility, 1.0f, visibility);
+        }
+        regions[r] = DistribTable2D(region_weights.data(), cu, cv);
+    });
+}
+
+int SkyVisibility::region(const vec3 &p) const
+{
+    vec3 extent = bound.extents().cwiseMax(1e-6f);
+    vec3 t = (p - bound.min).cwiseQuotient(extent) * (float)grid_res;
+    int x = std::clamp((int)std::floor(t.x()), 0, grid_res - 1);
+    int y = std::clamp((int)std::floor(t.y()), 0, grid_res - 1);
+    int z = std::clamp((int)std::floor(t.z()), 0, grid_res - 1);
+    return x + grid_res * (y + grid_res * z);
+}
+
+vec2 SkyVisibility::sample(const vec3 &p, const vec2 &u, float &pdf) const
+{
+    float pdf_cell;
+    vec2 uc = regions[region(p)].sample_linear(u, pdf_cell);
+    int cx = std::min((int)(uc.x() * cu), cu - 1);
+    int cy = std::min((int)(uc.y() * cv), cv - 1);
+    // Reuse the sample within the chosen cell.
+    vec2 u_cell(std::clamp(uc.x() * cu - cx, 0.0f, before_one), std::clamp(uc.y() * cv - cy, 0.0f, before_one));
+    float pdf_texel;
+    vec2 ut = cells[cy * cu + cx].sample_linear(u_cell, pdf_texel);
+    int x0 = cell_x(cx), x1 = cell_x(cx + 1);
+    int y0 = cell_y(cy), y1 = cell_y(cy + 1);
+    // From densities over the cell grid and over the cell to a density over the map.
+    pdf = pdf_cell / (float)(cu * cv) * pdf_texel * (float)(ures * vres) / (float)((x1 - x0) * (y1 - y0));
+    return vec2((x0 + ut.x() * (x1 - x0)) / (float)ures, (y0 + ut.y() * (y1 - y0)) / (float)vres);
+}
+
+float SkyVisibility::pdf(const vec3 &p, const vec2 &uv) const
+{
+    int tx = std::clamp((int)(uv.x() * ures), 0, ures - 1);
+    int ty = std::clamp((int)(uv.y() * vres), 0, vres - 1);
+    // The last cell starting at or before the texel (see cell_x).
+    int cx = ((tx + 1) * cu + ures - 1) / ures - 1;
+    int cy = ((ty + 1) * cv + vres - 1) / vres - 1;
+    int x0 = cell_x(cx), x1 = cell_x(cx + 1);
+    int y0 = cell_y(cy), y1 = cell_y(cy + 1);
+    float pdf_cell = regions[region(p)].pdf((uint32_t)cx, (uint32_t)cy);
+    float pdf_texel = cells[cy * cu + cx].pdf((uint32_t)(tx - x0), (uint32_t)(ty - y0));
+    return pdf_cell / (float)(cu * cv) * pdf_texel * (float)(ures * vres) / (float)((x1 - x0) * (y1 - y0));
+}
+
+} // namespace ks
\ No newline at end of file
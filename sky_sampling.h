@@ -0,0 +1,105 @@
+#pragma once
+#include "aabb.h"
+#include "config.h"
+#include "distrib.h"
+#include "maths.h"
+#include <span>
+#include <vector>
+
+namespace ks
+{
+
+struct Scene;
+
+// Rectangular opening (e.g. a window) through which the sky lights an interior. The normal edge_u x edge_v points
+// outwards, to the sky: only shading points behind the portal sample through it. Edges must be orthogonal.
+struct SkyPortal
+{
+    vec3 normal() const { return edge_u.cross(edge_v).normalized(); }
+    float area() const { return edge_u.cross(edge_v).norm(); }
+    // Distance t along (p, wi) to the portal, false if the ray misses it.
+    bool intersect(const vec3 &p, const vec3 &wi, float &t) const;
+
+    vec3 corner = vec3::Zero();
+    vec3 edge_u = vec3::UnitX();
+    vec3 edge_v = vec3::UnitY();
+};
+
+std::vector<SkyPortal> load_sky_portals(const ConfigArgs &args);
+
+// Solid angle of a portal seen from a point, sampled uniformly (Urena et al. 13, as in pbrt-v4). Portals that are too
+// small (or far) for that to be stable are sampled by area instead, like mesh light triangles.
+struct SphericalRectangle
+{
+    static constexpr float min_solid_angle = 1e-4f;
+
+    SphericalRectangle() = default;
+    SphericalRectangle(const SkyPortal &portal, const vec3 &p);
+
+    bool empty() const { return solid_angle <= 0.0f; }
+    bool area_sampled() const { return solid_angle < min_solid_angle; }
+    // Returns the direction and its solid angle pdf.
+    vec3 sample(const vec2 &u, float &pdf) const;
+    // Solid angle pdf of a direction that hits the portal at distance t.
+    float pdf(const vec3 &wi, float t) const;
+
+    const SkyPortal *portal = nullptr;
+    vec3 p = vec3::Zero();
+    // Local frame of the rectangle, z pointing away from it.
+    Frame frame;
+    float x0 = 0.0f, y0 = 0.0f, z0 = 0.0f, x1 = 0.0f, y1 = 0.0f;
+    float b0 = 0.0f, b1 = 0.0f, k = 0.0f;
+    // Zero if p is in front of the portal.
+    float solid_angle = 0.0f;
+};
+
+// Portals are picked by solid angle, so the pdf is close to uniform over their union.
+// Returns false (pdf 0) if no portal is visible from p.
+bool sample_sky_portals(std::span<const SkyPortal> portals, const vec3 &p, const vec2 &u, vec3 &wi, float &pdf);
+float sky_portals_pdf(std::span<const SkyPortal> portals, const vec3 &p, const vec3 &wi);
+bool sky_portals_visible(std::span<const SkyPortal> portals, const vec3 &p);
+
+struct SkyVisibilityOptions
+{
+    // Regions per axis of the scene bound.
+    int grid_res = 4;
+    // Directions are weighted by visibility in cells of dir_res x dir_res / 2 texels of the sky map.
+    int dir_res = 32;
+    // Visibility rays per region and direction cell.
+    int rays_per_cell = 4;
+    // Floor of the visibility weight, so that directions missed by the estimate can still be sampled.
+    float min_visibility = 0.05f;
+};
+
+SkyVisibilityOptions load_sky_visibility_options(const ConfigArgs &args);
+
+// Sky map distributions weighted by the visibility of the sky from regions of the scene, estimated once by tracing
+// shadow rays from random points of each region. In a region, a direction cell is picked by its luminance times its
+// visibility, then a texel within the cell by luminance (tables shared by all regions). The pdf is over the map uv like
+// the global distribution of SkyLight.
+struct SkyVisibility
+{
+    // weights are sin(theta) * luminance of the ures x vres texels of the map. map_to_world maps the z-up directions of
+    // the map to world space (see SkyLight::Baked).
+    SkyVisibility(std::span<const float> weights, int ures, int vres, const mat3 &map_to_world, const Scene &scene,
+                  const SkyVisibilityOptions &options);
+
+    vec2 sample(const vec3 &p, const vec2 &u, float &pdf) const;
+    float pdf(const vec3 &p, const vec2 &uv) const;
+
+    int region(const vec3 &p) const;
+    int cell_x(int cx) const { return cx * ures / cu; }
+    int cell_y(int cy) const { return cy * vres / cv; }
+
+    AABB3 bound;
+    int grid_res;
+    int ures, vres;
+    // Direction cells.
+    int cu, cv;
+    // Per region, over the direction cells.
+    std::vector<DistribTable2D> regions;
+    // Per direction cell, over its texels.
+    std::vector<DistribTable2D> cells;
+};
+
+} // namespace ks
\ No newline at end of file
@@ -1,6 +1,11 @@
 #include "sobol.h"
 #include "assertion.h"
 #include "hash.h"
+#include "maths.h"
+#include <algorithm>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 namespace ks
 {
@@ -150,4 +155,198 @@ float GetSobolStatelessIter(int idx, int dim, uint32_t seed, int nd)
 
 float sobol_owen(int idx, int dim, uint32_t seed, int nd) { return GetSobolStatelessIter(idx, dim, seed, nd); }
 
+//-----------------------------------------------------------------------------
+// Batched evaluation. Every lane runs the same iteration as GetSobolStatelessIter, lanes that are done are masked out
+// until the whole batch is, so the results are bit-identical to the scalar version.
+//-----------------------------------------------------------------------------
+
+#if defined(__AVX512F__) && defined(__AVX512CD__)
+static constexpr int sobol_batch_lanes = 16;
+
+static inline __m512i hash_to_rnd_int_x16(__m512i index, __m512i seed)
+{
+    __m512i r = _mm512_xor_si512(index, seed);
+    r = _mm512_xor_si512(r, _mm512_srli_epi32(r, 17));
+    r = _mm512_xor_si512(r, _mm512_srli_epi32(r, 10));
+    r = _mm512_mullo_epi32(r, _mm512_set1_epi32((int)0xb36534e5));
+    r = _mm512_xor_si512(r, _mm512_srli_epi32(r, 12));
+    r = _mm512_xor_si512(r, _mm512_srli_epi32(r, 21));
+    r = _mm512_mullo_epi32(r, _mm512_set1_epi32((int)0x93fc4795));
+    r = _mm512_xor_si512(r, _mm512_set1_epi32((int)0xdf6e307f));
+    r = _mm512_xor_si512(r, _mm512_srli_epi32(r, 17));
+    r = _mm512_mullo_epi32(r, _mm512_or_si512(_mm512_set1_epi32(1), _mm512_srli_epi32(seed, 18)));
+    return r;
+}
+
+// -1 for zero like GetMSB.
+static inline __m512i get_msb_x16(__m512i v) { return _mm512_sub_epi32(_mm512_set1_epi32(31), _mm512_lzcnt_epi32(v)); }
+
+static void sobol_owen_lanes(const int *idx_in, const int *dim_in, const uint32_t *seed_in, int nd, float *out)
+{
+    __m512i idx = _mm512_loadu_si512(idx_in);
+    __m512i dim = _mm512_loadu_si512(dim_in);
+    __m512i seed = _mm512_loadu_si512(seed_in);
+    __m512i vnd = _mm512_set1_epi32(nd);
+    __m512i v32 = _mm512_set1_epi32(32);
+
+    __m512i bits = hash_to_rnd_int_x16(_mm512_add_epi32(_mm512_mullo_epi32(idx, vnd), dim), seed);
+    __m512i msb = get_msb_x16(idx);
+    __mmask16 active = _mm512_cmpgt_epi32_mask(idx, _mm512_setzero_si512());
+    while (active) {
+        __m512i next_idx = _mm512_xor_si512(idx, _mm512_sllv_epi32(_mm512_set1_epi32(1), msb));
+        __m512i xor_index = _mm512_add_epi32(_mm512_slli_epi32(dim, 5), msb);
+        next_idx = _mm512_xor_si512(next_idx, _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), active, xor_index,
+                                                                          &sobol_xors[0][0], 4));
+        __m512i next_msb = get_msb_x16(next_idx);
+
+        __m512i rand_bits = hash_to_rnd_int_x16(_mm512_add_epi32(_mm512_mullo_epi32(next_idx, vnd), dim), seed);
+        __m512i bits_to_set = _mm512_sub_epi32(msb, next_msb);
+        __m512i rest = _mm512_sub_epi32(v32, bits_to_set);
+        rand_bits = _mm512_xor_si512(_mm512_srlv_epi32(rand_bits, rest), _mm512_set1_epi32(1));
+        __m512i next_bits = _mm512_xor_si512(_mm512_sllv_epi32(rand_bits, rest), _mm512_srlv_epi32(bits, bits_to_set));
+
+        bits = _mm512_mask_mov_epi32(bits, active, next_bits);
+        msb = _mm512_mask_mov_epi32(msb, active, next_msb);
+        idx = _mm512_mask_mov_epi32(idx, active, next_idx);
+        active = _mm512_cmpgt_epi32_mask(idx, _mm512_setzero_si512());
+    }
+
+    __m512 u = _mm512_div_ps(_mm512_cvtepu32_ps(bits), _mm512_set1_ps(float(0xffffffffu)));
+    _mm512_storeu_ps(out, _mm512_min_ps(u, _mm512_set1_ps(before_one)));
+}
+#elif defined(__AVX2__)
+static constexpr int sobol_batch_lanes = 8;
+
+static inline __m256i hash_to_rnd_int_x8(__m256i index, __m256i seed)
+{
+    __m256i r = _mm256_xor_si256(index, seed);
+    r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 17));
+    r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 10));
+    r = _mm256_mullo_epi32(r, _mm256_set1_epi32((int)0xb36534e5));
+    r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 12));
+    r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 21));
+    r = _mm256_mullo_epi32(r, _mm256_set1_epi32((int)0x93fc4795));
+    r = _mm256_xor_si256(r, _mm256_set1_epi32((int)0xdf6e307f));
+    r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 17));
+    r = _mm256_mullo_epi32(r, _mm256_or_si256(_mm256_set1_epi32(1), _mm256_srli_epi32(seed, 18)));
+    return r;
+}
+
+// -1 for zero like GetMSB. No lzcnt in AVX2: keep only the top bit and read it from the float exponent (exact since
+// it is a power of two below 2^31).
+static inline __m256i get_msb_x8(__m256i v)
+{
+    v = _mm256_or_si256(v, _mm256_srli_epi32(v, 1));
+    v = _mm256_or_si256(v, _mm256_srli_epi32(v, 2));
+    v = _mm256_or_si256(v, _mm256_srli_epi32(v, 4));
+    v = _mm256_or_si256(v, _mm256_srli_epi32(v, 8));
+    v = _mm256_or_si256(v, _mm256_srli_epi32(v, 16));
+    v = _mm256_xor_si256(v, _mm256_srli_epi32(v, 1));
+    __m256i e = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(v)), 23);
+    return _mm256_max_epi32(_mm256_sub_epi32(e, _mm256_set1_epi32(127)), _mm256_set1_epi32(-1));
+}
+
+static void sobol_owen_lanes(const int *idx_in, const int *dim_in, const uint32_t *seed_in, int nd, float *out)
+{
+    __m256i idx = _mm256_loadu_si256((const __m256i *)idx_in);
+    __m256i dim = _mm256_loadu_si256((const __m256i *)dim_in);
+    __m256i seed = _mm256_loadu_si256((const __m256i *)seed_in);
+    __m256i vnd = _mm256_set1_epi32(nd);
+    __m256i v32 = _mm256_set1_epi32(32);
+    __m256i zero = _mm256_setzero_si256();
+
+    __m256i bits = hash_to_rnd_int_x8(_mm256_add_epi32(_mm256_mullo_epi32(idx, vnd), dim), seed);
+    __m256i msb = get_msb_x8(idx);
+    __m256i active = _mm256_cmpgt_epi32(idx, zero);
+    while (!_mm256_testz_si256(active, active)) {
+        __m256i next_idx = _mm256_xor_si256(idx, _mm256_sllv_epi32(_mm256_set1_epi32(1), msb));
+        __m256i xor_index = _mm256_add_epi32(_mm256_slli_epi32(dim, 5), msb);
+        next_idx = _mm256_xor_si256(
+            next_idx, _mm256_mask_i32gather_epi32(zero, (const int *)&sobol_xors[0][0], xor_index, active, 4));
+        __m256i next_msb = get_msb_x8(next_idx);
+
+        __m256i rand_bits = hash_to_rnd_int_x8(_mm256_add_epi32(_mm256_mullo_epi32(next_idx, vnd), dim), seed);
+        __m256i bits_to_set = _mm256_sub_epi32(msb, next_msb);
+        __m256i rest = _mm256_sub_epi32(v32, bits_to_set);
+        rand_bits = _mm256_xor_si256(_mm256_srlv_epi32(rand_bits, rest), _mm256_set1_epi32(1));
+        __m256i next_bits = _mm256_xor_si256(_mm256_sllv_epi32(rand_bits, rest), _mm256_srlv_epi32(bits, bits_to_set));
+
+        bits = _mm256_blendv_epi8(bits, next_bits, active);
+        msb = _mm256_blendv_epi8(msb, next_msb, active);
+        idx = _mm256_blendv_epi8(idx, next_idx, active);
+        active = _mm256_cmpgt_epi32(idx, zero);
+    }
+
+    // uint32 -> float without AVX-512: both halves are exact, so the sum is rounded once like a direct conversion.
+    __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(bits, 16));
+    __m256 lo = _mm256_cvtepi32_ps(_mm256_and_si256(bits, _mm256_set1_epi32(0xffff)));
+    __m256 f = _mm256_add_ps(_mm256_mul_ps(hi, _mm256_set1_ps(65536.0f)), lo);
+    __m256 u = _mm256_div_ps(f, _mm256_set1_ps(float(0xffffffffu)));
+    _mm256_storeu_ps(out, _mm256_min_ps(u, _mm256_set1_ps(before_one)));
+}
+#else
+static constexpr int sobol_batch_lanes = 4;
+
+static void sobol_owen_lanes(const int *idx, const int *dim, const uint32_t *seed, int nd, float *out)
+{
+    for (int i = 0; i < sobol_batch_lanes; ++i) {
+        out[i] = GetSobolStatelessIter(idx[i], dim[i], seed[i], nd);
+    }
+}
+#endif
+
+void sobol_owen_n(std::span<const int> idx, std::span<const int> dim, std::span<const uint32_t> seed, int nd,
+                  std::span<float> out)
+{
+    ASSERT(idx.size() == out.size() && dim.size() == out.size() && seed.size() == out.size());
+    ASSERT(nd <= MAX_SOBOL_DIM, "Sobol only support up to 64 dimensions");
+    size_t n = out.size();
+    size_t i = 0;
+    for (; i + sobol_batch_lanes <= n; i += sobol_batch_lanes) {
+        sobol_owen_lanes(&idx[i], &dim[i], &seed[i], nd, &out[i]);
+    }
+    for (; i < n; ++i) {
+        out[i] = GetSobolStatelessIter(idx[i], dim[i], seed[i], nd);
+    }
+}
+
+// The shortcuts fill the lane inputs in chunks on the stack.
+static constexpr int sobol_chunk_size = 64;
+
+void sobol_owen_dims(int idx, int dim_begin, uint32_t seed, int nd, std::span<float> out)
+{
+    ASSERT(dim_begin + (int)out.size() <= MAX_SOBOL_DIM, "Sobol only support up to 64 dimensions");
+    int idxs[sobol_chunk_size], dims[sobol_chunk_size];
+    uint32_t seeds[sobol_chunk_size];
+    for (int i = 0; i < (int)out.size(); ++i) {
+        idxs[i] = idx;
+        dims[i] = dim_begin + i;
+        seeds[i] = seed;
+    }
+    sobol_owen_n(std::span(idxs, out.size()), std::span(dims, out.size()), std::span(seeds, out.size()), nd, out);
+}
+
+void sobol_owen_samples(int idx_begin, int dim, uint32_t seed, int nd, std::span<float> out)
+{
+    int idxs[sobol_chunk_size], dims[sobol_chunk_size];
+    uint32_t seeds[sobol_chunk_size];
+    for (size_t begin = 0; begin < out.size(); begin += sobol_chunk_size) {
+        size_t n = std::min(out.size() - begin, (size_t)sobol_chunk_size);
+        for (size_t i = 0; i < n; ++i) {
+            idxs[i] = idx_begin + (int)(begin + i);
+            dims[i] = dim;
+            seeds[i] = seed;
+        }
+        sobol_owen_n(std::span(idxs, n), std::span(dims, n), std::span(seeds, n), nd, out.subspan(begin, n));
+    }
+}
+
+SobolSeedTable::SobolSeedTable(int width, int height, uint32_t seed) : width(width), height(height)
+{
+    seeds.resize((size_t)width * height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            seeds[(size_t)y * width + x] = (uint32_t)hash(x, y, seed);
+}
+
 } // namespace ks
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "stats.h"
+#include "assertion.h"
+#include <fstream>
+
+namespace ks
+{
+
+uint32_t StatsRegistry::add(StatKind kind, const char *name)
+{
+    std::scoped_lock lock(mutex);
+    std::vector<std::string> &kind_names = names[(int)kind];
+    ASSERT(kind_names.size() < max_stats, "Too many stats (max %d per kind).", max_stats);
+    kind_names.push_back(name);
+    return (uint32_t)kind_names.size() - 1;
+}
+
+void StatsRegistry::reset()
+{
+    threads.combine_each([](ThreadStats &stats) { stats = ThreadStats(); });
+}
+
+void StatsRegistry::write_json(const fs::path &path)
+{
+    ThreadStats total;
+    threads.combine_each([&](const ThreadStats &stats) {
+        for (int i = 0; i < max_stats; ++i) {
+            total.counters[i] += stats.counters[i];
+
+            StatsRegistry::Histogram &h = total.histograms[i];
+            h.count += stats.histograms[i].count;
+            h.sum += stats.histograms[i].sum;
+            h.max = std::max(h.max, stats.histograms[i].max);
+            for (int b = 0; b < num_histogram_buckets; ++b)
+                h.buckets[b] += stats.histograms[i].buckets[b];
+
+            total.timers[i].count += stats.timers[i].count;
+            total.timers[i].nanoseconds += stats.timers[i].nanoseconds;
+        }
+    });
+
+    std::scoped_lock lock(mutex);
+    std::ofstream out(path);
+    out << "{\n  \"counters\": {";
+    const std::vector<std::string> &counter_names = names[(int)StatKind::Counter];
+    for (size_t i = 0; i < counter_names.size(); ++i) {
+        out << (i ? ",\n" : "\n") << "    \"" << counter_names[i] << "\": " << total.counters[i];
+    }
+    out << "\n  },\n  \"histograms\": {";
+    const std::vector<std::string> &histogram_names = names[(int)StatKind::Histogram];
+    for (size_t i = 0; i < histogram_names.size(); ++i) {
+        const Histogram &h = total.histograms[i];
+        int num_buckets = num_histogram_buckets;
+        while (num_buckets > 0 && h.buckets[num_buckets - 1] == 0)
+            --num_buckets;
+        out << (i ? ",\n" : "\n") << "    \"" << histogram_names[i] << "\": {\"count\": " << h.count
+            << ", \"sum\": " << h.sum << ", \"max\": " << h.max << ", \"mean\": "
+            << (h.count ? (double)h.sum / (double)h.count : 0.0) << ", \"log2_buckets\": [";
+        for (int b = 0; b < num_buckets; ++b)
+            out << (b ? ", " : "") << h.buckets[b];
+        out << "]}";
+    }
+    out << "\n  },\n  \"timers\": {";
+    const std::vector<std::string> &timer_names = names[(int)StatKind::Timer];
+    for (size_t i = 0; i < timer_names.size(); ++i) {
+        const Timer &t = total.timers[i];
+        out << (i ? ",\n" : "\n") << "    \"" << timer_names[i] << "\": {\"count\": " << t.count
+            << ", \"seconds\": " << (double)t.nanoseconds * 1e-9 << "}";
+    }
+    out << "\n  }\n}\n";
+}
+
+uint64_t StatsRegistry::counter_value(std::string_view name)
+{
+    std::scoped_lock lock(mutex);
+    const std::vector<std::string> &counter_names = names[(int)StatKind::Counter];
+    auto it = std::find(counter_names.begin(), counter_names.end(), name);
+    if (it == counter_names.end()) {
+        return 0;
+    }
+    size_t slot = it - counter_names.begin();
+    uint64_t total = 0;
+    threads.combine_each([&](const ThreadStats &stats) { total += stats.counters[slot]; });
+    return total;
+}
+
+StatsRegistry &stats_registry()
+{
+    static StatsRegistry registry;
+    return registry;
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,189 @@
+#pragma once
+#include "parallel.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+namespace fs = std::filesystem;
+
+// Build with -DKS_ENABLE_STATS=0 to compile all recording out (the stat definitions then cost nothing).
+#ifndef KS_ENABLE_STATS
+#define KS_ENABLE_STATS 1
+#endif
+
+namespace ks
+{
+
+// Render statistics: named counters, histograms and timers. Define them at namespace scope, e.g.
+//     static StatCounter stat_rays("scene/intersect1");
+//     ...
+//     stat_rays.add();
+// Values are accumulated per thread without synchronization and only summed by StatsRegistry::write_json.
+
+enum class StatKind
+{
+    Counter,
+    Histogram,
+    Timer,
+};
+constexpr int num_stat_kinds = 3;
+
+struct StatsRegistry
+{
+    static constexpr int max_stats = 128;
+    // Histogram bucket 0 counts 0 and bucket i > 0 counts [2^(i-1), 2^i). The last bucket also counts everything above.
+    static constexpr int num_histogram_buckets = 32;
+
+    struct Histogram
+    {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        std::array<uint64_t, num_histogram_buckets> buckets = {};
+    };
+    struct Timer
+    {
+        uint64_t count = 0;
+        uint64_t nanoseconds = 0;
+    };
+    struct ThreadStats
+    {
+        std::array<uint64_t, max_stats> counters = {};
+        std::array<Histogram, max_stats> histograms = {};
+        std::array<Timer, max_stats> timers = {};
+    };
+
+    // Returns the slot of a new stat of the given kind.
+    uint32_t add(StatKind kind, const char *name);
+    ThreadStats &local()
+    {
+        static thread_local ThreadStats *cached = nullptr;
+        if (!cached)
+            cached = &threads.local();
+        return *cached;
+    }
+
+    // NOTE: not thread-safe against concurrent recording.
+    void reset();
+    void write_json(const fs::path &path);
+    // Sum over all threads of a counter, or 0 if there is no such counter.
+    uint64_t counter_value(std::string_view name);
+
+    std::mutex mutex;
+    std::array<std::vector<std::string>, num_stat_kinds> names;
+    Combinable<ThreadStats> threads;
+};
+
+// Safe to use during static initialization.
+StatsRegistry &stats_registry();
+
+struct StatCounter
+{
+    explicit StatCounter(const char *name)
+    {
+#if KS_ENABLE_STATS
+        slot = stats_registry().add(StatKind::Counter, name);
+#endif
+    }
+
+    void add(uint64_t n = 1) const
+    {
+#if KS_ENABLE_STATS
+        stats_registry().local().counters[slot] += n;
+#endif
+    }
+
+    uint32_t slot = 0;
+};
+
+struct StatHistogram
+{
+    explicit StatHistogram(const char *name)
+    {
+#if KS_ENABLE_STATS
+        slot = stats_registry().add(StatKind::Histogram, name);
+#endif
+    }
+
+    void record(uint64_t value) const
+    {
+#if KS_ENABLE_STATS
+        StatsRegistry::Histogram &h = stats_registry().local().histograms[slot];
+        ++h.count;
+        h.sum += value;
+        h.max = std::max(h.max, value);
+        ++h.buckets[std::min((int)std::bit_width(value), StatsRegistry::num_histogram_buckets - 1)];
+#endif
+    }
+
+    uint32_t slot = 0;
+};
+
+struct StatTimer
+{
+    explicit StatTimer(const char *name)
+    {
+#if KS_ENABLE_STATS
+        slot = stats_registry().add(StatKind::Timer, name);
+#endif
+    }
+
+    void record(std::chrono::nanoseconds duration) const
+    {
+#if KS_ENABLE_STATS
+        StatsRegistry::Timer &t = stats_registry().local().timers[slot];
+        ++t.count;
+        t.nanoseconds += (uint64_t)duration.count();
+#endif
+    }
+
+    uint32_t slot = 0;
+};
+
+// Cheap timestamp for attributing cost to work items (e.g. per-pixel cost AOVs): the time stamp counter on x86, in
+// cycles, and steady_clock nanoseconds elsewhere. Only differences on the same thread are meaningful.
+inline uint64_t read_cycle_counter()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Records the lifetime of the scope. Reads the clock twice, so keep it out of the innermost loops.
+struct ScopedStatTimer
+{
+    explicit ScopedStatTimer(const StatTimer &timer) : timer(timer)
+    {
+#if KS_ENABLE_STATS
+        start = std::chrono::steady_clock::now();
+#endif
+    }
+    ~ScopedStatTimer()
+    {
+#if KS_ENABLE_STATS
+        timer.record(std::chrono::steady_clock::now() - start);
+#endif
+    }
+    ScopedStatTimer(const ScopedStatTimer &) = delete;
+    ScopedStatTimer &operator=(const ScopedStatTimer &) = delete;
+
+    const StatTimer &timer;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // namespace ks
\ No newline at end of file
@@ -3,11 +3,17 @@
 #include "microfacet.h"
 #include "ray.h"
 #include "rng.h"
+#include "sampler.h"
 #include "scene.h"
+#include "stats.h"
 
 namespace ks
 {
 
+static StatCounter stat_walks("subsurface/walks");
+static StatCounter stat_walk_exits("subsurface/walk_exits");
+static StatHistogram stat_walk_bounces("subsurface/walk_bounces");
+
 inline color3 safe_divide_color(const color3 &a, const color3 &b) { return (b == 0.0f).select(color3::Zero(), a / b); }
 
 inline color3 volume_color_transmittance(const color3 &sigma, float t) { return exp(-sigma * t); }
@@ -121,11 +127,60 @@ void subsurface_random_walk_remap(const float albedo, const float d, float g, fl
     *sigma_t = sigma_t_prime / (1.0f - g);
 }
 
+// Position of albedo along a table axis of n samples of albedo^(1/4) (the fits are steepest near 0).
+inline float albedo_table_coord(float albedo, int n)
+{
+    return std::sqrt(std::sqrt(std::clamp(albedo, 0.0f, 1.0f))) * (n - 1);
+}
+
+inline float lerp_table(const float *row, int n, float u)
+{
+    int i = std::min((int)u, n - 2);
+    float t = u - i;
+    return (1.0f - t) * row[i] + t * row[i + 1];
+}
+
+RandomWalkAlphaTable::RandomWalkAlphaTable()
+{
+    for (int j = 0; j < anisotropy_res; ++j) {
+        float g = max_anisotropy * j / (anisotropy_res - 1);
+        for (int i = 0; i < albedo_res; ++i) {
+            float albedo = sqr(sqr((float)i / (albedo_res - 1)));
+            float sigma_t;
+            subsurface_random_walk_remap(albedo, 1.0f, g, &sigma_t, &alpha[j * albedo_res + i]);
+        }
+    }
+}
+
+float RandomWalkAlphaTable::lookup(float albedo, float anisotropy) const
+{
+    float v = anisotropy * ((anisotropy_res - 1) / max_anisotropy);
+    int j = std::min((int)v, anisotropy_res - 2);
+    float t = v - j;
+    float u = albedo_table_coord(albedo, albedo_res);
+    return (1.0f - t) * lerp_table(&alpha[j * albedo_res], albedo_res, u) +
+           t * lerp_table(&alpha[(j + 1) * albedo_res], albedo_res, u);
+}
+
+const RandomWalkAlphaTable &random_walk_alpha_table()
+{
+    static const RandomWalkAlphaTable table;
+    return table;
+}
+
 void subsurface_random_walk_coefficients(const color3 &albedo, const color3 &radius, const float anisotropy,
-                                         color3 *sigma_t, color3 *alpha, color3 *throughput)
+                                         color3 *sigma_t, color3 *alpha, color3 *throughput, bool tabulated)
 {
-    for (int i = 0; i < color3::SizeAtCompileTime; ++i) {
-        subsurface_random_walk_remap(albedo[i], radius[i], anisotropy, &(*sigma_t)[i], &(*alpha)[i]);
+    if (tabulated && anisotropy >= 0.0f && anisotropy <= RandomWalkAlphaTable::max_anisotropy) {
+        const RandomWalkAlphaTable &table = random_walk_alpha_table();
+        for (int i = 0; i < color3::SizeAtCompileTime; ++i) {
+            (*alpha)[i] = table.lookup(albedo[i], anisotropy);
+            (*sigma_t)[i] = (1.0f / fmaxf(radius[i], 1e-16f)) / (1.0f - anisotropy);
+        }
+    } else {
+        for (int i = 0; i < color3::SizeAtCompileTime; ++i) {
+            subsurface_random_walk_remap(albedo[i], radius[i], anisotropy, &(*sigma_t)[i], &(*alpha)[i]);
+        }
     }
 
     // TODO: Should I do this ???
@@ -207,7 +262,7 @@ inline float bssrdf_dipole_compute_Rd(float alpha_prime, float fourthirdA)
     return 0.5f * alpha_prime * (1.0f + expf(-fourthirdA * s)) * expf(-s);
 }
 
-static float bssrdf_dipole_compute_alpha_prime(float rd, float fourthirdA)
+static float bssrdf_dipole_compute_alpha_prime(float rd, float fourthirdA, int max_num_iterations = 12)
 {
     /* Little Newton solver. */
     if (rd < 1e-4f) {
@@ -221,7 +276,6 @@ static float bssrdf_dipole_compute_alpha_prime(float rd, float fourthirdA)
     float x1 = 1.0f;
     float xmid, fmid;
 
-    constexpr const int max_num_iterations = 12;
     for (int i = 0; i < max_num_iterations; ++i) {
         xmid = 0.5f * (x0 + x1);
         fmid = bssrdf_dipole_compute_Rd(xmid, fourthirdA);
@@ -242,15 +296,30 @@ struct SubsurfaceProfile
     float anisotropy;
     float ior; // Should keep consistent with the surface BSDF.
     float rfr_entry_prob;
+    // BSSRDF::radius_scale, or empty to solve for it.
+    std::span<const float> radius_scale;
+    bool tabulated = false;
 };
 
-inline void bssrdf_setup_radius(SubsurfaceProfile &profile)
+inline float bssrdf_fourthirdA(float ior)
 {
-    /* Adjust radius based on IOR and albedo. */
-    const float eta = profile.ior;
+    const float eta = ior;
     const float inv_eta = 1.0f / eta;
     const float F_dr = inv_eta * (-1.440f * inv_eta + 0.710f) + 0.668f + 0.0636f * eta;
-    const float fourthirdA = (4.0f / 3.0f) * (1.0f + F_dr) / (1.0f - F_dr); /* From Jensen's `Fdr` ratio formula. */
+    return (4.0f / 3.0f) * (1.0f + F_dr) / (1.0f - F_dr); /* From Jensen's `Fdr` ratio formula. */
+}
+
+inline void bssrdf_setup_radius(SubsurfaceProfile &profile)
+{
+    /* Adjust radius based on IOR and albedo. */
+    if (!profile.radius_scale.empty()) {
+        int n = (int)profile.radius_scale.size();
+        for (int i = 0; i < color3::SizeAtCompileTime; ++i) {
+            profile.radius[i] *= lerp_table(profile.radius_scale.data(), n, albedo_table_coord(profile.albedo[i], n));
+        }
+        return;
+    }
+    const float fourthirdA = bssrdf_fourthirdA(profile.ior);
 
     color3 alpha_prime;
     for (int i = 0; i < color3::SizeAtCompileTime; ++i) {
@@ -266,21 +335,58 @@ inline void bssrdf_setup_radius(SubsurfaceProfile &profile)
 constexpr int BSSRDF_MAX_BOUNCES = 256;
 constexpr float VOLUME_THROUGHPUT_EPSILON = 1e-6f;
 
+// State of a random walk between steps, so that walks can be advanced one at a time (subsurface_random_walk) or in
+// lockstep (subsurface_random_walk_n) with the same code and the same random numbers.
+struct RandomWalk
+{
+    vec3 P; // entry position
+    vec3 N; // entry shading normal
+    color3 alpha;
+    color3 sigma_t_org, sigma_s_org;
+#ifdef SUBSURFACE_RANDOM_WALK_SIMILARITY_LEVEL
+    color3 sigma_t_star, sigma_s_star;
+#endif
+    float anisotropy_org;
+    float guided_fraction_org;
+    float diffusion_length;
+    float phase_log;
+
+    Ray ray;
+    color3 throughput;
+    int bounce = 0;
+    bool have_opposite_interface = false;
+    float opposite_distance = 0.0f;
+
+    // Terms of the current step that are needed again once its ray-cast is done.
+    color3 sigma_t, sigma_s;
+    float guided_fraction;
+    color3 channel_pdf;
+    float t;
+    float backward_fraction;
+    float forward_pdf_factor;
+    float forward_stretching;
+    float backward_pdf_factor;
+    float backward_stretching;
+
+    bool hit = false;
+    HitRecord exit_record;
+    Ray exit_ray;
+};
+
 // Following the convention, D is the entry direction (used to be diffuse entry).
 // if D is 0, we resample D based on rfr_entry_prob.
-// wi is the random walk output direction.
-// Pass in the current throughput to be accumulated during the random walk.
-// Return whether the random walk is successful.
-bool subsurface_random_walk(SubsurfaceProfile profile, const LocalGeometry &local_geometry, const Intersection &entry,
-                            vec3 D, RNG &rng, color3 &throughput, SceneHit &exit, vec3 &wi)
+// Return false if the walk fails before its first step.
+static bool random_walk_begin(RandomWalk &walk, SubsurfaceProfile profile, const Intersection &entry, vec3 D,
+                              Sampler &sampler, const color3 &throughput)
 {
+    stat_walks.add();
     bssrdf_setup_radius(profile);
 
     const vec3 &P = entry.p;          // entry position
     const vec3 &N = entry.sh_frame.n; // entry shading normal
     const vec3 &Ng = entry.frame.n;   // entry geometric normal
     if (D.isZero()) {
-        if (rng.next() < profile.rfr_entry_prob) {
+        if (sampler.next() < profile.rfr_entry_prob) {
             // Per Christophe, using D as-is may not get the best result in terms of matching references,
             // even if it seems to be the more "principal" way.
             // Empirically, re-sample refractive D given wo with a fixed 1.0 alpha GGX gives better result.
@@ -289,7 +395,7 @@ bool subsurface_random_walk(SubsurfaceProfile profile, const LocalGeometry &loca
             if (wo.z() <= 0.0f) {
                 return false;
             }
-            vec3 wh = GGX(1.0f).sample(wo, rng.next2d());
+            vec3 wh = GGX(1.0f).sample(wo, sampler.next2d());
             if (!refract(wo, wh, 1.0f / profile.ior, D)) {
                 // total internal reflection
                 return false;
@@ -301,7 +407,7 @@ bool subsurface_random_walk(SubsurfaceProfile profile, const LocalGeometry &loca
             D = entry.sh_vector_to_world(D);
         } else {
             // Override D with classic cosine entry.
-            D = sample_cosine_hemisphere(rng.next2d(), -N);
+            D = sample_cosine_hemisphere(sampler.next2d(), -N);
         }
     }
     //
@@ -310,7 +416,10 @@ bool subsurface_random_walk(SubsurfaceProfile profile, const LocalGeometry &loca
     }
 
     /* Setup ray. */
-    Ray ray = spawn_ray<OffsetType::NextBounce>(P, D, Ng, 0.0f, inf);
+    walk.P = P;
+    walk.N = N;
+    walk.ray = spawn_ray<OffsetType::NextBounce>(P, D, Ng, 0.0f, inf);
+    walk.ray.time = entry.time;
     // TODO: avoid self intersection on first bounce
 
     /* Convert subsurface to volume coefficients.
@@ -320,8 +429,11 @@ bool subsurface_random_walk(SubsurfaceProfile profile, const LocalGeometry &loca
     const float anisotropy = profile.anisotropy;
 
     color3 sigma_t, alpha;
-    subsurface_random_walk_coefficients(albedo, radius, anisotropy, &sigma_t, &alpha, &throughput);
+    walk.throughput = throughput;
+    subsurface_random_walk_coefficients(albedo, radius, anisotropy, &sigma_t, &alpha, &walk.throughput,
+                                        profile.tabulated);
     color3 sigma_s = sigma_t * alpha;
+    walk.alpha = alpha;
 
     /* Theoretically it should be better to use the exact alpha for the channel we're sampling at
      * each bounce, but in practice there doesn't seem to be a noticeable difference in exchange
@@ -331,9 +443,9 @@ bool subsurface_random_walk(SubsurfaceProfile profile, const LocalGeometry &loca
      * Since the strength of the guided sampling increases as alpha gets lower, using a value that
      * is too low results in fireflies while one that's too high just gives a bit more noise.
      * Therefore, the code here uses the highest of the three albedos to be safe. */
-    float diffusion_length = diffusion_length_dwivedi(alpha.maxCoeff());
+    walk.diffusion_length = diffusion_length_dwivedi(alpha.maxCoeff());
 
-    if (diffusion_length == 1.0f) {
+    if (walk.diffusion_length == 1.0f) {
         /* With specific values of alpha the length might become 1, which in asymptotic makes phase to
          * be infinite. After first bounce it will cause throughput to be 0. Do early output, avoiding
          * numerical issues and extra unneeded work. */
@@ -341,198 +453,246 @@ bool subsurface_random_walk(SubsurfaceProfile profile, const LocalGeometry &loca
     }
 
     /* Precompute term for phase sampling. */
-    const float phase_log = logf((diffusion_length + 1.0f) / (diffusion_length - 1.0f));
-
-    /* Random walk until we hit the surface again. */
-    bool hit = false;
-    bool have_opposite_interface = false;
-    float opposite_distance = 0.0f;
+    walk.phase_log = logf((walk.diffusion_length + 1.0f) / (walk.diffusion_length - 1.0f));
 
     /* TODO: Disable for `alpha > 0.999` or so? */
     /* Our heuristic, a compromise between guiding and classic. */
-    const float guided_fraction = 1.0f - fmaxf(0.5f, powf(fabsf(anisotropy), 0.125f));
+    walk.guided_fraction_org = 1.0f - fmaxf(0.5f, powf(fabsf(anisotropy), 0.125f));
+    walk.anisotropy_org = anisotropy;
+    walk.sigma_t_org = sigma_t;
+    walk.sigma_s_org = sigma_s;
 
 #ifdef SUBSURFACE_RANDOM_WALK_SIMILARITY_LEVEL
-    color3 sigma_s_star = sigma_s * (1.0f - anisotropy);
-    color3 sigma_t_star = sigma_t - sigma_s + sigma_s_star;
-    color3 sigma_t_org = sigma_t;
-    color3 sigma_s_org = sigma_s;
-    const float anisotropy_org = anisotropy;
-    const float guided_fraction_org = guided_fraction;
+    walk.sigma_s_star = sigma_s * (1.0f - anisotropy);
+    walk.sigma_t_star = sigma_t - sigma_s + walk.sigma_s_star;
 #endif
+    return true;
+}
 
-    for (int bounce = 0; bounce < BSSRDF_MAX_BOUNCES; bounce++) {
+// First half of a step: scatter and sample the distance. Sets walk.ray.tmax for the ray-cast.
+static void random_walk_sample_step(RandomWalk &walk, Sampler &sampler)
+{
+    Ray &ray = walk.ray;
+    const vec3 &P = walk.P;
+    const vec3 &N = walk.N;
+    const float diffusion_length = walk.diffusion_length;
+    const float phase_log = walk.phase_log;
+
+    float anisotropy = walk.anisotropy_org;
+    walk.guided_fraction = walk.guided_fraction_org;
+    walk.sigma_t = walk.sigma_t_org;
+    walk.sigma_s = walk.sigma_s_org;
 #ifdef SUBSURFACE_RANDOM_WALK_SIMILARITY_LEVEL
-        // shadow with local variables according to depth
-        float anisotropy, guided_fraction;
-        color3 sigma_s, sigma_t;
-        if (bounce <= SUBSURFACE_RANDOM_WALK_SIMILARITY_LEVEL) {
-            anisotropy = anisotropy_org;
-            guided_fraction = guided_fraction_org;
-            sigma_t = sigma_t_org;
-            sigma_s = sigma_s_org;
-        } else {
-            anisotropy = 0.0f;
-            guided_fraction = 0.75f; // back to isotropic heuristic from Blender
-            sigma_t = sigma_t_star;
-            sigma_s = sigma_s_star;
-        }
+    // switch coefficients according to depth
+    if (walk.bounce > SUBSURFACE_RANDOM_WALK_SIMILARITY_LEVEL) {
+        anisotropy = 0.0f;
+        walk.guided_fraction = 0.75f; // back to isotropic heuristic from Blender
+        walk.sigma_t = walk.sigma_t_star;
+        walk.sigma_s = walk.sigma_s_star;
+    }
 #endif
 
-        /* Sample color channel, use MIS with balance heuristic. */
-        float rphase = rng.next();
-        color3 channel_pdf;
-        int channel = volume_sample_channel(alpha, throughput, rphase, &channel_pdf);
-        float sample_sigma_t = volume_channel_get(sigma_t, channel);
-        float randt = rng.next();
-
-        /* We need the result of the ray-cast to compute the full guided PDF, so just remember the
-         * relevant terms to avoid recomputing them later. */
-        float backward_fraction = 0.0f;
-        float forward_pdf_factor = 0.0f;
-        float forward_stretching = 1.0f;
-        float backward_pdf_factor = 0.0f;
-        float backward_stretching = 1.0f;
-
-        /* For the initial ray, we already know the direction, so just do classic distance sampling. */
-        if (bounce > 0) {
-            /* Decide whether we should use guided or classic sampling. */
-            bool guided = (rng.next() < guided_fraction);
-
-            /* Determine if we want to sample away from the incoming interface.
-             * This only happens if we found a nearby opposite interface, and the probability for it
-             * depends on how close we are to it already.
-             * This probability term comes from the recorded presentation of [3]. */
-            bool guide_backward = false;
-            if (have_opposite_interface) {
-                /* Compute distance of the random walk between the tangent plane at the starting point
-                 * and the assumed opposite interface (the parallel plane that contains the point we
-                 * found in our ray query for the opposite side). */
-                float x = std::clamp((ray.origin - P).dot(-N), 0.0f, opposite_distance);
-                backward_fraction = 1.0f / (1.0f + expf((opposite_distance - 2.0f * x) / diffusion_length));
-                guide_backward = rng.next() < backward_fraction;
-            }
+    /* Sample color channel, use MIS with balance heuristic. */
+    float rphase = sampler.next();
+    int channel = volume_sample_channel(walk.alpha, walk.throughput, rphase, &walk.channel_pdf);
+    float sample_sigma_t = volume_channel_get(walk.sigma_t, channel);
+    float randt = sampler.next();
+
+    /* We need the result of the ray-cast to compute the full guided PDF, so just remember the
+     * relevant terms to avoid recomputing them later. */
+    walk.backward_fraction = 0.0f;
+    walk.forward_pdf_factor = 0.0f;
+    walk.forward_stretching = 1.0f;
+    walk.backward_pdf_factor = 0.0f;
+    walk.backward_stretching = 1.0f;
+
+    /* For the initial ray, we already know the direction, so just do classic distance sampling. */
+    if (walk.bounce > 0) {
+        /* Decide whether we should use guided or classic sampling. */
+        bool guided = (sampler.next() < walk.guided_fraction);
+
+        /* Determine if we want to sample away from the incoming interface.
+         * This only happens if we found a nearby opposite interface, and the probability for it
+         * depends on how close we are to it already.
+         * This probability term comes from the recorded presentation of [3]. */
+        bool guide_backward = false;
+        if (walk.have_opposite_interface) {
+            /* Compute distance of the random walk between the tangent plane at the starting point
+             * and the assumed opposite interface (the parallel plane that contains the point we
+             * found in our ray query for the opposite side). */
+            float x = std::clamp((ray.origin - P).dot(-N), 0.0f, walk.opposite_distance);
+            walk.backward_fraction =
+                1.0f / (1.0f + expf((walk.opposite_distance - 2.0f * x) / diffusion_length));
+            guide_backward = sampler.next() < walk.backward_fraction;
+        }
 
-            /* Sample scattering direction. */
-            const vec2 rand_scatter = rng.next2d();
-            float cos_theta;
-            float hg_pdf;
-            if (guided) {
-                cos_theta = sample_phase_dwivedi(diffusion_length, phase_log, rand_scatter.x());
-                /* The backwards guiding distribution is just mirrored along `sd->N`, so swapping the
-                 * sign here is enough to sample from that instead. */
-                if (guide_backward) {
-                    cos_theta = -cos_theta;
-                }
-                vec3 newD = direction_from_cosine(N, cos_theta, rand_scatter.y());
-                hg_pdf = single_peaked_henyey_greenstein(ray.dir.dot(newD), anisotropy);
-                ray.dir = newD;
-            } else {
-                vec3 newD = henyey_greenstrein_sample(ray.dir, anisotropy, rand_scatter.x(), rand_scatter.y(), &hg_pdf);
-                cos_theta = newD.dot(N);
-                ray.dir = newD;
+        /* Sample scattering direction. */
+        const vec2 rand_scatter = sampler.next2d();
+        float cos_theta;
+        float hg_pdf;
+        if (guided) {
+            cos_theta = sample_phase_dwivedi(diffusion_length, phase_log, rand_scatter.x());
+            /* The backwards guiding distribution is just mirrored along `sd->N`, so swapping the
+             * sign here is enough to sample from that instead. */
+            if (guide_backward) {
+                cos_theta = -cos_theta;
             }
+            vec3 newD = direction_from_cosine(N, cos_theta, rand_scatter.y());
+            hg_pdf = single_peaked_henyey_greenstein(ray.dir.dot(newD), anisotropy);
+            ray.dir = newD;
+        } else {
+            vec3 newD = henyey_greenstrein_sample(ray.dir, anisotropy, rand_scatter.x(), rand_scatter.y(), &hg_pdf);
+            cos_theta = newD.dot(N);
+            ray.dir = newD;
+        }
 
-            /* Compute PDF factor caused by phase sampling (as the ratio of guided / classic).
-             * Since phase sampling is channel-independent, we can get away with applying a factor
-             * to the guided PDF, which implicitly means pulling out the classic PDF term and letting
-             * it cancel with an equivalent term in the numerator of the full estimator.
-             * For the backward PDF, we again reuse the same probability distribution with a sign swap.
-             */
-            forward_pdf_factor = (1.0f / two_pi) * eval_phase_dwivedi(diffusion_length, phase_log, cos_theta) / hg_pdf;
-            backward_pdf_factor =
-                (1.0f / two_pi) * eval_phase_dwivedi(diffusion_length, phase_log, -cos_theta) / hg_pdf;
-
-            /* Prepare distance sampling.
-             * For the backwards case, this also needs the sign swapped since now directions against
-             * `sd->N` (and therefore with negative cos_theta) are preferred. */
-            forward_stretching = (1.0f - cos_theta / diffusion_length);
-            backward_stretching = (1.0f + cos_theta / diffusion_length);
-            if (guided) {
-                sample_sigma_t *= guide_backward ? backward_stretching : forward_stretching;
-            }
+        /* Compute PDF factor caused by phase sampling (as the ratio of guided / classic).
+         * Since phase sampling is channel-independent, we can get away with applying a factor
+         * to the guided PDF, which implicitly means pulling out the classic PDF term and letting
+         * it cancel with an equivalent term in the numerator of the full estimator.
+         * For the backward PDF, we again reuse the same probability distribution with a sign swap.
+         */
+        walk.forward_pdf_factor =
+            (1.0f / two_pi) * eval_phase_dwivedi(diffusion_length, phase_log, cos_theta) / hg_pdf;
+        walk.backward_pdf_factor =
+            (1.0f / two_pi) * eval_phase_dwivedi(diffusion_length, phase_log, -cos_theta) / hg_pdf;
+
+        /* Prepare distance sampling.
+         * For the backwards case, this also needs the sign swapped since now directions against
+         * `sd->N` (and therefore with negative cos_theta) are preferred. */
+        walk.forward_stretching = (1.0f - cos_theta / diffusion_length);
+        walk.backward_stretching = (1.0f + cos_theta / diffusion_length);
+        if (guided) {
+            sample_sigma_t *= guide_backward ? walk.backward_stretching : walk.forward_stretching;
         }
+    }
 
-        /* Sample distance along ray. */
-        float t = -logf(1.0f - randt) / sample_sigma_t;
+    /* Sample distance along ray. */
+    walk.t = -logf(1.0f - randt) / sample_sigma_t;
 
-        /* On the first bounce, we use the ray-cast to check if the opposite side is nearby.
-         * If yes, we will later use backwards guided sampling in order to have a decent
-         * chance of connecting to it.
-         * TODO: Maybe use less than 10 times the mean free path? */
-        if (bounce == 0) {
-            ray.tmax = std::max(t, 10.0f / ((sigma_t).minCoeff()));
-        } else {
-            ray.tmax = t;
-            // TODO:
-            /* After the first bounce the object can intersect the same surface again */
-            // ray.self.object = OBJECT_NONE;
-            // ray.self.prim = PRIM_NONE;
-        }
-        // scene_intersect_local(kg, &ray, &ss_isect, object, NULL, 1);
-        // hit = (ss_isect.num_hits > 0);
-        hit = local_geometry.intersect1(ray, exit);
+    /* On the first bounce, we use the ray-cast to check if the opposite side is nearby.
+     * If yes, we will later use backwards guided sampling in order to have a decent
+     * chance of connecting to it.
+     * TODO: Maybe use less than 10 times the mean free path? */
+    if (walk.bounce == 0) {
+        ray.tmax = std::max(walk.t, 10.0f / ((walk.sigma_t).minCoeff()));
+    } else {
+        ray.tmax = walk.t;
+        // TODO:
+        /* After the first bounce the object can intersect the same surface again */
+        // ray.self.object = OBJECT_NONE;
+        // ray.self.prim = PRIM_NONE;
+    }
+}
 
+// Second half of a step, given the result of the ray-cast of walk.ray. Return whether the walk goes on.
+static bool random_walk_finish_step(RandomWalk &walk, bool found, const HitRecord &record, Sampler &sampler,
+                                    const RussianRouletteOptions &rr)
+{
+    Ray &ray = walk.ray;
+    // Only the distance is needed until the walk exits (see the promotion in random_walk_end).
+    bool hit = found;
+    if (hit) {
+        ray.tmax = record.t;
+    }
+
+    if (walk.bounce == 0) {
+        /* Check if we hit the opposite side. */
         if (hit) {
-            ray.tmax = exit.it.thit;
+            walk.have_opposite_interface = true;
+            walk.opposite_distance = (ray.origin + ray.tmax * ray.dir - walk.P).dot(-walk.N);
         }
+        /* Apart from the opposite side check, we were supposed to only trace up to distance t,
+         * so check if there would have been a hit in that case. */
+        hit = ray.tmax < walk.t;
+    }
 
-        if (bounce == 0) {
-            /* Check if we hit the opposite side. */
-            if (hit) {
-                have_opposite_interface = true;
-                opposite_distance = (ray.origin + ray.tmax * ray.dir - P).dot(-N);
-            }
-            /* Apart from the opposite side check, we were supposed to only trace up to distance t,
-             * so check if there would have been a hit in that case. */
-            hit = ray.tmax < t;
-        }
+    /* Use the distance to the exit point for the throughput update if we found one. */
+    float t = walk.t;
+    if (hit) {
+        t = ray.tmax;
+        walk.exit_record = record;
+        walk.exit_ray = ray;
+    }
 
-        /* Use the distance to the exit point for the throughput update if we found one. */
-        if (hit) {
-            t = ray.tmax;
+    /* Advance to new scatter location. */
+    ray.origin += t * ray.dir;
+
+    const color3 &sigma_t = walk.sigma_t;
+    color3 transmittance;
+    color3 pdf = subsurface_random_walk_pdf(sigma_t, t, hit, &transmittance);
+    if (walk.bounce > 0) {
+        /* Compute PDF just like we do for classic sampling, but with the stretched sigma_t. */
+        color3 guided_pdf = subsurface_random_walk_pdf(walk.forward_stretching * sigma_t, t, hit, nullptr);
+
+        if (walk.have_opposite_interface) {
+            /* First step of MIS: Depending on geometry we might have two methods for guided
+             * sampling, so perform MIS between them. */
+            color3 back_pdf = subsurface_random_walk_pdf(walk.backward_stretching * sigma_t, t, hit, nullptr);
+            guided_pdf = lerp(guided_pdf * walk.forward_pdf_factor, back_pdf * walk.backward_pdf_factor,
+                              walk.backward_fraction);
+        } else {
+            /* Just include phase sampling factor otherwise. */
+            guided_pdf *= walk.forward_pdf_factor;
         }
 
-        /* Advance to new scatter location. */
-        ray.origin += t * ray.dir;
-
-        color3 transmittance;
-        color3 pdf = subsurface_random_walk_pdf(sigma_t, t, hit, &transmittance);
-        if (bounce > 0) {
-            /* Compute PDF just like we do for classic sampling, but with the stretched sigma_t. */
-            color3 guided_pdf = subsurface_random_walk_pdf(forward_stretching * sigma_t, t, hit, nullptr);
-
-            if (have_opposite_interface) {
-                /* First step of MIS: Depending on geometry we might have two methods for guided
-                 * sampling, so perform MIS between them. */
-                color3 back_pdf = subsurface_random_walk_pdf(backward_stretching * sigma_t, t, hit, nullptr);
-                guided_pdf = lerp(guided_pdf * forward_pdf_factor, back_pdf * backward_pdf_factor, backward_fraction);
-            } else {
-                /* Just include phase sampling factor otherwise. */
-                guided_pdf *= forward_pdf_factor;
-            }
+        /* Now we apply the MIS balance heuristic between the classic and guided sampling. */
+        pdf = lerp(pdf, guided_pdf, walk.guided_fraction);
+    }
 
-            /* Now we apply the MIS balance heuristic between the classic and guided sampling. */
-            pdf = lerp(pdf, guided_pdf, guided_fraction);
-        }
+    /* Finally, we're applying MIS again to combine the three color channels.
+     * Altogether, the MIS computation combines up to nine different estimators:
+     * {classic, guided, backward_guided} x {r, g, b} */
+    walk.throughput *= (hit ? transmittance : walk.sigma_s * transmittance) / ((walk.channel_pdf * pdf).sum());
+    walk.hit = hit;
+    int bounce = walk.bounce++;
 
-        /* Finally, we're applying MIS again to combine the three color channels.
-         * Altogether, the MIS computation combines up to nine different estimators:
-         * {classic, guided, backward_guided} x {r, g, b} */
-        throughput *= (hit ? transmittance : sigma_s * transmittance) / ((channel_pdf * pdf).sum());
+    if (hit) {
+        /* If we hit the surface, we are done. */
+        return false;
+    } else if ((walk.throughput).maxCoeff() < VOLUME_THROUGHPUT_EPSILON) {
+        /* Avoid unnecessary work and precision issue when throughput gets really small. */
+        return false;
+    } else if (!rr.survive(walk.throughput, bounce, sampler.next())) {
+        return false;
+    }
+    return walk.bounce < BSSRDF_MAX_BOUNCES;
+}
 
-        if (hit) {
-            /* If we hit the surface, we are done. */
-            break;
-        } else if ((throughput).maxCoeff() < VOLUME_THROUGHPUT_EPSILON) {
-            /* Avoid unnecessary work and precision issue when throughput gets really small. */
-            break;
-        }
+static bool random_walk_end(const RandomWalk &walk, const LocalGeometry &local_geometry, color3 &throughput,
+                            SceneHit &exit, vec3 &wi)
+{
+    stat_walk_bounces.record(walk.bounce);
+    if (walk.hit) {
+        stat_walk_exits.add();
+        local_geometry.scene->promote(walk.exit_record, walk.exit_ray, exit);
     }
+    wi = walk.ray.dir;
+    throughput = walk.throughput;
+    ASSERT_HOT(throughput.allFinite() && (throughput >= 0.0f).all());
+    return walk.hit;
+}
 
-    wi = ray.dir;
-    ASSERT(throughput.allFinite() && (throughput >= 0.0f).all());
-    return hit;
+// wi is the random walk output direction.
+// Pass in the current throughput to be accumulated during the random walk.
+// Return whether the random walk is successful.
+bool subsurface_random_walk(SubsurfaceProfile profile, const LocalGeometry &local_geometry, const Intersection &entry,
+                            vec3 D, Sampler &sampler, const RussianRouletteOptions &rr, color3 &throughput,
+                            SceneHit &exit, vec3 &wi)
+{
+    RandomWalk walk;
+    if (!random_walk_begin(walk, profile, entry, D, sampler, throughput)) {
+        return false;
+    }
+    /* Random walk until we hit the surface again. */
+    bool more = true;
+    while (more) {
+        random_walk_sample_step(walk, sampler);
+        HitRecord record;
+        bool found = local_geometry.intersect1(walk.ray, record);
+        more = random_walk_finish_step(walk, found, record, sampler, rr);
+    }
+    return random_walk_end(walk, local_geometry, throughput, exit, wi);
 }
 
 color3 LambertianSubsurfaceExitAdapter::eval(const vec3 &wo, const vec3 &wi, const Intersection &it) const
@@ -562,22 +722,98 @@ float LambertianSubsurfaceExitAdapter::pdf(const vec3 &wo, const vec3 &wi, const
     return wi.z() * inv_pi;
 }
 
-bool BSSRDF::sample(const LocalGeometry &local_geometry, const Intersection &entry, vec3 D, RNG &rng,
-                    color3 &throughput, SceneHit &exit, vec3 &wi) const
+static SubsurfaceProfile subsurface_profile(const BSSRDF &bssrdf, const Intersection &entry)
 {
     SubsurfaceProfile profile;
-    profile.albedo = (*albedo)(entry);
+    profile.albedo = (*bssrdf.albedo)(entry);
     profile.albedo = clamp(profile.albedo, color3::Zero(), color3::Ones());
-    profile.radius = (*radius)(entry);
-    profile.anisotropy = anisotropy;
-    profile.ior = ior;
-    profile.rfr_entry_prob = rfr_entry_prob;
-    if (!subsurface_random_walk(profile, local_geometry, entry, D, rng, throughput, exit, wi))
+    profile.radius = (*bssrdf.radius)(entry);
+    profile.anisotropy = bssrdf.anisotropy;
+    profile.ior = bssrdf.ior;
+    profile.rfr_entry_prob = bssrdf.rfr_entry_prob;
+    profile.radius_scale = bssrdf.radius_scale;
+    profile.tabulated = bssrdf.tabulated;
+    return profile;
+}
+
+bool BSSRDF::sample(const LocalGeometry &local_geometry, const Intersection &entry, vec3 D, Sampler &sampler,
+                    color3 &throughput, SceneHit &exit, vec3 &wi) const
+{
+    SubsurfaceProfile profile = subsurface_profile(*this, entry);
+    if (!subsurface_random_walk(profile, local_geometry, entry, D, sampler, walk_rr, throughput, exit, wi))
         return false;
 
     return true;
 }
 
+void BSSRDF::build_radius_scale()
+{
+    const float fourthirdA = bssrdf_fourthirdA(ior);
+    radius_scale.resize(radius_scale_res);
+    for (int i = 0; i < radius_scale_res; ++i) {
+        float albedo = sqr(sqr((float)i / (radius_scale_res - 1)));
+        // NOTE: solved to full float precision since this is only done once.
+        radius_scale[i] = std::sqrt(3.0f * (1.0f - bssrdf_dipole_compute_alpha_prime(albedo, fourthirdA, 24)));
+    }
+}
+
+void subsurface_random_walk_n(std::span<SubsurfaceWalk> walks, std::span<Sampler *const> samplers)
+{
+    ASSERT(samplers.size() == walks.size());
+    // Reuse per-thread buffers to avoid allocating on every call.
+    static thread_local std::vector<RandomWalk> states;
+    static thread_local std::vector<uint32_t> active;
+    static thread_local std::vector<LocalGeometry> local_geometries;
+    static thread_local std::vector<Ray> rays;
+    static thread_local std::vector<HitRecord> records;
+    static thread_local std::vector<uint8_t> found;
+
+    uint32_t n = (uint32_t)walks.size();
+    states.assign(n, RandomWalk());
+    active.clear();
+    for (uint32_t i = 0; i < n; ++i) {
+        SubsurfaceWalk &walk = walks[i];
+        walk.hit = false;
+        SubsurfaceProfile profile = subsurface_profile(*walk.bssrdf, walk.entry);
+        if (random_walk_begin(states[i], profile, walk.entry, walk.D, *samplers[i], walk.throughput)) {
+            active.push_back(i);
+        }
+    }
+
+    while (!active.empty()) {
+        uint32_t num_active = (uint32_t)active.size();
+        local_geometries.resize(num_active);
+        rays.resize(num_active);
+        records.resize(num_active);
+        found.resize(num_active);
+        for (uint32_t j = 0; j < num_active; ++j) {
+            uint32_t i = active[j];
+            random_walk_sample_step(states[i], *samplers[i]);
+            local_geometries[j] = walks[i].local_geometry;
+            rays[j] = states[i].ray;
+        }
+        LocalGeometry::intersect_stream(local_geometries, rays, records, found);
+        // Drop the walks that ended so that the next step only traces live ones.
+        uint32_t num_alive = 0;
+        for (uint32_t j = 0; j < num_active; ++j) {
+            uint32_t i = active[j];
+            if (random_walk_finish_step(states[i], found[j], records[j], *samplers[i], walks[i].bssrdf->walk_rr)) {
+                active[num_alive++] = i;
+            }
+        }
+        active.resize(num_alive);
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        SubsurfaceWalk &walk = walks[i];
+        walk.steps = (uint32_t)states[i].bounce;
+        // Walks that failed in random_walk_begin never took a step.
+        if (states[i].bounce > 0) {
+            walk.hit = random_walk_end(states[i], walk.local_geometry, walk.throughput, walk.exit, walk.wi);
+        }
+    }
+}
+
 std::unique_ptr<BSSRDF> create_bssrdf(const ConfigArgs &args)
 {
     std::unique_ptr<BSSRDF> bssrdf = std::make_unique<BSSRDF>();
@@ -586,6 +822,11 @@ std::unique_ptr<BSSRDF> create_bssrdf(const ConfigArgs &args)
     bssrdf->anisotropy = args.load_float("anisotropy");
     bssrdf->ior = args.load_float("ior");
     bssrdf->rfr_entry_prob = args.load_float("rfr_entry_prob");
+    bssrdf->walk_rr = load_russian_roulette_options(args, "rr_", bssrdf->walk_rr);
+    bssrdf->tabulated = args.load_bool("tabulated", bssrdf->tabulated);
+    if (bssrdf->tabulated) {
+        bssrdf->build_radius_scale();
+    }
     return bssrdf;
 }
 
@@ -7,14 +7,16 @@
 #include "bsdf.h"
 #include "config.h"
 #include "maths.h"
+#include "path_termination.h"
+#include "scene.h"
+#include <array>
+#include <span>
+#include <vector>
 
 namespace ks
 {
 
-struct Scene;
-struct LocalGeometry;
-struct SceneHit;
-struct RNG;
+struct Sampler;
 
 struct LambertianSubsurfaceExitAdapter : public BSDF
 {
@@ -31,18 +33,69 @@ struct LambertianSubsurfaceExitAdapter : public BSDF
     float eta;
 };
 
+// subsurface_random_walk_remap (albedo to single-scattering albedo) tabulated over albedo x anisotropy and
+// bilinearly interpolated. The albedo axis is sampled at albedo^(1/4) since the fit is steepest near 0.
+// A flat row-major array (one row per anisotropy), so that it can be uploaded as is, e.g. to CUDA constant memory.
+struct RandomWalkAlphaTable
+{
+    static constexpr int albedo_res = 128;
+    static constexpr int anisotropy_res = 64;
+    // The fit gets too steep towards 1. Anisotropy outside of [0, max_anisotropy] evaluates the fit directly.
+    static constexpr float max_anisotropy = 0.9f;
+
+    RandomWalkAlphaTable();
+    float lookup(float albedo, float anisotropy) const;
+
+    std::array<float, albedo_res * anisotropy_res> alpha;
+};
+
+// Built on first use.
+const RandomWalkAlphaTable &random_walk_alpha_table();
+
 struct BSSRDF : Configurable
 {
-    bool sample(const LocalGeometry &local_geometry, const Intersection &entry, vec3 D, RNG &rng, color3 &throughput,
-                SceneHit &exit, vec3 &wi) const;
+    bool sample(const LocalGeometry &local_geometry, const Intersection &entry, vec3 D, Sampler &sampler,
+                color3 &throughput, SceneHit &exit, vec3 &wi) const;
 
     std::unique_ptr<ShaderField<color3>> albedo;
     std::unique_ptr<ShaderField<color3>> radius;
     float anisotropy;
     float ior; // Should keep consistent with the surface BSDF?
     float rfr_entry_prob;
+    // Russian roulette on the throughput of the random walk (counted in scattering events inside).
+    RussianRouletteOptions walk_rr = {RussianRouletteMode::Throughput, 16, 0.05f};
+    // Use random_walk_alpha_table and radius_scale instead of evaluating the fits and solvers at every sample.
+    bool tabulated = true;
+    // Factor of the diffuse mean free path to the radius for this ior, tabulated like RandomWalkAlphaTable (over
+    // albedo^(1/4)).
+    static constexpr int radius_scale_res = 256;
+    std::vector<float> radius_scale;
+
+    void build_radius_scale();
+};
+
+// A random walk queued for subsurface_random_walk_n. The inputs are the arguments of BSSRDF::sample.
+struct SubsurfaceWalk
+{
+    const BSSRDF *bssrdf = nullptr;
+    LocalGeometry local_geometry;
+    Intersection entry;
+    vec3 D = vec3::Zero();
+    // Throughput before the walk, accumulated during the walk.
+    color3 throughput = color3::Ones();
+
+    // Outputs, valid if hit.
+    bool hit = false;
+    SceneHit exit;
+    vec3 wi;
+    // Ray-casts taken, hit or not.
+    uint32_t steps = 0;
 };
 
+// Runs walks[i] with samplers[i]. All walks are advanced in lockstep so that the ray-casts of each step are traced as
+// streams (see LocalGeometry::intersect_stream). The results are the same as calling BSSRDF::sample on each.
+void subsurface_random_walk_n(std::span<SubsurfaceWalk> walks, std::span<Sampler *const> samplers);
+
 std::unique_ptr<BSSRDF> create_bssrdf(const ConfigArgs &args);
 
 } // namespace ks
\ No newline at end of file
@@ -1,359 +1,75 @@
 #include "texture.h"
 #include "assertion.h"
+#include "compression.h"
 #include "file_util.h"
+#include "hash.h"
 #include "image_util.h"
+#include "mip_builder.h"
 #include "parallel.h"
+#include "stats.h"
+#include "texture_cache.h"
+#include "texture_codec.h"
 #include <array>
-#include <lz4.h>
+#include <bit>
+#include <cstring>
 
 namespace ks
 {
 
-constexpr int byte_stride(TextureDataType data_type)
+static StatCounter stat_texture_lookups("texture/lookups");
+static StatTimer stat_texture_load("assets/load_texture");
+
+int texture_element_bytes(TextureDataType data_type, int num_channels)
 {
     switch (data_type) {
     case TextureDataType::u8:
-        return 1;
+        return num_channels;
+    case TextureDataType::f16:
+        return 2 * num_channels;
+    case TextureDataType::bc1:
+        return bc1_block_bytes;
+    case TextureDataType::bc4:
+        return bc4_block_bytes;
+    case TextureDataType::bc5:
+        return bc5_block_bytes;
     case TextureDataType::f32:
     default:
-        return 4;
+        return 4 * num_channels;
     }
 }
 
+// Resolution of mips (in blocks for block-compressed types).
+static vec2i storage_res(TextureDataType data_type, int width, int height)
+{
+    if (is_block_compressed(data_type))
+        return vec2i((width + 3) / 4, (height + 3) / 4);
+    return vec2i(width, height);
+}
+
 Texture::Texture(int width, int height, int num_channels, TextureDataType data_type)
     : width(width), height(height), num_channels(num_channels), data_type(data_type)
 {
-    int stride = byte_stride(data_type) * num_channels;
+    int stride = texture_element_bytes(data_type, num_channels);
     int levels = 1;
     mips.resize(levels);
-    mips[0] = BlockedArray<std::byte>(width, height, stride);
+    vec2i res = storage_res(data_type, width, height);
+    mips[0] = TextureMip(res.x(), res.y(), stride);
 }
 
 Texture::Texture(const std::byte *bytes, int width, int height, int num_channels, TextureDataType data_type,
-                 bool build_mipmaps)
+                 bool build_mipmaps, MipFilter mip_filter)
     : width(width), height(height), num_channels(num_channels), data_type(data_type)
 {
-    int stride = byte_stride(data_type) * num_channels;
-    // https://www.nvidia.com/en-us/drivers/np2-mipmapping/
-    // NPOT mipmapping with rounding-up.
-    int levels = build_mipmaps ? (1 + (int)std::ceil(std::log2(std::max(width, height)))) : 1;
-    mips.resize(levels);
+    ASSERT(!build_mipmaps || !is_block_compressed(data_type), "Convert to block compression after building mips.");
+    int stride = texture_element_bytes(data_type, num_channels);
     constexpr int min_parallel_res = 256 * 256;
-    for (int l = 0; l < levels; ++l) {
-        if (l == 0) {
-            bool parallel = width * height >= min_parallel_res;
-            mips[l] = BlockedArray(width, height, stride, bytes, 2, parallel);
-        } else {
-            mips[l] = BlockedArray<std::byte>(width, height, stride);
-            int last_width = mips[l - 1].ures;
-            int last_height = mips[l - 1].vres;
-            bool round_up_width = (last_width == width * 2 - 1);
-            bool round_up_height = (last_height == height * 2 - 1);
-            if (last_width > 1 && round_up_width && last_height > 1 && round_up_height) {
-                parallel_tile_2d(width, height, [&](int x, int y) {
-                    float w0x = (float)x / (float)(last_width);
-                    float w1x = (float)width / (float)(last_width);
-                    float w2x = (float)(width - x - 1) / (float)(last_width);
-                    int x0 = 2 * x - 1;
-                    int x1 = 2 * x;
-                    int x2 = 2 * x + 1;
-                    float w0y = (float)y / (float)(last_height);
-                    float w1y = (float)height / (float)(last_height);
-                    float w2y = (float)(height - y - 1) / (float)(last_height);
-                    int y0 = 2 * y - 1;
-                    int y1 = 2 * y;
-                    int y2 = 2 * y + 1;
-
-                    VLA(v_sum, float, num_channels);
-                    std::span<float> v_sum_span(v_sum, v_sum + num_channels);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] = 0.0f;
-                    VLA(v, float, num_channels);
-                    std::span<float> v_span(v, v + num_channels);
-
-                    if (x0 > 0 && y0 > 0) {
-                        fetch_as_float(x0, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * w0y * v_span[c];
-                    }
-                    if (y0 > 0) {
-                        fetch_as_float(x1, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * w0y * v_span[c];
-                    }
-                    if (x2 < last_width && y0 > 0) {
-                        fetch_as_float(x2, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w2x * w0y * v_span[c];
-                    }
-                    if (x0 > 0) {
-                        fetch_as_float(x0, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * w1y * v_span[c];
-                    }
-                    {
-                        fetch_as_float(x1, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * w1y * v_span[c];
-                    }
-                    if (x2 < last_width) {
-                        fetch_as_float(x2, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w2x * w1y * v_span[c];
-                    }
-                    if (x0 > 0 && y2 < last_height) {
-                        fetch_as_float(x0, y2, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * w2y * v_span[c];
-                    }
-                    if (y2 < last_height) {
-                        fetch_as_float(x1, y2, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * w2y * v_span[c];
-                    }
-                    if (x2 < last_width && y2 < last_height) {
-                        fetch_as_float(x2, y2, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w2x * w2y * v_span[c];
-                    }
-                    set_from_float(x, y, l, v_sum_span);
-                });
-            } else if (last_width > 1 && !round_up_width && last_height > 1 && round_up_height) {
-                parallel_tile_2d(width, height, [&](int x, int y) {
-                    constexpr float w0x = 0.5f;
-                    constexpr float w1x = 0.5f;
-                    int x0 = 2 * x;
-                    int x1 = 2 * x + 1;
-                    float w0y = (float)y / (float)(last_height);
-                    float w1y = (float)height / (float)(last_height);
-                    float w2y = (float)(height - y - 1) / (float)(last_height);
-                    int y0 = 2 * y - 1;
-                    int y1 = 2 * y;
-                    int y2 = 2 * y + 1;
-
-                    VLA(v_sum, float, num_channels);
-                    std::span<float> v_sum_span(v_sum, v_sum + num_channels);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] = 0.0f;
-                    VLA(v, float, num_channels);
-                    std::span<float> v_span(v, v + num_channels);
-
-                    if (y0 > 0) {
-                        fetch_as_float(x0, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * w0y * v_span[c];
-                        fetch_as_float(x1, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * w0y * v_span[c];
-                    }
-                    {
-                        fetch_as_float(x0, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * w1y * v_span[c];
-                        fetch_as_float(x1, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * w1y * v_span[c];
-                    }
-                    if (y2 < last_height) {
-                        fetch_as_float(x0, y2, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * w2y * v_span[c];
-                        fetch_as_float(x1, y2, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * w2y * v_span[c];
-                    }
-                    set_from_float(x, y, l, v_sum_span);
-                });
-            } else if (last_width > 1 && round_up_width && last_height > 1 && !round_up_height) {
-                parallel_tile_2d(width, height, [&](int x, int y) {
-                    float w0x = (float)x / (float)(last_width);
-                    float w1x = (float)width / (float)(last_width);
-                    float w2x = (float)(width - x - 1) / (float)(last_width);
-                    int x0 = 2 * x - 1;
-                    int x1 = 2 * x;
-                    int x2 = 2 * x + 1;
-                    constexpr float w0y = 0.5f;
-                    constexpr float w1y = 0.5f;
-                    int y0 = 2 * y;
-                    int y1 = 2 * y + 1;
-
-                    VLA(v_sum, float, num_channels);
-                    std::span<float> v_sum_span(v_sum, v_sum + num_channels);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] = 0.0f;
-                    VLA(v, float, num_channels);
-                    std::span<float> v_span(v, v + num_channels);
-
-                    if (x0 > 0) {
-                        fetch_as_float(x0, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * w0y * v_span[c];
-                    }
-                    {
-                        fetch_as_float(x1, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * w0y * v_span[c];
-                    }
-                    if (x2 < last_width) {
-                        fetch_as_float(x2, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w2x * w0y * v_span[c];
-                    }
-                    if (x0 > 0) {
-                        fetch_as_float(x0, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * w1y * v_span[c];
-                    }
-                    {
-                        fetch_as_float(x1, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * w1y * v_span[c];
-                    }
-                    if (x2 < last_width) {
-                        fetch_as_float(x2, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w2x * w1y * v_span[c];
-                    }
-                    set_from_float(x, y, l, v_sum_span);
-                });
-            } else if (last_width > 1 && !round_up_width && last_height > 1 && !round_up_height) {
-                parallel_tile_2d(width, height, [&](int x, int y) {
-                    int x0 = 2 * x;
-                    int x1 = 2 * x + 1;
-                    int y0 = 2 * y;
-                    int y1 = 2 * y + 1;
-
-                    VLA(v_sum, float, num_channels);
-                    std::span<float> v_sum_span(v_sum, v_sum + num_channels);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] = 0.0f;
-                    VLA(v, float, num_channels);
-                    std::span<float> v_span(v, v + num_channels);
-
-                    fetch_as_float(x0, y0, l - 1, v_span);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] += 0.25f * v_span[c];
-                    fetch_as_float(x1, y0, l - 1, v_span);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] += 0.25f * v_span[c];
-                    fetch_as_float(x0, y1, l - 1, v_span);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] += 0.25f * v_span[c];
-                    fetch_as_float(x1, y1, l - 1, v_span);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] += 0.25f * v_span[c];
-                    set_from_float(x, y, l, v_sum_span);
-                });
-            } else if (last_width == 1 && last_height > 1 && round_up_height) {
-                parallel_tile_2d(width, height, [&](int x, int y) {
-                    float w0y = (float)y / (float)(last_height);
-                    float w1y = (float)height / (float)(last_height);
-                    float w2y = (float)(height - y - 1) / (float)(last_height);
-                    int y0 = 2 * y - 1;
-                    int y1 = 2 * y;
-                    int y2 = 2 * y + 1;
-
-                    VLA(v_sum, float, num_channels);
-                    std::span<float> v_sum_span(v_sum, v_sum + num_channels);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] = 0.0f;
-                    VLA(v, float, num_channels);
-                    std::span<float> v_span(v, v + num_channels);
-
-                    if (y0 > 0) {
-                        fetch_as_float(x, y0, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0y * v_span[c];
-                    }
-                    {
-                        fetch_as_float(x, y1, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1y * v_span[c];
-                    }
-                    if (y2 < last_height) {
-                        fetch_as_float(x, y2, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w2y * v_span[c];
-                    }
-                    set_from_float(x, y, l, v_sum_span);
-                });
-            } else if (last_width == 1 && last_height > 1 && !round_up_height) {
-                parallel_tile_2d(width, height, [&](int x, int y) {
-                    int y0 = 2 * y;
-                    int y1 = 2 * y + 1;
-
-                    VLA(v_sum, float, num_channels);
-                    std::span<float> v_sum_span(v_sum, v_sum + num_channels);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] = 0.0f;
-                    VLA(v, float, num_channels);
-                    std::span<float> v_span(v, v + num_channels);
-
-                    fetch_as_float(x, y0, l - 1, v_span);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] += 0.5f * v_span[c];
-                    fetch_as_float(x, y1, l - 1, v_span);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] += 0.5f * v_span[c];
-                    set_from_float(x, y, l, v_sum_span);
-                });
-            } else if (last_width > 1 && round_up_width && last_height == 1) {
-                parallel_tile_2d(width, height, [&](int x, int y) {
-                    float w0x = (float)x / (float)(last_width);
-                    float w1x = (float)width / (float)(last_width);
-                    float w2x = (float)(width - x - 1) / (float)(last_width);
-                    int x0 = 2 * x - 1;
-                    int x1 = 2 * x;
-                    int x2 = 2 * x + 1;
-
-                    VLA(v_sum, float, num_channels);
-                    std::span<float> v_sum_span(v_sum, v_sum + num_channels);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] = 0.0f;
-                    VLA(v, float, num_channels);
-                    std::span<float> v_span(v, v + num_channels);
-
-                    if (x0 > 0) {
-                        fetch_as_float(x0, y, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w0x * v_span[c];
-                    }
-                    {
-                        fetch_as_float(x1, y, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w1x * v_span[c];
-                    }
-                    if (x2 < last_width) {
-                        fetch_as_float(x2, y, l - 1, v_span);
-                        for (int c = 0; c < num_channels; ++c)
-                            v_sum_span[c] += w2x * v_span[c];
-                    }
-                    set_from_float(x, y, l, v_sum_span);
-                });
-            } else if (last_width > 1 && !round_up_width && last_height == 1) {
-                parallel_tile_2d(width, height, [&](int x, int y) {
-                    int x0 = 2 * x;
-                    int x1 = 2 * x + 1;
-
-                    VLA(v_sum, float, num_channels);
-                    std::span<float> v_sum_span(v_sum, v_sum + num_channels);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] = 0.0f;
-                    VLA(v, float, num_channels);
-                    std::span<float> v_span(v, v + num_channels);
-
-                    fetch_as_float(x0, y, l - 1, v_span);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] += 0.5f * v_span[c];
-                    fetch_as_float(x1, y, l - 1, v_span);
-                    for (int c = 0; c < num_channels; ++c)
-                        v_sum_span[c] += 0.5f * v_span[c];
-                    set_from_float(x, y, l, v_sum_span);
-                });
-            }
-        }
-        width = std::max(1, (width + 1) / 2);
-        height = std::max(1, (height + 1) / 2);
+    bool parallel = width * height >= min_parallel_res;
+    vec2i res = storage_res(data_type, width, height);
+    mips.emplace_back(res.x(), res.y(), stride, bytes, 2, parallel);
+    if (build_mipmaps) {
+        std::vector<TextureMip> levels =
+            build_mips(bytes, width, height, num_channels, data_type, mip_filter);
+        std::move(levels.begin(), levels.end(), std::back_inserter(mips));
     }
 }
 
@@ -361,13 +77,14 @@ Texture::Texture(std::span<const std::byte *> mip_bytes, int width, int height,
                  TextureDataType data_type)
     : width(width), height(height), num_channels(num_channels), data_type(data_type)
 {
-    int stride = byte_stride(data_type) * num_channels;
+    int stride = texture_element_bytes(data_type, num_channels);
     int levels = (int)mip_bytes.size();
     mips.resize(levels);
     for (int i = 0; i < levels; ++i) {
         constexpr int min_parallel_res = 256 * 256;
         bool parallel = width * height >= min_parallel_res;
-        mips[i] = BlockedArray(width, height, stride, mip_bytes[i], 2, parallel);
+        vec2i res = storage_res(data_type, width, height);
+        mips[i] = TextureMip(res.x(), res.y(), stride, mip_bytes[i], 2, parallel);
         // Assuming rounding up.
         width = std::max(1, (width + 1) / 2);
         height = std::max(1, (height + 1) / 2);
@@ -376,9 +93,82 @@ Texture::Texture(std::span<const std::byte *> mip_bytes, int width, int height,
 
 // TODO: fixed-point math for 8bit textures
 // TODO: SIMD
+Texture::Texture(std::shared_ptr<const TiledTextureFile> tiled)
+    : width(tiled->width), height(tiled->height), num_channels(tiled->num_channels), data_type(tiled->data_type),
+      tiled(std::move(tiled))
+{}
+
+int Texture::levels() const { return tiled ? (int)tiled->levels.size() : (int)mips.size(); }
+
+// Rounding up, same as building mips.
+static int mip_dim(int dim, int level) { return std::max(1, (dim + (1 << level) - 1) >> level); }
+
+int Texture::level_width(int level) const
+{
+    if (tiled)
+        return tiled->levels[level].width;
+    return is_block_compressed(data_type) ? mip_dim(width, level) : mips[level].ures;
+}
+
+int Texture::level_height(int level) const
+{
+    if (tiled)
+        return tiled->levels[level].height;
+    return is_block_compressed(data_type) ? mip_dim(height, level) : mips[level].vres;
+}
+
+const std::byte *Texture::fetch_tiled(int x, int y, int level) const { return tiled->fetch(x, y, level); }
+
+// Decode the block containing (x, y). Consecutive fetches (e.g. a bilinear footprint) mostly hit the same block, so
+// the last decoded block of each thread is kept.
+// NOTE: keyed by the encoded bytes rather than the block address, which may be reused once a texture is freed.
+static const float *fetch_block_compressed(const std::byte *block, TextureDataType data_type, int x, int y)
+{
+    struct DecodedBlock
+    {
+        TextureDataType data_type = TextureDataType::u8;
+        std::array<std::byte, bc5_block_bytes> encoded{};
+        float texels[16][3];
+    };
+    static thread_local DecodedBlock decoded;
+    int block_bytes = data_type == TextureDataType::bc5 ? bc5_block_bytes : bc1_block_bytes;
+    if (decoded.data_type != data_type || std::memcmp(decoded.encoded.data(), block, block_bytes) != 0) {
+        switch (data_type) {
+        case TextureDataType::bc1: {
+            decode_bc1_block(block, decoded.texels);
+            break;
+        }
+        case TextureDataType::bc4: {
+            float r[16];
+            decode_bc4_block(block, r);
+            for (int i = 0; i < 16; ++i)
+                decoded.texels[i][0] = r[i];
+            break;
+        }
+        case TextureDataType::bc5:
+        default: {
+            float rg[16][2];
+            decode_bc5_block(block, rg);
+            for (int i = 0; i < 16; ++i)
+                std::copy_n(rg[i], 2, decoded.texels[i]);
+            break;
+        }
+        }
+        decoded.data_type = data_type;
+        std::copy_n(block, block_bytes, decoded.encoded.data());
+    }
+    return decoded.texels[(y & 3) * 4 + (x & 3)];
+}
+
 void Texture::fetch_as_float(int x, int y, int level, std::span<float> out) const
 {
     const std::byte *bytes = fetch_raw(x, y, level);
+    if (is_block_compressed(data_type)) {
+        const float *texel = fetch_block_compressed(bytes, data_type, x, y);
+        int nc = std::min(num_channels, (int)out.size());
+        std::copy(texel, texel + nc, out.data());
+        return;
+    }
     switch (data_type) {
     case TextureDataType::u8: {
         const uint8_t *u8_data = reinterpret_cast<const uint8_t *>(bytes);
@@ -388,6 +178,14 @@ void Texture::fetch_as_float(int x, int y, int level, std::span<float> out) cons
         }
         break;
     }
+    case TextureDataType::f16: {
+        const uint16_t *f16_data = reinterpret_cast<const uint16_t *>(bytes);
+        int nc = std::min(num_channels, (int)out.size());
+        for (int c = 0; c < nc; ++c) {
+            out[c] = half_to_float(f16_data[c]);
+        }
+        break;
+    }
     case TextureDataType::f32:
     default: {
         const float *f32_data = reinterpret_cast<const float *>(bytes);
@@ -398,9 +196,85 @@ void Texture::fetch_as_float(int x, int y, int level, std::span<float> out) cons
     }
 }
 
+template <TextureDataType data_type>
+static float texel_channel_to_float(const std::byte *texel, int c)
+{
+    if constexpr (data_type == TextureDataType::u8) {
+        return (float)reinterpret_cast<const uint8_t *>(texel)[c] / 255.0f;
+    } else if constexpr (data_type == TextureDataType::f16) {
+        return half_to_float(reinterpret_cast<const uint16_t *>(texel)[c]);
+    } else {
+        return reinterpret_cast<const float *>(texel)[c];
+    }
+}
+
+template <TextureDataType data_type, int num_channels>
+static void fetch_quad_typed(const TextureMip &mip, int x0, int y0, int x1, int y1, int nc, float *out)
+{
+    constexpr int stride = (data_type == TextureDataType::u8 ? 1 : (data_type == TextureDataType::f16 ? 2 : 4)) *
+                           num_channels;
+    std::array<const std::byte *, 4> quad = mip.fetch_quad<stride>(x0, y0, x1, y1);
+    for (int i = 0; i < 4; ++i) {
+        for (int c = 0; c < nc; ++c)
+            out[i * nc + c] = texel_channel_to_float<data_type>(quad[i], c);
+    }
+}
+
+template <TextureDataType data_type>
+static bool fetch_quad_dispatch(const TextureMip &mip, int num_channels, int x0, int y0, int x1, int y1, int nc,
+                                float *out)
+{
+    switch (num_channels) {
+    case 1:
+        fetch_quad_typed<data_type, 1>(mip, x0, y0, x1, y1, nc, out);
+        return true;
+    case 2:
+        fetch_quad_typed<data_type, 2>(mip, x0, y0, x1, y1, nc, out);
+        return true;
+    case 3:
+        fetch_quad_typed<data_type, 3>(mip, x0, y0, x1, y1, nc, out);
+        return true;
+    case 4:
+        fetch_quad_typed<data_type, 4>(mip, x0, y0, x1, y1, nc, out);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void Texture::fetch_quad_as_float(int x0, int y0, int x1, int y1, int level, std::span<float> out) const
+{
+    int nc = std::min(num_channels, (int)out.size() / 4);
+    if (!tiled) {
+        const TextureMip &mip = mips[level];
+        bool done = false;
+        switch (data_type) {
+        case TextureDataType::u8:
+            done = fetch_quad_dispatch<TextureDataType::u8>(mip, num_channels, x0, y0, x1, y1, nc, out.data());
+            break;
+        case TextureDataType::f16:
+            done = fetch_quad_dispatch<TextureDataType::f16>(mip, num_channels, x0, y0, x1, y1, nc, out.data());
+            break;
+        case TextureDataType::f32:
+            done = fetch_quad_dispatch<TextureDataType::f32>(mip, num_channels, x0, y0, x1, y1, nc, out.data());
+            break;
+        default:
+            break;
+        }
+        if (done)
+            return;
+    }
+    fetch_as_float(x0, y0, level, out.subspan(0, nc));
+    fetch_as_float(x1, y0, level, out.subspan(nc, nc));
+    fetch_as_float(x0, y1, level, out.subspan(2 * nc, nc));
+    fetch_as_float(x1, y1, level, out.subspan(3 * nc, nc));
+}
+
 void Texture::set_from_float(int x, int y, int level, std::span<const float> in)
 {
     ASSERT(in.size() == num_channels);
+    ASSERT(!tiled, "Tiled textures are read-only.");
+    ASSERT(!is_block_compressed(data_type), "Block-compressed textures are read-only (see convert_texture).");
     std::byte *bytes = mips[level].fetch_multi(x, y);
     switch (data_type) {
     case TextureDataType::u8: {
@@ -410,6 +284,13 @@ void Texture::set_from_float(int x, int y, int level, std::span<const float> in)
         }
         break;
     }
+    case TextureDataType::f16: {
+        uint16_t *f16_data = reinterpret_cast<uint16_t *>(bytes);
+        for (int c = 0; c < num_channels; ++c) {
+            f16_data[c] = float_to_half(in[c]);
+        }
+        break;
+    }
     case TextureDataType::f32:
     default: {
         float *f32_data = reinterpret_cast<float *>(bytes);
@@ -442,20 +323,28 @@ color4 TextureSampler::operator()(const Texture &texture, const vec2 &uv, const
 
 void NearestSampler::operator()(const Texture &texture, const vec2 &uv, const mat2 &duvdxy, std::span<float> out) const
 {
-    float u = uv[0] * texture.mips[0].ures - 0.5f;
-    float v = uv[1] * texture.mips[0].vres - 0.5f;
+    stat_texture_lookups.add();
+    float u = uv[0] * texture.level_width(0) - 0.5f;
+    float v = uv[1] * texture.level_height(0) - 0.5f;
     int u0 = (int)std::floor(u);
     int v0 = (int)std::floor(v);
-    u0 = wrap(u0, texture.mips[0].ures, wrap_mode_u);
-    v0 = wrap(v0, texture.mips[0].vres, wrap_mode_v);
+    u0 = wrap(u0, texture.level_width(0), wrap_mode_u);
+    v0 = wrap(v0, texture.level_height(0), wrap_mode_v);
 
     texture.fetch_as_float(u0, v0, 0, out);
 }
 
+// Continuous mip level for a footprint of the given width in uv space.
+static float mip_level(const Texture &texture, float width)
+{
+    float texels = width * (float)std::max(texture.level_width(0), texture.level_height(0));
+    return std::log2(std::max(texels, (float)1e-8));
+}
+
 void LinearSampler::operator()(const Texture &texture, const vec2 &uv, const mat2 &duvdxy, std::span<float> out) const
 {
-    float width = duvdxy.cwiseAbs().maxCoeff();
-    float level = texture.levels() - 1 + std::log2(std::max(width, (float)1e-8));
+    stat_texture_lookups.add();
+    float level = mip_level(texture, duvdxy.cwiseAbs().maxCoeff());
     if (level < 0 || texture.levels() == 1) {
         bilinear(texture, 0, uv, out);
     } else if (level >= texture.levels() - 1) {
@@ -475,17 +364,17 @@ void LinearSampler::operator()(const Texture &texture, const vec2 &uv, const mat
 
 void LinearSampler::bilinear(const Texture &texture, int level, const vec2 &uv, std::span<float> out) const
 {
-    float u = uv[0] * texture.mips[level].ures - 0.5f;
-    float v = uv[1] * texture.mips[level].vres - 0.5f;
+    float u = uv[0] * texture.level_width(level) - 0.5f;
+    float v = uv[1] * texture.level_height(level) - 0.5f;
     int u0 = (int)std::floor(u);
     int v0 = (int)std::floor(v);
     float du = u - u0;
     float dv = v - v0;
 
-    u0 = wrap(u0, texture.mips[level].ures, wrap_mode_u);
-    v0 = wrap(v0, texture.mips[level].vres, wrap_mode_v);
-    int u1 = wrap(u0 + 1, texture.mips[level].ures, wrap_mode_u);
-    int v1 = wrap(v0 + 1, texture.mips[level].vres, wrap_mode_v);
+    u0 = wrap(u0, texture.level_width(level), wrap_mode_u);
+    v0 = wrap(v0, texture.level_height(level), wrap_mode_v);
+    int u1 = wrap(u0 + 1, texture.level_width(level), wrap_mode_u);
+    int v1 = wrap(v0 + 1, texture.level_height(level), wrap_mode_v);
 
     float w00 = (1 - du) * (1 - dv);
     float w10 = du * (1 - dv);
@@ -494,23 +383,132 @@ void LinearSampler::bilinear(const Texture &texture, int level, const vec2 &uv,
 
     size_t nc = std::min((size_t)texture.num_channels, out.size());
 
-    VLA(out00, float, nc);
-    texture.fetch_as_float(u0, v0, level, {out00, nc});
-    VLA(out10, float, nc);
-    texture.fetch_as_float(u1, v0, level, {out10, nc});
-    VLA(out01, float, nc);
-    texture.fetch_as_float(u0, v1, level, {out01, nc});
-    VLA(out11, float, nc);
-    texture.fetch_as_float(u1, v1, level, {out11, nc});
+    VLA(quad, float, 4 * nc);
+    texture.fetch_quad_as_float(u0, v0, u1, v1, level, {quad, 4 * nc});
+    const float *out00 = quad;
+    const float *out10 = quad + nc;
+    const float *out01 = quad + 2 * nc;
+    const float *out11 = quad + 3 * nc;
 
     for (int i = 0; i < nc; ++i)
         out[i] = w00 * out00[i] + w10 * out10[i] + w01 * out01[i] + w11 * out11[i];
 }
 
+template <TextureDataType data_type, int nc>
+static void fetch_texel_typed(const Texture &texture, int x, int y, int level, float *out)
+{
+    const std::byte *texel = texture.mips[level].fetch_multi(x, y);
+    for (int c = 0; c < nc; ++c)
+        out[c] = texel_channel_to_float<data_type>(texel, c);
+}
+
+template <TextureDataType data_type, int nc>
+static void nearest_lookup(const TextureSampler &sampler, const Texture &texture, const vec2 &uv, const mat2 &duvdxy,
+                           float *out)
+{
+    stat_texture_lookups.add();
+    int width = texture.level_width(0);
+    int height = texture.level_height(0);
+    float u = uv[0] * width - 0.5f;
+    float v = uv[1] * height - 0.5f;
+    int u0 = wrap((int)std::floor(u), width, sampler.wrap_mode_u);
+    int v0 = wrap((int)std::floor(v), height, sampler.wrap_mode_v);
+    fetch_texel_typed<data_type, nc>(texture, u0, v0, 0, out);
+}
+
+// Same as LinearSampler::bilinear.
+template <TextureDataType data_type, int nc>
+static void bilinear_typed(const TextureSampler &sampler, const Texture &texture, int level, const vec2 &uv,
+                           float *out)
+{
+    int width = texture.level_width(level);
+    int height = texture.level_height(level);
+    float u = uv[0] * width - 0.5f;
+    float v = uv[1] * height - 0.5f;
+    int u0 = (int)std::floor(u);
+    int v0 = (int)std::floor(v);
+    float du = u - u0;
+    float dv = v - v0;
+
+    u0 = wrap(u0, width, sampler.wrap_mode_u);
+    v0 = wrap(v0, height, sampler.wrap_mode_v);
+    int u1 = wrap(u0 + 1, width, sampler.wrap_mode_u);
+    int v1 = wrap(v0 + 1, height, sampler.wrap_mode_v);
+
+    float w00 = (1 - du) * (1 - dv);
+    float w10 = du * (1 - dv);
+    float w01 = (1 - du) * dv;
+    float w11 = du * dv;
+
+    float quad[4 * nc];
+    fetch_quad_typed<data_type, nc>(texture.mips[level], u0, v0, u1, v1, nc, quad);
+    for (int i = 0; i < nc; ++i)
+        out[i] = w00 * quad[i] + w10 * quad[nc + i] + w01 * quad[2 * nc + i] + w11 * quad[3 * nc + i];
+}
+
+// Same as LinearSampler::operator().
+template <TextureDataType data_type, int nc>
+static void linear_lookup(const TextureSampler &sampler, const Texture &texture, const vec2 &uv, const mat2 &duvdxy,
+                          float *out)
+{
+    stat_texture_lookups.add();
+    float level = mip_level(texture, duvdxy.cwiseAbs().maxCoeff());
+    int levels = (int)texture.mips.size();
+    if (level < 0 || levels == 1) {
+        bilinear_typed<data_type, nc>(sampler, texture, 0, uv, out);
+    } else if (level >= levels - 1) {
+        fetch_texel_typed<data_type, nc>(texture, 0, 0, levels - 1, out);
+    } else {
+        int ilevel = (int)std::floor(level);
+        float delta = level - ilevel;
+        float out0[nc];
+        bilinear_typed<data_type, nc>(sampler, texture, ilevel, uv, out0);
+        float out1[nc];
+        bilinear_typed<data_type, nc>(sampler, texture, ilevel + 1, uv, out1);
+        for (int i = 0; i < nc; ++i)
+            out[i] = std::lerp(out0[i], out1[i], delta);
+    }
+}
+
+template <TextureDataType data_type>
+static TextureLookup resolve_texture_lookup_typed(bool linear, int num_channels)
+{
+    switch (num_channels) {
+    case 1:
+        return linear ? linear_lookup<data_type, 1> : nearest_lookup<data_type, 1>;
+    case 2:
+        return linear ? linear_lookup<data_type, 2> : nearest_lookup<data_type, 2>;
+    case 3:
+        return linear ? linear_lookup<data_type, 3> : nearest_lookup<data_type, 3>;
+    case 4:
+        return linear ? linear_lookup<data_type, 4> : nearest_lookup<data_type, 4>;
+    default:
+        return nullptr;
+    }
+}
+
+TextureLookup resolve_texture_lookup(const TextureSampler &sampler, const Texture &texture)
+{
+    bool linear = dynamic_cast<const LinearSampler *>(&sampler) != nullptr;
+    bool nearest = dynamic_cast<const NearestSampler *>(&sampler) != nullptr;
+    if (!(linear || nearest) || texture.tiled || texture.mips.empty())
+        return nullptr;
+    switch (texture.data_type) {
+    case TextureDataType::u8:
+        return resolve_texture_lookup_typed<TextureDataType::u8>(linear, texture.num_channels);
+    case TextureDataType::f16:
+        return resolve_texture_lookup_typed<TextureDataType::f16>(linear, texture.num_channels);
+    case TextureDataType::f32:
+        return resolve_texture_lookup_typed<TextureDataType::f32>(linear, texture.num_channels);
+    default:
+        return nullptr;
+    }
+}
+
 void CubicSampler::operator()(const Texture &texture, const vec2 &uv, const mat2 &duvdxy, std::span<float> out) const
 {
-    float width = duvdxy.cwiseAbs().maxCoeff();
-    float level = texture.levels() - 1 + std::log2(std::max(width, (float)1e-8));
+    stat_texture_lookups.add();
+    float level = mip_level(texture, duvdxy.cwiseAbs().maxCoeff());
     if (level < 0 || texture.levels() == 1) {
         bicubic(texture, 0, uv, out);
     } else if (level >= texture.levels() - 1) {
@@ -544,8 +542,8 @@ inline void spline(float x, int nc, const float *c0, const float *c1, const floa
 
 void CubicSampler::bicubic(const Texture &texture, int level, const vec2 &uv, std::span<float> out) const
 {
-    float u = uv[0] * texture.mips[level].ures - 0.5f;
-    float v = uv[1] * texture.mips[level].vres - 0.5f;
+    float u = uv[0] * texture.level_width(level) - 0.5f;
+    float v = uv[1] * texture.level_height(level) - 0.5f;
     int u0 = (int)std::floor(u);
     int v0 = (int)std::floor(v);
     float du = u - u0;
@@ -554,8 +552,8 @@ void CubicSampler::bicubic(const Texture &texture, int level, const vec2 &uv, st
     vec4i us;
     vec4i vs;
     for (int i = 0; i < 4; ++i) {
-        us[i] = wrap(u0 + i - 1, texture.mips[level].ures, wrap_mode_u);
-        vs[i] = wrap(v0 + i - 1, texture.mips[level].vres, wrap_mode_v);
+        us[i] = wrap(u0 + i - 1, texture.level_width(level), wrap_mode_u);
+        vs[i] = wrap(v0 + i - 1, texture.level_height(level), wrap_mode_v);
     }
 
     size_t nc = std::min((size_t)texture.num_channels, out.size());
@@ -578,92 +576,233 @@ void CubicSampler::bicubic(const Texture &texture, int level, const vec2 &uv, st
     spline(dv, nc, c0, c1, c2, c3, ca, cb, out.data());
 }
 
+EWASampler::EWASampler(float max_anisotropy) : max_anisotropy(max_anisotropy)
+{
+    constexpr float alpha = 2.0f;
+    for (int i = 0; i < weight_lut_size; ++i) {
+        float r2 = (float)i / (float)(weight_lut_size - 1);
+        weight_lut[i] = std::exp(-alpha * r2) - std::exp(-alpha);
+    }
+}
+
+void EWASampler::operator()(const Texture &texture, const vec2 &uv, const mat2 &duvdxy, std::span<float> out) const
+{
+    stat_texture_lookups.add();
+    // Rows of duvdxy are the uv derivatives along screen x and y: the conjugate radii of the ellipse.
+    vec2 dst0 = duvdxy.row(0).transpose();
+    vec2 dst1 = duvdxy.row(1).transpose();
+    if (dst0.squaredNorm() < dst1.squaredNorm())
+        std::swap(dst0, dst1);
+    float major = dst0.norm();
+    float minor = dst1.norm();
+    if (minor * max_anisotropy < major && minor > 0.0f) {
+        float scale = major / (minor * max_anisotropy);
+        dst1 *= scale;
+        minor *= scale;
+    }
+    if (minor == 0.0f || texture.levels() == 1) {
+        // No coarser level to move to, so a grazing or minified footprint could cover the whole texture. Clamp the
+        // ellipse to max_anisotropy texels of level 0 to bound the cost (at the price of some aliasing).
+        float texels = major * (float)std::max(texture.level_width(0), texture.level_height(0));
+        if (texels > max_anisotropy) {
+            float scale = max_anisotropy / texels;
+            dst0 *= scale;
+            dst1 *= scale;
+        }
+        ewa(texture, 0, uv, dst0, dst1, out);
+        return;
+    }
+
+    float level = std::max(mip_level(texture, minor), 0.0f);
+    if (level >= texture.levels() - 1) {
+        texture.fetch_as_float(0, 0, texture.levels() - 1, out);
+        return;
+    }
+    int ilevel = (int)std::floor(level);
+    float delta = level - ilevel;
+    size_t nc = std::min((size_t)texture.num_channels, out.size());
+    VLA(out0, float, nc);
+    ewa(texture, ilevel, uv, dst0, dst1, {out0, nc});
+    VLA(out1, float, nc);
+    ewa(texture, ilevel + 1, uv, dst0, dst1, {out1, nc});
+    for (int i = 0; i < nc; ++i)
+        out[i] = std::lerp(out0[i], out1[i], delta);
+}
+
+void EWASampler::ewa(const Texture &texture, int level, const vec2 &uv, vec2 dst0, vec2 dst1,
+                     std::span<float> out) const
+{
+    int w = texture.level_width(level);
+    int h = texture.level_height(level);
+    float s = uv[0] * w - 0.5f;
+    float t = uv[1] * h - 0.5f;
+    dst0 = dst0.cwiseProduct(vec2(w, h));
+    dst1 = dst1.cwiseProduct(vec2(w, h));
+
+    // Implicit ellipse A s^2 + B s t + C t^2 < 1. Adding 1 makes the ellipse cover at least one texel.
+    float A = sqr(dst0[1]) + sqr(dst1[1]) + 1.0f;
+    float B = -2.0f * (dst0[0] * dst0[1] + dst1[0] * dst1[1]);
+    float C = sqr(dst0[0]) + sqr(dst1[0]) + 1.0f;
+    float inv_f = 1.0f / (A * C - B * B * 0.25f);
+    A *= inv_f;
+    B *= inv_f;
+    C *= inv_f;
+
+    float det = -B * B + 4.0f * A * C;
+    float inv_det = 1.0f / det;
+    float u_sqrt = std::sqrt(det * C);
+    float v_sqrt = std::sqrt(A * det);
+    int s0 = (int)std::ceil(s - 2.0f * inv_det * u_sqrt);
+    int s1 = (int)std::floor(s + 2.0f * inv_det * u_sqrt);
+    int t0 = (int)std::ceil(t - 2.0f * inv_det * v_sqrt);
+    int t1 = (int)std::floor(t + 2.0f * inv_det * v_sqrt);
+
+    size_t nc = std::min((size_t)texture.num_channels, out.size());
+    VLA(texel, float, nc);
+    std::fill_n(out.data(), nc, 0.0f);
+    float sum_weights = 0.0f;
+    for (int it = t0; it <= t1; ++it) {
+        float tt = it - t;
+        int y = wrap(it, h, wrap_mode_v);
+        for (int is = s0; is <= s1; ++is) {
+            float ss = is - s;
+            float r2 = A * ss * ss + B * ss * tt + C * tt * tt;
+            if (r2 >= 1.0f)
+                continue;
+            float weight = weight_lut[std::min((int)(r2 * weight_lut_size), weight_lut_size - 1)];
+            texture.fetch_as_float(wrap(is, w, wrap_mode_u), y, level, {texel, nc});
+            for (int i = 0; i < nc; ++i)
+                out[i] += weight * texel[i];
+            sum_weights += weight;
+        }
+    }
+    if (sum_weights > 0.0f) {
+        for (int i = 0; i < nc; ++i)
+            out[i] /= sum_weights;
+    }
+}
+
 std::unique_ptr<Texture> create_texture_from_image(int ch, bool build_mipmaps, ColorSpace src_colorspace,
-                                                   const fs::path &path)
+                                                   const fs::path &path, MipFilter mip_filter)
 {
     std::string ext = path.extension().string();
     int width, height;
-    TextureDataType data_type;
-    std::unique_ptr<float[]> float_data;
-    std::unique_ptr<std::byte[]> byte_data;
-    const std::byte *ptr = nullptr;
     if (ext == ".exr") {
-        float_data = load_from_exr(path, ch, width, height);
-        data_type = TextureDataType::f32;
-    } else if (ext == ".hdr") {
-        float_data = load_from_hdr(path, ch, width, height);
-        data_type = TextureDataType::f32;
+        std::unique_ptr<float[]> float_data = load_from_exr(path, ch, width, height);
+        return std::make_unique<Texture>(reinterpret_cast<const std::byte *>(float_data.get()), width, height, ch,
+                                         TextureDataType::f32, build_mipmaps, mip_filter);
+    }
+    std::unique_ptr<DecodedImage> image = decode_image(path, ch);
+    width = image->width;
+    height = image->height;
+    TextureDataType data_type = image->hdr() ? TextureDataType::f32 : TextureDataType::u8;
+    TexelConversion conversion(image->channels, ch, image->hdr() ? ColorSpace::Linear : src_colorspace);
+    if (!build_mipmaps) {
+        // Converted straight into the blocks of the only level.
+        std::unique_ptr<Texture> texture = std::make_unique<Texture>(width, height, ch, data_type);
+        if (image->hdr())
+            convert_image_to_blocked<float>(*image, texture->mips[0], conversion);
+        else
+            convert_image_to_blocked<uint8_t>(*image, texture->mips[0], conversion);
+        return texture;
+    }
+    // Mips are built from level 0 in row-major order. Converted in place in the decoded image if the texel size
+    // doesn't change.
+    std::unique_ptr<std::byte[]> converted;
+    const std::byte *ptr = nullptr;
+    bool in_place = image->channels == ch;
+    if (image->hdr()) {
+        if (!in_place) {
+            converted = std::make_unique<std::byte[]>((size_t)width * height * ch * sizeof(float));
+            convert_image(*image, reinterpret_cast<float *>(converted.get()), conversion);
+        }
+        ptr = converted ? converted.get() : reinterpret_cast<const std::byte *>(image->f32);
     } else {
-        byte_data = load_from_ldr(path, ch, width, height, src_colorspace);
-        data_type = TextureDataType::u8;
+        if (in_place) {
+            if (src_colorspace != ColorSpace::Linear)
+                convert_image(*image, image->u8, conversion);
+        } else {
+            converted = std::make_unique<std::byte[]>((size_t)width * height * ch);
+            convert_image(*image, reinterpret_cast<uint8_t *>(converted.get()), conversion);
+        }
+        ptr = converted ? converted.get() : reinterpret_cast<const std::byte *>(image->u8);
     }
-    ptr = float_data ? reinterpret_cast<const std::byte *>(float_data.get()) : byte_data.get();
-    return std::make_unique<Texture>(ptr, width, height, ch, data_type, build_mipmaps);
+    return std::make_unique<Texture>(ptr, width, height, ch, data_type, build_mipmaps, mip_filter);
 }
 
 // We use lz4 to compress serialized textures for smaller file size and fast decompress speed.
 
+// Legacy format: the whole image in a single buffer (see write_lz4_compressed). Still readable.
 constexpr const char *serialized_texture_magic = "i_am_a_serialized_texture";
+// Streamed format: small lz4 blocks (see write_lz4_stream) gathered from/scattered to the mips directly.
+constexpr const char *streamed_texture_magic = "i_am_a_streamed_tex_image";
+static_assert(std::string_view(serialized_texture_magic).size() == std::string_view(streamed_texture_magic).size());
+
+// Mip levels are concatenated in row-major order. Copies the bytes [offset, offset + size) of that layout between
+// linear and the mips.
+template <bool to_mips>
+static void copy_mip_bytes(std::conditional_t<to_mips, std::vector<TextureMip>,
+                                              const std::vector<TextureMip>> &mips,
+                           std::span<const size_t> level_offsets, size_t offset, size_t size,
+                           std::conditional_t<to_mips, const std::byte *, std::byte *> linear)
+{
+    size_t end = offset + size;
+    int level = int(std::upper_bound(level_offsets.begin(), level_offsets.end(), offset) - level_offsets.begin()) - 1;
+    for (; offset < end; ++level) {
+        auto &mip = mips[level];
+        size_t level_end = std::min(end, level_offsets[level + 1]);
+        while (offset < level_end) {
+            size_t local = offset - level_offsets[level];
+            size_t texel = local / mip.stride;
+            size_t byte = local % mip.stride;
+            size_t n = std::min(mip.stride - byte, level_end - offset);
+            auto *ptr = mip.fetch_multi(int(texel % mip.ures), int(texel / mip.ures)) + byte;
+            if constexpr (to_mips) {
+                std::copy_n(linear, n, ptr);
+            } else {
+                std::copy_n(ptr, n, linear);
+            }
+            linear += n;
+            offset += n;
+        }
+    }
+}
+
+static std::vector<size_t> mip_level_offsets(int width, int height, int levels, TextureDataType data_type,
+                                             int num_channels)
+{
+    std::vector<size_t> offsets(levels + 1);
+    int stride = texture_element_bytes(data_type, num_channels);
+    int w = width;
+    int h = height;
+    for (int l = 0; l < levels; ++l) {
+        vec2i res = storage_res(data_type, w, h);
+        offsets[l + 1] = offsets[l] + (size_t)res.x() * res.y() * stride;
+        w = std::max(1, (w + 1) / 2);
+        h = std::max(1, (h + 1) / 2);
+    }
+    return offsets;
+}
 
 void write_texture_to_serialized(const Texture &texture, const fs::path &path)
 {
+    ASSERT(!texture.tiled, "Tiled textures can't be serialized again.");
     BinaryWriter writer(path);
-    writer.write_array<char>(serialized_texture_magic, strlen(serialized_texture_magic));
+    writer.write_array<char>(streamed_texture_magic, strlen(streamed_texture_magic));
     writer.write<int>(texture.width);
     writer.write<int>(texture.height);
     writer.write<int>(texture.num_channels);
     writer.write<TextureDataType>(texture.data_type);
     int levels = (int)texture.levels();
     writer.write<int>(levels);
-    size_t total_size = 0;
-    int w = texture.width;
-    int h = texture.height;
-    int stride = byte_stride(texture.data_type) * texture.num_channels;
-    for (int l = 0; l < levels; ++l) {
-        total_size += w * h * stride;
-        w = std::max(1, (w + 1) / 2);
-        h = std::max(1, (h + 1) / 2);
-    }
+    std::vector<size_t> level_offsets =
+        mip_level_offsets(texture.width, texture.height, levels, texture.data_type, texture.num_channels);
+    size_t total_size = level_offsets.back();
     writer.write<size_t>(total_size);
 
-    std::unique_ptr<std::byte[]> buf = std::make_unique<std::byte[]>(total_size);
-    w = texture.width;
-    h = texture.height;
-    size_t offset = 0;
-    for (int l = 0; l < levels; ++l) {
-        texture.mips[l].copy_to_linear_array(buf.get() + offset);
-        offset += w * h * stride;
-        w = std::max(1, (w + 1) / 2);
-        h = std::max(1, (h + 1) / 2);
-    }
-
-    // LZ4_MAX_INPUT_SIZE is ~2GB. For super high-res textures we need to split the data into blocks.
-    int num_blocks = (int)std::ceil((double)total_size / double(LZ4_MAX_INPUT_SIZE));
-    writer.write<int>(num_blocks);
-
-    offset = 0;
-    size_t total_compressed_capacity = 0;
-    for (int block = 0; block < num_blocks; ++block) {
-        size_t block_size = std::min(size_t(LZ4_MAX_INPUT_SIZE), total_size - offset);
-        total_compressed_capacity += LZ4_compressBound((int)block_size);
-        offset += block_size;
-    }
-    std::unique_ptr<std::byte[]> compressed_buf = std::make_unique<std::byte[]>(total_compressed_capacity);
-    offset = 0;
-    size_t compressed_offset = 0;
-    for (int block = 0; block < num_blocks; ++block) {
-        size_t block_size = std::min(size_t(LZ4_MAX_INPUT_SIZE), total_size - offset);
-        int compressed_block_capacity = LZ4_compressBound((int)block_size);
-        int compressed_block_size =
-            LZ4_compress_default((const char *)(buf.get() + offset), (char *)(compressed_buf.get() + compressed_offset),
-                                 (int)block_size, compressed_block_capacity);
-        ASSERT(compressed_block_size > 0, "lz4 compression failed.");
-        writer.write<int>(compressed_block_size);
-        compressed_offset += compressed_block_size;
-        offset += block_size;
-    }
-    size_t total_compressed_size = compressed_offset;
-    writer.write_array<std::byte>(compressed_buf.get(), total_compressed_size);
+    write_lz4_stream(writer, total_size, [&](size_t offset, size_t size, std::byte *dest) {
+        copy_mip_bytes<false>(texture.mips, level_offsets, offset, size, dest);
+    });
 }
 
 std::unique_ptr<Texture> create_texture_from_serialized(const fs::path &path)
@@ -672,7 +811,8 @@ std::unique_ptr<Texture> create_texture_from_serialized(const fs::path &path)
     std::array<char, std::string_view(serialized_texture_magic).size() + 1> magic;
     reader.read_array<char>(magic.data(), magic.size() - 1);
     magic.back() = 0;
-    if (strcmp(magic.data(), serialized_texture_magic)) {
+    bool streamed = !strcmp(magic.data(), streamed_texture_magic);
+    if (!streamed && strcmp(magic.data(), serialized_texture_magic)) {
         ASSERT(false, "Invalid serialized texture.");
         return nullptr;
     }
@@ -682,50 +822,152 @@ std::unique_ptr<Texture> create_texture_from_serialized(const fs::path &path)
     TextureDataType data_type = reader.read<TextureDataType>();
     int levels = reader.read<int>();
     size_t total_size = reader.read<size_t>();
-    int num_blocks = reader.read<int>();
-    std::vector<int> compressed_block_sizes(num_blocks);
-    size_t total_compressed_size = 0;
-    for (int block = 0; block < num_blocks; ++block) {
-        compressed_block_sizes[block] = reader.read<int>();
-        total_compressed_size += compressed_block_sizes[block];
-    }
-    //
-    std::unique_ptr<std::byte[]> compressed_buf = std::make_unique<std::byte[]>(total_compressed_size);
-    reader.read_array<std::byte>(compressed_buf.get(), total_compressed_size);
-    std::unique_ptr<std::byte[]> buf = std::make_unique<std::byte[]>(total_size);
-    // LZ4_MAX_INPUT_SIZE is ~2GB. For super high-res textures we need to split the data into blocks.
-    size_t offset = 0;
-    size_t compressed_offset = 0;
-    for (int block = 0; block < num_blocks; ++block) {
-        size_t block_size = std::min(size_t(LZ4_MAX_INPUT_SIZE), total_size - offset);
-        int ret = LZ4_decompress_safe((const char *)(compressed_buf.get() + compressed_offset),
-                                      (char *)(buf.get() + offset), compressed_block_sizes[block], (int)block_size);
-        ASSERT(ret > 0, "lz4 decompression failed.");
-        offset += block_size;
-        compressed_offset += compressed_block_sizes[block];
-    }
-    // compressed_buf can be released now.
-    compressed_buf.reset();
-
-    std::vector<const std::byte *> mip_bytes(levels);
+    int stride = texture_element_bytes(data_type, num_channels);
+    std::vector<size_t> level_offsets = mip_level_offsets(width, height, levels, data_type, num_channels);
+    ASSERT(level_offsets.back() == total_size, "Corrupted serialized texture.");
+
+    if (!streamed) {
+        std::unique_ptr<std::byte[]> buf = std::make_unique<std::byte[]>(total_size);
+        read_lz4_compressed(reader, buf.get(), total_size);
+        std::vector<const std::byte *> mip_bytes(levels);
+        for (int l = 0; l < levels; ++l) {
+            mip_bytes[l] = buf.get() + level_offsets[l];
+        }
+        return std::make_unique<Texture>(mip_bytes, width, height, num_channels, data_type);
+    }
+
+    std::unique_ptr<Texture> texture = std::make_unique<Texture>();
+    texture->width = width;
+    texture->height = height;
+    texture->num_channels = num_channels;
+    texture->data_type = data_type;
+    texture->mips.resize(levels);
     int w = width;
     int h = height;
-    int stride = byte_stride(data_type) * num_channels;
-    offset = 0;
     for (int l = 0; l < levels; ++l) {
-        mip_bytes[l] = buf.get() + offset;
-        offset += w * h * stride;
+        vec2i res = storage_res(data_type, w, h);
+        texture->mips[l] = TextureMip(res.x(), res.y(), stride);
         w = std::max(1, (w + 1) / 2);
         h = std::max(1, (h + 1) / 2);
     }
-    return std::make_unique<Texture>(mip_bytes, width, height, num_channels, data_type);
+    read_lz4_stream(reader, total_size, [&](size_t offset, size_t size, const std::byte *src) {
+        copy_mip_bytes<true>(texture->mips, level_offsets, offset, size, src);
+    });
+    return texture;
+}
+
+std::unique_ptr<Texture> create_texture_from_tiled(const fs::path &path)
+{
+    return std::make_unique<Texture>(std::make_shared<const TiledTextureFile>(path));
+}
+
+std::unique_ptr<Texture> convert_texture(const Texture &texture, TextureDataType data_type)
+{
+    ASSERT(!is_block_compressed(texture.data_type), "Can't convert from block-compressed textures.");
+    int num_channels = texture.num_channels;
+    if (is_block_compressed(data_type)) {
+        int block_channels = data_type == TextureDataType::bc1 ? 3 : (data_type == TextureDataType::bc4 ? 1 : 2);
+        ASSERT(num_channels >= block_channels, "Not enough channels for the block-compressed type.");
+        if (num_channels > block_channels) {
+            printf("Texture has %d channels, only %d are block-compressed.\n", num_channels, block_channels);
+        }
+        num_channels = block_channels;
+    }
+
+    std::unique_ptr<Texture> converted = std::make_unique<Texture>();
+    converted->width = texture.width;
+    converted->height = texture.height;
+    converted->num_channels = num_channels;
+    converted->data_type = data_type;
+    converted->mips.resize(texture.levels());
+    int stride = texture_element_bytes(data_type, num_channels);
+    for (int l = 0; l < texture.levels(); ++l) {
+        int w = texture.level_width(l);
+        int h = texture.level_height(l);
+        vec2i res = storage_res(data_type, w, h);
+        converted->mips[l] = TextureMip(res.x(), res.y(), stride);
+        if (!is_block_compressed(data_type)) {
+            parallel_for(h, [&](int y) {
+                VLA(texel, float, texture.num_channels);
+                for (int x = 0; x < w; ++x) {
+                    texture.fetch_as_float(x, y, l, {texel, (size_t)texture.num_channels});
+                    converted->set_from_float(x, y, l, {texel, (size_t)num_channels});
+                }
+            });
+            continue;
+        }
+        parallel_for(res.x() * res.y(), [&](int b) {
+            int bx = b % res.x();
+            int by = b / res.x();
+            // Blocks on the border repeat the edge texels.
+            float texels[16][4] = {};
+            for (int i = 0; i < 16; ++i) {
+                int x = std::min(bx * 4 + i % 4, w - 1);
+                int y = std::min(by * 4 + i / 4, h - 1);
+                texture.fetch_as_float(x, y, l, {texels[i], (size_t)std::min(num_channels, 4)});
+            }
+            std::byte *block = converted->mips[l].fetch_multi(bx, by);
+            switch (data_type) {
+            case TextureDataType::bc1: {
+                float rgb[16][3];
+                for (int i = 0; i < 16; ++i)
+                    std::copy_n(texels[i], 3, rgb[i]);
+                encode_bc1_block(rgb, block);
+                break;
+            }
+            case TextureDataType::bc4: {
+                float r[16];
+                for (int i = 0; i < 16; ++i)
+                    r[i] = texels[i][0];
+                encode_bc4_block(r, block);
+                break;
+            }
+            case TextureDataType::bc5:
+            default: {
+                float rg[16][2];
+                for (int i = 0; i < 16; ++i)
+                    std::copy_n(texels[i], 2, rg[i]);
+                encode_bc5_block(rg, block);
+                break;
+            }
+            }
+        });
+    }
+    return converted;
+}
+
+static TextureDataType load_texture_data_type(const std::string &name)
+{
+    if (name == "u8") {
+        return TextureDataType::u8;
+    } else if (name == "f16") {
+        return TextureDataType::f16;
+    } else if (name == "bc1") {
+        return TextureDataType::bc1;
+    } else if (name == "bc4") {
+        return TextureDataType::bc4;
+    } else if (name == "bc5") {
+        return TextureDataType::bc5;
+    } else if (name == "f32") {
+        return TextureDataType::f32;
+    }
+    ASSERT(false, "Invalid texture data type [%s].", name.c_str());
+    return TextureDataType::f32;
 }
 
 std::unique_ptr<Texture> create_texture(const ConfigArgs &args)
 {
+    ScopedStatTimer timer(stat_texture_load);
     fs::path path = args.load_path("path");
     bool serialized = args.load_bool("serialized", false);
-    if (serialized) {
+    bool tiled = args.load_bool("tiled", false);
+    if (tiled) {
+        // NOTE: the cache is global so the last texture that sets the budget wins.
+        if (args.contains("tile_cache_budget_mb")) {
+            texture_tile_cache().set_budget((size_t)args.load_integer("tile_cache_budget_mb") << 20);
+        }
+        return create_texture_from_tiled(path);
+    } else if (serialized) {
         return create_texture_from_serialized(path);
     } else {
         int ch = args.load_integer("channels");
@@ -735,18 +977,60 @@ std::unique_ptr<Texture> create_texture(const ConfigArgs &args)
         if (src_colorspace_str == "sRGB") {
             src_colorspace = ColorSpace::sRGB;
         }
-        return create_texture_from_image(ch, build_mipmaps, src_colorspace, path);
+        MipFilter mip_filter = args.load_string("mip_filter", "box") == "kaiser" ? MipFilter::Kaiser : MipFilter::Box;
+        // Generated pyramids can be cached next to the image, keyed by the source file and the build options.
+        bool cache_mipmaps = build_mipmaps && args.load_bool("cache_mipmaps", false);
+        fs::path cache_path;
+        std::unique_ptr<Texture> texture;
+        if (cache_mipmaps) {
+            uint64_t key = hash(fs::file_size(path), fs::last_write_time(path).time_since_epoch().count(), ch,
+                                src_colorspace, mip_filter);
+            cache_path = path;
+            cache_path += string_format(".mips_%016llx.bin", (unsigned long long)key);
+            if (fs::exists(cache_path))
+                texture = create_texture_from_serialized(cache_path);
+        }
+        if (!texture) {
+            texture = create_texture_from_image(ch, build_mipmaps, src_colorspace, path, mip_filter);
+            if (cache_mipmaps)
+                write_texture_to_serialized(*texture, cache_path);
+        }
+        // Optionally store in a smaller format.
+        if (args.contains("data_type")) {
+            TextureDataType data_type = load_texture_data_type(args.load_string("data_type"));
+            if (data_type != texture->data_type)
+                texture = convert_texture(*texture, data_type);
+        }
+        return texture;
     }
 }
 
+ConfigurableSnapshot texture_snapshot()
+{
+    ConfigurableSnapshot snapshot;
+    snapshot.write = [](const Configurable &asset, const fs::path &path) {
+        const Texture &texture = dynamic_cast<const Texture &>(asset);
+        if (texture.tiled)
+            return false;
+        write_texture_to_serialized(texture, path);
+        return true;
+    };
+    snapshot.read = [](const fs::path &path) -> std::unique_ptr<Configurable> {
+        return create_texture_from_serialized(path);
+    };
+    return snapshot;
+}
+
 std::unique_ptr<TextureSampler> create_texture_sampler(const ConfigArgs &args)
 {
     std::unique_ptr<TextureSampler> sampler;
     std::string type = args.load_string("type");
     if (type == "nearest") {
         sampler = std::make_unique<NearestSampler>();
-    } else if (type == "linear") {
+    } else if (type == "linear" || type == "trilinear") {
         sampler = std::make_unique<LinearSampler>();
+    } else if (type == "ewa") {
+        sampler = std::make_unique<EWASampler>(args.load_float("max_anisotropy", 8.0f));
     } else if (type == "cubic") {
         CubicSampler::Kernel kernel = CubicSampler::Kernel::MitchellNetravali;
         std::string k = args.load_string("kernel", "mitchell");
@@ -775,12 +1059,18 @@ std::unique_ptr<TextureSampler> create_texture_sampler(const ConfigArgs &args)
 
 void convert_texture_task(const ConfigArgs &args, const fs::path &task_dir, int task_id)
 {
+    bool tiled = args.load_bool("tiled", false);
+    int log_tile_size = std::countr_zero((uint32_t)args.load_integer("tile_size", 64));
     int n_textures = args["textures"].array_size();
     for (int i = 0; i < n_textures; ++i) {
         std::string asset_path = args["textures"].load_string(i);
         const Texture *texture = args.asset_table().get<Texture>(asset_path);
         std::string name = asset_path.substr(asset_path.rfind(".") + 1);
-        write_texture_to_serialized(*texture, task_dir / (name + ".bin"));
+        if (tiled) {
+            write_texture_to_tiled(*texture, task_dir / (name + ".tiled.bin"), log_tile_size);
+        } else {
+            write_texture_to_serialized(*texture, task_dir / (name + ".bin"));
+        }
 
         // int w = texture->width;
         // int h = texture->height;
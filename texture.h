@@ -3,20 +3,37 @@
 #include "config.h"
 #include "image_util.h"
 #include "maths.h"
+#include <array>
 #include <cstddef>
+#include <memory>
 #include <span>
 
 namespace ks
 {
 
-// TODO: building mipmaps
-// TODO: EWA filtering
-// TODO: f16 data type?
-
 enum class TextureDataType
 {
     u8,
     f32,
+    f16,
+    // Block-compressed (see texture_codec.h). Elements of mips are 4x4 texel blocks that the CPU samplers decode on
+    // fetch. mips[l].copy_to_linear_array gives the block rows GPU APIs upload as is (see ksc::Texture2D).
+    bc1,
+    bc4,
+    bc5,
+};
+
+inline bool is_block_compressed(TextureDataType data_type)
+{
+    return data_type == TextureDataType::bc1 || data_type == TextureDataType::bc4 || data_type == TextureDataType::bc5;
+}
+// Bytes per element of mips: a texel, or a block for block-compressed types.
+int texture_element_bytes(TextureDataType data_type, int num_channels);
+
+enum class MipFilter
+{
+    Box,
+    Kaiser,
 };
 
 enum class TextureWrapMode
@@ -25,20 +42,43 @@ enum class TextureWrapMode
     Clamp
 };
 
+struct TiledTextureFile;
+
+// Mips always use 4x4 blocks, so indexing is shifts and masks. The stride is fixed per lookup (see fetch_quad_as_float).
+using TextureMip = BlockedArray<std::byte, 2>;
+
 struct Texture : public Configurable
 {
     Texture() = default;
     Texture(int width, int height, int num_channels, TextureDataType data_type);
     Texture(const std::byte *bytes, int width, int height, int num_channels, TextureDataType data_type,
-            bool build_mipmaps);
+            bool build_mipmaps, MipFilter mip_filter = MipFilter::Box);
     Texture(std::span<const std::byte *> mip_bytes, int width, int height, int num_channels, TextureDataType data_type);
 
-    const std::byte *fetch_raw(int x, int y, int level) const { return mips[level].fetch_multi(x, y); }
+    // Tiled textures are paged in through the global tile cache (see texture_cache.h).
+    explicit Texture(std::shared_ptr<const TiledTextureFile> tiled);
+
+    // NOTE: returns the block containing the texel for block-compressed types.
+    const std::byte *fetch_raw(int x, int y, int level) const
+    {
+        if (is_block_compressed(data_type))
+            return mips[level].fetch_multi(x >> 2, y >> 2);
+        return tiled ? fetch_tiled(x, y, level) : mips[level].fetch_multi(x, y);
+    }
     void fetch_as_float(int x, int y, int level, std::span<float> out) const;
+    // The bilinear footprint (x0, y0), (x1, y0), (x0, y1), (x1, y1): out[4 * nc] holds the texels one after another.
+    // Dispatches to lookups specialized on the data type and channel count.
+    void fetch_quad_as_float(int x0, int y0, int x1, int y1, int level, std::span<float> out) const;
     void set_from_float(int x, int y, int level, std::span<const float> in);
-    int levels() const { return (int)mips.size(); }
+    int levels() const;
+    int level_width(int level) const;
+    int level_height(int level) const;
+
+    const std::byte *fetch_tiled(int x, int y, int level) const;
 
-    std::vector<BlockedArray<std::byte>> mips;
+    // Empty for tiled textures.
+    std::vector<TextureMip> mips;
+    std::shared_ptr<const TiledTextureFile> tiled;
     int width = 0;
     int height = 0;
     int num_channels = 0;
@@ -61,6 +101,7 @@ struct NearestSampler : public TextureSampler
     void operator()(const Texture &texture, const vec2 &uv, const mat2 &duvdxy, std::span<float> out) const;
 };
 
+// Trilinear when the texture has mips: bilinear lookups of the two levels nearest to the (isotropic) footprint width.
 struct LinearSampler : public TextureSampler
 {
     using TextureSampler::operator();
@@ -104,11 +145,41 @@ struct CubicSampler : public TextureSampler
     vec4 ca, cb;
 };
 
+// Elliptically weighted average filtering (Heckbert 89, see also pbrt-v3). The elliptical footprint given by the
+// rows of duvdxy is filtered with a truncated Gaussian on the two mip levels nearest to its minor axis, so grazing
+// angles stay sharp along the major axis without aliasing.
+struct EWASampler : public TextureSampler
+{
+    explicit EWASampler(float max_anisotropy = 8.0f);
+    using TextureSampler::operator();
+    void operator()(const Texture &texture, const vec2 &uv, const mat2 &duvdxy, std::span<float> out) const;
+    void ewa(const Texture &texture, int level, const vec2 &uv, vec2 dst0, vec2 dst1, std::span<float> out) const;
+
+    // Gaussian weights indexed by the squared (normalized) distance to the ellipse center.
+    static constexpr int weight_lut_size = 128;
+    std::array<float, weight_lut_size> weight_lut;
+    // Eccentricity is clamped to bound the number of texels per lookup.
+    float max_anisotropy;
+};
+
+// Lookup of all channels of texture (out has texture.num_channels floats), specialized on the sampler kind, data type
+// and channel count. Same results as the virtual TextureSampler call without its runtime dispatch.
+using TextureLookup = void (*)(const TextureSampler &sampler, const Texture &texture, const vec2 &uv,
+                               const mat2 &duvdxy, float *out);
+// Resolve once per (sampler, texture), e.g. when a material is built. Null for samplers and textures that have no
+// specialization (cubic and EWA samplers, tiled or block-compressed textures).
+TextureLookup resolve_texture_lookup(const TextureSampler &sampler, const Texture &texture);
+
 std::unique_ptr<Texture> create_texture_from_image(int channels, bool build_mipmap, ColorSpace src_colorspace,
-                                                   const fs::path &path);
+                                                   const fs::path &path, MipFilter mip_filter = MipFilter::Box);
 std::unique_ptr<Texture> create_texture_from_serialized(const fs::path &path);
+std::unique_ptr<Texture> create_texture_from_tiled(const fs::path &path);
+// Convert to another data type (e.g. f16 or block compression) level by level.
+std::unique_ptr<Texture> convert_texture(const Texture &texture, TextureDataType data_type);
 void write_texture_to_serialized(const Texture &texture, const fs::path &path);
 std::unique_ptr<Texture> create_texture(const ConfigArgs &args);
 std::unique_ptr<TextureSampler> create_texture_sampler(const ConfigArgs &args);
+// Snapshots textures (with their mips) in the serialized format. Tiled textures are not snapshotted.
+ConfigurableSnapshot texture_snapshot();
 
 } // namespace ks
\ No newline at end of file
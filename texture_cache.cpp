@@ -0,0 +1,250 @@
+#include "texture_cache.h"
+#include "assertion.h"
+#include "hash.h"
+#include <cstring>
+#include <lz4.h>
+#include <string_view>
+
+namespace ks
+{
+
+constexpr const char *tiled_texture_magic = "i_am_a_tiled_texture";
+constexpr uint32_t tiled_texture_version = 1;
+
+struct TiledTextureHeader
+{
+    std::array<char, std::string_view(tiled_texture_magic).size()> magic;
+    uint32_t version;
+    int width;
+    int height;
+    int num_channels;
+    TextureDataType data_type;
+    int levels;
+    int log_tile_size;
+};
+
+static std::atomic<uint32_t> next_tiled_texture_id = 0;
+
+TiledTextureFile::TiledTextureFile(const fs::path &path)
+{
+    file = std::make_unique<MappedFile>(path);
+    TiledTextureHeader header;
+    ASSERT(file->size() >= sizeof(header), "Invalid tiled texture [%s].", path.string().c_str());
+    memcpy(&header, file->data(), sizeof(header));
+    ASSERT(std::string_view(header.magic.data(), header.magic.size()) == tiled_texture_magic,
+           "Invalid tiled texture [%s].", path.string().c_str());
+    ASSERT(header.version == tiled_texture_version, "Unsupported tiled texture version %u.", header.version);
+
+    width = header.width;
+    height = header.height;
+    num_channels = header.num_channels;
+    data_type = header.data_type;
+    log_tile_size = header.log_tile_size;
+    ASSERT(!is_block_compressed(data_type), "Block-compressed textures can't be tiled.");
+    stride = texture_element_bytes(data_type, num_channels);
+
+    levels.resize(header.levels);
+    int w = width;
+    int h = height;
+    uint32_t num_tiles = 0;
+    for (Level &level : levels) {
+        level.width = w;
+        level.height = h;
+        level.tiles_x = (w + tile_size() - 1) >> log_tile_size;
+        level.tiles_y = (h + tile_size() - 1) >> log_tile_size;
+        level.first_tile = num_tiles;
+        num_tiles += level.tiles_x * level.tiles_y;
+        w = std::max(1, (w + 1) / 2);
+        h = std::max(1, (h + 1) / 2);
+    }
+    ASSERT(file->size() >= sizeof(header) + num_tiles * sizeof(TileEntry), "Corrupted tiled texture.");
+    tiles.resize(num_tiles);
+    memcpy(tiles.data(), file->data() + sizeof(header), num_tiles * sizeof(TileEntry));
+    id = next_tiled_texture_id.fetch_add(1);
+}
+
+TextureMip TiledTextureFile::load_tile(uint32_t tile, Allocator *allocator) const
+{
+    const TileEntry &entry = tiles[tile];
+    ASSERT(entry.offset + entry.compressed_size <= file->size(), "Corrupted tiled texture.");
+    TextureMip texels(tile_size(), tile_size(), stride, 2, allocator);
+    int bytes = tile_size() * tile_size() * stride;
+    int ret = LZ4_decompress_safe((const char *)(file->data() + entry.offset), (char *)texels.data,
+                                  (int)entry.compressed_size, bytes);
+    ASSERT(ret == bytes, "lz4 decompression failed.");
+    return texels;
+}
+
+const std::byte *TiledTextureFile::fetch(int x, int y, int level) const
+{
+    // Per-thread pins of the last few tiles: keeps returned pointers alive after eviction from the global cache and
+    // skips the cache lookup for neighboring texels (e.g. the footprint of a bilinear/bicubic lookup).
+    struct Pins
+    {
+        std::array<uint64_t, 4> keys;
+        std::array<std::shared_ptr<const TextureTileCache::Tile>, 4> tiles;
+        int next = 0;
+    };
+    static thread_local Pins pins;
+
+    uint32_t tile = tile_index(x, y, level);
+    uint64_t key = ((uint64_t)id << 32) | tile;
+    int tx = x & (tile_size() - 1);
+    int ty = y & (tile_size() - 1);
+    for (int i = 0; i < (int)pins.keys.size(); ++i) {
+        if (pins.tiles[i] && pins.keys[i] == key)
+            return pins.tiles[i]->fetch_multi(tx, ty);
+    }
+    int slot = pins.next;
+    pins.next = (pins.next + 1) % (int)pins.keys.size();
+    pins.keys[slot] = key;
+    pins.tiles[slot] = texture_tile_cache().get(*this, tile);
+    return pins.tiles[slot]->fetch_multi(tx, ty);
+}
+
+void write_texture_to_tiled(const Texture &texture, const fs::path &path, int log_tile_size)
+{
+    ASSERT(!texture.tiled, "Texture is already tiled.");
+    ASSERT(!is_block_compressed(texture.data_type), "Block-compressed textures can't be tiled.");
+    ASSERT(log_tile_size >= 2 && log_tile_size <= 12, "Invalid tile size.");
+    TiledTextureHeader header;
+    std::copy_n(tiled_texture_magic, header.magic.size(), header.magic.begin());
+    header.version = tiled_texture_version;
+    header.width = texture.width;
+    header.height = texture.height;
+    header.num_channels = texture.num_channels;
+    header.data_type = texture.data_type;
+    header.levels = texture.levels();
+    header.log_tile_size = log_tile_size;
+
+    int tile_size = 1 << log_tile_size;
+    int stride = texture.mips[0].stride;
+    struct TileRef
+    {
+        int level;
+        int x_start;
+        int y_start;
+    };
+    std::vector<TileRef> refs;
+    for (int l = 0; l < texture.levels(); ++l) {
+        const TextureMip &mip = texture.mips[l];
+        for (int y = 0; y < mip.vres; y += tile_size) {
+            for (int x = 0; x < mip.ures; x += tile_size) {
+                refs.push_back({l, x, y});
+            }
+        }
+    }
+
+    // Compress in parallel, then write sequentially.
+    int tile_bytes = tile_size * tile_size * stride;
+    std::vector<std::vector<char>> compressed(refs.size());
+    // Scratch tiles are recycled through the pool instead of a fresh aligned allocation per tile.
+    PoolAllocator pool;
+    parallel_for((int)refs.size(), [&](int i) {
+        const TileRef &ref = refs[i];
+        const TextureMip &mip = texture.mips[ref.level];
+        // Texels outside the level are zero.
+        TextureMip texels(tile_size, tile_size, stride, 2, &pool);
+        std::fill_n(texels.data, tile_bytes, std::byte(0));
+        int x_end = std::min(ref.x_start + tile_size, mip.ures);
+        int y_end = std::min(ref.y_start + tile_size, mip.vres);
+        for (int y = ref.y_start; y < y_end; ++y) {
+            for (int x = ref.x_start; x < x_end; ++x) {
+                std::copy_n(mip.fetch_multi(x, y), stride, texels.fetch_multi(x - ref.x_start, y - ref.y_start));
+            }
+        }
+        std::vector<char> &dst = compressed[i];
+        dst.resize(LZ4_compressBound(tile_bytes));
+        int size =
+            LZ4_compress_default((const char *)texels.data, dst.data(), tile_bytes, (int)dst.size());
+        ASSERT(size > 0, "lz4 compression failed.");
+        dst.resize(size);
+    });
+
+    std::vector<TiledTextureFile::TileEntry> entries(refs.size());
+    uint64_t offset = sizeof(header) + entries.size() * sizeof(TiledTextureFile::TileEntry);
+    for (size_t i = 0; i < refs.size(); ++i) {
+        entries[i].offset = offset;
+        entries[i].compressed_size = (uint32_t)compressed[i].size();
+        offset += compressed[i].size();
+    }
+    BinaryWriter writer(path);
+    writer.write(header);
+    writer.write_array(entries.data(), entries.size());
+    for (const std::vector<char> &tile : compressed) {
+        writer.write_array(tile.data(), tile.size());
+    }
+}
+
+TextureTileCache::TextureTileCache(size_t budget_bytes) : budget_bytes(budget_bytes) {}
+
+void TextureTileCache::Shard::evict_to(size_t budget, std::atomic<uint64_t> &evictions)
+{
+    while (resident_bytes > budget && !lru.empty()) {
+        const auto &[key, tile] = lru.back();
+        resident_bytes -= tile->ures * tile->vres * tile->stride;
+        map.erase(key);
+        lru.pop_back();
+        ++evictions;
+    }
+}
+
+std::shared_ptr<const TextureTileCache::Tile> TextureTileCache::get(const TiledTextureFile &file, uint32_t tile)
+{
+    uint64_t key = ((uint64_t)file.id << 32) | tile;
+    Shard &shard = shards[hash(key) % num_shards];
+    {
+        std::scoped_lock lock(shard.mutex);
+        auto it = shard.map.find(key);
+        if (it != shard.map.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            ++hits;
+            return it->second->second;
+        }
+    }
+    // Decompress without holding the lock. Another thread may load the same tile concurrently; the first insert wins.
+    ++misses;
+    std::shared_ptr<const Tile> loaded = std::make_shared<const Tile>(file.load_tile(tile, &pool));
+    size_t bytes = loaded->ures * loaded->vres * loaded->stride;
+    std::scoped_lock lock(shard.mutex);
+    auto [it, inserted] = shard.map.try_emplace(key);
+    if (!inserted)
+        return it->second->second;
+    shard.lru.emplace_front(key, loaded);
+    it->second = shard.lru.begin();
+    shard.resident_bytes += bytes;
+    // Never evict the tile that was just loaded.
+    shard.evict_to(std::max(budget_bytes.load() / num_shards, bytes), evictions);
+    return loaded;
+}
+
+void TextureTileCache::set_budget(size_t budget)
+{
+    budget_bytes = budget;
+    for (Shard &shard : shards) {
+        std::scoped_lock lock(shard.mutex);
+        shard.evict_to(budget / num_shards, evictions);
+    }
+}
+
+TextureTileCache::Stats TextureTileCache::stats() const
+{
+    Stats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.evictions = evictions;
+    stats.budget_bytes = budget_bytes;
+    for (const Shard &shard : shards) {
+        std::scoped_lock lock(shard.mutex);
+        stats.resident_bytes += shard.resident_bytes;
+    }
+    return stats;
+}
+
+TextureTileCache &texture_tile_cache()
+{
+    static TextureTileCache cache(size_t(1) << 30);
+    return cache;
+}
+
+} // namespace ks
\ No newline at end of file
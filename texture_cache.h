@@ -0,0 +1,116 @@
+#pragma once
+#include "barray.h"
+#include "file_util.h"
+#include "parallel.h"
+#include "pool_allocator.h"
+#include "texture.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace ks
+{
+
+// On-disk tiled texture. Every mip level is split into square tiles that are lz4-compressed independently, so a
+// texture never has to be resident as a whole. Tiles are decompressed into the BlockedArray layout Texture mips use
+// (the tile size is a multiple of the block size) and paged in on demand through texture_tile_cache().
+struct TiledTextureFile
+{
+    explicit TiledTextureFile(const fs::path &path);
+
+    struct Level
+    {
+        int width;
+        int height;
+        int tiles_x;
+        int tiles_y;
+        // Index of the first tile of this level in tiles.
+        uint32_t first_tile;
+    };
+    struct TileEntry
+    {
+        uint64_t offset;
+        uint32_t compressed_size;
+        uint32_t padding = 0;
+    };
+
+    int tile_size() const { return 1 << log_tile_size; }
+    uint32_t tile_index(int x, int y, int level) const
+    {
+        const Level &l = levels[level];
+        return l.first_tile + (uint32_t)((y >> log_tile_size) * l.tiles_x + (x >> log_tile_size));
+    }
+    // Returns the texel bytes of (x, y). The pointer stays valid until a few more tiles are fetched by the same
+    // thread, so copy the texel right away.
+    const std::byte *fetch(int x, int y, int level) const;
+    // Decompress a tile (called by the cache on a miss). The texels come from allocator if given.
+    TextureMip load_tile(uint32_t tile, Allocator *allocator = nullptr) const;
+
+    std::unique_ptr<MappedFile> file;
+    std::vector<Level> levels;
+    std::vector<TileEntry> tiles;
+    int width = 0;
+    int height = 0;
+    int num_channels = 0;
+    TextureDataType data_type = TextureDataType::u8;
+    // Bytes per texel.
+    int stride = 0;
+    int log_tile_size = 6;
+    // Unique across all files opened by the process. Used in cache keys.
+    uint32_t id = 0;
+};
+
+// Write texture in the tiled format. log_tile_size must be at least the BlockedArray block size (log 2).
+void write_texture_to_tiled(const Texture &texture, const fs::path &path, int log_tile_size = 6);
+
+// Global LRU cache of decompressed texture tiles, shared by all tiled textures.
+struct TextureTileCache
+{
+    using Tile = TextureMip;
+
+    explicit TextureTileCache(size_t budget_bytes);
+
+    std::shared_ptr<const Tile> get(const TiledTextureFile &file, uint32_t tile);
+    // Evicts tiles right away if the cache is over the new budget.
+    void set_budget(size_t budget_bytes);
+
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t resident_bytes = 0;
+        size_t budget_bytes = 0;
+    };
+    Stats stats() const;
+
+    // Sharded to reduce lock contention. Each shard has its share of the budget.
+    static constexpr int num_shards = 16;
+    struct Shard
+    {
+        void evict_to(size_t budget, std::atomic<uint64_t> &evictions);
+
+        mutable spin_lock mutex;
+        // Most recently used at the front.
+        std::list<std::pair<uint64_t, std::shared_ptr<const Tile>>> lru;
+        std::unordered_map<uint64_t, decltype(lru)::iterator> map;
+        size_t resident_bytes = 0;
+    };
+    // Tile storage. Misses and evictions allocate/free same-sized tiles from many threads at a high rate. Declared
+    // before the shards so it outlives the tiles they hold.
+    PoolAllocator pool;
+    std::array<Shard, num_shards> shards;
+    std::atomic<size_t> budget_bytes;
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+    std::atomic<uint64_t> evictions = 0;
+};
+
+// Default budget is 1 GiB.
+TextureTileCache &texture_tile_cache();
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,261 @@
+#include "texture_codec.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace ks
+{
+
+uint16_t float_to_half(float f)
+{
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    uint32_t sign = (x >> 16) & 0x8000u;
+    int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffffu;
+    if (((x >> 23) & 0xff) == 0xff) {
+        // Inf or NaN (keep NaN quiet).
+        return (uint16_t)(sign | 0x7c00u | (mantissa ? 0x200u : 0u));
+    }
+    if (exp >= 0x1f) {
+        return (uint16_t)(sign | 0x7c00u);
+    }
+    if (exp <= 0) {
+        // Subnormal or zero.
+        if (exp < -10)
+            return (uint16_t)sign;
+        mantissa |= 0x800000u;
+        int shift = 14 - exp;
+        uint32_t half_mantissa = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half_mantissa & 1)))
+            ++half_mantissa;
+        return (uint16_t)(sign | half_mantissa);
+    }
+    uint32_t h = sign | ((uint32_t)exp << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fffu;
+    // Carry into the exponent is intended (rounds up to the next power of two or inf).
+    if (rest > 0x1000u || (rest == 0x1000u && (h & 1)))
+        ++h;
+    return (uint16_t)h;
+}
+
+float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000u) << 16;
+    uint32_t exp = (h >> 10) & 0x1fu;
+    uint32_t mantissa = h & 0x3ffu;
+    uint32_t x;
+    if (exp == 0x1f) {
+        x = sign | 0x7f800000u | (mantissa << 13);
+    } else if (exp != 0) {
+        x = sign | ((exp + 127 - 15) << 23) | (mantissa << 13);
+    } else if (mantissa != 0) {
+        // Normalize the subnormal.
+        exp = 127 - 15 + 1;
+        while (!(mantissa & 0x400u)) {
+            mantissa <<= 1;
+            --exp;
+        }
+        x = sign | (exp << 23) | ((mantissa & 0x3ffu) << 13);
+    } else {
+        x = sign;
+    }
+    return std::bit_cast<float>(x);
+}
+
+static uint16_t pack_565(const float c[3])
+{
+    uint16_t r = (uint16_t)std::lround(std::clamp(c[0], 0.0f, 1.0f) * 31.0f);
+    uint16_t g = (uint16_t)std::lround(std::clamp(c[1], 0.0f, 1.0f) * 63.0f);
+    uint16_t b = (uint16_t)std::lround(std::clamp(c[2], 0.0f, 1.0f) * 31.0f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void unpack_565(uint16_t v, float c[3])
+{
+    c[0] = (float)((v >> 11) & 31) / 31.0f;
+    c[1] = (float)((v >> 5) & 63) / 63.0f;
+    c[2] = (float)(v & 31) / 31.0f;
+}
+
+void encode_bc1_block(const float rgb[16][3], std::byte *block)
+{
+    // Endpoints from the extent of the texels along the principal axis (a few steps of power iteration).
+    float mean[3] = {0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < 16; ++i) {
+        for (int c = 0; c < 3; ++c)
+            mean[c] += rgb[i][c] / 16.0f;
+    }
+    float cov[6] = {};
+    for (int i = 0; i < 16; ++i) {
+        float d[3] = {rgb[i][0] - mean[0], rgb[i][1] - mean[1], rgb[i][2] - mean[2]};
+        cov[0] += d[0] * d[0];
+        cov[1] += d[0] * d[1];
+        cov[2] += d[0] * d[2];
+        cov[3] += d[1] * d[1];
+        cov[4] += d[1] * d[2];
+        cov[5] += d[2] * d[2];
+    }
+    float axis[3] = {1.0f, 1.0f, 1.0f};
+    for (int iter = 0; iter < 8; ++iter) {
+        float next[3] = {cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+                         cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                         cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]};
+        float norm = std::max({std::abs(next[0]), std::abs(next[1]), std::abs(next[2])});
+        if (norm == 0.0f)
+            break;
+        for (int c = 0; c < 3; ++c)
+            axis[c] = next[c] / norm;
+    }
+    float t_min = std::numeric_limits<float>::max();
+    float t_max = std::numeric_limits<float>::lowest();
+    for (int i = 0; i < 16; ++i) {
+        float t = (rgb[i][0] - mean[0]) * axis[0] + (rgb[i][1] - mean[1]) * axis[1] + (rgb[i][2] - mean[2]) * axis[2];
+        t_min = std::min(t_min, t);
+        t_max = std::max(t_max, t);
+    }
+    float e0[3], e1[3];
+    for (int c = 0; c < 3; ++c) {
+        e0[c] = mean[c] + t_max * axis[c];
+        e1[c] = mean[c] + t_min * axis[c];
+    }
+    uint16_t c0 = pack_565(e0);
+    uint16_t c1 = pack_565(e1);
+    // 4-color mode needs c0 > c1. Equal endpoints fall into 3-color mode, where index 0 is still c0.
+    if (c0 < c1)
+        std::swap(c0, c1);
+
+    float palette[4][3];
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (int c = 0; c < 3; ++c) {
+        palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+        palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        for (int i = 0; i < 16; ++i) {
+            int best = 0;
+            float best_dist = std::numeric_limits<float>::max();
+            for (int p = 0; p < 4; ++p) {
+                float dist = 0.0f;
+                for (int c = 0; c < 3; ++c)
+                    dist += (rgb[i][c] - palette[p][c]) * (rgb[i][c] - palette[p][c]);
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = p;
+                }
+            }
+            indices |= (uint32_t)best << (2 * i);
+        }
+    }
+    uint8_t bytes[8] = {(uint8_t)(c0 & 0xff), (uint8_t)(c0 >> 8), (uint8_t)(c1 & 0xff), (uint8_t)(c1 >> 8),
+                        (uint8_t)(indices & 0xff), (uint8_t)((indices >> 8) & 0xff),
+                        (uint8_t)((indices >> 16) & 0xff), (uint8_t)(indices >> 24)};
+    std::memcpy(block, bytes, 8);
+}
+
+void decode_bc1_block(const std::byte *block, float rgb[16][3])
+{
+    uint8_t bytes[8];
+    std::memcpy(bytes, block, 8);
+    uint16_t c0 = (uint16_t)(bytes[0] | (bytes[1] << 8));
+    uint16_t c1 = (uint16_t)(bytes[2] | (bytes[3] << 8));
+    uint32_t indices = bytes[4] | (bytes[5] << 8) | (bytes[6] << 16) | ((uint32_t)bytes[7] << 24);
+    float palette[4][3];
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (int c = 0; c < 3; ++c) {
+        if (c0 > c1) {
+            palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+            palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+        } else {
+            // NOTE: index 3 is transparent black in 3-color mode. Alpha is ignored.
+            palette[2][c] = 0.5f * (palette[0][c] + palette[1][c]);
+            palette[3][c] = 0.0f;
+        }
+    }
+    for (int i = 0; i < 16; ++i) {
+        int p = (indices >> (2 * i)) & 3;
+        std::copy_n(palette[p], 3, rgb[i]);
+    }
+}
+
+void encode_bc4_block(const float r[16], std::byte *block)
+{
+    float lo = 1.0f;
+    float hi = 0.0f;
+    for (int i = 0; i < 16; ++i) {
+        float v = std::clamp(r[i], 0.0f, 1.0f);
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+    }
+    // 8-value mode needs r0 > r1.
+    uint8_t r0 = (uint8_t)std::lround(hi * 255.0f);
+    uint8_t r1 = (uint8_t)std::lround(lo * 255.0f);
+    uint64_t bits = r0 | ((uint64_t)r1 << 8);
+    if (r0 > r1) {
+        for (int i = 0; i < 16; ++i) {
+            float v = std::clamp(r[i], 0.0f, 1.0f) * 255.0f;
+            // Position between the endpoints: 0 is r0 and 7 is r1.
+            int t = (int)std::lround((float)(r0 - v) / (float)(r0 - r1) * 7.0f);
+            t = std::clamp(t, 0, 7);
+            uint64_t index = t == 0 ? 0 : (t == 7 ? 1 : t + 1);
+            bits |= index << (16 + 3 * i);
+        }
+    }
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; ++i)
+        bytes[i] = (uint8_t)(bits >> (8 * i));
+    std::memcpy(block, bytes, 8);
+}
+
+void decode_bc4_block(const std::byte *block, float r[16])
+{
+    uint8_t bytes[8];
+    std::memcpy(bytes, block, 8);
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i)
+        bits |= (uint64_t)bytes[i] << (8 * i);
+    float r0 = (float)bytes[0] / 255.0f;
+    float r1 = (float)bytes[1] / 255.0f;
+    float palette[8] = {r0, r1};
+    if (bytes[0] > bytes[1]) {
+        for (int p = 2; p < 8; ++p)
+            palette[p] = ((float)(8 - p) * r0 + (float)(p - 1) * r1) / 7.0f;
+    } else {
+        for (int p = 2; p < 6; ++p)
+            palette[p] = ((float)(6 - p) * r0 + (float)(p - 1) * r1) / 5.0f;
+        palette[6] = 0.0f;
+        palette[7] = 1.0f;
+    }
+    for (int i = 0; i < 16; ++i)
+        r[i] = palette[(bits >> (16 + 3 * i)) & 7];
+}
+
+void encode_bc5_block(const float rg[16][2], std::byte *block)
+{
+    float r[16], g[16];
+    for (int i = 0; i < 16; ++i) {
+        r[i] = rg[i][0];
+        g[i] = rg[i][1];
+    }
+    encode_bc4_block(r, block);
+    encode_bc4_block(g, block + bc4_block_bytes);
+}
+
+void decode_bc5_block(const std::byte *block, float rg[16][2])
+{
+    float r[16], g[16];
+    decode_bc4_block(block, r);
+    decode_bc4_block(block + bc4_block_bytes, g);
+    for (int i = 0; i < 16; ++i) {
+        rg[i][0] = r[i];
+        rg[i][1] = g[i];
+    }
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace ks
+{
+
+// IEEE 754 binary16 conversion (round to nearest even).
+uint16_t float_to_half(float f);
+float half_to_float(uint16_t h);
+
+// Block compression of 4x4 texel blocks, laid out as in D3D/Vulkan/CUDA so the same bytes can be uploaded to GPUs.
+// Texels are in row-major order within a block and channel values are in [0, 1].
+// BC1: 8 bytes, rgb (opaque, 4-color mode).
+// BC4: 8 bytes, one channel.
+// BC5: 16 bytes, two channels (two BC4 blocks), typically normal maps.
+constexpr int bc1_block_bytes = 8;
+constexpr int bc4_block_bytes = 8;
+constexpr int bc5_block_bytes = 16;
+
+void encode_bc1_block(const float rgb[16][3], std::byte *block);
+void decode_bc1_block(const std::byte *block, float rgb[16][3]);
+void encode_bc4_block(const float r[16], std::byte *block);
+void decode_bc4_block(const std::byte *block, float r[16]);
+void encode_bc5_block(const float rg[16][2], std::byte *block);
+void decode_bc5_block(const std::byte *block, float rg[16][2]);
+
+} // namespace ks
\ No newline at end of file
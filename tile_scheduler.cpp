@@ -0,0 +1,115 @@
+#include "tile_scheduler.h"
+#include "assertion.h"
+#include "hash.h"
+#include <algorithm>
+#include <bit>
+#include <numeric>
+
+namespace ks
+{
+
+TileSchedulerOptions load_tile_scheduler_options(const ConfigArgs &args)
+{
+    TileSchedulerOptions options;
+    int tile_size = args.load_integer("tile_size", options.tile_width);
+    options.tile_width = args.load_integer("tile_width", tile_size);
+    options.tile_height = args.load_integer("tile_height", tile_size);
+    std::string order = args.load_string("tile_order", "hilbert");
+    if (order == "row_major") {
+        options.order = TileOrder::RowMajor;
+    } else if (order == "morton") {
+        options.order = TileOrder::Morton;
+    } else {
+        options.order = TileOrder::Hilbert;
+    }
+    options.cost_aware = args.load_bool("cost_aware", options.cost_aware);
+    options.seed = (uint32_t)args.load_integer("seed", 0);
+    ASSERT(options.tile_width > 0 && options.tile_height > 0, "Invalid tile size.");
+    return options;
+}
+
+// https://en.wikipedia.org/wiki/Hilbert_curve
+static uint32_t hilbert_xy_to_d(uint32_t n, uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        // rotate
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+TileScheduler::TileScheduler(int width, int height, const TileSchedulerOptions &options)
+    : options(options), width(width), height(height)
+{
+    num_tiles_x = (width + options.tile_width - 1) / options.tile_width;
+    num_tiles_y = (height + options.tile_height - 1) / options.tile_height;
+    tiles.resize(num_tiles_x * num_tiles_y);
+    for (int ty = 0; ty < num_tiles_y; ++ty) {
+        for (int tx = 0; tx < num_tiles_x; ++tx) {
+            Tile &tile = tiles[ty * num_tiles_x + tx];
+            tile.index = ty * num_tiles_x + tx;
+            tile.x_start = tx * options.tile_width;
+            tile.y_start = ty * options.tile_height;
+            tile.x_end = std::min(tile.x_start + options.tile_width, width);
+            tile.y_end = std::min(tile.y_start + options.tile_height, height);
+            tile.seed = hash(tx, ty, options.seed);
+        }
+    }
+    costs.resize(tiles.size(), 0.0f);
+
+    std::vector<uint32_t> keys(tiles.size());
+    uint32_t n = std::bit_ceil((uint32_t)std::max(num_tiles_x, num_tiles_y));
+    for (int i = 0; i < (int)tiles.size(); ++i) {
+        uint32_t tx = i % num_tiles_x;
+        uint32_t ty = i / num_tiles_x;
+        switch (options.order) {
+        case TileOrder::RowMajor:
+            keys[i] = i;
+            break;
+        case TileOrder::Morton:
+            keys[i] = encode_morton_2(tx, ty);
+            break;
+        case TileOrder::Hilbert:
+        default:
+            keys[i] = hilbert_xy_to_d(n, tx, ty);
+            break;
+        }
+    }
+    curve_order.resize(tiles.size());
+    std::iota(curve_order.begin(), curve_order.end(), 0);
+    std::sort(curve_order.begin(), curve_order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+    curve_rank.resize(tiles.size());
+    for (int i = 0; i < (int)curve_order.size(); ++i)
+        curve_rank[curve_order[i]] = i;
+}
+
+const std::vector<int> &TileScheduler::dispatch_order()
+{
+    if (!options.cost_aware || !has_costs)
+        return curve_order;
+    // Longest processing time first. Ties keep the curve order for coherence.
+    cost_order = curve_order;
+    std::stable_sort(cost_order.begin(), cost_order.end(), [&](int a, int b) { return costs[a] > costs[b]; });
+    return cost_order;
+}
+
+std::vector<int> TileScheduler::dispatch_order(std::span<const int> subset) const
+{
+    std::vector<int> order(subset.begin(), subset.end());
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return curve_rank[a] < curve_rank[b]; });
+    if (options.cost_aware && has_costs)
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return costs[a] > costs[b]; });
+    return order;
+}
+
+} // namespace ks
\ No newline at end of file
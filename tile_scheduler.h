@@ -0,0 +1,150 @@
+#pragma once
+#include "config.h"
+#include "parallel.h"
+#include <atomic>
+#include <chrono>
+#include <span>
+#include <vector>
+
+namespace ks
+{
+
+enum class TileOrder
+{
+    RowMajor,
+    Morton,
+    Hilbert,
+};
+
+struct Tile
+{
+    // Row-major index in the tile grid (stable across orders and runs).
+    int index;
+    int x_start, y_start;
+    int x_end, y_end;
+    // Depends only on the tile position and the scheduler seed, so results don't depend on thread count or timing.
+    uint64_t seed;
+};
+
+struct TileSchedulerOptions
+{
+    int tile_width = 16;
+    int tile_height = 16;
+    TileOrder order = TileOrder::Hilbert;
+    // Once costs are known (after the first run), dispatch the most expensive tiles first.
+    bool cost_aware = true;
+    uint32_t seed = 0;
+};
+
+TileSchedulerOptions load_tile_scheduler_options(const ConfigArgs &args);
+
+// Splits an image into tiles visited in a space-filling curve order. Worker threads pull the next tile from a shared
+// counter, so idle threads always take the next pending tile. The measured time of each tile is kept and, with
+// cost_aware, used to dispatch expensive tiles first in later runs (e.g. the next pass of a progressive render).
+struct TileScheduler
+{
+    TileScheduler(int width, int height, const TileSchedulerOptions &options = {});
+
+    int num_tiles() const { return (int)tiles.size(); }
+    int tile_index(int x, int y) const { return (y / options.tile_height) * num_tiles_x + x / options.tile_width; }
+
+    // tile_func(const Tile &) is called exactly once per tile.
+    template <typename Func>
+    void run(const Func &tile_func)
+    {
+        dispatch(dispatch_order(), tile_func);
+    }
+
+    // Same, for a subset of the tiles (row-major indices, e.g. the unconverged tiles of adaptive sampling).
+    template <typename Func>
+    void run(std::span<const int> subset, const Func &tile_func)
+    {
+        dispatch(dispatch_order(subset), tile_func);
+    }
+
+    // pixel_func(x, y, const Tile &).
+    template <typename Func>
+    void run_pixels(const Func &pixel_func)
+    {
+        run([&](const Tile &tile) { visit(tile.index, [&](int x, int y) { pixel_func(x, y, tile); }); });
+    }
+
+    // pixel_func(x, y) for the pixels of one tile, row by row.
+    template <typename Func>
+    void visit(int tile, const Func &pixel_func) const
+    {
+        const Tile &t = tiles[tile];
+        for (int y = t.y_start; y < t.y_end; ++y)
+            for (int x = t.x_start; x < t.x_end; ++x)
+                pixel_func(x, y);
+    }
+
+    const std::vector<int> &dispatch_order();
+    // The given tiles in the order run() would dispatch them.
+    std::vector<int> dispatch_order(std::span<const int> subset) const;
+
+    TileSchedulerOptions options;
+    int width, height;
+    int num_tiles_x, num_tiles_y;
+    // Stored in row-major order.
+    std::vector<Tile> tiles;
+    // Seconds per tile from the last run that included it.
+    std::vector<float> costs;
+    bool has_costs = false;
+
+  private:
+    // With NUMA nodes (see init_parallel), each node takes a contiguous part of the order, i.e. a compact region of the
+    // image with a curve order, and steals from the other parts once its own is done.
+    template <typename Func>
+    void dispatch(const std::vector<int> &order, const Func &tile_func)
+    {
+        int n = (int)order.size();
+        if (n == 0)
+            return;
+        auto run_tile = [&](int i) {
+            int t = order[i];
+            auto start = std::chrono::steady_clock::now();
+            tile_func(tiles[t]);
+            std::chrono::duration<float> duration = std::chrono::steady_clock::now() - start;
+            costs[t] = duration.count();
+        };
+        int num_nodes = num_numa_nodes();
+        if (num_nodes == 1 || n < 2 * num_nodes) {
+            std::atomic<int> next{0};
+            int num_workers = std::min(n, num_system_cores());
+            parallel_for(num_workers, [&](int) {
+                for (int i = next.fetch_add(1, std::memory_order_relaxed); i < n;
+                     i = next.fetch_add(1, std::memory_order_relaxed))
+                    run_tile(i);
+            });
+        } else {
+            std::vector<int64_t> bounds = numa_partition(n);
+            std::vector<std::atomic<int>> next(num_nodes);
+            for (int p = 0; p < num_nodes; ++p)
+                next[p] = (int)bounds[p];
+            numa_run([&](int node) {
+                std::atomic<uint64_t> count{0};
+                int num_workers = std::min((int)(bounds[node + 1] - bounds[node]), numa_node_concurrency(node));
+                parallel_for(num_workers, [&](int) {
+                    for (int k = 0; k < num_nodes; ++k) {
+                        int p = (node + k) % num_nodes;
+                        for (int i = next[p].fetch_add(1, std::memory_order_relaxed); i < bounds[p + 1];
+                             i = next[p].fetch_add(1, std::memory_order_relaxed)) {
+                            run_tile(i);
+                            count.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
+                });
+                return count.load();
+            });
+        }
+        has_costs = true;
+    }
+
+    std::vector<int> curve_order;
+    std::vector<int> cost_order;
+    // Position of each tile in curve_order.
+    std::vector<int> curve_rank;
+};
+
+} // namespace ks
@@ -0,0 +1,221 @@
+#include "viewport.h"
+#include "hash.h"
+#include "light_sampler.h"
+#include "parallel.h"
+#include "wavefront.h"
+#include <algorithm>
+#include <chrono>
+
+namespace ks
+{
+
+ViewportOptions load_viewport_options(const ConfigArgs &args)
+{
+    ViewportOptions options;
+    if (args.contains("levels")) {
+        int n = args["levels"].array_size();
+        options.levels.resize(n);
+        for (int i = 0; i < n; ++i) {
+            options.levels[i] = args["levels"].load_integer(i);
+        }
+    }
+    options.coarse_spp = args.load_integer("coarse_spp", options.coarse_spp);
+    options.max_spp = args.load_integer("max_spp", options.max_spp);
+    options.time_slice = args.load_float("time_slice", options.time_slice);
+    options.termination = load_path_termination_options(args);
+    options.wave_size = args.load_integer("wave_size", options.wave_size);
+    options.seed = (uint32_t)args.load_integer("seed", 0);
+    options.sampler = load_sampler_type(args, "sampler", options.sampler);
+    ASSERT(!options.levels.empty() && options.coarse_spp > 0 && options.max_spp > 0, "Invalid viewport options.");
+    for (int factor : options.levels) {
+        ASSERT(factor >= 1, "Invalid viewport level.");
+    }
+    return options;
+}
+
+Viewport::Viewport(const Scene &scene, std::span<const Light *const> lights, const Camera &camera, int width,
+                   int height, const ViewportOptions &options, const LightSampler *light_sampler)
+    : scene(scene), lights(lights.begin(), lights.end()), light_sampler(light_sampler), camera(camera), width(width),
+      height(height), options(options)
+{
+    ASSERT(!options.levels.empty());
+    worker = std::thread([this]() { worker_loop(); });
+}
+
+Viewport::~Viewport()
+{
+    cancel.store(true, std::memory_order_relaxed);
+    {
+        std::unique_lock<std::mutex> lock(render_mutex);
+        quit = true;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+void Viewport::restart_locked()
+{
+    current_level = 0;
+    level_spp = 0;
+    finished = false;
+    cancel.store(false, std::memory_order_relaxed);
+    wake.notify_one();
+}
+
+bool Viewport::fetch(RenderTarget &display)
+{
+    std::unique_lock<std::mutex> lock(display_mutex);
+    if (version == fetched_version) {
+        return false;
+    }
+    display = latest;
+    fetched_version = version;
+    return true;
+}
+
+void Viewport::worker_loop()
+{
+    std::unique_lock<std::mutex> lock(render_mutex);
+    while (true) {
+        // A pending cancel means modify() is waiting for the mutex: let it through.
+        wake.wait(lock, [&]() { return quit || (!finished && !cancel.load(std::memory_order_relaxed)); });
+        if (quit) {
+            break;
+        }
+        render_pass();
+    }
+}
+
+void Viewport::render_pass()
+{
+    int factor = options.levels[current_level];
+    int w = std::max(width / factor, 1);
+    int h = std::max(height / factor, 1);
+    bool last_level = current_level + 1 == (int)options.levels.size();
+
+    int pass_spp;
+    if (!last_level) {
+        pass_spp = options.coarse_spp - level_spp;
+    } else {
+        // Size full resolution passes to the time slice, from the cost of the previous ones.
+        int budget_spp = seconds_per_spp > 0.0f ? (int)(options.time_slice / seconds_per_spp) : 1;
+        pass_spp = std::clamp(budget_spp, 1, options.max_spp - level_spp);
+    }
+
+    WavefrontOptions wavefront_options;
+    wavefront_options.spp = pass_spp;
+    wavefront_options.termination = options.termination;
+    wavefront_options.wave_size = options.wave_size;
+    // Every pass after a restart gets its own sample sequence.
+    wavefront_options.seed = (uint32_t)hash(options.seed, current_level, level_spp);
+    wavefront_options.sampler = options.sampler;
+    wavefront_options.cancel = &cancel;
+
+    RenderTarget pass(w, h, color3::Zero());
+    auto start = std::chrono::steady_clock::now();
+    render_wavefront(scene, camera, lights, wavefront_options, pass, light_sampler);
+    if (cancel.load(std::memory_order_relaxed)) {
+        return;
+    }
+    float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+    // Coarse passes give a first (pessimistic since per-pass overhead dominates) guess for full resolution.
+    seconds_per_spp = seconds / (float)pass_spp * (float)(factor * factor);
+
+    if (level_spp == 0) {
+        accum = std::move(pass);
+    } else {
+        float weight = (float)pass_spp / (float)(level_spp + pass_spp);
+        parallel_for((int)accum.pixels.size(),
+                     [&](int i) { accum.pixels[i] += (pass.pixels[i] - accum.pixels[i]) * weight; });
+    }
+    level_spp += pass_spp;
+    publish();
+
+    if (!last_level) {
+        if (level_spp >= options.coarse_spp) {
+            ++current_level;
+            level_spp = 0;
+        }
+    } else if (level_spp >= options.max_spp) {
+        finished = true;
+    }
+}
+
+void Viewport::publish()
+{
+    int factor = options.levels[current_level];
+    std::unique_lock<std::mutex> lock(display_mutex);
+    if (latest.width != width || latest.height != height) {
+        latest = RenderTarget(width, height, color3::Zero());
+    }
+    // Nearest neighbour upsampling, so that coarse levels show as blocks.
+    parallel_for(height, [&](int y) {
+        int sy = std::min(y / factor, accum.height - 1);
+        for (int x = 0; x < width; ++x) {
+            int sx = std::min(x / factor, accum.width - 1);
+            latest(x, y) = accum(sx, sy);
+        }
+    });
+    ++version;
+    published_level.store(current_level, std::memory_order_relaxed);
+    published_spp.store(level_spp, std::memory_order_relaxed);
+}
+
+void render_viewport_task(const ConfigArgs &args, const fs::path &task_dir, int task_id)
+{
+    float duration = args.load_float("duration", 10.0f);
+    float display_rate = args.load_float("display_rate", 60.0f);
+    bool animate_camera = args.load_bool("animate_camera", false);
+    ASSERT(duration > 0.0f && display_rate > 0.0f, "Invalid viewport duration or display rate.");
+
+    args.update_time(0.0f);
+    std::unique_ptr<WavefrontTask> task = load_wavefront_task(args, task_dir);
+    ViewportOptions options;
+    if (args.contains("viewport")) {
+        options = load_viewport_options(args["viewport"]);
+    }
+    int last_level = (int)options.levels.size() - 1;
+
+    using clock = std::chrono::steady_clock;
+    auto frame_interval = std::chrono::duration<float>(1.0f / display_rate);
+    RenderTarget display(task->width, task->height, color3::Zero());
+    Viewport viewport(*task->scene, task->light_ptrs, *task->camera, task->width, task->height, options,
+                      task->light_sampler.get());
+    auto start = clock::now();
+    auto restart = start;
+    int shown_level = -1;
+    int n_frames = 0;
+    int n_restarts = 0;
+    while (true) {
+        auto frame_start = clock::now();
+        float t = std::chrono::duration<float>(frame_start - start).count();
+        if (t >= duration) {
+            break;
+        }
+        if (animate_camera && n_frames > 0) {
+            args.update_time(t / duration);
+            viewport.set_camera(*create_camera(args["camera"]));
+            restart = clock::now();
+            shown_level = -1;
+            ++n_restarts;
+        }
+        if (viewport.fetch(display) && viewport.level() != shown_level) {
+            shown_level = viewport.level();
+            float latency = std::chrono::duration<float>(clock::now() - restart).count();
+            printf("Viewport level %d shown %.3f sec after the last restart.\n", shown_level, latency);
+        }
+        ++n_frames;
+        if (viewport.level() == last_level && viewport.spp() >= options.max_spp) {
+            break;
+        }
+        std::this_thread::sleep_until(frame_start + frame_interval);
+    }
+    // The worker may have published after the last poll.
+    viewport.fetch(display);
+    std::chrono::duration<double> elapsed = clock::now() - start;
+    printf("Viewport ran %d frames (%d restarts) in %.3f sec, at level %d with %d spp.\n", n_frames, n_restarts,
+           elapsed.count(), viewport.level(), viewport.spp());
+    display.save_layers_to_exr_async(task_dir / "viewport.exr", task->exr_options);
+}
+
+} // namespace ks
\ No newline at end of file
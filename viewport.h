@@ -0,0 +1,128 @@
+#pragma once
+#include "camera.h"
+#include "config.h"
+#include "path_termination.h"
+#include "render_target.h"
+#include "sampler.h"
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace ks
+{
+
+struct Scene;
+struct Light;
+struct LightSampler;
+
+struct ViewportOptions
+{
+    // Downsampling factors of the passes after a restart, coarsest first. The last level should be 1 (full res).
+    std::vector<int> levels = {8, 4, 2, 1};
+    // Samples per pixel at each coarse level before moving to the next one.
+    int coarse_spp = 1;
+    // Full resolution accumulation stops here.
+    int max_spp = 4096;
+    // Target wall-clock seconds per full resolution pass. The image is published after every pass, so this bounds
+    // the time between two refinements. Restarts are picked up after at most one wave.
+    float time_slice = 1.0f / 30.0f;
+    PathTerminationOptions termination;
+    // Smaller than the batch default so that a restart cancels quickly.
+    int wave_size = 1 << 16;
+    uint32_t seed = 0;
+    SamplerType sampler = SamplerType::PMJ02;
+};
+
+ViewportOptions load_viewport_options(const ConfigArgs &args);
+
+// Interactive progressive renderer. A worker thread renders the scene with the wavefront path tracer, starting at a
+// fraction of the resolution and refining over passes. Any camera or scene change cancels the pass in flight and
+// starts over from the coarsest level. The GUI thread polls fetch() every frame and never waits for rendering.
+struct Viewport
+{
+    Viewport(const Scene &scene, std::span<const Light *const> lights, const Camera &camera, int width, int height,
+             const ViewportOptions &options = {}, const LightSampler *light_sampler = nullptr);
+    ~Viewport();
+
+    Viewport(const Viewport &) = delete;
+    Viewport &operator=(const Viewport &) = delete;
+
+    void set_camera(const Camera &camera)
+    {
+        modify([&]() { this->camera = camera; });
+    }
+
+    // Calls edit() while the worker is paused, so that the scene, materials or lights can be changed safely, then
+    // restarts. edit() runs on the calling thread.
+    template <typename Func>
+    void modify(const Func &edit)
+    {
+        cancel.store(true, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(render_mutex);
+        edit();
+        restart_locked();
+    }
+
+    // Copies the latest full resolution image (coarse levels are upsampled) into display if there is a newer one.
+    bool fetch(RenderTarget &display);
+
+    // Of the last published image.
+    int level() const { return published_level.load(std::memory_order_relaxed); }
+    int spp() const { return published_spp.load(std::memory_order_relaxed); }
+
+  private:
+    void restart_locked();
+    void worker_loop();
+    void render_pass();
+    void publish();
+
+    const Scene &scene;
+    std::vector<const Light *> lights;
+    const LightSampler *light_sampler = nullptr;
+    Camera camera;
+    int width, height;
+    ViewportOptions options;
+
+    // Worker state, guarded by render_mutex.
+    std::mutex render_mutex;
+    std::condition_variable wake;
+    std::atomic<bool> cancel{false};
+    bool quit = false;
+    bool finished = false;
+    int current_level = 0;
+    int level_spp = 0;
+    // Estimate of the cost of one full resolution sample per pixel, <= 0 if unknown.
+    float seconds_per_spp = 0.0f;
+    RenderTarget accum;
+
+    std::mutex display_mutex;
+    RenderTarget latest;
+    uint64_t version = 0;
+    uint64_t fetched_version = 0;
+    std::atomic<int> published_level{0};
+    std::atomic<int> published_spp{0};
+
+    std::thread worker;
+};
+
+// Drives a Viewport the way a window loop would, without a window: polls it at display_rate and, with
+// animate_camera, moves the camera along its keyframes over duration so that every frame restarts the render.
+// Prints when each level is first shown (the latency a user would see) and writes the last image to
+// task_dir/viewport.exr. Stops after duration seconds, or when the full resolution pass reaches max_spp.
+//
+// ...                  # same arguments as render_wavefront_task (scene, camera, lights, ...)
+// duration = 10.0
+// display_rate = 60.0
+// animate_camera = false
+// [viewport]           # see load_viewport_options
+// levels = [8, 4, 2, 1]
+// max_spp = 4096
+void render_viewport_task(const ConfigArgs &args, const fs::path &task_dir, int task_id);
+
+} // namespace ks
\ No newline at end of file
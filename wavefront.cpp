@@ -0,0 +1,927 @@
+#include "wavefront.h"
+#include "camera.h"
+#include "file_util.h"
+#include "light.h"
+#include "light_sampler.h"
+#include "material.h"
+#include "mesh_asset.h"
+#include "mesh_light.h"
+#include "nee.h"
+#include "parallel.h"
+#include "principled_bsdf.h"
+#include "render_target.h"
+#include "residency.h"
+#include "sampler.h"
+#include "sobol.h"
+#include "stats.h"
+#include "scene.h"
+#include "subsurface.h"
+#include "texture_cache.h"
+#include <chrono>
+#include <optional>
+#include <tuple>
+
+namespace ks
+{
+
+struct PathState
+{
+    color3 L = color3::Zero();
+    color3 beta = color3::Ones();
+    Sampler sampler;
+    bool active = true;
+    LobeBounces lobe_bounces = {};
+    // For the direct and indirect AOVs: L after the first bounce, and the lobe sampled there.
+    color3 L_direct = color3::Zero();
+    LobeType first_lobe = LobeType::Diffuse;
+    // First-hit AOVs, added with the others once the sample is done (see RenderTarget::enable_aov).
+    color3 albedo = color3::Zero();
+    vec3 normal = vec3::Zero();
+    float hit_depth = 0.0f;
+    // Recorded bounces for training the path guide. The last one waits for its L_mark while guide_open.
+    uint32_t num_guide_vertices = 0;
+    // Radiance cache: hits recorded for training it, the viewer position its levels of detail are relative to, and
+    // the footprint of the path (Mueller et al. 2021's spread heuristic) with the solid angle pdf of the last bounce.
+    uint32_t num_cache_vertices = 0;
+    vec3 view_pos = vec3::Zero();
+    float spread = 0.0f;
+    float bounce_pdf = 0.0f;
+    bool guide_open = false;
+    // Render cost of the sample, only recorded for the cost AOVs (see AOV::Cycles).
+    uint64_t cycles = 0;
+    uint32_t rays = 0;
+    uint32_t depth = 0;
+    uint32_t subsurface_steps = 0;
+};
+
+// A bounce recorded for training the path guide. The radiance arriving at p from wi is recovered from the final L of
+// the path: (L - L_mark) / beta + L_escaped.
+struct GuideVertex
+{
+    vec3 p;
+    vec3 wi;
+    float pdf;
+    // Throughput that contributions from further along wi are scaled by.
+    color3 beta;
+    // L of the path before any contribution from further along wi.
+    color3 L_mark;
+    // Lights seen along wi, escaped or hit (not added to L since NEE accounts for them).
+    color3 L_escaped;
+};
+
+// A hit recorded for training the radiance cache. The radiance scattered off it is (L - L_mark) / beta.
+struct CacheVertex
+{
+    vec3 p;
+    vec3 n;
+    color3 beta;
+    color3 L_mark;
+};
+
+struct ShadeKey
+{
+    bool operator<(const ShadeKey &other) const
+    {
+        return std::tie(material, subscene_id, geom_id, slot) <
+               std::tie(other.material, other.subscene_id, other.geom_id, other.slot);
+    }
+
+    const Material *material = nullptr;
+    uint32_t subscene_id = 0;
+    uint32_t geom_id = 0;
+    uint32_t slot = 0;
+};
+
+int render_wavefront(const Scene &scene, const Camera &camera, std::span<const Light *const> lights,
+                     const WavefrontOptions &options, RenderTarget &rt, const LightSampler *light_sampler,
+                     const CameraMotion *camera_motion)
+{
+    ASSERT(scene.are_material_assigned(), "Wavefront rendering requires all materials to be assigned.");
+
+    int width = rt.width;
+    int height = rt.height;
+    uint32_t num_pixels = (uint32_t)(width * height);
+    uint32_t wave_size = std::min((uint32_t)options.wave_size, num_pixels);
+    uint32_t stream_size = (uint32_t)options.stream_size;
+
+    std::vector<PathState> paths(wave_size);
+    std::vector<uint32_t> active(wave_size);
+    // Camera samples of the generate stage, by path.
+    std::vector<vec2> film_samples(wave_size);
+    std::vector<vec2> lens_samples(wave_size);
+    // Indexed by slot in the active list, not by path.
+    std::vector<Ray> rays(wave_size);
+    std::vector<SceneHit> hits(wave_size);
+    std::vector<uint8_t> found(wave_size);
+    std::vector<ShadeKey> shade_order(wave_size);
+    // Compaction buffers for sort_by_prototype.
+    std::vector<uint32_t> next_active;
+    std::vector<Ray> next_rays(options.sort_by_prototype ? wave_size : 0);
+    std::optional<PathGuide> guide;
+    std::vector<GuideVertex> guide_vertices;
+    const PathTerminationOptions &termination = options.termination;
+    int max_depth = termination.max_depth;
+    bool record_cost = rt.has_aov(AOV::Cycles) || rt.has_aov(AOV::RayCount) || rt.has_aov(AOV::PathDepth) ||
+                       rt.has_aov(AOV::SubsurfaceSteps);
+    if (options.guiding) {
+        guide.emplace(scene.bound(), options.guiding_options);
+        guide_vertices.resize((size_t)wave_size * max_depth);
+    }
+    // Samples per pixel rendered (in this call) while training the guide.
+    int guide_trained_spp = 0;
+    std::optional<RadianceCache> cache;
+    std::vector<CacheVertex> cache_vertices;
+    if (options.radiance_caching) {
+        cache.emplace(scene.bound(), options.radiance_cache_options);
+        cache_vertices.resize((size_t)wave_size * max_depth);
+    }
+    int cache_warmup_spp = 0;
+
+    std::optional<AdaptiveScheduler> scheduler;
+    if (options.adaptive) {
+        scheduler.emplace(width, height, options.adaptive_options, options.tile_options);
+    }
+    // Pixels to sample in the current pass, tile by tile in curve order so that each wave (and each NUMA node's band
+    // of it) covers a compact region of the image. Adaptive sampling shrinks this after each pass.
+    TileScheduler tiling = scheduler ? scheduler->tiling : TileScheduler(width, height, options.tile_options);
+    std::vector<uint32_t> pixel_list;
+    pixel_list.reserve(num_pixels);
+    for (int tile : tiling.dispatch_order())
+        tiling.visit(tile, [&](int x, int y) { pixel_list.push_back(rt.index(x, y)); });
+    const DistributedOptions &distributed = options.distributed_options;
+    int sample_begin = 0;
+    int sample_end = options.spp;
+    if (options.distributed) {
+        ASSERT(!options.adaptive || distributed.split == DistributedSplit::Tiles,
+               "Adaptive sampling can only be distributed by tiles.");
+        std::tie(sample_begin, sample_end) = distributed.sample_range(options.spp);
+        distributed.filter_pixels(rt, tiling, pixel_list);
+        if (scheduler)
+            distributed.filter_tiles(scheduler->tiles);
+    }
+    // Progressive, adaptive and distributed rendering accumulate into the per-pixel statistics, otherwise samples are
+    // directly averaged into the pixels.
+    const ProgressiveOptions &progressive = options.progressive_options;
+    if (options.adaptive || options.progressive || options.distributed) {
+        rt.enable_statistics();
+    }
+
+    bool done = false;
+    if (options.progressive && progressive.resume) {
+        int samples_taken = rt.load_checkpoint(progressive.checkpoint_path);
+        if (samples_taken >= 0) {
+            ASSERT(rt.has_statistics(), "Checkpoint was not written by a progressive render.");
+            sample_begin = samples_taken;
+            printf("Resuming from checkpoint [%s] at %d spp.\n", progressive.checkpoint_path.string().c_str(),
+                   sample_begin);
+            if (scheduler) {
+                done = !scheduler->resume(rt, sample_begin);
+                if (options.distributed)
+                    distributed.filter_tiles(scheduler->tiles);
+                scheduler->active_pixels(rt, pixel_list);
+            }
+        }
+    }
+    if (!scheduler) {
+        done = sample_begin >= sample_end;
+    }
+
+    using clock = std::chrono::steady_clock;
+    clock::time_point start_time = clock::now();
+    clock::time_point last_checkpoint_time = start_time;
+    float inv_spp = 1.0f / (float)options.spp;
+    CameraRaySetup camera_setup = camera.ray_setup(vec2i(width, height), options.spp);
+    SobolSeedTable seed_table;
+    if (options.sampler == SamplerType::Sobol || options.sampler == SamplerType::PMJ02) {
+        seed_table = SobolSeedTable(width, height, options.seed);
+    }
+    bool canceled = false;
+    while (!done) {
+        clock::time_point pass_start_time = clock::now();
+        int pass_spp;
+        if (scheduler) {
+            pass_spp = scheduler->next_pass_spp();
+        } else if (options.progressive) {
+            pass_spp = std::min(progressive.spp_per_pass, sample_end - sample_begin);
+        } else {
+            pass_spp = sample_end - sample_begin;
+        }
+        bool train = guide && guide_trained_spp < guide->options.training_spp;
+        if (train && !scheduler) {
+            // Training passes double in length, each one sampling the guide learned from all previous ones.
+            pass_spp = std::min(pass_spp, 1 << std::min(guide->iteration, 16));
+        }
+        if (cache && cache_warmup_spp < cache->options.warmup_spp && !scheduler) {
+            pass_spp = std::min(pass_spp, 1 << std::min(cache->iteration, 16));
+        }
+        const PathGuide *guide_ptr = guide ? &*guide : nullptr;
+        uint32_t num_pass_pixels = (uint32_t)pixel_list.size();
+        for (int s = sample_begin; s < sample_begin + pass_spp; ++s) {
+            for (uint32_t wave_start = 0; wave_start < num_pass_pixels; wave_start += wave_size) {
+                if (options.cancel && options.cancel->load(std::memory_order_relaxed)) {
+                    canceled = true;
+                    break;
+                }
+                uint32_t n = std::min(wave_size, num_pass_pixels - wave_start);
+
+                // 1. generate
+                // NOTE: the per-slot stages run through numa_parallel_for, so that with NUMA nodes each node keeps the
+                // same band of the wave (and its image rows) through all stages and bounces.
+                active.resize(n);
+                numa_parallel_for(n, [&](uint32_t i) {
+                    vec2i xy = rt.coords(pixel_list[wave_start + i]);
+                    int x = xy.x();
+                    int y = xy.y();
+                    PathState &path = paths[i];
+                    path = PathState();
+                    path.sampler = Sampler(options.sampler, options.seed);
+                    path.sampler.seed_table = seed_table.seeds.empty() ? nullptr : &seed_table;
+                    path.sampler.start_pixel_sample(vec2i(x, y), (uint32_t)s);
+                    vec2 u = path.sampler.next2d();
+                    vec2 film_pos((x + u.x()) / (float)width, (y + u.y()) / (float)height);
+                    if (camera_motion) {
+                        float time = path.sampler.next();
+                        // Only draw lens samples with a lens so that pinhole renders keep their sequences.
+                        vec2 u_lens = camera_motion->has_lens() ? path.sampler.next2d() : vec2::Zero();
+                        rays[i] = camera_motion->spawn_ray(film_pos, u_lens, vec2i(width, height), options.spp, time);
+                        path.view_pos = rays[i].origin;
+                    } else {
+                        film_samples[i] = film_pos;
+                        lens_samples[i] = camera_setup.lens.enabled() ? path.sampler.next2d() : vec2::Zero();
+                    }
+                    active[i] = i;
+                });
+                // Without motion, the rays of a stream come from the per-frame camera setup in one batch.
+                if (!camera_motion) {
+                    uint32_t num_streams = (n + stream_size - 1) / stream_size;
+                    numa_parallel_for(num_streams, [&](uint32_t c) {
+                        uint32_t begin = c * stream_size;
+                        uint32_t count = std::min(stream_size, n - begin);
+                        camera_setup.spawn_rays({film_samples.data() + begin, count},
+                                                {lens_samples.data() + begin, count}, {rays.data() + begin, count});
+                        for (uint32_t i = begin; i < begin + count; ++i)
+                            paths[i].view_pos = rays[i].origin;
+                    });
+                }
+
+                for (int depth = 0; !active.empty(); ++depth) {
+                    uint32_t num_active = (uint32_t)active.size();
+                    uint32_t num_streams = (num_active + stream_size - 1) / stream_size;
+
+                    // 2. intersect
+                    numa_parallel_for(num_streams, [&](uint32_t c) {
+                        uint32_t begin = c * stream_size;
+                        uint32_t count = std::min(stream_size, num_active - begin);
+                        uint64_t start = record_cost ? read_cycle_counter() : 0;
+                        scene.intersect_stream({rays.data() + begin, count}, {hits.data() + begin, count},
+                                               {found.data() + begin, count}, depth == 0);
+                        if (record_cost) {
+                            // The rays of a stream share its traversal cost.
+                            uint64_t share = (read_cycle_counter() - start) / count;
+                            for (uint32_t k = begin; k < begin + count; ++k) {
+                                PathState &path = paths[active[k]];
+                                path.cycles += share;
+                                ++path.rays;
+                                ++path.depth;
+                            }
+                        }
+                    });
+
+                    // 3. sort hits so that each shading stream mostly runs the same material code
+                    shade_order.resize(num_active);
+                    parallel_for(num_active, [&](uint32_t k) {
+                        ShadeKey &key = shade_order[k];
+                        key.slot = k;
+                        if ((options.sort_by_material || options.sort_by_prototype) && found[k]) {
+                            key.material = hits[k].material;
+                            key.subscene_id = hits[k].subscene_id;
+                            key.geom_id = hits[k].geom_id;
+                        } else {
+                            // Misses go first.
+                            key.material = nullptr;
+                            key.subscene_id = key.geom_id = 0;
+                        }
+                    });
+                    if (options.sort_by_material || options.sort_by_prototype) {
+                        parallel_sort(shade_order.begin(), shade_order.end());
+                    }
+
+                    // 4. shade and 5. trace shadow rays of the same stream
+                    numa_parallel_for(num_streams, [&](uint32_t c) {
+                        static thread_local ShadowRayQueue shadow_queue;
+                        static thread_local BSDFEvalBatch eval_batch;
+                        static thread_local std::vector<uint8_t> occluded;
+                        // Random walks queued by the materials of this stream (batch_subsurface), with the slot and
+                        // the partial sample of their path.
+                        static thread_local std::vector<SubsurfaceWalk> walks;
+                        static thread_local std::vector<Sampler *> walk_samplers;
+                        static thread_local std::vector<uint32_t> walk_slots;
+                        static thread_local std::vector<MaterialSample> walk_partials;
+                        // Escaped rays of this stream that need the infinite lights, in shading order.
+                        static thread_local std::vector<vec3> escaped_origins;
+                        static thread_local std::vector<vec3> escaped_dirs;
+                        static thread_local std::vector<color3> escaped_L;
+                        static thread_local std::vector<color3> light_L;
+                        shadow_queue.clear();
+                        eval_batch.clear();
+                        shadow_queue.eval_batch = options.batch_bsdf_eval ? &eval_batch : nullptr;
+                        walks.clear();
+                        walk_samplers.clear();
+                        walk_slots.clear();
+                        walk_partials.clear();
+                        ThreadLocalArena &arena = scratch_arena();
+                        // With record_cost, each slot is charged the cycles until the next one is shaded.
+                        uint32_t charged_slot = ~0u;
+                        uint64_t charge_start = 0;
+                        auto charge = [&](uint32_t k) {
+                            uint64_t now = read_cycle_counter();
+                            if (charged_slot != ~0u)
+                                paths[active[charged_slot]].cycles += now - charge_start;
+                            charged_slot = k;
+                            charge_start = now;
+                        };
+
+                        // Everything after the material of the hit in slot k is sampled.
+                        auto continue_path = [&](uint32_t k, const MaterialSample &ms, const vec3 &wi,
+                                                 const Intersection &exit) {
+                            PathState &path = paths[active[k]];
+                            const SceneHit &hit = hits[k];
+                            path.L += path.beta * ms.Ld;
+                            path.beta *= ms.beta;
+                            path.bounce_pdf = ms.pdf;
+                            arena.reset();
+                            if (depth == 0 && rt.has_aovs()) {
+                                path.first_lobe = ms.lobe;
+                                path.albedo = ms.beta;
+                            }
+
+                            if (path.beta.maxCoeff() == 0.0f ||
+                                termination.exceeds_depth(depth, ms.lobe, path.lobe_bounces)) {
+                                path.active = false;
+                                return;
+                            }
+                            float expected_ratio = -1.0f;
+                            if (termination.rr.mode == RussianRouletteMode::Efficiency && guide &&
+                                rt.has_statistics()) {
+                                // Expected contribution of the rest of the path relative to the pixel so far.
+                                uint32_t pixel = pixel_list[wave_start + active[k]];
+                                float pixel_estimate = luminance(rt.stats[pixel].mean);
+                                if (rt.stats[pixel].count > 0 && pixel_estimate > 0.0f)
+                                    expected_ratio =
+                                        luminance(path.beta) * guide->radiance_estimate(exit.p) / pixel_estimate;
+                            }
+                            if (depth >= termination.rr.start_depth &&
+                                !termination.rr.survive(path.beta, depth, path.sampler.next(), expected_ratio)) {
+                                path.active = false;
+                                return;
+                            }
+                            if (train && ms.pdf > 0.0f) {
+                                GuideVertex &v = guide_vertices[(size_t)active[k] * max_depth +
+                                                                path.num_guide_vertices++];
+                                v.p = exit.p;
+                                v.wi = wi;
+                                v.pdf = ms.pdf;
+                                v.beta = path.beta;
+                                v.L_mark = v.L_escaped = color3::Zero();
+                                path.guide_open = true;
+                            }
+                            float time = rays[k].time;
+                            rays[k] = spawn_ray<OffsetType::NextBounce>(exit.p, wi, exit.frame.n, 0.0f, inf);
+                            rays[k].time = time;
+                            if (hit.it.has_uv_partials()) {
+                                // NOTE: approximate differentials that keep the footprint of this hit and ignore the
+                                // spread of the BSDF lobe. Cheap, and later texture lookups stay filtered.
+                                Ray &next = rays[k];
+                                next.rx_origin = next.origin + hit.it.dpdx;
+                                next.ry_origin = next.origin + hit.it.dpdy;
+                                next.rx_dir = next.ry_dir = next.dir;
+                            }
+                        };
+
+                        uint32_t begin = c * stream_size;
+                        uint32_t end = std::min(begin + stream_size, num_active);
+                        // Escaped rays after the first bounce are already accounted for by NEE (only kept for
+                        // guiding). Each infinite light evaluates all of them in one eval_n call.
+                        escaped_origins.clear();
+                        escaped_dirs.clear();
+                        for (uint32_t j = begin; j < end; ++j) {
+                            uint32_t k = shade_order[j].slot;
+                            if (!found[k] && (depth == 0 || paths[active[k]].guide_open)) {
+                                escaped_origins.push_back(rays[k].origin);
+                                escaped_dirs.push_back(rays[k].dir);
+                            }
+                        }
+                        escaped_L.assign(escaped_dirs.size(), color3::Zero());
+                        light_L.resize(escaped_dirs.size());
+                        if (!escaped_dirs.empty()) {
+                            for (const Light *light : lights) {
+                                if (light->delta() || !light->infinite())
+                                    continue;
+                                light->eval_n(escaped_origins, escaped_dirs, light_L);
+                                for (size_t i = 0; i < light_L.size(); ++i)
+                                    escaped_L[i] += light_L[i];
+                            }
+                        }
+                        uint32_t num_escaped = 0;
+                        for (uint32_t j = begin; j < end; ++j) {
+                            uint32_t k = shade_order[j].slot;
+                            if (record_cost)
+                                charge(k);
+                            PathState &path = paths[active[k]];
+                            const Ray &ray = rays[k];
+                            GuideVertex *guide_vertex = nullptr;
+                            if (path.guide_open) {
+                                guide_vertex = &guide_vertices[(size_t)active[k] * max_depth +
+                                                               path.num_guide_vertices - 1];
+                                guide_vertex->L_mark = path.L;
+                                path.guide_open = false;
+                            }
+                            if (!found[k]) {
+                                if (depth == 0) {
+                                    path.L += path.beta * escaped_L[num_escaped++];
+                                } else if (guide_vertex) {
+                                    guide_vertex->L_escaped += escaped_L[num_escaped++];
+                                }
+                                path.active = false;
+                                continue;
+                            }
+
+                            const SceneHit &hit = hits[k];
+                            // Like escaped rays, emitters hit after the first bounce are accounted for by NEE.
+                            if (depth == 0) {
+                                path.L += path.beta * emitted_radiance(hit, -ray.dir);
+                            } else if (guide_vertex) {
+                                guide_vertex->L_escaped += emitted_radiance(hit, -ray.dir);
+                            }
+                            if (depth == 0 && rt.has_aovs()) {
+                                path.normal = hit.it.sh_frame.n;
+                                path.hit_depth = (hit.it.p - ray.origin).norm();
+                            }
+                            if (cache) {
+                                // Delta bounces (pdf 0) don't widen the footprint.
+                                float cos = std::abs(hit.it.frame.n.dot(ray.dir));
+                                if (depth > 0 && path.bounce_pdf > 0.0f && cos > 0.0f)
+                                    path.spread += (hit.it.p - ray.origin).norm() / std::sqrt(path.bounce_pdf * cos);
+                                color3 L_cache;
+                                if (depth > 0 && cache->iteration > 0 &&
+                                    path.spread > cache->options.footprint_threshold *
+                                                      cache->cell_size(hit.it.p, path.view_pos) &&
+                                    cache->lookup(hit.it.p, hit.it.frame.n, path.view_pos, L_cache)) {
+                                    path.L += path.beta * L_cache;
+                                    path.active = false;
+                                    continue;
+                                }
+                                if (path.num_cache_vertices < (uint32_t)max_depth) {
+                                    CacheVertex &v = cache_vertices[(size_t)active[k] * max_depth +
+                                                                    path.num_cache_vertices++];
+                                    v.p = hit.it.p;
+                                    v.n = hit.it.frame.n;
+                                    v.beta = path.beta;
+                                    v.L_mark = path.L;
+                                }
+                            }
+                            LocalGeometry local_geom{&scene, hit.geom_id, hit.inst_path};
+                            shadow_queue.path_id = active[k];
+                            shadow_queue.beta = path.beta;
+                            vec3 wi;
+                            Intersection exit;
+                            MaterialSample ms;
+                            if (options.batch_subsurface) {
+                                walks.emplace_back();
+                                if (hit.material->begin_sample_with_direct(-ray.dir, hit.it, scene, local_geom, lights,
+                                                                           path.sampler, wi, exit, ms, walks.back(),
+                                                                           &shadow_queue, light_sampler, guide_ptr)) {
+                                    walk_samplers.push_back(&path.sampler);
+                                    walk_slots.push_back(k);
+                                    walk_partials.push_back(ms);
+                                    arena.reset();
+                                    continue;
+                                }
+                                walks.pop_back();
+                            } else {
+                                ms = hit.material->sample_with_direct(-ray.dir, hit.it, scene, local_geom, lights,
+                                                                      path.sampler, wi, exit, &shadow_queue,
+                                                                      light_sampler, guide_ptr);
+                            }
+                            continue_path(k, ms, wi, exit);
+                        }
+
+                        if (record_cost)
+                            charge(~0u);
+
+                        if (!walks.empty()) {
+                            uint64_t walk_start = record_cost ? read_cycle_counter() : 0;
+                            subsurface_random_walk_n(walks, walk_samplers);
+                            uint64_t walk_share = record_cost ? (read_cycle_counter() - walk_start) / walks.size() : 0;
+                            for (uint32_t w = 0; w < (uint32_t)walks.size(); ++w) {
+                                uint32_t k = walk_slots[w];
+                                PathState &path = paths[active[k]];
+                                if (record_cost) {
+                                    charge(k);
+                                    path.cycles += walk_share;
+                                    path.rays += walks[w].steps;
+                                    path.subsurface_steps += walks[w].steps;
+                                }
+                                shadow_queue.path_id = active[k];
+                                shadow_queue.beta = path.beta;
+                                vec3 wi;
+                                Intersection exit;
+                                MaterialSample ms = hits[k].material->finish_sample_with_direct(
+                                    walks[w], walk_partials[w], scene, lights, path.sampler, wi, exit, &shadow_queue,
+                                    light_sampler, guide_ptr);
+                                continue_path(k, ms, wi, exit);
+                            }
+                        }
+
+                        if (record_cost)
+                            charge(~0u);
+
+                        flush_deferred(shadow_queue);
+                        occluded.resize(shadow_queue.size());
+                        uint64_t shadow_start = record_cost ? read_cycle_counter() : 0;
+                        scene.occlude_stream(shadow_queue.rays, occluded);
+                        if (record_cost && shadow_queue.size() > 0) {
+                            uint64_t share = (read_cycle_counter() - shadow_start) / shadow_queue.size();
+                            for (uint32_t j = 0; j < shadow_queue.size(); ++j) {
+                                PathState &path = paths[shadow_queue.path_ids[j]];
+                                path.cycles += share;
+                                ++path.rays;
+                            }
+                        }
+                        for (uint32_t j = 0; j < shadow_queue.size(); ++j) {
+                            if (!occluded[j])
+                                paths[shadow_queue.path_ids[j]].L += shadow_queue.contribs[j];
+                        }
+                    });
+
+                    if (depth == 0 && rt.has_aovs()) {
+                        // Everything up to here is direct lighting of the first hit, including its shadow rays.
+                        parallel_for(n, [&](uint32_t i) { paths[i].L_direct = paths[i].L; });
+                    }
+
+                    // Compact active paths.
+                    uint32_t m = 0;
+                    if (options.sort_by_prototype) {
+                        next_active.clear();
+                        for (uint32_t j = 0; j < num_active; ++j) {
+                            uint32_t k = shade_order[j].slot;
+                            if (paths[active[k]].active) {
+                                next_active.push_back(active[k]);
+                                next_rays[m++] = rays[k];
+                            }
+                        }
+                        std::swap(active, next_active);
+                        std::swap(rays, next_rays);
+                    } else {
+                        for (uint32_t k = 0; k < num_active; ++k) {
+                            if (paths[active[k]].active) {
+                                active[m] = active[k];
+                                rays[m] = rays[k];
+                                ++m;
+                            }
+                        }
+                        active.resize(m);
+                    }
+                    // Nothing refers to the geometries of this bounce anymore.
+                    if (scene.residency)
+                        scene.residency->trim();
+                }
+
+                numa_parallel_for(n, [&](uint32_t i) {
+                    uint32_t pixel = pixel_list[wave_start + i];
+                    if (!options.nonfinite_log) {
+                        ASSERT_HOT(paths[i].L.allFinite());
+                    } else if (!options.nonfinite_log->check(pixel, s, paths[i].L)) {
+                        // Counted as a black sample so that the sample counts stay consistent.
+                        paths[i].L = paths[i].L_direct = color3::Zero();
+                        paths[i].num_guide_vertices = 0;
+                        paths[i].num_cache_vertices = 0;
+                    }
+                    if (rt.has_aovs()) {
+                        // The count first: half AOVs are running means over it.
+                        rt.add_aov(pixel, AOV::SampleCount, 1.0f);
+                        if (rt.has_aov(AOV::Albedo))
+                            rt.add_aov(pixel, AOV::Albedo, paths[i].albedo);
+                        if (rt.has_aov(AOV::Normal))
+                            rt.add_aov(pixel, AOV::Normal, paths[i].normal);
+                        if (rt.has_aov(AOV::Depth))
+                            rt.add_aov(pixel, AOV::Depth, paths[i].hit_depth);
+                        if (rt.has_aov(AOV::Direct))
+                            rt.add_aov(pixel, AOV::Direct, paths[i].L_direct);
+                        AOV indirect = (AOV)((int)AOV::IndirectDiffuse + (int)paths[i].first_lobe);
+                        if (rt.has_aov(indirect))
+                            rt.add_aov(pixel, indirect, paths[i].L - paths[i].L_direct);
+                        if (record_cost) {
+                            if (rt.has_aov(AOV::Cycles))
+                                rt.add_aov(pixel, AOV::Cycles, (float)paths[i].cycles);
+                            if (rt.has_aov(AOV::RayCount))
+                                rt.add_aov(pixel, AOV::RayCount, (float)paths[i].rays);
+                            if (rt.has_aov(AOV::PathDepth))
+                                rt.add_aov(pixel, AOV::PathDepth, (float)paths[i].depth);
+                            if (rt.has_aov(AOV::SubsurfaceSteps))
+                                rt.add_aov(pixel, AOV::SubsurfaceSteps, (float)paths[i].subsurface_steps);
+                        }
+                    }
+                    for (uint32_t j = 0; j < paths[i].num_guide_vertices; ++j) {
+                        const GuideVertex &v = guide_vertices[(size_t)i * max_depth + j];
+                        color3 Li = (v.beta > 0.0f).select((paths[i].L - v.L_mark) / v.beta, 0.0f) + v.L_escaped;
+                        guide->record(v.p, v.wi, luminance(Li), v.pdf);
+                    }
+                    for (uint32_t j = 0; j < paths[i].num_cache_vertices; ++j) {
+                        const CacheVertex &v = cache_vertices[(size_t)i * max_depth + j];
+                        cache->record(v.p, v.n, paths[i].view_pos,
+                                      (v.beta > 0.0f).select((paths[i].L - v.L_mark) / v.beta, 0.0f));
+                    }
+                    if (rt.has_statistics()) {
+                        rt.add_sample(pixel, paths[i].L);
+                    } else {
+                        rt.pixels[pixel] += paths[i].L * inv_spp;
+                    }
+                });
+            }
+            if (canceled)
+                break;
+        }
+        // The partial pass is left in rt but not counted.
+        if (canceled)
+            break;
+        sample_begin += pass_spp;
+        if (train) {
+            guide->update();
+            guide_trained_spp += pass_spp;
+        }
+        if (cache) {
+            cache->update();
+            cache_warmup_spp += pass_spp;
+        }
+        if (scheduler) {
+            done = !scheduler->update(rt);
+            if (!done)
+                scheduler->active_pixels(rt, pixel_list);
+        } else {
+            done = sample_begin >= sample_end;
+        }
+        if (!options.progressive)
+            continue;
+
+        clock::time_point now = clock::now();
+        float elapsed = std::chrono::duration<float>(now - start_time).count();
+        float pass_seconds = std::chrono::duration<float>(now - pass_start_time).count();
+        // Assume the next pass takes as long as the last one.
+        bool out_of_time = !done && progressive.time_budget > 0.0f && elapsed + pass_seconds > progressive.time_budget;
+        if (progressive.checkpoint_interval > 0.0f &&
+            (done || out_of_time ||
+             std::chrono::duration<float>(now - last_checkpoint_time).count() >= progressive.checkpoint_interval)) {
+            rt.save_checkpoint(progressive.checkpoint_path, sample_begin);
+            last_checkpoint_time = clock::now();
+        }
+        if (out_of_time) {
+            printf("Time budget of %.1f sec reached at %d spp.\n", progressive.time_budget, sample_begin);
+            break;
+        }
+        if (!done && options.on_pass) {
+            options.on_pass(rt, sample_begin);
+        }
+    }
+
+    if (rt.has_statistics()) {
+        rt.resolve_statistics();
+    }
+    return sample_begin;
+}
+
+WavefrontTask::WavefrontTask() = default;
+
+WavefrontTask::~WavefrontTask() = default;
+
+RenderTarget WavefrontTask::create_render_target() const
+{
+    RenderTarget rt(width, height, color3::Zero(), tile_size);
+    for (AOV aov : aovs) {
+        rt.enable_aov(aov, half_aovs && (aov == AOV::Albedo || aov == AOV::Normal || aov == AOV::Depth));
+    }
+    return rt;
+}
+
+int WavefrontTask::render(RenderTarget &rt) const
+{
+    return render_wavefront(*scene, *camera, light_ptrs, options, rt, light_sampler.get(), camera_motion.get());
+}
+
+std::unique_ptr<WavefrontTask> load_wavefront_task(const ConfigArgs &args, const fs::path &task_dir)
+{
+    std::unique_ptr<WavefrontTask> task = std::make_unique<WavefrontTask>();
+    task->device = std::make_unique<EmbreeDevice>();
+    const EmbreeDevice &device = *task->device;
+    EmbreeBuildOptions build_options;
+    if (args.contains("bvh")) {
+        build_options = load_embree_build_options(args["bvh"]);
+    }
+    Scene scene;
+    std::string scene_type = args.load_string("scene_type", "compound");
+    if (scene_type == "compound") {
+        const CompoundMeshAsset *compound = args.asset_table().get<CompoundMeshAsset>(args.load_string("scene"));
+        scene = create_scene_from_compound_mesh_asset(*compound, device, build_options);
+    } else if (scene_type == "out_of_core") {
+        scene = create_out_of_core_scene(args["scene"], device, build_options);
+    } else {
+        const MeshAsset *mesh_asset = args.asset_table().get<MeshAsset>(args.load_string("scene"));
+        scene = create_scene_from_mesh_asset(*mesh_asset, device, build_options);
+    }
+    if (args.contains("material_list")) {
+        assign_material_list(scene, args["material_list"]);
+    }
+
+    std::unique_ptr<Camera> camera = create_camera(args["camera"]);
+    std::unique_ptr<CameraMotion> camera_motion;
+    if (args.contains("motion_blur")) {
+        // Keyframed transforms are sampled at time_steps times over the shutter interval and interpolated per ray.
+        ConfigArgs motion_args = args["motion_blur"];
+        float shutter_open = motion_args.load_float("shutter_open", 0.0f);
+        float shutter_close = motion_args.load_float("shutter_close", 1.0f);
+        int time_steps = motion_args.load_integer("time_steps", 2);
+        camera_motion = create_camera_motion(args["camera"], shutter_open, shutter_close, time_steps);
+        if (motion_args.contains("instances")) {
+            std::vector<float> times(time_steps);
+            for (int t = 0; t < time_steps; ++t) {
+                float u = time_steps == 1 ? 0.0f : (float)t / (float)(time_steps - 1);
+                times[t] = std::lerp(shutter_open, shutter_close, u);
+            }
+            int n_instances = motion_args["instances"].array_size();
+            for (int i = 0; i < n_instances; ++i) {
+                ConfigArgs inst_args = motion_args["instances"][i];
+                scene.set_instance_motion(inst_args.load_integer("instance"),
+                                          inst_args.load_transform_n("to_world", times));
+            }
+            scene.commit_updates();
+        }
+    }
+
+    std::vector<std::unique_ptr<Light>> lights;
+    std::vector<const Light *> light_ptrs;
+    int n_lights = args["lights"].array_size();
+    for (int i = 0; i < n_lights; ++i) {
+        lights.push_back(create_light(args["lights"][i]));
+        light_ptrs.push_back(lights.back().get());
+        // Visibility-weighted sky sampling traces the scene.
+        if (SkyLight *sky = dynamic_cast<SkyLight *>(lights.back().get()))
+            sky->build_visibility(scene);
+    }
+    if (args.load_bool("mesh_lights", true)) {
+        for (std::unique_ptr<MeshLight> &light : create_mesh_lights(scene, device)) {
+            light_ptrs.push_back(light.get());
+            lights.push_back(std::move(light));
+        }
+    }
+
+    std::unique_ptr<LightSampler> light_sampler;
+    if (args.contains("light_sampler")) {
+        light_sampler = create_light_sampler(args["light_sampler"], light_ptrs, scene.bound());
+    }
+
+    WavefrontOptions options;
+    if (args.contains("tiles")) {
+        options.tile_options = load_tile_scheduler_options(args["tiles"]);
+    }
+    options.adaptive = args.contains("adaptive");
+    if (options.adaptive) {
+        options.adaptive_options = load_adaptive_sampling_options(args["adaptive"]);
+        options.spp = options.adaptive_options.max_spp;
+    } else {
+        options.spp = args.load_integer("spp");
+    }
+    options.termination = load_path_termination_options(args);
+    options.wave_size = args.load_integer("wave_size", options.wave_size);
+    options.stream_size = args.load_integer("stream_size", options.stream_size);
+    options.seed = (uint32_t)args.load_integer("seed", 0);
+    options.sampler = load_sampler_type(args, "sampler", options.sampler);
+    options.sort_by_material = args.load_bool("sort_by_material", options.sort_by_material);
+    options.sort_by_prototype = args.load_bool("sort_by_prototype", (bool)scene.residency);
+    options.batch_subsurface = args.load_bool("batch_subsurface", options.batch_subsurface);
+    options.batch_bsdf_eval = args.load_bool("batch_bsdf_eval", options.batch_bsdf_eval);
+    options.progressive = args.contains("progressive");
+    if (options.progressive) {
+        options.progressive_options = load_progressive_options(args["progressive"], task_dir);
+    }
+    options.guiding = args.contains("guiding");
+    if (options.guiding) {
+        options.guiding_options = load_path_guide_options(args["guiding"]);
+    }
+    options.radiance_caching = args.contains("radiance_cache");
+    if (options.radiance_caching) {
+        options.radiance_cache_options = load_radiance_cache_options(args["radiance_cache"]);
+    }
+    options.distributed = args.contains("distributed");
+    if (options.distributed) {
+        options.distributed_options = load_distributed_options(args["distributed"], task_dir);
+    }
+
+    task->width = args.load_integer("width");
+    task->height = args.load_integer("height");
+    task->tile_size = args.load_integer("target_tile_size", task->tile_size);
+    task->half_aovs = args.load_bool("half_aovs", task->half_aovs);
+    ASSERT(task->tile_size >= 0, "Invalid target tile size.");
+    task->scene = std::make_unique<Scene>(std::move(scene));
+    task->camera = std::move(camera);
+    task->camera_motion = std::move(camera_motion);
+    task->lights = std::move(lights);
+    task->light_ptrs = std::move(light_ptrs);
+    task->light_sampler = std::move(light_sampler);
+    task->options = options;
+    if (args.contains("aovs")) {
+        ConfigArgs aov_args = args["aovs"];
+        for (int i = 0; i < (int)aov_args.array_size(); ++i)
+            task->aovs.push_back(aov_from_name(aov_args.load_string(i)));
+    }
+    if (args.contains("heatmaps")) {
+        // Also written as AOV layers.
+        ConfigArgs heatmap_args = args["heatmaps"];
+        for (int i = 0; i < (int)heatmap_args.array_size(); ++i) {
+            AOV aov = aov_from_name(heatmap_args.load_string(i));
+            task->heatmaps.push_back(aov);
+            if (std::find(task->aovs.begin(), task->aovs.end(), aov) == task->aovs.end())
+                task->aovs.push_back(aov);
+        }
+        if (args.contains("heatmap")) {
+            task->heatmap_options = load_heatmap_options(args["heatmap"]);
+        }
+    }
+    if (args.contains("exr")) {
+        task->exr_options = load_exr_options(args["exr"]);
+    }
+    if (args.contains("denoise")) {
+        task->denoise = load_denoise_options(args["denoise"]);
+        // The guides of the denoiser.
+        for (AOV aov : {AOV::Albedo, AOV::Normal}) {
+            if (std::find(task->aovs.begin(), task->aovs.end(), aov) == task->aovs.end())
+                task->aovs.push_back(aov);
+        }
+    }
+    if (args.load_bool("detect_nonfinite", false)) {
+        task->nonfinite_log = std::make_unique<NonFiniteLog>();
+        task->options.nonfinite_log = task->nonfinite_log.get();
+    }
+    return task;
+}
+
+void render_wavefront_task(const ConfigArgs &args, const fs::path &task_dir, int task_id)
+{
+    std::unique_ptr<WavefrontTask> task = load_wavefront_task(args, task_dir);
+    RenderTarget rt = task->create_render_target();
+    std::unique_ptr<Denoiser> denoiser;
+    if (task->denoise) {
+        denoiser = std::make_unique<Denoiser>(*task->denoise);
+    }
+    if (denoiser && task->denoise->preview && task->options.progressive) {
+        task->options.on_pass = [&](const RenderTarget &pass_rt, int samples_taken) {
+            RenderTarget preview(pass_rt.width, pass_rt.height, color3::Zero());
+            preview.pixels = denoiser->denoise(pass_rt);
+            preview.save_layers_to_exr_async(task_dir / "preview.exr", task->exr_options);
+        };
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int samples_taken = task->render(rt);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> duration = end - start;
+    printf("Wavefront rendering took %.3f sec.\n", duration.count());
+    ThreadLocalArena::Stats arena_stats = scratch_arena().stats();
+    printf("Scratch arena: peak %zu bytes, %zu blocks over %zu threads.\n", arena_stats.peak_bytes,
+           arena_stats.num_blocks, arena_stats.num_threads);
+    std::vector<NumaNodeStats> numa_stats = numa_node_stats();
+    for (int node = 0; node < (int)numa_stats.size(); ++node) {
+        printf("NUMA node %d: %d threads, %llu items, %.1f%% utilization.\n", node, numa_stats[node].concurrency,
+               (unsigned long long)numa_stats[node].items, 100.0f * numa_stats[node].utilization());
+    }
+    TextureTileCache::Stats cache_stats = texture_tile_cache().stats();
+    if (cache_stats.hits + cache_stats.misses > 0) {
+        printf("Texture tile cache: %llu hits, %llu misses, %llu evictions, %zu / %zu bytes resident.\n",
+               (unsigned long long)cache_stats.hits, (unsigned long long)cache_stats.misses,
+               (unsigned long long)cache_stats.evictions, cache_stats.resident_bytes, cache_stats.budget_bytes);
+    }
+
+    if (task->nonfinite_log && task->nonfinite_log->count > 0) {
+        printf("%llu non-finite samples dropped (see nonfinite.txt).\n",
+               (unsigned long long)task->nonfinite_log->count.load());
+        task->nonfinite_log->write(task_dir / "nonfinite.txt", rt);
+    }
+    if (task->options.distributed) {
+        // Sample counts are needed to merge the partial renders (see merge_render_task).
+        rt.save_checkpoint(task->options.distributed_options.partial_path, samples_taken);
+    }
+    // Written in the background, so that the next task can start right away.
+    rt.save_layers_to_exr_async(task_dir / "render.exr", task->exr_options);
+    for (AOV aov : task->heatmaps) {
+        rt.save_heatmap(aov, task_dir / string_format("heatmap_%s.png", aov_name(aov)), task->heatmap_options);
+    }
+    if (denoiser) {
+        auto denoise_start = std::chrono::steady_clock::now();
+        RenderTarget denoised(rt.width, rt.height, color3::Zero());
+        denoised.pixels = denoiser->denoise(rt);
+        std::chrono::duration<double> denoise_duration = std::chrono::steady_clock::now() - denoise_start;
+        printf("Denoising took %.3f sec.\n", denoise_duration.count());
+        denoised.save_layers_to_exr_async(task_dir / "denoised.exr", task->exr_options);
+    }
+}
+
+} // namespace ks
\ No newline at end of file
@@ -0,0 +1,132 @@
+#pragma once
+#include "adaptive_sampling.h"
+#include "config.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "maths.h"
+#include "path_guide.h"
+#include "radiance_cache.h"
+#include "path_termination.h"
+#include "render_target.h"
+#include "sampler.h"
+#include "tile_scheduler.h"
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+namespace fs = std::filesystem;
+
+namespace ks
+{
+
+struct EmbreeDevice;
+struct Scene;
+struct Camera;
+struct CameraMotion;
+struct Light;
+struct LightSampler;
+
+struct WavefrontOptions
+{
+    int spp = 1;
+    // Bounce budgets and russian roulette.
+    PathTerminationOptions termination;
+    // Number of paths in flight per wave.
+    int wave_size = 1 << 18;
+    // Number of rays per stream query.
+    int stream_size = 256;
+    // Sort hits by (material, subscene, geometry) before shading.
+    bool sort_by_material = true;
+    // Keep the bounce rays in that order, so that each stream leaves a single prototype and mostly enters the same
+    // ones (fewer out-of-core loads per wave, see ResidencyManager).
+    bool sort_by_prototype = false;
+    // Defer the BSSRDF random walks of each shading stream and advance them together, tracing the rays of each step
+    // as streams. Same results as walking them one by one.
+    bool batch_subsurface = true;
+    // Defer the NEE BSDF evaluations of each shading stream and run them as one SoA batch (GGX principled BSDFs, see
+    // BSDFEvalBatch). Same results up to floating point rounding.
+    bool batch_bsdf_eval = true;
+    uint32_t seed = 0;
+    SamplerType sampler = SamplerType::PMJ02;
+    // Tiles of adaptive sampling and distributed rendering, and the order in which pixels enter the waves.
+    TileSchedulerOptions tile_options;
+    // If set, spp is ignored and pixels are sampled until converged (rt.pixels gets the per-pixel mean).
+    bool adaptive = false;
+    AdaptiveSamplingOptions adaptive_options;
+    // Render in passes that can be interrupted by a time budget, checkpointed and resumed.
+    bool progressive = false;
+    ProgressiveOptions progressive_options;
+    // Learn a path guide during the first passes (see PathGuideOptions::training_spp) and mix it into BSDF sampling.
+    bool guiding = false;
+    PathGuideOptions guiding_options;
+    // Terminate indirect paths into a radiance cache learned from the previous passes (see RadianceCache) once their
+    // footprint is wider than its cells. Biased, but most of an indirect-heavy interior is then a single bounce.
+    bool radiance_caching = false;
+    RadianceCacheOptions radiance_cache_options;
+    // Only render this worker's share of tiles or sample indices.
+    bool distributed = false;
+    DistributedOptions distributed_options;
+    // Polled before each wave. Once set, the render returns without finishing the current pass (e.g. the interactive
+    // viewport restarting after a camera move).
+    const std::atomic<bool> *cancel = nullptr;
+    // If set, samples with a NaN/Inf contribution are recorded there and dropped instead of asserting. Meant for
+    // builds without hot-path assertions (KS_ASSERT_LEVEL 0), where the checks further down the path are gone.
+    NonFiniteLog *nonfinite_log = nullptr;
+    // Called after every progressive pass but the last, e.g. for denoised previews. rt.stats hold the means so far.
+    std::function<void(const RenderTarget &rt, int samples_taken)> on_pass;
+};
+
+// Path tracer that advances a wave of paths one bounce at a time: camera, bounce and shadow rays are collected into
+// streams and traced with Scene::intersect_stream / Scene::occlude_stream.
+// Stages per bounce: generate (first bounce only), intersect, sort, shade, shadow.
+// Returns the end of the last rendered sample index range.
+// If camera_motion is given, each path samples a shutter time and camera is ignored (motion blur).
+int render_wavefront(const Scene &scene, const Camera &camera, std::span<const Light *const> lights,
+                     const WavefrontOptions &options, RenderTarget &rt, const LightSampler *light_sampler = nullptr,
+                     const CameraMotion *camera_motion = nullptr);
+
+// Everything render_wavefront_task loads from its config, so that other tasks (e.g. benchmarks) can render the same
+// scene repeatedly.
+struct WavefrontTask
+{
+    WavefrontTask();
+    ~WavefrontTask();
+
+    // Sized and laid out by the task, with the AOVs enabled.
+    RenderTarget create_render_target() const;
+    int render(RenderTarget &rt) const;
+
+    // NOTE: declared first so that it is released last.
+    std::unique_ptr<EmbreeDevice> device;
+    std::unique_ptr<Scene> scene;
+    std::unique_ptr<Camera> camera;
+    std::unique_ptr<CameraMotion> camera_motion;
+    std::vector<std::unique_ptr<Light>> lights;
+    std::vector<const Light *> light_ptrs;
+    std::unique_ptr<LightSampler> light_sampler;
+    // Set with detect_nonfinite = true (see WavefrontOptions::nonfinite_log).
+    std::unique_ptr<NonFiniteLog> nonfinite_log;
+    WavefrontOptions options;
+    int width = 0;
+    int height = 0;
+    // See RenderTarget: tiles keep the writes of a wave local at high resolutions (e.g. 32), 0 is row-major.
+    int tile_size = 0;
+    // Store the first-hit AOVs (albedo, normal, depth) in half precision.
+    bool half_aovs = false;
+    std::vector<AOV> aovs;
+    // Written as heatmap_<aov>.png, e.g. the render cost AOVs to find what eats the frame budget.
+    std::vector<AOV> heatmaps;
+    HeatmapOptions heatmap_options;
+    ExrOptions exr_options;
+    // Writes denoised.exr next to render.exr (and preview.exr after progressive passes with preview).
+    std::optional<DenoiseOptions> denoise;
+};
+
+std::unique_ptr<WavefrontTask> load_wavefront_task(const ConfigArgs &args, const fs::path &task_dir);
+
+void render_wavefront_task(const ConfigArgs &args, const fs::path &task_dir, int task_id);
+
+} // namespace ks
\ No newline at end of file